@@ -94,7 +94,7 @@ static VOID NTAPI _PtVmxInitFeatureMSR(
 );
 
 //+++++++++++++++++++++Definitions++++++++++++++++++++++++
-ULONG g_HostStackBaseAddress; //4     // FIXME: this is ugly -- we should move it somewhere else
+ULONG_PTR g_HostStackBaseAddress; //4     // FIXME: this is ugly -- we should move it somewhere else
 extern ULONG g_uSubvertedCPUs;
 extern PMadDog_Control g_HvmControl;
 
@@ -167,9 +167,9 @@ static NTSTATUS NTAPI PtVmxInitialize (
 
 //#ifndef _X86_
     PVOID tmp = HvMmAllocateContiguousPages (1, NULL,&AllocatedPage);
-    g_HostStackBaseAddress = (ULONG) tmp;
+    g_HostStackBaseAddress = (ULONG_PTR) tmp;
 
-	DbgPrint("g_HostStackBaseAddress VA: 0x%llx\n", g_HostStackBaseAddress);
+	DbgPrint("g_HostStackBaseAddress VA: 0x%llx\n", (ULONG64) g_HostStackBaseAddress);
 	#ifdef USE_MEMORY_MEMORYHIDING_STRATEGY
 		//MmChangeRequireHidingAllocPage(AllocatedPage,FALSE);
 	#endif
@@ -291,7 +291,7 @@ static NTSTATUS NTAPI PtVmxVirtualize (
   PCPU Cpu
 )
 {//Finished
-    ULONG esp;
+    ULONG_PTR esp;
     if (!Cpu)
         return STATUS_INVALID_PARAMETER;
 
@@ -302,7 +302,7 @@ static NTSTATUS NTAPI PtVmxVirtualize (
     Print(("VmxVirtualize(): Rsp: 0x%x \n", esp));
 
 //#ifndef _X86_
-    *((PULONG) (g_HostStackBaseAddress + 0x0C00)) = (ULONG) Cpu;
+    *((PULONG_PTR) (g_HostStackBaseAddress + 0x0C00)) = (ULONG_PTR) Cpu;
 //#endif
 
 	#ifdef USE_MEMORY_MEMORYHIDING_STRATEGY
@@ -340,9 +340,9 @@ NTSTATUS NTAPI VmxEnable (
     PVOID VmxonVA
 )
 {//Finished
-    ULONG cr4;
+    ULONG_PTR cr4;
     ULONG64 vmxmsr;//ULONG32
-    ULONG flags;
+    ULONG_PTR flags;
     PHYSICAL_ADDRESS VmxonPA;
 
     // set cr4, enable vmx
@@ -378,7 +378,7 @@ NTSTATUS NTAPI VmxEnable (
 NTSTATUS NTAPI VmxDisable (
 )
 {
-    ULONG cr4;
+    ULONG_PTR cr4;
     VmxTurnOff ();
     cr4 = get_cr4 ();
     clear_in_cr4 (X86_CR4_VMXE);
@@ -416,7 +416,21 @@ static NTSTATUS VmxSetupVMCS (
 	//Step 3. Set Key Host Environment Info in the VMCB
     VmxWrite (HOST_RSP, g_HostStackBaseAddress + 0x0C00); //setup host sp at vmxLaunch(...)
     // setup host ip:CmSlipIntoMatrix
-    VmxWrite (HOST_RIP, (ULONG) VmxVmexitHandler); //setup host ip:CmSlipIntoMatrix
+    VmxWrite (HOST_RIP, (ULONG_PTR) VmxVmexitHandler); //setup host ip:CmSlipIntoMatrix
+
+#ifdef _AMD64_
+	// Step 4. The samples fill the controls the same way on x86 and amd64,
+	// so the long mode bits are added here: a 64-bit host, and a guest that
+	// resumes in IA-32e mode (EFER itself is not switched on entry/exit).
+	VmxWrite (VM_EXIT_CONTROLS, VmxRead (VM_EXIT_CONTROLS) | VM_EXIT_IA32E_MODE);
+	VmxWrite (VM_ENTRY_CONTROLS, VmxRead (VM_ENTRY_CONTROLS) | VM_ENTRY_IA32E_MODE);
+
+	// In long mode the FS and GS bases live in MSRs, not in the GDT.
+	VmxWrite (GUEST_FS_BASE, MsrRead (MSR_FS_BASE));
+	VmxWrite (GUEST_GS_BASE, MsrRead (MSR_GS_BASE));
+	VmxWrite (HOST_FS_BASE, MsrRead (MSR_FS_BASE));
+	VmxWrite (HOST_GS_BASE, MsrRead (MSR_GS_BASE));
+#endif
 
 	Print(("MadDog Framework:VmxSetupVMCS(): Exit\n"));
 
@@ -449,7 +463,7 @@ static VOID VmxGenerateTrampolineToGuest (
 )
 {
   ULONG uTrampolineSize = 0;
-  ULONG NewRsp;
+  ULONG_PTR NewRsp;
 
   if (!Cpu || !GuestRegs)
     return;
@@ -473,6 +487,17 @@ static VOID VmxGenerateTrampolineToGuest (
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RSI, GuestRegs->esi);
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RDI, GuestRegs->edi);
 
+#ifdef _AMD64_
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R8, GuestRegs->r8);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R9, GuestRegs->r9);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R10, GuestRegs->r10);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R11, GuestRegs->r11);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R12, GuestRegs->r12);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R13, GuestRegs->r13);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R14, GuestRegs->r14);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_R15, GuestRegs->r15);
+#endif
+
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_CR0, VmxRead (GUEST_CR0));
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_CR3, VmxRead (GUEST_CR3));
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_CR4, VmxRead (GUEST_CR4));
@@ -493,6 +518,12 @@ static VOID VmxGenerateTrampolineToGuest (
   // [TOS+0x4]    cs
   // [TOS+0x8]    rflags
 
+#ifdef _AMD64_
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX, VmxRead (GUEST_SS_SELECTOR));
+  CmGeneratePushReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX);
+  CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX, NewRsp);
+  CmGeneratePushReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX);
+#endif
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX, VmxRead (GUEST_RFLAGS));
   CmGeneratePushReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX);
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX, VmxRead (GUEST_CS_SELECTOR));
@@ -511,11 +542,21 @@ static VOID VmxGenerateTrampolineToGuest (
 
   CmGenerateMovReg (&Trampoline[uTrampolineSize], &uTrampolineSize, REG_RAX, GuestRegs->eax);
 
+#ifdef _AMD64_
+  CmGenerateIretq (&Trampoline[uTrampolineSize], &uTrampolineSize);
+#else
   CmGenerateIretd (&Trampoline[uTrampolineSize], &uTrampolineSize);
+#endif
 
   // restore old GDTR
   CmReloadGdtr ((PVOID) VmxRead (GUEST_GDTR_BASE), (ULONG) VmxRead (GUEST_GDTR_LIMIT));
 
+#ifdef _AMD64_
+  // The host ran on HOST_FS_BASE/HOST_GS_BASE; hand the guest its own bases back.
+  MsrWrite (MSR_GS_BASE, VmxRead (GUEST_GS_BASE));
+  MsrWrite (MSR_FS_BASE, VmxRead (GUEST_FS_BASE));
+#endif
+
   //MsrWrite (MSR_GS_BASE, VmxRead (GUEST_GS_BASE));
   //MsrWrite (MSR_FS_BASE, VmxRead (GUEST_FS_BASE));
 
@@ -560,6 +601,7 @@ static NTSTATUS NTAPI PtVmxShutdown (
 	#endif
 	
 	Print(("VmxShutdown(): Trampoline generated\n", Cpu->ProcessorNumber));
+	SimdRestoreGuest (Cpu);
 	VmxDisable ();
 	((VOID (*)()) & (HvGuestPipe->Trampoline)) ();
 
@@ -580,17 +622,27 @@ static VOID VmxHandleInterception (
 	if (!Cpu || !GuestRegs)
        	return;
   
-    Exitcode = VmxRead (VM_EXIT_REASON);
+    Exitcode = (ULONG32) VmxRead (VM_EXIT_REASON);
 
 		//DbgPrint("VmxHandleInterception(): Exitcode %x\n", Exitcode);
 
+    // exits of a nested guest belong to the guest hypervisor, unless only MadDog's own controls asked
+    // for them: those go through the traps below with vmcs02 current and act on the nested guest
+    if (PtVmxNestedHandleExit (Cpu, GuestRegs, Exitcode))
+        return;
+
     if (Exitcode == EXIT_REASON_CR_ACCESS
-        && GuestRegs->eax == MADDOG_EXIT_EAX)
+        && GuestRegs->eax == MADDOG_EXIT_EAX
+        && Cpu->Vmx.VmcsToContinuePA.QuadPart == Cpu->Vmx.OriginalVmcsPA.QuadPart)
     {
         // to uninstall
         PtVmxShutdown(Cpu, GuestRegs, FALSE);
     }
 
+    // monitor trap flag steps belong to the tracer, which also watches every exit for its start
+    if (PtVmxMtfTraceHandleExit (Cpu, GuestRegs, Exitcode))
+        return;
+
     // search for a registered trap for this interception
     Status = TrFindRegisteredTrap (Cpu, GuestRegs, Exitcode, &Trap);//<----------------------1.1 Finished!
     if (!NT_SUCCESS (Status)) 
@@ -610,6 +662,8 @@ static VOID VmxHandleInterception (
     {
         Print(("VmxHandleInterception(): HvmExecuteGeneralTrapHandler() failed with status 0x%08hX\n", Status));
     }
+
+    PtVmxMtfTraceAfterExit (Cpu, GuestRegs);
 }
 
 /**
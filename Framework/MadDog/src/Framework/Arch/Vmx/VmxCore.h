@@ -30,6 +30,7 @@
 #include "traps.h"
 #include "cpuid.h"
 #include "chicken.h"
+#include "simd.h"
 //+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
 
 #define	ARCH_VMX	2
@@ -70,7 +71,7 @@
 
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 //Implemented in vmx-asm.asm
-ULONG NTAPI get_cr4 (
+ULONG_PTR NTAPI get_cr4 (
 );
 
 VOID NTAPI set_in_cr4 (
@@ -109,6 +110,17 @@ VOID NTAPI VmxLaunch (
 VOID NTAPI VmxResume (
 );
 
+// INVEPT and INVVPID of <Type> with the 128-bit <Descriptor>, return the RFLAGS they leave
+ULONG_PTR NTAPI VmxInvept (
+  ULONG_PTR Type,
+  PVOID Descriptor
+);
+
+ULONG_PTR NTAPI VmxInvvpid (
+  ULONG_PTR Type,
+  PVOID Descriptor
+);
+
 VOID NTAPI VmxVmexitHandler (
   VOID
 );
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#include "Arch/Vmx/VTPlatform.h"
+#include "regs.h"
+#include "HvCoreAPIs.h"
+#include "Memory/MemRegs.h"
+#include "Arch/Vmx/Vmx.h"
+
+#define VMX_EMU_REGS			(sizeof (GUEST_REGS) / sizeof (ULONG_PTR) - 1)	//All but eflags
+#define CS_AR_LONG_MODE			0x2000	//bit 13, L
+#define CS_AR_DEFAULT_BIG		0x4000	//bit 14, D/B
+#define CR0_PE					0x00000001
+#define CR4_SMAP				0x00200000
+#define EFLAGS_AC				0x00040000
+#define SS_AR_DPL(Ar)			(((Ar) >> 5) & 3)
+
+//Guest paging structure entries
+#define VMX_PTE_PRESENT			0x001
+#define VMX_PTE_WRITABLE		0x002
+#define VMX_PTE_USER			0x004
+#define VMX_PTE_ACCESSED		0x020
+#define VMX_PTE_DIRTY			0x040
+#define VMX_PTE_LARGE			0x080
+#define VMX_PTE_PFN_MASK		0x000FFFFFFFFFF000ULL
+
+//#PF error code
+#define VMX_PF_PRESENT			0x1
+#define VMX_PF_WRITE			0x2
+#define VMX_PF_USER				0x4
+
+//VM_ENTRY_INTR_INFO_FIELD
+#define VMX_INTR_HW_EXCEPTION	(3 << 8)
+#define VMX_INTR_DELIVER_CODE	0x00000800
+#define VMX_INTR_VALID			0x80000000
+
+/*
+ * The guest paging state of the current VM Exit. Guest memory is reached by walking the guest's own
+ * page tables under GUEST_CR3, with the permission checks the processor would make for an access at
+ * the guest CPL, and then through the host mapping of the physical page. Execute-disable is not
+ * checked: the only fetches are of an instruction the processor has already fetched itself.
+ */
+typedef struct _VMX_GUEST_PAGING
+{
+	ULONG_PTR Cr0;
+	ULONG_PTR Cr3;
+	ULONG_PTR Cr4;
+	ULONG_PTR Rflags;
+	BOOLEAN LongMode;
+	BOOLEAN User;//CPL 3
+} VMX_GUEST_PAGING,*PVMX_GUEST_PAGING;
+
+typedef struct _VMX_EMU_CONTEXT
+{
+	VMX_GUEST_PAGING Paging;
+	PVMX_GUEST_FAULT Fault;
+	EMU_ACCESS_PORT AccessPort;
+	PVOID Context;
+} VMX_EMU_CONTEXT,*PVMX_EMU_CONTEXT;
+
+// decoded instructions of every CPU, looked up by guest RIP and CR3
+static EMU_CACHE VmxEmuCaches[MADDOG_BROADCAST_MAX_CPUS];
+
+static VOID NTAPI VmxLoadGuestPaging (
+  PVMX_GUEST_PAGING Paging
+)
+{
+	Paging->Cr0 = VmxRead (GUEST_CR0);
+	Paging->Cr3 = VmxRead (GUEST_CR3);
+	Paging->Cr4 = VmxRead (GUEST_CR4);
+	Paging->Rflags = VmxRead (GUEST_RFLAGS);
+	Paging->LongMode = (VmxRead (VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE) != 0;
+	// SS.DPL is the CPL
+	Paging->User = SS_AR_DPL (VmxRead (GUEST_SS_AR_BYTES)) == 3;
+}
+
+/**
+ * returns: The host address of the guest physical address <Address>, NULL if the host does not map it.
+ */
+static PUCHAR NTAPI VmxMapGuestPhysical (
+  ULONG64 Address
+)
+{
+	PHYSICAL_ADDRESS PhysicalAddress;
+	PUCHAR Host;
+
+	PhysicalAddress.QuadPart = Address;
+	Host = (PUCHAR) HvMmHostPhysicalToVirtual (PhysicalAddress);
+#ifndef _AMD64_
+	// x86 hosts find it in the system mappings, which may not cover every page
+	if (Host && !MmIsAddressValid (Host))
+		Host = NULL;
+#endif
+	return Host;
+}
+
+/**
+ * effects: Record exception <Vector> at <Address> in <Fault>.
+ * returns: FALSE, for the access that raised it.
+ */
+static BOOLEAN NTAPI VmxRaiseFault (
+  PVMX_GUEST_FAULT Fault,
+  ULONG32 Vector,
+  ULONG32 ErrorCode,
+  ULONG64 Address
+)
+{
+	Fault->Raised = TRUE;
+	Fault->Vector = Vector;
+	Fault->ErrorCode = ErrorCode;
+	Fault->Address = Address;
+	return FALSE;
+}
+
+static BOOLEAN NTAPI VmxRaisePageFault (
+  PVMX_GUEST_PAGING Paging,
+  ULONG64 Address,
+  BOOLEAN Write,
+  BOOLEAN Present,
+  PVMX_GUEST_FAULT Fault
+)
+{
+	return VmxRaiseFault (Fault, VMX_GUEST_VECTOR_PF,
+		(Present ? VMX_PF_PRESENT : 0) | (Write ? VMX_PF_WRITE : 0) | (Paging->User ? VMX_PF_USER : 0), Address);
+}
+
+/**
+ * effects: Translate the guest linear <Address> through the guest page tables, check that the guest
+ * may read it, or write it if <Write>, at its CPL, and set the accessed and dirty bits the processor
+ * would. 4-level, PAE and 32-bit paging are walked, with their large pages.
+ * returns: FALSE if the access faults, with the #PF or #GP in <Fault>, or if the host cannot reach
+ * a paging structure, with nothing raised.
+ */
+static BOOLEAN NTAPI VmxTranslateGuest (
+  PVMX_GUEST_PAGING Paging,
+  ULONG64 Address,
+  BOOLEAN Write,
+  PULONG64 PhysicalAddress,
+  PVMX_GUEST_FAULT Fault
+)
+{
+	volatile LONG *Entries[4];
+	ULONG64 Table, Entry, PageMask, Rights = VMX_PTE_WRITABLE | VMX_PTE_USER;
+	ULONG32 Shift, IndexBits, EntrySize, Levels = 0, i;
+	PUCHAR Host;
+
+	if (!(Paging->Cr0 & X86_CR0_PG))
+	{
+		*PhysicalAddress = Address & 0xFFFFFFFF;
+		return TRUE;
+	}
+
+	if (Paging->LongMode)
+	{
+		if ((ULONG64) ((LONG64) (Address << 16) >> 16) != Address)
+			return VmxRaiseFault (Fault, VMX_GUEST_VECTOR_GP, 0, Address);
+		Table = Paging->Cr3 & VMX_PTE_PFN_MASK;
+		Shift = 39;
+		IndexBits = 9;
+		EntrySize = 8;
+	}
+	else if (Paging->Cr4 & X86_CR4_PAE)
+	{
+		// the four PDPTEs carry no access rights
+		Host = VmxMapGuestPhysical ((Paging->Cr3 & 0xFFFFFFE0) + ((Address >> 30) & 3) * 8);
+		if (!Host)
+			return FALSE;
+		Entry = *(volatile ULONG64 *) Host;
+		if (!(Entry & VMX_PTE_PRESENT))
+			return VmxRaisePageFault (Paging, Address, Write, FALSE, Fault);
+		Table = Entry & VMX_PTE_PFN_MASK;
+		Shift = 21;
+		IndexBits = 9;
+		EntrySize = 8;
+	}
+	else
+	{
+		Table = Paging->Cr3 & 0xFFFFF000;
+		Shift = 22;
+		IndexBits = 10;
+		EntrySize = 4;
+	}
+
+	for (;;)
+	{
+		Host = VmxMapGuestPhysical (Table + ((Address >> Shift) & ((1 << IndexBits) - 1)) * EntrySize);
+		if (!Host)
+			return FALSE;
+		Entry = EntrySize == 8 ? *(volatile ULONG64 *) Host : *(volatile ULONG32 *) Host;
+		if (!(Entry & VMX_PTE_PRESENT))
+			return VmxRaisePageFault (Paging, Address, Write, FALSE, Fault);
+		Rights &= Entry;
+		Entries[Levels++] = (volatile LONG *) Host;
+
+		PageMask = ((ULONG64) 1 << Shift) - 1;
+		if (Shift == 12)
+		{
+			*PhysicalAddress = (Entry & VMX_PTE_PFN_MASK) | (Address & PageMask);
+			break;
+		}
+		// 1GB and 2MB pages, and the 4MB pages of 32-bit paging with CR4.PSE
+		if ((Entry & VMX_PTE_LARGE) && (EntrySize == 8 ? Shift <= 30 : (Paging->Cr4 & X86_CR4_PSE) != 0))
+		{
+			if (EntrySize == 8)
+				*PhysicalAddress = (Entry & VMX_PTE_PFN_MASK & ~PageMask) | (Address & PageMask);
+			else
+				// PSE-36: bits 20:13 of the entry are bits 39:32 of the address
+				*PhysicalAddress = (Entry & 0xFFC00000) | (((Entry >> 13) & 0xFF) << 32) | (Address & PageMask);
+			break;
+		}
+		Table = Entry & (EntrySize == 8 ? VMX_PTE_PFN_MASK : 0xFFFFF000);
+		Shift -= IndexBits;
+	}
+
+	if (Paging->User && !(Rights & VMX_PTE_USER))
+		return VmxRaisePageFault (Paging, Address, Write, TRUE, Fault);
+	if (Write && !(Rights & VMX_PTE_WRITABLE) && (Paging->User || (Paging->Cr0 & X86_CR0_WP)))
+		return VmxRaisePageFault (Paging, Address, Write, TRUE, Fault);
+	if (!Paging->User && (Rights & VMX_PTE_USER) && (Paging->Cr4 & CR4_SMAP) && !(Paging->Rflags & EFLAGS_AC))
+		return VmxRaisePageFault (Paging, Address, Write, TRUE, Fault);
+
+	// the flags are in the low dword of every entry format
+	for (i = 0; i < Levels; i++)
+	{
+		if (!(*Entries[i] & VMX_PTE_ACCESSED))
+			InterlockedOr (Entries[i], VMX_PTE_ACCESSED);
+	}
+	if (Write && !(*Entries[Levels - 1] & VMX_PTE_DIRTY))
+		InterlockedOr (Entries[Levels - 1], VMX_PTE_DIRTY);
+	return TRUE;
+}
+
+/**
+ * effects: Copy guest memory a page at a time, through the host mapping of the physical page the
+ * guest page tables give. A range over more than one page is checked whole first, so a fault leaves
+ * the guest memory untouched.
+ * returns: FALSE if the access faults, with the fault in <Fault>, or if the host cannot reach a page.
+ */
+static BOOLEAN NTAPI VmxCopyGuestMemory (
+  PVMX_GUEST_PAGING Paging,
+  ULONG64 Address,
+  PVOID Buffer,
+  ULONG32 Size,
+  BOOLEAN Write,
+  PVMX_GUEST_FAULT Fault
+)
+{
+	ULONG64 Guest, PhysicalAddress;
+	PUCHAR Data = (PUCHAR) Buffer, Host;
+	ULONG32 Chunk, Left;
+
+	Fault->Raised = FALSE;
+	if (BYTE_OFFSET (Address) + Size > PAGE_SIZE)
+	{
+		for (Guest = Address, Left = Size; Left; Guest += Chunk, Left -= Chunk)
+		{
+			Chunk = PAGE_SIZE - BYTE_OFFSET (Guest);
+			if (Chunk > Left)
+				Chunk = Left;
+			if (!VmxTranslateGuest (Paging, Guest, Write, &PhysicalAddress, Fault))
+				return FALSE;
+		}
+	}
+
+	for (Guest = Address; Size; Guest += Chunk, Data += Chunk, Size -= Chunk)
+	{
+		Chunk = PAGE_SIZE - BYTE_OFFSET (Guest);
+		if (Chunk > Size)
+			Chunk = Size;
+
+		if (!VmxTranslateGuest (Paging, Guest, Write, &PhysicalAddress, Fault))
+			return FALSE;
+		Host = VmxMapGuestPhysical (PhysicalAddress);
+		if (!Host)
+			return FALSE;
+
+		if (Write)
+			RtlCopyMemory (Host, Data, Chunk);
+		else
+			RtlCopyMemory (Data, Host, Chunk);
+	}
+	return TRUE;
+}
+
+static BOOLEAN NTAPI VmxEmuAccessMemory (
+  PVOID Context,
+  ULONG64 Address,
+  PVOID Buffer,
+  ULONG32 Size,
+  BOOLEAN Write
+)
+{
+	PVMX_EMU_CONTEXT EmuContext = (PVMX_EMU_CONTEXT) Context;
+
+	return VmxCopyGuestMemory (&EmuContext->Paging, Address, Buffer, Size, Write, EmuContext->Fault);
+}
+
+/**
+ * effects: Compare-exchange guest memory with an interlocked operation on the host mapping. Bytes and
+ * words go through the aligned quadword around them.
+ * returns: FALSE if the access faults, or if the operand is split over two pages or two quadwords
+ * and has no single location to lock.
+ */
+static BOOLEAN NTAPI VmxEmuCompareExchange (
+  PVOID Context,
+  ULONG64 Address,
+  ULONG64 Comparand,
+  ULONG64 Exchange,
+  ULONG32 Size,
+  PULONG64 Original
+)
+{
+	PVMX_EMU_CONTEXT EmuContext = (PVMX_EMU_CONTEXT) Context;
+	volatile LONG64 *Quad;
+	ULONG64 PhysicalAddress, Old, New, Mask;
+	ULONG32 Shift;
+	PUCHAR Host;
+
+	EmuContext->Fault->Raised = FALSE;
+	if (BYTE_OFFSET (Address) + Size > PAGE_SIZE)
+		return FALSE;
+	if (!VmxTranslateGuest (&EmuContext->Paging, Address, TRUE, &PhysicalAddress, EmuContext->Fault))
+		return FALSE;
+	Host = VmxMapGuestPhysical (PhysicalAddress);
+	if (!Host)
+		return FALSE;
+
+	switch (Size)
+	{
+	case 4:
+		*Original = (ULONG32) InterlockedCompareExchange ((volatile LONG *) Host, (LONG) Exchange, (LONG) Comparand);
+		return TRUE;
+	case 8:
+		*Original = (ULONG64) InterlockedCompareExchange64 ((volatile LONG64 *) Host, (LONG64) Exchange, (LONG64) Comparand);
+		return TRUE;
+	}
+
+	Shift = (ULONG32) ((ULONG_PTR) Host & 7) * 8;
+	if (Shift + Size * 8 > 64)
+		return FALSE;
+	Quad = (volatile LONG64 *) ((ULONG_PTR) Host & ~(ULONG_PTR) 7);
+	Mask = (((ULONG64) 1 << (Size * 8)) - 1) << Shift;
+	for (;;)
+	{
+		Old = (ULONG64) *Quad;
+		*Original = (Old & Mask) >> Shift;
+		if (*Original != Comparand)
+			return TRUE;
+		New = (Old & ~Mask) | (Exchange << Shift);
+		if ((ULONG64) InterlockedCompareExchange64 (Quad, (LONG64) New, (LONG64) Old) == Old)
+			return TRUE;
+	}
+}
+
+static BOOLEAN NTAPI VmxEmuAccessPort (
+  PVOID Context,
+  USHORT Port,
+  PULONG32 Value,
+  ULONG32 Size,
+  BOOLEAN Out
+)
+{
+	PVMX_EMU_CONTEXT EmuContext = (PVMX_EMU_CONTEXT) Context;
+
+	if (EmuContext->AccessPort)
+		return EmuContext->AccessPort (EmuContext->Context, Port, Value, Size, Out);
+
+	switch (Size)
+	{
+	case 1:
+		if (Out)
+			WRITE_PORT_UCHAR ((PUCHAR) Port, (UCHAR) *Value);
+		else
+			*Value = READ_PORT_UCHAR ((PUCHAR) Port);
+		break;
+	case 2:
+		if (Out)
+			WRITE_PORT_USHORT ((PUSHORT) Port, (USHORT) *Value);
+		else
+			*Value = READ_PORT_USHORT ((PUSHORT) Port);
+		break;
+	default:
+		if (Out)
+			WRITE_PORT_ULONG ((PULONG) Port, *Value);
+		else
+			*Value = READ_PORT_ULONG ((PULONG) Port);
+		break;
+	}
+	return TRUE;
+}
+
+HVSTATUS NTAPI PtVmxEmulateInstruction (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	EMU_ACCESS_PORT AccessPort,
+	PVOID Context,
+	PVMX_GUEST_FAULT Fault
+)
+{
+	VMX_EMU_CONTEXT EmuContext;
+	VMX_GUEST_FAULT NoFault;
+	EMU_STATE State;
+	ULONG32 CsAccessRights, Status, i;
+
+	if (!Cpu || !GuestRegs)
+		return HVSTATUS_INVALID_PARAMETERS;
+
+	VmxLoadGuestPaging (&EmuContext.Paging);
+	EmuContext.Fault = Fault ? Fault : &NoFault;
+	EmuContext.Fault->Raised = FALSE;
+	EmuContext.AccessPort = AccessPort;
+	EmuContext.Context = Context;
+
+	RtlZeroMemory (&State, sizeof (State));
+	// GUEST_REGS is in register number order; HvmEventCallback() put the guest RSP in the esp slot
+	for (i = 0; i < VMX_EMU_REGS; i++)
+		State.Regs[i] = ((PULONG_PTR) GuestRegs)[i];
+	State.Rip = VmxRead (GUEST_RIP);
+	State.Rflags = EmuContext.Paging.Rflags;
+	State.Cr3 = EmuContext.Paging.Cr3;
+	State.SegmentBase[EMU_ES] = VmxRead (GUEST_ES_BASE);
+	State.SegmentBase[EMU_CS] = VmxRead (GUEST_CS_BASE);
+	State.SegmentBase[EMU_SS] = VmxRead (GUEST_SS_BASE);
+	State.SegmentBase[EMU_DS] = VmxRead (GUEST_DS_BASE);
+	State.SegmentBase[EMU_FS] = VmxRead (GUEST_FS_BASE);
+	State.SegmentBase[EMU_GS] = VmxRead (GUEST_GS_BASE);
+
+	CsAccessRights = (ULONG32) VmxRead (GUEST_CS_AR_BYTES);
+	if (CsAccessRights & CS_AR_LONG_MODE)
+		State.Mode = EMU_MODE_64;
+	else if ((CsAccessRights & CS_AR_DEFAULT_BIG) && (VmxRead (GUEST_CR0) & CR0_PE))
+		State.Mode = EMU_MODE_32;
+	else
+		State.Mode = EMU_MODE_16;
+
+	State.MaxRepeat = VMX_EMU_MAX_REPEAT;
+	State.AccessMemory = VmxEmuAccessMemory;
+	State.AccessPort = VmxEmuAccessPort;
+	State.CompareExchange = VmxEmuCompareExchange;
+	State.Context = &EmuContext;
+
+	Status = EmuStep (&State, Cpu->ProcessorNumber < MADDOG_BROADCAST_MAX_CPUS ?
+		&VmxEmuCaches[Cpu->ProcessorNumber] : NULL);
+	if (Status == EMU_UNSUPPORTED)
+		return HVSTATUS_UNSUPPORTED_FEATURE;
+
+	if (Status != EMU_OK)
+	{
+		// RIP stays on the instruction; a REP that stopped part way keeps the elements it moved
+		((PULONG_PTR) GuestRegs)[EMU_RCX] = (ULONG_PTR) State.Regs[EMU_RCX];
+		((PULONG_PTR) GuestRegs)[EMU_RSI] = (ULONG_PTR) State.Regs[EMU_RSI];
+		((PULONG_PTR) GuestRegs)[EMU_RDI] = (ULONG_PTR) State.Regs[EMU_RDI];
+		return Status == EMU_REPEAT ? HVSTATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+	}
+
+	for (i = 0; i < VMX_EMU_REGS; i++)
+		((PULONG_PTR) GuestRegs)[i] = (ULONG_PTR) State.Regs[i];
+	VmxWrite (GUEST_RIP, (ULONG_PTR) State.Rip);
+	VmxWrite (GUEST_RFLAGS, (ULONG_PTR) State.Rflags);
+	return HVSTATUS_SUCCESS;
+}
+
+BOOLEAN NTAPI PtVmxAccessGuestMemory (
+  ULONG64 Address,
+  PVOID Buffer,
+  ULONG32 Size,
+  BOOLEAN Write,
+  PVMX_GUEST_FAULT Fault
+)
+{
+	VMX_GUEST_PAGING Paging;
+	VMX_GUEST_FAULT NoFault;
+
+	if (!Buffer)
+		return FALSE;
+	VmxLoadGuestPaging (&Paging);
+	return VmxCopyGuestMemory (&Paging, Address, Buffer, Size, Write, Fault ? Fault : &NoFault);
+}
+
+VOID NTAPI PtVmxInjectGuestFault (
+  PVMX_GUEST_FAULT Fault
+)
+{
+	if (!Fault || !Fault->Raised)
+		return;
+
+	// CR2 is not switched by VM Entry, the guest gets the value the host leaves in it
+	if (Fault->Vector == VMX_GUEST_VECTOR_PF)
+		RegSetCr2 ((ULONG_PTR) Fault->Address);
+	VmxWrite (VM_ENTRY_EXCEPTION_ERROR_CODE, Fault->ErrorCode);
+	VmxWrite (VM_ENTRY_INTR_INFO_FIELD, Fault->Vector | VMX_INTR_HW_EXCEPTION | VMX_INTR_DELIVER_CODE | VMX_INTR_VALID);
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#include "Arch/Vmx/VTPlatform.h"
+#include "msr.h"
+#include "regs.h"
+#include "HvCoreAPIs.h"
+#include "Arch/Vmx/Vmx.h"
+
+/*
+ * Instruction tracing with the monitor trap flag. While a CPU is stepping, the MTF control makes the
+ * guest exit after every instruction, without touching the guest RFLAGS.TF, raising #DB or injecting
+ * anything back, so guest debuggers and pushf see nothing. Every step exit records the instruction the
+ * guest just executed: the RIP and bytes taken at the previous exit, and the registers that differ
+ * from the previous exit. An instruction that exits for another reason, e.g. CPUID, is completed by its
+ * handler, and the next step exit only comes after the instruction that follows it. So once the handler
+ * has run, PtVmxMtfTraceAfterExit() records the emulated instruction itself and takes the snapshot of
+ * the new RIP.
+ *
+ * The trace is started and stopped from non-root mode by publishing a new generation. Each CPU copies
+ * the configuration at its next exit and keeps its own state, so the step path takes no lock.
+ */
+#define MTF_TRACE_REGS			(sizeof (GUEST_REGS) / sizeof (ULONG_PTR))
+#define MTF_TRACE_MAX_RECORD	(sizeof (MTF_TRACE_RECORD) + 16 + MTF_TRACE_REGS * sizeof (ULONG_PTR))
+#define MTF_TRACE_ALIGN(x)		(((x) + sizeof (ULONG_PTR) - 1) & ~(sizeof (ULONG_PTR) - 1))
+
+typedef struct _MTF_TRACE_CPU
+{
+	PUCHAR Buffer;
+	volatile ULONG32 Used;//Bytes of complete records
+	LONG Generation;//Of the configuration below
+	MTF_TRACE_CONFIG Config;
+	volatile ULONG32 State;
+	ULONG32 Steps;
+	ULONG32 Records;
+	ULONG32 Filtered;
+	ULONG32 ExitsSeen;//Of Config.StartExitReason while waiting
+	BOOLEAN HandlerPending;//A trap handler runs after PtVmxMtfTraceHandleExit() while stepping
+
+	//Taken at the previous exit, before the instruction being stepped over ran
+	ULONG_PTR PrevRip;
+	BOOLEAN PrevTraced;//The instruction at PrevRip passes the filter
+	UCHAR PrevOpcodeLength;
+	UCHAR PrevOpcode[MTF_TRACE_MAX_OPCODE];
+	ULONG_PTR PrevRegs[MTF_TRACE_REGS];
+} MTF_TRACE_CPU,*PMTF_TRACE_CPU;
+
+static volatile LONG MtfGeneration;//0 when stopped
+static LONG MtfLastGeneration;
+static MTF_TRACE_CONFIG MtfConfig;
+static MTF_TRACE_CPU MtfCpus[MADDOG_BROADCAST_MAX_CPUS];
+
+/**
+ * effects: Snapshot the guest general-purpose registers into <Regs>, in GUEST_REGS slot order.
+ * HvmEventCallback() has already put the guest RSP into the esp slot; the eflags slot of GUEST_REGS
+ * holds the host flags, so the guest RFLAGS comes from the VMCS.
+ */
+static VOID NTAPI MtfSnapshotRegs (
+  PGUEST_REGS GuestRegs,
+  PULONG_PTR Regs
+)
+{
+	RtlCopyMemory (Regs, GuestRegs, sizeof (GUEST_REGS));
+	Regs[MTF_TRACE_REGS - 1] = VmxRead (GUEST_RFLAGS);
+}
+
+static BOOLEAN NTAPI MtfPassesFilter (
+  PMTF_TRACE_CONFIG Config,
+  ULONG_PTR Rip,
+  ULONG_PTR Cr3
+)
+{
+	if (Config->Cr3 && Config->Cr3 != Cr3)
+		return FALSE;
+	if ((Config->RipStart || Config->RipEnd) && (Rip < Config->RipStart || Rip >= Config->RipEnd))
+		return FALSE;
+	return TRUE;
+}
+
+/**
+ * effects: Copy up to MTF_TRACE_MAX_OPCODE bytes of the instruction at <Rip>. The host only sees the
+ * guest user space when it runs on the same CR3, and a fault in root mode is fatal, so the bytes are
+ * copied only when they are mapped; otherwise fewer or none are recorded.
+ */
+static VOID NTAPI MtfReadOpcode (
+  PMTF_TRACE_CPU Trace,
+  ULONG_PTR Rip,
+  ULONG_PTR Cr3
+)
+{
+	ULONG32 Length;
+
+	Trace->PrevOpcodeLength = 0;
+
+	if (Rip < (ULONG_PTR) MmSystemRangeStart && Cr3 != RegGetCr3 ())
+		return;
+	if (!MmIsAddressValid ((PVOID) Rip))
+		return;
+
+	Length = MTF_TRACE_MAX_OPCODE;
+	if (BYTE_OFFSET (Rip) + Length > PAGE_SIZE && !MmIsAddressValid ((PVOID) (Rip + Length - 1)))
+		Length = PAGE_SIZE - BYTE_OFFSET (Rip);
+
+	RtlCopyMemory (Trace->PrevOpcode, (PVOID) Rip, Length);
+	Trace->PrevOpcodeLength = (UCHAR) Length;
+}
+
+/**
+ * effects: Remember where the guest is before it runs its next instruction.
+ */
+static VOID NTAPI MtfTakePrevious (
+  PMTF_TRACE_CPU Trace,
+  PULONG_PTR Regs
+)
+{
+	ULONG_PTR Cr3;
+
+	Cr3 = VmxRead (GUEST_CR3);
+	Trace->PrevRip = VmxRead (GUEST_RIP);
+	Trace->PrevTraced = MtfPassesFilter (&Trace->Config, Trace->PrevRip, Cr3);
+	Trace->PrevOpcodeLength = 0;
+	if (Trace->PrevTraced && (Trace->Config.Flags & MTF_TRACE_OPCODES))
+		MtfReadOpcode (Trace, Trace->PrevRip, Cr3);
+
+	RtlCopyMemory (Trace->PrevRegs, Regs, sizeof (Trace->PrevRegs));
+}
+
+static VOID NTAPI MtfSetControl (
+  BOOLEAN Step
+)
+{
+	ULONG32 Controls;
+
+	Controls = (ULONG32) VmxRead (CPU_BASED_VM_EXEC_CONTROL);
+	if (Step)
+		Controls |= CPU_BASED_MONITOR_TRAP_FLAG;
+	else
+		Controls &= ~CPU_BASED_MONITOR_TRAP_FLAG;
+	VmxWrite (CPU_BASED_VM_EXEC_CONTROL, Controls);
+}
+
+static VOID NTAPI MtfFinish (
+  PMTF_TRACE_CPU Trace
+)
+{
+	MtfSetControl (FALSE);
+	Trace->State = MTF_TRACE_DONE;
+}
+
+/**
+ * effects: Pick up the generation <Generation> published by PtVmxMtfTraceStart() or
+ * PtVmxMtfTraceStop(). The configuration is copied like a seqlock: if a new start overwrote it
+ * meanwhile, the copy is dropped and taken again at the next exit.
+ */
+static VOID NTAPI MtfSync (
+  PMTF_TRACE_CPU Trace,
+  LONG Generation
+)
+{
+	LARGE_INTEGER MsrValue;
+
+	if (Trace->State == MTF_TRACE_STEPPING)
+		MtfFinish (Trace);
+
+	if (!Generation)
+	{
+		Trace->Generation = 0;
+		if (Trace->State == MTF_TRACE_WAITING)
+			Trace->State = MTF_TRACE_DONE;
+		return;
+	}
+
+	Trace->State = MTF_TRACE_IDLE;
+	RtlCopyMemory (&Trace->Config, &MtfConfig, sizeof (MTF_TRACE_CONFIG));
+	KeMemoryBarrier ();
+	if (MtfGeneration != Generation)
+		return;
+
+	Trace->Generation = Generation;
+	Trace->Steps = 0;
+	Trace->Records = 0;
+	Trace->Filtered = 0;
+	Trace->ExitsSeen = 0;
+	Trace->Used = 0;
+
+	// allowed 1-settings are in the high dword
+	MsrValue.QuadPart = MsrRead (MSR_IA32_VMX_PROCBASED_CTLS);
+	if (!(MsrValue.HighPart & CPU_BASED_MONITOR_TRAP_FLAG))
+		Trace->State = MTF_TRACE_UNSUPPORTED;
+	else
+		Trace->State = MTF_TRACE_WAITING;
+}
+
+static BOOLEAN NTAPI MtfStartConditionsHold (
+  PMTF_TRACE_CPU Trace,
+  ULONG32 Exitcode
+)
+{
+	PMTF_TRACE_CONFIG Config = &Trace->Config;
+
+	if (Config->StartExitCount)
+	{
+		if (Exitcode == Config->StartExitReason && Trace->ExitsSeen < Config->StartExitCount)
+			Trace->ExitsSeen++;
+		if (Trace->ExitsSeen < Config->StartExitCount)
+			return FALSE;
+	}
+
+	return MtfPassesFilter (Config, VmxRead (GUEST_RIP), VmxRead (GUEST_CR3));
+}
+
+/**
+ * effects: Append the record of the instruction at Trace->PrevRip, which left the registers in <Regs>.
+ * returns: FALSE if the buffer is full.
+ */
+static BOOLEAN NTAPI MtfAppendRecord (
+  PMTF_TRACE_CPU Trace,
+  PULONG_PTR Regs,
+  ULONG_PTR Rip
+)
+{
+	PMTF_TRACE_RECORD Record;
+	PULONG_PTR Deltas;
+	ULONG_PTR Advance;
+	ULONG32 OpcodeLength, i;
+
+	if (Trace->Used + MTF_TRACE_MAX_RECORD > MTF_TRACE_BUFFER_PAGES * PAGE_SIZE)
+		return FALSE;
+
+	// the exit reports no instruction length: a fall-through gives it away, otherwise keep all bytes read
+	OpcodeLength = Trace->PrevOpcodeLength;
+	Advance = Rip - Trace->PrevRip;
+	if (Advance && Advance < OpcodeLength)
+		OpcodeLength = (ULONG32) Advance;
+
+	Record = (PMTF_TRACE_RECORD) (Trace->Buffer + Trace->Used);
+	Record->Rip = Trace->PrevRip;
+	Record->DeltaMask = 0;
+	Record->OpcodeLength = (UCHAR) OpcodeLength;
+	Record->Reserved = 0;
+	RtlCopyMemory (Record + 1, Trace->PrevOpcode, OpcodeLength);
+
+	Deltas = (PULONG_PTR) ((PUCHAR) (Record + 1) + MTF_TRACE_ALIGN (OpcodeLength));
+	if (Trace->Config.Flags & MTF_TRACE_DELTAS)
+	{
+		for (i = 0; i < MTF_TRACE_REGS; i++)
+		{
+			if (Regs[i] != Trace->PrevRegs[i])
+			{
+				Record->DeltaMask |= 1 << i;
+				*Deltas++ = Regs[i];
+			}
+		}
+	}
+	Record->Size = (USHORT) ((PUCHAR) Deltas - (PUCHAR) Record);
+
+	// publish only complete records to PtVmxMtfTraceCopy()
+	KeMemoryBarrier ();
+	Trace->Used += Record->Size;
+	Trace->Records++;
+	return TRUE;
+}
+
+static VOID NTAPI MtfStep (
+  PMTF_TRACE_CPU Trace,
+  PGUEST_REGS GuestRegs
+)
+{
+	ULONG_PTR Regs[MTF_TRACE_REGS];
+
+	Trace->Steps++;
+	MtfSnapshotRegs (GuestRegs, Regs);
+
+	if (Trace->PrevTraced)
+	{
+		if (!MtfAppendRecord (Trace, Regs, VmxRead (GUEST_RIP)))
+		{
+			MtfFinish (Trace);
+			return;
+		}
+	}
+	else
+		Trace->Filtered++;
+
+	if (Trace->Steps >= Trace->Config.Budget)
+	{
+		MtfFinish (Trace);
+		return;
+	}
+
+	MtfTakePrevious (Trace, Regs);
+}
+
+HVSTATUS NTAPI PtVmxMtfTraceStart (
+	PMTF_TRACE_CONFIG Config
+)
+{
+	PALLOCATED_PAGE AllocatedPage;
+	ULONG32 i;
+
+	if (!Config || !Config->Budget || Config->RipEnd < Config->RipStart)
+		return HVSTATUS_INVALID_PARAMETERS;
+	if (Config->RipStart && Config->RipEnd == Config->RipStart)
+		return HVSTATUS_INVALID_PARAMETERS;
+
+	for (i = 0; i < (ULONG32) KeNumberProcessors && i < MADDOG_BROADCAST_MAX_CPUS; i++)
+	{
+		if (MtfCpus[i].Buffer)
+			continue;
+		MtfCpus[i].Buffer = HvMmAllocatePages (MTF_TRACE_BUFFER_PAGES, NULL, LAB_TAG, &AllocatedPage);
+		if (!MtfCpus[i].Buffer)
+			return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// take the published generation away first, so no CPU copies a half-written configuration
+	InterlockedExchange (&MtfGeneration, 0);
+	RtlCopyMemory (&MtfConfig, Config, sizeof (MTF_TRACE_CONFIG));
+	if (++MtfLastGeneration == 0)
+		MtfLastGeneration = 1;
+	InterlockedExchange (&MtfGeneration, MtfLastGeneration);
+
+	return HVSTATUS_SUCCESS;
+}
+
+VOID NTAPI PtVmxMtfTraceStop (
+)
+{
+	InterlockedExchange (&MtfGeneration, 0);
+}
+
+HVSTATUS NTAPI PtVmxMtfTraceQuery (
+	ULONG32 CpuIndex,
+	PMTF_TRACE_STATS Stats
+)
+{
+	PMTF_TRACE_CPU Trace;
+
+	if (!Stats || CpuIndex >= MADDOG_BROADCAST_MAX_CPUS || !MtfCpus[CpuIndex].Buffer)
+		return HVSTATUS_INVALID_PARAMETERS;
+
+	Trace = &MtfCpus[CpuIndex];
+	Stats->State = Trace->State;
+	Stats->Steps = Trace->Steps;
+	Stats->Records = Trace->Records;
+	Stats->Filtered = Trace->Filtered;
+	Stats->BytesUsed = Trace->Used;
+	return HVSTATUS_SUCCESS;
+}
+
+ULONG32 NTAPI PtVmxMtfTraceCopy (
+	ULONG32 CpuIndex,
+	PVOID Buffer,
+	ULONG32 Length
+)
+{
+	PMTF_TRACE_CPU Trace;
+	PMTF_TRACE_RECORD Record;
+	ULONG32 Used, Copied;
+
+	if (!Buffer || CpuIndex >= MADDOG_BROADCAST_MAX_CPUS || !MtfCpus[CpuIndex].Buffer)
+		return 0;
+
+	Trace = &MtfCpus[CpuIndex];
+	Used = Trace->Used;
+	KeMemoryBarrier ();
+
+	for (Copied = 0; Copied < Used; Copied += Record->Size)
+	{
+		Record = (PMTF_TRACE_RECORD) (Trace->Buffer + Copied);
+		if (Copied + Record->Size > Length)
+			break;
+	}
+
+	RtlCopyMemory (Buffer, Trace->Buffer, Copied);
+	return Copied;
+}
+
+BOOLEAN NTAPI PtVmxMtfTraceHandleExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Exitcode
+)
+{
+	PMTF_TRACE_CPU Trace;
+	ULONG_PTR Regs[MTF_TRACE_REGS];
+	LONG Generation;
+
+	if (Cpu->ProcessorNumber >= MADDOG_BROADCAST_MAX_CPUS || !MtfCpus[Cpu->ProcessorNumber].Buffer)
+		return FALSE;
+
+	Trace = &MtfCpus[Cpu->ProcessorNumber];
+	Generation = MtfGeneration;
+	if (Trace->Generation != Generation)
+		MtfSync (Trace, Generation);
+
+	switch (Trace->State)
+	{
+	case MTF_TRACE_WAITING:
+		if (MtfStartConditionsHold (Trace, Exitcode))
+		{
+			// the handler of this exit still runs, its effects go to the first record
+			MtfSnapshotRegs (GuestRegs, Regs);
+			MtfTakePrevious (Trace, Regs);
+			MtfSetControl (TRUE);
+			Trace->State = MTF_TRACE_STEPPING;
+			Trace->HandlerPending = TRUE;
+		}
+		break;
+
+	case MTF_TRACE_STEPPING:
+		if (Exitcode == EXIT_REASON_MONITOR_TRAP_FLAG)
+		{
+			MtfStep (Trace, GuestRegs);
+			return TRUE;
+		}
+		Trace->HandlerPending = TRUE;
+		break;
+	}
+
+	if (Exitcode == EXIT_REASON_MONITOR_TRAP_FLAG)
+	{
+		// left pending by a trace that has just stopped
+		MtfSetControl (FALSE);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+VOID NTAPI PtVmxMtfTraceAfterExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs
+)
+{
+	PMTF_TRACE_CPU Trace;
+	ULONG_PTR Regs[MTF_TRACE_REGS];
+
+	if (Cpu->ProcessorNumber >= MADDOG_BROADCAST_MAX_CPUS)
+		return;
+
+	Trace = &MtfCpus[Cpu->ProcessorNumber];
+	if (!Trace->HandlerPending)
+		return;
+	Trace->HandlerPending = FALSE;
+	if (Trace->State != MTF_TRACE_STEPPING)
+		return;
+
+	// a moved RIP means the handler completed the instruction, which no step exit will report
+	if (VmxRead (GUEST_RIP) != Trace->PrevRip)
+	{
+		MtfStep (Trace, GuestRegs);
+		return;
+	}
+
+	// the instruction runs again, or an event is delivered first: only the registers may be stale
+	MtfSnapshotRegs (GuestRegs, Regs);
+	MtfTakePrevious (Trace, Regs);
+}
@@ -0,0 +1,1011 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#include "VmxCore.h"
+#include "Arch/Vmx/VTPlatform.h"
+#include "msr.h"
+#include "regs.h"
+#include "HvCoreAPIs.h"
+#include "Memory/MemOps.h"
+#include "Memory/MemRegs.h"
+#include "Arch/Vmx/Vmx.h"
+#include "nestedvmx.h"
+
+/*
+ * Nested VMX. The guest (L1) runs a hypervisor of its own, which runs a nested guest (L2). L0 emulates
+ * the VMX instructions of L1 on a cache of its current VMCS (vmcs12, see nestedvmx.c) and runs L2 on
+ * vmcs02, a VMCS of its own that gets vmcs12 merged in at every VMLAUNCH and VMRESUME, together with
+ * the exiting controls and bitmaps of vmcs01. Every exit of L2 lands in L0 with vmcs02 current. One
+ * vmcs12 asks for is handed to L1 as if it had come straight from the processor; one only L0's own
+ * controls caused goes through L0's traps like an exit of L1 would, and L2 continues after it.
+ * L0 does not use EPT, so the guest-physical addresses in vmcs12 (bitmaps, EPT pointer, APIC pages) are
+ * host-physical too and go into vmcs02 unchanged.
+ *
+ * Where the processor has VMCS shadowing, the link pointer of vmcs01 points to a shadow VMCS with the
+ * fields L1 reads and writes most between two entries, so those VMREADs and VMWRITEs do not exit. The
+ * shadow and vmcs12 are synchronized at the points L0 looks at vmcs12: VMPTRLD, VMCLEAR, VMLAUNCH,
+ * VMRESUME and every nested VM Exit.
+ *
+ * VMLAUNCH and VMRESUME do not enter L2 themselves: the handler makes vmcs02 current and leaves it in
+ * Cpu->Vmx.VmcsToContinuePA, and VmxVmexitHandler() enters it on its way out, with VMLAUNCH the first
+ * time vmcs02 runs after a VMCLEAR.
+ */
+#define NESTED_EFLAGS_CF			0x00000001
+#define NESTED_EFLAGS_PF			0x00000004
+#define NESTED_EFLAGS_AF			0x00000010
+#define NESTED_EFLAGS_ZF			0x00000040
+#define NESTED_EFLAGS_SF			0x00000080
+#define NESTED_EFLAGS_OF			0x00000800
+#define NESTED_EFLAGS_VM			0x00020000
+#define NESTED_EFLAGS_RESULT		(NESTED_EFLAGS_CF | NESTED_EFLAGS_PF | NESTED_EFLAGS_AF | \
+									 NESTED_EFLAGS_ZF | NESTED_EFLAGS_SF | NESTED_EFLAGS_OF)
+
+#define NESTED_CS_AR_LONG_MODE		0x2000	//bit 13, L
+#define NESTED_AR_DPL(Ar)			(((Ar) >> 5) & 3)
+#define NESTED_BLOCKING_MOV_SS		0x00000002
+
+//VM_ENTRY_INTR_INFO_FIELD
+#define NESTED_VECTOR_UD			6
+#define NESTED_VECTOR_GP			13
+#define NESTED_INTR_HW_EXCEPTION	(3 << 8)
+#define NESTED_INTR_DELIVER_CODE	0x00000800
+#define NESTED_INTR_VALID			0x80000000
+
+#define NESTED_BASIC_TRUE_CTLS		((ULONG64) 1 << 55)	//IA32_VMX_BASIC, the TRUE control MSRs exist
+#define NESTED_REVISION_MASK		0x7FFFFFFF
+#define NESTED_SHADOW_INDICATOR		0x80000000	//In the revision of a shadow VMCS
+#define NESTED_MISC_VMWRITE_ANY		((ULONG64) 1 << 29)	//IA32_VMX_MISC, exit information can be written
+
+//IA32_VMX_EPT_VPID_CAP
+#define NESTED_CAP_INVEPT			((ULONG64) 1 << 20)
+#define NESTED_CAP_INVEPT_TYPE(t)	((ULONG64) 1 << (24 + (t)))	//Single-context 1, all-context 2
+#define NESTED_CAP_INVVPID			((ULONG64) 1 << 32)
+#define NESTED_CAP_INVVPID_TYPE(t)	((ULONG64) 1 << (40 + (t)))	//Individual-address 0 to single-context-retaining-globals 3
+
+//VMX_INSTRUCTION_INFO
+#define NESTED_INFO_SCALE(i)		((i) & 3)
+#define NESTED_INFO_REG1(i)			(((i) >> 3) & 0xF)
+#define NESTED_INFO_ADDRESS_SIZE(i)	(((i) >> 7) & 7)	//0 16-bit, 1 32-bit, 2 64-bit
+#define NESTED_INFO_REGISTER		0x00000400	//The operand is REG1, not memory
+#define NESTED_INFO_SEGMENT(i)		(((i) >> 15) & 7)
+#define NESTED_INFO_INDEX(i)		(((i) >> 18) & 0xF)
+#define NESTED_INFO_NO_INDEX		0x00400000
+#define NESTED_INFO_BASE(i)			(((i) >> 23) & 0xF)
+#define NESTED_INFO_NO_BASE			0x08000000
+#define NESTED_INFO_REG2(i)			(((i) >> 28) & 0xF)
+#define NESTED_SEGMENT_FS			4
+
+#define NESTED_FIELD_64(Encoding)	((((Encoding) >> 13) & 3) == 1)
+
+typedef struct _VMX_NESTED_CPU
+{
+	NVMX_STATE Nvmx;
+	NVMX_HOST Host;
+	PCPU Cpu;
+	ULONG32 Revision;//Of every VMCS on this processor
+	ULONG64 EptVpidCaps;//0 without EPT and VPID
+
+	PVOID Vmcs02;
+	PHYSICAL_ADDRESS Vmcs02PA;
+	PVOID ShadowVmcs;
+	PHYSICAL_ADDRESS ShadowVmcsPA;
+
+	ULONG64 VmxonPointer;
+	ULONG64 CurrentPointer;//Of the vmcs12 in Nvmx, NVMX_NO_VMCS if there is none
+	ULONG64 Vmcs02Owner;//vmcs12 last merged into vmcs02 in whole, NVMX_NO_VMCS to merge the next one in whole
+	BOOLEAN VmxOn;
+	BOOLEAN InL2;
+	BOOLEAN Launching;//The entry into L2 is a VMLAUNCH, vmcs12 stays clear if it fails
+	BOOLEAN Vmcs02Launched;
+	BOOLEAN CanShadow;
+	BOOLEAN Shadowing;//vmcs01 has VMCS shadowing on
+
+	//Of the VMX instruction being emulated
+	ULONG32 Info;
+	BOOLEAN LongMode;//64-bit mode
+
+	VMX_NESTED_STATS Stats;
+} VMX_NESTED_CPU,*PVMX_NESTED_CPU;
+
+static PVMX_NESTED_CPU NestedCpus[MADDOG_BROADCAST_MAX_CPUS];
+
+//Shared by every CPU, the shadowed fields are the same everywhere
+static PUCHAR NestedVmreadBitmap;
+static PHYSICAL_ADDRESS NestedVmreadBitmapPA;
+static PUCHAR NestedVmwriteBitmap;
+static PHYSICAL_ADDRESS NestedVmwriteBitmapPA;
+
+static ULONG32 NestedExits[] = {
+	EXIT_REASON_VMCLEAR,
+	EXIT_REASON_VMLAUNCH,
+	EXIT_REASON_VMPTRLD,
+	EXIT_REASON_VMPTRST,
+	EXIT_REASON_VMREAD,
+	EXIT_REASON_VMRESUME,
+	EXIT_REASON_VMWRITE,
+	EXIT_REASON_VMXOFF,
+	EXIT_REASON_VMXON,
+	EXIT_REASON_INVEPT,
+	EXIT_REASON_INVVPID
+};
+
+static PVMX_NESTED_CPU NTAPI VmxNestedGet (
+  PCPU Cpu
+)
+{
+	if (!Cpu || Cpu->ProcessorNumber >= MADDOG_BROADCAST_MAX_CPUS)
+		return NULL;
+	return NestedCpus[Cpu->ProcessorNumber];
+}
+
+/**
+ * effects: VMREAD of the current VMCS for nestedvmx.c. 64-bit fields come in two halves on x86.
+ */
+static ULONG64 NTAPI VmxNestedReadField (
+  PVOID Context,
+  ULONG32 Encoding
+)
+{
+#ifndef _AMD64_
+	if (NESTED_FIELD_64 (Encoding))
+		return VmxRead (Encoding) | ((ULONG64) VmxRead (Encoding + 1) << 32);
+#endif
+	return VmxRead (Encoding);
+}
+
+static VOID NTAPI VmxNestedWriteField (
+  PVOID Context,
+  ULONG32 Encoding,
+  ULONG64 Value
+)
+{
+	VmxWrite (Encoding, Value);
+#ifndef _AMD64_
+	if (NESTED_FIELD_64 (Encoding))
+		VmxWrite (Encoding + 1, Value >> 32);
+#endif
+}
+
+/**
+ * returns: The host mapping of the page at <Address>, NULL if the host cannot reach it.
+ */
+static PUCHAR NTAPI VmxNestedMapPage (
+  PVOID Context,
+  ULONG64 Address
+)
+{
+	PHYSICAL_ADDRESS PhysicalAddress;
+	PVOID Page;
+
+	PhysicalAddress.QuadPart = Address;
+	Page = HvMmHostPhysicalToVirtual (PhysicalAddress);
+#ifndef _AMD64_
+	// x86 hosts find it in the system mappings, which may not cover every page
+	if (Page && !MmIsAddressValid (Page))
+		return NULL;
+#endif
+	return (PUCHAR) Page;
+}
+
+/**
+ * returns: The host mapping of the VMCS region at <Pointer>, NULL if the host cannot reach it.
+ */
+static PNVMX_VMCS12 NTAPI VmxNestedMapRegion (
+  ULONG64 Pointer
+)
+{
+	return (PNVMX_VMCS12) VmxNestedMapPage (NULL, Pointer);
+}
+
+/**
+ * effects: Raise exception <Vector> in the guest hypervisor in place of its VMX instruction.
+ * returns: FALSE, RIP stays on the instruction.
+ */
+static BOOLEAN NTAPI VmxNestedInject (
+  ULONG32 Vector,
+  BOOLEAN ErrorCode
+)
+{
+	ULONG32 Info = Vector | NESTED_INTR_HW_EXCEPTION | NESTED_INTR_VALID;
+
+	if (ErrorCode)
+	{
+		Info |= NESTED_INTR_DELIVER_CODE;
+		VmxWrite (VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+	}
+	VmxWrite (VM_ENTRY_INTR_INFO_FIELD, Info);
+	return FALSE;
+}
+
+/**
+ * effects: Report VMsucceed, VMfailInvalid or VMfailValid in the RFLAGS of the guest hypervisor.
+ * returns: TRUE, RIP moves past the instruction.
+ */
+static BOOLEAN NTAPI VmxNestedSucceed (
+)
+{
+	VmxWrite (GUEST_RFLAGS, VmxRead (GUEST_RFLAGS) & ~NESTED_EFLAGS_RESULT);
+	return TRUE;
+}
+
+static BOOLEAN NTAPI VmxNestedFailInvalid (
+)
+{
+	VmxWrite (GUEST_RFLAGS, (VmxRead (GUEST_RFLAGS) & ~NESTED_EFLAGS_RESULT) | NESTED_EFLAGS_CF);
+	return TRUE;
+}
+
+static BOOLEAN NTAPI VmxNestedFail (
+  PVMX_NESTED_CPU Nested,
+  ULONG32 Error
+)
+{
+	// the error number goes into the current VMCS, without one the failure is VMfailInvalid
+	if (Nested->CurrentPointer == NVMX_NO_VMCS)
+		return VmxNestedFailInvalid ();
+
+	NvmxSetField (&Nested->Nvmx, VM_INSTRUCTION_ERROR, Error);
+	VmxWrite (GUEST_RFLAGS, (VmxRead (GUEST_RFLAGS) & ~NESTED_EFLAGS_RESULT) | NESTED_EFLAGS_ZF);
+	return TRUE;
+}
+
+/**
+ * returns: Slot <Number> of <GuestRegs>, which follows the register numbering of the instruction
+ * information. HvmEventCallback() has put the guest RSP in the esp slot.
+ */
+static PULONG_PTR NTAPI VmxNestedRegister (
+  PGUEST_REGS GuestRegs,
+  ULONG32 Number
+)
+{
+#ifndef _AMD64_
+	Number &= 7;
+#endif
+	return &((PULONG_PTR) GuestRegs)[Number];
+}
+
+/**
+ * returns: The linear address of the memory operand of the VMX instruction that exited, from the
+ * instruction information and the displacement in the exit qualification. Segment limits are not
+ * checked.
+ */
+static ULONG64 NTAPI VmxNestedOperandAddress (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs
+)
+{
+	ULONG32 Info = Nested->Info;
+	ULONG32 Segment;
+	ULONG64 Address;
+
+	Address = VmxRead (EXIT_QUALIFICATION);
+	if (!(Info & NESTED_INFO_NO_BASE))
+		Address += *VmxNestedRegister (GuestRegs, NESTED_INFO_BASE (Info));
+	if (!(Info & NESTED_INFO_NO_INDEX))
+		Address += (ULONG64) *VmxNestedRegister (GuestRegs, NESTED_INFO_INDEX (Info)) << NESTED_INFO_SCALE (Info);
+
+	switch (NESTED_INFO_ADDRESS_SIZE (Info))
+	{
+	case 0:
+		Address &= 0xFFFF;
+		break;
+	case 1:
+		Address &= 0xFFFFFFFF;
+		break;
+	}
+
+	// 64-bit mode only keeps the FS and GS bases
+	Segment = NESTED_INFO_SEGMENT (Info);
+	if (!Nested->LongMode || Segment >= NESTED_SEGMENT_FS)
+		Address += VmxRead (GUEST_ES_BASE + Segment * 2);
+	if (!Nested->LongMode)
+		Address &= 0xFFFFFFFF;
+	return Address;
+}
+
+/**
+ * effects: Read or write the memory operand of the VMX instruction being emulated.
+ * returns: FALSE if the guest may not access it, with the #PF or #GP injected, or if the host cannot
+ * reach it, with #GP(0) injected in place of the fault the processor would have raised.
+ */
+static BOOLEAN NTAPI VmxNestedAccessOperand (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs,
+  PVOID Buffer,
+  ULONG32 Size,
+  BOOLEAN Write
+)
+{
+	VMX_GUEST_FAULT Fault;
+
+	if (PtVmxAccessGuestMemory (VmxNestedOperandAddress (Nested, GuestRegs), Buffer, Size, Write, &Fault))
+		return TRUE;
+	if (Fault.Raised)
+		PtVmxInjectGuestFault (&Fault);
+	else
+		VmxNestedInject (NESTED_VECTOR_GP, TRUE);
+	return FALSE;
+}
+
+/**
+ * effects: Copy the shadowed fields of vmcs12 into the shadow VMCS (<ToShadow>), or take back what
+ * the guest hypervisor wrote there. vmcs01 is current again afterwards.
+ */
+static VOID NTAPI VmxNestedSyncShadow (
+  PVMX_NESTED_CPU Nested,
+  BOOLEAN ToShadow
+)
+{
+	if (!Nested->Shadowing || Nested->CurrentPointer == NVMX_NO_VMCS)
+		return;
+
+	VmxPtrld (Nested->ShadowVmcsPA);
+	if (ToShadow)
+		NvmxSyncToShadow (&Nested->Nvmx, &Nested->Host, VmxNestedWriteField, NULL);
+	else
+		NvmxSyncFromShadow (&Nested->Nvmx, &Nested->Host, VmxNestedReadField, NULL);
+	VmxPtrld (Nested->Cpu->Vmx.OriginalVmcsPA);
+}
+
+/**
+ * effects: Turn VMCS shadowing on or off in vmcs01, which must be current. It starts with no shadow
+ * VMCS linked, VMREAD and VMWRITE then fail without exiting like they do without a current VMCS.
+ */
+static VOID NTAPI VmxNestedSetShadowing (
+  PVMX_NESTED_CPU Nested,
+  BOOLEAN Enable
+)
+{
+	ULONG32 Proc, Proc2;
+
+	Proc = (ULONG32) VmxRead (CPU_BASED_VM_EXEC_CONTROL);
+	Proc2 = (Proc & CPU_BASED_ACTIVATE_SECONDARY_CONTROLS) ? (ULONG32) VmxRead (SECONDARY_VM_EXEC_CONTROL) : 0;
+	if (Enable)
+	{
+		VmxNestedWriteField (NULL, VMREAD_BITMAP, NestedVmreadBitmapPA.QuadPart);
+		VmxNestedWriteField (NULL, VMWRITE_BITMAP, NestedVmwriteBitmapPA.QuadPart);
+		Proc2 |= SECONDARY_EXEC_SHADOW_VMCS;
+	}
+	else
+		Proc2 &= ~SECONDARY_EXEC_SHADOW_VMCS;
+
+	VmxNestedWriteField (NULL, VMCS_LINK_POINTER, NVMX_NO_VMCS);
+	VmxWrite (SECONDARY_VM_EXEC_CONTROL, Proc2);
+	VmxWrite (CPU_BASED_VM_EXEC_CONTROL, Proc | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS);
+	Nested->Shadowing = Enable;
+}
+
+/**
+ * effects: Write the current vmcs12 back into the region of the guest hypervisor and leave no VMCS
+ * current.
+ */
+static VOID NTAPI VmxNestedFlush (
+  PVMX_NESTED_CPU Nested
+)
+{
+	PNVMX_VMCS12 Region;
+	ULONG32 i;
+
+	if (Nested->CurrentPointer == NVMX_NO_VMCS)
+		return;
+
+	VmxNestedSyncShadow (Nested, FALSE);
+
+	// the dirty fields are lost with the cache, so vmcs02 has to be merged in whole next time
+	for (i = 0; i < sizeof (Nested->Nvmx.Dirty) / sizeof (Nested->Nvmx.Dirty[0]); i++)
+	{
+		if (Nested->Nvmx.Dirty[i] && Nested->Vmcs02Owner == Nested->CurrentPointer)
+			Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	}
+
+	Region = VmxNestedMapRegion (Nested->CurrentPointer);
+	if (Region)
+		RtlCopyMemory (Region, &Nested->Nvmx.Vmcs12, sizeof (NVMX_VMCS12));
+
+	if (Nested->Shadowing)
+		VmxNestedWriteField (NULL, VMCS_LINK_POINTER, NVMX_NO_VMCS);
+	Nested->CurrentPointer = NVMX_NO_VMCS;
+}
+
+/**
+ * effects: Make vmcs01 current again after L2 exited or failed to enter.
+ */
+static VOID NTAPI VmxNestedLeaveL2 (
+  PVMX_NESTED_CPU Nested
+)
+{
+	PCPU Cpu = Nested->Cpu;
+
+	VmxPtrld (Cpu->Vmx.OriginalVmcsPA);
+	Cpu->Vmx.VmcsToContinuePA = Cpu->Vmx.OriginalVmcsPA;
+	Cpu->Vmx.LaunchVmcsToContinue = FALSE;
+	Nested->InL2 = FALSE;
+	Nested->Launching = FALSE;
+}
+
+static BOOLEAN NTAPI VmxNestedVmxon (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs
+)
+{
+	PNVMX_VMCS12 Region;
+	ULONG64 Pointer;
+
+	if (Nested->VmxOn)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMXON_IN_ROOT);
+	if (!VmxNestedAccessOperand (Nested, GuestRegs, &Pointer, sizeof (Pointer), FALSE))
+		return FALSE;
+
+	Region = (Pointer & (PAGE_SIZE - 1)) ? NULL : VmxNestedMapRegion (Pointer);
+	if (!Region || Region->Revision != Nested->Revision)
+		return VmxNestedFailInvalid ();
+
+	Nested->VmxOn = TRUE;
+	Nested->VmxonPointer = Pointer;
+	Nested->CurrentPointer = NVMX_NO_VMCS;
+	Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	if (Nested->CanShadow)
+	{
+		VmxClear (Nested->ShadowVmcsPA);
+		VmxNestedSetShadowing (Nested, TRUE);
+	}
+	return VmxNestedSucceed ();
+}
+
+static BOOLEAN NTAPI VmxNestedVmxoff (
+  PVMX_NESTED_CPU Nested
+)
+{
+	VmxNestedFlush (Nested);
+	if (Nested->Shadowing)
+		VmxNestedSetShadowing (Nested, FALSE);
+	Nested->VmxOn = FALSE;
+	Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	return VmxNestedSucceed ();
+}
+
+static BOOLEAN NTAPI VmxNestedVmclear (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs
+)
+{
+	PNVMX_VMCS12 Region;
+	ULONG64 Pointer;
+
+	if (!VmxNestedAccessOperand (Nested, GuestRegs, &Pointer, sizeof (Pointer), FALSE))
+		return FALSE;
+	if (Pointer & (PAGE_SIZE - 1))
+		return VmxNestedFail (Nested, NVMX_ERROR_VMCLEAR_ADDRESS);
+	if (Pointer == Nested->VmxonPointer)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMCLEAR_VMXON);
+
+	if (Pointer == Nested->CurrentPointer)
+	{
+		Nested->Nvmx.Vmcs12.LaunchState = NVMX_LAUNCH_CLEAR;
+		VmxNestedFlush (Nested);
+	}
+	else
+	{
+		Region = VmxNestedMapRegion (Pointer);
+		if (!Region)
+			return VmxNestedFail (Nested, NVMX_ERROR_VMCLEAR_ADDRESS);
+		Region->LaunchState = NVMX_LAUNCH_CLEAR;
+	}
+
+	if (Pointer == Nested->Vmcs02Owner)
+		Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	return VmxNestedSucceed ();
+}
+
+static BOOLEAN NTAPI VmxNestedVmptrld (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs
+)
+{
+	PNVMX_VMCS12 Region;
+	ULONG64 Pointer;
+
+	if (!VmxNestedAccessOperand (Nested, GuestRegs, &Pointer, sizeof (Pointer), FALSE))
+		return FALSE;
+	if (Pointer & (PAGE_SIZE - 1))
+		return VmxNestedFail (Nested, NVMX_ERROR_VMPTRLD_ADDRESS);
+	if (Pointer == Nested->VmxonPointer)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMPTRLD_VMXON);
+	Region = VmxNestedMapRegion (Pointer);
+	if (!Region)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMPTRLD_ADDRESS);
+	// shadow VMCSs are not offered to the guest hypervisor
+	if (Region->Revision != Nested->Revision)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMPTRLD_REVISION);
+
+	if (Pointer != Nested->CurrentPointer)
+	{
+		VmxNestedFlush (Nested);
+		RtlCopyMemory (&Nested->Nvmx.Vmcs12, Region, sizeof (NVMX_VMCS12));
+		RtlZeroMemory (Nested->Nvmx.Dirty, sizeof (Nested->Nvmx.Dirty));
+		Nested->CurrentPointer = Pointer;
+		if (Nested->Shadowing)
+		{
+			VmxNestedSyncShadow (Nested, TRUE);
+			VmxNestedWriteField (NULL, VMCS_LINK_POINTER, Nested->ShadowVmcsPA.QuadPart);
+		}
+	}
+	return VmxNestedSucceed ();
+}
+
+static BOOLEAN NTAPI VmxNestedVmptrst (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs
+)
+{
+	ULONG64 Pointer = Nested->CurrentPointer;
+
+	if (!VmxNestedAccessOperand (Nested, GuestRegs, &Pointer, sizeof (Pointer), TRUE))
+		return FALSE;
+	return VmxNestedSucceed ();
+}
+
+/**
+ * effects: Emulate a VMREAD or VMWRITE that exited: the field is not shadowed, so it lives in the
+ * cache only, or shadowing is off.
+ */
+static BOOLEAN NTAPI VmxNestedVmaccess (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs,
+  BOOLEAN Write
+)
+{
+	ULONG64 Field, Value = 0, Old;
+	ULONG32 Size, Error;
+
+	if (Nested->CurrentPointer == NVMX_NO_VMCS)
+		return VmxNestedFailInvalid ();
+
+	Field = *VmxNestedRegister (GuestRegs, NESTED_INFO_REG2 (Nested->Info));
+	if (!Nested->LongMode)
+		Field &= 0xFFFFFFFF;
+	if (Field >> 32)
+		return VmxNestedFail (Nested, NVMX_ERROR_UNSUPPORTED_FIELD);
+	Size = Nested->LongMode ? sizeof (ULONG64) : sizeof (ULONG32);
+
+	if (!Write)
+	{
+		Error = NvmxRead (&Nested->Nvmx, (ULONG32) Field, &Value);
+		if (Error)
+			return VmxNestedFail (Nested, Error);
+		if (Nested->Info & NESTED_INFO_REGISTER)
+			*VmxNestedRegister (GuestRegs, NESTED_INFO_REG1 (Nested->Info)) = (ULONG_PTR) (Nested->LongMode ? Value : (ULONG32) Value);
+		else if (!VmxNestedAccessOperand (Nested, GuestRegs, &Value, Size, TRUE))
+			return FALSE;
+		return VmxNestedSucceed ();
+	}
+
+	if (Nested->Info & NESTED_INFO_REGISTER)
+		Value = *VmxNestedRegister (GuestRegs, NESTED_INFO_REG1 (Nested->Info));
+	else if (!VmxNestedAccessOperand (Nested, GuestRegs, &Value, Size, FALSE))
+		return FALSE;
+	if (!Nested->LongMode)
+		Value &= 0xFFFFFFFF;
+
+	Error = NvmxWrite (&Nested->Nvmx, (ULONG32) Field, Value);
+	if (Error == NVMX_ERROR_READ_ONLY_FIELD && (Nested->Host.Misc & NESTED_MISC_VMWRITE_ANY))
+	{
+		// the processor lets exit information be written too, it is never merged into vmcs02
+		if (Field & 1)
+		{
+			NvmxRead (&Nested->Nvmx, (ULONG32) Field & ~1, &Old);
+			Value = (Old & 0xFFFFFFFF) | (Value << 32);
+		}
+		NvmxSetField (&Nested->Nvmx, (ULONG32) Field & ~1, Value);
+		// a shadowed copy would still have the old value for VMREAD
+		if (NvmxFieldInfo (NvmxFieldIndex ((ULONG32) Field), NULL) & NVMX_SHADOW_RO)
+			VmxNestedSyncShadow (Nested, TRUE);
+		Error = 0;
+	}
+	if (Error)
+		return VmxNestedFail (Nested, Error);
+	return VmxNestedSucceed ();
+}
+
+/**
+ * effects: Emulate VMLAUNCH or VMRESUME: check vmcs12, merge it into vmcs02 and leave vmcs02 for
+ * VmxVmexitHandler() to enter. vmcs01 is already past the instruction with VMsucceed, which is what
+ * the guest hypervisor sees at the nested VM Exit.
+ * returns: TRUE if the instruction failed and the guest hypervisor continues after it.
+ */
+static BOOLEAN NTAPI VmxNestedEnter (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs,
+  BOOLEAN Launch
+)
+{
+	PCPU Cpu = Nested->Cpu;
+	ULONG64 Rsp;
+	ULONG32 Error;
+	BOOLEAN Full;
+
+	if (Nested->CurrentPointer == NVMX_NO_VMCS)
+		return VmxNestedFailInvalid ();
+	if (VmxRead (GUEST_INTERRUPTIBILITY_INFO) & NESTED_BLOCKING_MOV_SS)
+		return VmxNestedFail (Nested, NVMX_ERROR_ENTRY_MOV_SS);
+
+	VmxNestedSyncShadow (Nested, FALSE);
+	if (Launch && Nested->Nvmx.Vmcs12.LaunchState != NVMX_LAUNCH_CLEAR)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMLAUNCH_NOT_CLEAR);
+	if (!Launch && Nested->Nvmx.Vmcs12.LaunchState != NVMX_LAUNCH_LAUNCHED)
+		return VmxNestedFail (Nested, NVMX_ERROR_VMRESUME_NOT_LAUNCHED);
+	Error = NvmxCheckEntry (&Nested->Nvmx, &Nested->Host, (VmxRead (VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE) != 0);
+	if (Error)
+		return VmxNestedFail (Nested, Error);
+
+	VmxWrite (GUEST_RIP, VmxRead (GUEST_RIP) + VmxRead (VM_EXIT_INSTRUCTION_LEN));
+	VmxNestedSucceed ();
+
+	// vmcs02 keeps what the last vmcs12 merged into it, only another vmcs12 needs all of it
+	Full = Nested->Vmcs02Owner != Nested->CurrentPointer;
+	if (Full)
+	{
+		NvmxCaptureHost (&Nested->Host, VmxNestedReadField, NULL);
+		VmxClear (Nested->Vmcs02PA);
+		Nested->Vmcs02Launched = FALSE;
+		Nested->Stats.FullMerges++;
+	}
+	// L0's traps may have changed what vmcs01 exits on, and L1 its bitmaps without a VMWRITE
+	NvmxCaptureExiting (&Nested->Nvmx, &Nested->Host, VmxNestedReadField, NULL);
+	NvmxMergeBitmaps (&Nested->Nvmx, &Nested->Host, VmxNestedMapPage, NULL);
+	VmxPtrld (Nested->Vmcs02PA);
+	Nested->Stats.FieldsMerged += NvmxMerge (&Nested->Nvmx, &Nested->Host, Full, VmxNestedWriteField, NULL);
+
+	Nested->Vmcs02Owner = Nested->CurrentPointer;
+	Nested->InL2 = TRUE;
+	Nested->Launching = Launch;
+	Cpu->Vmx.VmcsToContinuePA = Nested->Vmcs02PA;
+	Cpu->Vmx.LaunchVmcsToContinue = !Nested->Vmcs02Launched;
+	Nested->Vmcs02Launched = TRUE;
+	if (Launch)
+		Nested->Nvmx.Vmcs12.LaunchState = NVMX_LAUNCH_LAUNCHED;
+
+	// HvmEventCallback() writes this back as the GUEST_RSP of vmcs02
+	NvmxRead (&Nested->Nvmx, GUEST_RSP, &Rsp);
+	GuestRegs->esp = (ULONG_PTR) Rsp;
+	Nested->Stats.Entries++;
+	return FALSE;
+}
+
+static BOOLEAN NTAPI VmxNestedInvalidate (
+  PVMX_NESTED_CPU Nested,
+  PGUEST_REGS GuestRegs,
+  ULONG32 Exitcode
+)
+{
+	ULONG64 Descriptor[2];
+	ULONG_PTR Type, Flags;
+	BOOLEAN Supported;
+
+	Type = *VmxNestedRegister (GuestRegs, NESTED_INFO_REG2 (Nested->Info));
+	if (!Nested->LongMode)
+		Type = (ULONG32) Type;
+
+	if (Exitcode == EXIT_REASON_INVEPT)
+	{
+		if (!(Nested->EptVpidCaps & NESTED_CAP_INVEPT))
+			return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+		Supported = (Type == 1 || Type == 2) && (Nested->EptVpidCaps & NESTED_CAP_INVEPT_TYPE (Type));
+	}
+	else
+	{
+		if (!(Nested->EptVpidCaps & NESTED_CAP_INVVPID))
+			return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+		Supported = Type <= 3 && (Nested->EptVpidCaps & NESTED_CAP_INVVPID_TYPE (Type));
+	}
+	if (!Supported)
+		return VmxNestedFail (Nested, NVMX_ERROR_INVALID_OPERAND);
+	if (!VmxNestedAccessOperand (Nested, GuestRegs, Descriptor, sizeof (Descriptor), FALSE))
+		return FALSE;
+
+	// vmcs02 runs with the EPT pointers and VPIDs of the guest hypervisor, so its own are the ones to flush
+	if (Exitcode == EXIT_REASON_INVEPT)
+		Flags = VmxInvept (Type, Descriptor);
+	else
+		Flags = VmxInvvpid (Type, Descriptor);
+	if (Flags & (NESTED_EFLAGS_CF | NESTED_EFLAGS_ZF))
+		return VmxNestedFail (Nested, NVMX_ERROR_INVALID_OPERAND);
+	return VmxNestedSucceed ();
+}
+
+/**
+ * effects: Handler of every VMX instruction of the guest hypervisor.
+ */
+static BOOLEAN NTAPI VmxNestedDispatch (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  PNBP_TRAP Trap,
+  BOOLEAN WillBeAlsoHandledByGuestHv,
+  ...
+)
+{
+	PVMX_NESTED_CPU Nested;
+	ULONG32 Exitcode, CsAccessRights;
+
+	Nested = VmxNestedGet (Cpu);
+	if (!Nested || !GuestRegs)
+		return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+
+	Trap->RipDelta = (ULONG) VmxRead (VM_EXIT_INSTRUCTION_LEN);
+	Exitcode = (ULONG32) VmxRead (VM_EXIT_REASON) & 0xFFFF;
+	Nested->Stats.Instructions++;
+
+	// the checks the processor makes before the exit, in its order
+	CsAccessRights = (ULONG32) VmxRead (GUEST_CS_AR_BYTES);
+	if (!(VmxRead (GUEST_CR0) & X86_CR0_PE) || (VmxRead (GUEST_RFLAGS) & NESTED_EFLAGS_VM))
+		return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+	if ((VmxRead (VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE) && !(CsAccessRights & NESTED_CS_AR_LONG_MODE))
+		return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+	if (!Nested->VmxOn && Exitcode != EXIT_REASON_VMXON)
+		return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+	if (NESTED_AR_DPL (VmxRead (GUEST_SS_AR_BYTES)))
+		return VmxNestedInject (NESTED_VECTOR_GP, TRUE);
+
+	Nested->Info = (ULONG32) VmxRead (VMX_INSTRUCTION_INFO);
+	Nested->LongMode = (CsAccessRights & NESTED_CS_AR_LONG_MODE) != 0;
+
+	switch (Exitcode)
+	{
+	case EXIT_REASON_VMXON:
+		return VmxNestedVmxon (Nested, GuestRegs);
+	case EXIT_REASON_VMXOFF:
+		return VmxNestedVmxoff (Nested);
+	case EXIT_REASON_VMCLEAR:
+		return VmxNestedVmclear (Nested, GuestRegs);
+	case EXIT_REASON_VMPTRLD:
+		return VmxNestedVmptrld (Nested, GuestRegs);
+	case EXIT_REASON_VMPTRST:
+		return VmxNestedVmptrst (Nested, GuestRegs);
+	case EXIT_REASON_VMREAD:
+		return VmxNestedVmaccess (Nested, GuestRegs, FALSE);
+	case EXIT_REASON_VMWRITE:
+		return VmxNestedVmaccess (Nested, GuestRegs, TRUE);
+	case EXIT_REASON_VMLAUNCH:
+		return VmxNestedEnter (Nested, GuestRegs, TRUE);
+	case EXIT_REASON_VMRESUME:
+		return VmxNestedEnter (Nested, GuestRegs, FALSE);
+	case EXIT_REASON_INVEPT:
+	case EXIT_REASON_INVVPID:
+		return VmxNestedInvalidate (Nested, GuestRegs, Exitcode);
+	}
+	return VmxNestedInject (NESTED_VECTOR_UD, FALSE);
+}
+
+HVSTATUS NTAPI PtVmxNestedInitialize (
+	PCPU Cpu
+)
+{
+	PVMX_NESTED_CPU Nested;
+	PNVMX_HOST Host;
+	PALLOCATED_PAGE AllocatedPage;
+	PNBP_TRAP Trap;
+	PHYSICAL_ADDRESS BitmapsPA;
+	ULONG64 Basic;
+	NTSTATUS Status;
+	ULONG32 i, eax, ebx, ecx, edx;
+
+	if (!Cpu || Cpu->ProcessorNumber >= MADDOG_BROADCAST_MAX_CPUS)
+		return HVSTATUS_INVALID_PARAMETERS;
+
+	Nested = NestedCpus[Cpu->ProcessorNumber];
+	if (!Nested)
+	{
+		Nested = HvMmAllocatePages (BYTES_TO_PAGES (sizeof (VMX_NESTED_CPU)), NULL, LAB_TAG, &AllocatedPage);
+		if (!Nested)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		RtlZeroMemory (Nested, sizeof (VMX_NESTED_CPU));
+		Nested->Vmcs02 = HvMmAllocateContiguousPages (VMX_VMCS_SIZE_IN_PAGES, &Nested->Vmcs02PA, &AllocatedPage);
+		Nested->ShadowVmcs = HvMmAllocateContiguousPages (VMX_VMCS_SIZE_IN_PAGES, &Nested->ShadowVmcsPA, &AllocatedPage);
+		Nested->Host.Bitmaps02 = HvMmAllocateContiguousPages (NVMX_BITMAP_PAGES, &BitmapsPA, &AllocatedPage);
+		if (!Nested->Vmcs02 || !Nested->ShadowVmcs || !Nested->Host.Bitmaps02)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		Nested->Host.Bitmaps02PA = BitmapsPA.QuadPart;
+		NestedCpus[Cpu->ProcessorNumber] = Nested;
+	}
+
+	RtlZeroMemory (&Nested->Nvmx, sizeof (NVMX_STATE));
+	RtlZeroMemory (&Nested->Stats, sizeof (VMX_NESTED_STATS));
+	Nested->Cpu = Cpu;
+	Nested->VmxonPointer = NVMX_NO_VMCS;
+	Nested->CurrentPointer = NVMX_NO_VMCS;
+	Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	Nested->VmxOn = FALSE;
+	Nested->InL2 = FALSE;
+	Nested->Shadowing = FALSE;
+
+	// the guest hypervisor reads the same capability MSRs, vmcs12 is checked against them
+	Host = &Nested->Host;
+	Basic = MsrRead (MSR_IA32_VMX_BASIC);
+	if (Basic & NESTED_BASIC_TRUE_CTLS)
+	{
+		Host->PinControls = MsrRead (MSR_IA32_VMX_TRUE_PINBASED_CTLS);
+		Host->ProcControls = MsrRead (MSR_IA32_VMX_TRUE_PROCBASED_CTLS);
+		Host->ExitControls = MsrRead (MSR_IA32_VMX_TRUE_EXIT_CTLS);
+		Host->EntryControls = MsrRead (MSR_IA32_VMX_TRUE_ENTRY_CTLS);
+	}
+	else
+	{
+		Host->PinControls = MsrRead (MSR_IA32_VMX_PINBASED_CTLS);
+		Host->ProcControls = MsrRead (MSR_IA32_VMX_PROCBASED_CTLS);
+		Host->ExitControls = MsrRead (MSR_IA32_VMX_EXIT_CTLS);
+		Host->EntryControls = MsrRead (MSR_IA32_VMX_ENTRY_CTLS);
+	}
+	Host->Proc2Controls = ((Host->ProcControls >> 32) & CPU_BASED_ACTIVATE_SECONDARY_CONTROLS) ?
+		MsrRead (MSR_IA32_VMX_PROCBASED_CTLS2) : 0;
+	Host->Misc = MsrRead (MSR_IA32_VMX_MISC);
+	Host->Efer = MsrRead (MSR_EFER);
+	Host->Pat = MsrRead (MSR_IA32_PAT);
+	Host->Cr0Fixed0 = MsrRead (MSR_IA32_VMX_CR0_FIXED0);
+	Host->Cr0Fixed1 = MsrRead (MSR_IA32_VMX_CR0_FIXED1);
+	Host->Cr4Fixed0 = MsrRead (MSR_IA32_VMX_CR4_FIXED0);
+	Host->Cr4Fixed1 = MsrRead (MSR_IA32_VMX_CR4_FIXED1);
+	GetCpuIdInfo (0x80000008, &eax, &ebx, &ecx, &edx);
+	Host->PhysicalAddressBits = eax & 0xFF;
+
+	Nested->EptVpidCaps = ((Host->Proc2Controls >> 32) & (SECONDARY_EXEC_ENABLE_EPT | SECONDARY_EXEC_ENABLE_VPID)) ?
+		MsrRead (MSR_IA32_VMX_EPT_VPID_CAP) : 0;
+	Nested->Revision = (ULONG32) Basic & NESTED_REVISION_MASK;
+	*(PULONG32) Nested->Vmcs02 = Nested->Revision;
+	*(PULONG32) Nested->ShadowVmcs = Nested->Revision | NESTED_SHADOW_INDICATOR;
+
+	Nested->CanShadow = ((Host->Proc2Controls >> 32) & SECONDARY_EXEC_SHADOW_VMCS) != 0;
+	if (Nested->CanShadow && !NestedVmreadBitmap)
+	{
+		NestedVmreadBitmap = HvMmAllocateContiguousPages (1, &NestedVmreadBitmapPA, &AllocatedPage);
+		NestedVmwriteBitmap = HvMmAllocateContiguousPages (1, &NestedVmwriteBitmapPA, &AllocatedPage);
+		if (NestedVmreadBitmap && NestedVmwriteBitmap)
+			NvmxBuildShadowBitmaps (Host, NestedVmreadBitmap, NestedVmwriteBitmap);
+		else
+			NestedVmreadBitmap = NULL;
+	}
+	if (!NestedVmreadBitmap)
+	{
+		if (Nested->CanShadow)
+			Print(("PtVmxNestedInitialize(): No memory for the VMREAD and VMWRITE bitmaps, every access exits\n"));
+		Nested->CanShadow = FALSE;
+	}
+
+	for (i = 0; i < sizeof (NestedExits) / sizeof (ULONG32); i++)
+	{
+		Status = HvInitializeGeneralTrap (
+			Cpu,
+			NestedExits[i],
+			FALSE,
+			0, // length of the instruction, 0 means length need to be get from vmcs later.
+			VmxNestedDispatch,
+			&Trap,
+			LAB_TAG);
+		if (!NT_SUCCESS (Status))
+		{
+			Print(("PtVmxNestedInitialize(): Failed to register VmxNestedDispatch with status 0x%08hX\n", Status));
+			return Status;
+		}
+		MadDog_RegisterTrap (Cpu, Trap);
+	}
+
+	return HVSTATUS_SUCCESS;
+}
+
+HVSTATUS NTAPI PtVmxNestedQuery (
+	ULONG32 CpuIndex,
+	PVMX_NESTED_STATS Stats
+)
+{
+	PVMX_NESTED_CPU Nested;
+
+	if (!Stats || CpuIndex >= MADDOG_BROADCAST_MAX_CPUS || !NestedCpus[CpuIndex])
+		return HVSTATUS_INVALID_PARAMETERS;
+
+	Nested = NestedCpus[CpuIndex];
+	RtlCopyMemory (Stats, &Nested->Stats, sizeof (VMX_NESTED_STATS));
+	Stats->VmxOn = Nested->VmxOn;
+	Stats->Shadowing = Nested->Shadowing;
+	Stats->InL2 = Nested->InL2;
+	return HVSTATUS_SUCCESS;
+}
+
+/**
+ * returns: TRUE if the exit of the nested guest with <Exitcode> is one vmcs12 asks for.
+ */
+static BOOLEAN NTAPI VmxNestedExitForL1 (
+	PVMX_NESTED_CPU Nested,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Exitcode
+)
+{
+	NVMX_EXIT Exit;
+
+	Exit.Reason = Exitcode;
+	Exit.Qualification = VmxRead (EXIT_QUALIFICATION);
+	Exit.IntrInfo = (ULONG32) VmxRead (VM_EXIT_INTR_INFO);
+	Exit.ErrorCode = (ULONG32) VmxRead (VM_EXIT_INTR_ERROR_CODE);
+	Exit.Operand = 0;
+	if (Exitcode == EXIT_REASON_MSR_READ || Exitcode == EXIT_REASON_MSR_WRITE)
+		Exit.Operand = (ULONG32) GuestRegs->ecx;
+	else if (Exitcode == EXIT_REASON_CR_ACCESS)
+		Exit.Operand = *VmxNestedRegister (GuestRegs, (ULONG32) (Exit.Qualification >> 8) & 0xF);
+	return NvmxExitForL1 (&Nested->Nvmx, &Exit, VmxNestedMapPage, NULL);
+}
+
+BOOLEAN NTAPI PtVmxNestedHandleExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Exitcode
+)
+{
+	PVMX_NESTED_CPU Nested;
+	ULONG64 Rsp;
+
+	Nested = VmxNestedGet (Cpu);
+	if (!Nested || !Nested->InL2)
+		return FALSE;
+	// L0's own traps run with vmcs02 current and act on the nested guest, which then continues
+	if (!(Exitcode & VMX_EXIT_REASONS_FAILED_VMENTRY) && !VmxNestedExitForL1 (Nested, GuestRegs, Exitcode))
+	{
+		Nested->Stats.ExitsToL0++;
+		return FALSE;
+	}
+
+	NvmxSaveExit (&Nested->Nvmx, VmxNestedReadField, NULL);
+	if (Exitcode & VMX_EXIT_REASONS_FAILED_VMENTRY)
+	{
+		// vmcs02 was not entered, neither it nor vmcs12 is launched
+		if (Nested->Launching)
+			Nested->Nvmx.Vmcs12.LaunchState = NVMX_LAUNCH_CLEAR;
+		Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	}
+
+	VmxNestedLeaveL2 (Nested);
+	NvmxLoadHostState (&Nested->Nvmx, VmxNestedReadField, VmxNestedWriteField, NULL);
+	NvmxRead (&Nested->Nvmx, HOST_RSP, &Rsp);
+	GuestRegs->esp = (ULONG_PTR) Rsp;
+
+	VmxNestedSyncShadow (Nested, TRUE);
+	Nested->Stats.Exits++;
+	return TRUE;
+}
+
+VOID NTAPI PtVmxNestedEntryFailed (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs
+)
+{
+	PVMX_NESTED_CPU Nested;
+	ULONG32 Error;
+
+	Nested = VmxNestedGet (Cpu);
+	if (!Nested || !Nested->InL2)
+	{
+		Print(("PtVmxNestedEntryFailed(): VM Entry failed with error %d\n", (ULONG32) VmxRead (VM_INSTRUCTION_ERROR)));
+		VmxCrash (Cpu, GuestRegs);
+		return;
+	}
+
+	Error = (ULONG32) VmxRead (VM_INSTRUCTION_ERROR);
+	if (Nested->Launching)
+		Nested->Nvmx.Vmcs12.LaunchState = NVMX_LAUNCH_CLEAR;
+	Nested->Vmcs02Owner = NVMX_NO_VMCS;
+	VmxNestedLeaveL2 (Nested);
+
+	// vmcs01 is already past the VMLAUNCH or VMRESUME, only the outcome changes
+	VmxNestedFail (Nested, Error);
+	Nested->Stats.EntryFailures++;
+}
@@ -19,9 +19,113 @@
 
 #include "HvCore.h"
 #include "AllocPageMgr.h"
+#include "Memory/HostPaging.h"
 
 #ifdef USE_MEMORY_DEFAULT_STRATEGY
 
+#ifdef _AMD64_
+//+++++++++++++++++++++amd64 Host Paging++++++++++++++++++++++++
+// On amd64 the host runs on a private copy of the PML4 that was live when
+// the memory manager started, built by HostPaging.c. Its kernel half follows
+// the guest's, and one kernel slot, reserved in the guest's PML4, holds a
+// direct map of physical memory. The map is write-back; MTRRs still make
+// MMIO holes uncached.
+
+static HOSTPG_TABLES g_HostTables;
+
+/**
+ * effects: Return the size of the physical range the direct map has to
+ * cover, rounded up to 1GB and capped at the 512GB one PML4 slot holds.
+ */
+static ULONG64 NTAPI MmGetPhysicalMapSize (
+)
+{
+	PPHYSICAL_MEMORY_RANGE Ranges;
+	ULONG64 Top = 4 * HOSTPG_PAGE_1GB, End;
+	ULONG i;
+
+	// Below 4GB everything is mapped, so the MMIO of the chipset is reachable too.
+	Ranges = MmGetPhysicalMemoryRanges();
+	if (Ranges)
+	{
+		for (i = 0; Ranges[i].BaseAddress.QuadPart || Ranges[i].NumberOfBytes.QuadPart; i++)
+		{
+			End = Ranges[i].BaseAddress.QuadPart + Ranges[i].NumberOfBytes.QuadPart;
+			if (End > Top)
+				Top = End;
+		}
+		ExFreePool(Ranges);
+	}
+
+	Top = (Top + HOSTPG_PAGE_1GB - 1) & ~(HOSTPG_PAGE_1GB - 1);
+	if (Top > HOSTPG_ENTRIES * HOSTPG_PAGE_1GB)
+		Top = HOSTPG_ENTRIES * HOSTPG_PAGE_1GB;
+	return Top;
+}
+
+/**
+ * effects: Allocate a zeroed page of the host page tables, tracked by the APM.
+ */
+static PVOID NTAPI MmAllocateHostTablePage (
+	PULONG64 PhysicalAddress
+)
+{
+	PHYSICAL_ADDRESS PagePA;
+	PVOID Page;
+
+	Page = HvMmAllocatePages(1, &PagePA, 'LMPH', NULL);
+	*PhysicalAddress = PagePA.QuadPart;
+	return Page;
+}
+
+/**
+ * effects: Build the host PML4 and its direct physical map.
+ */
+static NTSTATUS NTAPI MmInitHostPageTables (
+)
+{
+	PHYSICAL_ADDRESS SystemPml4PA;
+	PULONG64 SystemPml4;
+	ULONG32 eax, ebx, ecx = 0, edx;
+	BOOLEAN b1GbPages;
+	ULONG32 Result;
+
+	SystemPml4PA.QuadPart = RegGetCr3() & HOSTPG_PFN_MASK;
+	SystemPml4 = (PULONG64) MmGetVirtualForPhysical(SystemPml4PA);
+	if (!SystemPml4)
+		return STATUS_UNSUCCESSFUL;
+
+	// CPUID.80000001H:EDX.Page1GB[bit 26]
+	MadDog_GetCpuIdInfo(0x80000001, &eax, &ebx, &ecx, &edx);
+	b1GbPages = (edx & (1 << 26)) != 0;
+
+	// Pages of a half-built map are left to MmAPMFinalize().
+	Result = HpBuild(&g_HostTables, SystemPml4, MmGetPhysicalMapSize(), b1GbPages, MmAllocateHostTablePage);
+	if (Result == HOSTPG_NO_SLOT)
+	{
+		DbgPrint("MmInitHostPageTables(): No free kernel PML4 slot for the physical map\n");
+		return STATUS_UNSUCCESSFUL;
+	}
+	if (Result != HOSTPG_OK)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	DbgPrint("MmInitHostPageTables(): Host PML4 PA 0x%llx, %lluGB of physical memory at 0x%llx with %s pages, slot %u\n",
+		g_HostTables.Pml4PA, g_HostTables.PhysicalMapSize / HOSTPG_PAGE_1GB, g_HostTables.PhysicalMapBase,
+		b1GbPages ? "1GB" : "2MB", g_HostTables.Slot);
+	return STATUS_SUCCESS;
+}
+
+/**
+ * effects: Give the host the kernel PML4 entries the guest has added
+ * since the host page tables were built.
+ */
+VOID NTAPI HvMmSyncHostPageTables (
+)
+{
+	HpSyncKernelHalf(&g_HostTables);
+}
+#endif
+
 /**
  * effects: Initialize the memory manager.
  */
@@ -31,6 +135,10 @@ NTSTATUS NTAPI HvMmInitManager (
 	NTSTATUS Status;
 
 	Status = MmAPMInit();
+#ifdef _AMD64_
+	if (NT_SUCCESS(Status))
+		Status = MmInitHostPageTables();
+#endif
 	return Status;
 }
 
@@ -175,27 +283,54 @@ NTSTATUS NTAPI HvMmShutdownManager (
 {
 	NTSTATUS Status;
 
+#ifdef _AMD64_
+	// The host page tables were tracked by the APM and go with it.
+	HpRelease(&g_HostTables);
+	RtlZeroMemory(&g_HostTables, sizeof (g_HostTables));
+#endif
+
 	Status = MmAPMFinalize();
-	
 	return Status;
 }
 
 /**
  * effects: Return the value of Host CR3
  */
-ULONG NTAPI HvMmGetHostCR3 (
+ULONG_PTR NTAPI HvMmGetHostCR3 (
 )
 {
+#ifdef _AMD64_
+	if (g_HostTables.Pml4)
+		return (ULONG_PTR) g_HostTables.Pml4PA;
+#endif
 	return RegGetCr3();
 }
 
 /**
  * effects: Return the origin value of Guest CR3 before install the hypervisor
  */
-ULONG NTAPI HvMmGetOriginGuestCR3 (
+ULONG_PTR NTAPI HvMmGetOriginGuestCR3 (
 )
 {
 	return RegGetCr3();
 }
 
+/**
+ * effects: Return the host virtual address of <PhysicalAddress>.
+ * On amd64 this is a lookup in the direct map, so it is safe in VM exit
+ * handlers; on x86 the host shares the guest's mappings and asks the kernel.
+ */
+PVOID NTAPI HvMmHostPhysicalToVirtual (
+  PHYSICAL_ADDRESS PhysicalAddress
+)
+{
+#ifdef _AMD64_
+	if (!g_HostTables.PhysicalMapBase || (ULONG64) PhysicalAddress.QuadPart >= g_HostTables.PhysicalMapSize)
+		return NULL;
+	return (PVOID) (g_HostTables.PhysicalMapBase + (ULONG_PTR) PhysicalAddress.QuadPart);
+#else
+	return MmGetVirtualForPhysical(PhysicalAddress);
+#endif
+}
+
 #endif
\ No newline at end of file
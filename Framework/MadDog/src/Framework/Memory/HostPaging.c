@@ -0,0 +1,125 @@
+#include "Memory/HostPaging.h"
+
+#ifdef HOSTPG_USER_MODE
+#define HpCompareExchange(Entry, Exchange, Comparand)	__sync_val_compare_and_swap (Entry, Comparand, Exchange)
+#else
+#define HpCompareExchange(Entry, Exchange, Comparand)	\
+	(ULONG64) InterlockedCompareExchange64 ((volatile LONG64 *) (Entry), (LONG64) (Exchange), (LONG64) (Comparand))
+#endif
+
+/**
+ * effects: Claim the highest kernel slot of <GuestPml4> that is empty, by putting the marker in it.
+ * The kernel may fill a slot at any time, so the claim is a compare-exchange against 0.
+ * returns: The slot, 0 if there is none.
+ */
+static ULONG32 NTAPI HpReserveSlot (
+	PULONG64 GuestPml4
+)
+{
+	ULONG32 Slot;
+
+	for (Slot = HOSTPG_ENTRIES - 1; Slot >= HOSTPG_KERNEL_SLOT; Slot--)
+	{
+		if (!GuestPml4[Slot] && HpCompareExchange (&GuestPml4[Slot], HOSTPG_SLOT_MARKER, 0) == 0)
+			return Slot;
+	}
+	return 0;
+}
+
+ULONG32 NTAPI HpBuild (
+	PHOSTPG_TABLES Tables,
+	PULONG64 GuestPml4,
+	ULONG64 PhysicalMapSize,
+	BOOLEAN b1GbPages,
+	HOSTPG_ALLOCATE_PAGE AllocatePage
+)
+{
+	ULONG64 Pml4PA, PdptPA, PdPA;
+	PULONG64 Pml4, Pdpt, Pd;
+	ULONG32 Slot, i, j;
+
+	Slot = HpReserveSlot (GuestPml4);
+	if (!Slot)
+		return HOSTPG_NO_SLOT;
+
+	Tables->GuestPml4 = GuestPml4;
+	Tables->Slot = Slot;
+
+	Pml4 = (PULONG64) AllocatePage (&Pml4PA);
+	Pdpt = (PULONG64) AllocatePage (&PdptPA);
+	if (!Pml4 || !Pdpt)
+	{
+		HpRelease (Tables);
+		return HOSTPG_NO_MEMORY;
+	}
+
+	for (i = 0; i < PhysicalMapSize / HOSTPG_PAGE_1GB; i++)
+	{
+		if (b1GbPages)
+		{
+			Pdpt[i] = i * HOSTPG_PAGE_1GB | HOSTPG_LARGE | HOSTPG_WRITABLE | HOSTPG_PRESENT;
+			continue;
+		}
+
+		Pd = (PULONG64) AllocatePage (&PdPA);
+		if (!Pd)
+		{
+			HpRelease (Tables);
+			return HOSTPG_NO_MEMORY;
+		}
+		for (j = 0; j < HOSTPG_ENTRIES; j++)
+			Pd[j] = (i * HOSTPG_PAGE_1GB + j * HOSTPG_PAGE_2MB) | HOSTPG_LARGE | HOSTPG_WRITABLE | HOSTPG_PRESENT;
+		Pdpt[i] = PdPA | HOSTPG_WRITABLE | HOSTPG_PRESENT;
+	}
+
+	for (i = 0; i < HOSTPG_ENTRIES; i++)
+		Pml4[i] = GuestPml4[i];
+	Pml4[Slot] = PdptPA | HOSTPG_WRITABLE | HOSTPG_PRESENT;
+
+	Tables->Pml4 = Pml4;
+	Tables->Pml4PA = Pml4PA;
+	Tables->PhysicalMapSize = PhysicalMapSize;
+	// Canonical form: bits 63:48 repeat bit 47, which is set for every kernel slot.
+	Tables->PhysicalMapBase = (ULONG_PTR) (0xffff000000000000ULL | ((ULONG64) Slot << 39));
+	return HOSTPG_OK;
+}
+
+ULONG32 NTAPI HpSyncKernelHalf (
+	PHOSTPG_TABLES Tables
+)
+{
+	ULONG64 Entry, Added = 0;
+	ULONG32 i, Copied = 0;
+
+	if (!Tables->Pml4)
+		return 0;
+
+	// Almost always nothing is new, so look for it without branches first. The reserved slot is
+	// present in the host PML4 and never counts.
+	for (i = HOSTPG_KERNEL_SLOT; i < HOSTPG_ENTRIES; i++)
+		Added |= Tables->GuestPml4[i] & ~Tables->Pml4[i];
+	if (!(Added & HOSTPG_PRESENT))
+		return 0;
+
+	// The kernel neither moves nor takes away its PML4 entries, so only the ones it added are copied.
+	// A host entry that was not present cannot be cached, so no TLB flush is needed.
+	for (i = HOSTPG_KERNEL_SLOT; i < HOSTPG_ENTRIES; i++)
+	{
+		Entry = ((volatile ULONG64 *) Tables->GuestPml4)[i];
+		if (i == Tables->Slot || !(Entry & HOSTPG_PRESENT) || (Tables->Pml4[i] & HOSTPG_PRESENT))
+			continue;
+		Tables->Pml4[i] = Entry;
+		Copied++;
+	}
+	return Copied;
+}
+
+VOID NTAPI HpRelease (
+	PHOSTPG_TABLES Tables
+)
+{
+	if (Tables->Slot)
+		HpCompareExchange (&Tables->GuestPml4[Tables->Slot], 0, HOSTPG_SLOT_MARKER);
+	Tables->Slot = 0;
+	Tables->Pml4 = NULL;
+}
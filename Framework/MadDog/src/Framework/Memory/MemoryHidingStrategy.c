@@ -26,6 +26,10 @@
 
 #ifdef USE_MEMORY_MEMORYHIDING_STRATEGY 
 
+#ifdef _AMD64_
+#error "The memory hiding strategy walks 2-level x86 page tables; use USE_MEMORY_DEFAULT_STRATEGY on amd64"
+#endif
+
 //++++++++++Inner Functions++++++++++++++
 VOID NTAPI MmInvalidatePage (
   PVOID Page
@@ -1091,25 +1095,30 @@ VOID NTAPI MmHidingStrategyHideAllAllocatedGuestPages (
 /**
  * effects: Return the value of Host CR3
  */
-ULONG NTAPI HvMmGetHostCR3 (
+ULONG_PTR NTAPI HvMmGetHostCR3 (
 )
 {
-	#ifdef _X86_
-		return g_PageMapBasePhysicalAddress.LowPart;
-	#else 
-		#if defined(_AMD64_)|| defined(_IA64_)
-			return g_PageMapBasePhysicalAddress.QuadPart
-		#endif
-	#endif
+	return g_PageMapBasePhysicalAddress.LowPart;
 }
 
 /**
  * effects: Return the origin value of Guest CR3 before install the hypervisor
  */
-ULONG NTAPI HvMmGetOriginGuestCR3 (
+ULONG_PTR NTAPI HvMmGetOriginGuestCR3 (
 )
 {
 	return originGuestCR3;
 }
 
+/**
+ * effects: The host page tables of this strategy keep no map of physical
+ * memory, so there is nothing to return.
+ */
+PVOID NTAPI HvMmHostPhysicalToVirtual (
+  PHYSICAL_ADDRESS PhysicalAddress
+)
+{
+	return NULL;
+}
+
 #endif
@@ -0,0 +1,9 @@
+.CODE
+
+; MmInvalidatePage (PVOID PageVA (rcx));
+MmInvalidatePage PROC
+	invlpg	[rcx]
+	ret
+MmInvalidatePage ENDP
+
+END
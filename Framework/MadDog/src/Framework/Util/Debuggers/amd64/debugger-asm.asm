@@ -0,0 +1,24 @@
+.CODE
+
+; CmInitSpinLock (PULONG BpSpinLock (rcx));
+CmInitSpinLock PROC
+	and	dword ptr [rcx], 0
+	ret
+CmInitSpinLock ENDP
+
+
+CmAcquireSpinLock PROC
+loop_down:
+	lock	bts dword ptr [rcx], 0
+	jb	loop_down
+	ret
+CmAcquireSpinLock ENDP
+
+
+CmReleaseSpinLock PROC
+	lock	btr dword ptr [rcx], 0
+	ret
+CmReleaseSpinLock ENDP
+
+
+END
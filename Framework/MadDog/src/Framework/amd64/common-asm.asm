@@ -0,0 +1,181 @@
+EXTERN	 HvmSubvertCpu:PROC
+EXTERN	 HvmResumeGuest:PROC
+
+
+; rax is pushed first, so the failure path of CmSubvert can drop its slot
+; and return HvmSubvertCpu's status in rax.
+CM_SAVE_ALL_NOSEGREGS MACRO
+        push rax
+        push rcx
+        push rdx
+        push rbx
+        push rbp
+        push rsi
+        push rdi
+        push r8
+        push r9
+        push r10
+        push r11
+        push r12
+        push r13
+        push r14
+        push r15
+ENDM
+
+; The 64-bit forms (REX.W) of FXSAVE/FXRSTOR/XSAVE/XSAVEOPT/XRSTOR [rcx],
+; so the full x87 instruction and operand pointers are kept.
+cm_fxsave64_rcx MACRO
+	BYTE	48h, 0Fh, 0AEh, 001h
+ENDM
+
+cm_fxrstor64_rcx MACRO
+	BYTE	48h, 0Fh, 0AEh, 009h
+ENDM
+
+cm_xsave64_rcx MACRO
+	BYTE	48h, 0Fh, 0AEh, 021h
+ENDM
+
+cm_xsaveopt64_rcx MACRO
+	BYTE	48h, 0Fh, 0AEh, 031h
+ENDM
+
+cm_xrstor64_rcx MACRO
+	BYTE	48h, 0Fh, 0AEh, 029h
+ENDM
+
+CM_RESTORE_ALL_BUT_RAX MACRO
+        pop r15
+        pop r14
+        pop r13
+        pop r12
+        pop r11
+        pop r10
+        pop r9
+        pop r8
+        pop rdi
+        pop rsi
+        pop rbp
+        pop rbx
+        pop rdx
+        pop rcx
+ENDM
+
+
+.CODE
+
+CmCli PROC
+	cli
+	ret
+CmCli  ENDP
+
+CmSti PROC
+	sti
+	ret
+CmSti ENDP
+
+CmDebugBreak PROC
+	int	3
+	ret
+CmDebugBreak ENDP
+
+CmClts PROC
+	clts
+	ret
+CmClts ENDP
+
+
+; CmReloadGdtr (PVOID GdtBase (rcx), ULONG GdtLimit (rdx) );
+
+CmReloadGdtr PROC
+	push	rcx
+	shl	rdx, 48
+	push	rdx
+	lgdt	fword ptr [rsp+6]	; 10-byte pseudo-descriptor: limit, then the 64-bit base
+	pop	rax
+	pop	rax
+	ret
+CmReloadGdtr ENDP
+
+; CmReloadIdtr (PVOID IdtBase (rcx), ULONG IdtLimit (rdx) );
+
+CmReloadIdtr PROC
+	push	rcx
+	shl	rdx, 48
+	push	rdx
+	lidt	fword ptr [rsp+6]
+	pop	rax
+	pop	rax
+	ret
+CmReloadIdtr ENDP
+
+; CmFxsave (PVOID Area (rcx));
+CmFxsave PROC
+	cm_fxsave64_rcx
+	ret
+CmFxsave ENDP
+
+; CmFxrstor (PVOID Area (rcx));
+CmFxrstor PROC
+	cm_fxrstor64_rcx
+	ret
+CmFxrstor ENDP
+
+; CmXsave (PVOID Area (rcx), ULONG64 Mask (rdx));
+CmXsave PROC
+	mov	rax, rdx
+	shr	rdx, 32
+	cm_xsave64_rcx
+	ret
+CmXsave ENDP
+
+; CmXsaveopt (PVOID Area (rcx), ULONG64 Mask (rdx));
+CmXsaveopt PROC
+	mov	rax, rdx
+	shr	rdx, 32
+	cm_xsaveopt64_rcx
+	ret
+CmXsaveopt ENDP
+
+; CmXrstor (PVOID Area (rcx), ULONG64 Mask (rdx));
+CmXrstor PROC
+	mov	rax, rdx
+	shr	rdx, 32
+	cm_xrstor64_rcx
+	ret
+CmXrstor ENDP
+
+; CmSubvert (PVOID  GuestRsp);
+;
+; Entered with rsp 8 mod 16. The 15 pushes and the 20h of shadow space
+; leave rsp aligned for the call, and the same rsp becomes the guest's
+; rsp in CmSlipIntoMatrix, so HvmResumeGuest is called aligned too.
+CmSubvert PROC
+
+	CM_SAVE_ALL_NOSEGREGS
+	sub	rsp, 20h
+
+	mov	rcx, rsp
+	call	HvmSubvertCpu
+
+	; only reached when the processor could not be subverted
+	add	rsp, 20h
+	CM_RESTORE_ALL_BUT_RAX
+	add	rsp, 8
+	ret
+
+CmSubvert ENDP
+
+; CmSlipIntoMatrix (PVOID  GuestRsp);
+CmSlipIntoMatrix PROC
+
+	call	HvmResumeGuest
+
+	add	rsp, 20h
+	CM_RESTORE_ALL_BUT_RAX
+	pop	rax
+	ret
+
+CmSlipIntoMatrix ENDP
+
+END
@@ -0,0 +1,41 @@
+.CODE
+
+; GetCpuIdInfo (ULONG32 fn (rcx), PULONG32 ret_eax (rdx), PULONG32 ret_ebx (r8),
+;	PULONG32 ret_ecx (r9), PULONG32 ret_edx ([rsp+28h]) );
+;
+; As on i386, *ret_ecx is the subleaf passed in.
+GetCpuIdInfo PROC
+	push	rbx
+	mov	r10, rdx
+	mov	r11, [rsp+30h]		; ret_edx, above the pushed rbx
+
+	mov	eax, ecx
+	mov	ecx, dword ptr [r9]
+	cpuid
+
+	mov	[r10], eax
+	mov	[r8], ebx
+	mov	[r9], ecx
+	mov	[r11], edx
+
+	pop	rbx
+	ret
+GetCpuIdInfo ENDP
+
+
+; CpuidWithEcxEdx (PULONG32 ecx (rcx), PULONG32 edx (rdx));
+CpuidWithEcxEdx PROC
+	mov	r9, rcx
+	mov	r10, rdx
+
+	mov	ecx, dword ptr [rcx]
+	mov	edx, dword ptr [rdx]
+	push	rbx
+	cpuid
+	pop	rbx
+	mov	[r9], ecx
+	mov	[r10], edx
+	ret
+CpuidWithEcxEdx ENDP
+
+END
@@ -0,0 +1,316 @@
+; /*
+;   * amd64 counterpart of i386\vmx-asm.asm.
+;   *
+;   * Same entry points, Microsoft x64 calling convention: the first
+;   * arguments come in rcx, rdx, r8, r9 and there is no @N decoration.
+;   */
+
+EXTERN	 HvmEventCallback:PROC
+EXTERN	 PtVmxNestedEntryFailed:PROC
+
+vmx_call MACRO
+	BYTE	0Fh, 01h, 0C1h
+ENDM
+
+vmx_clear MACRO
+	BYTE	066h, 0Fh, 0C7h
+ENDM
+
+vmx_ptrld MACRO
+	BYTE	0Fh, 0C7h
+ENDM
+
+vmx_ptrst MACRO
+	BYTE	0Fh, 0C7h
+ENDM
+
+vmx_read MACRO
+	BYTE	0Fh, 078h
+ENDM
+
+vmx_write MACRO
+	BYTE	0Fh, 079h
+ENDM
+
+vmx_on MACRO
+	BYTE	0F3h, 0Fh, 0C7h
+ENDM
+
+vmx_off MACRO
+	BYTE	0Fh, 01h, 0C4h
+ENDM
+
+vmx_resume MACRO
+	BYTE	0Fh, 01h, 0C3h
+ENDM
+
+vmx_launch MACRO
+	BYTE	0Fh, 01h, 0C2h
+ENDM
+
+
+
+MODRM_EAX_06 MACRO   ;/* [RAX], with reg/opcode: /6 */
+	BYTE	030h
+ENDM
+
+MODRM_EAX_07 MACRO   ;/* [RAX], with reg/opcode: /7 */
+	BYTE	038h
+ENDM
+
+MODRM_EAX_ECX MACRO  ;/* [RAX], [RCX] */
+	BYTE	0C1h
+ENDM
+
+
+; Must stay in sync with GUEST_REGS (HvCoreTypes.h): rax is at the lowest
+; address, rflags at the highest. The slot order of rax..r15 is the
+; general-purpose register numbering used by the exit qualifications.
+HVM_SAVE_ALL_NOSEGREGS MACRO
+	pushfq
+        push r15
+        push r14
+        push r13
+        push r12
+        push r11
+        push r10
+        push r9
+        push r8
+        push rdi
+        push rsi
+        push rbp
+        push rbp ;        push rsp
+        push rbx
+        push rdx
+        push rcx
+        push rax
+ENDM
+
+HVM_RESTORE_ALL_NOSEGREGS MACRO
+        pop rax
+        pop rcx
+        pop rdx
+        pop rbx
+        pop rbp ;        pop rsp
+        pop rbp
+        pop rsi
+        pop rdi
+        pop r8
+        pop r9
+        pop r10
+        pop r11
+        pop r12
+        pop r13
+        pop r14
+        pop r15
+        popfq
+ENDM
+
+; The x64 ABI lets compiled code clobber xmm0-xmm5 and MXCSR without saving
+; them, and the C handlers do (memcpy, RtlCopyMemory, struct copies). They
+; are the guest's, so they are saved around every call out of the exit
+; handler, 16-byte aligned above the 28h of shadow space the call needs.
+; Expects rsp 8 bytes off 16-byte alignment, as after the 17 pushes of
+; HVM_SAVE_ALL_NOSEGREGS, and leaves it aligned for the call.
+HVM_SAVE_VOLATILE_XMM MACRO
+	sub	rsp,98h
+	movdqa	xmmword ptr [rsp + 30h],xmm0
+	movdqa	xmmword ptr [rsp + 40h],xmm1
+	movdqa	xmmword ptr [rsp + 50h],xmm2
+	movdqa	xmmword ptr [rsp + 60h],xmm3
+	movdqa	xmmword ptr [rsp + 70h],xmm4
+	movdqa	xmmword ptr [rsp + 80h],xmm5
+	stmxcsr	dword ptr [rsp + 90h]
+ENDM
+
+HVM_RESTORE_VOLATILE_XMM MACRO
+	ldmxcsr	dword ptr [rsp + 90h]
+	movdqa	xmm0,xmmword ptr [rsp + 30h]
+	movdqa	xmm1,xmmword ptr [rsp + 40h]
+	movdqa	xmm2,xmmword ptr [rsp + 50h]
+	movdqa	xmm3,xmmword ptr [rsp + 60h]
+	movdqa	xmm4,xmmword ptr [rsp + 70h]
+	movdqa	xmm5,xmmword ptr [rsp + 80h]
+	add	rsp,98h
+ENDM
+
+
+.CODE
+
+;void vmxPtrld(u64 addr (rcx))
+VmxPtrld PROC
+	push rcx
+	mov rax,rsp
+	vmx_ptrld
+	MODRM_EAX_06
+	pop rcx
+	ret
+VmxPtrld ENDP
+
+;void vmxPtrst(u64 addr (rcx))
+VmxPtrst PROC
+	push rcx
+	mov rax,rsp
+	vmx_ptrst
+	MODRM_EAX_07
+	pop rcx
+	ret
+VmxPtrst ENDP
+
+;void vmxClear(u64 addr (rcx))
+VmxClear PROC
+	push rcx
+	mov rax,rsp
+	vmx_clear
+	MODRM_EAX_06
+	pop rcx
+	ret
+VmxClear ENDP
+
+; vmxRead(field (rcx)), the whole natural-width field comes back in rax
+VmxRead PROC
+	mov rax,rcx
+	vmx_read
+	MODRM_EAX_ECX  ;read value stored in rcx
+	mov rax,rcx
+	ret
+VmxRead ENDP
+
+; void vmxWrite(field (rcx), value (rdx))
+VmxWrite PROC
+	mov rax,rcx
+	mov rcx,rdx
+	vmx_write
+	MODRM_EAX_ECX
+	ret
+VmxWrite ENDP
+
+;_vmxOff()
+VmxTurnOff PROC
+	vmx_off
+	ret
+VmxTurnOff ENDP
+
+;void vmxOn(u64 addr (rcx))
+VmxTurnOn PROC
+	push rcx
+	mov rax,rsp
+	vmx_on
+	MODRM_EAX_06
+	pop rcx
+	ret
+VmxTurnOn ENDP
+
+;VmxVmCall(ULONG32 HypercallNumber (ecx))
+VmxVmCall PROC
+	mov edx,ecx
+	vmx_call
+	ret
+VmxVmCall ENDP
+
+
+;get_cr4()
+get_cr4 PROC
+	mov rax,cr4
+	ret
+get_cr4 ENDP
+
+; void set_in_cr4(ULONG32 mask (ecx)), the upper half of rcx is undefined
+set_in_cr4 PROC
+	mov ecx,ecx
+	mov rax,cr4
+	or  rax,rcx
+	mov cr4,rax
+	ret
+set_in_cr4 ENDP
+
+; void clear_in_cr4(ULONG32 mask (ecx))
+clear_in_cr4 PROC
+	mov ecx,ecx
+	mov rax,cr4
+	not rcx
+	and rax,rcx
+	mov cr4,rax
+	ret
+clear_in_cr4 ENDP
+
+
+VmxLaunch PROC
+	vmx_launch
+	ret
+VmxLaunch ENDP
+
+VmxResume PROC
+	vmx_resume
+	ret
+VmxResume ENDP
+
+; ULONG_PTR VmxInvept(ULONG_PTR Type (rcx), PVOID Descriptor (rdx)), returns the rflags it leaves
+VmxInvept PROC
+	BYTE	066h, 0Fh, 038h, 080h, 0Ah	;invept rcx,[rdx]
+	pushfq
+	pop	rax
+	ret
+VmxInvept ENDP
+
+; ULONG_PTR VmxInvvpid(ULONG_PTR Type (rcx), PVOID Descriptor (rdx)), returns the rflags it leaves
+VmxInvvpid PROC
+	BYTE	066h, 0Fh, 038h, 081h, 0Ah	;invvpid rcx,[rdx]
+	pushfq
+	pop	rax
+	ret
+VmxInvvpid ENDP
+
+
+; Host stack on entry (HOST_RSP, see VmxSetupVMCS):
+;
+; [rsp]	PCPU, stored by PtVmxVirtualize
+;
+; After the 17 pushes the CPU pointer is at [rsp+88h]. HOST_RSP is 16-byte
+; aligned, so 17 pushes plus the 98h of HVM_SAVE_VOLATILE_XMM leave rsp
+; aligned at the call, as the x64 ABI wants.
+
+;
+; HvmEventCallback() returns nonzero when the VMCS to continue with is clear,
+; a vmcs02 entered for the first time. If that entry fails, the stack is as
+; it was on entry again and PtVmxNestedEntryFailed() reports it to the guest
+; hypervisor, whose vmcs01 it makes current to resume instead.
+
+;HvmEventCallback (PCPU Cpu (rcx), PGUEST_REGS GuestRegs (rdx))
+VmxVmexitHandler PROC
+	HVM_SAVE_ALL_NOSEGREGS
+
+	mov     rcx,[rsp + 88h]     ;PCPU
+	mov 	rdx,rsp		;GuestRegs
+	HVM_SAVE_VOLATILE_XMM
+
+	call	HvmEventCallback
+
+	HVM_RESTORE_VOLATILE_XMM
+	test	al,al
+	jnz	VmxVmexitLaunch
+	HVM_RESTORE_ALL_NOSEGREGS
+	vmx_resume
+	jmp	VmxVmexitFailed
+
+VmxVmexitLaunch:
+	HVM_RESTORE_ALL_NOSEGREGS
+	vmx_launch
+
+VmxVmexitFailed:
+	HVM_SAVE_ALL_NOSEGREGS
+
+	mov     rcx,[rsp + 88h]     ;PCPU
+	mov 	rdx,rsp		;GuestRegs
+	HVM_SAVE_VOLATILE_XMM
+
+	call	PtVmxNestedEntryFailed
+
+	HVM_RESTORE_VOLATILE_XMM
+	HVM_RESTORE_ALL_NOSEGREGS
+	vmx_resume
+	ret
+
+VmxVmexitHandler ENDP
+
+END
@@ -86,4 +86,25 @@ NTSTATUS NTAPI MadDog_RegisterTrap (
 )
 {
 	return TrRegisterTrap(Cpu, Trap);
+}
+
+/**
+ * effects: Deregister trap struct.
+ */
+NTSTATUS NTAPI MadDog_DeregisterTrap (
+  PCPU Cpu,
+  PNBP_TRAP Trap
+)
+{
+	return TrDeregisterTrap(Cpu, Trap);
+}
+
+/**
+ * effects: Reserve trap sets for updates from VMX root mode.
+ */
+NTSTATUS NTAPI MadDog_ReserveTrapSets (
+  ULONG Count
+)
+{
+	return TrReserveSets(Count);
 }
\ No newline at end of file
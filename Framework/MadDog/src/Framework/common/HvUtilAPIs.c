@@ -51,13 +51,15 @@ NTSTATUS NTAPI MadDog_InitializeSegmentSelector (
     pSegmentSelector->limit = SegDesc->limit0 | (SegDesc->limit1attr1 & 0xf) << 16;
     pSegmentSelector->attributes.UCHARs = SegDesc->attr0 | (SegDesc->limit1attr1 & 0xf0) << 4;
 
-    //if (!(SegDesc->attr0 & LA_STANDARD)) 
-    //{
-    //    ULONG64 tmp;
-    //    // this is a TSS or callgate etc, save the base high part
-    //    tmp = (*(PULONG64) ((PUCHAR) SegDesc + 8));
-    //    SegmentSelector->base = (SegmentSelector->base & 0xffffffff) | (tmp << 32);
-    //}
+#ifdef _AMD64_
+    if (!pSegmentSelector->attributes.fields.s) 
+    {
+        ULONG64 tmp;
+        // this is a TSS or callgate etc, save the base high part
+        tmp = (*(PULONG64) ((PUCHAR) SegDesc + 8));
+        pSegmentSelector->base = (pSegmentSelector->base & 0xffffffff) | (tmp << 32);
+    }
+#endif
 
     if (pSegmentSelector->attributes.fields.g) 
     {
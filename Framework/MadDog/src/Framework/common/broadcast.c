@@ -0,0 +1,108 @@
+#include "broadcast.h"
+
+/*
+ * One broadcast at a time. The poster fills in the handler and bumps <BcSequence>; every CPU
+ * compares it with the sequence in its own mailbox at each VM Exit and runs the handler once.
+ * Mailboxes are written by their owner only and sit on separate cache lines.
+ */
+#define BC_IDLE			0
+#define BC_POSTING		1
+#define BC_IN_FLIGHT	2
+
+typedef struct _BC_MAILBOX
+{
+	volatile LONG Done;//Sequence of the last broadcast this CPU ran
+	ULONG32 Reserved;
+	ULONG64 Result;
+	UCHAR Pad[48];
+} BC_MAILBOX,*PBC_MAILBOX;
+
+static volatile LONG BcState = BC_IDLE;
+static volatile LONG BcSequence;
+static MADDOG_BROADCAST_HANDLER BcHandler;
+static ULONG32 BcArgument;
+static ULONG32 BcTargetMask;
+static ULONG64 BcPostTsc;
+static BC_MAILBOX BcMailboxes[MADDOG_BROADCAST_MAX_CPUS];
+
+VOID NTAPI BcPollMailbox (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs
+)
+{
+	PBC_MAILBOX Mailbox;
+	MADDOG_BROADCAST_HANDLER Handler;
+	ULONG32 Argument;
+	LONG Sequence;
+
+	if (BcState != BC_IN_FLIGHT || Cpu->ProcessorNumber >= MADDOG_BROADCAST_MAX_CPUS)
+		return;
+
+	Mailbox = &BcMailboxes[Cpu->ProcessorNumber];
+	Sequence = BcSequence;
+	if (Mailbox->Done == Sequence)
+		return;
+	Handler = BcHandler;
+	Argument = BcArgument;
+	// the broadcast may have timed out and been released meanwhile
+	if (BcState != BC_IN_FLIGHT || BcSequence != Sequence)
+		return;
+
+	Mailbox->Result = Handler (Cpu, GuestRegs, Argument);
+	InterlockedExchange (&Mailbox->Done, Sequence);
+}
+
+NTSTATUS NTAPI MadDog_Broadcast (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	MADDOG_BROADCAST_HANDLER Handler,
+	ULONG32 Argument,
+	ULONG64 Timeout,
+	PMADDOG_BROADCAST_RESULT Result
+)
+{
+	ULONG32 i;
+	LONG Sequence;
+
+	if (!Cpu || !Handler || !Result)
+		return STATUS_INVALID_PARAMETER;
+
+	if (InterlockedCompareExchange (&BcState, BC_POSTING, BC_IDLE) == BC_IDLE)
+	{
+		BcHandler = Handler;
+		BcArgument = Argument;
+		BcTargetMask = KeNumberProcessors >= MADDOG_BROADCAST_MAX_CPUS ? 
+			0xffffffff : (1 << KeNumberProcessors) - 1;
+		BcPostTsc = RegGetTSC ();
+		InterlockedIncrement (&BcSequence);
+		InterlockedExchange (&BcState, BC_IN_FLIGHT);
+	}
+	else if (BcState != BC_IN_FLIGHT || BcHandler != Handler || BcArgument != Argument)
+	{
+		return STATUS_DEVICE_BUSY;
+	}
+	BcPollMailbox (Cpu, GuestRegs);
+
+	RtlZeroMemory (Result, sizeof (MADDOG_BROADCAST_RESULT));
+	Sequence = BcSequence;
+	for (i = 0; i < MADDOG_BROADCAST_MAX_CPUS; i++)
+	{
+		if (!(BcTargetMask & (1 << i)) || BcMailboxes[i].Done != Sequence)
+			continue;
+		Result->CpuMask |= 1 << i;
+		Result->CpuCount++;
+		Result->PerCpu[i] = BcMailboxes[i].Result;
+		Result->Sum += BcMailboxes[i].Result;
+	}
+
+	if (Result->CpuMask != BcTargetMask && RegGetTSC () - BcPostTsc < Timeout)
+		return STATUS_PENDING;
+
+	InterlockedCompareExchange (&BcState, BC_IDLE, BC_IN_FLIGHT);
+	if (Result->CpuMask != BcTargetMask)
+	{
+		Print(("MadDog_Broadcast(): Timed out, CPU mask 0x%x of 0x%x\n", Result->CpuMask, BcTargetMask));
+		return STATUS_TIMEOUT;
+	}
+	return STATUS_SUCCESS;
+}
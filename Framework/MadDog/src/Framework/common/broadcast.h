@@ -0,0 +1,11 @@
+#pragma once
+#include "common.h"
+#include "HvCore.h"
+
+/**
+ * effects: Run the broadcast in flight on <Cpu> unless it already did. Called at every VM Exit.
+ */
+VOID NTAPI BcPollMailbox (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs
+);
@@ -70,11 +70,12 @@ NTSTATUS NTAPI CmDeliverToProcessor (
 }
 
 // generate binary code
+// On amd64 the GP registers get "mov r64, imm64" (REX.W, plus REX.B for r8-r15).
 NTSTATUS NTAPI CmGenerateMovReg (
   PUCHAR pCode,
   PULONG pGeneratedCodeLength,
   ULONG Register,
-  ULONG Value
+  ULONG_PTR Value
 )
 { //Finished
     ULONG uCodeLength;
@@ -84,6 +85,21 @@ NTSTATUS NTAPI CmGenerateMovReg (
 
     switch (Register & ~REG_MASK) 
     {
+#ifdef _AMD64_
+    case REG_GP:
+        pCode[0] = 0x48;
+        pCode[1] = 0xb8 | (UCHAR) (Register & REG_MASK);
+        memcpy (&pCode[2], &Value, 8);
+        uCodeLength = 10;
+        break;
+
+    case REG_GP_ADDITIONAL:
+        pCode[0] = 0x49;
+        pCode[1] = 0xb8 | (UCHAR) (Register & REG_MASK);
+        memcpy (&pCode[2], &Value, 8);
+        uCodeLength = 10;
+        break;
+#else
     case REG_GP:
         pCode[0] = 0xb8 | (UCHAR) (Register & REG_MASK);
         memcpy (&pCode[1], &Value, 4);
@@ -95,6 +111,7 @@ NTSTATUS NTAPI CmGenerateMovReg (
         memcpy (&pCode[1], &Value, 4);
         uCodeLength = 5;
         break;
+#endif
 
     case REG_CONTROL:
         uCodeLength = *pGeneratedCodeLength;
@@ -149,4 +166,19 @@ NTSTATUS NTAPI CmGenerateIretd (
     *pGeneratedCodeLength += 1;
 
     return STATUS_SUCCESS;
-};
\ No newline at end of file
+};
+
+NTSTATUS NTAPI CmGenerateIretq (
+    PUCHAR pCode,
+    PULONG pGeneratedCodeLength
+)
+{
+    if (!pCode || !pGeneratedCodeLength)
+        return STATUS_INVALID_PARAMETER;
+
+    pCode[0] = 0x48;
+    pCode[1] = 0xcf;
+    *pGeneratedCodeLength += 2;
+
+    return STATUS_SUCCESS;
+}
\ No newline at end of file
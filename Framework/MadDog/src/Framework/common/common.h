@@ -91,6 +91,15 @@
 #define REG_RSI	REG_GP | 6
 #define REG_RDI	REG_GP | 7
 
+#define REG_R8	REG_GP_ADDITIONAL | 0
+#define REG_R9	REG_GP_ADDITIONAL | 1
+#define REG_R10	REG_GP_ADDITIONAL | 2
+#define REG_R11	REG_GP_ADDITIONAL | 3
+#define REG_R12	REG_GP_ADDITIONAL | 4
+#define REG_R13	REG_GP_ADDITIONAL | 5
+#define REG_R14	REG_GP_ADDITIONAL | 6
+#define REG_R15	REG_GP_ADDITIONAL | 7
+
 #define REG_CR0	REG_CONTROL | 0
 #define REG_CR2	REG_CONTROL | 2
 #define REG_CR3	REG_CONTROL | 3
@@ -240,6 +249,9 @@ VOID NTAPI CmSti (
 VOID NTAPI CmDebugBreak (
 );
 
+VOID NTAPI CmClts (
+);
+
 VOID NTAPI CmWbinvd (
 );
 
@@ -329,11 +341,34 @@ NTSTATUS NTAPI CmSubvert (
   PVOID
 );
 
+VOID NTAPI CmFxsave (
+  PVOID Area
+);
+
+VOID NTAPI CmFxrstor (
+  PVOID Area
+);
+
+VOID NTAPI CmXsave (
+  PVOID Area,
+  ULONG64 Mask
+);
+
+VOID NTAPI CmXsaveopt (
+  PVOID Area,
+  ULONG64 Mask
+);
+
+VOID NTAPI CmXrstor (
+  PVOID Area,
+  ULONG64 Mask
+);
+
 NTSTATUS NTAPI CmGenerateMovReg (
   PUCHAR pCode,
   PULONG pGeneratedCodeLength,
   ULONG Register,
-  ULONG Value
+  ULONG_PTR Value
 );
 
 NTSTATUS NTAPI CmGeneratePushReg (
@@ -345,4 +380,9 @@ NTSTATUS NTAPI CmGeneratePushReg (
 NTSTATUS NTAPI CmGenerateIretd (
     PUCHAR pCode,
     PULONG pGeneratedCodeLength
+);
+
+NTSTATUS NTAPI CmGenerateIretq (
+    PUCHAR pCode,
+    PULONG pGeneratedCodeLength
 );
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "crc32c.h"
+
+#ifdef _MSC_VER
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#else
+#include <nmmintrin.h>
+#define CRC32C_SSE42	__attribute__ ((target ("sse4.2")))
+#endif
+
+#if defined (_M_X64) || defined (_M_AMD64) || defined (__x86_64__)
+#define CRC32C_WORD				ULONG64
+#define CRC32C_STEP(Crc, p)		((ULONG32) _mm_crc32_u64 ((Crc), *(const ULONG64 *) (p)))
+#else
+#define CRC32C_WORD				ULONG32
+#define CRC32C_STEP(Crc, p)		_mm_crc32_u32 ((Crc), *(const ULONG32 *) (p))
+#endif
+
+#define CRC32C_POLY				0x82F63B78
+#define CRC32C_LANE				1360	//Three lanes cover 4080 bytes of a page, multiple of 8
+
+static ULONG32 Crc32cTable[8][256];
+static ULONG32 Crc32cLaneShift;//x^(8*CRC32C_LANE) mod P, moves a CRC past one lane
+static BOOLEAN Crc32cHardware;
+
+/**
+ * effects: a*b modulo the CRC32C polynomial, both in the reflected bit order.
+ */
+static ULONG32 NTAPI Crc32cMultiply (
+  ULONG32 a,
+  ULONG32 b
+)
+{
+	ULONG32 m = 1u << 31, p = 0;
+
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * effects: CRC32C of A followed by B, from the CRCs of A and of B, B being CRC32C_LANE bytes long.
+ */
+static ULONG32 NTAPI Crc32cCombineLane (
+  ULONG32 CrcA,
+  ULONG32 CrcB
+)
+{
+	return Crc32cMultiply (Crc32cLaneShift, CrcA) ^ CrcB;
+}
+
+/**
+ * effects: Run the CRC register <Crc> (pre-inverted) over <Length> bytes, eight at a time.
+ */
+static ULONG32 NTAPI Crc32cSoftware (
+  ULONG32 Crc,
+  const UCHAR *p,
+  SIZE_T Length
+)
+{
+	ULONG32 Low, High;
+
+	for (; Length && ((SIZE_T) p & 7); Length--)
+		Crc = Crc32cTable[0][(Crc ^ *p++) & 0xff] ^ (Crc >> 8);
+
+	for (; Length >= 8; Length -= 8, p += 8)
+	{
+		Low = Crc ^ *(const ULONG32 *) p;
+		High = *(const ULONG32 *) (p + 4);
+		Crc = Crc32cTable[7][Low & 0xff] ^ Crc32cTable[6][(Low >> 8) & 0xff] ^
+			Crc32cTable[5][(Low >> 16) & 0xff] ^ Crc32cTable[4][Low >> 24] ^
+			Crc32cTable[3][High & 0xff] ^ Crc32cTable[2][(High >> 8) & 0xff] ^
+			Crc32cTable[1][(High >> 16) & 0xff] ^ Crc32cTable[0][High >> 24];
+	}
+
+	for (; Length; Length--)
+		Crc = Crc32cTable[0][(Crc ^ *p++) & 0xff] ^ (Crc >> 8);
+	return Crc;
+}
+
+CRC32C_SSE42 static ULONG32 NTAPI Crc32cInstruction (
+  ULONG32 Crc,
+  const UCHAR *p,
+  SIZE_T Length
+)
+{
+	for (; Length && ((SIZE_T) p & (sizeof (CRC32C_WORD) - 1)); Length--)
+		Crc = _mm_crc32_u8 (Crc, *p++);
+
+	for (; Length >= sizeof (CRC32C_WORD); Length -= sizeof (CRC32C_WORD), p += sizeof (CRC32C_WORD))
+		Crc = CRC32C_STEP (Crc, p);
+
+	for (; Length; Length--)
+		Crc = _mm_crc32_u8 (Crc, *p++);
+	return Crc;
+}
+
+/**
+ * effects: One CRC32 instruction has a latency of 3 cycles but issues every cycle, so three
+ * independent lanes keep it busy. The lane CRCs are merged with Crc32cCombineLane().
+ */
+CRC32C_SSE42 static ULONG32 NTAPI Crc32cInstructionPage (
+  const UCHAR *Page
+)
+{
+	ULONG32 a = 0xffffffff, b = 0xffffffff, c = 0xffffffff, Crc;
+	SIZE_T i;
+
+	for (i = 0; i < CRC32C_LANE; i += sizeof (CRC32C_WORD))
+	{
+		a = CRC32C_STEP (a, Page + i);
+		b = CRC32C_STEP (b, Page + CRC32C_LANE + i);
+		c = CRC32C_STEP (c, Page + 2 * CRC32C_LANE + i);
+	}
+	Crc = Crc32cCombineLane (Crc32cCombineLane (~a, ~b), ~c);
+	return ~Crc32cInstruction (~Crc, Page + 3 * CRC32C_LANE, CRC32C_PAGE_SIZE - 3 * CRC32C_LANE);
+}
+
+VOID NTAPI Crc32cInitialize (
+  BOOLEAN UseHardware
+)
+{
+	ULONG32 i, j, Crc;
+
+	for (i = 0; i < 256; i++)
+	{
+		Crc = i;
+		for (j = 0; j < 8; j++)
+			Crc = Crc & 1 ? (Crc >> 1) ^ CRC32C_POLY : Crc >> 1;
+		Crc32cTable[0][i] = Crc;
+	}
+	for (i = 0; i < 256; i++)
+	{
+		for (j = 1; j < 8; j++)
+			Crc32cTable[j][i] = (Crc32cTable[j - 1][i] >> 8) ^ Crc32cTable[0][Crc32cTable[j - 1][i] & 0xff];
+	}
+
+	//x^0 is the top bit in the reflected order, each byte multiplies by x^8
+	Crc32cLaneShift = 1u << 31;
+	for (i = 0; i < CRC32C_LANE; i++)
+		Crc32cLaneShift = Crc32cMultiply (Crc32cLaneShift, 1u << 23);
+
+	Crc32cHardware = UseHardware;
+}
+
+ULONG32 NTAPI Crc32c (
+  ULONG32 Crc,
+  const VOID *Buffer,
+  SIZE_T Length
+)
+{
+	if (Crc32cHardware)
+		return ~Crc32cInstruction (~Crc, (const UCHAR *) Buffer, Length);
+	return ~Crc32cSoftware (~Crc, (const UCHAR *) Buffer, Length);
+}
+
+ULONG32 NTAPI Crc32cPage (
+  const VOID *Page
+)
+{
+	if (Crc32cHardware)
+		return Crc32cInstructionPage ((const UCHAR *) Page);
+	return ~Crc32cSoftware (0xffffffff, (const UCHAR *) Page, CRC32C_PAGE_SIZE);
+}
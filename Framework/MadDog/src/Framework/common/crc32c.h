@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * CRC32C (Castagnoli), reflected, as computed by the SSE4.2 CRC32 instruction.
+ * Builds in the framework and, with CRC32C_USER_MODE defined, in user-mode tools.
+ */
+#ifdef CRC32C_USER_MODE
+#include <stddef.h>
+typedef unsigned char UCHAR;
+typedef unsigned char BOOLEAN;
+typedef unsigned int ULONG32;
+typedef unsigned long long ULONG64;
+typedef size_t SIZE_T;
+#define VOID	void
+#define NTAPI
+#define TRUE	1
+#define FALSE	0
+#else
+#include <ntddk.h>
+#endif
+
+#define CRC32C_PAGE_SIZE	4096
+
+/**
+ * effects: Build the lookup tables. With <UseHardware> (the caller checked CPUID.1:ECX.SSE4_2[bit 20])
+ * Crc32c() and Crc32cPage() use the CRC32 instruction, otherwise slicing-by-8 tables.
+ * The CRC32 instruction works on general registers only, so no SIMD state is touched either way.
+ */
+VOID NTAPI Crc32cInitialize (
+  BOOLEAN UseHardware
+);
+
+/**
+ * effects: Continue the CRC32C <Crc> (0 for a new one) over <Length> bytes at <Buffer>.
+ */
+ULONG32 NTAPI Crc32c (
+  ULONG32 Crc,
+  const VOID *Buffer,
+  SIZE_T Length
+);
+
+/**
+ * effects: CRC32C of the CRC32C_PAGE_SIZE bytes at <Page>, same value as Crc32c (0, Page, CRC32C_PAGE_SIZE).
+ * The hardware path runs three independent streams over the page and merges them.
+ */
+ULONG32 NTAPI Crc32cPage (
+  const VOID *Page
+);
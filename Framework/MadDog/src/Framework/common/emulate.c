@@ -0,0 +1,1070 @@
+#include "emulate.h"
+
+/*
+ * The decoder turns an instruction into one EMU_INSTRUCTION: an operation, a register operand (Reg),
+ * an r/m operand that is a register (Rm) or an address (Base, Index, Scale, Displacement), and an
+ * optional immediate. Every supported instruction fits that shape, so EmuExecute() only needs the
+ * operation to pick a source and a destination. Anything else is EMU_UNSUPPORTED and is left to the
+ * caller, who still has the exit qualification to fall back on.
+ */
+#define EMU_PREFIX_OPERAND		0x01
+#define EMU_PREFIX_ADDRESS		0x02
+#define EMU_PREFIX_LOCK			0x04
+
+#define EMU_NO_SEGMENT			0xFF
+
+typedef struct _EMU_READER
+{
+	const UCHAR *Bytes;
+	ULONG32 Available;
+	ULONG32 Offset;
+	BOOLEAN Truncated;
+} EMU_READER,*PEMU_READER;
+
+typedef struct _EMU_OPERAND
+{
+	BOOLEAN Memory;
+	UCHAR Reg;
+	ULONG64 Address;//Linear
+} EMU_OPERAND,*PEMU_OPERAND;
+
+static ULONG64 NTAPI EmuNext (
+  PEMU_READER Reader,
+  ULONG32 Size
+)
+{
+	ULONG64 Value = 0;
+	ULONG32 i;
+
+	if (Reader->Offset + Size > Reader->Available || Reader->Offset + Size > EMU_MAX_INSTRUCTION)
+	{
+		Reader->Truncated = TRUE;
+		return 0;
+	}
+	for (i = 0; i < Size; i++)
+		Value |= (ULONG64) Reader->Bytes[Reader->Offset + i] << (i * 8);
+	Reader->Offset += Size;
+	return Value;
+}
+
+static ULONG64 NTAPI EmuMask (
+  ULONG32 Size
+)
+{
+	return Size == 8 ? ~(ULONG64) 0 : ((ULONG64) 1 << (Size * 8)) - 1;
+}
+
+static ULONG64 NTAPI EmuSignExtend (
+  ULONG64 Value,
+  ULONG32 Size
+)
+{
+	ULONG64 Sign;
+
+	if (Size == 8)
+		return Value;
+	Sign = (ULONG64) 1 << (Size * 8 - 1);
+	Value &= EmuMask (Size);
+	return (Value ^ Sign) - Sign;
+}
+
+/**
+ * effects: Decode ModRM, SIB and displacement. Reg and Rm get the REX extensions; a memory operand
+ * gets its default segment, SS for the forms based on RSP or RBP.
+ */
+static VOID NTAPI EmuDecodeModRm (
+  PEMU_READER Reader,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	static const UCHAR Base16[8] = { EMU_RBX, EMU_RBX, EMU_RBP, EMU_RBP, EMU_RSI, EMU_RDI, EMU_RBP, EMU_RBX };
+	static const UCHAR Index16[8] = { EMU_RSI, EMU_RDI, EMU_RSI, EMU_RDI, EMU_NO_REGISTER, EMU_NO_REGISTER,
+		EMU_NO_REGISTER, EMU_NO_REGISTER };
+	UCHAR ModRm, Sib, Mod, Rm, Rex = Instruction->Rex;
+	UCHAR DefaultSegment = EMU_DS;
+
+	ModRm = (UCHAR) EmuNext (Reader, 1);
+	Mod = ModRm >> 6;
+	Rm = ModRm & 7;
+	Instruction->Reg = ((ModRm >> 3) & 7) | ((Rex & 4) << 1);
+	Instruction->Base = EMU_NO_REGISTER;
+	Instruction->Index = EMU_NO_REGISTER;
+	Instruction->Scale = 1;
+	Instruction->Displacement = 0;
+
+	if (Mod == 3)
+	{
+		Instruction->HasMemory = FALSE;
+		Instruction->Rm = Rm | ((Rex & 1) << 3);
+		return;
+	}
+	Instruction->HasMemory = TRUE;
+
+	if (Instruction->AddressSize == 2)
+	{
+		if (Mod == 0 && Rm == 6)
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 2), 2);
+		else
+		{
+			Instruction->Base = Base16[Rm];
+			Instruction->Index = Index16[Rm];
+			if (Instruction->Base == EMU_RBP)
+				DefaultSegment = EMU_SS;
+		}
+		if (Mod == 1)
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 1), 1);
+		else if (Mod == 2)
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 2), 2);
+	}
+	else
+	{
+		if (Rm == 4)
+		{
+			Sib = (UCHAR) EmuNext (Reader, 1);
+			Instruction->Scale = 1 << (Sib >> 6);
+			Instruction->Index = ((Sib >> 3) & 7) | ((Rex & 2) << 2);
+			if (Instruction->Index == EMU_RSP)
+				Instruction->Index = EMU_NO_REGISTER;
+			Rm = Sib & 7;
+			if (Mod == 0 && Rm == 5)
+				Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 4), 4);
+			else
+				Instruction->Base = Rm | ((Rex & 1) << 3);
+		}
+		else if (Mod == 0 && Rm == 5)
+		{
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 4), 4);
+			Instruction->RipRelative = Instruction->Mode == EMU_MODE_64;
+		}
+		else
+			Instruction->Base = Rm | ((Rex & 1) << 3);
+
+		if (Instruction->Base == EMU_RSP || Instruction->Base == EMU_RBP)
+			DefaultSegment = EMU_SS;
+		if (Mod == 1)
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 1), 1);
+		else if (Mod == 2)
+			Instruction->Displacement = EmuSignExtend (EmuNext (Reader, 4), 4);
+	}
+
+	if (Instruction->Segment == EMU_NO_SEGMENT)
+		Instruction->Segment = DefaultSegment;
+}
+
+/**
+ * returns: TRUE for the operations LOCK may prefix.
+ */
+static BOOLEAN NTAPI EmuIsLockable (
+  PEMU_INSTRUCTION Instruction
+)
+{
+	switch (Instruction->Operation)
+	{
+	case EMU_OP_ALU:
+		return Instruction->AluOp != EMU_ALU_CMP;
+	case EMU_OP_XCHG:
+	case EMU_OP_CMPXCHG:
+	case EMU_OP_XADD:
+	case EMU_OP_INC:
+	case EMU_OP_DEC:
+	case EMU_OP_NOT:
+	case EMU_OP_NEG:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+ULONG32 NTAPI EmuDecode (
+  const UCHAR *Bytes,
+  ULONG32 Available,
+  UCHAR Mode,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	EMU_READER Reader;
+	ULONG32 Prefixes = 0, ImmediateSize = 0, i;
+	UCHAR Opcode, Group;
+	BOOLEAN ByteOp, HasModRm = TRUE, Escaped = FALSE;
+
+	if (Mode != EMU_MODE_16 && Mode != EMU_MODE_32 && Mode != EMU_MODE_64)
+		return EMU_UNSUPPORTED;
+
+	for (i = 0; i < sizeof (EMU_INSTRUCTION); i++)
+		((UCHAR *) Instruction)[i] = 0;
+	Instruction->Mode = Mode;
+	Instruction->Segment = EMU_NO_SEGMENT;
+
+	Reader.Bytes = Bytes;
+	Reader.Available = Available;
+	Reader.Offset = 0;
+	Reader.Truncated = FALSE;
+
+	// legacy prefixes, then REX, which only counts right before the opcode
+	for (;;)
+	{
+		Opcode = (UCHAR) EmuNext (&Reader, 1);
+		if (Reader.Truncated)
+			return EMU_UNSUPPORTED;
+
+		switch (Opcode)
+		{
+		case 0x66: Prefixes |= EMU_PREFIX_OPERAND; Instruction->Rex = 0; continue;
+		case 0x67: Prefixes |= EMU_PREFIX_ADDRESS; Instruction->Rex = 0; continue;
+		case 0xF0: Prefixes |= EMU_PREFIX_LOCK; Instruction->Rex = 0; continue;
+		case 0xF2:
+		case 0xF3: Instruction->Rep = Opcode; Instruction->Rex = 0; continue;
+		case 0x26: Instruction->Segment = EMU_ES; Instruction->Rex = 0; continue;
+		case 0x2E: Instruction->Segment = EMU_CS; Instruction->Rex = 0; continue;
+		case 0x36: Instruction->Segment = EMU_SS; Instruction->Rex = 0; continue;
+		case 0x3E: Instruction->Segment = EMU_DS; Instruction->Rex = 0; continue;
+		case 0x64: Instruction->Segment = EMU_FS; Instruction->Rex = 0; continue;
+		case 0x65: Instruction->Segment = EMU_GS; Instruction->Rex = 0; continue;
+		}
+		if (Mode == EMU_MODE_64 && (Opcode & 0xF0) == 0x40)
+		{
+			Instruction->Rex = Opcode;
+			continue;
+		}
+		break;
+	}
+
+	if (Mode == EMU_MODE_64 && (Instruction->Segment == EMU_ES || Instruction->Segment == EMU_CS
+		|| Instruction->Segment == EMU_SS || Instruction->Segment == EMU_DS))
+		Instruction->Segment = EMU_NO_SEGMENT;
+
+	if (Instruction->Rex & 8)
+		Instruction->OperandSize = 8;
+	else if (Prefixes & EMU_PREFIX_OPERAND)
+		Instruction->OperandSize = Mode == EMU_MODE_16 ? 4 : 2;
+	else
+		Instruction->OperandSize = Mode == EMU_MODE_16 ? 2 : 4;
+
+	if (Prefixes & EMU_PREFIX_ADDRESS)
+		Instruction->AddressSize = Mode == EMU_MODE_32 ? 2 : 4;
+	else
+		Instruction->AddressSize = Mode;
+
+	ByteOp = FALSE;
+	if (Opcode == 0x0F)
+	{
+		Escaped = TRUE;
+		Opcode = (UCHAR) EmuNext (&Reader, 1);
+		switch (Opcode)
+		{
+		case 0xB0: case 0xB1:
+			Instruction->Operation = EMU_OP_CMPXCHG;
+			ByteOp = Opcode == 0xB0;
+			break;
+		case 0xC0: case 0xC1:
+			Instruction->Operation = EMU_OP_XADD;
+			ByteOp = Opcode == 0xC0;
+			break;
+		case 0xB6: case 0xB7:
+		case 0xBE: case 0xBF:
+			Instruction->Operation = Opcode >= 0xBE ? EMU_OP_MOVSX : EMU_OP_MOVZX;
+			Instruction->SourceSize = Opcode & 1 ? 2 : 1;
+			Instruction->ToRegister = TRUE;
+			break;
+		default:
+			return EMU_UNSUPPORTED;
+		}
+	}
+	else if (Opcode < 0x40 && (Opcode & 7) < 6)
+	{
+		// ADD OR ADC SBB AND SUB XOR CMP: r/m,r  r,r/m  rAX,imm
+		Instruction->Operation = EMU_OP_ALU;
+		Instruction->AluOp = Opcode >> 3;
+		ByteOp = !(Opcode & 1);
+		Instruction->ToRegister = (Opcode & 7) == 2 || (Opcode & 7) == 3;
+		if ((Opcode & 7) >= 4)
+		{
+			HasModRm = FALSE;
+			Instruction->Rm = EMU_RAX;
+			ImmediateSize = ByteOp ? 1 : 4;
+		}
+	}
+	else
+	{
+		switch (Opcode)
+		{
+		case 0x63:
+			if (Mode != EMU_MODE_64)
+				return EMU_UNSUPPORTED;
+			Instruction->Operation = EMU_OP_MOVSX;
+			Instruction->SourceSize = 4;
+			Instruction->ToRegister = TRUE;
+			break;
+		case 0x80: case 0x81: case 0x83:
+			Instruction->Operation = EMU_OP_ALU;
+			ByteOp = Opcode == 0x80;
+			ImmediateSize = Opcode == 0x81 ? 4 : 1;
+			break;
+		case 0x84: case 0x85:
+			Instruction->Operation = EMU_OP_TEST;
+			ByteOp = Opcode == 0x84;
+			break;
+		case 0xA8: case 0xA9:
+			Instruction->Operation = EMU_OP_TEST;
+			ByteOp = Opcode == 0xA8;
+			HasModRm = FALSE;
+			Instruction->Rm = EMU_RAX;
+			ImmediateSize = ByteOp ? 1 : 4;
+			break;
+		case 0x86: case 0x87:
+			Instruction->Operation = EMU_OP_XCHG;
+			ByteOp = Opcode == 0x86;
+			break;
+		case 0x88: case 0x89: case 0x8A: case 0x8B:
+			Instruction->Operation = EMU_OP_MOV;
+			ByteOp = !(Opcode & 1);
+			Instruction->ToRegister = (Opcode & 2) != 0;
+			break;
+		case 0xC6: case 0xC7:
+			Instruction->Operation = EMU_OP_MOV;
+			ByteOp = Opcode == 0xC6;
+			ImmediateSize = ByteOp ? 1 : 4;
+			break;
+		case 0xA0: case 0xA1: case 0xA2: case 0xA3:
+			// moffs: an absolute address as wide as the address size, in the default data segment
+			Instruction->Operation = EMU_OP_MOV;
+			ByteOp = !(Opcode & 1);
+			Instruction->ToRegister = Opcode < 0xA2;
+			Instruction->Reg = EMU_RAX;
+			Instruction->HasMemory = TRUE;
+			Instruction->Base = EMU_NO_REGISTER;
+			Instruction->Index = EMU_NO_REGISTER;
+			Instruction->Scale = 1;
+			Instruction->Displacement = EmuNext (&Reader, Instruction->AddressSize);
+			if (Instruction->Segment == EMU_NO_SEGMENT)
+				Instruction->Segment = EMU_DS;
+			HasModRm = FALSE;
+			break;
+		case 0xA4: case 0xA5:
+			Instruction->Operation = EMU_OP_MOVS;
+			ByteOp = Opcode == 0xA4;
+			HasModRm = FALSE;
+			break;
+		case 0xAA: case 0xAB:
+			Instruction->Operation = EMU_OP_STOS;
+			ByteOp = Opcode == 0xAA;
+			HasModRm = FALSE;
+			break;
+		case 0xAC: case 0xAD:
+			Instruction->Operation = EMU_OP_LODS;
+			ByteOp = Opcode == 0xAC;
+			HasModRm = FALSE;
+			break;
+		case 0x6C: case 0x6D:
+			Instruction->Operation = EMU_OP_INS;
+			ByteOp = Opcode == 0x6C;
+			HasModRm = FALSE;
+			break;
+		case 0x6E: case 0x6F:
+			Instruction->Operation = EMU_OP_OUTS;
+			ByteOp = Opcode == 0x6E;
+			HasModRm = FALSE;
+			break;
+		case 0xE4: case 0xE5: case 0xEC: case 0xED:
+		case 0xE6: case 0xE7: case 0xEE: case 0xEF:
+			Instruction->Operation = Opcode & 2 ? EMU_OP_OUT : EMU_OP_IN;
+			ByteOp = !(Opcode & 1);
+			HasModRm = FALSE;
+			if (Opcode < 0xE8)
+			{
+				Instruction->HasImmediate = TRUE;
+				Instruction->Immediate = EmuNext (&Reader, 1);
+			}
+			break;
+		case 0xF6: case 0xF7:
+		case 0xFE: case 0xFF:
+			// the operation is in ModRM.reg, decoded below
+			ByteOp = !(Opcode & 1);
+			break;
+		default:
+			return EMU_UNSUPPORTED;
+		}
+	}
+
+	if (ByteOp)
+		Instruction->OperandSize = 1;
+	if (HasModRm)
+		EmuDecodeModRm (&Reader, Instruction);
+
+	// groups: the register field of ModRM selects the operation
+	Group = Instruction->Reg & 7;
+	switch (Escaped ? 0 : Opcode)
+	{
+	case 0x80: case 0x81: case 0x83:
+		Instruction->AluOp = Group;
+		break;
+	case 0xC6: case 0xC7:
+		if (Instruction->Operation == EMU_OP_MOV && Group)
+			return EMU_UNSUPPORTED;
+		break;
+	case 0xF6: case 0xF7:
+		if (Group == 0)
+		{
+			Instruction->Operation = EMU_OP_TEST;
+			ImmediateSize = ByteOp ? 1 : 4;
+		}
+		else if (Group == 2)
+			Instruction->Operation = EMU_OP_NOT;
+		else if (Group == 3)
+			Instruction->Operation = EMU_OP_NEG;
+		else
+			return EMU_UNSUPPORTED;
+		break;
+	case 0xFE: case 0xFF:
+		if (Group == 0)
+			Instruction->Operation = EMU_OP_INC;
+		else if (Group == 1)
+			Instruction->Operation = EMU_OP_DEC;
+		else
+			return EMU_UNSUPPORTED;
+		break;
+	}
+
+	if (ImmediateSize)
+	{
+		if (ImmediateSize == 4 && Instruction->OperandSize == 2)
+			ImmediateSize = 2;
+		Instruction->HasImmediate = TRUE;
+		Instruction->Immediate = EmuSignExtend (EmuNext (&Reader, ImmediateSize), ImmediateSize)
+			& EmuMask (Instruction->OperandSize);
+	}
+
+	if (Reader.Truncated)
+		return EMU_UNSUPPORTED;
+	// LOCK is only valid on the memory destination of a read-modify-write, XCHG is locked without it
+	if (Prefixes & EMU_PREFIX_LOCK)
+	{
+		if (!Instruction->HasMemory || Instruction->ToRegister || !EmuIsLockable (Instruction))
+			return EMU_UNSUPPORTED;
+		Instruction->Lock = TRUE;
+	}
+	if (Instruction->Operation == EMU_OP_XCHG && Instruction->HasMemory)
+		Instruction->Lock = TRUE;
+	if (Instruction->Segment == EMU_NO_SEGMENT)
+		Instruction->Segment = EMU_DS;
+
+	Instruction->Length = (UCHAR) Reader.Offset;
+	for (i = 0; i < Reader.Offset; i++)
+		Instruction->Bytes[i] = Bytes[i];
+	return EMU_OK;
+}
+
+//+++++++++++++++++++++Execution+++++++++++++++++++++++++++
+
+static ULONG64 NTAPI EmuReadRegister (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  UCHAR Reg,
+  ULONG32 Size
+)
+{
+	// without REX, byte registers 4-7 are AH CH DH BH
+	if (Size == 1 && !Instruction->Rex && Reg >= 4 && Reg < 8)
+		return (State->Regs[Reg - 4] >> 8) & 0xFF;
+	return State->Regs[Reg] & EmuMask (Size);
+}
+
+static VOID NTAPI EmuWriteRegister (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  UCHAR Reg,
+  ULONG32 Size,
+  ULONG64 Value
+)
+{
+	if (Size == 1 && !Instruction->Rex && Reg >= 4 && Reg < 8)
+		State->Regs[Reg - 4] = (State->Regs[Reg - 4] & ~(ULONG64) 0xFF00) | ((Value & 0xFF) << 8);
+	else if (Size >= 4)
+		// a 32-bit write clears the upper half
+		State->Regs[Reg] = Value & EmuMask (Size);
+	else
+		State->Regs[Reg] = (State->Regs[Reg] & ~EmuMask (Size)) | (Value & EmuMask (Size));
+}
+
+/**
+ * effects: Linear address of <Offset> in <Segment>, wrapped to the address size outside 64-bit mode.
+ */
+static ULONG64 NTAPI EmuLinear (
+  PEMU_STATE State,
+  UCHAR Segment,
+  ULONG64 Offset,
+  ULONG32 AddressSize
+)
+{
+	Offset &= EmuMask (AddressSize);
+	if (State->Mode == EMU_MODE_64)
+		return Segment == EMU_FS || Segment == EMU_GS ? Offset + State->SegmentBase[Segment] : Offset;
+	return (Offset + State->SegmentBase[Segment]) & 0xFFFFFFFF;
+}
+
+static VOID NTAPI EmuResolveRm (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  PEMU_OPERAND Operand
+)
+{
+	ULONG64 Offset;
+
+	Operand->Memory = Instruction->HasMemory;
+	Operand->Reg = Instruction->Rm;
+	if (!Instruction->HasMemory)
+		return;
+
+	Offset = Instruction->Displacement;
+	if (Instruction->Base != EMU_NO_REGISTER)
+		Offset += State->Regs[Instruction->Base];
+	if (Instruction->Index != EMU_NO_REGISTER)
+		Offset += State->Regs[Instruction->Index] * Instruction->Scale;
+	if (Instruction->RipRelative)
+		Offset += State->Rip + Instruction->Length;
+	Operand->Address = EmuLinear (State, Instruction->Segment, Offset, Instruction->AddressSize);
+}
+
+static BOOLEAN NTAPI EmuLoad (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  PEMU_OPERAND Operand,
+  ULONG32 Size,
+  PULONG64 Value
+)
+{
+	if (!Operand->Memory)
+	{
+		*Value = EmuReadRegister (State, Instruction, Operand->Reg, Size);
+		return TRUE;
+	}
+	*Value = 0;
+	// little endian: the low bytes of *Value are the operand
+	return State->AccessMemory (State->Context, Operand->Address, Value, Size, FALSE);
+}
+
+static BOOLEAN NTAPI EmuStore (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  PEMU_OPERAND Operand,
+  ULONG32 Size,
+  ULONG64 Value
+)
+{
+	if (!Operand->Memory)
+	{
+		EmuWriteRegister (State, Instruction, Operand->Reg, Size, Value);
+		return TRUE;
+	}
+	return State->AccessMemory (State->Context, Operand->Address, &Value, Size, TRUE);
+}
+
+static ULONG64 NTAPI EmuResultFlags (
+  ULONG64 Flags,
+  ULONG32 Size,
+  ULONG64 Result
+)
+{
+	ULONG32 Parity = (ULONG32) Result & 0xFF;
+
+	Parity ^= Parity >> 4;
+	Parity ^= Parity >> 2;
+	Parity ^= Parity >> 1;
+	if (!(Parity & 1))
+		Flags |= EMU_PF;
+	if (!Result)
+		Flags |= EMU_ZF;
+	if (Result & ((ULONG64) 1 << (Size * 8 - 1)))
+		Flags |= EMU_SF;
+	return Flags;
+}
+
+/**
+ * effects: <A> <AluOp> <B> on <Size> bytes, with the status flags of the hardware in State->Rflags.
+ * AF is left clear by the logical operations, where the hardware leaves it undefined.
+ */
+static ULONG64 NTAPI EmuAlu (
+  PEMU_STATE State,
+  UCHAR AluOp,
+  ULONG32 Size,
+  ULONG64 A,
+  ULONG64 B
+)
+{
+	ULONG64 Mask = EmuMask (Size), Sign = (ULONG64) 1 << (Size * 8 - 1);
+	ULONG64 Result, Carry, Flags;
+
+	A &= Mask;
+	B &= Mask;
+	Carry = State->Rflags & EMU_CF ? 1 : 0;
+	Flags = State->Rflags & ~(ULONG64) EMU_STATUS_FLAGS;
+
+	switch (AluOp)
+	{
+	case EMU_ALU_ADD:
+	case EMU_ALU_ADC:
+		if (AluOp == EMU_ALU_ADD)
+			Carry = 0;
+		Result = (A + B + Carry) & Mask;
+		if (Result < A || (Carry && Result == A))
+			Flags |= EMU_CF;
+		if ((A ^ Result) & (B ^ Result) & Sign)
+			Flags |= EMU_OF;
+		Flags |= (A ^ B ^ Result) & EMU_AF;
+		break;
+	case EMU_ALU_SUB:
+	case EMU_ALU_SBB:
+	case EMU_ALU_CMP:
+		if (AluOp != EMU_ALU_SBB)
+			Carry = 0;
+		Result = (A - B - Carry) & Mask;
+		if (Carry ? A <= B : A < B)
+			Flags |= EMU_CF;
+		if ((A ^ B) & (A ^ Result) & Sign)
+			Flags |= EMU_OF;
+		Flags |= (A ^ B ^ Result) & EMU_AF;
+		break;
+	case EMU_ALU_OR:
+		Result = A | B;
+		break;
+	case EMU_ALU_AND:
+		Result = A & B;
+		break;
+	default:
+		Result = A ^ B;
+		break;
+	}
+
+	State->Rflags = EmuResultFlags (Flags, Size, Result);
+	return Result;
+}
+
+/**
+ * effects: Add <Delta> elements of <Size> to the string pointer <Reg>, backwards if DF is set.
+ * Only the address-size part of the register moves.
+ */
+static VOID NTAPI EmuAdvancePointer (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction,
+  UCHAR Reg,
+  ULONG32 Size
+)
+{
+	ULONG64 Value = State->Regs[Reg];
+
+	Value = State->Rflags & EMU_DF ? Value - Size : Value + Size;
+	EmuWriteRegister (State, Instruction, Reg, Instruction->AddressSize, Value);
+}
+
+/**
+ * effects: MOVS STOS LODS INS OUTS, one element or a REP of them. The source of MOVS LODS OUTS is in
+ * the segment of the instruction, the destination of MOVS STOS INS is always ES.
+ */
+static ULONG32 NTAPI EmuExecuteString (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	ULONG32 Size = Instruction->OperandSize, Done = 0;
+	ULONG64 Count, Value, Source, Destination;
+	ULONG32 PortValue;
+	USHORT Port = (USHORT) State->Regs[EMU_RDX];
+	BOOLEAN Ok;
+
+	if ((Instruction->Operation == EMU_OP_INS || Instruction->Operation == EMU_OP_OUTS) && Size == 8)
+		Size = 4;
+
+	Count = Instruction->Rep ? State->Regs[EMU_RCX] & EmuMask (Instruction->AddressSize) : 1;
+	while (Count)
+	{
+		if (Instruction->Rep && State->MaxRepeat && Done == State->MaxRepeat)
+			return EMU_REPEAT;
+
+		Source = EmuLinear (State, Instruction->Segment, State->Regs[EMU_RSI], Instruction->AddressSize);
+		Destination = EmuLinear (State, EMU_ES, State->Regs[EMU_RDI], Instruction->AddressSize);
+		Value = 0;
+
+		switch (Instruction->Operation)
+		{
+		case EMU_OP_MOVS:
+			Ok = State->AccessMemory (State->Context, Source, &Value, Size, FALSE)
+				&& State->AccessMemory (State->Context, Destination, &Value, Size, TRUE);
+			break;
+		case EMU_OP_STOS:
+			Value = State->Regs[EMU_RAX];
+			Ok = State->AccessMemory (State->Context, Destination, &Value, Size, TRUE);
+			break;
+		case EMU_OP_LODS:
+			Ok = State->AccessMemory (State->Context, Source, &Value, Size, FALSE);
+			if (Ok)
+				EmuWriteRegister (State, Instruction, EMU_RAX, Size, Value);
+			break;
+		case EMU_OP_INS:
+			PortValue = 0;
+			Ok = State->AccessPort (State->Context, Port, &PortValue, Size, FALSE);
+			Value = PortValue;
+			Ok = Ok && State->AccessMemory (State->Context, Destination, &Value, Size, TRUE);
+			break;
+		default:
+			Ok = State->AccessMemory (State->Context, Source, &Value, Size, FALSE);
+			PortValue = (ULONG32) Value;
+			Ok = Ok && State->AccessPort (State->Context, Port, &PortValue, Size, TRUE);
+			break;
+		}
+		if (!Ok)
+			return EMU_ACCESS_FAILED;
+
+		if (Instruction->Operation == EMU_OP_MOVS || Instruction->Operation == EMU_OP_LODS
+			|| Instruction->Operation == EMU_OP_OUTS)
+			EmuAdvancePointer (State, Instruction, EMU_RSI, Size);
+		if (Instruction->Operation != EMU_OP_LODS && Instruction->Operation != EMU_OP_OUTS)
+			EmuAdvancePointer (State, Instruction, EMU_RDI, Size);
+
+		Count--;
+		Done++;
+		if (Instruction->Rep)
+			EmuWriteRegister (State, Instruction, EMU_RCX, Instruction->AddressSize, Count);
+	}
+	return EMU_OK;
+}
+
+/**
+ * effects: Execute <Instruction> on <State>, leaving whatever it got to if an access fails.
+ */
+static VOID NTAPI EmuNextInstruction (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	State->Rip += Instruction->Length;
+	if (State->Mode != EMU_MODE_64)
+		State->Rip &= 0xFFFFFFFF;
+}
+
+/**
+ * effects: Execute the locked <Instruction> as a compare-exchange loop on its memory operand: compute
+ * the result from the value read, store it only if the operand still holds that value, and start over
+ * from the new value if it does not. The registers are written once the store is done.
+ */
+static ULONG32 NTAPI EmuRunLocked (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	EMU_OPERAND Rm;
+	ULONG32 Size = Instruction->OperandSize;
+	ULONG64 A, B, Result, Original, Rflags = State->Rflags;
+
+	if (!State->CompareExchange)
+		return EMU_UNSUPPORTED;
+
+	EmuResolveRm (State, Instruction, &Rm);
+	if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+		return EMU_ACCESS_FAILED;
+	B = Instruction->HasImmediate ? Instruction->Immediate : EmuReadRegister (State, Instruction, Instruction->Reg, Size);
+
+	for (;;)
+	{
+		State->Rflags = Rflags;
+		switch (Instruction->Operation)
+		{
+		case EMU_OP_ALU:
+			Result = EmuAlu (State, Instruction->AluOp, Size, A, B);
+			break;
+		case EMU_OP_XADD:
+			Result = EmuAlu (State, EMU_ALU_ADD, Size, A, B);
+			break;
+		case EMU_OP_INC:
+		case EMU_OP_DEC:
+			// CF is kept
+			Result = EmuAlu (State, Instruction->Operation == EMU_OP_INC ? EMU_ALU_ADD : EMU_ALU_SUB, Size, A, 1);
+			State->Rflags = (State->Rflags & ~(ULONG64) EMU_CF) | (Rflags & EMU_CF);
+			break;
+		case EMU_OP_NOT:
+			Result = ~A & EmuMask (Size);
+			break;
+		case EMU_OP_NEG:
+			Result = EmuAlu (State, EMU_ALU_SUB, Size, 0, A);
+			break;
+		case EMU_OP_XCHG:
+			Result = B;
+			break;
+		default:
+			// CMPXCHG, a locked one writes the destination back unchanged when it differs
+			EmuAlu (State, EMU_ALU_CMP, Size, State->Regs[EMU_RAX], A);
+			Result = State->Rflags & EMU_ZF ? B : A;
+			break;
+		}
+
+		if (!State->CompareExchange (State->Context, Rm.Address, A, Result, Size, &Original))
+			return EMU_ACCESS_FAILED;
+		if (Original == A)
+			break;
+		A = Original;
+	}
+
+	switch (Instruction->Operation)
+	{
+	case EMU_OP_XADD:
+	case EMU_OP_XCHG:
+		EmuWriteRegister (State, Instruction, Instruction->Reg, Size, A);
+		break;
+	case EMU_OP_CMPXCHG:
+		if (!(State->Rflags & EMU_ZF))
+			EmuWriteRegister (State, Instruction, EMU_RAX, Size, A);
+		break;
+	}
+
+	EmuNextInstruction (State, Instruction);
+	return EMU_OK;
+}
+
+static ULONG32 NTAPI EmuRun (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	EMU_OPERAND Rm, Reg, *Destination, *Source;
+	ULONG32 Size = Instruction->OperandSize, PortValue, Status;
+	ULONG64 A, B, Result, Carry;
+
+	EmuResolveRm (State, Instruction, &Rm);
+	Reg.Memory = FALSE;
+	Reg.Reg = Instruction->Reg;
+	Reg.Address = 0;
+	Destination = Instruction->ToRegister ? &Reg : &Rm;
+	Source = Instruction->ToRegister ? &Rm : &Reg;
+
+	switch (Instruction->Operation)
+	{
+	case EMU_OP_MOV:
+		if (Instruction->HasImmediate)
+			B = Instruction->Immediate;
+		else if (!EmuLoad (State, Instruction, Source, Size, &B))
+			return EMU_ACCESS_FAILED;
+		if (!EmuStore (State, Instruction, Destination, Size, B))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_MOVZX:
+	case EMU_OP_MOVSX:
+		if (!EmuLoad (State, Instruction, &Rm, Instruction->SourceSize, &B))
+			return EMU_ACCESS_FAILED;
+		if (Instruction->Operation == EMU_OP_MOVSX)
+			B = EmuSignExtend (B, Instruction->SourceSize);
+		EmuWriteRegister (State, Instruction, Instruction->Reg, Size, B);
+		break;
+
+	case EMU_OP_ALU:
+	case EMU_OP_TEST:
+		if (!EmuLoad (State, Instruction, Destination, Size, &A))
+			return EMU_ACCESS_FAILED;
+		if (Instruction->HasImmediate)
+			B = Instruction->Immediate;
+		else if (!EmuLoad (State, Instruction, Source, Size, &B))
+			return EMU_ACCESS_FAILED;
+		Result = EmuAlu (State, Instruction->Operation == EMU_OP_TEST ? EMU_ALU_AND : Instruction->AluOp, Size, A, B);
+		if (Instruction->Operation == EMU_OP_ALU && Instruction->AluOp != EMU_ALU_CMP
+			&& !EmuStore (State, Instruction, Destination, Size, Result))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_XCHG:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		B = EmuReadRegister (State, Instruction, Instruction->Reg, Size);
+		if (!EmuStore (State, Instruction, &Rm, Size, B))
+			return EMU_ACCESS_FAILED;
+		EmuWriteRegister (State, Instruction, Instruction->Reg, Size, A);
+		break;
+
+	case EMU_OP_CMPXCHG:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		EmuAlu (State, EMU_ALU_CMP, Size, State->Regs[EMU_RAX], A);
+		if (State->Rflags & EMU_ZF)
+		{
+			B = EmuReadRegister (State, Instruction, Instruction->Reg, Size);
+			if (!EmuStore (State, Instruction, &Rm, Size, B))
+				return EMU_ACCESS_FAILED;
+		}
+		else
+		{
+			// the hardware writes the destination back unchanged, which matters for MMIO
+			if (Rm.Memory && !EmuStore (State, Instruction, &Rm, Size, A))
+				return EMU_ACCESS_FAILED;
+			EmuWriteRegister (State, Instruction, EMU_RAX, Size, A);
+		}
+		break;
+
+	case EMU_OP_XADD:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		B = EmuReadRegister (State, Instruction, Instruction->Reg, Size);
+		Result = EmuAlu (State, EMU_ALU_ADD, Size, A, B);
+		EmuWriteRegister (State, Instruction, Instruction->Reg, Size, A);
+		if (!EmuStore (State, Instruction, &Rm, Size, Result))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_INC:
+	case EMU_OP_DEC:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		// CF is kept
+		Carry = State->Rflags & EMU_CF;
+		Result = EmuAlu (State, Instruction->Operation == EMU_OP_INC ? EMU_ALU_ADD : EMU_ALU_SUB, Size, A, 1);
+		State->Rflags = (State->Rflags & ~(ULONG64) EMU_CF) | Carry;
+		if (!EmuStore (State, Instruction, &Rm, Size, Result))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_NOT:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		if (!EmuStore (State, Instruction, &Rm, Size, ~A))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_NEG:
+		if (!EmuLoad (State, Instruction, &Rm, Size, &A))
+			return EMU_ACCESS_FAILED;
+		Result = EmuAlu (State, EMU_ALU_SUB, Size, 0, A);
+		if (!EmuStore (State, Instruction, &Rm, Size, Result))
+			return EMU_ACCESS_FAILED;
+		break;
+
+	case EMU_OP_IN:
+	case EMU_OP_OUT:
+		if (Size == 8)
+			Size = 4;
+		PortValue = (ULONG32) State->Regs[EMU_RAX];
+		if (!State->AccessPort (State->Context,
+			(USHORT) (Instruction->HasImmediate ? Instruction->Immediate : State->Regs[EMU_RDX]),
+			&PortValue, Size, Instruction->Operation == EMU_OP_OUT))
+			return EMU_ACCESS_FAILED;
+		if (Instruction->Operation == EMU_OP_IN)
+			EmuWriteRegister (State, Instruction, EMU_RAX, Size, PortValue);
+		break;
+
+	default:
+		Status = EmuExecuteString (State, Instruction);
+		if (Status != EMU_OK)
+			return Status;
+		break;
+	}
+
+	EmuNextInstruction (State, Instruction);
+	return EMU_OK;
+}
+
+ULONG32 NTAPI EmuExecute (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+)
+{
+	ULONG64 Regs[16], Rflags = State->Rflags;
+	ULONG32 Status, i;
+	BOOLEAN String;
+
+	if (Instruction->Mode != State->Mode)
+		return EMU_UNSUPPORTED;
+
+	for (i = 0; i < 16; i++)
+		Regs[i] = State->Regs[i];
+
+	Status = Instruction->Lock ? EmuRunLocked (State, Instruction) : EmuRun (State, Instruction);
+	if (Status == EMU_OK || Status == EMU_UNSUPPORTED)
+		return Status;
+
+	// like a fault: the registers and flags are as before, only a string instruction keeps its progress
+	String = Instruction->Operation >= EMU_OP_MOVS && Instruction->Operation <= EMU_OP_OUTS;
+	for (i = 0; i < 16; i++)
+	{
+		if (!String || (i != EMU_RCX && i != EMU_RSI && i != EMU_RDI))
+			State->Regs[i] = Regs[i];
+	}
+	State->Rflags = Rflags;
+	return Status;
+}
+
+/**
+ * effects: Fetch up to EMU_MAX_INSTRUCTION bytes at RIP. Near the end of a mapped page the full
+ * fetch may fail while the instruction itself is shorter, so fall back to the rest of the page.
+ * returns: The number of bytes fetched.
+ */
+static ULONG32 NTAPI EmuFetch (
+  PEMU_STATE State,
+  ULONG64 Linear,
+  UCHAR *Bytes,
+  ULONG32 Size
+)
+{
+	ULONG32 ToPageEnd = 0x1000 - (ULONG32) (Linear & 0xFFF);
+
+	if (State->AccessMemory (State->Context, Linear, Bytes, Size, FALSE))
+		return Size;
+	if (ToPageEnd < Size && State->AccessMemory (State->Context, Linear, Bytes, ToPageEnd, FALSE))
+		return ToPageEnd;
+	return 0;
+}
+
+ULONG32 NTAPI EmuStep (
+  PEMU_STATE State,
+  PEMU_CACHE Cache
+)
+{
+	EMU_INSTRUCTION Decoded;
+	PEMU_INSTRUCTION Instruction = &Decoded;
+	PEMU_CACHE_ENTRY Entry = NULL;
+	UCHAR Bytes[EMU_MAX_INSTRUCTION];
+	ULONG64 Linear;
+	ULONG32 Fetched, i;
+
+	Linear = EmuLinear (State, EMU_CS, State->Rip, State->Mode == EMU_MODE_64 ? 8 : 4);
+
+	if (Cache)
+	{
+		Entry = &Cache->Entries[(ULONG32) (State->Rip ^ (State->Rip >> 7)) & (EMU_CACHE_ENTRIES - 1)];
+		if (Entry->Instruction.Length && Entry->Rip == State->Rip && Entry->Cr3 == State->Cr3
+			&& Entry->Instruction.Mode == State->Mode)
+		{
+			// the code may have changed under the same RIP, so the bytes are compared every time
+			if (!State->AccessMemory (State->Context, Linear, Bytes, Entry->Instruction.Length, FALSE))
+				return EMU_ACCESS_FAILED;
+			for (i = 0; i < Entry->Instruction.Length; i++)
+				if (Bytes[i] != Entry->Instruction.Bytes[i])
+					break;
+			if (i == Entry->Instruction.Length)
+			{
+				Cache->Hits++;
+				return EmuExecute (State, &Entry->Instruction);
+			}
+		}
+		Cache->Misses++;
+	}
+
+	Fetched = EmuFetch (State, Linear, Bytes, EMU_MAX_INSTRUCTION);
+	if (!Fetched)
+		return EMU_ACCESS_FAILED;
+	if (EmuDecode (Bytes, Fetched, State->Mode, Instruction) != EMU_OK)
+		return EMU_UNSUPPORTED;
+
+	if (Entry)
+	{
+		Entry->Rip = State->Rip;
+		Entry->Cr3 = State->Cr3;
+		Entry->Instruction = Decoded;
+		Instruction = &Entry->Instruction;
+	}
+	return EmuExecute (State, Instruction);
+}
+
+VOID NTAPI EmuFlushCache (
+  PEMU_CACHE Cache
+)
+{
+	ULONG32 i;
+
+	for (i = 0; i < EMU_CACHE_ENTRIES; i++)
+		Cache->Entries[i].Instruction.Length = 0;
+}
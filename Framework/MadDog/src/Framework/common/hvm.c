@@ -18,6 +18,9 @@
  */
  
 #include "hvm.h"
+#include "broadcast.h"
+#include "simd.h"
+#include "traps.h"
 
 static KMUTEX g_HvmMutex;
 extern PMadDog_Control g_HvmControl;
@@ -224,8 +227,8 @@ NTSTATUS NTAPI HvmSubvertCpu (
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // unchecked -8 or -4 ?
-    Cpu = (PCPU) ((PCHAR) HostKernelStackBase + HOST_STACK_SIZE_IN_PAGES * PAGE_SIZE - 4 - sizeof (CPU));
+    // keep CPU pointer-aligned, amd64 puts 8-byte fields in it
+    Cpu = (PCPU) ((PCHAR) HostKernelStackBase + HOST_STACK_SIZE_IN_PAGES * PAGE_SIZE - sizeof (ULONG_PTR) - sizeof (CPU));
     Cpu->HostStack = HostKernelStackBase;
 	Cpu->HypervisorGuestPipe = &HvGuestPipe;
     // for interrupt handlers which will address CPU through the FS
@@ -243,7 +246,7 @@ NTSTATUS NTAPI HvmSubvertCpu (
 
 	for(i = 0; i< NUM_VMEXITS ;i++)
 	{
-		InitializeListHead (&Cpu->TrapsList[i]);
+		Cpu->TrapSets[i] = NULL;
 	}
 
     Cpu->GdtArea = HvMmAllocatePages (BYTES_TO_PAGES (BP_GDT_LIMIT), NULL, 'GDTA',&AllocatedPage);//Currently we create our own GDT and IDT area
@@ -259,6 +262,10 @@ NTSTATUS NTAPI HvmSubvertCpu (
         Print(("HvmSubvertCpu(): Failed to allocate memory for IDT\n"));
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+
+    Status = SimdInitializeCpu (Cpu);
+    if (!NT_SUCCESS (Status))
+        return Status;
 	
 	//2:ɾSparePage
     // allocate a 4k page. Fail the init if we can't allocate such page
@@ -498,22 +505,52 @@ static NTSTATUS NTAPI HvmLiberateCpu (
 }
 
 // this function is call when guest => host
-VOID NTAPI HvmEventCallback (
+// returns TRUE if the VMCS to continue with has to be entered with VMLAUNCH, see PtVmxNestedHandleExit()
+BOOLEAN NTAPI HvmEventCallback (
     PCPU Cpu,                   // cpu struct
     PGUEST_REGS GuestRegs       // store guest's regs
 )
 {//Finished
     NTSTATUS Status;
+    ULONG64 EntryTsc;
+    ULONG32 ExitReason, GuestCr3;
+    BOOLEAN Launch;
 
     if (!Cpu || !GuestRegs)
-        return;
+        return FALSE;
+
+    TrEnterVmExit (Cpu);
+
+    if (g_HvmControl->AccountExit)
+    {
+        // sample before dispatching, a MOV to CR3 changes GUEST_CR3
+        EntryTsc = RegGetTSC ();
+        ExitReason = (ULONG32) VmxRead (VM_EXIT_REASON);
+        GuestCr3 = (ULONG32) VmxRead (GUEST_CR3);
+    }
 
     GuestRegs->esp = VmxRead (GUEST_RSP);
 
+#ifdef _AMD64_
+    // before any handler touches a kernel region the guest mapped after launch
+    HvMmSyncHostPageTables ();
+#endif
+
+    BcPollMailbox (Cpu, GuestRegs);
+
     // it's an original event
     Hvm->ArchDispatchEvent (Cpu, GuestRegs);
 
     VmxWrite (GUEST_RSP, GuestRegs->esp);
 
-    return;
+    if (g_HvmControl->AccountExit)
+        g_HvmControl->AccountExit (Cpu, ExitReason, GuestCr3, EntryTsc, RegGetTSC ());
+
+    SimdRestoreGuest (Cpu);
+
+    TrLeaveVmExit (Cpu);
+
+    Launch = Cpu->Vmx.LaunchVmcsToContinue;
+    Cpu->Vmx.LaunchVmcsToContinue = FALSE;
+    return Launch;
 }
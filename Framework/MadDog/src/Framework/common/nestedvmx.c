@@ -0,0 +1,1238 @@
+#include "nestedvmx.h"
+
+/*
+ * The field table lists every VMCS field a guest hypervisor may use, sorted by encoding, with how it
+ * reaches vmcs02. The guest hypervisor sees the capability MSRs of the processor unchanged, so it may
+ * use any of them; fields the processor itself lacks just fail their VMWRITE into vmcs02, as they would
+ * have failed for the guest hypervisor on bare metal.
+ * vmcs02 is the guest part of vmcs12 under the host part of vmcs01, and exits straight to L0. Its
+ * execution controls are those of both levels: the exiting controls, exception bitmap and I/O and MSR
+ * bitmaps of vmcs01 are ORed into the ones of vmcs12, so a nested guest does not get around L0's traps,
+ * and NvmxExitForL1() hands the guest hypervisor only the exits its own controls cause. vmcs02 also
+ * gets L0's host address size, the EFER and PAT switching L0 needs around a nested guest that loads
+ * its own, and the TSC offset of both levels added up.
+ */
+#define NVMX_WIDTH(Encoding)	(((Encoding) >> 13) & 3)
+#define NVMX_WIDTH_16			0
+#define NVMX_WIDTH_64			1
+#define NVMX_WIDTH_32			2
+#define NVMX_WIDTH_NATURAL		3
+#define NVMX_READ_ONLY(Encoding)	((((Encoding) >> 10) & 3) == 1)
+
+//Fields the code below works on by name
+#define NVMX_IO_BITMAP_A		0x2000
+#define NVMX_IO_BITMAP_B		0x2002
+#define NVMX_MSR_BITMAP			0x2004
+#define NVMX_TSC_OFFSET			0x2010
+#define NVMX_LINK_POINTER		0x2800
+#define NVMX_GUEST_DEBUGCTL		0x2802
+#define NVMX_GUEST_PAT			0x2804
+#define NVMX_GUEST_EFER			0x2806
+#define NVMX_GUEST_PERF_GLOBAL	0x2808
+#define NVMX_HOST_PAT			0x2C00
+#define NVMX_HOST_EFER			0x2C02
+#define NVMX_HOST_PERF_GLOBAL	0x2C04
+#define NVMX_PIN_CONTROLS		0x4000
+#define NVMX_PROC_CONTROLS		0x4002
+#define NVMX_CR3_TARGET_COUNT	0x400A
+#define NVMX_EXIT_CONTROLS		0x400C
+#define NVMX_ENTRY_CONTROLS		0x4012
+#define NVMX_ENTRY_INTR_INFO	0x4016
+#define NVMX_PROC2_CONTROLS		0x401E
+#define NVMX_EXCEPTION_BITMAP	0x4004
+#define NVMX_PF_ERROR_MASK		0x4006
+#define NVMX_PF_ERROR_MATCH		0x4008
+#define NVMX_CR3_TARGET(n)		(0x6008 + (n) * 2)
+#define NVMX_EXIT_REASON		0x4402
+#define NVMX_GUEST_INTERRUPTIBILITY	0x4824
+#define NVMX_GUEST_ACTIVITY		0x4826
+#define NVMX_GUEST_TIMER		0x482E
+#define NVMX_GUEST_DR7			0x681A
+#define NVMX_HOST_CR0			0x6C00
+#define NVMX_HOST_CR3			0x6C02
+#define NVMX_HOST_CR4			0x6C04
+#define NVMX_HOST_FS_BASE		0x6C06
+#define NVMX_HOST_GS_BASE		0x6C08
+#define NVMX_HOST_TR_BASE		0x6C0A
+#define NVMX_HOST_GDTR_BASE		0x6C0C
+#define NVMX_HOST_IDTR_BASE		0x6C0E
+#define NVMX_HOST_SYSENTER_ESP	0x6C10
+#define NVMX_HOST_SYSENTER_EIP	0x6C12
+#define NVMX_HOST_RIP			0x6C16
+
+//Guest and host state by segment register, ES CS SS DS FS GS LDTR TR
+#define NVMX_GUEST_SELECTOR(n)	(0x0800 + (n) * 2)
+#define NVMX_GUEST_LIMIT(n)		(0x4800 + (n) * 2)
+#define NVMX_GUEST_AR(n)		(0x4814 + (n) * 2)
+#define NVMX_GUEST_BASE(n)		(0x6806 + (n) * 2)
+#define NVMX_HOST_SELECTOR(n)	(0x0C00 + (n) * 2)	//ES CS SS DS FS GS TR, there is no host LDTR
+#define NVMX_HOST_TR_SELECTOR	0x0C0C
+#define NVMX_SEG_CS				1
+#define NVMX_SEG_SS				2
+#define NVMX_SEG_FS				4
+#define NVMX_SEG_GS				5
+#define NVMX_SEG_LDTR			6
+#define NVMX_SEG_TR				7
+
+#define NVMX_PIN_EXTERNAL			0x00000001
+#define NVMX_PIN_NMI				0x00000008
+
+#define NVMX_PROC_TSC_OFFSETTING	0x00000008
+#define NVMX_PROC_HLT				0x00000080
+#define NVMX_PROC_INVLPG			0x00000200
+#define NVMX_PROC_MWAIT				0x00000400
+#define NVMX_PROC_RDPMC				0x00000800
+#define NVMX_PROC_RDTSC				0x00001000
+#define NVMX_PROC_CR3_LOAD			0x00008000
+#define NVMX_PROC_CR3_STORE			0x00010000
+#define NVMX_PROC_CR8_LOAD			0x00080000
+#define NVMX_PROC_CR8_STORE			0x00100000
+#define NVMX_PROC_MOV_DR			0x00800000
+#define NVMX_PROC_UNCONDITIONAL_IO	0x01000000
+#define NVMX_PROC_IO_BITMAPS		0x02000000
+#define NVMX_PROC_MSR_BITMAPS		0x10000000
+#define NVMX_PROC_MONITOR			0x20000000
+#define NVMX_PROC_PAUSE				0x40000000
+#define NVMX_PROC_SECONDARY			0x80000000
+#define NVMX_PROC2_DESCRIPTOR		0x00000004
+#define NVMX_PROC2_WBINVD			0x00000040
+#define NVMX_PROC2_PAUSE_LOOP		0x00000400
+#define NVMX_PROC2_RDRAND			0x00000800
+#define NVMX_PROC2_SHADOW_VMCS		0x00004000	//Hidden from vmcs02, nested guests get no shadowing
+#define NVMX_PROC2_RDSEED			0x00010000
+
+//Exiting controls of vmcs01 that vmcs02 takes on, whatever vmcs12 asks for
+#define NVMX_PIN_L0_EXITING			(NVMX_PIN_EXTERNAL | NVMX_PIN_NMI)
+#define NVMX_PROC_L0_EXITING		(NVMX_PROC_HLT | NVMX_PROC_INVLPG | NVMX_PROC_MWAIT | NVMX_PROC_RDPMC | \
+									 NVMX_PROC_RDTSC | NVMX_PROC_CR3_LOAD | NVMX_PROC_CR3_STORE | \
+									 NVMX_PROC_CR8_LOAD | NVMX_PROC_CR8_STORE | NVMX_PROC_MOV_DR | \
+									 NVMX_PROC_MONITOR | NVMX_PROC_PAUSE)
+#define NVMX_PROC2_L0_EXITING		(NVMX_PROC2_DESCRIPTOR | NVMX_PROC2_WBINVD | NVMX_PROC2_RDRAND | NVMX_PROC2_RDSEED)
+
+//How one level exits on I/O instructions or MSR accesses, vmcs02 takes the larger of the two
+#define NVMX_EXITS_NONE				0
+#define NVMX_EXITS_BITMAP			1
+#define NVMX_EXITS_ALL				2
+
+#define NVMX_BITMAP_SIZE			4096
+#define NVMX_VECTOR_PF				14
+#define NVMX_INTR_TYPE(Info)		(((Info) >> 8) & 7)
+#define NVMX_INTR_TYPE_NMI			2
+
+//Basic exit reasons NvmxExitForL1() looks at, the others always go to the guest hypervisor
+#define NVMX_REASON_EXCEPTION		0
+#define NVMX_REASON_EXTERNAL		1
+#define NVMX_REASON_HLT				12
+#define NVMX_REASON_INVLPG			14
+#define NVMX_REASON_RDPMC			15
+#define NVMX_REASON_RDTSC			16
+#define NVMX_REASON_CR				28
+#define NVMX_REASON_DR				29
+#define NVMX_REASON_IO				30
+#define NVMX_REASON_RDMSR			31
+#define NVMX_REASON_WRMSR			32
+#define NVMX_REASON_MWAIT			36
+#define NVMX_REASON_MONITOR			39
+#define NVMX_REASON_PAUSE			40
+#define NVMX_REASON_GDTR_IDTR		46
+#define NVMX_REASON_LDTR_TR			47
+#define NVMX_REASON_RDTSCP			51
+#define NVMX_REASON_WBINVD			54
+#define NVMX_REASON_RDRAND			57
+#define NVMX_REASON_RDSEED			61
+
+#define NVMX_EXIT_SAVE_DEBUG		0x00000004
+#define NVMX_EXIT_HOST_64			0x00000200
+#define NVMX_EXIT_ACK_INTR			0x00008000
+#define NVMX_EXIT_SAVE_PAT			0x00040000
+#define NVMX_EXIT_LOAD_PAT			0x00080000
+#define NVMX_EXIT_SAVE_EFER			0x00100000
+#define NVMX_EXIT_LOAD_EFER			0x00200000
+#define NVMX_EXIT_SAVE_TIMER		0x00400000
+
+#define NVMX_ENTRY_GUEST_64			0x00000200
+#define NVMX_ENTRY_SMM				0x00000400
+#define NVMX_ENTRY_DUAL_MONITOR		0x00000800
+#define NVMX_ENTRY_LOAD_PERF		0x00002000	//Dropped: L0 would have to restore its own at every nested exit
+#define NVMX_ENTRY_LOAD_PAT			0x00004000
+#define NVMX_ENTRY_LOAD_EFER		0x00008000
+#define NVMX_ENTRY_DROPPED			(NVMX_ENTRY_SMM | NVMX_ENTRY_DUAL_MONITOR | NVMX_ENTRY_LOAD_PERF)
+
+#define NVMX_MISC_VMWRITE_ANY		((ULONG64) 1 << 29)	//Exit information can be written, into the shadow VMCS too
+
+#define NVMX_CR0_PE					0x00000001
+#define NVMX_CR0_PG					0x80000000
+#define NVMX_CR4_PAE				0x00000020
+#define NVMX_CR4_PCIDE				0x00020000
+#define NVMX_EFER_LME				0x00000100
+#define NVMX_EFER_LMA				0x00000400
+#define NVMX_EFER_VALID				0x00000D01	//SCE, LME, LMA and NXE, the rest is reserved
+
+typedef struct _NVMX_FIELD
+{
+	USHORT Encoding;
+	UCHAR Flags;//Kind and shadow flags
+} NVMX_FIELD,*PNVMX_FIELD;
+
+static const NVMX_FIELD NvmxFields[] = {
+	//16-bit control
+	{ 0x0000, NVMX_CONTROL },	//VIRTUAL_PROCESSOR_ID
+	{ 0x0002, NVMX_CONTROL },	//POSTED_INTR_NOTIFICATION_VECTOR
+	{ 0x0004, NVMX_CONTROL },	//EPTP_INDEX
+	//16-bit guest state
+	{ 0x0800, NVMX_GUEST_STATE },	//GUEST_ES_SELECTOR
+	{ 0x0802, NVMX_GUEST_STATE },	//GUEST_CS_SELECTOR
+	{ 0x0804, NVMX_GUEST_STATE },	//GUEST_SS_SELECTOR
+	{ 0x0806, NVMX_GUEST_STATE },	//GUEST_DS_SELECTOR
+	{ 0x0808, NVMX_GUEST_STATE },	//GUEST_FS_SELECTOR
+	{ 0x080A, NVMX_GUEST_STATE },	//GUEST_GS_SELECTOR
+	{ 0x080C, NVMX_GUEST_STATE },	//GUEST_LDTR_SELECTOR
+	{ 0x080E, NVMX_GUEST_STATE },	//GUEST_TR_SELECTOR
+	{ 0x0810, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_INTR_STATUS
+	{ 0x0812, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_PML_INDEX
+	//16-bit host state
+	{ 0x0C00, NVMX_HOST_STATE },	//HOST_ES_SELECTOR
+	{ 0x0C02, NVMX_HOST_STATE },	//HOST_CS_SELECTOR
+	{ 0x0C04, NVMX_HOST_STATE },	//HOST_SS_SELECTOR
+	{ 0x0C06, NVMX_HOST_STATE },	//HOST_DS_SELECTOR
+	{ 0x0C08, NVMX_HOST_STATE },	//HOST_FS_SELECTOR
+	{ 0x0C0A, NVMX_HOST_STATE },	//HOST_GS_SELECTOR
+	{ 0x0C0C, NVMX_HOST_STATE },	//HOST_TR_SELECTOR
+	//64-bit control
+	{ 0x2000, NVMX_EXECUTION },	//IO_BITMAP_A
+	{ 0x2002, NVMX_EXECUTION },	//IO_BITMAP_B
+	{ 0x2004, NVMX_EXECUTION },	//MSR_BITMAP
+	{ 0x2006, NVMX_CONTROL },	//VM_EXIT_MSR_STORE_ADDR
+	{ 0x2008, NVMX_CONTROL },	//VM_EXIT_MSR_LOAD_ADDR
+	{ 0x200A, NVMX_CONTROL },	//VM_ENTRY_MSR_LOAD_ADDR
+	{ 0x200E, NVMX_CONTROL },	//PML_ADDRESS
+	{ 0x2010, NVMX_EXECUTION | NVMX_SHADOW_RW },	//TSC_OFFSET
+	{ 0x2012, NVMX_CONTROL },	//VIRTUAL_APIC_PAGE_ADDR
+	{ 0x2014, NVMX_CONTROL },	//APIC_ACCESS_ADDR
+	{ 0x2016, NVMX_CONTROL },	//POSTED_INTR_DESC_ADDR
+	{ 0x2018, NVMX_CONTROL },	//VM_FUNCTION_CONTROL
+	{ 0x201A, NVMX_CONTROL },	//EPT_POINTER
+	{ 0x201C, NVMX_CONTROL },	//EOI_EXIT_BITMAP0
+	{ 0x201E, NVMX_CONTROL },	//EOI_EXIT_BITMAP1
+	{ 0x2020, NVMX_CONTROL },	//EOI_EXIT_BITMAP2
+	{ 0x2022, NVMX_CONTROL },	//EOI_EXIT_BITMAP3
+	{ 0x2024, NVMX_CONTROL },	//EPTP_LIST_ADDRESS
+	{ 0x2026, NVMX_UNMERGED },	//VMREAD_BITMAP
+	{ 0x2028, NVMX_UNMERGED },	//VMWRITE_BITMAP
+	{ 0x202A, NVMX_CONTROL },	//VE_INFORMATION_ADDRESS
+	{ 0x202C, NVMX_CONTROL },	//XSS_EXIT_BITMAP
+	{ 0x2032, NVMX_CONTROL },	//TSC_MULTIPLIER
+	//64-bit read-only
+	{ 0x2400, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//GUEST_PHYSICAL_ADDRESS
+	//64-bit guest state
+	{ 0x2800, NVMX_UNMERGED },	//VMCS_LINK_POINTER
+	{ 0x2802, NVMX_GUEST_STATE },	//GUEST_IA32_DEBUGCTL
+	{ 0x2804, NVMX_GUEST_STATE },	//GUEST_IA32_PAT
+	{ 0x2806, NVMX_GUEST_STATE },	//GUEST_IA32_EFER
+	{ 0x2808, NVMX_GUEST_STATE },	//GUEST_IA32_PERF_GLOBAL_CTRL
+	{ 0x280A, NVMX_GUEST_STATE },	//GUEST_PDPTE0
+	{ 0x280C, NVMX_GUEST_STATE },	//GUEST_PDPTE1
+	{ 0x280E, NVMX_GUEST_STATE },	//GUEST_PDPTE2
+	{ 0x2810, NVMX_GUEST_STATE },	//GUEST_PDPTE3
+	//64-bit host state
+	{ 0x2C00, NVMX_HOST_STATE },	//HOST_IA32_PAT
+	{ 0x2C02, NVMX_HOST_STATE },	//HOST_IA32_EFER
+	{ 0x2C04, NVMX_HOST_STATE },	//HOST_IA32_PERF_GLOBAL_CTRL
+	//32-bit control
+	{ 0x4000, NVMX_EXECUTION },	//PIN_BASED_VM_EXEC_CONTROL
+	{ 0x4002, NVMX_EXECUTION | NVMX_SHADOW_RW },	//CPU_BASED_VM_EXEC_CONTROL
+	{ 0x4004, NVMX_EXECUTION | NVMX_SHADOW_RW },	//EXCEPTION_BITMAP
+	{ 0x4006, NVMX_EXECUTION },	//PAGE_FAULT_ERROR_CODE_MASK
+	{ 0x4008, NVMX_EXECUTION },	//PAGE_FAULT_ERROR_CODE_MATCH
+	{ 0x400A, NVMX_EXECUTION },	//CR3_TARGET_COUNT
+	{ 0x400C, NVMX_EXECUTION },	//VM_EXIT_CONTROLS
+	{ 0x400E, NVMX_CONTROL },	//VM_EXIT_MSR_STORE_COUNT
+	{ 0x4010, NVMX_CONTROL },	//VM_EXIT_MSR_LOAD_COUNT
+	{ 0x4012, NVMX_EXECUTION },	//VM_ENTRY_CONTROLS
+	{ 0x4014, NVMX_CONTROL },	//VM_ENTRY_MSR_LOAD_COUNT
+	{ 0x4016, NVMX_CONTROL | NVMX_SHADOW_RW },	//VM_ENTRY_INTR_INFO_FIELD
+	{ 0x4018, NVMX_CONTROL | NVMX_SHADOW_RW },	//VM_ENTRY_EXCEPTION_ERROR_CODE
+	{ 0x401A, NVMX_CONTROL | NVMX_SHADOW_RW },	//VM_ENTRY_INSTRUCTION_LEN
+	{ 0x401C, NVMX_CONTROL | NVMX_SHADOW_RW },	//TPR_THRESHOLD
+	{ 0x401E, NVMX_EXECUTION },	//SECONDARY_VM_EXEC_CONTROL
+	{ 0x4020, NVMX_CONTROL },	//PLE_GAP
+	{ 0x4022, NVMX_CONTROL },	//PLE_WINDOW
+	//32-bit read-only
+	{ 0x4400, NVMX_UNMERGED },	//VM_INSTRUCTION_ERROR, of vmcs12 only, set by L0
+	{ 0x4402, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//VM_EXIT_REASON
+	{ 0x4404, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//VM_EXIT_INTR_INFO
+	{ 0x4406, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//VM_EXIT_INTR_ERROR_CODE
+	{ 0x4408, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//IDT_VECTORING_INFO_FIELD
+	{ 0x440A, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//IDT_VECTORING_ERROR_CODE
+	{ 0x440C, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//VM_EXIT_INSTRUCTION_LEN
+	{ 0x440E, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//VMX_INSTRUCTION_INFO
+	//32-bit guest state
+	{ 0x4800, NVMX_GUEST_STATE },	//GUEST_ES_LIMIT
+	{ 0x4802, NVMX_GUEST_STATE },	//GUEST_CS_LIMIT
+	{ 0x4804, NVMX_GUEST_STATE },	//GUEST_SS_LIMIT
+	{ 0x4806, NVMX_GUEST_STATE },	//GUEST_DS_LIMIT
+	{ 0x4808, NVMX_GUEST_STATE },	//GUEST_FS_LIMIT
+	{ 0x480A, NVMX_GUEST_STATE },	//GUEST_GS_LIMIT
+	{ 0x480C, NVMX_GUEST_STATE },	//GUEST_LDTR_LIMIT
+	{ 0x480E, NVMX_GUEST_STATE },	//GUEST_TR_LIMIT
+	{ 0x4810, NVMX_GUEST_STATE },	//GUEST_GDTR_LIMIT
+	{ 0x4812, NVMX_GUEST_STATE },	//GUEST_IDTR_LIMIT
+	{ 0x4814, NVMX_GUEST_STATE },	//GUEST_ES_AR_BYTES
+	{ 0x4816, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_CS_AR_BYTES
+	{ 0x4818, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_SS_AR_BYTES
+	{ 0x481A, NVMX_GUEST_STATE },	//GUEST_DS_AR_BYTES
+	{ 0x481C, NVMX_GUEST_STATE },	//GUEST_FS_AR_BYTES
+	{ 0x481E, NVMX_GUEST_STATE },	//GUEST_GS_AR_BYTES
+	{ 0x4820, NVMX_GUEST_STATE },	//GUEST_LDTR_AR_BYTES
+	{ 0x4822, NVMX_GUEST_STATE },	//GUEST_TR_AR_BYTES
+	{ 0x4824, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_INTERRUPTIBILITY_INFO
+	{ 0x4826, NVMX_GUEST_STATE },	//GUEST_ACTIVITY_STATE
+	{ 0x4828, NVMX_GUEST_STATE },	//GUEST_SMBASE
+	{ 0x482A, NVMX_GUEST_STATE },	//GUEST_SYSENTER_CS
+	{ 0x482E, NVMX_GUEST_STATE },	//VMX_PREEMPTION_TIMER_VALUE
+	//32-bit host state
+	{ 0x4C00, NVMX_HOST_STATE },	//HOST_IA32_SYSENTER_CS
+	//Natural-width control
+	{ 0x6000, NVMX_CONTROL },	//CR0_GUEST_HOST_MASK
+	{ 0x6002, NVMX_CONTROL },	//CR4_GUEST_HOST_MASK
+	{ 0x6004, NVMX_CONTROL | NVMX_SHADOW_RW },	//CR0_READ_SHADOW
+	{ 0x6006, NVMX_CONTROL | NVMX_SHADOW_RW },	//CR4_READ_SHADOW
+	{ 0x6008, NVMX_CONTROL },	//CR3_TARGET_VALUE0
+	{ 0x600A, NVMX_CONTROL },	//CR3_TARGET_VALUE1
+	{ 0x600C, NVMX_CONTROL },	//CR3_TARGET_VALUE2
+	{ 0x600E, NVMX_CONTROL },	//CR3_TARGET_VALUE3
+	//Natural-width read-only
+	{ 0x6400, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//EXIT_QUALIFICATION
+	{ 0x6402, NVMX_EXIT_INFO },	//IO_RCX
+	{ 0x6404, NVMX_EXIT_INFO },	//IO_RSI
+	{ 0x6406, NVMX_EXIT_INFO },	//IO_RDI
+	{ 0x6408, NVMX_EXIT_INFO },	//IO_RIP
+	{ 0x640A, NVMX_EXIT_INFO | NVMX_SHADOW_RO },	//GUEST_LINEAR_ADDRESS
+	//Natural-width guest state
+	{ 0x6800, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_CR0
+	{ 0x6802, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_CR3
+	{ 0x6804, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_CR4
+	{ 0x6806, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_ES_BASE
+	{ 0x6808, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_CS_BASE
+	{ 0x680A, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_SS_BASE
+	{ 0x680C, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_DS_BASE
+	{ 0x680E, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_FS_BASE
+	{ 0x6810, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_GS_BASE
+	{ 0x6812, NVMX_GUEST_STATE },	//GUEST_LDTR_BASE
+	{ 0x6814, NVMX_GUEST_STATE },	//GUEST_TR_BASE
+	{ 0x6816, NVMX_GUEST_STATE },	//GUEST_GDTR_BASE
+	{ 0x6818, NVMX_GUEST_STATE },	//GUEST_IDTR_BASE
+	{ 0x681A, NVMX_GUEST_STATE },	//GUEST_DR7
+	{ 0x681C, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_RSP
+	{ 0x681E, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_RIP
+	{ 0x6820, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_RFLAGS
+	{ 0x6822, NVMX_GUEST_STATE | NVMX_SHADOW_RW },	//GUEST_PENDING_DBG_EXCEPTIONS
+	{ 0x6824, NVMX_GUEST_STATE },	//GUEST_SYSENTER_ESP
+	{ 0x6826, NVMX_GUEST_STATE },	//GUEST_SYSENTER_EIP
+	//Natural-width host state
+	{ 0x6C00, NVMX_HOST_STATE },	//HOST_CR0
+	{ 0x6C02, NVMX_HOST_STATE },	//HOST_CR3
+	{ 0x6C04, NVMX_HOST_STATE },	//HOST_CR4
+	{ 0x6C06, NVMX_HOST_STATE | NVMX_SHADOW_RW },	//HOST_FS_BASE
+	{ 0x6C08, NVMX_HOST_STATE | NVMX_SHADOW_RW },	//HOST_GS_BASE
+	{ 0x6C0A, NVMX_HOST_STATE },	//HOST_TR_BASE
+	{ 0x6C0C, NVMX_HOST_STATE },	//HOST_GDTR_BASE
+	{ 0x6C0E, NVMX_HOST_STATE },	//HOST_IDTR_BASE
+	{ 0x6C10, NVMX_HOST_STATE },	//HOST_IA32_SYSENTER_ESP
+	{ 0x6C12, NVMX_HOST_STATE },	//HOST_IA32_SYSENTER_EIP
+	{ 0x6C14, NVMX_HOST_STATE },	//HOST_RSP
+	{ 0x6C16, NVMX_HOST_STATE },	//HOST_RIP
+};
+
+#define NVMX_FIELD_COUNT		(sizeof (NvmxFields) / sizeof (NvmxFields[0]))
+
+typedef char NvmxFieldTableFits[NVMX_FIELD_COUNT <= NVMX_MAX_FIELDS ? 1 : -1];
+
+ULONG32 NTAPI NvmxFieldIndex (
+  ULONG32 Encoding
+)
+{
+	ULONG32 Low = 0, High = NVMX_FIELD_COUNT, Middle;
+
+	if (Encoding >> 15)
+		return NVMX_NO_FIELD;
+	//Bit 0 is the high-half access of 64-bit fields, and must be clear for the others
+	if (Encoding & 1)
+	{
+		if (NVMX_WIDTH (Encoding) != NVMX_WIDTH_64)
+			return NVMX_NO_FIELD;
+		Encoding &= ~1;
+	}
+	while (Low < High)
+	{
+		Middle = (Low + High) / 2;
+		if (NvmxFields[Middle].Encoding == Encoding)
+			return Middle;
+		if (NvmxFields[Middle].Encoding < Encoding)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+	return NVMX_NO_FIELD;
+}
+
+ULONG32 NTAPI NvmxFieldInfo (
+  ULONG32 Index,
+  PULONG32 Encoding
+)
+{
+	if (Index >= NVMX_FIELD_COUNT)
+		return 0;
+	if (Encoding)
+		*Encoding = NvmxFields[Index].Encoding;
+	return NvmxFields[Index].Flags;
+}
+
+static ULONG64 NTAPI NvmxTruncate (
+  ULONG32 Encoding,
+  ULONG64 Value
+)
+{
+	switch (NVMX_WIDTH (Encoding))
+	{
+	case NVMX_WIDTH_16:
+		return Value & 0xFFFF;
+	case NVMX_WIDTH_32:
+		return Value & 0xFFFFFFFF;
+	}
+	return Value;
+}
+
+static ULONG64 NTAPI NvmxField (
+  PNVMX_STATE State,
+  ULONG32 Encoding
+)
+{
+	return State->Vmcs12.Fields[NvmxFieldIndex (Encoding)];
+}
+
+static ULONG64 NTAPI NvmxHostField (
+  PNVMX_HOST Host,
+  ULONG32 Encoding
+)
+{
+	return Host->Fields[NvmxFieldIndex (Encoding)];
+}
+
+static VOID NTAPI NvmxMarkDirty (
+  PNVMX_STATE State,
+  ULONG32 Index
+)
+{
+	State->Dirty[Index / 32] |= 1U << (Index % 32);
+}
+
+ULONG32 NTAPI NvmxRead (
+  PNVMX_STATE State,
+  ULONG32 Encoding,
+  PULONG64 Value
+)
+{
+	ULONG32 Index = NvmxFieldIndex (Encoding);
+
+	if (Index == NVMX_NO_FIELD)
+		return NVMX_ERROR_UNSUPPORTED_FIELD;
+	if (Encoding & 1)
+		*Value = State->Vmcs12.Fields[Index] >> 32;
+	else
+		*Value = NvmxTruncate (Encoding, State->Vmcs12.Fields[Index]);
+	return 0;
+}
+
+ULONG32 NTAPI NvmxWrite (
+  PNVMX_STATE State,
+  ULONG32 Encoding,
+  ULONG64 Value
+)
+{
+	ULONG32 Index = NvmxFieldIndex (Encoding);
+	ULONG64 Old;
+
+	if (Index == NVMX_NO_FIELD)
+		return NVMX_ERROR_UNSUPPORTED_FIELD;
+	if (NVMX_READ_ONLY (Encoding))
+		return NVMX_ERROR_READ_ONLY_FIELD;
+
+	Old = State->Vmcs12.Fields[Index];
+	if (Encoding & 1)
+		Value = (Old & 0xFFFFFFFF) | (Value << 32);
+	else
+		Value = NvmxTruncate (Encoding, Value);
+	if (Value != Old)
+	{
+		State->Vmcs12.Fields[Index] = Value;
+		NvmxMarkDirty (State, Index);
+	}
+	return 0;
+}
+
+VOID NTAPI NvmxSetField (
+  PNVMX_STATE State,
+  ULONG32 Encoding,
+  ULONG64 Value
+)
+{
+	ULONG32 Index = NvmxFieldIndex (Encoding & ~1);
+
+	if (Index != NVMX_NO_FIELD)
+		State->Vmcs12.Fields[Index] = NvmxTruncate (Encoding, Value);
+}
+
+/**
+ * returns: TRUE if <Controls> keep to the allowed 0 and 1-settings of <Capability>.
+ */
+static BOOLEAN NTAPI NvmxControlsAllowed (
+  ULONG64 Controls,
+  ULONG64 Capability
+)
+{
+	return !(Controls & ~(Capability >> 32)) && (Controls & (ULONG32) Capability) == (ULONG32) Capability;
+}
+
+static ULONG32 NTAPI NvmxAdjustControls (
+  ULONG64 Controls,
+  ULONG64 Capability
+)
+{
+	return (ULONG32) ((Controls & (Capability >> 32)) | (ULONG32) Capability);
+}
+
+/**
+ * returns: TRUE if <Address> is canonical for 48-bit linear addresses.
+ */
+static BOOLEAN NTAPI NvmxCanonical (
+  ULONG64 Address
+)
+{
+	return Address < 0x0000800000000000ULL || Address >= 0xFFFF800000000000ULL;
+}
+
+/**
+ * returns: TRUE if <Value> has every bit of <Fixed0> set and none outside <Fixed1>.
+ */
+static BOOLEAN NTAPI NvmxFixedAllowed (
+  ULONG64 Value,
+  ULONG64 Fixed0,
+  ULONG64 Fixed1
+)
+{
+	return (Value & Fixed0) == Fixed0 && !(Value & ~Fixed1);
+}
+
+/**
+ * returns: TRUE if every entry of <Pat> is a memory type: UC, WC, WT, WP, WB or UC-.
+ */
+static BOOLEAN NTAPI NvmxPatValid (
+  ULONG64 Pat
+)
+{
+	ULONG32 i, Type;
+
+	for (i = 0; i < 8; i++)
+	{
+		Type = (ULONG32) (Pat >> (i * 8)) & 0xFF;
+		if (Type > 7 || Type == 2 || Type == 3)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+//Host bases and SYSENTER MSRs, canonical on every processor with Intel 64
+static const USHORT NvmxHostAddresses[] = {
+	NVMX_HOST_FS_BASE, NVMX_HOST_GS_BASE, NVMX_HOST_TR_BASE, NVMX_HOST_GDTR_BASE, NVMX_HOST_IDTR_BASE,
+	NVMX_HOST_SYSENTER_ESP, NVMX_HOST_SYSENTER_EIP
+};
+
+ULONG32 NTAPI NvmxCheckEntry (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  BOOLEAN LongMode
+)
+{
+	ULONG64 Proc = NvmxField (State, NVMX_PROC_CONTROLS);
+	ULONG64 Exit = NvmxField (State, NVMX_EXIT_CONTROLS);
+	ULONG64 Cr4 = NvmxField (State, NVMX_HOST_CR4);
+	ULONG64 Rip = NvmxField (State, NVMX_HOST_RIP);
+	ULONG64 Efer = NvmxField (State, NVMX_HOST_EFER);
+	BOOLEAN Host64 = (Exit & NVMX_EXIT_HOST_64) != 0;
+	ULONG32 Segment, i;
+
+	if (!NvmxControlsAllowed (NvmxField (State, NVMX_PIN_CONTROLS), Host->PinControls) ||
+		!NvmxControlsAllowed (Proc, Host->ProcControls) ||
+		!NvmxControlsAllowed (Exit, Host->ExitControls) ||
+		!NvmxControlsAllowed (NvmxField (State, NVMX_ENTRY_CONTROLS), Host->EntryControls))
+		return NVMX_ERROR_ENTRY_CONTROLS;
+	//Shadowing is offered by the capability MSRs, so a guest hypervisor may ask for it; it just doesn't get it
+	if ((Proc & NVMX_PROC_SECONDARY) &&
+		(NvmxField (State, NVMX_PROC2_CONTROLS) & ~NVMX_PROC2_SHADOW_VMCS & ~(Host->Proc2Controls >> 32)))
+		return NVMX_ERROR_ENTRY_CONTROLS;
+	if (NvmxField (State, NVMX_CR3_TARGET_COUNT) > 4)
+		return NVMX_ERROR_ENTRY_CONTROLS;
+	if ((Proc & NVMX_PROC_IO_BITMAPS) &&
+		((NvmxField (State, NVMX_IO_BITMAP_A) | NvmxField (State, NVMX_IO_BITMAP_B)) & 0xFFF))
+		return NVMX_ERROR_ENTRY_CONTROLS;
+	if ((Proc & NVMX_PROC_MSR_BITMAPS) && (NvmxField (State, NVMX_MSR_BITMAP) & 0xFFF))
+		return NVMX_ERROR_ENTRY_CONTROLS;
+
+	//The host state is loaded into vmcs01 at the nested VM Exit, where a bad one would fail L0's own entry
+	for (Segment = 0; Segment < 7; Segment++)
+		if (NvmxField (State, NVMX_HOST_SELECTOR (Segment)) & 7)
+			return NVMX_ERROR_ENTRY_HOST_STATE;
+	if (!NvmxField (State, NVMX_HOST_SELECTOR (NVMX_SEG_CS)) || !NvmxField (State, NVMX_HOST_TR_SELECTOR) ||
+		(!(Exit & NVMX_EXIT_HOST_64) && !NvmxField (State, NVMX_HOST_SELECTOR (NVMX_SEG_SS))))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	for (i = 0; i < sizeof (NvmxHostAddresses) / sizeof (NvmxHostAddresses[0]); i++)
+		if (!NvmxCanonical (NvmxField (State, NvmxHostAddresses[i])))
+			return NVMX_ERROR_ENTRY_HOST_STATE;
+
+	//Control registers against the fixed bits of VMX operation, CR3 within the physical address width
+	if ((NvmxField (State, NVMX_HOST_CR0) & (NVMX_CR0_PE | NVMX_CR0_PG)) != (NVMX_CR0_PE | NVMX_CR0_PG) ||
+		!NvmxFixedAllowed (NvmxField (State, NVMX_HOST_CR0), Host->Cr0Fixed0, Host->Cr0Fixed1) ||
+		!NvmxFixedAllowed (Cr4, Host->Cr4Fixed0, Host->Cr4Fixed1) ||
+		(NvmxField (State, NVMX_HOST_CR3) >> Host->PhysicalAddressBits))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	if ((Exit & NVMX_EXIT_LOAD_PAT) && !NvmxPatValid (NvmxField (State, NVMX_HOST_PAT)))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	if ((Exit & NVMX_EXIT_LOAD_EFER) && ((Efer & ~(ULONG64) NVMX_EFER_VALID) ||
+		!(Efer & NVMX_EFER_LMA) != !Host64 || !(Efer & NVMX_EFER_LME) != !Host64))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+
+	//The address-space size has to match the mode the guest hypervisor runs in
+	if (LongMode != Host64)
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	if (!LongMode && (NvmxField (State, NVMX_ENTRY_CONTROLS) & NVMX_ENTRY_GUEST_64))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	if (Host64 ? !(Cr4 & NVMX_CR4_PAE) || !NvmxCanonical (Rip) : (Cr4 & NVMX_CR4_PCIDE) || (Rip >> 32))
+		return NVMX_ERROR_ENTRY_HOST_STATE;
+	return 0;
+}
+
+VOID NTAPI NvmxCaptureHost (
+  PNVMX_HOST Host,
+  NVMX_VMREAD Read,
+  PVOID Context
+)
+{
+	ULONG32 i, Encoding;
+
+	for (i = 0; i < NVMX_FIELD_COUNT; i++)
+	{
+		Encoding = NvmxFields[i].Encoding;
+		//vmcs01 may not switch these MSRs, L0's values are in Efer and Pat
+		if ((NvmxFields[i].Flags & NVMX_KIND_MASK) != NVMX_HOST_STATE ||
+			Encoding == NVMX_HOST_PAT || Encoding == NVMX_HOST_EFER || Encoding == NVMX_HOST_PERF_GLOBAL)
+			continue;
+		Host->Fields[i] = Read (Context, Encoding);
+	}
+	Host->Fields[NvmxFieldIndex (NVMX_EXIT_CONTROLS)] = Read (Context, NVMX_EXIT_CONTROLS);
+	Host->Fields[NvmxFieldIndex (NVMX_TSC_OFFSET)] = (Read (Context, NVMX_PROC_CONTROLS) & NVMX_PROC_TSC_OFFSETTING) ?
+		Read (Context, NVMX_TSC_OFFSET) : 0;
+	Host->Fields[NvmxFieldIndex (NVMX_HOST_PAT)] = Host->Pat;
+	Host->Fields[NvmxFieldIndex (NVMX_HOST_EFER)] = Host->Efer;
+}
+
+static const USHORT NvmxExitingFields[] = {
+	NVMX_PIN_CONTROLS, NVMX_PROC_CONTROLS, NVMX_PROC2_CONTROLS, NVMX_EXCEPTION_BITMAP, NVMX_PF_ERROR_MASK,
+	NVMX_PF_ERROR_MATCH, NVMX_IO_BITMAP_A, NVMX_IO_BITMAP_B, NVMX_MSR_BITMAP
+};
+
+ULONG32 NTAPI NvmxCaptureExiting (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  NVMX_VMREAD Read,
+  PVOID Context
+)
+{
+	ULONG64 Proc = Read (Context, NVMX_PROC_CONTROLS), Value;
+	ULONG32 i, Index, Changed = 0;
+
+	for (i = 0; i < sizeof (NvmxExitingFields) / sizeof (NvmxExitingFields[0]); i++)
+	{
+		if (NvmxExitingFields[i] == NVMX_PROC_CONTROLS)
+			Value = Proc;
+		else if (NvmxExitingFields[i] == NVMX_PROC2_CONTROLS && !(Proc & NVMX_PROC_SECONDARY))
+			Value = 0;
+		else
+			Value = Read (Context, NvmxExitingFields[i]);
+		Index = NvmxFieldIndex (NvmxExitingFields[i]);
+		if (Host->Fields[Index] != Value)
+		{
+			Host->Fields[Index] = Value;
+			Changed++;
+		}
+	}
+	//Any of them is an execution field, which has all of them merged again
+	if (Changed)
+		NvmxMarkDirty (State, NvmxFieldIndex (NVMX_PIN_CONTROLS));
+	return Changed;
+}
+
+/**
+ * returns: How vmcs02 exits on I/O instructions, or on MSR accesses if <Msr>, with the processor
+ * controls <Proc12> and <Proc01>: NVMX_EXITS_NONE, NVMX_EXITS_BITMAP or NVMX_EXITS_ALL, the more of
+ * the two levels.
+ */
+static ULONG32 NTAPI NvmxBitmapExits (
+  ULONG64 Proc12,
+  ULONG64 Proc01,
+  BOOLEAN Msr
+)
+{
+	ULONG64 Proc[2];
+	ULONG32 Exits[2], i;
+
+	Proc[0] = Proc12;
+	Proc[1] = Proc01;
+	for (i = 0; i < 2; i++)
+	{
+		//Without MSR bitmaps every RDMSR and WRMSR exits
+		if (Msr)
+			Exits[i] = (Proc[i] & NVMX_PROC_MSR_BITMAPS) ? NVMX_EXITS_BITMAP : NVMX_EXITS_ALL;
+		else if (Proc[i] & NVMX_PROC_IO_BITMAPS)
+			Exits[i] = NVMX_EXITS_BITMAP;
+		else
+			Exits[i] = (Proc[i] & NVMX_PROC_UNCONDITIONAL_IO) ? NVMX_EXITS_ALL : NVMX_EXITS_NONE;
+	}
+	return Exits[0] > Exits[1] ? Exits[0] : Exits[1];
+}
+
+/**
+ * returns: TRUE if no #PF exits with <Exceptions>, <Mask> and <Match>. A #PF exits if the error code
+ * matches and bit 14 of the exception bitmap is set, or if it does not match and the bit is clear.
+ */
+static BOOLEAN NTAPI NvmxNoPageFaultExits (
+  ULONG64 Exceptions,
+  ULONG64 Mask,
+  ULONG64 Match
+)
+{
+	if (Exceptions & ((ULONG64) 1 << NVMX_VECTOR_PF))
+		return (Match & ~Mask) != 0;
+	return !Mask && !Match;
+}
+
+/**
+ * effects: Write the execution controls, TSC offset and exception and I/O/MSR bitmaps of vmcs02, which
+ * all depend on each other and on the ones of vmcs01.
+ */
+static ULONG32 NTAPI NvmxMergeExecution (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  NVMX_VMWRITE Write,
+  PVOID Context
+)
+{
+	ULONG64 Pin = NvmxField (State, NVMX_PIN_CONTROLS);
+	ULONG64 Proc12 = NvmxField (State, NVMX_PROC_CONTROLS);
+	ULONG64 Proc01 = NvmxHostField (Host, NVMX_PROC_CONTROLS);
+	ULONG64 Exit = NvmxField (State, NVMX_EXIT_CONTROLS);
+	ULONG64 Exit01 = NvmxHostField (Host, NVMX_EXIT_CONTROLS);
+	ULONG64 Entry = NvmxField (State, NVMX_ENTRY_CONTROLS);
+	ULONG64 Exceptions = NvmxField (State, NVMX_EXCEPTION_BITMAP);
+	ULONG64 Exceptions01 = NvmxHostField (Host, NVMX_EXCEPTION_BITMAP);
+	ULONG64 Mask = NvmxField (State, NVMX_PF_ERROR_MASK);
+	ULONG64 Match = NvmxField (State, NVMX_PF_ERROR_MATCH);
+	ULONG64 Mask01 = NvmxHostField (Host, NVMX_PF_ERROR_MASK);
+	ULONG64 Match01 = NvmxHostField (Host, NVMX_PF_ERROR_MATCH);
+	ULONG64 TscOffset = NvmxHostField (Host, NVMX_TSC_OFFSET);
+	ULONG64 PageFault = (ULONG64) 1 << NVMX_VECTOR_PF;
+	ULONG64 Proc, Proc2, Exit02;
+	ULONG32 Io, Count = 12;
+
+	//vmcs02 exits wherever either level asks for it, NvmxExitForL1() sorts the exits out again
+	Write (Context, NVMX_PIN_CONTROLS, NvmxAdjustControls (Pin | (NvmxHostField (Host, NVMX_PIN_CONTROLS) & NVMX_PIN_L0_EXITING),
+		Host->PinControls));
+	Proc = (Proc12 & ~(NVMX_PROC_UNCONDITIONAL_IO | NVMX_PROC_IO_BITMAPS | NVMX_PROC_MSR_BITMAPS)) |
+		(Proc01 & NVMX_PROC_L0_EXITING);
+	Proc2 = ((Proc12 & NVMX_PROC_SECONDARY) ? NvmxField (State, NVMX_PROC2_CONTROLS) & ~NVMX_PROC2_SHADOW_VMCS : 0) |
+		(NvmxHostField (Host, NVMX_PROC2_CONTROLS) & NVMX_PROC2_L0_EXITING);
+	if (Host->Proc2Controls >> 32)
+	{
+		if (Proc2)
+			Proc |= NVMX_PROC_SECONDARY;
+		Write (Context, NVMX_PROC2_CONTROLS, (Proc & NVMX_PROC_SECONDARY) ? NvmxAdjustControls (Proc2, Host->Proc2Controls) : 0);
+		Count++;
+	}
+
+	//A level that exits on every I/O instruction or MSR access has vmcs02 do so too, otherwise the
+	//bitmaps of both are ORed into pages of L0 by NvmxMergeBitmaps()
+	Io = NvmxBitmapExits (Proc12, Proc01, FALSE);
+	if (Io == NVMX_EXITS_ALL)
+		Proc |= NVMX_PROC_UNCONDITIONAL_IO;
+	else if (Io == NVMX_EXITS_BITMAP)
+		Proc |= NVMX_PROC_IO_BITMAPS;
+	if (NvmxBitmapExits (Proc12, Proc01, TRUE) == NVMX_EXITS_BITMAP)
+		Proc |= NVMX_PROC_MSR_BITMAPS;
+	Write (Context, NVMX_IO_BITMAP_A, Host->Bitmaps02PA);
+	Write (Context, NVMX_IO_BITMAP_B, Host->Bitmaps02PA + NVMX_BITMAP_SIZE);
+	Write (Context, NVMX_MSR_BITMAP, Host->Bitmaps02PA + 2 * NVMX_BITMAP_SIZE);
+	//The CR3 target values of the guest hypervisor must not hide loads from L0
+	Write (Context, NVMX_CR3_TARGET_COUNT, (Proc01 & NVMX_PROC_CR3_LOAD) ? 0 : NvmxField (State, NVMX_CR3_TARGET_COUNT));
+
+	//Both #PF filters are kept where one of them lets no #PF exit or they are the same, otherwise every
+	//#PF exits
+	if (NvmxNoPageFaultExits (Exceptions, Mask, Match) ||
+		(!((Exceptions ^ Exceptions01) & PageFault) && Mask == Mask01 && Match == Match01))
+	{
+		Exceptions = (Exceptions & ~PageFault) | (Exceptions01 & PageFault);
+		Mask = Mask01;
+		Match = Match01;
+	}
+	else if (!NvmxNoPageFaultExits (Exceptions01, Mask01, Match01))
+	{
+		Exceptions |= PageFault;
+		Mask = 0;
+		Match = 0;
+	}
+	Write (Context, NVMX_EXCEPTION_BITMAP, Exceptions | (Exceptions01 & ~PageFault));
+	Write (Context, NVMX_PF_ERROR_MASK, Mask);
+	Write (Context, NVMX_PF_ERROR_MATCH, Match);
+
+	//The TSC the nested guest sees is offset twice, once by each hypervisor
+	if (Proc12 & NVMX_PROC_TSC_OFFSETTING)
+		TscOffset += NvmxField (State, NVMX_TSC_OFFSET);
+	if (TscOffset)
+		Proc |= NVMX_PROC_TSC_OFFSETTING;
+	Write (Context, NVMX_PROC_CONTROLS, NvmxAdjustControls (Proc, Host->ProcControls));
+	Write (Context, NVMX_TSC_OFFSET, TscOffset);
+
+	//Exits return to L0, so its own host address size; a nested guest with its own EFER or PAT has them
+	//switched back to L0's, the guest hypervisor's are loaded into vmcs01 with the rest of its host state.
+	//An external interrupt only L0 exits on is acknowledged the way L0's own handlers expect.
+	Exit02 = (Exit01 & NVMX_EXIT_HOST_64) |
+		(Exit & (NVMX_EXIT_SAVE_DEBUG | NVMX_EXIT_SAVE_PAT | NVMX_EXIT_SAVE_EFER | NVMX_EXIT_SAVE_TIMER)) |
+		(((Pin & NVMX_PIN_EXTERNAL) ? Exit : Exit01) & NVMX_EXIT_ACK_INTR);
+	if (Entry & NVMX_ENTRY_LOAD_PAT)
+		Exit02 |= NVMX_EXIT_LOAD_PAT;
+	if (Entry & NVMX_ENTRY_LOAD_EFER)
+		Exit02 |= NVMX_EXIT_LOAD_EFER;
+	Write (Context, NVMX_EXIT_CONTROLS, NvmxAdjustControls (Exit02, Host->ExitControls));
+	Write (Context, NVMX_ENTRY_CONTROLS, NvmxAdjustControls (Entry & ~NVMX_ENTRY_DROPPED, Host->EntryControls));
+	return Count;
+}
+
+static ULONG32 NTAPI NvmxMergeField (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  ULONG32 Index,
+  BOOLEAN Full,
+  NVMX_VMWRITE Write,
+  PVOID Context
+)
+{
+	switch (NvmxFields[Index].Flags & NVMX_KIND_MASK)
+	{
+	case NVMX_GUEST_STATE:
+	case NVMX_CONTROL:
+		Write (Context, NvmxFields[Index].Encoding, State->Vmcs12.Fields[Index]);
+		return 1;
+	case NVMX_HOST_STATE:
+		if (!Full)
+			return 0;
+		Write (Context, NvmxFields[Index].Encoding, Host->Fields[Index]);
+		return 1;
+	case NVMX_UNMERGED:
+		if (!Full || NvmxFields[Index].Encoding != NVMX_LINK_POINTER)
+			return 0;
+		Write (Context, NVMX_LINK_POINTER, NVMX_NO_VMCS);
+		return 1;
+	}
+	return 0;
+}
+
+ULONG32 NTAPI NvmxMerge (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  BOOLEAN Full,
+  NVMX_VMWRITE Write,
+  PVOID Context
+)
+{
+	BOOLEAN Execution = Full;
+	ULONG32 Count = 0, Word, Bits, Index;
+
+	if (Full)
+	{
+		for (Index = 0; Index < NVMX_FIELD_COUNT; Index++)
+			Count += NvmxMergeField (State, Host, Index, TRUE, Write, Context);
+	}
+	else
+	{
+		for (Word = 0; Word < sizeof (State->Dirty) / sizeof (State->Dirty[0]); Word++)
+		{
+			for (Bits = State->Dirty[Word]; Bits; Bits &= Bits - 1)
+			{
+				for (Index = Word * 32; !(Bits & (1U << (Index % 32))); Index++);
+				if ((NvmxFields[Index].Flags & NVMX_KIND_MASK) == NVMX_EXECUTION)
+					Execution = TRUE;
+				else
+					Count += NvmxMergeField (State, Host, Index, FALSE, Write, Context);
+			}
+		}
+	}
+	if (Execution)
+		Count += NvmxMergeExecution (State, Host, Write, Context);
+
+	for (Word = 0; Word < sizeof (State->Dirty) / sizeof (State->Dirty[0]); Word++)
+		State->Dirty[Word] = 0;
+	return Count;
+}
+
+/**
+ * effects: OR the bitmap page at <Address12>, if <Use12>, and the one at <Address01>, if <Use01>,
+ * into <Merged>. A page the host cannot reach counts as all ones.
+ */
+static VOID NTAPI NvmxMergePage (
+  PULONG64 Merged,
+  BOOLEAN Use12,
+  ULONG64 Address12,
+  BOOLEAN Use01,
+  ULONG64 Address01,
+  NVMX_MAP Map,
+  PVOID Context
+)
+{
+	PULONG64 Page12 = Use12 ? (PULONG64) Map (Context, Address12) : NULL;
+	PULONG64 Page01 = Use01 ? (PULONG64) Map (Context, Address01) : NULL;
+	ULONG64 Fill = ((Use12 && !Page12) || (Use01 && !Page01)) ? ~(ULONG64) 0 : 0;
+	ULONG32 i;
+
+	for (i = 0; i < NVMX_BITMAP_SIZE / sizeof (ULONG64); i++)
+		Merged[i] = Fill | (Page12 ? Page12[i] : 0) | (Page01 ? Page01[i] : 0);
+}
+
+ULONG32 NTAPI NvmxMergeBitmaps (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  NVMX_MAP Map,
+  PVOID Context
+)
+{
+	ULONG64 Proc12 = NvmxField (State, NVMX_PROC_CONTROLS);
+	ULONG64 Proc01 = NvmxHostField (Host, NVMX_PROC_CONTROLS);
+	PULONG64 Pages = (PULONG64) Host->Bitmaps02;
+	ULONG32 i, Count = 0;
+
+	if (NvmxBitmapExits (Proc12, Proc01, FALSE) == NVMX_EXITS_BITMAP)
+	{
+		for (i = 0; i < 2; i++)
+			NvmxMergePage (Pages + i * NVMX_BITMAP_SIZE / sizeof (ULONG64),
+				(Proc12 & NVMX_PROC_IO_BITMAPS) != 0, NvmxField (State, NVMX_IO_BITMAP_A + i * 2),
+				(Proc01 & NVMX_PROC_IO_BITMAPS) != 0, NvmxHostField (Host, NVMX_IO_BITMAP_A + i * 2), Map, Context);
+		Count += 2;
+	}
+	//Only merged when both levels have MSR bitmaps
+	if (NvmxBitmapExits (Proc12, Proc01, TRUE) == NVMX_EXITS_BITMAP)
+	{
+		NvmxMergePage (Pages + 2 * NVMX_BITMAP_SIZE / sizeof (ULONG64), TRUE, NvmxField (State, NVMX_MSR_BITMAP),
+			TRUE, NvmxHostField (Host, NVMX_MSR_BITMAP), Map, Context);
+		Count++;
+	}
+	return Count;
+}
+
+/**
+ * returns: TRUE if bit <Bit> of the bitmap page at <Address> is set, or the host cannot reach it.
+ */
+static BOOLEAN NTAPI NvmxBitmapBit (
+  ULONG64 Address,
+  ULONG32 Bit,
+  NVMX_MAP Map,
+  PVOID Context
+)
+{
+	PUCHAR Page = Map (Context, Address);
+
+	return !Page || ((Page[Bit / 8] >> (Bit % 8)) & 1);
+}
+
+BOOLEAN NTAPI NvmxExitForL1 (
+  PNVMX_STATE State,
+  PNVMX_EXIT Exit,
+  NVMX_MAP Map,
+  PVOID Context
+)
+{
+	ULONG64 Pin = NvmxField (State, NVMX_PIN_CONTROLS);
+	ULONG64 Proc = NvmxField (State, NVMX_PROC_CONTROLS);
+	ULONG64 Proc2 = (Proc & NVMX_PROC_SECONDARY) ? NvmxField (State, NVMX_PROC2_CONTROLS) : 0;
+	ULONG64 Exceptions;
+	ULONG32 Register, Access, Port, Last, Msr, Bit, i;
+
+	if (Exit->Reason & 0x80000000)
+		return TRUE;
+
+	switch (Exit->Reason & 0xFFFF)
+	{
+	case NVMX_REASON_EXCEPTION:
+		if (NVMX_INTR_TYPE (Exit->IntrInfo) == NVMX_INTR_TYPE_NMI)
+			return (Pin & NVMX_PIN_NMI) != 0;
+		Exceptions = NvmxField (State, NVMX_EXCEPTION_BITMAP);
+		if ((Exit->IntrInfo & 0xFF) != NVMX_VECTOR_PF)
+			return (Exceptions >> (Exit->IntrInfo & 0x1F)) & 1;
+		return ((Exceptions >> NVMX_VECTOR_PF) & 1) ==
+			((Exit->ErrorCode & NvmxField (State, NVMX_PF_ERROR_MASK)) == NvmxField (State, NVMX_PF_ERROR_MATCH));
+	case NVMX_REASON_EXTERNAL:
+		return (Pin & NVMX_PIN_EXTERNAL) != 0;
+	case NVMX_REASON_HLT:
+		return (Proc & NVMX_PROC_HLT) != 0;
+	case NVMX_REASON_INVLPG:
+		return (Proc & NVMX_PROC_INVLPG) != 0;
+	case NVMX_REASON_RDPMC:
+		return (Proc & NVMX_PROC_RDPMC) != 0;
+	case NVMX_REASON_RDTSC:
+	case NVMX_REASON_RDTSCP:
+		return (Proc & NVMX_PROC_RDTSC) != 0;
+	case NVMX_REASON_CR:
+		//Control register in bits 3:0 of the qualification, access in bits 5:4, 0 for MOV to and 1 for MOV from
+		Register = (ULONG32) Exit->Qualification & 0xF;
+		Access = (ULONG32) (Exit->Qualification >> 4) & 3;
+		if (Register == 3 && Access == 0)
+		{
+			if (!(Proc & NVMX_PROC_CR3_LOAD))
+				return FALSE;
+			for (i = 0; i < NvmxField (State, NVMX_CR3_TARGET_COUNT) && i < 4; i++)
+				if (NvmxField (State, NVMX_CR3_TARGET (i)) == Exit->Operand)
+					return FALSE;
+			return TRUE;
+		}
+		if (Register == 3 && Access == 1)
+			return (Proc & NVMX_PROC_CR3_STORE) != 0;
+		if (Register == 8 && Access == 0)
+			return (Proc & NVMX_PROC_CR8_LOAD) != 0;
+		if (Register == 8 && Access == 1)
+			return (Proc & NVMX_PROC_CR8_STORE) != 0;
+		//CR0 and CR4 exit by the guest/host masks, which are the guest hypervisor's alone
+		return TRUE;
+	case NVMX_REASON_DR:
+		return (Proc & NVMX_PROC_MOV_DR) != 0;
+	case NVMX_REASON_IO:
+		if (!(Proc & NVMX_PROC_IO_BITMAPS))
+			return (Proc & NVMX_PROC_UNCONDITIONAL_IO) != 0;
+		//Size - 1 in bits 2:0 of the qualification, port in bits 31:16; an access past port 0xFFFF exits
+		Port = (ULONG32) (Exit->Qualification >> 16) & 0xFFFF;
+		Last = Port + ((ULONG32) Exit->Qualification & 7);
+		if (Last > 0xFFFF)
+			return TRUE;
+		for (; Port <= Last; Port++)
+			if (NvmxBitmapBit (NvmxField (State, Port < 0x8000 ? NVMX_IO_BITMAP_A : NVMX_IO_BITMAP_B), Port & 0x7FFF, Map, Context))
+				return TRUE;
+		return FALSE;
+	case NVMX_REASON_RDMSR:
+	case NVMX_REASON_WRMSR:
+		if (!(Proc & NVMX_PROC_MSR_BITMAPS))
+			return TRUE;
+		//Read bits of the low and the high MSRs, then write bits of both; other MSRs always exit
+		Msr = (ULONG32) Exit->Operand;
+		if (Msr <= 0x1FFF)
+			Bit = Msr;
+		else if (Msr >= 0xC0000000 && Msr <= 0xC0001FFF)
+			Bit = 0x2000 + (Msr & 0x1FFF);
+		else
+			return TRUE;
+		if ((Exit->Reason & 0xFFFF) == NVMX_REASON_WRMSR)
+			Bit += 0x4000;
+		return NvmxBitmapBit (NvmxField (State, NVMX_MSR_BITMAP), Bit, Map, Context);
+	case NVMX_REASON_MWAIT:
+		return (Proc & NVMX_PROC_MWAIT) != 0;
+	case NVMX_REASON_MONITOR:
+		return (Proc & NVMX_PROC_MONITOR) != 0;
+	case NVMX_REASON_PAUSE:
+		return (Proc & NVMX_PROC_PAUSE) || (Proc2 & NVMX_PROC2_PAUSE_LOOP);
+	case NVMX_REASON_GDTR_IDTR:
+	case NVMX_REASON_LDTR_TR:
+		return (Proc2 & NVMX_PROC2_DESCRIPTOR) != 0;
+	case NVMX_REASON_WBINVD:
+		return (Proc2 & NVMX_PROC2_WBINVD) != 0;
+	case NVMX_REASON_RDRAND:
+		return (Proc2 & NVMX_PROC2_RDRAND) != 0;
+	case NVMX_REASON_RDSEED:
+		return (Proc2 & NVMX_PROC2_RDSEED) != 0;
+	}
+	return TRUE;
+}
+
+VOID NTAPI NvmxSaveExit (
+  PNVMX_STATE State,
+  NVMX_VMREAD Read,
+  PVOID Context
+)
+{
+	ULONG64 Exit = NvmxField (State, NVMX_EXIT_CONTROLS);
+	ULONG32 Index, Kind, Encoding;
+	BOOLEAN EntryFailed;
+
+	EntryFailed = (Read (Context, NVMX_EXIT_REASON) & 0x80000000) != 0;
+	for (Index = 0; Index < NVMX_FIELD_COUNT; Index++)
+	{
+		Kind = NvmxFields[Index].Flags & NVMX_KIND_MASK;
+		Encoding = NvmxFields[Index].Encoding;
+		//A failed entry saves no guest state, and the rest is saved only under the matching exit control
+		if (Kind != NVMX_EXIT_INFO && (Kind != NVMX_GUEST_STATE || EntryFailed))
+			continue;
+		if ((Encoding == NVMX_GUEST_PAT && !(Exit & NVMX_EXIT_SAVE_PAT)) ||
+			(Encoding == NVMX_GUEST_EFER && !(Exit & NVMX_EXIT_SAVE_EFER)) ||
+			(Encoding == NVMX_GUEST_TIMER && !(Exit & NVMX_EXIT_SAVE_TIMER)) ||
+			((Encoding == NVMX_GUEST_DEBUGCTL || Encoding == NVMX_GUEST_DR7) && !(Exit & NVMX_EXIT_SAVE_DEBUG)) ||
+			Encoding == NVMX_GUEST_PERF_GLOBAL)
+			continue;
+		State->Vmcs12.Fields[Index] = Read (Context, Encoding);
+	}
+	//Every VM Exit consumes the event injection, the processor has cleared the valid bit in vmcs02 too
+	State->Vmcs12.Fields[NvmxFieldIndex (NVMX_ENTRY_INTR_INFO)] &= ~(ULONG64) 0x80000000;
+}
+
+VOID NTAPI NvmxLoadHostState (
+  PNVMX_STATE State,
+  NVMX_VMREAD Read,
+  NVMX_VMWRITE Write,
+  PVOID Context
+)
+{
+	ULONG64 Exit = NvmxField (State, NVMX_EXIT_CONTROLS);
+	ULONG64 Selector;
+	ULONG32 Segment;
+
+	Write (Context, 0x6800, NvmxField (State, NVMX_HOST_CR0));
+	Write (Context, 0x6802, NvmxField (State, 0x6C02));//CR3
+	Write (Context, 0x6804, NvmxField (State, NVMX_HOST_CR4));
+	Write (Context, NVMX_GUEST_DR7, 0x400);
+	Write (Context, NVMX_GUEST_DEBUGCTL, 0);
+	Write (Context, 0x482A, NvmxField (State, 0x4C00));//SYSENTER_CS
+	Write (Context, 0x6824, NvmxField (State, 0x6C10));//SYSENTER_ESP
+	Write (Context, 0x6826, NvmxField (State, 0x6C12));//SYSENTER_EIP
+	if (Exit & NVMX_EXIT_LOAD_PAT)
+		Write (Context, NVMX_GUEST_PAT, NvmxField (State, NVMX_HOST_PAT));
+	if (Exit & NVMX_EXIT_LOAD_EFER)
+		Write (Context, NVMX_GUEST_EFER, NvmxField (State, NVMX_HOST_EFER));
+
+	//Flat segments from the host selectors, a null one unusable; TR keeps its base and a minimal limit
+	for (Segment = 0; Segment < 6; Segment++)
+	{
+		Selector = NvmxField (State, NVMX_HOST_SELECTOR (Segment));
+		Write (Context, NVMX_GUEST_SELECTOR (Segment), Selector);
+		Write (Context, NVMX_GUEST_LIMIT (Segment), 0xFFFFFFFF);
+		if (Segment == NVMX_SEG_CS)
+			Write (Context, NVMX_GUEST_AR (Segment), (Exit & NVMX_EXIT_HOST_64) ? 0xA09B : 0xC09B);
+		else
+			Write (Context, NVMX_GUEST_AR (Segment), Selector ? 0xC093 : 0x10000);
+		if (Segment == NVMX_SEG_FS)
+			Write (Context, NVMX_GUEST_BASE (Segment), NvmxField (State, 0x6C06));
+		else if (Segment == NVMX_SEG_GS)
+			Write (Context, NVMX_GUEST_BASE (Segment), NvmxField (State, 0x6C08));
+		else
+			Write (Context, NVMX_GUEST_BASE (Segment), 0);
+	}
+	Write (Context, NVMX_GUEST_SELECTOR (NVMX_SEG_LDTR), 0);
+	Write (Context, NVMX_GUEST_AR (NVMX_SEG_LDTR), 0x10000);
+	Write (Context, NVMX_GUEST_SELECTOR (NVMX_SEG_TR), NvmxField (State, NVMX_HOST_TR_SELECTOR));
+	Write (Context, NVMX_GUEST_LIMIT (NVMX_SEG_TR), 0x67);
+	Write (Context, NVMX_GUEST_AR (NVMX_SEG_TR), 0x8B);
+	Write (Context, NVMX_GUEST_BASE (NVMX_SEG_TR), NvmxField (State, 0x6C0A));
+	Write (Context, 0x4810, 0xFFFF);//GDTR limit
+	Write (Context, 0x6816, NvmxField (State, 0x6C0C));
+	Write (Context, 0x4812, 0xFFFF);//IDTR limit
+	Write (Context, 0x6818, NvmxField (State, 0x6C0E));
+
+	Write (Context, 0x681C, NvmxField (State, 0x6C14));//RSP
+	Write (Context, 0x681E, NvmxField (State, 0x6C16));//RIP
+	Write (Context, 0x6820, 0x2);//RFLAGS
+	//Blocking by STI and MOV SS ends with the exit, blocking by NMI does not
+	Write (Context, NVMX_GUEST_INTERRUPTIBILITY, Read (Context, NVMX_GUEST_INTERRUPTIBILITY) & 0x8);
+	Write (Context, NVMX_GUEST_ACTIVITY, 0);
+	Write (Context, 0x6822, 0);//Pending debug exceptions
+	Write (Context, NVMX_ENTRY_CONTROLS, (Read (Context, NVMX_ENTRY_CONTROLS) & ~NVMX_ENTRY_GUEST_64) |
+		((Exit & NVMX_EXIT_HOST_64) ? NVMX_ENTRY_GUEST_64 : 0));
+}
+
+static BOOLEAN NTAPI NvmxShadowed (
+  PNVMX_HOST Host,
+  ULONG32 Index,
+  BOOLEAN Write
+)
+{
+	if (NvmxFields[Index].Flags & NVMX_SHADOW_RW)
+		return TRUE;
+	return !Write && (NvmxFields[Index].Flags & NVMX_SHADOW_RO) && (Host->Misc & NVMX_MISC_VMWRITE_ANY);
+}
+
+ULONG32 NTAPI NvmxBuildShadowBitmaps (
+  PNVMX_HOST Host,
+  PUCHAR VmreadBitmap,
+  PUCHAR VmwriteBitmap
+)
+{
+	ULONG32 i, Encoding, Count = 0;
+
+	for (i = 0; i < 4096; i++)
+	{
+		VmreadBitmap[i] = 0xFF;
+		VmwriteBitmap[i] = 0xFF;
+	}
+	for (i = 0; i < NVMX_FIELD_COUNT; i++)
+	{
+		Encoding = NvmxFields[i].Encoding;
+		if (!NvmxShadowed (Host, i, FALSE))
+			continue;
+		VmreadBitmap[Encoding / 8] &= ~(1 << (Encoding % 8));
+		if (NVMX_WIDTH (Encoding) == NVMX_WIDTH_64)
+			VmreadBitmap[(Encoding + 1) / 8] &= ~(1 << ((Encoding + 1) % 8));
+		if (NvmxShadowed (Host, i, TRUE))
+		{
+			VmwriteBitmap[Encoding / 8] &= ~(1 << (Encoding % 8));
+			if (NVMX_WIDTH (Encoding) == NVMX_WIDTH_64)
+				VmwriteBitmap[(Encoding + 1) / 8] &= ~(1 << ((Encoding + 1) % 8));
+		}
+		Count++;
+	}
+	return Count;
+}
+
+ULONG32 NTAPI NvmxSyncToShadow (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  NVMX_VMWRITE Write,
+  PVOID Context
+)
+{
+	ULONG32 i, Count = 0;
+
+	for (i = 0; i < NVMX_FIELD_COUNT; i++)
+	{
+		if (!NvmxShadowed (Host, i, FALSE))
+			continue;
+		Write (Context, NvmxFields[i].Encoding, State->Vmcs12.Fields[i]);
+		Count++;
+	}
+	return Count;
+}
+
+ULONG32 NTAPI NvmxSyncFromShadow (
+  PNVMX_STATE State,
+  PNVMX_HOST Host,
+  NVMX_VMREAD Read,
+  PVOID Context
+)
+{
+	ULONG64 Value;
+	ULONG32 i, Count = 0;
+
+	for (i = 0; i < NVMX_FIELD_COUNT; i++)
+	{
+		if (!NvmxShadowed (Host, i, TRUE))
+			continue;
+		Value = Read (Context, NvmxFields[i].Encoding);
+		if (Value != State->Vmcs12.Fields[i])
+		{
+			State->Vmcs12.Fields[i] = Value;
+			NvmxMarkDirty (State, i);
+			Count++;
+		}
+	}
+	return Count;
+}
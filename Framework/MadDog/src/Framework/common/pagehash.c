@@ -0,0 +1,243 @@
+#ifdef PH_USER_MODE
+#include "pagehash.h"
+#else
+#include "common.h"
+#include "cpuid.h"
+#endif
+#include "crc32c.h"
+
+/*
+ * Guest-physical ranges registered with MadDog_HashAddRange() are hashed a page at a time with CRC32C.
+ * The first hash of a page is its baseline; MadDog_HashScan() walks the ranges from a cursor that
+ * survives between calls, stops when its TSC budget is spent and reports only the pages whose hash
+ * moved. A full pass over 16MB is a few milliseconds of hashing, so the scan can live inside VM Exits
+ * without stretching any of them. Ranges are never freed before uninstall, like every HvMm page.
+ */
+#define PH_PAGE_NEW			0	//Not hashed yet, the next hash is the baseline
+#define PH_PAGE_HASHED		1	//Hashes[] holds the hash of the last mapped visit
+
+#define CPUID_1_ECX_SSE42	20
+
+typedef struct _PH_RANGE
+{
+	BOOLEAN Active;
+	ULONG32 NumberOfPages;
+	PHYSICAL_ADDRESS Start;
+	PULONG32 Hashes;
+	PUCHAR States;
+} PH_RANGE,*PPH_RANGE;
+
+static volatile LONG PhLock;
+static BOOLEAN PhReady;
+static PH_RANGE PhRanges[MADDOG_HASH_MAX_RANGES];
+static ULONG32 PhCursorRange;
+static ULONG32 PhCursorPage;
+static ULONG64 PhPassStartTsc;
+static MADDOG_HASH_STATS PhStats;
+
+/**
+ * effects: Take the lock from non-root mode. The holder is either another CPU or a scan in VMX
+ * root mode, neither of which can be preempted by us, so spinning is bounded by one slice.
+ */
+static VOID NTAPI PhAcquire (
+)
+{
+	while (InterlockedCompareExchange (&PhLock, 1, 0))
+		;
+}
+
+static VOID NTAPI PhRelease (
+)
+{
+	InterlockedExchange (&PhLock, 0);
+}
+
+/**
+ * effects: Host virtual address of the guest-physical page <PhysicalAddress>, NULL if there is none.
+ */
+static PVOID NTAPI PhMapPage (
+  PHYSICAL_ADDRESS PhysicalAddress
+)
+{
+	PVOID Page;
+
+	Page = HvMmHostPhysicalToVirtual (PhysicalAddress);
+#ifndef _AMD64_
+	// the x86 host runs on the guest's page tables: the kernel may know a VA it has not mapped, and a
+	// user VA is only mapped, to this page, in the address space of its process
+	if (!Page)
+		return NULL;
+	if ((ULONG_PTR) Page < (ULONG_PTR) MmSystemRangeStart)
+	{
+		if ((ULONG_PTR) VmxRead (GUEST_CR3) != RegGetCr3 () || !MmIsAddressValid (Page) ||
+			MmGetPhysicalAddress (Page).QuadPart != PhysicalAddress.QuadPart)
+			return NULL;
+	}
+	else if (!MmIsAddressValid (Page))
+		return NULL;
+#endif
+	return Page;
+}
+
+NTSTATUS NTAPI MadDog_HashAddRange (
+	PHYSICAL_ADDRESS Start,
+	ULONG32 NumberOfPages,
+	PULONG32 RangeId
+)
+{
+	ULONG32 eax, ebx, ecx = 0, edx;
+	PULONG32 Hashes;
+	PALLOCATED_PAGE AllocatedPage;
+	ULONG32 i;
+
+	if (!NumberOfPages || !RangeId || (Start.QuadPart & (PAGE_SIZE - 1)))
+		return STATUS_INVALID_PARAMETER;
+
+	if (!PhReady)
+	{
+		GetCpuIdInfo (1, &eax, &ebx, &ecx, &edx);
+		Crc32cInitialize ((ecx & (1 << CPUID_1_ECX_SSE42)) ? TRUE : FALSE);
+		PhStats.Hardware = (ecx & (1 << CPUID_1_ECX_SSE42)) ? TRUE : FALSE;
+		PhReady = TRUE;
+	}
+
+	// one ULONG32 hash and one state byte per page, zeroed: every page starts as PH_PAGE_NEW
+	Hashes = HvMmAllocatePages (BYTES_TO_PAGES (NumberOfPages * (sizeof (ULONG32) + sizeof (UCHAR))),
+		NULL, LAB_TAG, &AllocatedPage);
+	if (!Hashes)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	PhAcquire ();
+	for (i = 0; i < MADDOG_HASH_MAX_RANGES; i++)
+	{
+		if (PhRanges[i].Active)
+			continue;
+		PhRanges[i].Start = Start;
+		PhRanges[i].NumberOfPages = NumberOfPages;
+		PhRanges[i].Hashes = Hashes;
+		PhRanges[i].States = (PUCHAR) (Hashes + NumberOfPages);
+		PhRanges[i].Active = TRUE;
+		PhStats.Ranges++;
+		PhStats.Pages += NumberOfPages;
+		PhRelease ();
+		*RangeId = i;
+		return STATUS_SUCCESS;
+	}
+	PhRelease ();
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS NTAPI MadDog_HashRemoveRange (
+	ULONG32 RangeId
+)
+{
+	if (RangeId >= MADDOG_HASH_MAX_RANGES)
+		return STATUS_INVALID_PARAMETER;
+
+	PhAcquire ();
+	if (!PhRanges[RangeId].Active)
+	{
+		PhRelease ();
+		return STATUS_NOT_FOUND;
+	}
+	PhRanges[RangeId].Active = FALSE;
+	PhStats.Ranges--;
+	PhStats.Pages -= PhRanges[RangeId].NumberOfPages;
+	PhRelease ();
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS NTAPI MadDog_HashScan (
+	ULONG64 Budget,
+	PMADDOG_HASH_CHANGE Changes,
+	ULONG32 Capacity,
+	PULONG32 Count
+)
+{
+	PPH_RANGE Range;
+	PHYSICAL_ADDRESS PhysicalAddress;
+	PVOID Page;
+	ULONG32 Hash, Hashed = 0;
+	ULONG64 StartTsc, Now;
+	NTSTATUS Status = STATUS_PENDING;
+
+	*Count = 0;
+	if (InterlockedCompareExchange (&PhLock, 1, 0))
+		return STATUS_DEVICE_BUSY;
+
+	StartTsc = Now = RegGetTSC ();
+	if (!PhPassStartTsc)
+		PhPassStartTsc = StartTsc;
+
+	for (;;)
+	{
+		if (PhCursorRange >= MADDOG_HASH_MAX_RANGES)
+		{
+			PhStats.Passes++;
+			PhStats.LastPassTsc = Now - PhPassStartTsc;
+			PhCursorRange = 0;
+			PhCursorPage = 0;
+			PhPassStartTsc = 0;
+			Status = STATUS_SUCCESS;
+			break;
+		}
+		Range = &PhRanges[PhCursorRange];
+		if (!Range->Active || PhCursorPage >= Range->NumberOfPages)
+		{
+			PhCursorRange++;
+			PhCursorPage = 0;
+			continue;
+		}
+		// always make progress, whatever the budget
+		if (Hashed && Now - StartTsc >= Budget)
+			break;
+
+		PhysicalAddress.QuadPart = Range->Start.QuadPart + ((ULONG64) PhCursorPage << PAGE_SHIFT);
+		Page = PhMapPage (PhysicalAddress);
+		if (!Page)
+		{
+			PhStats.PagesUnmapped++;
+			PhCursorPage++;
+			Now = RegGetTSC ();
+			continue;
+		}
+
+		Hash = Crc32cPage (Page);
+		Hashed++;
+		PhStats.PagesHashed++;
+		if (Range->States[PhCursorPage] == PH_PAGE_HASHED && Hash != Range->Hashes[PhCursorPage])
+		{
+			// leave the cursor here, the caller drains the buffer and calls again
+			if (*Count >= Capacity)
+			{
+				Status = STATUS_BUFFER_OVERFLOW;
+				break;
+			}
+			Changes[*Count].RangeId = PhCursorRange;
+			Changes[*Count].Page = PhCursorPage;
+			Changes[*Count].PhysicalAddress = PhysicalAddress;
+			Changes[*Count].OldHash = Range->Hashes[PhCursorPage];
+			Changes[*Count].NewHash = Hash;
+			(*Count)++;
+			PhStats.PagesChanged++;
+		}
+		Range->Hashes[PhCursorPage] = Hash;
+		Range->States[PhCursorPage] = PH_PAGE_HASHED;
+		PhCursorPage++;
+		Now = RegGetTSC ();
+	}
+
+	PhStats.Slices++;
+	PhStats.ScanTsc += Now - StartTsc;
+	PhRelease ();
+	return Status;
+}
+
+VOID NTAPI MadDog_HashGetStats (
+	PMADDOG_HASH_STATS Stats
+)
+{
+	PhAcquire ();
+	*Stats = PhStats;
+	PhRelease ();
+}
@@ -0,0 +1,127 @@
+#include "simd.h"
+
+/*
+ * The host runs with the guest's x87/SSE/AVX registers live: VMX switches none of them, nor XCR0.
+ * Code in VMX root mode that wants SIMD brackets it with MadDog_BeginSimd()/MadDog_EndSimd(); the
+ * first MadDog_BeginSimd() of a VM Exit saves the guest state, later ones only count the nesting.
+ * The restore is deferred to SimdRestoreGuest() just before VM Entry, so an exit that never touches
+ * SIMD pays nothing and one that does pays for a single save/restore pair. On amd64 the compiler's
+ * own use of xmm0-xmm5 is not covered here: VmxVmexitHandler() saves those and MXCSR around the C
+ * handlers, see HVM_SAVE_VOLATILE_XMM.
+ */
+#define CPUID_1_ECX_OSXSAVE		27
+#define CPUID_1_EDX_FXSR		24
+#define CPUID_D_1_EAX_XSAVEOPT	0
+
+#define FXSAVE_AREA_SIZE		512
+
+// Every component XCR0 enables; the guest owns XCR0, so that is the guest's set
+#define SIMD_ALL_COMPONENTS		((ULONG64) -1)
+
+NTSTATUS NTAPI SimdInitializeCpu (
+  PCPU Cpu
+)
+{
+	ULONG32 eax, ebx, ecx = 0, edx;
+	PHYSICAL_ADDRESS AllocatedPage;
+
+	Cpu->SimdMode = SIMD_MODE_NONE;
+	Cpu->SimdSaved = FALSE;
+	Cpu->SimdDepth = 0;
+
+	GetCpuIdInfo (1, &eax, &ebx, &ecx, &edx);
+	if (ecx & (1 << CPUID_1_ECX_OSXSAVE))
+	{
+		// CPUID.(EAX=0DH,ECX=0):ECX is the size for all supported components, whatever XCR0 holds now
+		ecx = 0;
+		GetCpuIdInfo (0xd, &eax, &ebx, &ecx, &edx);
+		Cpu->SimdAreaSize = ecx;
+		ecx = 1;
+		GetCpuIdInfo (0xd, &eax, &ebx, &ecx, &edx);
+		Cpu->SimdMode = (eax & (1 << CPUID_D_1_EAX_XSAVEOPT)) ? SIMD_MODE_XSAVEOPT : SIMD_MODE_XSAVE;
+	}
+	else if ((edx & (1 << CPUID_1_EDX_FXSR)) && (RegGetCr4 () & X86_CR4_OSFXSR))
+	{
+		Cpu->SimdAreaSize = FXSAVE_AREA_SIZE;
+		Cpu->SimdMode = SIMD_MODE_FXSAVE;
+	}
+	else
+	{
+		Print(("SimdInitializeCpu(): CPU#%d can't save SIMD state, MadDog_BeginSimd() disabled\n", 
+			Cpu->ProcessorNumber));
+		return STATUS_SUCCESS;
+	}
+
+	// page aligned, which covers the 16 (FXSAVE) and 64 (XSAVE) byte alignment
+	Cpu->SimdArea = HvMmAllocatePages (BYTES_TO_PAGES (Cpu->SimdAreaSize), NULL, 'SIMD', &AllocatedPage);
+	if (!Cpu->SimdArea)
+	{
+		Cpu->SimdMode = SIMD_MODE_NONE;
+		Print(("SimdInitializeCpu(): Failed to allocate %d bytes for the SIMD area\n", Cpu->SimdAreaSize));
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	// XRSTOR faults on a garbage XSAVE header
+	RtlZeroMemory (Cpu->SimdArea, Cpu->SimdAreaSize);
+
+	Print(("SimdInitializeCpu(): CPU#%d mode %d, %d bytes\n", 
+		Cpu->ProcessorNumber, Cpu->SimdMode, Cpu->SimdAreaSize));
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN NTAPI MadDog_BeginSimd (
+  PCPU Cpu
+)
+{
+	if (!Cpu || Cpu->SimdMode == SIMD_MODE_NONE)
+		return FALSE;
+
+	if (!Cpu->SimdSaved)
+	{
+		// HOST_CR0 is the CR0 of the time we virtualized, the guest OS may have left TS set then
+		if (RegGetCr0 () & X86_CR0_TS)
+			CmClts ();
+
+		switch (Cpu->SimdMode)
+		{
+		case SIMD_MODE_XSAVEOPT:
+			CmXsaveopt (Cpu->SimdArea, SIMD_ALL_COMPONENTS);
+			break;
+		case SIMD_MODE_XSAVE:
+			CmXsave (Cpu->SimdArea, SIMD_ALL_COMPONENTS);
+			break;
+		default:
+			CmFxsave (Cpu->SimdArea);
+			break;
+		}
+		Cpu->SimdSaved = TRUE;
+	}
+	Cpu->SimdDepth++;
+	return TRUE;
+}
+
+VOID NTAPI MadDog_EndSimd (
+  PCPU Cpu
+)
+{
+	if (!Cpu || !Cpu->SimdDepth)
+		return;
+
+	// the guest state stays in the area until SimdRestoreGuest()
+	Cpu->SimdDepth--;
+}
+
+VOID NTAPI SimdRestoreGuest (
+  PCPU Cpu
+)
+{
+	if (!Cpu->SimdSaved)
+		return;
+
+	if (Cpu->SimdMode == SIMD_MODE_FXSAVE)
+		CmFxrstor (Cpu->SimdArea);
+	else
+		CmXrstor (Cpu->SimdArea, SIMD_ALL_COMPONENTS);
+
+	Cpu->SimdSaved = FALSE;
+	Cpu->SimdDepth = 0;
+}
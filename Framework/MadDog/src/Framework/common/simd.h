@@ -0,0 +1,24 @@
+#pragma once
+#include "common.h"
+#include "HvCore.h"
+
+#define SIMD_MODE_NONE		0
+#define SIMD_MODE_FXSAVE	1
+#define SIMD_MODE_XSAVE		2
+#define SIMD_MODE_XSAVEOPT	3
+
+/**
+ * effects: Pick the save instruction for this CPU and allocate <Cpu>'s save area, sized from
+ * CPUID leaf 0xD. Without FXSR the CPU is left at SIMD_MODE_NONE and MadDog_BeginSimd() fails.
+ */
+NTSTATUS NTAPI SimdInitializeCpu (
+  PCPU Cpu
+);
+
+/**
+ * effects: Put back the guest x87/SSE/AVX state if this VM Exit saved it. Called before every
+ * VM Entry and before the trampoline back to the guest.
+ */
+VOID NTAPI SimdRestoreGuest (
+  PCPU Cpu
+);
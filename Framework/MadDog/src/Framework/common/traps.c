@@ -18,6 +18,155 @@
  */
 #include "traps.h"
 
+/*
+ * VM Exit dispatch reads Cpu->TrapSets[] without a lock. Updates therefore never touch a
+ * published TRAP_SET: they build a new one and swap the pointer, so a dispatch sees either the
+ * old or the new set, whole. The old set is retired with a snapshot of the per-CPU exit counters,
+ * which are odd while a CPU is inside a VM Exit. Once every CPU was either outside an exit at the
+ * swap or has moved on to a later exit, nobody can still be reading the set and it is recycled.
+ * Sets come from HvMm pages like the traps themselves and are not freed before uninstall.
+ */
+#define TR_SETS_PER_PAGE	((ULONG) (PAGE_SIZE / sizeof (TRAP_SET)))
+
+typedef struct _TR_QUIESCENT_STATE
+{
+	volatile LONG Exits;//Odd inside a VM Exit
+	ULONG32 Pad[15];
+} TR_QUIESCENT_STATE;
+
+static volatile LONG TrLock;//Serializes updaters only
+static PTRAP_SET TrFreeSets;
+static ULONG TrFreeCount;
+static PTRAP_SET TrRetiredSets;
+static TR_QUIESCENT_STATE TrQuiescentStates[MADDOG_BROADCAST_MAX_CPUS];
+
+//+++++++++++++++++++++Static Functions++++++++++++++++++++++++
+
+/**
+ * effects: TRUE if the caller runs inside a VM Exit handler.
+ */
+static BOOLEAN NTAPI TrInRootMode (
+)
+{
+	ULONG Processor = KeGetCurrentProcessorNumber ();
+
+	return Processor < MADDOG_BROADCAST_MAX_CPUS && (TrQuiescentStates[Processor].Exits & 1);
+}
+
+/**
+ * effects: Take TrLock. Outside VMX root mode the caller is raised to DISPATCH_LEVEL first, so a
+ * holder is never preempted with the lock and other guest CPUs only spin for its short updates.
+ * returns: FALSE if the lock is held and the caller is in VMX root mode. The holder may be the
+ * guest this very exit interrupted, so spinning could never end.
+ */
+static BOOLEAN NTAPI TrAcquire (
+  PKIRQL OldIrql
+)
+{
+	if (TrInRootMode ())
+		return InterlockedCompareExchange (&TrLock, 1, 0) == 0;
+
+	KeRaiseIrql (DISPATCH_LEVEL, OldIrql);
+	while (InterlockedCompareExchange (&TrLock, 1, 0))
+		;
+	return TRUE;
+}
+
+/**
+ * effects: Drop TrLock and, outside VMX root mode, return to <OldIrql> from TrAcquire().
+ */
+static VOID NTAPI TrRelease (
+  KIRQL OldIrql
+)
+{
+	InterlockedExchange (&TrLock, 0);
+	if (!TrInRootMode ())
+		KeLowerIrql (OldIrql);
+}
+
+/**
+ * effects: Move the retired sets no CPU can still be reading to the free list.
+ * requires: TrLock held
+ */
+static VOID NTAPI TrReclaimSets (
+)
+{
+	PTRAP_SET *Link, Set;
+	ULONG i;
+	LONG Exits;
+
+	// CPUs past the counters can't be followed, never reuse anything then
+	if (KeNumberProcessors > MADDOG_BROADCAST_MAX_CPUS)
+		return;
+
+	Link = &TrRetiredSets;
+	while ((Set = *Link) != NULL)
+	{
+		for (i = 0; i < (ULONG) KeNumberProcessors; i++)
+		{
+			Exits = TrQuiescentStates[i].Exits;
+			if ((Set->ExitCounts[i] & 1) && Exits == Set->ExitCounts[i])
+				break;
+		}
+		if (i < (ULONG) KeNumberProcessors)
+		{
+			Link = &Set->Next;
+			continue;
+		}
+		*Link = Set->Next;
+		Set->Next = TrFreeSets;
+		TrFreeSets = Set;
+		TrFreeCount++;
+	}
+}
+
+/**
+ * effects: Take an empty set from the free list, recycling retired sets first if it is empty.
+ * requires: TrLock held
+ */
+static PTRAP_SET NTAPI TrAllocateSet (
+)
+{
+	PTRAP_SET Set;
+
+	if (!TrFreeSets)
+		TrReclaimSets ();
+	Set = TrFreeSets;
+	if (!Set)
+		return NULL;
+	TrFreeSets = Set->Next;
+	TrFreeCount--;
+
+	Set->Next = NULL;
+	Set->Count = 0;
+	return Set;
+}
+
+/**
+ * effects: Make <NewSet> the traps of <TrappedVmExit> on <Cpu> and retire the set it replaces.
+ * requires: TrLock held
+ */
+static VOID NTAPI TrPublishSet (
+  PCPU Cpu,
+  ULONG TrappedVmExit,
+  PTRAP_SET NewSet
+)
+{
+	PTRAP_SET OldSet;
+	ULONG i;
+
+	// a full barrier: the new set is complete before it shows, and the counters below are
+	// read after the old one is gone
+	OldSet = (PTRAP_SET) InterlockedExchangePointer ((PVOID volatile *) &Cpu->TrapSets[TrappedVmExit], NewSet);
+	if (!OldSet)
+		return;
+
+	for (i = 0; i < MADDOG_BROADCAST_MAX_CPUS; i++)
+		OldSet->ExitCounts[i] = TrQuiescentStates[i].Exits;
+	OldSet->Next = TrRetiredSets;
+	TrRetiredSets = OldSet;
+}
+
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 
 /**
@@ -125,43 +274,162 @@ NTSTATUS NTAPI TrRegisterTrap (
   PNBP_TRAP Trap
 )
 {
-	//PLIST_ENTRY TrapList;
-
-	//if (!Cpu || !Trap)
-	//	return STATUS_INVALID_PARAMETER;
-
-	//switch (Trap->TrapType) {
-	//	case TRAP_GENERAL:
-	//		TrapList = &Cpu->GeneralTrapsList;
-	//		break;
-	//	case TRAP_MSR:
-	//		TrapList = &Cpu->MsrTrapsList;
-	//		break;
-	//	//case TRAP_IO:
-	//	//  TrapList = &Cpu->IoTrapsList;
-	//	//  break;
-	//	default:
-	//		Print(("Helloworld:TrRegisterTrap(): Unknown TRAP_TYPE code: %d\n", (char) Trap->TrapType));
-	//		return STATUS_UNSUCCESSFUL;
-	//}
-
-	//InsertTailList (TrapList, &Trap->le);
-	//return STATUS_SUCCESS;
-	PLIST_ENTRY TrapList;
-	ULONG TrappedVmExit;
+	PTRAP_SET OldSet, NewSet;
+	NTSTATUS Status;
+	KIRQL OldIrql;
 
 	if (!Cpu || !Trap)
 		return STATUS_INVALID_PARAMETER;
-
-	TrappedVmExit = Trap->TrappedVmExit;
 	//TODO - Solve this bug.
 	//BUG:In SVM the exitcode maybe >256 or <0, we don't consider this yet
-	TrapList = &Cpu->TrapsList[TrappedVmExit];
-	
-	InsertTailList (TrapList, &Trap->le);
+	if (Trap->TrappedVmExit >= NUM_VMEXITS)
+		return STATUS_INVALID_PARAMETER;
+
+	for (;;)
+	{
+		if (!TrAcquire (&OldIrql))
+			return STATUS_DEVICE_BUSY;
+		OldSet = Cpu->TrapSets[Trap->TrappedVmExit];
+		if (OldSet && OldSet->Count >= TR_SET_MAX_TRAPS)
+		{
+			TrRelease (OldIrql);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		NewSet = TrAllocateSet ();
+		if (NewSet)
+			break;
+		TrRelease (OldIrql);
+
+		// allocate outside the lock, then start over: the set may have changed meanwhile
+		if (TrInRootMode ())
+			return STATUS_INSUFFICIENT_RESOURCES;
+		if (!NT_SUCCESS (Status = TrReserveSets (1)))
+			return Status;
+	}
+
+	if (OldSet)
+	{
+		RtlCopyMemory (NewSet->Traps, OldSet->Traps, OldSet->Count * sizeof (PNBP_TRAP));
+		NewSet->Count = OldSet->Count;
+	}
+	NewSet->Traps[NewSet->Count++] = Trap;
+	TrPublishSet (Cpu, Trap->TrappedVmExit, NewSet);
+
+	TrRelease (OldIrql);
 	return STATUS_SUCCESS;
 }
 
+/**
+ * effects: Remove <Trap> from <Cpu>'s traps.
+ */
+NTSTATUS NTAPI TrDeregisterTrap (
+  PCPU Cpu,
+  PNBP_TRAP Trap
+)
+{
+	PTRAP_SET OldSet, NewSet = NULL;
+	ULONG i;
+	NTSTATUS Status;
+	KIRQL OldIrql;
+
+	if (!Cpu || !Trap || Trap->TrappedVmExit >= NUM_VMEXITS)
+		return STATUS_INVALID_PARAMETER;
+
+	for (;;)
+	{
+		if (!TrAcquire (&OldIrql))
+			return STATUS_DEVICE_BUSY;
+		OldSet = Cpu->TrapSets[Trap->TrappedVmExit];
+		for (i = 0; OldSet && i < OldSet->Count; i++)
+		{
+			if (OldSet->Traps[i] == Trap)
+				break;
+		}
+		if (!OldSet || i == OldSet->Count)
+		{
+			TrRelease (OldIrql);
+			return STATUS_NOT_FOUND;
+		}
+		// the last trap goes with its set
+		if (OldSet->Count == 1)
+			break;
+		NewSet = TrAllocateSet ();
+		if (NewSet)
+			break;
+		TrRelease (OldIrql);
+
+		if (TrInRootMode ())
+			return STATUS_INSUFFICIENT_RESOURCES;
+		if (!NT_SUCCESS (Status = TrReserveSets (1)))
+			return Status;
+	}
+
+	if (NewSet)
+	{
+		for (i = 0; i < OldSet->Count; i++)
+		{
+			if (OldSet->Traps[i] != Trap)
+				NewSet->Traps[NewSet->Count++] = OldSet->Traps[i];
+		}
+	}
+	TrPublishSet (Cpu, Trap->TrappedVmExit, NewSet);
+
+	TrRelease (OldIrql);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS NTAPI TrReserveSets (
+  ULONG Count
+)
+{
+	PTRAP_SET Sets;
+	PALLOCATED_PAGE AllocatedPage;
+	ULONG i, Free;
+	KIRQL OldIrql;
+
+	if (TrInRootMode ())
+		return STATUS_INVALID_DEVICE_STATE;
+
+	TrAcquire (&OldIrql);
+	TrReclaimSets ();
+	Free = TrFreeCount;
+	TrRelease (OldIrql);
+
+	while (Free < Count)
+	{
+		Sets = HvMmAllocatePages (1, NULL, LAB_TAG, &AllocatedPage);
+		if (!Sets)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		TrAcquire (&OldIrql);
+		for (i = 0; i < TR_SETS_PER_PAGE; i++)
+		{
+			Sets[i].Next = TrFreeSets;
+			TrFreeSets = &Sets[i];
+		}
+		TrFreeCount += TR_SETS_PER_PAGE;
+		Free = TrFreeCount;
+		TrRelease (OldIrql);
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID NTAPI TrEnterVmExit (
+  PCPU Cpu
+)
+{
+	if (Cpu->ProcessorNumber < MADDOG_BROADCAST_MAX_CPUS)
+		InterlockedIncrement (&TrQuiescentStates[Cpu->ProcessorNumber].Exits);
+}
+
+VOID NTAPI TrLeaveVmExit (
+  PCPU Cpu
+)
+{
+	if (Cpu->ProcessorNumber < MADDOG_BROADCAST_MAX_CPUS)
+		InterlockedIncrement (&TrQuiescentStates[Cpu->ProcessorNumber].Exits);
+}
+
 NTSTATUS NTAPI TrExecuteGeneralTrapHandler (
     PCPU Cpu,
     PGUEST_REGS GuestRegs,
@@ -232,20 +500,21 @@ NTSTATUS NTAPI TrFindRegisteredTrap (
 
     //return STATUS_NOT_FOUND;
 
-	PLIST_ENTRY TrapList;
+	PTRAP_SET TrapSet;
     PNBP_TRAP Trap;
 	ULONG32 exit_qualification;
     ULONG32 cr;
+	ULONG i;
 
-	if (!Cpu || !GuestRegs || !pTrap)
+	if (!Cpu || !GuestRegs || !pTrap || exitcode >= NUM_VMEXITS)
 		return STATUS_INVALID_PARAMETER;
 
-	TrapList = &Cpu->TrapsList[exitcode];
+	// read the set once, an update may replace it while we look
+	TrapSet = Cpu->TrapSets[exitcode];
 	
-	Trap = (PNBP_TRAP) TrapList->Flink;
-	while (Trap != (PNBP_TRAP) TrapList) 
+	for (i = 0; TrapSet && i < TrapSet->Count; i++) 
 	{
-		Trap = CONTAINING_RECORD (Trap, NBP_TRAP, le);
+		Trap = TrapSet->Traps[i];
 
 		if (Trap->TrapCallback) 
 		{
@@ -275,7 +544,6 @@ NTSTATUS NTAPI TrFindRegisteredTrap (
 			}
 
 		}
-		Trap = (PNBP_TRAP) Trap->le.Flink;
 	}
 
 	return STATUS_NOT_FOUND;
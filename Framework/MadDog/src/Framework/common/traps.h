@@ -22,6 +22,23 @@
 #include "common.h"
 #include "hvm.h"
 
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define TR_SET_MAX_TRAPS	15	//Traps per exit reason and CPU
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * The traps of one exit reason on one CPU, in registration order. Never changed once it is in
+ * Cpu->TrapSets[], see traps.c.
+ */
+typedef struct _TRAP_SET
+{
+	struct _TRAP_SET *Next;//Free or retired list
+	ULONG Count;
+	PNBP_TRAP Traps[TR_SET_MAX_TRAPS];
+	LONG ExitCounts[MADDOG_BROADCAST_MAX_CPUS];//Per-CPU exit counts when the set was replaced
+} TRAP_SET;
+
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 
 /**
@@ -50,12 +67,43 @@ NTSTATUS NTAPI TrInitializeMSROpTrap (
 );
 
 /**
- * effects: Register trap struct.
+ * effects: Register trap struct. Safe while <Cpu> is dispatching VM Exits. From the guest, call it at
+ * IRQL <= DISPATCH_LEVEL.
  */
 NTSTATUS NTAPI TrRegisterTrap (
   PCPU Cpu,
   PNBP_TRAP Trap
 );
+
+/**
+ * effects: Remove <Trap> from <Cpu>'s traps. Safe while <Cpu> is dispatching VM Exits; a dispatch
+ * that started before may still run <Trap>, so it must stay valid. From the guest, call it at
+ * IRQL <= DISPATCH_LEVEL.
+ */
+NTSTATUS NTAPI TrDeregisterTrap (
+  PCPU Cpu,
+  PNBP_TRAP Trap
+);
+
+/**
+ * effects: Make sure <Count> trap sets are free, so that as many updates can be made from VMX root
+ * mode, where no memory is allocated. Call it from the guest.
+ */
+NTSTATUS NTAPI TrReserveSets (
+  ULONG Count
+);
+
+/**
+ * effects: Mark the start and the end of a VM Exit on <Cpu>. Everything between the two may hold
+ * on to a trap set, so replaced sets are recycled only once every CPU has been outside one.
+ */
+VOID NTAPI TrEnterVmExit (
+  PCPU Cpu
+);
+
+VOID NTAPI TrLeaveVmExit (
+  PCPU Cpu
+);
 /**
  * Search Registered Traps
  */
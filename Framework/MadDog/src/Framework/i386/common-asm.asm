@@ -18,6 +18,27 @@ CM_SAVE_ALL_NOSEGREGS MACRO
         push eax
 ENDM
 
+; FXSAVE/FXRSTOR/XSAVE/XSAVEOPT/XRSTOR [ecx], spelled out like the vmx_* macros
+cm_fxsave_ecx MACRO
+	BYTE	0Fh, 0AEh, 001h
+ENDM
+
+cm_fxrstor_ecx MACRO
+	BYTE	0Fh, 0AEh, 009h
+ENDM
+
+cm_xsave_ecx MACRO
+	BYTE	0Fh, 0AEh, 021h
+ENDM
+
+cm_xsaveopt_ecx MACRO
+	BYTE	0Fh, 0AEh, 031h
+ENDM
+
+cm_xrstor_ecx MACRO
+	BYTE	0Fh, 0AEh, 029h
+ENDM
+
 CM_RESTORE_ALL_NOSEGREGS MACRO
         pop eax
         pop ecx
@@ -47,6 +68,11 @@ CmDebugBreak PROC
 	ret
 CmDebugBreak ENDP
 
+CmClts PROC
+	clts
+	ret
+CmClts ENDP
+
 
 ; CmReloadGdtr (PVOID GdtBase (rcx), ULONG GdtLimit (rdx) );
 
@@ -72,6 +98,47 @@ CmReloadIdtr PROC StdCall _IdtBase,_IdtLimit
 	ret
 CmReloadIdtr ENDP
 
+; CmFxsave (PVOID Area);
+CmFxsave PROC StdCall _Area
+	mov	ecx, _Area
+	cm_fxsave_ecx
+	ret
+CmFxsave ENDP
+
+; CmFxrstor (PVOID Area);
+CmFxrstor PROC StdCall _Area
+	mov	ecx, _Area
+	cm_fxrstor_ecx
+	ret
+CmFxrstor ENDP
+
+; CmXsave (PVOID Area, ULONG64 Mask);
+CmXsave PROC StdCall _Area, _MaskLow, _MaskHigh
+	mov	ecx, _Area
+	mov	eax, _MaskLow
+	mov	edx, _MaskHigh
+	cm_xsave_ecx
+	ret
+CmXsave ENDP
+
+; CmXsaveopt (PVOID Area, ULONG64 Mask);
+CmXsaveopt PROC StdCall _Area, _MaskLow, _MaskHigh
+	mov	ecx, _Area
+	mov	eax, _MaskLow
+	mov	edx, _MaskHigh
+	cm_xsaveopt_ecx
+	ret
+CmXsaveopt ENDP
+
+; CmXrstor (PVOID Area, ULONG64 Mask);
+CmXrstor PROC StdCall _Area, _MaskLow, _MaskHigh
+	mov	ecx, _Area
+	mov	eax, _MaskLow
+	mov	edx, _MaskHigh
+	cm_xrstor_ecx
+	ret
+CmXrstor ENDP
+
 ; CmSubvert (PVOID  GuestRsp);
 CmSubvert PROC StdCall _GuestRsp
 
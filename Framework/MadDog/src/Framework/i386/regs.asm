@@ -59,6 +59,12 @@ RegGetGs PROC
 	ret
 RegGetGs ENDP
 
+RegSetCr2 PROC StdCall _CR2
+	mov		eax, _CR2
+	mov		cr2, eax
+	ret
+RegSetCr2 ENDP
+
 RegSetCr3 PROC StdCall _CR3
 	mov		eax, _CR3
 	mov		cr3, eax
@@ -14,6 +14,7 @@
 option casemap:none
 
 EXTERN	 HvmEventCallback@8:PROC  
+EXTERN	 PtVmxNestedEntryFailed@8:PROC
 ;EXTERN   bCurrentMachineState:DWORD
 
 vmx_call MACRO
@@ -229,9 +230,31 @@ VmxResume PROC
 	ret
 VmxResume ENDP
 
+; ULONG_PTR VmxInvept(Type, Descriptor), returns the eflags it leaves
+VmxInvept PROC StdCall _type,_descriptor
+	mov ecx,_type
+	mov edx,_descriptor
+	BYTE	066h, 0Fh, 038h, 080h, 0Ah	;invept ecx,[edx]
+	pushfd
+	pop eax
+	ret
+VmxInvept ENDP
+
+; ULONG_PTR VmxInvvpid(Type, Descriptor), returns the eflags it leaves
+VmxInvvpid PROC StdCall _type,_descriptor
+	mov ecx,_type
+	mov edx,_descriptor
+	BYTE	066h, 0Fh, 038h, 081h, 0Ah	;invvpid ecx,[edx]
+	pushfd
+	pop eax
+	ret
+VmxInvvpid ENDP
+
 
 
 ;HvmEventCallback (PCPU Cpu, PGUEST_REGS GuestRegs)
+; A nonzero return asks for VMLAUNCH, and a failed entry goes to
+; PtVmxNestedEntryFailed (PCPU Cpu, PGUEST_REGS GuestRegs), as on amd64.
 VmxVmexitHandler PROC   StdCall  
 	HVM_SAVE_ALL_NOSEGREGS
 
@@ -243,8 +266,28 @@ VmxVmexitHandler PROC   StdCall
 	push    ecx		;PCPU
 	call	HvmEventCallback@8
 	
+	test	al,al
+	jnz	VmxVmexitLaunch
 	HVM_RESTORE_ALL_NOSEGREGS	
 	vmx_resume
+	jmp	VmxVmexitFailed
+
+VmxVmexitLaunch:
+	HVM_RESTORE_ALL_NOSEGREGS
+	vmx_launch
+
+VmxVmexitFailed:
+	HVM_SAVE_ALL_NOSEGREGS
+
+	mov     ecx,[esp + 24h]     ;PCPU
+	mov 	ebx,esp		;ebx=GuestRegs
+
+	push	ebx     ;GuestRegs
+	push    ecx		;PCPU
+	call	PtVmxNestedEntryFailed@8
+
+	HVM_RESTORE_ALL_NOSEGREGS
+	vmx_resume
 	ret
 
 VmxVmexitHandler ENDP
@@ -38,6 +38,9 @@
 
 #include "VMCSServices/VMXTimerService.h"
 #include "VMCSServices/VmxDefaultInterceptions.h"
+#include "VMCSServices/VmxMtfTraceService.h"
+#include "VMCSServices/VmxEmulateService.h"
+#include "VMCSServices/VmxNestedService.h"
 
 /**
  * This function is used to set value safely according to MSR register.
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#pragma once
+
+#include <ntddk.h>
+#include "HvCoreDefs.h"
+#include "emulate.h"
+
+#define VMX_EMU_MAX_REPEAT		256	//REP elements per VM Exit, interrupts are off meanwhile
+
+#define VMX_GUEST_VECTOR_GP		13
+#define VMX_GUEST_VECTOR_PF		14
+
+/**
+ * The exception the guest takes in place of an emulated access its page tables do not allow.
+ */
+typedef struct _VMX_GUEST_FAULT
+{
+	BOOLEAN Raised;
+	ULONG32 Vector;//VMX_GUEST_VECTOR_PF, or VMX_GUEST_VECTOR_GP for a non-canonical address
+	ULONG32 ErrorCode;
+	ULONG64 Address;//The linear address, CR2 of a #PF
+} VMX_GUEST_FAULT,
+ *PVMX_GUEST_FAULT;
+
+/*
+ * effects: Finish the guest instruction at GUEST_RIP inside the current VM Exit, whatever exit it
+ * caused: the guest registers, RIP and RFLAGS are loaded into the emulator of emulate.h, the instruction
+ * is run and the results are written back. The handler calling this must return FALSE, RIP is already
+ * past the instruction. A REP moves at most VMX_EMU_MAX_REPEAT elements per exit, with interrupts off;
+ * if more are left, RIP stays on it, so the guest takes pending interrupts and then exits again for
+ * the rest. That too returns HVSTATUS_SUCCESS.
+ * Guest memory is reached through the guest page tables, with the checks of the guest CPL, CR0.WP
+ * and SMAP, and then through the host mapping of the physical page. Locked instructions, XCHG among
+ * them, are done with interlocked operations on that mapping.
+ * returns: HVSTATUS_UNSUPPORTED_FEATURE if the instruction is not emulated, nothing was changed and
+ * the exit qualification is still there to fall back on. STATUS_UNSUCCESSFUL if a memory or port
+ * access failed: RIP still points at the instruction and only the elements a REP already moved are
+ * written back, in RCX, RSI and RDI. If the guest page tables refused the access, <Fault> holds the exception
+ * to inject with PtVmxInjectGuestFault().
+ */
+HVSTATUS NTAPI PtVmxEmulateInstruction (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	EMU_ACCESS_PORT AccessPort, /* If this is null, port I/O goes to the hardware*/
+	PVOID Context, /* Passed to <AccessPort>*/
+	PVMX_GUEST_FAULT Fault /* May be null*/
+);
+
+/**
+ * effects: Copy <Size> bytes between <Buffer> and the guest linear address <Address> of the current
+ * VM Exit, with the same page walk and checks as the emulator.
+ * returns: FALSE if the guest may not make the access, with the exception in <Fault>, or if the host
+ * cannot reach part of the range, with no exception raised. A refused access copies nothing.
+ */
+BOOLEAN NTAPI PtVmxAccessGuestMemory (
+	ULONG64 Address,
+	PVOID Buffer,
+	ULONG32 Size,
+	BOOLEAN Write,
+	PVMX_GUEST_FAULT Fault /* May be null*/
+);
+
+/**
+ * effects: Make the next VM Entry deliver <Fault> to the guest, if one was raised. The instruction
+ * that caused it must not be completed: RIP stays on it.
+ */
+VOID NTAPI PtVmxInjectGuestFault (
+	PVMX_GUEST_FAULT Fault
+);
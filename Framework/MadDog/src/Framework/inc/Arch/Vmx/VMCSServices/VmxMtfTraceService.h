@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#pragma once
+
+#include <ntddk.h>
+#include "HvCoreDefs.h"
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define MTF_TRACE_BUFFER_PAGES		16	//Record buffer of every CPU, 64KB
+#define MTF_TRACE_MAX_OPCODE		15	//Longest x86 instruction
+
+//Flags of MTF_TRACE_CONFIG
+#define MTF_TRACE_OPCODES			0x00000001	//Record the bytes of every instruction
+#define MTF_TRACE_DELTAS			0x00000002	//Record the registers every instruction changed
+
+//States of the trace on one CPU
+#define MTF_TRACE_IDLE				0	//Nothing started since the last PtVmxMtfTraceStop()
+#define MTF_TRACE_WAITING			1	//Waiting for the start conditions
+#define MTF_TRACE_STEPPING			2
+#define MTF_TRACE_DONE				3	//Budget used up, buffer full or stopped
+#define MTF_TRACE_UNSUPPORTED		4	//The processor has no monitor trap flag
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * Start conditions and filter of a trace. A CPU starts stepping at the first VM Exit at which all the
+ * set conditions hold, and from then on records only the instructions inside the RIP range and CR3.
+ * Exits are the only points the conditions are looked at, so a RIP range alone starts the trace only
+ * once an exit happens to land in it; pair it with a CR3 or an exit count to start earlier.
+ */
+typedef struct _MTF_TRACE_CONFIG
+{
+	ULONG_PTR RipStart;//[RipStart, RipEnd), 0 and 0 for any RIP
+	ULONG_PTR RipEnd;
+	ULONG_PTR Cr3;//0 for any address space
+	ULONG32 StartExitReason;
+	ULONG32 StartExitCount;//Exits of <StartExitReason> to see before starting, 0 for no such condition
+	ULONG32 Budget;//Instructions stepped on each CPU before its trace stops, recorded or not
+	ULONG32 Flags;
+} MTF_TRACE_CONFIG,
+ *PMTF_TRACE_CONFIG;
+
+/**
+ * One executed instruction. The record is followed by <OpcodeLength> instruction bytes, padded to a
+ * ULONG_PTR, and then by the new value of every register set in <DeltaMask>, lowest bit first.
+ * Bit n of <DeltaMask> is slot n of GUEST_REGS, where the esp slot holds the guest RSP and the eflags
+ * slot the guest RFLAGS. RIP is not a delta: it is the <Rip> of the next record.
+ */
+typedef struct _MTF_TRACE_RECORD
+{
+	ULONG_PTR Rip;
+	ULONG32 DeltaMask;
+	USHORT Size;//Of the whole record, a multiple of sizeof (ULONG_PTR)
+	UCHAR OpcodeLength;
+	UCHAR Reserved;
+} MTF_TRACE_RECORD,
+ *PMTF_TRACE_RECORD;
+
+typedef struct _MTF_TRACE_STATS
+{
+	ULONG32 State;
+	ULONG32 Steps;//Instructions stepped over, at MTF exits or completed by a trap handler
+	ULONG32 Records;
+	ULONG32 Filtered;//Steps outside the RIP range or CR3
+	ULONG32 BytesUsed;
+} MTF_TRACE_STATS,
+ *PMTF_TRACE_STATS;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Start a new trace on every CPU with the conditions in <Config>, dropping the records of the
+ * previous one. Each CPU picks the trace up at its next VM Exit. The first call allocates the buffers,
+ * so call this from non-root mode.
+ * returns: HVSTATUS_INVALID_PARAMETERS if <Budget> is 0 or the RIP range is empty.
+ */
+HVSTATUS NTAPI PtVmxMtfTraceStart (
+	PMTF_TRACE_CONFIG Config
+);
+
+/**
+ * effects: Stop the trace on every CPU at its next VM Exit. The records stay until the next start.
+ */
+VOID NTAPI PtVmxMtfTraceStop (
+);
+
+/**
+ * returns: HVSTATUS_INVALID_PARAMETERS if there is no CPU <CpuIndex>.
+ */
+HVSTATUS NTAPI PtVmxMtfTraceQuery (
+	ULONG32 CpuIndex,
+	PMTF_TRACE_STATS Stats
+);
+
+/**
+ * effects: Copy the whole records of CPU <CpuIndex> that fit in <Length> bytes to <Buffer>. This is
+ * safe while the CPU is still tracing: records are published only once they are complete.
+ * returns: The number of bytes copied.
+ */
+ULONG32 NTAPI PtVmxMtfTraceCopy (
+	ULONG32 CpuIndex,
+	PVOID Buffer,
+	ULONG32 Length
+);
+
+/**
+ * effects: Called at every VM Exit before the registered traps are searched. Checks the start
+ * conditions and records the instruction the guest just stepped over.
+ * returns: TRUE if the exit was a monitor trap flag exit and is fully handled.
+ */
+BOOLEAN NTAPI PtVmxMtfTraceHandleExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Exitcode
+);
+
+/**
+ * effects: Called once the trap handler of an exit PtVmxMtfTraceHandleExit() did not handle has run.
+ * Records the instruction the handler completed, if it moved RIP, and snapshots the guest again.
+ */
+VOID NTAPI PtVmxMtfTraceAfterExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs
+);
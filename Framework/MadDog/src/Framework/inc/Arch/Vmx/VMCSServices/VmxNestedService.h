@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2010, Trusted Computing Lab in Shanghai Jiaotong University.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+#pragma once
+
+#include <ntddk.h>
+#include "HvCoreDefs.h"
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+typedef struct _VMX_NESTED_STATS
+{
+	BOOLEAN VmxOn;//The guest hypervisor is in VMX operation
+	BOOLEAN Shadowing;//Its VMREAD and VMWRITE of the common fields run without exiting
+	BOOLEAN InL2;//The CPU runs the nested guest
+	ULONG32 Instructions;//VMX instructions emulated
+	ULONG32 Entries;//VMLAUNCH and VMRESUME that reached vmcs02
+	ULONG32 FullMerges;//Entries that wrote the whole vmcs12, see NvmxMerge()
+	ULONG32 FieldsMerged;//VMWRITEs into vmcs02 by all entries
+	ULONG32 Exits;//Nested VM Exits handed to the guest hypervisor
+	ULONG32 ExitsToL0;//Exits of the nested guest only L0's own controls asked for, handled by its traps
+	ULONG32 EntryFailures;//Entries vmcs02 refused with VMfailValid
+} VMX_NESTED_STATS,
+ *PVMX_NESTED_STATS;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Let the guest on <Cpu> run a hypervisor of its own: register the handlers of the VMX
+ * instructions and allocate the VMCSs L0 runs the nested guest with. Call this from the trap
+ * registration of a sample, in non-root mode, in place of handlers that make VMX instructions fail.
+ * VMREAD and VMWRITE of the common fields go through a shadow VMCS where the processor has VMCS
+ * shadowing; elsewhere they all exit and are emulated.
+ * returns: HVSTATUS_INVALID_PARAMETERS if there is no slot for the CPU.
+ */
+HVSTATUS NTAPI PtVmxNestedInitialize (
+	PCPU Cpu
+);
+
+/**
+ * returns: HVSTATUS_INVALID_PARAMETERS if CPU <CpuIndex> was not initialized.
+ */
+HVSTATUS NTAPI PtVmxNestedQuery (
+	ULONG32 CpuIndex,
+	PVMX_NESTED_STATS Stats
+);
+
+/**
+ * effects: Called at every VM Exit before anything else looks at it. An exit of the nested guest
+ * belongs to the guest hypervisor if its vmcs12 asks for it: its exit information and the guest state
+ * are saved into vmcs12, vmcs01 is made current again and the guest hypervisor continues at its
+ * HOST_RIP. An exit only L0's own controls asked for is left to L0's traps, with vmcs02 current.
+ * returns: TRUE if the exit was a nested VM Exit and is fully handled.
+ */
+BOOLEAN NTAPI PtVmxNestedHandleExit (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Exitcode
+);
+
+/**
+ * effects: Called by VmxVmexitHandler() when the VMLAUNCH or VMRESUME it ended with failed. That
+ * only happens for vmcs02, whose controls come from the guest hypervisor: the failure is reported to
+ * it as the VMfailValid of its own VMLAUNCH or VMRESUME, and vmcs01 is made current to resume with.
+ */
+VOID NTAPI PtVmxNestedEntryFailed (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs
+);
@@ -27,6 +27,7 @@
 #define MSR_LSTAR		0xC0000082
 #define	MSR_SHADOW_GS_BASE	0xc0000102
 #define	MSR_VM_HSAVE_PA		0xC0010117
+#define MSR_IA32_PAT		0x277
 
 #define EFER_LME     (1<<8)
 
@@ -73,6 +74,15 @@
 #define MSR_IA32_VMX_EXIT_CTLS		0x483
 #define MSR_IA32_VMX_ENTRY_CTLS		0x484
 #define MSR_IA32_VMX_MISC			0x485
+#define MSR_IA32_VMX_CR0_FIXED0		0x486
+#define MSR_IA32_VMX_CR0_FIXED1		0x487
+#define MSR_IA32_VMX_CR4_FIXED0		0x488
+#define MSR_IA32_VMX_CR4_FIXED1		0x489
+#define MSR_IA32_VMX_PROCBASED_CTLS2	0x48B
+#define MSR_IA32_VMX_EPT_VPID_CAP	0x48C
+#define MSR_IA32_VMX_TRUE_PROCBASED_CTLS	0x48E
+#define MSR_IA32_VMX_TRUE_EXIT_CTLS	0x48F
+#define MSR_IA32_VMX_TRUE_ENTRY_CTLS	0x490
 
 #define MSR_IA32_SYSENTER_CS		0x174
 #define MSR_IA32_SYSENTER_ESP		0x175
@@ -138,11 +148,14 @@
 #define EXIT_REASON_MSR_LOADING         34
 
 #define EXIT_REASON_MWAIT_INSTRUCTION   36
+#define EXIT_REASON_MONITOR_TRAP_FLAG   37
 #define EXIT_REASON_MONITOR_INSTRUCTION 39
 #define EXIT_REASON_PAUSE_INSTRUCTION   40
 
 #define EXIT_REASON_MACHINE_CHECK       41
 
+#define EXIT_REASON_INVEPT              50
+#define EXIT_REASON_INVVPID             53
 #define EXIT_REASON_TPR_BELOW_THRESHOLD 55
 
 #define EXIT_REASON_TPR_BELOW_THRESHOLD 55
@@ -166,7 +179,8 @@ typedef enum SEGREGS
 
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 
-ULONG32 NTAPI VmxRead (//Here should 
+// Natural-width fields come back whole: 64 bits on amd64 hosts.
+ULONG_PTR NTAPI VmxRead (
   ULONG64 field
 );
 
@@ -43,9 +43,15 @@ enum
 #define CPU_BASED_MOV_DR_EXITING        0x00800000
 #define CPU_BASED_UNCOND_IO_EXITING     0x01000000
 #define CPU_BASED_ACTIVATE_IO_BITMAP    0x02000000
+#define CPU_BASED_MONITOR_TRAP_FLAG     0x08000000
 #define CPU_BASED_ACTIVATE_MSR_BITMAP   0x10000000
 #define CPU_BASED_MONITOR_EXITING       0x20000000
 #define CPU_BASED_PAUSE_EXITING         0x40000000
+#define CPU_BASED_ACTIVATE_SECONDARY_CONTROLS 0x80000000
+
+#define SECONDARY_EXEC_ENABLE_EPT       0x00000002
+#define SECONDARY_EXEC_ENABLE_VPID      0x00000020
+#define SECONDARY_EXEC_SHADOW_VMCS      0x00004000
 
 #define PIN_BASED_EXT_INTR_MASK         0x00000001
 #define PIN_BASED_NMI_EXITING           0x00000008
@@ -91,6 +97,10 @@ enum
   TSC_OFFSET_HIGH = 0x00002011,
   VIRTUAL_APIC_PAGE_ADDR = 0x00002012,
   VIRTUAL_APIC_PAGE_ADDR_HIGH = 0x00002013,
+  VMREAD_BITMAP = 0x00002026,
+  VMREAD_BITMAP_HIGH = 0x00002027,
+  VMWRITE_BITMAP = 0x00002028,
+  VMWRITE_BITMAP_HIGH = 0x00002029,
   VMCS_LINK_POINTER = 0x00002800,
   VMCS_LINK_POINTER_HIGH = 0x00002801,
   GUEST_IA32_DEBUGCTL = 0x00002802,
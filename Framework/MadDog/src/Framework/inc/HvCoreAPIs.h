@@ -30,10 +30,14 @@
 //#ifdef DEBUG_HVCORE
 #include "HvCoreDebugger.h"
 //#endif
+#include "pagehash.h"
 
 //+++++++++++++++++++++Global Variables Declaration+++++++++++++++
 //extern BOOLEAN bCurrentMachineState; //true means it is in guest OS now, otherwise in hypervisor
 
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define MADDOG_BROADCAST_MAX_CPUS	32
+
 //+++++++++++++++++++++Structs Definitions+++++++++++++++++++++
 
 /**
@@ -46,9 +50,31 @@ typedef struct _MadDog_Control
 	NTSTATUS (*UserFinalization)();//This always happens after Hypervisor removed, You don't need to handle the initialization on multi processor 
 	NTSTATUS (*SetupVMCB)(PCPU Cpu, PVOID GuestEip, PVOID GuestEsp);
 	NTSTATUS (*ApplyTraps) (PCPU Cpu);
+	//Optional. Called at the end of every VM Exit with the exit reason, the guest CR3 the exit came from
+	//and the TSC on entry to/return from HvmEventCallback(). Runs in VMX root mode, keep it short.
+	VOID (*AccountExit) (PCPU Cpu, ULONG32 ExitReason, ULONG32 GuestCr3, ULONG64 EntryTsc, ULONG64 LeaveTsc);
 } MadDog_Control,
  *PMadDog_Control;
 
+/**
+ * Work item of MadDog_Broadcast(). Runs in VMX root mode on each CPU, inside whatever VM Exit that
+ * CPU takes next, so it must not call into the guest OS. Returns the CPU's share of the result.
+ */
+typedef ULONG64 (NTAPI * MADDOG_BROADCAST_HANDLER) (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	ULONG32 Argument
+);
+
+typedef struct _MADDOG_BROADCAST_RESULT
+{
+	ULONG32 CpuMask;//CPUs which ran the handler
+	ULONG32 CpuCount;
+	ULONG64 Sum;//Sum of the per-CPU results
+	ULONG64 PerCpu[MADDOG_BROADCAST_MAX_CPUS];
+} MADDOG_BROADCAST_RESULT,
+ *PMADDOG_BROADCAST_RESULT;
+
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 
 /**
@@ -80,9 +106,70 @@ NTSTATUS NTAPI HvInitializeGeneralTrap (
 );
 
 /**
- * effects: Register trap struct.
+ * effects: Register trap struct. This may be done at any time, not only in ApplyTraps: the
+ * traps of <Cpu> are replaced as a whole while it keeps dispatching VM Exits. At most
+ * TR_SET_MAX_TRAPS (15) traps per exit reason and CPU.
+ * returns: STATUS_DEVICE_BUSY if called in VMX root mode while another update is in progress,
+ * STATUS_INSUFFICIENT_RESOURCES in VMX root mode without a free trap set, see
+ * MadDog_ReserveTrapSets().
  */
 NTSTATUS NTAPI MadDog_RegisterTrap (
 	PCPU Cpu,
 	PNBP_TRAP Trap
+);
+
+/**
+ * effects: Remove <Trap> from the traps of <Cpu>, at any time. VM Exits that already found
+ * <Trap> still run it, and trap structs are never freed, so the caller has nothing to wait for.
+ * Leave a trap for every exit reason the VMCS still intercepts: an exit without one is fatal.
+ */
+NTSTATUS NTAPI MadDog_DeregisterTrap (
+	PCPU Cpu,
+	PNBP_TRAP Trap
+);
+
+/**
+ * effects: Keep <Count> trap sets free, each serves one later MadDog_RegisterTrap() or
+ * MadDog_DeregisterTrap() made in VMX root mode (a hypercall handler, say), where no memory can be
+ * allocated. Call it from the guest.
+ */
+NTSTATUS NTAPI MadDog_ReserveTrapSets (
+	ULONG Count
+);
+
+/**
+ * effects: Run <Handler> on every subverted CPU and aggregate the results, from a single hypercall.
+ * The first call posts <Handler> to the per-CPU mailboxes and runs it on <Cpu> at once, the other
+ * CPUs run it at their next VM Exit. Call it again (e.g. leave the guest RIP on the trapping
+ * instruction) until it stops returning STATUS_PENDING; later calls with the same <Handler> and
+ * <Argument> may come from any CPU.
+ * returns: STATUS_PENDING while CPUs are outstanding, STATUS_DEVICE_BUSY if another broadcast is in
+ * flight, otherwise STATUS_SUCCESS or STATUS_TIMEOUT (<Timeout> TSC ticks passed since the post)
+ * with <Result> filled from the CPUs that answered.
+ */
+NTSTATUS NTAPI MadDog_Broadcast (
+	PCPU Cpu,
+	PGUEST_REGS GuestRegs,
+	MADDOG_BROADCAST_HANDLER Handler,
+	ULONG32 Argument,
+	ULONG64 Timeout,
+	PMADDOG_BROADCAST_RESULT Result
+);
+
+/**
+ * effects: Make the x87/SSE/AVX registers usable by VMX root mode code until the matching
+ * MadDog_EndSimd(). The guest state is saved at the first call in a VM Exit and restored right
+ * before VM Entry, so nested and repeated pairs in one exit cost nothing more.
+ * returns: FALSE if this CPU can't save the state; use integer code instead and don't call
+ * MadDog_EndSimd().
+ */
+BOOLEAN NTAPI MadDog_BeginSimd (
+	PCPU Cpu
+);
+
+/**
+ * effects: End a MadDog_BeginSimd() section. The guest state is not restored until VM Entry.
+ */
+VOID NTAPI MadDog_EndSimd (
+	PCPU Cpu
 );
\ No newline at end of file
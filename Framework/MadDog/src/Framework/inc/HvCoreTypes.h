@@ -98,13 +98,14 @@ typedef struct _VMX
   PHYSICAL_ADDRESS MSRBitmapPA; // points to MsrBitMap
   PVOID MSRBitmap;
 
-  ULONG GuestCR0;             //Guest's CR0. 
-  ULONG GuestCR3;             //Guest's CR3. for storing guest cr3 when guest diasble paging.
-  ULONG GuestCR4;             //Guest's CR4. 
+  ULONG_PTR GuestCR0;         //Guest's CR0. 
+  ULONG_PTR GuestCR3;         //Guest's CR3. for storing guest cr3 when guest diasble paging.
+  ULONG_PTR GuestCR4;         //Guest's CR4. 
   ULONG64 GuestEFER;
   UCHAR GuestStateBeforeInterrupt[0xc00];
 
   VMXFEATURESMSR FeaturesMSR;
+  BOOLEAN LaunchVmcsToContinue; // VmcsToContinuePA is clear, VmxVmexitHandler() enters it with VMLAUNCH
 
 } VMX,
  *PVMX;
@@ -123,6 +124,8 @@ typedef struct _WORMHOLE
 	
 } WORMHOLE,*PWORMHOLE;
 
+typedef struct _TRAP_SET *PTRAP_SET;//traps.h
+
 typedef struct _CPU
 {
 
@@ -142,7 +145,8 @@ typedef struct _CPU
 	//LIST_ENTRY GeneralTrapsList;  // list of BP_TRAP structures
 	//LIST_ENTRY MsrTrapsList;      //
 	// LIST_ENTRY IoTrapsList;       //
-	LIST_ENTRY TrapsList[NUM_VMEXITS];
+	// Immutable, replaced as a whole by TrRegisterTrap()/TrDeregisterTrap(); NULL for no traps
+	PTRAP_SET volatile TrapSets[NUM_VMEXITS];
 	// [Superymk 6/1/2009] End
 
 	// PVOID SparePage;              // a single page which was allocated just to get an unused PTE.
@@ -154,6 +158,13 @@ typedef struct _CPU
 
 	PVOID HostStack;              // note that CPU structure reside in this memory region
 	PWORMHOLE HypervisorGuestPipe; 
+
+	// Guest x87/SSE/AVX state, saved lazily by MadDog_BeginSimd() (see simd.c)
+	PVOID SimdArea;               // FXSAVE/XSAVE area, page aligned
+	ULONG SimdAreaSize;
+	UCHAR SimdMode;               // SIMD_MODE_*
+	BOOLEAN SimdSaved;            // the guest state of the current VM Exit is in <SimdArea>
+	USHORT SimdDepth;             // nesting of MadDog_BeginSimd()/MadDog_EndSimd()
 	// BOOLEAN Nested;
 
 	// ULONG64 ComPrintLastTsc;
@@ -162,17 +173,30 @@ typedef struct _CPU
  	int ChickenQueueHead, ChickenQueueTail;
 } CPU;
 
+// Laid out by HVM_SAVE_ALL_NOSEGREGS (vmx-asm.asm). The registers keep
+// their x86 names but are native width, so on amd64 eax holds all of rax;
+// slot n is general-purpose register n of the exit qualifications.
 typedef struct _GUEST_REGS
 {
-  ULONG32 eax;                  // 0x00         // NOT VALID FOR SVM
-  ULONG32 ecx;
-  ULONG32 edx;                  // 0x08
-  ULONG32 ebx;
-  ULONG32 esp;                  // esp is not stored here on SVM 0x10
-  ULONG32 ebp;
-  ULONG32 esi;		      //0x18
-  ULONG32 edi;
-  ULONG32 eflags;            //0x20
+  ULONG_PTR eax;                // x86 0x00, amd64 0x00   // NOT VALID FOR SVM
+  ULONG_PTR ecx;
+  ULONG_PTR edx;                // x86 0x08, amd64 0x10
+  ULONG_PTR ebx;
+  ULONG_PTR esp;                // esp is not stored here on SVM 0x10
+  ULONG_PTR ebp;
+  ULONG_PTR esi;		// x86 0x18, amd64 0x30
+  ULONG_PTR edi;
+#ifdef _AMD64_
+  ULONG_PTR r8;                 // amd64 0x40
+  ULONG_PTR r9;
+  ULONG_PTR r10;
+  ULONG_PTR r11;
+  ULONG_PTR r12;
+  ULONG_PTR r13;
+  ULONG_PTR r14;
+  ULONG_PTR r15;
+#endif
+  ULONG_PTR eflags;             // x86 0x20, amd64 0x80
 } GUEST_REGS;
 
 //+++++++++++++++++++++Traps Structs++++++++++++++++++++++++++++++++
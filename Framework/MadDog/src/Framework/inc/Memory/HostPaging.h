@@ -0,0 +1,96 @@
+#pragma once
+
+/*
+ * The amd64 host page tables: a private copy of the kernel's PML4 whose kernel half follows the guest's,
+ * plus one kernel slot that holds a direct map of physical memory. The slot is reserved in the guest's
+ * PML4 with a marker entry, which is not present, so the kernel does not place a mapping there that the
+ * host would hide. Pages come from callbacks, so the same code builds the tables in the hypervisor and
+ * on simulated physical memory in user-mode tools (with HOSTPG_USER_MODE defined).
+ */
+#ifdef HOSTPG_USER_MODE
+typedef unsigned char BOOLEAN;
+typedef unsigned int ULONG32;
+typedef unsigned long long ULONG64;
+typedef unsigned long long *PULONG64;
+typedef unsigned long ULONG_PTR;
+#define VOID	void
+typedef void *PVOID;
+#define NTAPI
+#define TRUE	1
+#define FALSE	0
+#else
+#include <ntddk.h>
+#endif
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define HOSTPG_ENTRIES			512
+#define HOSTPG_KERNEL_SLOT		256	//First PML4 slot of the kernel half
+
+#define HOSTPG_PRESENT			0x01
+#define HOSTPG_WRITABLE			0x02
+#define HOSTPG_LARGE			0x80
+#define HOSTPG_PFN_MASK			0x000ffffffffff000ULL
+
+#define HOSTPG_PAGE_1GB			0x40000000ULL
+#define HOSTPG_PAGE_2MB			0x200000ULL
+
+//Guest PML4 entry of the reserved slot: not present, so the processor ignores the other bits
+#define HOSTPG_SLOT_MARKER		0x4d61644400000000ULL	//"MadD"
+
+//HpBuild() results
+#define HOSTPG_OK				0
+#define HOSTPG_NO_SLOT			1
+#define HOSTPG_NO_MEMORY		2
+
+//+++++++++++++++++++++Structs Definitions+++++++++++++++++++++
+
+/**
+ * Allocate a zeroed 4KB page and store its physical address in <PhysicalAddress>.
+ * Pages are not freed one by one, the owner of the allocator releases them all.
+ */
+typedef PVOID (NTAPI * HOSTPG_ALLOCATE_PAGE) (
+	PULONG64 PhysicalAddress
+);
+
+typedef struct _HOSTPG_TABLES
+{
+	PULONG64 Pml4;//Host PML4
+	ULONG64 Pml4PA;
+	PULONG64 GuestPml4;//PML4 the kernel half is copied from
+	ULONG32 Slot;//PML4 slot of the direct map
+	ULONG_PTR PhysicalMapBase;//Host VA of physical address 0
+	ULONG64 PhysicalMapSize;
+} HOSTPG_TABLES,
+ *PHOSTPG_TABLES;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Reserve the highest free kernel slot of <GuestPml4>, then build a copy of <GuestPml4> with
+ * a direct map of the first <PhysicalMapSize> bytes (a multiple of 1GB, at most 512GB) in that slot,
+ * from 1GB pages if <b1GbPages>, 2MB pages otherwise.
+ * returns: HOSTPG_OK, HOSTPG_NO_SLOT or HOSTPG_NO_MEMORY. On failure the slot is released again.
+ */
+ULONG32 NTAPI HpBuild (
+	PHOSTPG_TABLES Tables,
+	PULONG64 GuestPml4,
+	ULONG64 PhysicalMapSize,
+	BOOLEAN b1GbPages,
+	HOSTPG_ALLOCATE_PAGE AllocatePage
+);
+
+/**
+ * effects: Copy the kernel PML4 entries the guest has added since the last call, except the reserved
+ * slot, into the host PML4. Cheap enough to call at every VM Exit.
+ * returns: The number of entries copied.
+ */
+ULONG32 NTAPI HpSyncKernelHalf (
+	PHOSTPG_TABLES Tables
+);
+
+/**
+ * effects: Give the reserved slot back to the guest, if it still holds the marker.
+ */
+VOID NTAPI HpRelease (
+	PHOSTPG_TABLES Tables
+);
@@ -23,11 +23,28 @@
 /**
  * effects: Return the value of Host CR3
  */
-ULONG NTAPI HvMmGetHostCR3 (
+ULONG_PTR NTAPI HvMmGetHostCR3 (
 );
 
 /**
  * effects: Return the origin value of Guest CR3 before install the hypervisor
  */
-ULONG NTAPI HvMmGetOriginGuestCR3 (
-);
\ No newline at end of file
+ULONG_PTR NTAPI HvMmGetOriginGuestCR3 (
+);
+
+/**
+ * effects: Return the host virtual address of <PhysicalAddress>, or NULL
+ * if the host page tables do not map it.
+ */
+PVOID NTAPI HvMmHostPhysicalToVirtual (
+  PHYSICAL_ADDRESS PhysicalAddress
+);
+
+#ifdef _AMD64_
+/**
+ * effects: Give the host page tables the kernel PML4 entries the guest
+ * has added since they were built. Called at every VM Exit.
+ */
+VOID NTAPI HvMmSyncHostPageTables (
+);
+#endif
\ No newline at end of file
@@ -0,0 +1,250 @@
+#pragma once
+
+/*
+ * Decoder and emulator for the integer instructions a VM Exit handler has to finish itself: MOV,
+ * MOVZX/MOVSX, the ALU and read-modify-write group, XCHG/CMPXCHG/XADD, string moves and port I/O with
+ * REP. Memory and ports are reached only through callbacks, so the same code runs on guest memory in a
+ * handler and on plain buffers in user-mode tools (with EMU_USER_MODE defined).
+ */
+#ifdef EMU_USER_MODE
+#include <stddef.h>
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+typedef unsigned char BOOLEAN;
+typedef unsigned int ULONG32;
+typedef unsigned long long ULONG64;
+typedef unsigned int *PULONG32;
+typedef unsigned long long *PULONG64;
+#define VOID	void
+typedef void *PVOID;
+#define NTAPI
+#define TRUE	1
+#define FALSE	0
+#else
+#include <ntddk.h>
+#endif
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define EMU_MAX_INSTRUCTION		15
+#define EMU_CACHE_ENTRIES		32	//Decoded instructions kept per cache, a power of 2
+
+//Default operand and address size of the code segment
+#define EMU_MODE_16				2
+#define EMU_MODE_32				4
+#define EMU_MODE_64				8
+
+//Results of EmuDecode(), EmuExecute() and EmuStep()
+#define EMU_OK					0
+#define EMU_UNSUPPORTED			1	//Not in the subset or not decodable, nothing was changed
+#define EMU_ACCESS_FAILED		2	//A callback failed, see EmuExecute()
+#define EMU_REPEAT				3	//A REP stopped after State->MaxRepeat elements, RIP is unchanged
+
+//Register numbers, in the encoding order, which is also the GUEST_REGS slot order
+#define EMU_RAX					0
+#define EMU_RCX					1
+#define EMU_RDX					2
+#define EMU_RBX					3
+#define EMU_RSP					4
+#define EMU_RBP					5
+#define EMU_RSI					6
+#define EMU_RDI					7
+#define EMU_NO_REGISTER			0xFF
+
+//Segment registers, in the encoding order
+#define EMU_ES					0
+#define EMU_CS					1
+#define EMU_SS					2
+#define EMU_DS					3
+#define EMU_FS					4
+#define EMU_GS					5
+
+//RFLAGS bits the emulator reads or writes
+#define EMU_CF					0x0001
+#define EMU_PF					0x0004
+#define EMU_AF					0x0010
+#define EMU_ZF					0x0040
+#define EMU_SF					0x0080
+#define EMU_DF					0x0400
+#define EMU_OF					0x0800
+#define EMU_STATUS_FLAGS		(EMU_CF | EMU_PF | EMU_AF | EMU_ZF | EMU_SF | EMU_OF)
+
+//EMU_INSTRUCTION.Operation
+#define EMU_OP_MOV				1
+#define EMU_OP_MOVZX			2
+#define EMU_OP_MOVSX			3
+#define EMU_OP_ALU				4	//AluOp is the /digit of the 80 group: ADD OR ADC SBB AND SUB XOR CMP
+#define EMU_OP_TEST				5
+#define EMU_OP_XCHG				6
+#define EMU_OP_CMPXCHG			7
+#define EMU_OP_XADD				8
+#define EMU_OP_INC				9
+#define EMU_OP_DEC				10
+#define EMU_OP_NOT				11
+#define EMU_OP_NEG				12
+#define EMU_OP_MOVS				13
+#define EMU_OP_STOS				14
+#define EMU_OP_LODS				15
+#define EMU_OP_INS				16
+#define EMU_OP_OUTS				17
+#define EMU_OP_IN				18
+#define EMU_OP_OUT				19
+
+#define EMU_ALU_ADD				0
+#define EMU_ALU_OR				1
+#define EMU_ALU_ADC				2
+#define EMU_ALU_SBB				3
+#define EMU_ALU_AND				4
+#define EMU_ALU_SUB				5
+#define EMU_ALU_XOR				6
+#define EMU_ALU_CMP				7
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * Read (<Write> FALSE) or write <Size> bytes at the linear address <Address>, which may cross a page.
+ * Instruction bytes are fetched through the same callback.
+ * returns: FALSE if the access can't be done; the emulator then stops the instruction.
+ */
+typedef BOOLEAN (NTAPI *EMU_ACCESS_MEMORY) (
+  PVOID Context,
+  ULONG64 Address,
+  PVOID Buffer,
+  ULONG32 Size,
+  BOOLEAN Write
+);
+
+/**
+ * Read (<Out> FALSE) or write the <Size> byte wide port <Port> from or to the low bytes of <*Value>.
+ */
+typedef BOOLEAN (NTAPI *EMU_ACCESS_PORT) (
+  PVOID Context,
+  USHORT Port,
+  PULONG32 Value,
+  ULONG32 Size,
+  BOOLEAN Out
+);
+
+/**
+ * Replace the <Size> bytes at <Address> with <Exchange> if they hold <Comparand>, atomically like LOCK
+ * CMPXCHG, and return the bytes found in <*Original> either way. Locked instructions are run as a loop
+ * of these, so they stay atomic against other processors.
+ * returns: FALSE if the access can't be done, or can't be done atomically.
+ */
+typedef BOOLEAN (NTAPI *EMU_COMPARE_EXCHANGE) (
+  PVOID Context,
+  ULONG64 Address,
+  ULONG64 Comparand,
+  ULONG64 Exchange,
+  ULONG32 Size,
+  PULONG64 Original
+);
+
+/**
+ * The guest state the emulator works on. The caller loads it from the exit, runs EmuStep() or
+ * EmuExecute(), and copies the registers, RIP and RFLAGS back.
+ */
+typedef struct _EMU_STATE
+{
+	ULONG64 Regs[16];//By register number, R8-R15 only in 64-bit mode
+	ULONG64 Rip;
+	ULONG64 Rflags;
+	ULONG64 SegmentBase[6];//Only FS and GS are used in 64-bit mode
+	ULONG64 Cr3;//Tells the address spaces apart in the decode cache
+	UCHAR Mode;
+	ULONG32 MaxRepeat;//Elements a REP moves per call before returning EMU_REPEAT, 0 for all of them
+	EMU_ACCESS_MEMORY AccessMemory;
+	EMU_ACCESS_PORT AccessPort;
+	EMU_COMPARE_EXCHANGE CompareExchange;//NULL if locked instructions are not to be emulated
+	PVOID Context;//Passed to the callbacks
+} EMU_STATE,
+ *PEMU_STATE;
+
+typedef struct _EMU_INSTRUCTION
+{
+	UCHAR Length;
+	UCHAR Mode;
+	UCHAR Operation;
+	UCHAR AluOp;
+	UCHAR OperandSize;//Bytes: 1, 2, 4 or 8
+	UCHAR SourceSize;//Of the r/m operand of MOVZX/MOVSX
+	UCHAR AddressSize;//Bytes: 2, 4 or 8
+	UCHAR Rep;//0, 0xF3 or 0xF2
+	BOOLEAN Lock;//LOCK prefix, or XCHG with memory
+	UCHAR Rex;//0 if there is none
+	UCHAR Segment;//Of the r/m operand or the string source
+	UCHAR Reg;//ModRM.reg, or the register implied by the opcode
+	UCHAR Rm;//ModRM.rm for a register r/m operand
+	UCHAR Base;//Of a memory r/m operand, EMU_NO_REGISTER if none
+	UCHAR Index;
+	UCHAR Scale;
+	BOOLEAN HasMemory;//The r/m operand is in memory
+	BOOLEAN ToRegister;//Reg is the destination, r/m the source
+	BOOLEAN HasImmediate;//The source is Immediate; also the port of IN/OUT
+	BOOLEAN RipRelative;
+	ULONG64 Displacement;//Sign-extended
+	ULONG64 Immediate;//Sign-extended to the operand size
+	UCHAR Bytes[EMU_MAX_INSTRUCTION];
+} EMU_INSTRUCTION,
+ *PEMU_INSTRUCTION;
+
+typedef struct _EMU_CACHE_ENTRY
+{
+	ULONG64 Rip;
+	ULONG64 Cr3;
+	EMU_INSTRUCTION Instruction;//Length 0 if the entry is free
+} EMU_CACHE_ENTRY,
+ *PEMU_CACHE_ENTRY;
+
+/**
+ * Decoded instructions by guest RIP, direct mapped. Not locked: give every CPU its own.
+ */
+typedef struct _EMU_CACHE
+{
+	ULONG32 Hits;
+	ULONG32 Misses;
+	EMU_CACHE_ENTRY Entries[EMU_CACHE_ENTRIES];
+} EMU_CACHE,
+ *PEMU_CACHE;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Decode the instruction in the first <Available> bytes of <Bytes> as code of <Mode>.
+ * returns: EMU_UNSUPPORTED if it is outside the subset, or longer than <Available> bytes.
+ */
+ULONG32 NTAPI EmuDecode (
+  const UCHAR *Bytes,
+  ULONG32 Available,
+  UCHAR Mode,
+  PEMU_INSTRUCTION Instruction
+);
+
+/**
+ * effects: Execute <Instruction> on <State> and move RIP past it. A failed memory or port access stops
+ * it like a fault would: RIP is not moved and the registers and flags are as they were, except that a
+ * string instruction keeps the elements done so far (RCX, RSI and RDI count them). The store of an
+ * instruction is its last access, so a failed one has changed nothing in memory. The same holds after
+ * EMU_REPEAT.
+ * Locked and implicitly locked forms go through State->CompareExchange and are EMU_UNSUPPORTED
+ * without it.
+ */
+ULONG32 NTAPI EmuExecute (
+  PEMU_STATE State,
+  PEMU_INSTRUCTION Instruction
+);
+
+/**
+ * effects: Fetch, decode and execute the instruction at State->Rip. With a <Cache>, an instruction
+ * seen before at the same RIP and CR3 is only fetched again to check its bytes, not decoded.
+ */
+ULONG32 NTAPI EmuStep (
+  PEMU_STATE State,
+  PEMU_CACHE Cache
+);
+
+/**
+ * effects: Drop every decoded instruction, e.g. after the guest wrote to its code.
+ */
+VOID NTAPI EmuFlushCache (
+  PEMU_CACHE Cache
+);
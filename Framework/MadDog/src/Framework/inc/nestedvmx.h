@@ -0,0 +1,330 @@
+#pragma once
+
+/*
+ * The VMCS a guest hypervisor works on (vmcs12) and how it maps onto the VMCS the processor runs its
+ * guest with (vmcs02). vmcs12 lives in a cache that VMREAD and VMWRITE are emulated on; at every nested
+ * VM Entry the fields written since the last one are merged into vmcs02, and at every nested VM Exit the
+ * guest state and exit information are saved back. Real VMCSs are reached only through callbacks, so the
+ * same code runs on the processor in the hypervisor and on simulated VMCSs in user-mode tools (with
+ * NVMX_USER_MODE defined).
+ * vmcs02 exits wherever vmcs12 or vmcs01 asks for it; NvmxExitForL1() tells the exits the guest
+ * hypervisor gets from the ones only L0's own controls caused.
+ */
+#ifdef NVMX_USER_MODE
+#include <stddef.h>
+typedef unsigned char UCHAR;
+typedef unsigned char *PUCHAR;
+typedef unsigned short USHORT;
+typedef unsigned char BOOLEAN;
+typedef unsigned int ULONG32;
+typedef unsigned long long ULONG64;
+typedef unsigned int *PULONG32;
+typedef unsigned long long *PULONG64;
+#define VOID	void
+typedef void *PVOID;
+#define NTAPI
+#define TRUE	1
+#define FALSE	0
+#else
+#include <ntddk.h>
+#endif
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define NVMX_MAX_FIELDS			160	//Entries of the field table, see nestedvmx.c
+#define NVMX_NO_FIELD			0xFFFFFFFF
+#define NVMX_NO_VMCS			((ULONG64)-1)	//Current-VMCS pointer when there is none
+#define NVMX_BITMAP_PAGES		3	//I/O bitmap A, I/O bitmap B and MSR bitmap of vmcs02, see NVMX_HOST
+
+//NVMX_VMCS12.LaunchState
+#define NVMX_LAUNCH_CLEAR		0
+#define NVMX_LAUNCH_LAUNCHED	1
+
+//Field kinds, in the low bits of the NvmxFieldInfo() result
+#define NVMX_KIND_MASK			0x0F
+#define NVMX_GUEST_STATE		1	//Copied to vmcs02, saved back at every nested VM Exit
+#define NVMX_CONTROL			2	//Copied to vmcs02
+#define NVMX_EXECUTION			3	//Controls, TSC offset, exception and I/O/MSR bitmaps, merged with L0's
+#define NVMX_HOST_STATE			4	//Host state of the guest hypervisor, vmcs02 has the one of L0 instead
+#define NVMX_EXIT_INFO			5	//Read-only, saved back at every nested VM Exit
+#define NVMX_UNMERGED			6	//Link pointer, VMREAD/VMWRITE bitmaps, VM-instruction error
+
+//Shadow flags, fields the guest hypervisor reaches in the shadow VMCS without exiting
+#define NVMX_SHADOW_RW			0x10
+#define NVMX_SHADOW_RO			0x20	//Only if the processor can VMWRITE exit information, see NVMX_HOST.Misc
+
+//VM-instruction error numbers
+#define NVMX_ERROR_VMCLEAR_ADDRESS		2
+#define NVMX_ERROR_VMCLEAR_VMXON		3
+#define NVMX_ERROR_VMLAUNCH_NOT_CLEAR	4
+#define NVMX_ERROR_VMRESUME_NOT_LAUNCHED	5
+#define NVMX_ERROR_ENTRY_CONTROLS		7
+#define NVMX_ERROR_ENTRY_HOST_STATE		8
+#define NVMX_ERROR_VMPTRLD_ADDRESS		9
+#define NVMX_ERROR_VMPTRLD_VMXON		10
+#define NVMX_ERROR_VMPTRLD_REVISION		11
+#define NVMX_ERROR_UNSUPPORTED_FIELD	12
+#define NVMX_ERROR_READ_ONLY_FIELD		13
+#define NVMX_ERROR_VMXON_IN_ROOT		15
+#define NVMX_ERROR_ENTRY_MOV_SS			26
+#define NVMX_ERROR_INVALID_OPERAND		28
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * The VMCS region of the guest hypervisor, as kept in its own memory while the VMCS is not current.
+ * <Fields> are indexed like the field table, 64-bit fields whole on every host.
+ */
+typedef struct _NVMX_VMCS12
+{
+	ULONG32 Revision;
+	ULONG32 Abort;
+	ULONG32 LaunchState;
+	ULONG32 Reserved;
+	ULONG64 Fields[NVMX_MAX_FIELDS];
+} NVMX_VMCS12,
+ *PNVMX_VMCS12;
+
+/**
+ * The current vmcs12 of one virtual CPU of the guest hypervisor.
+ */
+typedef struct _NVMX_STATE
+{
+	NVMX_VMCS12 Vmcs12;
+	ULONG32 Dirty[(NVMX_MAX_FIELDS + 31) / 32];//Fields vmcs02 has not been given since the last merge
+} NVMX_STATE,
+ *PNVMX_STATE;
+
+/**
+ * What L0 brings to vmcs02. The control capabilities carry the allowed 0-settings in the low half and
+ * the allowed 1-settings in the high half, taken from the TRUE MSRs where the processor has them.
+ */
+typedef struct _NVMX_HOST
+{
+	ULONG64 PinControls;
+	ULONG64 ProcControls;
+	ULONG64 Proc2Controls;//0 if there are no secondary controls
+	ULONG64 ExitControls;
+	ULONG64 EntryControls;
+	ULONG64 Misc;//IA32_VMX_MISC
+	ULONG64 Efer;//Of L0, restored at the exits of a nested guest which loads its own
+	ULONG64 Pat;
+	ULONG64 Cr0Fixed0;//IA32_VMX_CR0_FIXED0, bits the host CR0 must have set
+	ULONG64 Cr0Fixed1;//Bits it may have set
+	ULONG64 Cr4Fixed0;
+	ULONG64 Cr4Fixed1;
+	ULONG32 PhysicalAddressBits;//MAXPHYADDR
+	PUCHAR Bitmaps02;//NVMX_BITMAP_PAGES contiguous pages, the I/O and MSR bitmaps of both levels ORed
+	ULONG64 Bitmaps02PA;
+	ULONG64 Fields[NVMX_MAX_FIELDS];//Host state, TSC offset, exiting controls and bitmaps of vmcs01
+} NVMX_HOST,
+ *PNVMX_HOST;
+
+/**
+ * A VM Exit of the nested guest, as NvmxExitForL1() looks at it.
+ */
+typedef struct _NVMX_EXIT
+{
+	ULONG32 Reason;
+	ULONG32 IntrInfo;//VM_EXIT_INTR_INFO
+	ULONG32 ErrorCode;//VM_EXIT_INTR_ERROR_CODE
+	ULONG64 Qualification;
+	ULONG64 Operand;//ECX of RDMSR and WRMSR, the source register of MOV to CR3
+} NVMX_EXIT,
+ *PNVMX_EXIT;
+
+typedef ULONG64 (NTAPI *NVMX_VMREAD) (
+	PVOID Context,
+	ULONG32 Encoding
+);
+
+//64-bit fields are written whole, callbacks on 32-bit hosts split them into their two halves
+typedef VOID (NTAPI *NVMX_VMWRITE) (
+	PVOID Context,
+	ULONG32 Encoding,
+	ULONG64 Value
+);
+
+//Host mapping of the 4KB page at <PhysicalAddress>, NULL if the host cannot reach it
+typedef PUCHAR (NTAPI *NVMX_MAP) (
+	PVOID Context,
+	ULONG64 PhysicalAddress
+);
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * returns: The index of the field <Encoding> in the field table, also for the high half of a 64-bit
+ * field, or NVMX_NO_FIELD if it is not supported.
+ */
+ULONG32 NTAPI NvmxFieldIndex (
+	ULONG32 Encoding
+);
+
+/**
+ * effects: Store the full encoding of entry <Index> of the field table in <Encoding>.
+ * returns: Its kind and shadow flags, 0 past the end of the table.
+ */
+ULONG32 NTAPI NvmxFieldInfo (
+	ULONG32 Index,
+	PULONG32 Encoding
+);
+
+/**
+ * effects: Emulate a VMREAD of <Encoding> from the current vmcs12. 16 and 32-bit fields are zero
+ * extended, the high half of a 64-bit field is returned in the low 32 bits.
+ * returns: 0, or the VM-instruction error for VMfailValid.
+ */
+ULONG32 NTAPI NvmxRead (
+	PNVMX_STATE State,
+	ULONG32 Encoding,
+	PULONG64 Value
+);
+
+/**
+ * effects: Emulate a VMWRITE of <Value> to <Encoding>, truncated to the width of the field, and mark
+ * the field dirty if it changed.
+ * returns: 0, or the VM-instruction error for VMfailValid.
+ */
+ULONG32 NTAPI NvmxWrite (
+	PNVMX_STATE State,
+	ULONG32 Encoding,
+	ULONG64 Value
+);
+
+/**
+ * effects: Set a field on behalf of L0, read-only ones included, without marking it dirty.
+ */
+VOID NTAPI NvmxSetField (
+	PNVMX_STATE State,
+	ULONG32 Encoding,
+	ULONG64 Value
+);
+
+/**
+ * effects: Check the parts of vmcs12 that vmcs02 cannot be trusted to reject itself: controls against
+ * the capabilities of <Host>, and the host state L0 loads into vmcs01 at the nested VM Exit, the way
+ * the processor checks it (SDM 26.2.2 to 26.2.4). <LongMode> tells whether the guest hypervisor runs
+ * in IA-32e mode.
+ * returns: 0, or the VM-instruction error of the failed VMLAUNCH or VMRESUME.
+ */
+ULONG32 NTAPI NvmxCheckEntry (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	BOOLEAN LongMode
+);
+
+/**
+ * effects: Take the host state, TSC offset and VM-exit controls of vmcs01 into <Host>. vmcs01 must be
+ * current; the other members of <Host> are filled in by the caller.
+ */
+VOID NTAPI NvmxCaptureHost (
+	PNVMX_HOST Host,
+	NVMX_VMREAD Read,
+	PVOID Context
+);
+
+/**
+ * effects: Take the exiting controls, exception bitmap and I/O and MSR bitmap addresses of vmcs01,
+ * which must be current, into <Host>. L0 may change them between two nested entries, so this runs at
+ * every one; if they changed, the execution controls of vmcs02 are merged again.
+ * returns: The number of fields that changed.
+ */
+ULONG32 NTAPI NvmxCaptureExiting (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	NVMX_VMREAD Read,
+	PVOID Context
+);
+
+/**
+ * effects: OR the I/O and MSR bitmaps of vmcs12 and vmcs01 into the pages of <Host->Bitmaps02> that
+ * vmcs02 uses. A bitmap the host cannot reach counts as all ones. The bitmaps live in guest memory and
+ * may change without a VMWRITE, so this runs at every nested entry.
+ * returns: The number of pages merged.
+ */
+ULONG32 NTAPI NvmxMergeBitmaps (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	NVMX_MAP Map,
+	PVOID Context
+);
+
+/**
+ * effects: Write vmcs12 into vmcs02, which must be current: all of it if <Full>, for a vmcs02 that was
+ * last merged from another vmcs12, otherwise only the dirty fields. Clears the dirty fields.
+ * returns: The number of VMWRITEs issued.
+ */
+ULONG32 NTAPI NvmxMerge (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	BOOLEAN Full,
+	NVMX_VMWRITE Write,
+	PVOID Context
+);
+
+/**
+ * returns: TRUE if the controls of vmcs12 cause <Exit>, so it goes to the guest hypervisor, FALSE if
+ * only the ones vmcs02 took from vmcs01 do, so it goes to L0's own traps. A failed entry and every
+ * exit the guest hypervisor cannot turn off are its own.
+ */
+BOOLEAN NTAPI NvmxExitForL1 (
+	PNVMX_STATE State,
+	PNVMX_EXIT Exit,
+	NVMX_MAP Map,
+	PVOID Context
+);
+
+/**
+ * effects: At a nested VM Exit, save the guest state and exit information of vmcs02, which must be
+ * current, into vmcs12. vmcs02 keeps the same values, so nothing becomes dirty.
+ */
+VOID NTAPI NvmxSaveExit (
+	PNVMX_STATE State,
+	NVMX_VMREAD Read,
+	PVOID Context
+);
+
+/**
+ * effects: Load the host state of vmcs12 into the guest state of vmcs01, which must be current, the
+ * way the processor loads host state at a VM Exit, so the guest hypervisor continues at its HOST_RIP.
+ */
+VOID NTAPI NvmxLoadHostState (
+	PNVMX_STATE State,
+	NVMX_VMREAD Read,
+	NVMX_VMWRITE Write,
+	PVOID Context
+);
+
+/**
+ * effects: Fill the 4KB VMREAD and VMWRITE bitmaps of vmcs01: clear bits for the shadowed fields, set
+ * bits for every other encoding, which then exits to be emulated.
+ * returns: The number of shadowed fields.
+ */
+ULONG32 NTAPI NvmxBuildShadowBitmaps (
+	PNVMX_HOST Host,
+	PUCHAR VmreadBitmap,
+	PUCHAR VmwriteBitmap
+);
+
+/**
+ * effects: Copy the shadowed fields of vmcs12 into the shadow VMCS, which must be current.
+ * returns: The number of VMWRITEs issued.
+ */
+ULONG32 NTAPI NvmxSyncToShadow (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	NVMX_VMWRITE Write,
+	PVOID Context
+);
+
+/**
+ * effects: Take back the fields the guest hypervisor may have written in the shadow VMCS, which must
+ * be current, marking the changed ones dirty.
+ * returns: The number of fields that changed.
+ */
+ULONG32 NTAPI NvmxSyncFromShadow (
+	PNVMX_STATE State,
+	PNVMX_HOST Host,
+	NVMX_VMREAD Read,
+	PVOID Context
+);
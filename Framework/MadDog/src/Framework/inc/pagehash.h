@@ -0,0 +1,107 @@
+#pragma once
+
+/*
+ * Incremental CRC32C hashing of guest-physical ranges, see common/pagehash.c. Builds in the framework
+ * and, with PH_USER_MODE defined, in user-mode tools, which then supply the few host services
+ * pagehash.c calls (page mapping and allocation, TSC, CPUID and the interlocked operations).
+ */
+#ifdef PH_USER_MODE
+#ifndef CRC32C_USER_MODE
+#define CRC32C_USER_MODE
+#endif
+#include "crc32c.h"
+typedef int LONG;
+typedef unsigned int ULONG;
+typedef unsigned char *PUCHAR;
+typedef unsigned int *PULONG32;
+typedef unsigned long ULONG_PTR;
+typedef void *PVOID;
+typedef LONG NTSTATUS;
+typedef struct _PHYSICAL_ADDRESS
+{
+	long long QuadPart;
+} PHYSICAL_ADDRESS,
+ *PPHYSICAL_ADDRESS;
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000)
+#define STATUS_PENDING					((NTSTATUS)0x00000103)
+#define STATUS_BUFFER_OVERFLOW			((NTSTATUS)0x80000005)
+#define STATUS_DEVICE_BUSY				((NTSTATUS)0x80000011)
+#define STATUS_INVALID_PARAMETER		((NTSTATUS)0xC000000D)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009A)
+#define STATUS_NOT_FOUND				((NTSTATUS)0xC0000225)
+#else
+#include <ntddk.h>
+#endif
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define MADDOG_HASH_MAX_RANGES		16
+
+//+++++++++++++++++++++Structs Definitions+++++++++++++++++++++
+
+/**
+ * A page of a MadDog_HashAddRange() range whose CRC32C differs from the one of the previous pass.
+ */
+typedef struct _MADDOG_HASH_CHANGE
+{
+	ULONG32 RangeId;
+	ULONG32 Page;//Index in the range
+	PHYSICAL_ADDRESS PhysicalAddress;
+	ULONG32 OldHash;
+	ULONG32 NewHash;
+} MADDOG_HASH_CHANGE,
+ *PMADDOG_HASH_CHANGE;
+
+typedef struct _MADDOG_HASH_STATS
+{
+	ULONG64 Passes;//Completed passes over all ranges
+	ULONG64 PagesHashed;
+	ULONG64 PagesChanged;
+	ULONG64 PagesUnmapped;//Visits skipped because the page had no host mapping
+	ULONG64 Slices;//Calls to MadDog_HashScan() which got the lock
+	ULONG64 ScanTsc;//TSC ticks spent in all slices
+	ULONG64 LastPassTsc;//Wall time of the last completed pass, from its first to its last slice
+	ULONG32 Ranges;
+	ULONG32 Pages;
+	BOOLEAN Hardware;//CRC32 instruction (SSE4.2) rather than tables
+} MADDOG_HASH_STATS,
+ *PMADDOG_HASH_STATS;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Watch the <NumberOfPages> guest-physical pages from <Start> for modification. Call it
+ * from the guest OS (non-root mode); the pages get their baseline hash at the next scan that
+ * reaches them.
+ * returns: STATUS_INSUFFICIENT_RESOURCES if MADDOG_HASH_MAX_RANGES ranges are watched already.
+ */
+NTSTATUS NTAPI MadDog_HashAddRange (
+	PHYSICAL_ADDRESS Start,
+	ULONG32 NumberOfPages,
+	PULONG32 RangeId
+);
+
+/**
+ * effects: Stop watching the range <RangeId>. Its hash table is freed with the hypervisor.
+ */
+NTSTATUS NTAPI MadDog_HashRemoveRange (
+	ULONG32 RangeId
+);
+
+/**
+ * effects: Rehash the watched pages from where the previous call stopped, for about <Budget> TSC
+ * ticks but at least one page, and put the pages whose hash changed in <Changes>. Meant to run in
+ * VMX root mode, e.g. a slice per VM Exit or per preemption timer exit.
+ * returns: STATUS_SUCCESS when the call finished a pass, STATUS_PENDING if the pass goes on,
+ * STATUS_BUFFER_OVERFLOW if <Capacity> changes filled <Changes> (the pass resumes at the page that
+ * did not fit) and STATUS_DEVICE_BUSY if another CPU is scanning.
+ */
+NTSTATUS NTAPI MadDog_HashScan (
+	ULONG64 Budget,
+	PMADDOG_HASH_CHANGE Changes,
+	ULONG32 Capacity,
+	PULONG32 Count
+);
+
+VOID NTAPI MadDog_HashGetStats (
+	PMADDOG_HASH_STATS Stats
+);
@@ -13,6 +13,9 @@
  */
 
 #pragma once
+
+// The control, debug and flags registers and the descriptor table bases are
+// native width: 32 bits on x86, 64 bits on amd64 (see amd64\regs.asm).
 //#include "common.h"
 #include <ntddk.h>
 
@@ -29,26 +32,26 @@ USHORT NTAPI RegGetFs (
 USHORT NTAPI RegGetGs (
 );
 
-ULONG NTAPI RegGetCr0 (
+ULONG_PTR NTAPI RegGetCr0 (
 );
-ULONG NTAPI RegGetCr2 (
+ULONG_PTR NTAPI RegGetCr2 (
 );
-ULONG NTAPI RegGetCr3 (
+ULONG_PTR NTAPI RegGetCr3 (
 );
-ULONG NTAPI RegGetCr4 (
+ULONG_PTR NTAPI RegGetCr4 (
 );
-ULONG NTAPI RegGetCr8 (
+ULONG_PTR NTAPI RegGetCr8 (
 );
-ULONG NTAPI RegGetRflags (
+ULONG_PTR NTAPI RegGetRflags (
 );
-ULONG NTAPI RegGetEsp (
+ULONG_PTR NTAPI RegGetEsp (
 );
 
-ULONG NTAPI GetIdtBase (
+ULONG_PTR NTAPI GetIdtBase (
 );
 USHORT NTAPI GetIdtLimit (
 );
-ULONG NTAPI GetGdtBase (
+ULONG_PTR NTAPI GetGdtBase (
 );
 USHORT NTAPI GetGdtLimit (
 );
@@ -58,23 +61,23 @@ USHORT NTAPI GetLdtr (
 USHORT NTAPI GetTrSelector (
 );
 
-ULONG NTAPI RegGetEbx (
+ULONG_PTR NTAPI RegGetEbx (
 );
-ULONG NTAPI RegGetEax (
+ULONG_PTR NTAPI RegGetEax (
 );
 
-ULONG NTAPI RegGetTSC (
+ULONG64 NTAPI RegGetTSC (
 );
 
-ULONG NTAPI RegGetDr0 (
+ULONG_PTR NTAPI RegGetDr0 (
 );
-ULONG NTAPI RegGetDr1 (
+ULONG_PTR NTAPI RegGetDr1 (
 );
-ULONG NTAPI RegGetDr2 (
+ULONG_PTR NTAPI RegGetDr2 (
 );
-ULONG NTAPI RegGetDr3 (
+ULONG_PTR NTAPI RegGetDr3 (
 );
-ULONG NTAPI RegGetDr6 (
+ULONG_PTR NTAPI RegGetDr6 (
 );
 ULONG NTAPI RegSetDr0 (
 );
@@ -85,8 +88,11 @@ ULONG NTAPI RegSetDr2 (
 ULONG NTAPI RegSetDr3 (
 );
 
+ULONG NTAPI RegSetCr2 (
+  ULONG_PTR NewCr2
+);
 ULONG NTAPI RegSetCr3 (
-  ULONG NewCr3
+  ULONG_PTR NewCr3
 );
 ULONG NTAPI RegSetCr8 (
   ULONG NewCr8
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <imagehlp.h>
 #include <psapi.h>
+#include "..\PeImage\PeImage.h"
 #pragma pack(1)
 #pragma comment(lib, "imagehlp.lib")
 #pragma comment(lib, "psapi.lib")
@@ -10,25 +11,6 @@
 
 #pragma comment(linker,"/STACK:10240,2048")
 
-//unsigned long LoadPEFile(char *FileName, char **Buffer)
-//{
-//    FILE *fp = fopen(FileName, "rb");
-//    fseek(fp, 0, SEEK_END);
-//    unsigned long len = ftell(fp);
-//    fseek(fp, 0, SEEK_SET);
-//    *Buffer = new char[len + 4];
-//    memset(*Buffer, 0x0, len + 4);
-//    unsigned long i = 0;
-//    while(i < len)
-//    {
-//        fread(*Buffer + i, 4, 1, fp);
-//        i+=4;
-//    }
-//    fclose(fp);
-//    return len;
-//}
-
-
 int main()
 {
 	char *Buffer = NULL;
@@ -46,7 +28,14 @@ int main()
     s[0] = '\0';
     printf("path:%s\n", lpBuffer);
     SetCurrentDirectory(lpBuffer);
-    //unsigned long len = LoadPEFile(PEFile, &Buffer);
+    PeImage image;
+    if (!image.Open(PEFile) || image.Is64())
+    {
+        printf("%s: %s\n", PEFile, image.Error() ? image.Error() : "not a PE32 image");
+        return 1;
+    }
+    OEP = image.EntryPoint();
+    image.Close();
 
    /* IMAGE_DOS_HEADER *dos_header = (IMAGE_DOS_HEADER *)Buffer;
     IMAGE_NT_HEADERS *pINH = (IMAGE_NT_HEADERS *)((DWORD)dos_header + dos_header->e_lfanew);
@@ -66,18 +55,6 @@ int main()
     else
     {
         printf("base address:0x%.8x\n", hmod);
-        MODULEINFO dumpinfo;
-        DWORD dw = 0;
-        GetModuleInformation(GetCurrentProcess(), hmod, &dumpinfo, sizeof MODULEINFO);
-        IMAGE_DOS_HEADER *dos_header = (IMAGE_DOS_HEADER *)hmod;
-        IMAGE_NT_HEADERS *pINH = (IMAGE_NT_HEADERS *)((DWORD)dos_header + dos_header->e_lfanew);
-        if(!VirtualProtect((char *)pINH, sizeof(IMAGE_NT_HEADERS), PAGE_EXECUTE_READWRITE, &dw)) return 1;
-        //pINH->OptionalHeader.AddressOfEntryPoint = OEP;
-		OEP = pINH->OptionalHeader.AddressOfEntryPoint;
-       /* printf("pINH->FileHeader.Characteristics:0x%.8x\n", pINH->FileHeader.Characteristics);
-        pINH->FileHeader.Characteristics &= ~IMAGE_FILE_DLL;
-        printf("pINH->FileHeader.Characteristics:0x%.8x\n", pINH->FileHeader.Characteristics);*/
-        if(!VirtualProtect((char *)pINH, sizeof(IMAGE_NT_HEADERS), PAGE_EXECUTE_READ, &dw)) return 1;
         printf("Call\n");
         DWORD id = 0;
         //if(argc == 3)
@@ -1,13 +1,16 @@
 //--------------------
 // PROGRAM: PEDUMP
-// FILE:    PEDUMP.C
+// FILE:    PEDUMP.CPP
 // AUTHOR:  Matt Pietrek - 1993
 //--------------------
 #include <windows.h>
 #include <stdio.h>
+#include "PeImage\PeImage.h"
+extern "C" {
 #include "objdump.h"
 #include "exedump.h"
 #include "extrnvar.h"
+}
 
 // Global variables set here, and used in EXEDUMP.C and OBJDUMP.C
 BOOL fShowRelocations = FALSE;
@@ -27,51 +30,34 @@ char HelpText[] =
 // Open up a file, memory map it, and call the appropriate dumping routine
 void DumpFile(LPSTR filename)
 {
-    HANDLE hFile;
-    HANDLE hFileMapping;
-    LPVOID lpFileBase;
+    PeFileView view;
+    PeImage image;
     PIMAGE_DOS_HEADER dosHeader;
     
-    hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
-                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-                    
-    if ( hFile = = INVALID_HANDLE_VALUE )
-    {   printf("Couldn't open file with CreateFile()\n");
-        return; }
-    
-    hFileMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    if ( hFileMapping = = 0 )
-    {   CloseHandle(hFile);
-        printf("Couldn't open file mapping with CreateFileMapping()\n");
+    if ( !view.Map(filename) )
+    {   printf("Couldn't open and map file\n");
         return; }
-    
-    lpFileBase = MapViewOfFile(hFileMapping, FILE_MAP_READ, 0, 0, 0);
-    if ( lpFileBase = = 0 )
-    {
-        CloseHandle(hFileMapping);
-        CloseHandle(hFile);
-        printf("Couldn't map view of file with MapViewOfFile()\n");
-        return;
-    }
 
     printf("Dump of file %s\n\n", filename);
     
-    dosHeader = (PIMAGE_DOS_HEADER)lpFileBase;
-    if ( dosHeader->e_magic = = IMAGE_DOS_SIGNATURE )
+    // PeImage checks every header DumpExeFile walks, so a truncated or
+    // corrupt image is reported here instead of faulting in the dumper.
+    dosHeader = (PIMAGE_DOS_HEADER)view.Base();
+    if ( image.Attach(view.Base(), view.Size()) )
        { DumpExeFile( dosHeader ); }
-    else if ( (dosHeader->e_magic = = 0x014C)    // Does it look like a i386
-              && (dosHeader->e_sp = = 0) )        // COFF OBJ file???
+    else if ( dosHeader->e_magic == IMAGE_DOS_SIGNATURE )
+        printf("bad image: %s\n", image.Error());
+    else if ( view.Size() >= sizeof(IMAGE_FILE_HEADER)
+              && (dosHeader->e_magic == 0x014C)    // Does it look like a i386
+              && (dosHeader->e_sp == 0) )        // COFF OBJ file???
     {
         // The two tests above aren't what they look like.  They're
-        // really checking for IMAGE_FILE_HEADER.Machine = = i386 (0x14C)
-        // and IMAGE_FILE_HEADER.SizeOfOptionalHeader = = 0;
-        DumpObjFile( (PIMAGE_FILE_HEADER)lpFileBase );
+        // really checking for IMAGE_FILE_HEADER.Machine == i386 (0x14C)
+        // and IMAGE_FILE_HEADER.SizeOfOptionalHeader == 0;
+        DumpObjFile( (PIMAGE_FILE_HEADER)view.Base() );
     }
     else
         printf("unrecognized file format\n");
-    UnmapViewOfFile(lpFileBase);
-    CloseHandle(hFileMapping);
-    CloseHandle(hFile);
 }
 
 // process all the command line arguments and return a pointer to
@@ -85,32 +71,33 @@ PSTR ProcessCommandLine(int argc, char *argv[])
         strupr(argv[i]);
         
         // Is it a switch character?
-        if ( (argv[i][0] = = '-') || (argv[i][0] = = '/') )
+        if ( (argv[i][0] == '-') || (argv[i][0] == '/') )
         {
-            if ( argv[i][1] = = 'A' )
+            if ( argv[i][1] == 'A' )
             {   fShowRelocations = TRUE;
                 fShowRawSectionData = TRUE;
                 fShowSymbolTable = TRUE;
                 fShowLineNumbers = TRUE; }
-            else if ( argv[i][1] = = 'H' )
+            else if ( argv[i][1] == 'H' )
                 fShowRawSectionData = TRUE;
-            else if ( argv[i][1] = = 'L' )
+            else if ( argv[i][1] == 'L' )
                 fShowLineNumbers = TRUE;
-            else if ( argv[i][1] = = 'R' )
+            else if ( argv[i][1] == 'R' )
                 fShowRelocations = TRUE;
-            else if ( argv[i][1] = = 'S' )
+            else if ( argv[i][1] == 'S' )
                 fShowSymbolTable = TRUE;
         }
         else    // Not a switch character.  Must be the filename
         {   return argv[i]; }
     }
+    return NULL;
 }
 
 int main(int argc, char *argv[])
 {
     PSTR filename;
     
-    if ( argc = = 1 )
+    if ( argc == 1 )
     {   printf(    HelpText );
         return 1; }
     
@@ -0,0 +1,724 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * PeImage - portable PE32/PE32+ file image library. See PeImage.h.
+ */
+
+#include "PeImage.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Cap on a single read() in the fallback path. Large enough that even a
+ * 100MB image takes a handful of syscalls. */
+#define PE_READ_CHUNK	(16 * 1024 * 1024)
+
+//////////////////////////////////////////////////////////////////////////
+// PeFileView
+
+PeFileView::PeFileView()
+	: m_Base(NULL), m_Size(0), m_Mapped(false)
+#ifdef _WIN32
+	, m_File(INVALID_HANDLE_VALUE), m_Mapping(NULL)
+#endif
+{
+}
+
+PeFileView::~PeFileView()
+{
+	Unmap();
+}
+
+#ifdef _WIN32
+
+bool PeFileView::Map(const char *FileName)
+{
+	LARGE_INTEGER Size;
+
+	Unmap();
+	m_File = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_File == INVALID_HANDLE_VALUE)
+		return false;
+	if (!GetFileSizeEx(m_File, &Size) || Size.QuadPart == 0 || (ULONGLONG)Size.QuadPart > (size_t)-1)
+	{
+		Unmap();
+		return false;
+	}
+
+	m_Mapping = CreateFileMappingA(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_Mapping)
+	{
+		m_Base = (const uint8_t *)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+		if (m_Base)
+		{
+			m_Size = (size_t)Size.QuadPart;
+			m_Mapped = true;
+			return true;
+		}
+		CloseHandle(m_Mapping);
+		m_Mapping = NULL;
+	}
+	Unmap();
+	return false;
+}
+
+void PeFileView::Unmap()
+{
+	if (m_Base && m_Mapped)
+		UnmapViewOfFile((LPCVOID)m_Base);
+	if (m_Mapping)
+		CloseHandle(m_Mapping);
+	if (m_File != INVALID_HANDLE_VALUE)
+		CloseHandle(m_File);
+	m_Base = NULL;
+	m_Size = 0;
+	m_Mapped = false;
+	m_Mapping = NULL;
+	m_File = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool PeFileView::Map(const char *FileName)
+{
+	struct stat St;
+	uint8_t *Buffer;
+	size_t Done;
+	void *Base;
+	int Fd;
+
+	Unmap();
+	Fd = open(FileName, O_RDONLY);
+	if (Fd < 0)
+		return false;
+	if (fstat(Fd, &St) != 0 || St.st_size <= 0 || (uint64_t)St.st_size > (size_t)-1)
+	{
+		close(Fd);
+		return false;
+	}
+
+	Base = mmap(NULL, (size_t)St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+	if (Base != MAP_FAILED)
+	{
+		close(Fd);
+		m_Base = (const uint8_t *)Base;
+		m_Size = (size_t)St.st_size;
+		m_Mapped = true;
+		return true;
+	}
+
+	// Can't map it (some filesystems refuse), so read the whole file in
+	// as few syscalls as possible.
+	Buffer = (uint8_t *)malloc((size_t)St.st_size);
+	if (!Buffer)
+	{
+		close(Fd);
+		return false;
+	}
+	for (Done = 0; Done < (size_t)St.st_size; )
+	{
+		size_t Chunk = (size_t)St.st_size - Done;
+		ssize_t Got;
+
+		if (Chunk > PE_READ_CHUNK)
+			Chunk = PE_READ_CHUNK;
+		Got = read(Fd, Buffer + Done, Chunk);
+		if (Got <= 0)
+		{
+			free(Buffer);
+			close(Fd);
+			return false;
+		}
+		Done += (size_t)Got;
+	}
+	close(Fd);
+	m_Base = Buffer;
+	m_Size = Done;
+	return true;
+}
+
+void PeFileView::Unmap()
+{
+	if (m_Base)
+	{
+		if (m_Mapped)
+			munmap((void *)m_Base, m_Size);
+		else
+			free((void *)m_Base);
+	}
+	m_Base = NULL;
+	m_Size = 0;
+	m_Mapped = false;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// PeImage
+
+PeImage::PeImage()
+	: m_Base(NULL), m_Size(0), m_Error(NULL), m_SectionOrder(NULL),
+	  m_ExportNames(NULL), m_ExportHash(NULL)
+{
+	Close();
+}
+
+PeImage::~PeImage()
+{
+	Close();
+}
+
+bool PeImage::Fail(const char *Error)
+{
+	Close();
+	m_Error = Error;
+	return false;
+}
+
+bool PeImage::Open(const char *FileName)
+{
+	Close();
+	if (!m_View.Map(FileName))
+		return Fail("can't read file");
+	return Validate(m_View.Base(), m_View.Size());
+}
+
+bool PeImage::Attach(const void *Base, size_t Size)
+{
+	Close();
+	return Validate((const uint8_t *)Base, Size);
+}
+
+void PeImage::Close()
+{
+	free(m_SectionOrder);
+	free(m_ExportNames);
+	free(m_ExportHash);
+
+	m_Base = NULL;
+	m_Size = 0;
+	m_Error = NULL;
+	m_FileHeader = NULL;
+	m_NtHeadersOffset = 0;
+	m_Is64 = false;
+	m_EntryPoint = 0;
+	m_ImageBase = 0;
+	m_SizeOfImage = 0;
+	m_SizeOfHeaders = 0;
+	m_NumberOfRvaAndSizes = 0;
+	m_Directories = NULL;
+	m_Sections = NULL;
+	m_NumberOfSections = 0;
+	m_SectionOrder = NULL;
+	m_LastSection = 0;
+
+	m_ExportsState = 0;
+	m_ExportDirectory = NULL;
+	m_ExportRva = 0;
+	m_ExportSize = 0;
+	m_Functions = NULL;
+	m_Names = NULL;
+	m_NameOrdinals = NULL;
+	m_NumberOfFunctions = 0;
+	m_NumberOfNames = 0;
+	m_ExportNames = NULL;
+	m_ExportHash = NULL;
+	m_ExportHashMask = 0;
+
+	m_View.Unmap();
+}
+
+/**
+ * effects: The one place headers are checked. Everything the accessors
+ * dereference later without checks is verified to lie inside the file here.
+ */
+bool PeImage::Validate(const uint8_t *Base, size_t Size)
+{
+	const PE_DOS_HEADER *Dos = (const PE_DOS_HEADER *)Base;
+	const uint8_t *Optional;
+	uint32_t SectionTable, i;
+	uint16_t Magic;
+
+	m_Base = Base;
+	m_Size = Size;
+
+	if (Size < sizeof(PE_DOS_HEADER) || Dos->e_magic != PE_DOS_SIGNATURE)
+		return Fail("no MZ header");
+	if (Dos->e_lfanew < (int32_t)sizeof(PE_DOS_HEADER) ||
+		(uint64_t)Dos->e_lfanew + 4 + sizeof(PE_FILE_HEADER) + sizeof(uint16_t) > Size)
+		return Fail("e_lfanew out of range");
+	m_NtHeadersOffset = (uint32_t)Dos->e_lfanew;
+	if (*(const uint32_t *)(m_Base + m_NtHeadersOffset) != PE_NT_SIGNATURE)
+		return Fail("no PE signature");
+
+	m_FileHeader = (const PE_FILE_HEADER *)(m_Base + m_NtHeadersOffset + 4);
+	Optional = (const uint8_t *)(m_FileHeader + 1);
+	SectionTable = m_NtHeadersOffset + 4 + sizeof(PE_FILE_HEADER) + m_FileHeader->SizeOfOptionalHeader;
+	if ((uint64_t)SectionTable + (uint64_t)m_FileHeader->NumberOfSections * sizeof(PE_SECTION_HEADER) > Size)
+		return Fail("section table out of range");
+
+	Magic = *(const uint16_t *)Optional;
+	if (Magic == PE_OPTIONAL_MAGIC_PE32)
+	{
+		const PE_OPTIONAL_HEADER32 *Oh = (const PE_OPTIONAL_HEADER32 *)Optional;
+
+		if (m_FileHeader->SizeOfOptionalHeader < offsetof(PE_OPTIONAL_HEADER32, DataDirectory))
+			return Fail("optional header too small");
+		m_Is64 = false;
+		m_EntryPoint = Oh->AddressOfEntryPoint;
+		m_ImageBase = Oh->ImageBase;
+		m_SizeOfImage = Oh->SizeOfImage;
+		m_SizeOfHeaders = Oh->SizeOfHeaders;
+		m_NumberOfRvaAndSizes = Oh->NumberOfRvaAndSizes;
+		m_Directories = Oh->DataDirectory;
+	}
+	else if (Magic == PE_OPTIONAL_MAGIC_PE32PLUS)
+	{
+		const PE_OPTIONAL_HEADER64 *Oh = (const PE_OPTIONAL_HEADER64 *)Optional;
+
+		if (m_FileHeader->SizeOfOptionalHeader < offsetof(PE_OPTIONAL_HEADER64, DataDirectory))
+			return Fail("optional header too small");
+		m_Is64 = true;
+		m_EntryPoint = Oh->AddressOfEntryPoint;
+		m_ImageBase = Oh->ImageBase;
+		m_SizeOfImage = Oh->SizeOfImage;
+		m_SizeOfHeaders = Oh->SizeOfHeaders;
+		m_NumberOfRvaAndSizes = Oh->NumberOfRvaAndSizes;
+		m_Directories = Oh->DataDirectory;
+	}
+	else
+		return Fail("unknown optional header magic");
+
+	// Only trust the directories that actually fit in the optional header.
+	i = (uint32_t)(((const uint8_t *)m_Directories - Optional));
+	i = (m_FileHeader->SizeOfOptionalHeader - i) / sizeof(PE_DATA_DIRECTORY);
+	if (m_NumberOfRvaAndSizes > i)
+		m_NumberOfRvaAndSizes = i;
+	if (m_NumberOfRvaAndSizes > PE_NUMBEROF_DIRECTORY_ENTRIES)
+		m_NumberOfRvaAndSizes = PE_NUMBEROF_DIRECTORY_ENTRIES;
+	if (m_SizeOfHeaders > Size)
+		m_SizeOfHeaders = (uint32_t)Size;
+
+	m_Sections = (const PE_SECTION_HEADER *)(m_Base + SectionTable);
+	m_NumberOfSections = m_FileHeader->NumberOfSections;
+
+	// Sort section indices by VirtualAddress once, so RVA lookups can
+	// binary search. Section counts are tiny, insertion sort is fine.
+	if (m_NumberOfSections)
+	{
+		m_SectionOrder = (uint32_t *)malloc(m_NumberOfSections * sizeof(uint32_t));
+		if (!m_SectionOrder)
+			return Fail("out of memory");
+		for (i = 0; i < m_NumberOfSections; i++)
+		{
+			uint32_t j = i;
+
+			while (j > 0 && m_Sections[m_SectionOrder[j - 1]].VirtualAddress > m_Sections[i].VirtualAddress)
+			{
+				m_SectionOrder[j] = m_SectionOrder[j - 1];
+				j--;
+			}
+			m_SectionOrder[j] = i;
+		}
+	}
+	return true;
+}
+
+const PE_DATA_DIRECTORY *PeImage::Directory(uint32_t Index) const
+{
+	if (Index >= m_NumberOfRvaAndSizes)
+		return NULL;
+	if (!m_Directories[Index].VirtualAddress || !m_Directories[Index].Size)
+		return NULL;
+	return &m_Directories[Index];
+}
+
+const PE_SECTION_HEADER *PeImage::SectionFromRva(uint32_t Rva) const
+{
+	const PE_SECTION_HEADER *Section;
+	uint32_t Lo, Hi, Extent;
+
+	if (!m_NumberOfSections)
+		return NULL;
+
+	Section = &m_Sections[m_LastSection];
+	Extent = Section->VirtualSize > Section->SizeOfRawData ? Section->VirtualSize : Section->SizeOfRawData;
+	if (Rva >= Section->VirtualAddress && Rva - Section->VirtualAddress < Extent)
+		return Section;
+
+	// Last section whose VirtualAddress <= Rva.
+	Lo = 0;
+	Hi = m_NumberOfSections;
+	while (Lo < Hi)
+	{
+		uint32_t Mid = (Lo + Hi) / 2;
+
+		if (m_Sections[m_SectionOrder[Mid]].VirtualAddress <= Rva)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	if (!Lo)
+		return NULL;
+
+	Section = &m_Sections[m_SectionOrder[Lo - 1]];
+	Extent = Section->VirtualSize > Section->SizeOfRawData ? Section->VirtualSize : Section->SizeOfRawData;
+	if (Rva - Section->VirtualAddress >= Extent)
+		return NULL;
+	m_LastSection = m_SectionOrder[Lo - 1];
+	return Section;
+}
+
+/**
+ * effects: Translate <Rva> to a file offset.
+ * returns: false if the RVA has no bytes in the file. <Available> is the
+ * number of file-backed bytes from there to the end of the section.
+ */
+bool PeImage::Translate(uint32_t Rva, uint32_t *Offset, uint32_t *Available) const
+{
+	const PE_SECTION_HEADER *Section;
+	uint64_t End;
+	uint32_t Delta;
+
+	if (Rva < m_SizeOfHeaders)
+	{
+		*Offset = Rva;
+		*Available = m_SizeOfHeaders - Rva;
+		return true;
+	}
+
+	Section = SectionFromRva(Rva);
+	if (!Section)
+		return false;
+	Delta = Rva - Section->VirtualAddress;
+	if (Delta >= Section->SizeOfRawData)
+		return false;
+
+	End = (uint64_t)Section->PointerToRawData + Section->SizeOfRawData;
+	if (End > m_Size)
+		End = m_Size;
+	if ((uint64_t)Section->PointerToRawData + Delta >= End)
+		return false;
+	*Offset = Section->PointerToRawData + Delta;
+	*Available = (uint32_t)(End - *Offset);
+	return true;
+}
+
+uint32_t PeImage::RvaToOffset(uint32_t Rva) const
+{
+	uint32_t Offset, Available;
+
+	if (!Translate(Rva, &Offset, &Available))
+		return 0;
+	return Offset;
+}
+
+const void *PeImage::RvaToPointer(uint32_t Rva, uint32_t Size) const
+{
+	uint32_t Offset, Available;
+
+	if (!Translate(Rva, &Offset, &Available) || Size > Available)
+		return NULL;
+	return m_Base + Offset;
+}
+
+const char *PeImage::RvaToString(uint32_t Rva) const
+{
+	uint32_t Offset, Available;
+
+	if (!Translate(Rva, &Offset, &Available))
+		return NULL;
+	if (!memchr(m_Base + Offset, 0, Available))
+		return NULL;
+	return (const char *)(m_Base + Offset);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Exports
+
+/* FNV-1a, good enough for symbol names and cheap to compute inline. */
+static uint32_t PeHashName(const char *Name)
+{
+	uint32_t Hash = 2166136261u;
+
+	while (*Name)
+	{
+		Hash ^= (uint8_t)*Name++;
+		Hash *= 16777619u;
+	}
+	return Hash;
+}
+
+bool PeImage::LoadExports()
+{
+	const PE_DATA_DIRECTORY *Dir;
+
+	if (m_ExportsState)
+		return m_ExportsState > 0;
+	m_ExportsState = -1;
+
+	Dir = Directory(PE_DIRECTORY_EXPORT);
+	if (!Dir)
+		return false;
+	m_ExportDirectory = (const PE_EXPORT_DIRECTORY *)RvaToPointer(Dir->VirtualAddress, sizeof(PE_EXPORT_DIRECTORY));
+	if (!m_ExportDirectory)
+		return false;
+	m_ExportRva = Dir->VirtualAddress;
+	m_ExportSize = Dir->Size;
+
+	m_NumberOfFunctions = m_ExportDirectory->NumberOfFunctions;
+	m_NumberOfNames = m_ExportDirectory->NumberOfNames;
+	if (m_NumberOfFunctions > 0x10000 * 16 || m_NumberOfNames > m_NumberOfFunctions)
+		return false;
+
+	m_Functions = (const uint32_t *)RvaToPointer(m_ExportDirectory->AddressOfFunctions,
+		m_NumberOfFunctions * sizeof(uint32_t));
+	if (!m_Functions && m_NumberOfFunctions)
+		return false;
+	if (m_NumberOfNames)
+	{
+		m_Names = (const uint32_t *)RvaToPointer(m_ExportDirectory->AddressOfNames,
+			m_NumberOfNames * sizeof(uint32_t));
+		m_NameOrdinals = (const uint16_t *)RvaToPointer(m_ExportDirectory->AddressOfNameOrdinals,
+			m_NumberOfNames * sizeof(uint16_t));
+		if (!m_Names || !m_NameOrdinals)
+			return false;
+	}
+
+	m_ExportsState = 1;
+	return true;
+}
+
+bool PeImage::BuildExportHash()
+{
+	uint32_t Slots, i;
+
+	if (m_ExportHash)
+		return true;
+	if (!LoadExports())
+		return false;
+
+	// Power of two, at most half full.
+	for (Slots = 16; Slots < m_NumberOfNames * 2; Slots <<= 1)
+		;
+	m_ExportHash = (PE_EXPORT_SLOT *)calloc(Slots, sizeof(PE_EXPORT_SLOT));
+	m_ExportNames = (const char **)malloc((m_NumberOfNames ? m_NumberOfNames : 1) * sizeof(const char *));
+	if (!m_ExportHash || !m_ExportNames)
+	{
+		free(m_ExportHash);
+		free(m_ExportNames);
+		m_ExportHash = NULL;
+		m_ExportNames = NULL;
+		return false;
+	}
+	m_ExportHashMask = Slots - 1;
+
+	for (i = 0; i < m_NumberOfNames; i++)
+	{
+		const char *Name = RvaToString(m_Names[i]);
+		uint32_t Hash, Slot;
+
+		m_ExportNames[i] = Name;
+		if (!Name || m_NameOrdinals[i] >= m_NumberOfFunctions)
+			continue;
+		Hash = PeHashName(Name);
+		for (Slot = Hash & m_ExportHashMask; m_ExportHash[Slot].Index; Slot = (Slot + 1) & m_ExportHashMask)
+			;
+		m_ExportHash[Slot].Hash = Hash;
+		m_ExportHash[Slot].Index = i + 1;
+	}
+	return true;
+}
+
+void PeImage::FillExport(uint32_t FunctionIndex, const char *Name, PE_EXPORT *Export) const
+{
+	uint32_t Rva = m_Functions[FunctionIndex];
+
+	Export->Name = Name;
+	Export->Ordinal = m_ExportDirectory->Base + FunctionIndex;
+	Export->Rva = Rva;
+	Export->Forwarder = NULL;
+	// An RVA inside the export directory is a forwarder string.
+	if (Rva >= m_ExportRva && Rva - m_ExportRva < m_ExportSize)
+		Export->Forwarder = RvaToString(Rva);
+}
+
+bool PeImage::FindExport(const char *Name, PE_EXPORT *Export)
+{
+	uint32_t Hash, Slot;
+
+	if (!BuildExportHash())
+		return false;
+
+	Hash = PeHashName(Name);
+	for (Slot = Hash & m_ExportHashMask; m_ExportHash[Slot].Index; Slot = (Slot + 1) & m_ExportHashMask)
+	{
+		uint32_t i = m_ExportHash[Slot].Index - 1;
+
+		if (m_ExportHash[Slot].Hash == Hash && !strcmp(m_ExportNames[i], Name))
+		{
+			FillExport(m_NameOrdinals[i], m_ExportNames[i], Export);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool PeImage::FindExportByOrdinal(uint32_t Ordinal, PE_EXPORT *Export)
+{
+	uint32_t Index;
+
+	if (!LoadExports())
+		return false;
+	Index = Ordinal - m_ExportDirectory->Base;
+	if (Ordinal < m_ExportDirectory->Base || Index >= m_NumberOfFunctions || !m_Functions[Index])
+		return false;
+	FillExport(Index, NULL, Export);
+	return true;
+}
+
+uint32_t PeImage::NumberOfExports()
+{
+	if (!LoadExports())
+		return 0;
+	return m_NumberOfNames;
+}
+
+/**
+ * effects: Return the <Index>th named export, in the image's (sorted) name
+ * order.
+ */
+bool PeImage::ExportByIndex(uint32_t Index, PE_EXPORT *Export)
+{
+	if (!BuildExportHash() || Index >= m_NumberOfNames)
+		return false;
+	if (!m_ExportNames[Index] || m_NameOrdinals[Index] >= m_NumberOfFunctions)
+		return false;
+	FillExport(m_NameOrdinals[Index], m_ExportNames[Index], Export);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Imports and relocations
+
+bool PeImage::EnumerateImports(PE_IMPORT_CALLBACK Callback, void *Context) const
+{
+	const PE_DATA_DIRECTORY *Dir = Directory(PE_DIRECTORY_IMPORT);
+	uint32_t ThunkSize = m_Is64 ? 8 : 4;
+	uint32_t Rva;
+
+	if (!Dir)
+		return true;
+
+	for (Rva = Dir->VirtualAddress; ; Rva += sizeof(PE_IMPORT_DESCRIPTOR))
+	{
+		const PE_IMPORT_DESCRIPTOR *Desc;
+		PE_IMPORT Import;
+		uint32_t Thunk, Iat;
+
+		Desc = (const PE_IMPORT_DESCRIPTOR *)RvaToPointer(Rva, sizeof(PE_IMPORT_DESCRIPTOR));
+		if (!Desc)
+			return false;
+		if (!Desc->Name && !Desc->FirstThunk)
+			return true;
+
+		Import.Module = RvaToString(Desc->Name);
+		if (!Import.Module)
+			return false;
+
+		// Bound or already-patched images only have the IAT.
+		Thunk = Desc->OriginalFirstThunk ? Desc->OriginalFirstThunk : Desc->FirstThunk;
+		for (Iat = Desc->FirstThunk; ; Thunk += ThunkSize, Iat += ThunkSize)
+		{
+			const void *Entry = RvaToPointer(Thunk, ThunkSize);
+			uint64_t Value;
+			bool ByOrdinal;
+
+			if (!Entry)
+				return false;
+			if (m_Is64)
+			{
+				Value = *(const uint64_t *)Entry;
+				ByOrdinal = (Value >> 63) != 0;
+			}
+			else
+			{
+				Value = *(const uint32_t *)Entry;
+				ByOrdinal = (Value >> 31) != 0;
+			}
+			if (!Value)
+				break;
+
+			Import.IatRva = Iat;
+			if (ByOrdinal)
+			{
+				Import.Name = NULL;
+				Import.Hint = 0;
+				Import.Ordinal = (uint32_t)(Value & 0xFFFF);
+			}
+			else
+			{
+				const uint16_t *Hint = (const uint16_t *)RvaToPointer((uint32_t)Value, sizeof(uint16_t));
+
+				if (!Hint)
+					return false;
+				Import.Hint = *Hint;
+				Import.Name = RvaToString((uint32_t)Value + sizeof(uint16_t));
+				Import.Ordinal = 0;
+				if (!Import.Name)
+					return false;
+			}
+			if (!Callback(Context, &Import))
+				return true;
+		}
+	}
+}
+
+bool PeImage::EnumerateRelocations(PE_RELOCATION_CALLBACK Callback, void *Context) const
+{
+	const PE_DATA_DIRECTORY *Dir = Directory(PE_DIRECTORY_BASERELOC);
+	uint32_t Rva, End;
+
+	if (!Dir)
+		return true;
+
+	End = Dir->VirtualAddress + Dir->Size;
+	for (Rva = Dir->VirtualAddress; Rva + sizeof(PE_BASE_RELOCATION) <= End; )
+	{
+		const PE_BASE_RELOCATION *Block;
+		const uint16_t *Entries;
+		uint32_t Count, i;
+
+		Block = (const PE_BASE_RELOCATION *)RvaToPointer(Rva, sizeof(PE_BASE_RELOCATION));
+		if (!Block)
+			return false;
+		if (Block->SizeOfBlock < sizeof(PE_BASE_RELOCATION) || Block->SizeOfBlock > End - Rva)
+			return false;
+
+		Count = (Block->SizeOfBlock - sizeof(PE_BASE_RELOCATION)) / sizeof(uint16_t);
+		Entries = (const uint16_t *)RvaToPointer(Rva + sizeof(PE_BASE_RELOCATION), Count * sizeof(uint16_t));
+		if (!Entries && Count)
+			return false;
+
+		for (i = 0; i < Count; i++)
+		{
+			uint32_t Type = Entries[i] >> 12;
+
+			if (Type == PE_REL_BASED_ABSOLUTE)
+				continue;
+			if (!Callback(Context, Block->VirtualAddress + (Entries[i] & 0xFFF), Type))
+				return true;
+		}
+		Rva += Block->SizeOfBlock;
+	}
+	return true;
+}
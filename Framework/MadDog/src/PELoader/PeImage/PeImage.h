@@ -0,0 +1,381 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * PeImage - portable PE32/PE32+ file image library.
+ *
+ * The file is mapped once (mmap / MapViewOfFile, or one read() into a
+ * buffer where mapping is not possible), the headers are validated once in
+ * PeImage::Attach(), and everything afterwards is bounds-checked pointer
+ * arithmetic on the view. Nothing here depends on <windows.h>, so the same
+ * code builds with the WDK and with g++ on Linux.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PE_DOS_SIGNATURE				0x5A4D		/* MZ */
+#define PE_NT_SIGNATURE					0x00004550	/* PE\0\0 */
+#define PE_OPTIONAL_MAGIC_PE32			0x10B
+#define PE_OPTIONAL_MAGIC_PE32PLUS		0x20B
+
+#define PE_NUMBEROF_DIRECTORY_ENTRIES	16
+#define PE_DIRECTORY_EXPORT				0
+#define PE_DIRECTORY_IMPORT				1
+#define PE_DIRECTORY_BASERELOC			5
+
+#define PE_SIZEOF_SHORT_NAME			8
+
+#define PE_REL_BASED_ABSOLUTE			0
+#define PE_REL_BASED_HIGHLOW			3
+#define PE_REL_BASED_DIR64				10
+
+#define PE_FILE_DLL						0x2000
+
+#pragma pack(push, 1)
+
+typedef struct _PE_DOS_HEADER
+{
+	uint16_t e_magic;
+	uint16_t e_cblp;
+	uint16_t e_cp;
+	uint16_t e_crlc;
+	uint16_t e_cparhdr;
+	uint16_t e_minalloc;
+	uint16_t e_maxalloc;
+	uint16_t e_ss;
+	uint16_t e_sp;
+	uint16_t e_csum;
+	uint16_t e_ip;
+	uint16_t e_cs;
+	uint16_t e_lfarlc;
+	uint16_t e_ovno;
+	uint16_t e_res[4];
+	uint16_t e_oemid;
+	uint16_t e_oeminfo;
+	uint16_t e_res2[10];
+	int32_t e_lfanew;
+} PE_DOS_HEADER, *PPE_DOS_HEADER;
+
+typedef struct _PE_FILE_HEADER
+{
+	uint16_t Machine;
+	uint16_t NumberOfSections;
+	uint32_t TimeDateStamp;
+	uint32_t PointerToSymbolTable;
+	uint32_t NumberOfSymbols;
+	uint16_t SizeOfOptionalHeader;
+	uint16_t Characteristics;
+} PE_FILE_HEADER, *PPE_FILE_HEADER;
+
+typedef struct _PE_DATA_DIRECTORY
+{
+	uint32_t VirtualAddress;
+	uint32_t Size;
+} PE_DATA_DIRECTORY, *PPE_DATA_DIRECTORY;
+
+typedef struct _PE_OPTIONAL_HEADER32
+{
+	uint16_t Magic;
+	uint8_t MajorLinkerVersion;
+	uint8_t MinorLinkerVersion;
+	uint32_t SizeOfCode;
+	uint32_t SizeOfInitializedData;
+	uint32_t SizeOfUninitializedData;
+	uint32_t AddressOfEntryPoint;
+	uint32_t BaseOfCode;
+	uint32_t BaseOfData;
+	uint32_t ImageBase;
+	uint32_t SectionAlignment;
+	uint32_t FileAlignment;
+	uint16_t MajorOperatingSystemVersion;
+	uint16_t MinorOperatingSystemVersion;
+	uint16_t MajorImageVersion;
+	uint16_t MinorImageVersion;
+	uint16_t MajorSubsystemVersion;
+	uint16_t MinorSubsystemVersion;
+	uint32_t Win32VersionValue;
+	uint32_t SizeOfImage;
+	uint32_t SizeOfHeaders;
+	uint32_t CheckSum;
+	uint16_t Subsystem;
+	uint16_t DllCharacteristics;
+	uint32_t SizeOfStackReserve;
+	uint32_t SizeOfStackCommit;
+	uint32_t SizeOfHeapReserve;
+	uint32_t SizeOfHeapCommit;
+	uint32_t LoaderFlags;
+	uint32_t NumberOfRvaAndSizes;
+	PE_DATA_DIRECTORY DataDirectory[PE_NUMBEROF_DIRECTORY_ENTRIES];
+} PE_OPTIONAL_HEADER32, *PPE_OPTIONAL_HEADER32;
+
+typedef struct _PE_OPTIONAL_HEADER64
+{
+	uint16_t Magic;
+	uint8_t MajorLinkerVersion;
+	uint8_t MinorLinkerVersion;
+	uint32_t SizeOfCode;
+	uint32_t SizeOfInitializedData;
+	uint32_t SizeOfUninitializedData;
+	uint32_t AddressOfEntryPoint;
+	uint32_t BaseOfCode;
+	uint64_t ImageBase;
+	uint32_t SectionAlignment;
+	uint32_t FileAlignment;
+	uint16_t MajorOperatingSystemVersion;
+	uint16_t MinorOperatingSystemVersion;
+	uint16_t MajorImageVersion;
+	uint16_t MinorImageVersion;
+	uint16_t MajorSubsystemVersion;
+	uint16_t MinorSubsystemVersion;
+	uint32_t Win32VersionValue;
+	uint32_t SizeOfImage;
+	uint32_t SizeOfHeaders;
+	uint32_t CheckSum;
+	uint16_t Subsystem;
+	uint16_t DllCharacteristics;
+	uint64_t SizeOfStackReserve;
+	uint64_t SizeOfStackCommit;
+	uint64_t SizeOfHeapReserve;
+	uint64_t SizeOfHeapCommit;
+	uint32_t LoaderFlags;
+	uint32_t NumberOfRvaAndSizes;
+	PE_DATA_DIRECTORY DataDirectory[PE_NUMBEROF_DIRECTORY_ENTRIES];
+} PE_OPTIONAL_HEADER64, *PPE_OPTIONAL_HEADER64;
+
+typedef struct _PE_SECTION_HEADER
+{
+	uint8_t Name[PE_SIZEOF_SHORT_NAME];
+	uint32_t VirtualSize;
+	uint32_t VirtualAddress;
+	uint32_t SizeOfRawData;
+	uint32_t PointerToRawData;
+	uint32_t PointerToRelocations;
+	uint32_t PointerToLinenumbers;
+	uint16_t NumberOfRelocations;
+	uint16_t NumberOfLinenumbers;
+	uint32_t Characteristics;
+} PE_SECTION_HEADER, *PPE_SECTION_HEADER;
+
+typedef struct _PE_EXPORT_DIRECTORY
+{
+	uint32_t Characteristics;
+	uint32_t TimeDateStamp;
+	uint16_t MajorVersion;
+	uint16_t MinorVersion;
+	uint32_t Name;
+	uint32_t Base;
+	uint32_t NumberOfFunctions;
+	uint32_t NumberOfNames;
+	uint32_t AddressOfFunctions;
+	uint32_t AddressOfNames;
+	uint32_t AddressOfNameOrdinals;
+} PE_EXPORT_DIRECTORY, *PPE_EXPORT_DIRECTORY;
+
+typedef struct _PE_IMPORT_DESCRIPTOR
+{
+	uint32_t OriginalFirstThunk;
+	uint32_t TimeDateStamp;
+	uint32_t ForwarderChain;
+	uint32_t Name;
+	uint32_t FirstThunk;
+} PE_IMPORT_DESCRIPTOR, *PPE_IMPORT_DESCRIPTOR;
+
+typedef struct _PE_BASE_RELOCATION
+{
+	uint32_t VirtualAddress;
+	uint32_t SizeOfBlock;
+} PE_BASE_RELOCATION, *PPE_BASE_RELOCATION;
+
+#pragma pack(pop)
+
+/* The rest is in-memory only. Pin the packing so that an includer's own
+ * #pragma pack (PELoader uses pack(1)) can't change the class layout. */
+#pragma pack(push, 8)
+
+/* Export name hash slot. Index is the name index + 1, 0 marks a free slot. */
+typedef struct _PE_EXPORT_SLOT
+{
+	uint32_t Hash;
+	uint32_t Index;
+} PE_EXPORT_SLOT, *PPE_EXPORT_SLOT;
+
+/* One resolved export. Forwarder is set (and Rva is meaningless) when the
+ * export is forwarded to another module, e.g. "NTDLL.RtlAllocateHeap". */
+typedef struct _PE_EXPORT
+{
+	const char *Name;		/* NULL when exported by ordinal only */
+	uint32_t Ordinal;		/* biased, i.e. what GetProcAddress takes */
+	uint32_t Rva;
+	const char *Forwarder;
+} PE_EXPORT, *PPE_EXPORT;
+
+/* One imported function. Name is NULL for imports by ordinal. */
+typedef struct _PE_IMPORT
+{
+	const char *Module;
+	const char *Name;
+	uint16_t Hint;
+	uint32_t Ordinal;
+	uint32_t IatRva;		/* RVA of the IAT slot the loader patches */
+} PE_IMPORT, *PPE_IMPORT;
+
+/* Enumeration callbacks return false to stop early. */
+typedef bool (*PE_IMPORT_CALLBACK)(void *Context, const PE_IMPORT *Import);
+typedef bool (*PE_RELOCATION_CALLBACK)(void *Context, uint32_t Rva, uint32_t Type);
+
+/**
+ * A read-only view of a whole file.
+ * effects: Maps the file if the platform can, otherwise reads it with a
+ * single read into one buffer.
+ */
+class PeFileView
+{
+public:
+	PeFileView();
+	~PeFileView();
+
+	bool Map(const char *FileName);
+	void Unmap();
+
+	const uint8_t *Base() const { return m_Base; }
+	size_t Size() const { return m_Size; }
+
+private:
+	PeFileView(const PeFileView &);
+	PeFileView &operator=(const PeFileView &);
+
+	const uint8_t *m_Base;
+	size_t m_Size;
+	bool m_Mapped;			/* false: m_Base came from malloc() */
+#ifdef _WIN32
+	void *m_File;
+	void *m_Mapping;
+#endif
+};
+
+class PeImage
+{
+public:
+	PeImage();
+	~PeImage();
+
+	/**
+	 * effects: Map <FileName> and validate its headers.
+	 * returns: false with Error() set if the file can't be read or isn't
+	 * a PE32/PE32+ image.
+	 */
+	bool Open(const char *FileName);
+
+	/**
+	 * effects: Validate a file image that is already in memory. The buffer
+	 * must stay valid and unchanged until Close().
+	 */
+	bool Attach(const void *Base, size_t Size);
+
+	void Close();
+	const char *Error() const { return m_Error; }
+
+	const uint8_t *Base() const { return m_Base; }
+	size_t Size() const { return m_Size; }
+
+	const PE_DOS_HEADER *DosHeader() const { return (const PE_DOS_HEADER *)m_Base; }
+	const PE_FILE_HEADER *FileHeader() const { return m_FileHeader; }
+	uint32_t NtHeadersOffset() const { return m_NtHeadersOffset; }
+
+	bool Is64() const { return m_Is64; }
+	uint16_t Machine() const { return m_FileHeader->Machine; }
+	uint16_t Characteristics() const { return m_FileHeader->Characteristics; }
+	uint32_t EntryPoint() const { return m_EntryPoint; }
+	uint64_t ImageBase() const { return m_ImageBase; }
+	uint32_t SizeOfImage() const { return m_SizeOfImage; }
+	uint32_t SizeOfHeaders() const { return m_SizeOfHeaders; }
+
+	uint32_t NumberOfSections() const { return m_NumberOfSections; }
+	const PE_SECTION_HEADER *Section(uint32_t Index) const { return &m_Sections[Index]; }
+	const PE_DATA_DIRECTORY *Directory(uint32_t Index) const;
+
+	/**
+	 * effects: Find the section holding <Rva>. Sections are kept sorted by
+	 * VirtualAddress, the last hit is cached, anything else is a binary search.
+	 * returns: NULL for RVAs in the headers or outside every section.
+	 */
+	const PE_SECTION_HEADER *SectionFromRva(uint32_t Rva) const;
+
+	/**
+	 * returns: File offset of <Rva>, or 0 if it has no file backing
+	 * (headers map 1:1).
+	 */
+	uint32_t RvaToOffset(uint32_t Rva) const;
+
+	/**
+	 * returns: Pointer into the view for <Size> bytes at <Rva>, or NULL if
+	 * any of them lies outside the file data.
+	 */
+	const void *RvaToPointer(uint32_t Rva, uint32_t Size) const;
+
+	/* NUL-terminated string at <Rva>, or NULL if it runs off the file. */
+	const char *RvaToString(uint32_t Rva) const;
+
+	/**
+	 * effects: Look up an export by name. The first call builds a hash of
+	 * every exported name, after that each lookup is O(1).
+	 */
+	bool FindExport(const char *Name, PE_EXPORT *Export);
+
+	/* O(1): ordinals index AddressOfFunctions directly. */
+	bool FindExportByOrdinal(uint32_t Ordinal, PE_EXPORT *Export);
+
+	uint32_t NumberOfExports();
+	bool ExportByIndex(uint32_t Index, PE_EXPORT *Export);
+
+	bool EnumerateImports(PE_IMPORT_CALLBACK Callback, void *Context) const;
+	bool EnumerateRelocations(PE_RELOCATION_CALLBACK Callback, void *Context) const;
+
+private:
+	PeImage(const PeImage &);
+	PeImage &operator=(const PeImage &);
+
+	bool Fail(const char *Error);
+	bool Validate(const uint8_t *Base, size_t Size);
+	bool Translate(uint32_t Rva, uint32_t *Offset, uint32_t *Available) const;
+	bool LoadExports();
+	bool BuildExportHash();
+	void FillExport(uint32_t FunctionIndex, const char *Name, PE_EXPORT *Export) const;
+
+	PeFileView m_View;
+	const uint8_t *m_Base;
+	size_t m_Size;
+	const char *m_Error;
+
+	const PE_FILE_HEADER *m_FileHeader;
+	uint32_t m_NtHeadersOffset;
+	bool m_Is64;
+	uint32_t m_EntryPoint;
+	uint64_t m_ImageBase;
+	uint32_t m_SizeOfImage;
+	uint32_t m_SizeOfHeaders;
+	uint32_t m_NumberOfRvaAndSizes;
+	const PE_DATA_DIRECTORY *m_Directories;
+
+	const PE_SECTION_HEADER *m_Sections;
+	uint32_t m_NumberOfSections;
+	uint32_t *m_SectionOrder;		/* indices into m_Sections, by VirtualAddress */
+	mutable uint32_t m_LastSection;
+
+	/* Export state, resolved on first use */
+	int m_ExportsState;				/* 0 = not loaded, 1 = loaded, -1 = none/corrupt */
+	const PE_EXPORT_DIRECTORY *m_ExportDirectory;
+	uint32_t m_ExportRva;
+	uint32_t m_ExportSize;
+	const uint32_t *m_Functions;
+	const uint32_t *m_Names;
+	const uint16_t *m_NameOrdinals;
+	uint32_t m_NumberOfFunctions;
+	uint32_t m_NumberOfNames;
+	const char **m_ExportNames;		/* name index -> string, built with the hash */
+	PE_EXPORT_SLOT *m_ExportHash;	/* open addressing, linear probing */
+	uint32_t m_ExportHashMask;
+};
+
+#pragma pack(pop)
@@ -0,0 +1,367 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * PeMapper - in-memory PE image mapper. See PeMapper.h.
+ */
+
+#include "PeMapper.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PE_RELOC_SSE2
+#endif
+
+#define PE_REL_BASED_HIGH		1
+#define PE_REL_BASED_LOW		2
+#define PE_REL_BASED_HIGHADJ	4
+
+/* Largest image we agree to lay out; real images are far below this. */
+#define PE_MAX_IMAGE_SIZE		0x40000000
+#define PE_PAGE_SIZE			0x1000
+
+static inline uint32_t Load32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t Load64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline void Store32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+static inline void Store64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+
+PeMapper::PeMapper()
+	: m_Source(NULL), m_Image(NULL), m_Size(0), m_Base(0), m_Is64(false),
+	  m_Relocations(0), m_RelocationsChecked(false), m_Error(NULL), m_Resolver(NULL), m_ResolverContext(NULL),
+	  m_ResolveFailed(false)
+{
+}
+
+PeMapper::~PeMapper()
+{
+	Unmap();
+}
+
+void PeMapper::Unmap()
+{
+	free(m_Image);
+	m_Source = NULL;
+	m_Image = NULL;
+	m_Size = 0;
+	m_Base = 0;
+	m_Relocations = 0;
+	m_RelocationsChecked = false;
+	m_Error = NULL;
+}
+
+bool PeMapper::Fail(const char *Error)
+{
+	Unmap();
+	m_Error = Error;
+	return false;
+}
+
+/* Like Fail(), but the mapping stays usable. */
+bool PeMapper::Refuse(const char *Error)
+{
+	m_Error = Error;
+	return false;
+}
+
+bool PeMapper::Map(PeImage &Image, uint64_t Base, PE_IMPORT_RESOLVER Resolver, void *Context)
+{
+	uint32_t i;
+
+	Unmap();
+	if (!Image.Base())
+		return Fail("image not open");
+	if (!Image.SizeOfImage() || Image.SizeOfImage() > PE_MAX_IMAGE_SIZE)
+		return Fail("bad SizeOfImage");
+	if (Image.SizeOfHeaders() > Image.SizeOfImage())
+		return Fail("headers larger than the image");
+
+	m_Size = Image.SizeOfImage();
+	m_Image = (uint8_t *)calloc(1, m_Size);
+	if (!m_Image)
+		return Fail("out of memory");
+	m_Source = &Image;
+	m_Is64 = Image.Is64();
+
+	memcpy(m_Image, Image.Base(), Image.SizeOfHeaders());
+	for (i = 0; i < Image.NumberOfSections(); i++)
+	{
+		const PE_SECTION_HEADER *Section = Image.Section(i);
+		uint32_t Length = Section->SizeOfRawData;
+
+		// Like the loader: raw data beyond VirtualSize is not mapped, and a
+		// zero VirtualSize means "use SizeOfRawData".
+		if (Section->VirtualSize && Section->VirtualSize < Length)
+			Length = Section->VirtualSize;
+		if (Section->VirtualAddress > m_Size || Length > m_Size - Section->VirtualAddress)
+			return Fail("section outside SizeOfImage");
+		if (!Length)
+			continue;
+		if ((uint64_t)Section->PointerToRawData + Length > Image.Size())
+			return Fail("section data outside the file");
+		memcpy(m_Image + Section->VirtualAddress, Image.Base() + Section->PointerToRawData, Length);
+	}
+
+	// The mapped headers describe the mapped image, so they carry the new base.
+	m_Base = Image.ImageBase();
+	if (Base != m_Base && !Relocate(Base))
+		return Fail(m_Error);
+
+	if (Resolver)
+	{
+		m_Resolver = Resolver;
+		m_ResolverContext = Context;
+		m_ResolveFailed = false;
+		if (!Image.EnumerateImports(ResolveOne, this))
+			return Fail("corrupt import table");
+		if (m_ResolveFailed)
+			return Fail("unresolved import");
+	}
+	return true;
+}
+
+bool PeMapper::ResolveOne(void *Context, const PE_IMPORT *Import)
+{
+	PeMapper *Mapper = (PeMapper *)Context;
+	uint32_t Width = Mapper->m_Is64 ? 8 : 4;
+	uint64_t Address = 0;
+
+	if (Import->IatRva > Mapper->m_Size || Width > Mapper->m_Size - Import->IatRva ||
+		!Mapper->m_Resolver(Mapper->m_ResolverContext, Import, &Address))
+	{
+		Mapper->m_ResolveFailed = true;
+		return false;
+	}
+	if (Mapper->m_Is64)
+		Store64(Mapper->m_Image + Import->IatRva, Address);
+	else
+		Store32(Mapper->m_Image + Import->IatRva, (uint32_t)Address);
+	return true;
+}
+
+bool PeMapper::Relocate(uint64_t NewBase)
+{
+	const PE_DOS_HEADER *Dos;
+	uint8_t *ImageBase;
+
+	if (!m_Image)
+		return Fail("image not mapped");
+	if (NewBase == m_Base)
+		return true;
+	if (m_Source->Characteristics() & 0x0001)	// IMAGE_FILE_RELOCS_STRIPPED
+		return Refuse("relocations stripped");
+	// ApplyRelocations() stops at the first bad entry with part of the
+	// table applied, so a table is walked once without writing first.
+	if (!m_RelocationsChecked && !CheckRelocations())
+		return Refuse("corrupt relocation table");
+	m_RelocationsChecked = true;
+	if (!ApplyRelocations(NewBase - m_Base))
+		return Refuse("corrupt relocation table");
+
+	Dos = (const PE_DOS_HEADER *)m_Image;
+	ImageBase = m_Image + Dos->e_lfanew + 4 + sizeof(PE_FILE_HEADER);
+	if (m_Is64)
+		Store64(ImageBase + offsetof(PE_OPTIONAL_HEADER64, ImageBase), NewBase);
+	else
+		Store32(ImageBase + offsetof(PE_OPTIONAL_HEADER32, ImageBase), (uint32_t)NewBase);
+	m_Base = NewBase;
+	return true;
+}
+
+/**
+ * returns: true if ApplyRelocations() will get through the whole table:
+ * every block inside the directory, every entry of a known type with its
+ * slot inside the image.
+ */
+bool PeMapper::CheckRelocations()
+{
+	const PE_DATA_DIRECTORY *Dir = m_Source->Directory(PE_DIRECTORY_BASERELOC);
+	uint32_t Rva, End;
+
+	if (!Dir)
+		return true;
+	if (Dir->VirtualAddress > m_Size || Dir->Size > m_Size - Dir->VirtualAddress)
+		return false;
+
+	End = Dir->VirtualAddress + Dir->Size;
+	for (Rva = Dir->VirtualAddress; End - Rva >= sizeof(PE_BASE_RELOCATION); )
+	{
+		PE_BASE_RELOCATION Block;
+		const uint16_t *Entries;
+		uint32_t Count, i;
+
+		memcpy(&Block, m_Image + Rva, sizeof(Block));
+		if (Block.SizeOfBlock < sizeof(PE_BASE_RELOCATION) || Block.SizeOfBlock > End - Rva)
+			return false;
+		Count = (Block.SizeOfBlock - sizeof(PE_BASE_RELOCATION)) / sizeof(uint16_t);
+		Entries = (const uint16_t *)(m_Image + Rva + sizeof(PE_BASE_RELOCATION));
+
+		for (i = 0; i < Count; i++)
+		{
+			uint32_t Type = Entries[i] >> 12;
+			uint32_t Target = Block.VirtualAddress + (Entries[i] & 0xFFF);
+			uint32_t Width = Type == PE_REL_BASED_DIR64 ? 8 : Type == PE_REL_BASED_HIGHLOW ? 4 : 2;
+
+			if (Type == PE_REL_BASED_ABSOLUTE)
+				continue;
+			if (Type != PE_REL_BASED_HIGHLOW && Type != PE_REL_BASED_DIR64 && Type != PE_REL_BASED_HIGH &&
+				Type != PE_REL_BASED_LOW && Type != PE_REL_BASED_HIGHADJ)
+				return false;
+			if (Block.VirtualAddress > m_Size || Target > m_Size || Width > m_Size - Target)
+				return false;
+			if (Type == PE_REL_BASED_HIGHADJ && ++i >= Count)
+				return false;
+		}
+		Rva += Block.SizeOfBlock;
+	}
+	return true;
+}
+
+/**
+ * effects: Add <Delta> to every relocated slot.
+ *
+ * Blocks are handled whole. When the block's page plus the widest fixup
+ * lies inside the image, the per-entry bounds check is dropped, and the
+ * entries are decoded 8 at a time with SSE2: if all 8 carry the image's
+ * native type (HIGHLOW or DIR64), their offsets are applied in a straight
+ * run. Anything else (padding, HIGH/LOW/HIGHADJ, blocks at the end of the
+ * image) goes through the checked scalar path.
+ */
+bool PeMapper::ApplyRelocations(uint64_t Delta)
+{
+	const PE_DATA_DIRECTORY *Dir = m_Source->Directory(PE_DIRECTORY_BASERELOC);
+	uint32_t Native = m_Is64 ? PE_REL_BASED_DIR64 : PE_REL_BASED_HIGHLOW;
+	uint32_t Delta32 = (uint32_t)Delta;
+	uint32_t Rva, End;
+
+	m_Relocations = 0;
+	if (!Dir)
+		return true;
+	if (Dir->VirtualAddress > m_Size || Dir->Size > m_Size - Dir->VirtualAddress)
+		return false;
+
+	End = Dir->VirtualAddress + Dir->Size;
+	for (Rva = Dir->VirtualAddress; End - Rva >= sizeof(PE_BASE_RELOCATION); )
+	{
+		PE_BASE_RELOCATION Block;
+		const uint16_t *Entries;
+		uint8_t *Page;
+		uint32_t Count, i = 0;
+
+		memcpy(&Block, m_Image + Rva, sizeof(Block));
+		if (Block.SizeOfBlock < sizeof(PE_BASE_RELOCATION) || Block.SizeOfBlock > End - Rva)
+			return false;
+		Count = (Block.SizeOfBlock - sizeof(PE_BASE_RELOCATION)) / sizeof(uint16_t);
+		Entries = (const uint16_t *)(m_Image + Rva + sizeof(PE_BASE_RELOCATION));
+		Page = m_Image + Block.VirtualAddress;
+
+		if (Block.VirtualAddress <= m_Size && m_Size - Block.VirtualAddress >= PE_PAGE_SIZE + 8)
+		{
+#ifdef PE_RELOC_SSE2
+			const __m128i TypeMask = _mm_set1_epi16((short)0xF000);
+			const __m128i NativeType = _mm_set1_epi16((short)(Native << 12));
+
+			for (; i + 8 <= Count; i += 8)
+			{
+				__m128i Raw = _mm_loadu_si128((const __m128i *)(Entries + i));
+				uint16_t Offsets[8];
+				uint32_t k;
+
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(Raw, TypeMask), NativeType)) != 0xFFFF)
+					break;
+				_mm_storeu_si128((__m128i *)Offsets, _mm_andnot_si128(TypeMask, Raw));
+				if (m_Is64)
+				{
+					for (k = 0; k < 8; k++)
+						Store64(Page + Offsets[k], Load64(Page + Offsets[k]) + Delta);
+				}
+				else
+				{
+					for (k = 0; k < 8; k++)
+						Store32(Page + Offsets[k], Load32(Page + Offsets[k]) + Delta32);
+				}
+				m_Relocations += 8;
+			}
+#endif
+			// Unchecked scalar run over whatever SSE2 left.
+			for (; i < Count; i++)
+			{
+				uint32_t Type = Entries[i] >> 12;
+				uint8_t *Slot = Page + (Entries[i] & 0xFFF);
+
+				if (Type == PE_REL_BASED_ABSOLUTE)
+					continue;
+				if (Type != Native)
+					break;
+				if (m_Is64)
+					Store64(Slot, Load64(Slot) + Delta);
+				else
+					Store32(Slot, Load32(Slot) + Delta32);
+				m_Relocations++;
+			}
+		}
+
+		// Checked path: rare types and blocks too close to the end.
+		for (; i < Count; i++)
+		{
+			uint32_t Type = Entries[i] >> 12;
+			uint32_t Target = Block.VirtualAddress + (Entries[i] & 0xFFF);
+			uint32_t Width = Type == PE_REL_BASED_DIR64 ? 8 : Type == PE_REL_BASED_HIGHLOW ? 4 : 2;
+			uint8_t *Slot;
+
+			if (Type == PE_REL_BASED_ABSOLUTE)
+				continue;
+			if (Target > m_Size || Width > m_Size - Target)
+				return false;
+			Slot = m_Image + Target;
+
+			switch (Type)
+			{
+			case PE_REL_BASED_HIGHLOW:
+				Store32(Slot, Load32(Slot) + Delta32);
+				break;
+			case PE_REL_BASED_DIR64:
+				Store64(Slot, Load64(Slot) + Delta);
+				break;
+			case PE_REL_BASED_HIGH:
+			{
+				uint16_t Value;
+
+				memcpy(&Value, Slot, 2);
+				Value = (uint16_t)((((uint32_t)Value << 16) + Delta32) >> 16);
+				memcpy(Slot, &Value, 2);
+				break;
+			}
+			case PE_REL_BASED_LOW:
+			{
+				uint16_t Value;
+
+				memcpy(&Value, Slot, 2);
+				Value = (uint16_t)(Value + Delta32);
+				memcpy(Slot, &Value, 2);
+				break;
+			}
+			case PE_REL_BASED_HIGHADJ:
+			{
+				uint16_t Value;
+				uint32_t Full;
+
+				// The next entry holds the low half used for rounding.
+				if (++i >= Count)
+					return false;
+				memcpy(&Value, Slot, 2);
+				Full = ((uint32_t)Value << 16) + (int16_t)Entries[i];
+				Full += Delta32 + 0x8000;
+				Value = (uint16_t)(Full >> 16);
+				memcpy(Slot, &Value, 2);
+				break;
+			}
+			default:
+				return false;
+			}
+			m_Relocations++;
+		}
+		Rva += Block.SizeOfBlock;
+	}
+	return true;
+}
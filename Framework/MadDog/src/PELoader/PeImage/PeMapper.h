@@ -0,0 +1,79 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * PeMapper - lay a PeImage out in memory the way the Windows loader does,
+ * without running any of it: headers and sections at their RVAs, base
+ * relocations applied for the chosen base, and the IAT filled in through
+ * a caller-supplied resolver.
+ */
+
+#pragma once
+
+#include "PeImage.h"
+
+#pragma pack(push, 8)
+
+/**
+ * Resolve one import for the mapped image.
+ * returns: false to fail the mapping. Otherwise <*Address> is written to the
+ * import's IAT slot (truncated to 32 bits for PE32 images).
+ */
+typedef bool (*PE_IMPORT_RESOLVER)(void *Context, const PE_IMPORT *Import, uint64_t *Address);
+
+class PeMapper
+{
+public:
+	PeMapper();
+	~PeMapper();
+
+	/**
+	 * effects: Map <Image> at <Base>. Pass Image.ImageBase() to skip the
+	 * relocation pass. With a NULL <Resolver> the IAT is left as it is in
+	 * the file.
+	 * returns: false with Error() set on a corrupt image or failed import.
+	 */
+	bool Map(PeImage &Image, uint64_t Base, PE_IMPORT_RESOLVER Resolver, void *Context);
+
+	/**
+	 * effects: Rebase the mapped image to <NewBase> by applying the
+	 * relocations again with the difference to the current base.
+	 * returns: false with Error() set if the image has its relocations
+	 * stripped or a corrupt relocation table. The image stays mapped at
+	 * its current base, untouched.
+	 */
+	bool Relocate(uint64_t NewBase);
+
+	void Unmap();
+	const char *Error() const { return m_Error; }
+
+	const uint8_t *Image() const { return m_Image; }
+	size_t Size() const { return m_Size; }
+	uint64_t Base() const { return m_Base; }
+	uint32_t Relocations() const { return m_Relocations; }
+
+private:
+	PeMapper(const PeMapper &);
+	PeMapper &operator=(const PeMapper &);
+
+	bool Fail(const char *Error);
+	bool Refuse(const char *Error);
+	bool CheckRelocations();
+	bool ApplyRelocations(uint64_t Delta);
+
+	static bool ResolveOne(void *Context, const PE_IMPORT *Import);
+
+	PeImage *m_Source;
+	uint8_t *m_Image;
+	size_t m_Size;
+	uint64_t m_Base;
+	bool m_Is64;
+	uint32_t m_Relocations;
+	bool m_RelocationsChecked;
+	const char *m_Error;
+
+	/* Import pass state */
+	PE_IMPORT_RESOLVER m_Resolver;
+	void *m_ResolverContext;
+	bool m_ResolveFailed;
+};
+
+#pragma pack(pop)
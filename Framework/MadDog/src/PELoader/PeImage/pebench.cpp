@@ -0,0 +1,361 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * pebench - time PeImage against the old PELoader code paths over a corpus
+ * of PE files.
+ *
+ * Usage: pebench [-n rounds] <file or directory>...
+ *
+ * Directories are walked recursively; files that aren't PE images are
+ * skipped. For every phase the best of <rounds> runs is reported:
+ *
+ *	load/fread4	the old LoadPEFile loop, 4 bytes per fread()
+ *	load/PeImage	PeImage::Open (mmap + header validation)
+ *	walk		sections, RVA translation, imports and relocations
+ *	exports/linear	each exported name looked up by a strcmp scan
+ *	exports/hash	each exported name and ordinal looked up with PeImage
+ *	map		PeMapper::Map at the preferred base
+ *	reloc/checked	rebase by 64K through EnumerateRelocations, one
+ *			bounds-checked fixup per callback
+ *	reloc/batched	rebase by 64K with PeMapper::Relocate
+ *
+ * The reloc phases only cover images that can be rebased; those with
+ * their relocations stripped are mapped but not timed there.
+ */
+
+#include "PeMapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+/* Results go here so the compiler can't drop the work being timed. */
+static volatile uint64_t Sink;
+
+static double Now()
+{
+#ifdef _WIN32
+	LARGE_INTEGER Count, Frequency;
+
+	QueryPerformanceCounter(&Count);
+	QueryPerformanceFrequency(&Frequency);
+	return (double)Count.QuadPart / (double)Frequency.QuadPart;
+#else
+	struct timespec Ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec / 1e9;
+#endif
+}
+
+static void Collect(const std::string &Path, std::vector<std::string> &Files)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA Data;
+	HANDLE Find;
+	DWORD Attributes = GetFileAttributesA(Path.c_str());
+
+	if (Attributes == INVALID_FILE_ATTRIBUTES)
+		return;
+	if (!(Attributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		Files.push_back(Path);
+		return;
+	}
+	Find = FindFirstFileA((Path + "\\*").c_str(), &Data);
+	if (Find == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if (strcmp(Data.cFileName, ".") && strcmp(Data.cFileName, ".."))
+			Collect(Path + "\\" + Data.cFileName, Files);
+	} while (FindNextFileA(Find, &Data));
+	FindClose(Find);
+#else
+	struct stat St;
+	struct dirent *Entry;
+	DIR *Dir;
+
+	if (lstat(Path.c_str(), &St) != 0)
+		return;
+	if (S_ISREG(St.st_mode))
+	{
+		Files.push_back(Path);
+		return;
+	}
+	if (!S_ISDIR(St.st_mode) || !(Dir = opendir(Path.c_str())))
+		return;
+	while ((Entry = readdir(Dir)) != NULL)
+	{
+		if (strcmp(Entry->d_name, ".") && strcmp(Entry->d_name, ".."))
+			Collect(Path + "/" + Entry->d_name, Files);
+	}
+	closedir(Dir);
+#endif
+}
+
+/* The loop PeLoader/peloader.cpp used before it moved to PeImage. */
+static unsigned long LoadFread4(const char *FileName)
+{
+	FILE *fp = fopen(FileName, "rb");
+	unsigned long len, i;
+	char *Buffer;
+
+	if (!fp)
+		return 0;
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	Buffer = new char[len + 4];
+	memset(Buffer, 0x0, len + 4);
+	for (i = 0; i < len; i += 4)
+		fread(Buffer + i, 4, 1, fp);
+	fclose(fp);
+	delete []Buffer;
+	return len;
+}
+
+static bool CountImport(void *Context, const PE_IMPORT *Import)
+{
+	++*(uint64_t *)Context;
+	return true;
+}
+
+static bool CountRelocation(void *Context, uint32_t Rva, uint32_t Type)
+{
+	++*(uint64_t *)Context;
+	return true;
+}
+
+static uint64_t Walk(PeImage &Image)
+{
+	uint64_t Items = 0;
+	uint32_t i;
+
+	for (i = 0; i < Image.NumberOfSections(); i++)
+	{
+		const PE_SECTION_HEADER *Section = Image.Section(i);
+
+		Items += Image.SectionFromRva(Section->VirtualAddress) == Section;
+		Items += Image.RvaToOffset(Section->VirtualAddress) != 0;
+	}
+	Image.EnumerateImports(CountImport, &Items);
+	Image.EnumerateRelocations(CountRelocation, &Items);
+	return Items;
+}
+
+/* What a PEDump-style tool does without an index: strcmp down the name table. */
+static uint64_t ExportsLinear(PeImage &Image)
+{
+	uint32_t Count = Image.NumberOfExports(), i, j;
+	std::vector<const char *> Names;
+	uint64_t Found = 0;
+	PE_EXPORT Export;
+
+	for (i = 0; i < Count; i++)
+		Names.push_back(Image.ExportByIndex(i, &Export) ? Export.Name : NULL);
+	for (i = 0; i < Count; i++)
+	{
+		if (!Names[i])
+			continue;
+		for (j = 0; j < Count; j++)
+		{
+			if (Names[j] && !strcmp(Names[j], Names[i]))
+			{
+				Found++;
+				break;
+			}
+		}
+	}
+	return Found;
+}
+
+static uint64_t ExportsHashed(PeImage &Image)
+{
+	uint32_t Count = Image.NumberOfExports(), i;
+	uint64_t Found = 0;
+	PE_EXPORT Export, Hit;
+
+	for (i = 0; i < Count; i++)
+	{
+		if (!Image.ExportByIndex(i, &Export))
+			continue;
+		Found += Image.FindExport(Export.Name, &Hit);
+		Found += Image.FindExportByOrdinal(Export.Ordinal, &Hit);
+	}
+	return Found;
+}
+
+typedef struct _CHECKED_RELOCATION
+{
+	uint8_t *Image;
+	uint32_t Size;
+	uint64_t Delta;
+	bool Is64;
+} CHECKED_RELOCATION;
+
+/* The obvious rebase loop: one callback, one type switch, one bounds check per fixup. */
+static bool ApplyChecked(void *Context, uint32_t Rva, uint32_t Type)
+{
+	CHECKED_RELOCATION *Reloc = (CHECKED_RELOCATION *)Context;
+
+	if (Type == PE_REL_BASED_HIGHLOW && Rva + 4 <= Reloc->Size)
+	{
+		uint32_t Value;
+
+		memcpy(&Value, Reloc->Image + Rva, 4);
+		Value += (uint32_t)Reloc->Delta;
+		memcpy(Reloc->Image + Rva, &Value, 4);
+	}
+	else if (Type == PE_REL_BASED_DIR64 && Rva + 8 <= Reloc->Size)
+	{
+		uint64_t Value;
+
+		memcpy(&Value, Reloc->Image + Rva, 8);
+		Value += Reloc->Delta;
+		memcpy(Reloc->Image + Rva, &Value, 8);
+	}
+	return true;
+}
+
+enum { PHASE_FREAD4, PHASE_OPEN, PHASE_WALK, PHASE_LINEAR, PHASE_HASH,
+	PHASE_MAP, PHASE_RELOC_CHECKED, PHASE_RELOC_BATCHED, PHASE_COUNT };
+
+static const char *PhaseNames[PHASE_COUNT] =
+{
+	"load/fread4", "load/PeImage", "walk", "exports/linear", "exports/hash",
+	"map", "reloc/checked", "reloc/batched",
+};
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> Files, Images;
+	std::vector<bool> Relocatable;
+	double Best[PHASE_COUNT];
+	uint64_t Bytes = 0, Exports = 0, Fixups = 0, Rebased = 0;
+	int Rounds = 5, Round, Phase, i;
+	size_t f;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			Rounds = atoi(argv[++i]);
+		else
+			Collect(argv[i], Files);
+	}
+	if (Files.empty() || Rounds < 1)
+	{
+		fprintf(stderr, "usage: pebench [-n rounds] <file or directory>...\n");
+		return 1;
+	}
+
+	for (f = 0; f < Files.size(); f++)
+	{
+		PeImage Image;
+
+		if (Image.Open(Files[f].c_str()))
+		{
+			PeMapper Mapper;
+			bool Rebases = Mapper.Map(Image, Image.ImageBase(), NULL, NULL) &&
+				Mapper.Relocate(Image.ImageBase() + 0x10000);
+
+			Images.push_back(Files[f]);
+			Relocatable.push_back(Rebases);
+			Bytes += Image.Size();
+			Exports += Image.NumberOfExports();
+			if (Rebases)
+			{
+				Fixups += Mapper.Relocations();
+				Rebased++;
+			}
+		}
+	}
+	if (Images.empty())
+	{
+		fprintf(stderr, "pebench: no PE images among %u files\n", (unsigned)Files.size());
+		return 1;
+	}
+
+	for (Phase = 0; Phase < PHASE_COUNT; Phase++)
+		Best[Phase] = 1e30;
+
+	for (Round = 0; Round < Rounds; Round++)
+	{
+		double Start, Elapsed[PHASE_COUNT] = { 0 };
+
+		for (f = 0; f < Images.size(); f++)
+		{
+			const char *FileName = Images[f].c_str();
+			PeImage Image;
+
+			Start = Now();
+			Sink += LoadFread4(FileName);
+			Elapsed[PHASE_FREAD4] += Now() - Start;
+
+			Start = Now();
+			Image.Open(FileName);
+			Elapsed[PHASE_OPEN] += Now() - Start;
+
+			Start = Now();
+			Sink += Walk(Image);
+			Elapsed[PHASE_WALK] += Now() - Start;
+
+			Start = Now();
+			Sink += ExportsLinear(Image);
+			Elapsed[PHASE_LINEAR] += Now() - Start;
+
+			// Fresh image so the hash build is part of the measurement.
+			Image.Open(FileName);
+			Start = Now();
+			Sink += ExportsHashed(Image);
+			Elapsed[PHASE_HASH] += Now() - Start;
+
+			PeMapper Mapper;
+			Start = Now();
+			if (!Mapper.Map(Image, Image.ImageBase(), NULL, NULL))
+				continue;
+			Elapsed[PHASE_MAP] += Now() - Start;
+			if (!Relocatable[f])
+				continue;
+
+			// Both rebases start from the same mapped bytes.
+			std::vector<uint8_t> Copy(Mapper.Image(), Mapper.Image() + Mapper.Size());
+			CHECKED_RELOCATION Checked = { &Copy[0], (uint32_t)Copy.size(), 0x10000, Image.Is64() };
+			Start = Now();
+			Image.EnumerateRelocations(ApplyChecked, &Checked);
+			Elapsed[PHASE_RELOC_CHECKED] += Now() - Start;
+
+			Start = Now();
+			if (!Mapper.Relocate(Image.ImageBase() + 0x10000))
+				continue;
+			Elapsed[PHASE_RELOC_BATCHED] += Now() - Start;
+			Sink += Copy[Round % Copy.size()] + Mapper.Image()[Round % Mapper.Size()];
+		}
+		for (Phase = 0; Phase < PHASE_COUNT; Phase++)
+		{
+			if (Elapsed[Phase] < Best[Phase])
+				Best[Phase] = Elapsed[Phase];
+		}
+	}
+
+	printf("%u images, %llu bytes, %llu named exports, %llu fixups in %llu rebased images, best of %d rounds\n",
+		(unsigned)Images.size(), (unsigned long long)Bytes, (unsigned long long)Exports,
+		(unsigned long long)Fixups, (unsigned long long)Rebased, Rounds);
+	for (Phase = 0; Phase < PHASE_COUNT; Phase++)
+	{
+		printf("%-16s %12.3f ms", PhaseNames[Phase], Best[Phase] * 1000);
+		if ((Phase == PHASE_RELOC_CHECKED || Phase == PHASE_RELOC_BATCHED) && Best[Phase] > 0)
+			printf("  %8.1f Mfixups/s", Fixups / Best[Phase] / 1e6);
+		printf("\n");
+	}
+	return 0;
+}
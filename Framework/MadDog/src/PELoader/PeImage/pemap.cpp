@@ -0,0 +1,135 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * pemap - map a PE file with PeMapper, write the memory image out, or
+ * check it byte for byte against a reference image.
+ *
+ * Usage: pemap [-b base] [-o out] [-c reference] <file>
+ *
+ *	-b base		map at this base instead of the preferred ImageBase
+ *	-o out		write the SizeOfImage bytes of the mapped image to <out>
+ *	-c reference	compare with <reference>, e.g. a dump of the module
+ *			taken from a process where it loaded at the same base.
+ *			IAT slots are skipped, since the loader fills them with
+ *			whatever the imported DLLs resolved to on that machine.
+ *
+ * Exit status is 0 when the image maps (and matches the reference).
+ */
+
+#include "PeMapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+typedef struct _IAT_SLOTS
+{
+	std::vector<uint32_t> Rvas;
+	uint32_t Width;
+} IAT_SLOTS;
+
+static bool CollectIat(void *Context, const PE_IMPORT *Import)
+{
+	((IAT_SLOTS *)Context)->Rvas.push_back(Import->IatRva);
+	return true;
+}
+
+static int Compare(PeImage &Image, PeMapper &Mapper, const char *Reference)
+{
+	PeFileView View;
+	std::vector<uint8_t> Skip(Mapper.Size(), 0);
+	IAT_SLOTS Iat;
+	size_t Offset, Length, Differences = 0, Shown = 0;
+
+	if (!View.Map(Reference))
+	{
+		fprintf(stderr, "pemap: %s: can't read\n", Reference);
+		return 1;
+	}
+
+	Iat.Width = Image.Is64() ? 8 : 4;
+	Image.EnumerateImports(CollectIat, &Iat);
+	for (Offset = 0; Offset < Iat.Rvas.size(); Offset++)
+	{
+		uint32_t k;
+
+		for (k = 0; k < Iat.Width && Iat.Rvas[Offset] + k < Skip.size(); k++)
+			Skip[Iat.Rvas[Offset] + k] = 1;
+	}
+
+	Length = View.Size() < Mapper.Size() ? View.Size() : Mapper.Size();
+	for (Offset = 0; Offset < Length; Offset++)
+	{
+		if (Skip[Offset] || View.Base()[Offset] == Mapper.Image()[Offset])
+			continue;
+		if (Shown++ < 16)
+			printf("  +%08lx: mapped %02x, reference %02x\n", (unsigned long)Offset,
+				Mapper.Image()[Offset], View.Base()[Offset]);
+		Differences++;
+	}
+	if (View.Size() != Mapper.Size())
+		printf("size differs: mapped 0x%lx, reference 0x%lx\n",
+			(unsigned long)Mapper.Size(), (unsigned long)View.Size());
+	printf("%lu bytes differ (%lu IAT slots skipped)\n",
+		(unsigned long)Differences, (unsigned long)Iat.Rvas.size());
+	return Differences || View.Size() != Mapper.Size();
+}
+
+int main(int argc, char **argv)
+{
+	const char *Output = NULL, *Reference = NULL, *FileName = NULL;
+	uint64_t Base = 0;
+	bool HaveBase = false;
+	PeImage Image;
+	PeMapper Mapper;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-b") && i + 1 < argc)
+		{
+			Base = strtoull(argv[++i], NULL, 0);
+			HaveBase = true;
+		}
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			Output = argv[++i];
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			Reference = argv[++i];
+		else
+			FileName = argv[i];
+	}
+	if (!FileName)
+	{
+		fprintf(stderr, "usage: pemap [-b base] [-o out] [-c reference] <file>\n");
+		return 2;
+	}
+
+	if (!Image.Open(FileName))
+	{
+		fprintf(stderr, "pemap: %s: %s\n", FileName, Image.Error());
+		return 1;
+	}
+	if (!HaveBase)
+		Base = Image.ImageBase();
+	if (!Mapper.Map(Image, Base, NULL, NULL))
+	{
+		fprintf(stderr, "pemap: %s: %s\n", FileName, Mapper.Error());
+		return 1;
+	}
+	printf("%s: 0x%lx bytes at 0x%llx, %u relocations applied\n", FileName,
+		(unsigned long)Mapper.Size(), (unsigned long long)Mapper.Base(), Mapper.Relocations());
+
+	if (Output)
+	{
+		FILE *fp = fopen(Output, "wb");
+
+		if (!fp || fwrite(Mapper.Image(), 1, Mapper.Size(), fp) != Mapper.Size() || fclose(fp))
+		{
+			fprintf(stderr, "pemap: %s: write failed\n", Output);
+			return 1;
+		}
+	}
+	if (Reference)
+		return Compare(Image, Mapper, Reference);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+# peref - reference mapper for "make check": lays a PE file out at a given
+# base the way the Windows loader does, without sharing any code with
+# PeMapper, so pemap -c can check PeMapper against it byte for byte.
+#
+# Usage: peref.py [-b base] <file> <out>
+#        peref.py -r <file>	exit 0 if the image can be rebased
+#
+# Only what the loader does before the imports: headers, sections at their
+# RVAs, base relocations and the ImageBase field. The IAT is left as in the
+# file, which is what pemap does without a resolver.
+
+import struct
+import sys
+
+RELOCS_STRIPPED = 0x0001
+
+
+def headers(data):
+    lfanew = struct.unpack_from('<I', data, 0x3C)[0]
+    if data[:2] != b'MZ' or data[lfanew:lfanew + 4] != b'PE\0\0':
+        raise ValueError('not a PE image')
+    sections, opt_size, characteristics = struct.unpack_from('<2xH12xHH', data, lfanew + 4)
+    opt = lfanew + 24
+    magic = struct.unpack_from('<H', data, opt)[0]
+    if magic == 0x10B:
+        base_at, base_fmt, dirs = opt + 28, '<I', opt + 96
+    elif magic == 0x20B:
+        base_at, base_fmt, dirs = opt + 24, '<Q', opt + 112
+    else:
+        raise ValueError('unknown optional header')
+    image_base = struct.unpack_from(base_fmt, data, base_at)[0]
+    size_of_image, size_of_headers = struct.unpack_from('<II', data, opt + 56)
+    reloc_rva, reloc_size = struct.unpack_from('<II', data, dirs + 5 * 8)
+    table = []
+    for i in range(sections):
+        va_size, va, raw_size, raw_ptr = struct.unpack_from('<8xIIII', data, opt + opt_size + i * 40)
+        table.append((va_size, va, raw_size, raw_ptr))
+    return dict(characteristics=characteristics, base_at=base_at, base_fmt=base_fmt,
+                image_base=image_base, size_of_image=size_of_image,
+                size_of_headers=size_of_headers, relocs=(reloc_rva, reloc_size),
+                sections=table, is64=magic == 0x20B)
+
+
+def layout(data, h):
+    image = bytearray(h['size_of_image'])
+    image[:h['size_of_headers']] = data[:h['size_of_headers']]
+    for va_size, va, raw_size, raw_ptr in h['sections']:
+        length = min(va_size, raw_size) if va_size else raw_size
+        image[va:va + length] = data[raw_ptr:raw_ptr + length]
+    return image
+
+
+def rebase(image, h, base):
+    delta = base - h['image_base']
+    rva, size = h['relocs']
+    end = rva + size
+    while end - rva >= 8:
+        page, block = struct.unpack_from('<II', image, rva)
+        entries = struct.unpack_from('<%dH' % ((block - 8) // 2), image, rva + 8)
+        i = 0
+        while i < len(entries):
+            kind, at = entries[i] >> 12, page + (entries[i] & 0xFFF)
+            if kind == 3:		# HIGHLOW
+                value = struct.unpack_from('<I', image, at)[0]
+                struct.pack_into('<I', image, at, (value + delta) & 0xFFFFFFFF)
+            elif kind == 10:	# DIR64
+                value = struct.unpack_from('<Q', image, at)[0]
+                struct.pack_into('<Q', image, at, (value + delta) & 0xFFFFFFFFFFFFFFFF)
+            elif kind == 1:		# HIGH
+                value = struct.unpack_from('<H', image, at)[0]
+                struct.pack_into('<H', image, at, (((value << 16) + delta) >> 16) & 0xFFFF)
+            elif kind == 2:		# LOW
+                value = struct.unpack_from('<H', image, at)[0]
+                struct.pack_into('<H', image, at, (value + delta) & 0xFFFF)
+            elif kind == 4:		# HIGHADJ, the low half is in the next entry
+                i += 1
+                low = entries[i] - 0x10000 if entries[i] & 0x8000 else entries[i]
+                value = struct.unpack_from('<H', image, at)[0]
+                full = (value << 16) + low + delta + 0x8000
+                struct.pack_into('<H', image, at, (full >> 16) & 0xFFFF)
+            elif kind != 0:
+                raise ValueError('relocation type %d' % kind)
+            i += 1
+        rva += block
+    struct.pack_into(h['base_fmt'], image, h['base_at'],
+                     base & (0xFFFFFFFFFFFFFFFF if h['is64'] else 0xFFFFFFFF))
+
+
+def main(argv):
+    args = argv[1:]
+    base = None
+    if args[:1] == ['-r']:
+        h = headers(open(args[1], 'rb').read())
+        return 1 if h['characteristics'] & RELOCS_STRIPPED else 0
+    if args[:1] == ['-b']:
+        base = int(args[1], 0)
+        args = args[2:]
+    if len(args) != 2:
+        sys.stderr.write('usage: peref.py [-b base] <file> <out> | -r <file>\n')
+        return 2
+    data = open(args[0], 'rb').read()
+    h = headers(data)
+    image = layout(data, h)
+    if base is not None and base != h['image_base']:
+        rebase(image, h, base)
+    open(args[1], 'wb').write(image)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,838 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * emulatebench - check the instruction emulator of common/emulate.c against
+ * the processor it runs on, then time it, in user mode on x86-64.
+ *
+ * Usage: emulatebench [-n random cases] [-s seed]
+ *
+ * Every instruction checked is built as bytes, run by the emulator on one
+ * copy of the registers and memory and run natively on another, and the
+ * registers, the defined flags and the memory are compared:
+ *
+ *	alu8		ADD..CMP, TEST, INC DEC NOT NEG on bytes, every value
+ *			pair and carry in
+ *	random		the whole subset with 16, 32 and 64-bit operands,
+ *			memory and register forms, high byte registers
+ *	string		REP MOVS STOS LODS, both directions, lengths 0-40
+ *	decode		32 and 16-bit code, port I/O and REP limits, which
+ *			can't run natively here, against hand results
+ *	failure		a store that fails leaves the registers and flags,
+ *			a REP only keeps the elements it moved
+ *	locked		the LOCK forms natively, and emulated LOCK INC
+ *			racing a native LOCK ADD from another thread
+ *
+ * It then reports the cost of EmuStep() per instruction with and without
+ * the decode cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "emulate.c"
+
+typedef struct _NATIVE_CONTEXT
+{
+	ULONG64 Regs[8];	/* rsp is not loaded */
+	ULONG64 Rflags;
+} NATIVE_CONTEXT;
+
+typedef void (*NATIVE_STUB)(NATIVE_CONTEXT *Context);
+
+static UCHAR *Code;
+static size_t CodeSize;
+static UCHAR Memory[2048] __attribute__ ((aligned (64)));
+static unsigned long long Seed = 88172645463325252ULL;
+static unsigned long Checked, Failed;
+
+/* Results go here so the compiler can't drop the work being timed. */
+static volatile ULONG64 Sink;
+
+/* A write that touches this address fails, like a store to a page the guest may not write. */
+static ULONG64 FailAddress;
+
+static double Now()
+{
+	struct timespec Ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static ULONG64 Random()
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+/* Mostly random, but often one of the values the flags care about. */
+static ULONG64 RandomValue()
+{
+	static const ULONG64 Edges[] = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0xffff, 0x7fffffff,
+		0x80000000, 0xffffffff, 0x7fffffffffffffffULL, 0x8000000000000000ULL, ~0ULL };
+	ULONG64 r = Random();
+
+	if (r % 4 == 0)
+		return Edges[(r >> 8) % (sizeof(Edges) / sizeof(Edges[0]))] + (r >> 40) % 3 - 1;
+	return Random();
+}
+
+/* Identity memory: the emulator sees this process's own addresses. */
+static BOOLEAN NTAPI AccessMemory(PVOID Context, ULONG64 Address, PVOID Buffer, ULONG32 Size, BOOLEAN Write)
+{
+	if (Write && FailAddress >= Address && FailAddress < Address + Size)
+		return FALSE;
+	if (Write)
+		memcpy((void *)Address, Buffer, Size);
+	else
+		memcpy(Buffer, (const void *)Address, Size);
+	return TRUE;
+}
+
+/* Compare-exchange on the identity memory, with the processor's own LOCK CMPXCHG. */
+static BOOLEAN NTAPI CompareExchange(PVOID Context, ULONG64 Address, ULONG64 Comparand, ULONG64 Exchange,
+	ULONG32 Size, PULONG64 Original)
+{
+	if (FailAddress >= Address && FailAddress < Address + Size)
+		return FALSE;
+	switch (Size)
+	{
+	case 1:
+		*Original = __sync_val_compare_and_swap((UCHAR *)Address, (UCHAR)Comparand, (UCHAR)Exchange);
+		break;
+	case 2:
+		*Original = __sync_val_compare_and_swap((USHORT *)Address, (USHORT)Comparand, (USHORT)Exchange);
+		break;
+	case 4:
+		*Original = __sync_val_compare_and_swap((ULONG32 *)Address, (ULONG32)Comparand, (ULONG32)Exchange);
+		break;
+	default:
+		*Original = __sync_val_compare_and_swap((ULONG64 *)Address, Comparand, Exchange);
+		break;
+	}
+	return TRUE;
+}
+
+/*
+ * push rbx; push rbp; mov r11, rdi; load rax..rdi from [r11]; push [r11+64]; popfq;
+ * <instruction>; pushfq; pop [r11+64]; cld; store rax..rdi; pop rbp; pop rbx; ret
+ */
+static NATIVE_STUB BuildStub(const UCHAR *Bytes, ULONG32 Length)
+{
+	static UCHAR Last[EMU_MAX_INSTRUCTION];
+	static ULONG32 LastLength;
+	UCHAR *p = Code;
+	int r;
+
+	/* rewriting code costs a pipeline flush, the exhaustive loops run one instruction many times */
+	if (Length == LastLength && !memcmp(Bytes, Last, Length))
+		return (NATIVE_STUB)Code;
+	memcpy(Last, Bytes, Length);
+	LastLength = Length;
+
+	*p++ = 0x53;
+	*p++ = 0x55;
+	*p++ = 0x49; *p++ = 0x89; *p++ = 0xfb;
+	for (r = 0; r < 8; r++)
+	{
+		if (r == EMU_RSP)
+			continue;
+		*p++ = 0x49; *p++ = 0x8b; *p++ = 0x43 | r << 3; *p++ = r * 8;
+	}
+	*p++ = 0x41; *p++ = 0xff; *p++ = 0x73; *p++ = 64;
+	*p++ = 0x9d;
+	memcpy(p, Bytes, Length);
+	p += Length;
+	*p++ = 0x9c;
+	*p++ = 0x41; *p++ = 0x8f; *p++ = 0x43; *p++ = 64;
+	*p++ = 0xfc;
+	for (r = 0; r < 8; r++)
+	{
+		if (r == EMU_RSP)
+			continue;
+		*p++ = 0x49; *p++ = 0x89; *p++ = 0x43 | r << 3; *p++ = r * 8;
+	}
+	*p++ = 0x5d;
+	*p++ = 0x5b;
+	*p++ = 0xc3;
+	__builtin___clear_cache((char *)Code, (char *)p);
+	return (NATIVE_STUB)Code;
+}
+
+static void Describe(const UCHAR *Bytes, ULONG32 Length)
+{
+	ULONG32 i;
+
+	for (i = 0; i < Length; i++)
+		fprintf(stderr, "%02x ", Bytes[i]);
+}
+
+/*
+ * Run <Bytes> natively and in the emulator from the same registers and Memory[], compare all of
+ * it except the flags outside <DefinedFlags>.
+ */
+static int Check(const UCHAR *Bytes, ULONG32 Length, const NATIVE_CONTEXT *Start, ULONG64 DefinedFlags)
+{
+	static UCHAR Initial[sizeof(Memory)], Emulated[sizeof(Memory)];
+	NATIVE_CONTEXT Native = *Start;
+	EMU_INSTRUCTION Instruction;
+	EMU_STATE State;
+	ULONG32 Status;
+	int r, Bad = 0;
+
+	Checked++;
+	memcpy(Initial, Memory, sizeof(Memory));
+
+	memset(&State, 0, sizeof(State));
+	memcpy(State.Regs, Start->Regs, sizeof(Start->Regs));
+	State.Rflags = Start->Rflags;
+	State.Rip = 0x10000;
+	State.Mode = EMU_MODE_64;
+	State.AccessMemory = AccessMemory;
+	State.CompareExchange = CompareExchange;
+	Status = EmuDecode(Bytes, Length, EMU_MODE_64, &Instruction);
+	if (Status == EMU_OK)
+		Status = EmuExecute(&State, &Instruction);
+	if (Status != EMU_OK || Instruction.Length != Length || State.Rip != 0x10000 + Length)
+	{
+		fprintf(stderr, "emulatebench: ");
+		Describe(Bytes, Length);
+		fprintf(stderr, "not emulated (status %u, length %u)\n", Status, Instruction.Length);
+		Failed++;
+		return 0;
+	}
+	memcpy(Emulated, Memory, sizeof(Memory));
+	memcpy(Memory, Initial, sizeof(Memory));
+
+	BuildStub(Bytes, Length)(&Native);
+
+	for (r = 0; r < 8; r++)
+		if (r != EMU_RSP && Native.Regs[r] != State.Regs[r])
+			Bad = 1;
+	if ((Native.Rflags ^ State.Rflags) & DefinedFlags)
+		Bad = 1;
+	if (memcmp(Memory, Emulated, sizeof(Memory)))
+		Bad = 1;
+	if (!Bad)
+		return 1;
+
+	if (++Failed <= 20)
+	{
+		fprintf(stderr, "emulatebench: ");
+		Describe(Bytes, Length);
+		fprintf(stderr, "differs:");
+		for (r = 0; r < 8; r++)
+			if (r != EMU_RSP && Native.Regs[r] != State.Regs[r])
+				fprintf(stderr, " r%d %llx/%llx", r, Native.Regs[r], State.Regs[r]);
+		if ((Native.Rflags ^ State.Rflags) & DefinedFlags)
+			fprintf(stderr, " flags %llx/%llx", Native.Rflags & DefinedFlags, State.Rflags & DefinedFlags);
+		if (memcmp(Memory, Emulated, sizeof(Memory)))
+			fprintf(stderr, " memory");
+		fprintf(stderr, " (native/emulated)\n");
+	}
+	return 0;
+}
+
+static void RandomContext(NATIVE_CONTEXT *Context)
+{
+	int r;
+
+	for (r = 0; r < 8; r++)
+		Context->Regs[r] = RandomValue();
+	Context->Rflags = 0x202 | (Random() & EMU_STATUS_FLAGS);
+	/* rdi addresses Memory[] for the [rdi] forms, at an offset that leaves room for 8 bytes */
+	Context->Regs[EMU_RDI] = (ULONG64)(Memory + 64 + Random() % 64);
+	for (r = 0; r < (int)sizeof(Memory); r += 8)
+		*(ULONG64 *)(Memory + r) = Random();
+	*(ULONG64 *)(Memory + 64 + Random() % 64) = RandomValue();
+}
+
+static void CheckAlu8()
+{
+	NATIVE_CONTEXT Context;
+	UCHAR Bytes[4];
+	ULONG32 Op, a, b, Cf, Form;
+	ULONG64 Defined;
+
+	memset(&Context, 0, sizeof(Context));
+	Context.Regs[EMU_RDI] = (ULONG64)(Memory + 64);
+
+	for (Op = 0; Op < 9; Op++)
+	{
+		/* AF is undefined after the logical operations */
+		Defined = Op == EMU_ALU_OR || Op == EMU_ALU_AND || Op == EMU_ALU_XOR || Op == 8
+			? EMU_STATUS_FLAGS & ~EMU_AF : EMU_STATUS_FLAGS;
+		for (Form = 0; Form < 2; Form++)
+		{
+			/* op [rdi], cl  and  op cl, [rdi]; op 8 is TEST [rdi], cl */
+			Bytes[0] = Op == 8 ? 0x84 : (UCHAR)(Op << 3 | Form << 1);
+			Bytes[1] = 0x0f;
+			if (Op == 8 && Form)
+				break;
+			for (a = 0; a < 256; a++)
+				for (b = 0; b < 256; b++)
+					for (Cf = 0; Cf < 2; Cf++)
+					{
+						Memory[64] = (UCHAR)a;
+						Context.Regs[EMU_RCX] = b;
+						Context.Rflags = 0x202 | Cf;
+						Check(Bytes, 2, &Context, Defined);
+					}
+		}
+	}
+
+	/* inc dec [rdi] (fe /0 /1), not neg [rdi] (f6 /2 /3) */
+	for (Op = 0; Op < 4; Op++)
+	{
+		Bytes[0] = Op < 2 ? 0xfe : 0xf6;
+		Bytes[1] = (UCHAR)((Op < 2 ? Op : Op) << 3 | 7);
+		for (a = 0; a < 256; a++)
+			for (Cf = 0; Cf < 2; Cf++)
+			{
+				Memory[64] = (UCHAR)a;
+				Context.Rflags = 0x202 | Cf | (a & 1 ? EMU_ZF | EMU_OF : 0);
+				Check(Bytes, 2, &Context, EMU_STATUS_FLAGS);
+			}
+	}
+}
+
+/*
+ * One random instruction of the subset: an opcode pattern, a random operand size prefix and a
+ * ModRM that is either [rdi] (+disp8) or a register other than rsp and rdi.
+ */
+static void CheckRandom(unsigned long Cases)
+{
+	static const struct
+	{
+		UCHAR Opcode[2];
+		UCHAR Length;	/* of the opcode */
+		UCHAR Digit;	/* ModRM.reg for the groups, 0xff when it is a register */
+		UCHAR Immediate;	/* 1, or 4 meaning the operand size capped at 4 */
+		UCHAR ByteOp;
+		UCHAR Logical;	/* AF undefined */
+		UCHAR RegSource;	/* MOVZX/MOVSX/MOVSXD: the r/m operand is narrower */
+	} Patterns[] = {
+		{ { 0x01 }, 1, 0xff, 0, 0, 0 }, { { 0x03 }, 1, 0xff, 0, 0, 0 }, { { 0x11 }, 1, 0xff, 0, 0, 0 },
+		{ { 0x19 }, 1, 0xff, 0, 0, 0 }, { { 0x21 }, 1, 0xff, 0, 0, 1 }, { { 0x2b }, 1, 0xff, 0, 0, 0 },
+		{ { 0x31 }, 1, 0xff, 0, 0, 1 }, { { 0x3b }, 1, 0xff, 0, 0, 0 }, { { 0x09 }, 1, 0xff, 0, 0, 1 },
+		{ { 0x02 }, 1, 0xff, 0, 1, 0 }, { { 0x18 }, 1, 0xff, 0, 1, 0 }, { { 0x30 }, 1, 0xff, 0, 1, 1 },
+		{ { 0x05 }, 1, 0xfe, 4, 0, 0 }, { { 0x2c }, 1, 0xfe, 1, 1, 0 }, { { 0xa9 }, 1, 0xfe, 4, 0, 1 },
+		{ { 0x80 }, 1, 0, 1, 1, 0 }, { { 0x80 }, 1, 3, 1, 1, 0 }, { { 0x80 }, 1, 6, 1, 1, 1 },
+		{ { 0x81 }, 1, 0, 4, 0, 0 }, { { 0x81 }, 1, 2, 4, 0, 0 }, { { 0x81 }, 1, 4, 4, 0, 1 },
+		{ { 0x81 }, 1, 7, 4, 0, 0 }, { { 0x83 }, 1, 5, 1, 0, 0 }, { { 0x83 }, 1, 1, 1, 0, 1 },
+		{ { 0x83 }, 1, 3, 1, 0, 0 }, { { 0x85 }, 1, 0xff, 0, 0, 1 }, { { 0x84 }, 1, 0xff, 0, 1, 1 },
+		{ { 0xf7 }, 1, 0, 4, 0, 1 }, { { 0xf6 }, 1, 0, 1, 1, 1 }, { { 0x87 }, 1, 0xff, 0, 0, 0 },
+		{ { 0x86 }, 1, 0xff, 0, 1, 0 }, { { 0x88 }, 1, 0xff, 0, 1, 0 }, { { 0x89 }, 1, 0xff, 0, 0, 0 },
+		{ { 0x8a }, 1, 0xff, 0, 1, 0 }, { { 0x8b }, 1, 0xff, 0, 0, 0 }, { { 0xc6 }, 1, 0, 1, 1, 0 },
+		{ { 0xc7 }, 1, 0, 4, 0, 0 }, { { 0xff }, 1, 0, 0, 0, 0 }, { { 0xff }, 1, 1, 0, 0, 0 },
+		{ { 0xfe }, 1, 1, 0, 1, 0 }, { { 0xf7 }, 1, 2, 0, 0, 0 }, { { 0xf7 }, 1, 3, 0, 0, 0 },
+		{ { 0xf6 }, 1, 3, 0, 1, 0 }, { { 0x0f, 0xb1 }, 2, 0xff, 0, 0, 0 }, { { 0x0f, 0xb0 }, 2, 0xff, 0, 1, 0 },
+		{ { 0x0f, 0xc1 }, 2, 0xff, 0, 0, 0 }, { { 0x0f, 0xc0 }, 2, 0xff, 0, 1, 0 },
+		{ { 0x0f, 0xb6 }, 2, 0xff, 0, 0, 0, 1 }, { { 0x0f, 0xb7 }, 2, 0xff, 0, 0, 0, 1 },
+		{ { 0x0f, 0xbe }, 2, 0xff, 0, 0, 0, 1 }, { { 0x0f, 0xbf }, 2, 0xff, 0, 0, 0, 1 },
+		{ { 0x63 }, 1, 0xff, 0, 0, 0, 1 },
+	};
+	NATIVE_CONTEXT Context;
+	UCHAR Bytes[16];
+	ULONG32 Length, i, Size, Reg, Rm, Immediate;
+	unsigned long n;
+
+	for (n = 0; n < Cases; n++)
+	{
+		i = Random() % (sizeof(Patterns) / sizeof(Patterns[0]));
+		RandomContext(&Context);
+		Length = 0;
+
+		/* 0x66, none or REX.W; byte forms may get a plain REX for spl..dil, or none for ah..bh */
+		Size = Patterns[i].ByteOp ? 1 : 2 << (Random() % 3);
+		if (Size == 2)
+			Bytes[Length++] = 0x66;
+		if (Size == 8)
+			Bytes[Length++] = 0x48;
+		if (Size == 1 && Random() % 2)
+			Bytes[Length++] = 0x40;
+		/* MOVSXD without REX.W is just a move, keep it to the real form */
+		if (Patterns[i].Opcode[0] == 0x63 && Size != 8)
+			Bytes[Length++] = 0x48;
+
+		memcpy(Bytes + Length, Patterns[i].Opcode, Patterns[i].Length);
+		Length += Patterns[i].Length;
+
+		if (Patterns[i].Digit != 0xfe)
+		{
+			/* any register but rsp and rdi, which addresses Memory[] */
+			do
+				Reg = Random() % 8;
+			while (Reg == EMU_RSP || Reg == EMU_RDI || (Size == 1 && !(Bytes[0] & 0x40) && Reg == 7));
+			if (Patterns[i].Digit != 0xff)
+				Reg = Patterns[i].Digit;
+
+			switch (Random() % 3)
+			{
+			case 0:
+				Bytes[Length++] = (UCHAR)(Reg << 3 | EMU_RDI);
+				break;
+			case 1:
+				Bytes[Length++] = (UCHAR)(0x40 | Reg << 3 | EMU_RDI);
+				Bytes[Length++] = (UCHAR)(Random() % 32 - 16);
+				break;
+			default:
+				do
+					Rm = Random() % 8;
+				while (Rm == EMU_RSP || Rm == EMU_RDI || (Size == 1 && !(Bytes[0] & 0x40) && Rm == 7));
+				Bytes[Length++] = (UCHAR)(0xc0 | Reg << 3 | Rm);
+				break;
+			}
+		}
+
+		Immediate = Patterns[i].Immediate == 4 ? (Size == 2 ? 2 : 4) : Patterns[i].Immediate;
+		while (Immediate--)
+			Bytes[Length++] = (UCHAR)Random();
+
+		Check(Bytes, Length, &Context, Patterns[i].Logical ? EMU_STATUS_FLAGS & ~EMU_AF : EMU_STATUS_FLAGS);
+	}
+}
+
+static void CheckStrings()
+{
+	static const UCHAR Ops[] = { 0xa4, 0xa5, 0xaa, 0xab, 0xac, 0xad };
+	NATIVE_CONTEXT Context;
+	UCHAR Bytes[4];
+	ULONG32 Length, o, Size, Count, Df, Rep;
+
+	for (o = 0; o < sizeof(Ops); o++)
+		for (Size = 1; Size <= 8; Size *= 2)
+		{
+			if (Size > 1 && !(Ops[o] & 1))
+				break;
+			for (Rep = 0; Rep < 2; Rep++)
+				for (Df = 0; Df < 2; Df++)
+					for (Count = 0; Count <= 40; Count += Rep ? 1 : 41)
+					{
+						RandomContext(&Context);
+						Length = 0;
+						if (Rep)
+							Bytes[Length++] = 0xf3;
+						if (Size == 2)
+							Bytes[Length++] = 0x66;
+						if (Size == 8)
+							Bytes[Length++] = 0x48;
+						Bytes[Length++] = Ops[o];
+
+						/* both pointers in the middle of Memory[], so either direction stays inside */
+						Context.Regs[EMU_RCX] = Count;
+						Context.Regs[EMU_RSI] = (ULONG64)(Memory + 640 + Random() % 8);
+						Context.Regs[EMU_RDI] = (ULONG64)(Memory + 1344 + Random() % 8);
+						if (Df)
+							Context.Rflags |= EMU_DF;
+						Check(Bytes, Length, &Context, EMU_STATUS_FLAGS | EMU_DF);
+					}
+		}
+}
+
+/* A port that counts up on reads and sums what it is written. */
+static ULONG32 PortCounter, PortSum, PortLastSize;
+
+static BOOLEAN NTAPI AccessPort(PVOID Context, USHORT Port, PULONG32 Value, ULONG32 Size, BOOLEAN Out)
+{
+	if (Port != 0x3f8)
+		return FALSE;
+	PortLastSize = Size;
+	if (Out)
+		PortSum += *Value & (ULONG32)EmuMask(Size);
+	else
+		*Value = PortCounter++ & (ULONG32)EmuMask(Size);
+	return TRUE;
+}
+
+static void Expect(int Ok, const char *What)
+{
+	Checked++;
+	if (!Ok)
+	{
+		Failed++;
+		fprintf(stderr, "emulatebench: %s\n", What);
+	}
+}
+
+static void CheckDecode()
+{
+	EMU_INSTRUCTION Instruction;
+	EMU_STATE State;
+	ULONG32 Status, i;
+	UCHAR *Low;
+
+	/* 32-bit linear addresses wrap at 4GB, so 32-bit code gets 128KB below it */
+	Low = mmap(NULL, 0x20000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (Low == MAP_FAILED)
+	{
+		perror("emulatebench: mmap");
+		Failed++;
+		return;
+	}
+
+	memset(&State, 0, sizeof(State));
+	State.AccessMemory = AccessMemory;
+	State.AccessPort = AccessPort;
+
+	/* 32-bit: mov eax, fs:[ebx+esi*4+0x10] */
+	State.Mode = EMU_MODE_32;
+	State.SegmentBase[EMU_FS] = (ULONG64)Low + 0x100;
+	State.Regs[EMU_RBX] = 0x8;
+	State.Regs[EMU_RSI] = 1;
+	State.Regs[EMU_RAX] = 0xffffffff12345678ULL;
+	memcpy(Low + 0x100 + 0x8 + 4 + 0x10, "\x11\x22\x33\x44", 4);
+	Status = EmuDecode((const UCHAR *)"\x64\x8b\x44\xb3\x10", 5, EMU_MODE_32, &Instruction);
+	Expect(Status == EMU_OK && Instruction.Length == 5 && Instruction.Segment == EMU_FS && Instruction.Base == EMU_RBX &&
+		Instruction.Index == EMU_RSI && Instruction.Scale == 4 && Instruction.Displacement == 0x10 &&
+		Instruction.ToRegister && Instruction.OperandSize == 4, "32-bit mov with SIB and segment decodes");
+	Expect(EmuExecute(&State, &Instruction) == EMU_OK && State.Regs[EMU_RAX] == 0x44332211,
+		"32-bit mov with SIB and segment runs");
+
+	/* 32-bit: ebp based defaults to SS, 16-bit: [bp+si] also */
+	Expect(EmuDecode((const UCHAR *)"\x89\x45\xfc", 3, EMU_MODE_32, &Instruction) == EMU_OK &&
+		Instruction.Segment == EMU_SS && Instruction.Displacement == (ULONG64)-4, "32-bit [ebp-4] is in SS");
+	Expect(EmuDecode((const UCHAR *)"\x89\x02", 2, EMU_MODE_16, &Instruction) == EMU_OK &&
+		Instruction.Base == EMU_RBP && Instruction.Index == EMU_RSI && Instruction.Segment == EMU_SS &&
+		Instruction.OperandSize == 2 && Instruction.AddressSize == 2, "16-bit mov [bp+si], ax");
+	Expect(EmuDecode((const UCHAR *)"\x67\x66\x89\x06\x34\x12", 6, EMU_MODE_32, &Instruction) == EMU_OK &&
+		Instruction.Length == 6 && Instruction.Base == EMU_NO_REGISTER && Instruction.Displacement == 0x1234 &&
+		Instruction.OperandSize == 2, "32-bit code with 16-bit addressing, mov [0x1234], ax");
+
+	/* 64-bit: RIP relative, REX.B, moffs */
+	Expect(EmuDecode((const UCHAR *)"\x48\x8b\x05\x10\x00\x00\x00", 7, EMU_MODE_64, &Instruction) == EMU_OK &&
+		Instruction.RipRelative && Instruction.Displacement == 0x10 && Instruction.OperandSize == 8,
+		"64-bit mov rax, [rip+0x10]");
+	Expect(EmuDecode((const UCHAR *)"\x41\x89\x04\x24", 4, EMU_MODE_64, &Instruction) == EMU_OK &&
+		Instruction.Base == 12 && Instruction.Index == EMU_NO_REGISTER, "64-bit mov [r12], eax");
+	Expect(EmuDecode((const UCHAR *)"\xa1\x88\x77\x66\x55\x44\x33\x22\x11", 9, EMU_MODE_64, &Instruction) == EMU_OK &&
+		Instruction.Length == 9 && Instruction.Displacement == 0x1122334455667788ULL, "64-bit mov eax, moffs64");
+
+	/* outside the subset, truncated, and LOCK on a register */
+	Expect(EmuDecode((const UCHAR *)"\x0f\xa2", 2, EMU_MODE_32, &Instruction) == EMU_UNSUPPORTED, "cpuid is not emulated");
+	Expect(EmuDecode((const UCHAR *)"\x8b\x44", 2, EMU_MODE_32, &Instruction) == EMU_UNSUPPORTED, "truncated ModRM/SIB");
+	Expect(EmuDecode((const UCHAR *)"\xf0\x01\xc8", 3, EMU_MODE_32, &Instruction) == EMU_UNSUPPORTED, "lock add eax, ecx");
+	Expect(EmuDecode((const UCHAR *)"\xff\x10", 2, EMU_MODE_32, &Instruction) == EMU_UNSUPPORTED, "call [eax]");
+
+	/* rep insb, 10 elements at most 4 per call */
+	State.MaxRepeat = 4;
+	State.Rip = 0x100;
+	State.Regs[EMU_RDX] = 0x3f8;
+	State.Regs[EMU_RCX] = 10;
+	State.Regs[EMU_RDI] = 0x20;
+	State.SegmentBase[EMU_ES] = (ULONG64)Low;
+	PortCounter = 1;
+	EmuDecode((const UCHAR *)"\xf3\x6c", 2, EMU_MODE_32, &Instruction);
+	for (i = 0; (Status = EmuExecute(&State, &Instruction)) == EMU_REPEAT; i++)
+		Expect(State.Rip == 0x100, "rep insb keeps RIP while it repeats");
+	Expect(Status == EMU_OK && i == 2 && State.Rip == 0x102 && State.Regs[EMU_RCX] == 0 && State.Regs[EMU_RDI] == 0x2a &&
+		Low[0x20] == 1 && Low[0x29] == 10 && Low[0x2a] == 0, "rep insb in three calls");
+
+	/* a16 rep outsw from si 0xfffe: 0xfffe, then si wraps to 0 and 2; cx counts, the upper halves stay */
+	PortSum = 0;
+	State.MaxRepeat = 0;
+	State.Regs[EMU_RCX] = 0x12340003;
+	State.Regs[EMU_RSI] = 0xabcdfffe;
+	State.SegmentBase[EMU_DS] = (ULONG64)Low;
+	memcpy(Low + 0xfffe, "\x05\x00", 2);
+	memcpy(Low, "\x06\x00\x07\x00", 4);
+	EmuDecode((const UCHAR *)"\x67\xf3\x66\x6f", 4, EMU_MODE_32, &Instruction);
+	Status = EmuExecute(&State, &Instruction);
+	Expect(Status == EMU_OK && PortSum == 5 + 6 + 7 && PortLastSize == 2 && State.Regs[EMU_RCX] == 0x12340000 &&
+		State.Regs[EMU_RSI] == 0xabcd0004, "a16 rep outsw wraps si and counts cx");
+
+	/* in al, dx keeps the rest of eax; out dx, eax and out imm8, al */
+	State.Regs[EMU_RAX] = 0xaabbccdd;
+	PortCounter = 0x42;
+	EmuDecode((const UCHAR *)"\xec", 1, EMU_MODE_32, &Instruction);
+	Expect(EmuExecute(&State, &Instruction) == EMU_OK && State.Regs[EMU_RAX] == 0xaabbcc42, "in al, dx");
+	PortSum = 0;
+	EmuDecode((const UCHAR *)"\xef", 1, EMU_MODE_32, &Instruction);
+	Expect(EmuExecute(&State, &Instruction) == EMU_OK && PortSum == 0xaabbcc42 && PortLastSize == 4, "out dx, eax");
+	Expect(EmuDecode((const UCHAR *)"\xe6\x80", 2, EMU_MODE_32, &Instruction) == EMU_OK && Instruction.HasImmediate &&
+		Instruction.Immediate == 0x80 && Instruction.Length == 2, "out 0x80, al");
+	State.Rip = 0x200;
+	Expect(EmuExecute(&State, &Instruction) == EMU_ACCESS_FAILED && State.Rip == 0x200, "a failed port leaves RIP");
+
+	munmap(Low, 0x20000);
+}
+
+/*
+ * Run <Bytes> with every write to <Fail> failing: the registers, flags, RIP and Memory[] must be as
+ * before, but for a string instruction's RCX RSI RDI, which <Counters> gives.
+ */
+static void ExpectFailure(const char *Bytes, ULONG32 Length, const EMU_STATE *Start, ULONG64 Fail,
+	const ULONG64 *Counters, const char *What)
+{
+	static UCHAR Initial[sizeof(Memory)];
+	EMU_INSTRUCTION Instruction;
+	EMU_STATE State = *Start;
+	ULONG64 Expected[16];
+	int r, Ok;
+
+	memcpy(Initial, Memory, sizeof(Memory));
+	memcpy(Expected, Start->Regs, sizeof(Expected));
+	if (Counters)
+	{
+		Expected[EMU_RCX] = Counters[0];
+		Expected[EMU_RSI] = Counters[1];
+		Expected[EMU_RDI] = Counters[2];
+	}
+
+	FailAddress = Fail;
+	Ok = EmuDecode((const UCHAR *)Bytes, Length, Start->Mode, &Instruction) == EMU_OK &&
+		EmuExecute(&State, &Instruction) == EMU_ACCESS_FAILED;
+	FailAddress = 0;
+
+	for (r = 0; r < 16; r++)
+		if (State.Regs[r] != Expected[r])
+			Ok = 0;
+	Ok = Ok && State.Rflags == Start->Rflags && State.Rip == Start->Rip;
+	/* a REP keeps what it stored before the failing element */
+	if (!Counters)
+		Ok = Ok && !memcmp(Memory, Initial, sizeof(Memory));
+	Expect(Ok, What);
+}
+
+static void CheckFailures()
+{
+	EMU_STATE State;
+	ULONG64 Counters[3];
+	UCHAR *Target = Memory + 256;
+
+	memset(&State, 0, sizeof(State));
+	State.Mode = EMU_MODE_64;
+	State.AccessMemory = AccessMemory;
+	State.CompareExchange = CompareExchange;
+	State.Rip = 0x10000;
+	State.Rflags = 0x202 | EMU_CF | EMU_ZF;
+	State.Regs[EMU_RAX] = 0x1111;
+	State.Regs[EMU_RCX] = 0x2222;
+	State.Regs[EMU_RDI] = (ULONG64)Target;
+	memset(Target, 0x5a, 64);
+
+	/* the register half of XADD and the flags of the ALU forms are dropped with the store */
+	ExpectFailure("\x0f\xc1\x0f", 3, &State, (ULONG64)Target, NULL, "xadd [rdi], ecx failing keeps ecx");
+	ExpectFailure("\x11\x0f", 2, &State, (ULONG64)Target, NULL, "adc [rdi], ecx failing keeps the flags");
+	ExpectFailure("\xff\x07", 2, &State, (ULONG64)Target, NULL, "inc dword [rdi] failing keeps the flags");
+	ExpectFailure("\xf7\x1f", 2, &State, (ULONG64)Target + 3, NULL, "neg dword [rdi] failing at its last byte");
+	ExpectFailure("\x0f\xb1\x0f", 3, &State, (ULONG64)Target, NULL, "cmpxchg [rdi], ecx failing keeps eax");
+	ExpectFailure("\x87\x0f", 2, &State, (ULONG64)Target, NULL, "xchg [rdi], ecx failing keeps ecx");
+	ExpectFailure("\xf0\x0f\xc1\x0f", 4, &State, (ULONG64)Target, NULL, "lock xadd [rdi], ecx failing keeps ecx");
+
+	/* rep stosb over 16 bytes failing at the 6th: 5 stored, rcx and rdi count them, rax stays */
+	State.Regs[EMU_RCX] = 16;
+	Counters[0] = 11;
+	Counters[1] = 0;
+	Counters[2] = (ULONG64)Target + 5;
+	ExpectFailure("\xf3\xaa", 2, &State, (ULONG64)Target + 5, Counters, "rep stosb failing part way");
+	Expect(Target[4] == 0x11 && Target[5] == 0x5a, "rep stosb stored the elements before the failure");
+
+	/* rep lodsd does not write, but a rep movsd failing on its 2nd store keeps one element */
+	memset(Target, 0x5a, 64);
+	State.Regs[EMU_RCX] = 4;
+	State.Regs[EMU_RSI] = (ULONG64)Target + 32;
+	Counters[0] = 3;
+	Counters[1] = (ULONG64)Target + 36;
+	Counters[2] = (ULONG64)Target + 4;
+	ExpectFailure("\xf3\xa5", 2, &State, (ULONG64)Target + 6, Counters, "rep movsd failing part way");
+}
+
+#define LOCKED_ROUNDS	1000000
+
+static ULONG32 LockedCounter __attribute__ ((aligned (64)));
+static volatile int LockedGo;
+
+/* The other processor: plain LOCK ADDs on the counter the emulator increments. */
+static void *LockedNative(void *Unused)
+{
+	int i;
+
+	while (!LockedGo)
+		;
+	for (i = 0; i < LOCKED_ROUNDS; i++)
+		__sync_fetch_and_add(&LockedCounter, 1);
+	return NULL;
+}
+
+static void CheckLocked()
+{
+	static const struct
+	{
+		const char *Bytes;
+		ULONG32 Length;
+		ULONG64 Defined;
+	} Forms[] = {
+		{ "\xf0\x01\x0f", 3, EMU_STATUS_FLAGS }, { "\xf0\x48\x11\x0f", 4, EMU_STATUS_FLAGS },
+		{ "\xf0\x66\x19\x0f", 4, EMU_STATUS_FLAGS }, { "\xf0\x21\x0f", 3, EMU_STATUS_FLAGS & ~EMU_AF },
+		{ "\xf0\x08\x2f", 3, EMU_STATUS_FLAGS & ~EMU_AF }, { "\xf0\x48\x29\x0f", 4, EMU_STATUS_FLAGS },
+		{ "\xf0\x31\x0f", 3, EMU_STATUS_FLAGS & ~EMU_AF }, { "\xf0\x80\x07\x7f", 4, EMU_STATUS_FLAGS },
+		{ "\xf0\x48\x83\x2f\x01", 5, EMU_STATUS_FLAGS }, { "\xf0\xff\x07", 3, EMU_STATUS_FLAGS },
+		{ "\xf0\x66\xff\x0f", 4, EMU_STATUS_FLAGS }, { "\xf0\xf6\x17", 3, 0 },
+		{ "\xf0\x48\xf7\x1f", 4, EMU_STATUS_FLAGS }, { "\xf0\x0f\xc1\x0f", 4, EMU_STATUS_FLAGS },
+		{ "\xf0\x0f\xc0\x2f", 4, EMU_STATUS_FLAGS }, { "\xf0\x48\x0f\xb1\x0f", 5, EMU_STATUS_FLAGS },
+		{ "\xf0\x66\x0f\xb1\x0f", 5, EMU_STATUS_FLAGS }, { "\x86\x2f", 2, 0 }, { "\x48\x87\x0f", 3, 0 },
+	};
+	NATIVE_CONTEXT Context;
+	EMU_INSTRUCTION Instruction;
+	EMU_STATE State;
+	pthread_t Thread;
+	ULONG32 f, n, Status = EMU_OK;
+	int i;
+
+	for (f = 0; f < sizeof(Forms) / sizeof(Forms[0]); f++)
+		for (n = 0; n < 2000; n++)
+		{
+			RandomContext(&Context);
+			/* cmpxchg succeeds half the time */
+			if (n & 1)
+				Context.Regs[EMU_RAX] = *(ULONG64 *)Context.Regs[EMU_RDI];
+			Check((const UCHAR *)Forms[f].Bytes, Forms[f].Length, &Context, Forms[f].Defined);
+		}
+
+	/* not read-modify-writes of memory, or not locked without the callback */
+	Expect(EmuDecode((const UCHAR *)"\xf0\x8b\x07", 3, EMU_MODE_64, &Instruction) == EMU_UNSUPPORTED, "lock mov");
+	Expect(EmuDecode((const UCHAR *)"\xf0\x39\x07", 3, EMU_MODE_64, &Instruction) == EMU_UNSUPPORTED, "lock cmp");
+	Expect(EmuDecode((const UCHAR *)"\xf0\x03\x07", 3, EMU_MODE_64, &Instruction) == EMU_UNSUPPORTED,
+		"lock add to a register");
+	memset(&State, 0, sizeof(State));
+	State.Mode = EMU_MODE_64;
+	State.AccessMemory = AccessMemory;
+	State.Regs[EMU_RDI] = (ULONG64)Memory;
+	Expect(EmuDecode((const UCHAR *)"\x87\x07", 2, EMU_MODE_64, &Instruction) == EMU_OK && Instruction.Lock &&
+		EmuExecute(&State, &Instruction) == EMU_UNSUPPORTED, "xchg [rdi], eax without CompareExchange");
+
+	/* lock inc dword [rdi] emulated here, lock add natively on another thread: no increment is lost */
+	State.CompareExchange = CompareExchange;
+	State.Regs[EMU_RDI] = (ULONG64)&LockedCounter;
+	LockedCounter = 0;
+	LockedGo = 0;
+	EmuDecode((const UCHAR *)"\xf0\xff\x07", 3, EMU_MODE_64, &Instruction);
+	if (pthread_create(&Thread, NULL, LockedNative, NULL))
+	{
+		perror("emulatebench: pthread_create");
+		Failed++;
+		return;
+	}
+	LockedGo = 1;
+	for (i = 0; i < LOCKED_ROUNDS && Status == EMU_OK; i++)
+		Status = EmuExecute(&State, &Instruction);
+	pthread_join(Thread, NULL);
+	Expect(Status == EMU_OK && LockedCounter == 2 * LOCKED_ROUNDS, "lock inc races lock add");
+}
+
+/* A short run of trapping-looking instructions, executed over and over through EmuStep(). */
+static void Bench()
+{
+	static const UCHAR Program[] = {
+		0x89, 0x07,			/* mov [rdi], eax */
+		0x8b, 0x4f, 0x04,		/* mov ecx, [rdi+4] */
+		0x48, 0x01, 0x47, 0x08,		/* add [rdi+8], rax */
+		0x0f, 0xb6, 0x57, 0x02,		/* movzx edx, byte [rdi+2] */
+		0xf0, 0x0f, 0xb1, 0x0f,		/* lock cmpxchg [rdi], ecx */
+		0x83, 0x67, 0x10, 0xf0,		/* and dword [rdi+16], -16 */
+		0x66, 0xff, 0x47, 0x14,		/* inc word [rdi+20] */
+		0x48, 0x87, 0x5f, 0x18,		/* xchg [rdi+24], rbx */
+	};
+	static EMU_CACHE Cache;
+	EMU_STATE State;
+	ULONG64 Start;
+	double Time[2];
+	int Rounds = 200000, r, c;
+	ULONG32 Steps = 0;
+
+	for (c = 0; c < 2; c++)
+	{
+		Time[c] = Now();
+		for (r = 0; r < Rounds; r++)
+		{
+			memset(&State, 0, sizeof(State));
+			State.Mode = EMU_MODE_64;
+			State.AccessMemory = AccessMemory;
+			State.CompareExchange = CompareExchange;
+			State.Regs[EMU_RDI] = (ULONG64)Memory;
+			State.Regs[EMU_RAX] = r;
+			State.Rip = (ULONG64)Program;
+			Start = State.Rip;
+			while (State.Rip < Start + sizeof(Program))
+			{
+				if (EmuStep(&State, c ? &Cache : NULL) != EMU_OK)
+				{
+					fprintf(stderr, "emulatebench: EmuStep failed at +%llu\n", State.Rip - Start);
+					Failed++;
+					return;
+				}
+				Steps++;
+			}
+		}
+		Time[c] = Now() - Time[c];
+	}
+	Sink = Steps + Memory[0];
+
+	Steps /= 2;
+	printf("%-14s %7.1f ns/instruction\n", "step", Time[0] * 1e9 / Steps);
+	printf("%-14s %7.1f ns/instruction  %u hits %u misses\n", "step/cached", Time[1] * 1e9 / Steps,
+		Cache.Hits, Cache.Misses);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long Cases = 500000;
+	double Start;
+	int r;
+
+	for (r = 1; r + 1 < argc; r += 2)
+	{
+		if (!strcmp(argv[r], "-n"))
+			Cases = strtoul(argv[r + 1], NULL, 0);
+		else if (!strcmp(argv[r], "-s"))
+			Seed = strtoull(argv[r + 1], NULL, 0) | 1;
+	}
+	if (r < argc)
+	{
+		fprintf(stderr, "usage: emulatebench [-n random cases] [-s seed]\n");
+		return 2;
+	}
+
+	CodeSize = 4096;
+	Code = mmap(NULL, CodeSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Code == MAP_FAILED)
+	{
+		perror("emulatebench: mmap");
+		return 1;
+	}
+
+	Start = Now();
+	CheckAlu8();
+	printf("%-14s %9lu checked %6.2f s\n", "alu8", Checked, Now() - Start);
+	Start = Now();
+	r = Checked;
+	CheckRandom(Cases);
+	printf("%-14s %9lu checked %6.2f s\n", "random", Checked - r, Now() - Start);
+	r = Checked;
+	CheckStrings();
+	printf("%-14s %9lu checked\n", "string", Checked - r);
+	r = Checked;
+	CheckDecode();
+	printf("%-14s %9lu checked\n", "decode", Checked - r);
+	r = Checked;
+	CheckFailures();
+	printf("%-14s %9lu checked\n", "failure", Checked - r);
+	r = Checked;
+	CheckLocked();
+	printf("%-14s %9lu checked\n", "locked", Checked - r);
+	if (Failed)
+	{
+		printf("%lu of %lu checks FAILED\n", Failed, Checked);
+		return 1;
+	}
+
+	Bench();
+	munmap(Code, CodeSize);
+	return Failed ? 1 : 0;
+}
@@ -0,0 +1,322 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * hostpagingbench - check the amd64 host page tables that Memory/HostPaging.c
+ * builds, on simulated physical memory, then time the sync every VM exit
+ * does, in user mode on x86-64.
+ *
+ * Usage: hostpagingbench [-n random lookups] [-s seed]
+ *
+ * Table pages come from a pool at a made-up physical address, and a software
+ * page walker translates host virtual addresses through them. The checks are:
+ *
+ *	build		the direct map translates every physical address below its
+ *			size to itself, with 1GB and with 2MB pages, and nothing
+ *			above; the rest of the PML4 equals the guest's
+ *	slot		the highest free kernel slot is taken and marked in the
+ *			guest's PML4; no free slot and running out of pages both
+ *			fail and leave the guest's PML4 as it was
+ *	sync		kernel entries the guest adds later reach the host, user
+ *			ones, the reserved slot and present host entries do not
+ *	release		the marker goes away again, unless the guest replaced it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "HostPaging.c"
+
+#define POOL_PAGES		1024
+#define POOL_BASE		0x7f0000000000ULL	//Physical address of the first pool page
+
+typedef struct _SIM_PAGE
+{
+	ULONG64 Entries[HOSTPG_ENTRIES];
+} SIM_PAGE;
+
+static unsigned long long Seed = 88172645463325252ULL;
+static unsigned long Checked, Failed;
+static SIM_PAGE Pool[POOL_PAGES] __attribute__((aligned(4096)));
+static unsigned long PoolUsed, PoolLimit = POOL_PAGES;
+static ULONG64 Guest[HOSTPG_ENTRIES];
+
+/* Results go here so the compiler can't drop the work being timed. */
+static volatile ULONG64 Sink;
+
+static double Now()
+{
+	struct timespec Ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static ULONG64 Random()
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static void Expect(int Ok, const char *What)
+{
+	Checked++;
+	if (!Ok)
+	{
+		Failed++;
+		fprintf(stderr, "hostpagingbench: %s\n", What);
+	}
+}
+
+static PVOID NTAPI SimAllocatePage(PULONG64 PhysicalAddress)
+{
+	if (PoolUsed >= PoolLimit)
+		return NULL;
+	memset(&Pool[PoolUsed], 0, sizeof(Pool[PoolUsed]));
+	*PhysicalAddress = POOL_BASE + PoolUsed * sizeof(SIM_PAGE);
+	return &Pool[PoolUsed++];
+}
+
+static PULONG64 SimPage(ULONG64 Entry)
+{
+	ULONG64 PhysicalAddress = Entry & HOSTPG_PFN_MASK;
+
+	if (PhysicalAddress < POOL_BASE || PhysicalAddress >= POOL_BASE + PoolUsed * sizeof(SIM_PAGE))
+		return NULL;
+	return Pool[(PhysicalAddress - POOL_BASE) / sizeof(SIM_PAGE)].Entries;
+}
+
+/* Walk <Pml4> like the processor does. Returns 0 if <Va> is not mapped or not canonical. */
+static int Translate(PULONG64 Pml4, ULONG64 Va, ULONG64 *Pa)
+{
+	PULONG64 Pdpt, Pd;
+	ULONG64 Entry;
+
+	if ((ULONG64) ((long long) (Va << 16) >> 16) != Va)
+		return 0;
+	Entry = Pml4[(Va >> 39) & 511];
+	if (!(Entry & HOSTPG_PRESENT) || !(Pdpt = SimPage(Entry)))
+		return 0;
+	Entry = Pdpt[(Va >> 30) & 511];
+	if (!(Entry & HOSTPG_PRESENT))
+		return 0;
+	if (Entry & HOSTPG_LARGE)
+	{
+		*Pa = (Entry & HOSTPG_PFN_MASK & ~(HOSTPG_PAGE_1GB - 1)) | (Va & (HOSTPG_PAGE_1GB - 1));
+		return 1;
+	}
+	if (!(Pd = SimPage(Entry)))
+		return 0;
+	Entry = Pd[(Va >> 21) & 511];
+	if (!(Entry & HOSTPG_PRESENT) || !(Entry & HOSTPG_LARGE))
+		return 0;
+	*Pa = (Entry & HOSTPG_PFN_MASK & ~(HOSTPG_PAGE_2MB - 1)) | (Va & (HOSTPG_PAGE_2MB - 1));
+	return 1;
+}
+
+/* A guest PML4 with the user slots below <Users> and the kernel slots in <Kernel> present. */
+static void FillGuest(ULONG32 Users, const ULONG32 *Kernel, ULONG32 Count)
+{
+	ULONG32 i;
+
+	memset(Guest, 0, sizeof(Guest));
+	for (i = 0; i < Users; i++)
+		Guest[i] = 0x100000000ULL + i * 0x1000 + 0x67;
+	for (i = 0; i < Count; i++)
+		Guest[Kernel[i]] = 0x200000000ULL + Kernel[i] * 0x1000 + 0x63;
+}
+
+static void CheckBuild(unsigned long Lookups)
+{
+	static const ULONG32 Kernel[] = { 256, 300, 493, 494, 509, 511 };
+	static const ULONG64 Sizes[] = { 4, 64, 512 };
+	ULONG64 Saved[HOSTPG_ENTRIES], Size, Pa, Va;
+	HOSTPG_TABLES Tables;
+	ULONG32 s, Large, i, Result;
+	unsigned long l;
+	int SameRest;
+
+	for (Large = 0; Large < 2; Large++)
+	{
+		for (s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++)
+		{
+			Size = Sizes[s] * HOSTPG_PAGE_1GB;
+			FillGuest(16, Kernel, sizeof(Kernel) / sizeof(Kernel[0]));
+			memcpy(Saved, Guest, sizeof(Saved));
+			memset(&Tables, 0, sizeof(Tables));
+			PoolUsed = 0;
+			Result = HpBuild(&Tables, Guest, Size, (BOOLEAN) Large, SimAllocatePage);
+			Expect(Result == HOSTPG_OK, "build failed");
+			if (Result != HOSTPG_OK)
+				continue;
+
+			Expect(Tables.Slot == 510, "not the highest free kernel slot");
+			Expect(Guest[510] == HOSTPG_SLOT_MARKER && !(Guest[510] & HOSTPG_PRESENT), "slot not marked in the guest");
+			Expect(Tables.PhysicalMapBase == 0xffffff0000000000ULL, "map base");
+			Expect(Tables.PhysicalMapSize == Size, "map size");
+			Expect(PoolUsed == (Large ? 2 : 2 + Sizes[s]), "table pages used");
+			SameRest = 1;
+			for (i = 0; i < HOSTPG_ENTRIES; i++)
+				if (i != 510 && Tables.Pml4[i] != Saved[i])
+					SameRest = 0;
+			Expect(SameRest, "host PML4 differs from the guest's outside the slot");
+			Expect(SimPage(Tables.Pml4PA) == Tables.Pml4, "PML4 physical address");
+
+			for (l = 0; l < Lookups; l++)
+			{
+				Pa = l < 4 ? (ULONG64[]) { 0, Size - 1, HOSTPG_PAGE_2MB, HOSTPG_PAGE_1GB }[l] : Random() % Size;
+				Expect(Translate(Tables.Pml4, Tables.PhysicalMapBase + Pa, &Va) && Va == Pa, "direct map translation");
+			}
+			Expect(!Translate(Tables.Pml4, Tables.PhysicalMapBase + Size, &Va) || Size == 512 * HOSTPG_PAGE_1GB,
+				"direct map goes past its size");
+		}
+	}
+}
+
+static void CheckSlot()
+{
+	static const ULONG32 Kernel[] = { 256, 511 };
+	ULONG64 Saved[HOSTPG_ENTRIES];
+	HOSTPG_TABLES Tables;
+	ULONG32 i;
+
+	//Every kernel slot taken
+	memset(Guest, 0, sizeof(Guest));
+	for (i = HOSTPG_KERNEL_SLOT; i < HOSTPG_ENTRIES; i++)
+		Guest[i] = 0x300000000ULL + i * 0x1000 + 0x63;
+	memcpy(Saved, Guest, sizeof(Saved));
+	memset(&Tables, 0, sizeof(Tables));
+	PoolUsed = 0;
+	Expect(HpBuild(&Tables, Guest, 4 * HOSTPG_PAGE_1GB, TRUE, SimAllocatePage) == HOSTPG_NO_SLOT, "no free slot");
+	Expect(!memcmp(Saved, Guest, sizeof(Saved)) && !Tables.Pml4, "failed build changed something");
+
+	//A user slot is never taken
+	memset(Guest, 0, sizeof(Guest));
+	for (i = HOSTPG_KERNEL_SLOT; i < HOSTPG_ENTRIES; i++)
+		Guest[i] = 0x63;
+	Guest[100] = Guest[255] = 0;
+	Expect(HpBuild(&Tables, Guest, 4 * HOSTPG_PAGE_1GB, TRUE, SimAllocatePage) == HOSTPG_NO_SLOT, "user slot taken");
+
+	//Out of pages halfway through the 2MB tables
+	FillGuest(4, Kernel, 2);
+	memcpy(Saved, Guest, sizeof(Saved));
+	memset(&Tables, 0, sizeof(Tables));
+	PoolUsed = 0;
+	PoolLimit = 5;
+	Expect(HpBuild(&Tables, Guest, 16 * HOSTPG_PAGE_1GB, FALSE, SimAllocatePage) == HOSTPG_NO_MEMORY, "out of pages");
+	Expect(!memcmp(Saved, Guest, sizeof(Saved)) && !Tables.Pml4, "slot kept after running out of pages");
+	PoolLimit = POOL_PAGES;
+}
+
+static void CheckSync(unsigned long Rounds)
+{
+	static const ULONG32 Kernel[] = { 256, 400 };
+	HOSTPG_TABLES Tables;
+	ULONG64 Present, Entry;
+	ULONG32 Slot, i, Added;
+	unsigned long r;
+
+	FillGuest(8, Kernel, 2);
+	memset(&Tables, 0, sizeof(Tables));
+	PoolUsed = 0;
+	Expect(HpBuild(&Tables, Guest, 4 * HOSTPG_PAGE_1GB, TRUE, SimAllocatePage) == HOSTPG_OK, "build for sync");
+	Slot = Tables.Slot;
+	Expect(Slot == 511, "sync slot");
+	Expect(HpSyncKernelHalf(&Tables) == 0, "sync with nothing new");
+
+	for (r = 0; r < Rounds; r++)
+	{
+		i = HOSTPG_KERNEL_SLOT + Random() % (HOSTPG_ENTRIES - HOSTPG_KERNEL_SLOT - 1);
+		Entry = (Random() & 0x000ffffffff000ULL) | 0x63;
+		Present = Tables.Pml4[i] & HOSTPG_PRESENT;
+		Guest[i] = Entry;
+		Added = HpSyncKernelHalf(&Tables);
+		if (Present)
+			Expect(Added == 0 && Tables.Pml4[i] != Entry, "present host entry replaced");
+		else
+			Expect(Added == 1 && Tables.Pml4[i] == Entry, "new kernel entry not copied");
+	}
+
+	Guest[20] = 0x12345067;
+	Guest[Slot] = 0x5000063;
+	Expect(HpSyncKernelHalf(&Tables) == 0, "user or slot entry copied");
+	Expect(Tables.Pml4[20] == 0 && SimPage(Tables.Pml4[Slot]), "host slot or user half changed");
+
+	//The guest took the slot over: release leaves its entry alone
+	HpRelease(&Tables);
+	Expect(Guest[Slot] == 0x5000063, "release cleared a guest entry");
+	Expect(HpSyncKernelHalf(&Tables) == 0, "sync after release");
+
+	FillGuest(8, Kernel, 2);
+	memset(&Tables, 0, sizeof(Tables));
+	PoolUsed = 0;
+	HpBuild(&Tables, Guest, 4 * HOSTPG_PAGE_1GB, TRUE, SimAllocatePage);
+	HpRelease(&Tables);
+	Expect(Guest[511] == 0, "release kept the marker");
+}
+
+static void Bench()
+{
+	static const ULONG32 Kernel[] = { 256, 300, 400, 493, 494, 509 };
+	HOSTPG_TABLES Tables;
+	unsigned long Rounds = 2000000, r;
+	double Start, Time[2];
+	ULONG32 i;
+
+	FillGuest(16, Kernel, sizeof(Kernel) / sizeof(Kernel[0]));
+	memset(&Tables, 0, sizeof(Tables));
+	PoolUsed = 0;
+	Start = Now();
+	HpBuild(&Tables, Guest, 512 * HOSTPG_PAGE_1GB, FALSE, SimAllocatePage);
+	Time[0] = Now() - Start;
+
+	Start = Now();
+	for (r = 0; r < Rounds; r++)
+		Sink += HpSyncKernelHalf(&Tables);
+	Time[1] = Now() - Start;
+	for (i = 0; i < 4; i++)
+		Sink += Tables.Pml4[i];
+
+	printf("%-14s %7.1f us for 512GB with 2MB pages\n", "build", Time[0] * 1e6);
+	printf("%-14s %7.1f ns/exit   kernel half, nothing new\n", "sync", Time[1] * 1e9 / Rounds);
+	HpRelease(&Tables);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long Lookups = 100000, r;
+	int a;
+
+	for (a = 1; a + 1 < argc; a += 2)
+	{
+		if (!strcmp(argv[a], "-n"))
+			Lookups = strtoul(argv[a + 1], NULL, 0);
+		else if (!strcmp(argv[a], "-s"))
+			Seed = strtoull(argv[a + 1], NULL, 0) | 1;
+	}
+	if (a < argc)
+	{
+		fprintf(stderr, "usage: hostpagingbench [-n random lookups] [-s seed]\n");
+		return 2;
+	}
+
+	r = Checked;
+	CheckBuild(Lookups);
+	printf("%-14s %9lu checked\n", "build", Checked - r);
+	r = Checked;
+	CheckSlot();
+	printf("%-14s %9lu checked\n", "slot", Checked - r);
+	r = Checked;
+	CheckSync(Lookups / 10);
+	printf("%-14s %9lu checked\n", "sync", Checked - r);
+	if (Failed)
+	{
+		printf("%lu of %lu checks FAILED\n", Failed, Checked);
+		return 1;
+	}
+
+	Bench();
+	return 0;
+}
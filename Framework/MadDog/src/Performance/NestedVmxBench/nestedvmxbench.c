@@ -0,0 +1,939 @@
+/* Copyright (C) 2010 Trusted Computing Lab in Shanghai Jiaotong University
+ *
+ * nestedvmxbench - check the vmcs12 handling of common/nestedvmx.c on
+ * simulated VMCSs, then count and time what a nested exit costs, in user
+ * mode on x86-64.
+ *
+ * Usage: nestedvmxbench [-n random cases] [-s seed]
+ *
+ * A simulated VMCS is an array indexed by field encoding that counts its
+ * VMREADs and VMWRITEs. The checks are:
+ *
+ *	access		emulated VMREAD/VMWRITE against a plain model: widths,
+ *			high halves, read-only and unsupported encodings
+ *	merge		dirty-only merges into one vmcs02 end up equal to a full
+ *			merge into a fresh one, and vmcs02 has vmcs12's guest
+ *			state, L0's host state and controls L0's processor takes;
+ *			entry checks catch host state vmcs01 could not load
+ *	exit		guest state and exit information come back into vmcs12,
+ *			the guest hypervisor's host state goes into vmcs01
+ *	shadow		VMREAD/VMWRITE bitmaps, and fields written in the shadow
+ *			VMCS reach vmcs02 at the next entry
+ *	routing		with random controls and bitmaps at both levels, vmcs02
+ *			exits wherever vmcs12 or vmcs01 does, and exactly the exits
+ *			vmcs12 asks for go to the guest hypervisor
+ *
+ * It then replays the VMCS accesses of a typical guest hypervisor exit
+ * handler to count the exits of one nested exit with and without VMCS
+ * shadowing, and times the merges.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nestedvmx.c"
+
+typedef struct _SIM_VMCS
+{
+	ULONG64 Values[0x8000];
+	unsigned long Reads;
+	unsigned long Writes;
+} SIM_VMCS;
+
+//Capabilities of a recent processor, allowed 0-settings low, allowed 1-settings high
+#define SIM_PIN_CAPS		0x0000007F00000016ULL
+#define SIM_PROC_CAPS		0xFFF9FFFE04006172ULL
+#define SIM_PROC2_CAPS		0x0017FFFF00000000ULL
+#define SIM_EXIT_CAPS		0x007FFFFF00036DFFULL
+#define SIM_ENTRY_CAPS		0x0000FFFF000011FFULL
+#define SIM_MISC			0x20000000ULL
+
+/* Simulated physical pages for the bitmaps, the last three hold the merged ones of vmcs02 */
+#define SIM_PAGES			16
+#define SIM_PAGE_BASE		0x100000ULL
+#define SIM_UNREACHABLE		0x7FFFF000ULL
+
+static unsigned long long Seed = 88172645463325252ULL;
+static unsigned long Checked, Failed;
+static UCHAR Kinds[0x8000];	/* Flags of each full encoding, 0 if not in the table */
+static SIM_VMCS Vmcs01, Vmcs02, Fresh, Shadow;
+static NVMX_STATE State;
+static NVMX_HOST Host;
+static UCHAR Pages[SIM_PAGES][4096];
+
+/* Results go here so the compiler can't drop the work being timed. */
+static volatile ULONG64 Sink;
+
+static double Now()
+{
+	struct timespec Ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static ULONG64 Random()
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static void Expect(int Ok, const char *What)
+{
+	Checked++;
+	if (!Ok)
+	{
+		Failed++;
+		fprintf(stderr, "nestedvmxbench: %s\n", What);
+	}
+}
+
+static ULONG64 NTAPI SimRead(PVOID Context, ULONG32 Encoding)
+{
+	SIM_VMCS *Vmcs = Context;
+
+	Vmcs->Reads++;
+	return Vmcs->Values[Encoding & 0x7FFF];
+}
+
+static VOID NTAPI SimWrite(PVOID Context, ULONG32 Encoding, ULONG64 Value)
+{
+	SIM_VMCS *Vmcs = Context;
+
+	Vmcs->Writes++;
+	Vmcs->Values[Encoding & 0x7FFF] = Value;
+}
+
+static PUCHAR NTAPI SimMap(PVOID Context, ULONG64 Address)
+{
+	if (Address < SIM_PAGE_BASE || Address >= SIM_PAGE_BASE + SIM_PAGES * 4096)
+		return NULL;
+	return (PUCHAR)Pages + (Address - SIM_PAGE_BASE);
+}
+
+/* A bitmap page of either level, now and then one the host cannot reach */
+static ULONG64 RandomPage()
+{
+	if (Random() % 16 == 0)
+		return SIM_UNREACHABLE;
+	return SIM_PAGE_BASE + Random() % (SIM_PAGES - 3) * 4096;
+}
+
+static ULONG32 Width(ULONG32 Encoding)
+{
+	return (Encoding >> 13) & 3;
+}
+
+static ULONG64 Truncate(ULONG32 Encoding, ULONG64 Value)
+{
+	if (Width(Encoding) == 0)
+		return Value & 0xFFFF;
+	if (Width(Encoding) == 2)
+		return Value & 0xFFFFFFFF;
+	return Value;
+}
+
+static ULONG32 RandomField()
+{
+	ULONG32 Encoding;
+
+	do
+		Encoding = Random() & 0x7FFE;
+	while (!Kinds[Encoding]);
+	return Encoding;
+}
+
+static ULONG32 RandomWritableField()
+{
+	ULONG32 Encoding;
+
+	do
+		Encoding = RandomField();
+	while (((Encoding >> 10) & 3) == 1);
+	return Encoding;
+}
+
+static ULONG64 Get(ULONG32 Encoding)
+{
+	return State.Vmcs12.Fields[NvmxFieldIndex(Encoding)];
+}
+
+static void Put(ULONG32 Encoding, ULONG64 Value)
+{
+	Expect(NvmxWrite(&State, Encoding, Value) == 0, "VMWRITE of a writable field failed");
+}
+
+static BOOLEAN Allowed(ULONG64 Controls, ULONG64 Caps)
+{
+	return !(Controls & ~(Caps >> 32)) && (Controls & (ULONG32)Caps) == (ULONG32)Caps;
+}
+
+/* Controls the guest hypervisor would pick from the capabilities, with a few random optional bits. */
+static ULONG64 RandomControls(ULONG64 Caps)
+{
+	return ((Random() & (Caps >> 32)) | (ULONG32)Caps) & 0xFFFFFFFF;
+}
+
+static void InitHost()
+{
+	ULONG32 i, Encoding;
+
+	memset(&Host, 0, sizeof(Host));
+	Host.PinControls = SIM_PIN_CAPS;
+	Host.ProcControls = SIM_PROC_CAPS;
+	Host.Proc2Controls = SIM_PROC2_CAPS;
+	Host.ExitControls = SIM_EXIT_CAPS;
+	Host.EntryControls = SIM_ENTRY_CAPS;
+	Host.Misc = SIM_MISC;
+	Host.Efer = 0xD01;
+	Host.Pat = 0x0007040600070406ULL;
+	Host.Cr0Fixed0 = 0x80000021;
+	Host.Cr0Fixed1 = 0xFFFFFFFF;
+	Host.Cr4Fixed0 = 0x2000;
+	Host.Cr4Fixed1 = 0x003727FF;
+	Host.PhysicalAddressBits = 39;
+
+	memset(&Vmcs01, 0, sizeof(Vmcs01));
+	for (i = 0; NvmxFieldInfo(i, &Encoding); i++)
+		Vmcs01.Values[Encoding] = Truncate(Encoding, Random());
+	Vmcs01.Values[0x400C] = 0x00036FFF;	/* VM_EXIT_CONTROLS with host address size */
+	Vmcs01.Values[0x4002] = 0x8401E17A;	/* CPU_BASED with TSC offsetting */
+	Vmcs01.Values[0x2010] = 0x1000;
+	NvmxCaptureHost(&Host, SimRead, &Vmcs01);
+	NvmxCaptureExiting(&State, &Host, SimRead, &Vmcs01);
+	Host.Bitmaps02 = Pages[SIM_PAGES - 3];
+	Host.Bitmaps02PA = SIM_PAGE_BASE + (SIM_PAGES - 3) * 4096;
+}
+
+/* Make the host state of vmcs12 pass the entry checks of a 64-bit guest hypervisor, whatever was in it. */
+static void FixHostState()
+{
+	static const ULONG32 Addresses[] = { 0x6C06, 0x6C08, 0x6C0A, 0x6C0C, 0x6C0E, 0x6C10, 0x6C12, 0x6C16 };
+	ULONG32 i;
+
+	for (i = 0; i < 7; i++)
+		Put(0x0C00 + i * 2, (Get(0x0C00 + i * 2) & 0xFFF8) | 8);
+	for (i = 0; i < sizeof(Addresses) / sizeof(Addresses[0]); i++)
+		Put(Addresses[i], (ULONG64)((long long)(Get(Addresses[i]) << 16) >> 16));
+	Put(0x6C00, (Get(0x6C00) & Host.Cr0Fixed1) | Host.Cr0Fixed0);
+	Put(0x6C02, Get(0x6C02) & 0x7FFFFFF000ULL);
+	Put(0x6C04, (Get(0x6C04) & Host.Cr4Fixed1) | Host.Cr4Fixed0 | 0x20);
+	Put(0x2C00, 0x0007040600070406ULL);
+	Put(0x2C02, 0xD01);
+}
+
+/* A vmcs12 the guest hypervisor could enter with: random fields, valid controls and host state. */
+static void InitState()
+{
+	ULONG32 i, Encoding;
+
+	memset(&State, 0, sizeof(State));
+	for (i = 0; NvmxFieldInfo(i, &Encoding); i++)
+		if (((Encoding >> 10) & 3) != 1)
+			Put(Encoding, Random());
+	Put(0x4000, RandomControls(SIM_PIN_CAPS));
+	Put(0x4002, RandomControls(SIM_PROC_CAPS) & ~0x12000000ULL);	/* no I/O or MSR bitmaps */
+	Put(0x401E, RandomControls(SIM_PROC2_CAPS));
+	Put(0x400C, RandomControls(SIM_EXIT_CAPS) | 0x200);
+	Put(0x4012, RandomControls(SIM_ENTRY_CAPS) & ~0xC00ULL);
+	Put(0x400A, Random() % 5);
+	FixHostState();
+}
+
+static void CheckAccess(unsigned long Cases)
+{
+	static ULONG64 Model[0x8000];
+	ULONG32 Encoding, Error, Expected;
+	ULONG64 Value, Want;
+	unsigned long c;
+	BOOLEAN Valid;
+
+	memset(&State, 0, sizeof(State));
+	for (c = 0; c < Cases; c++)
+	{
+		if (Random() % 4)
+		{
+			Encoding = RandomField();
+			if (Random() % 3 == 0)
+				Encoding |= 1;
+		}
+		else
+			Encoding = Random() % 3 ? Random() & 0x7FFF : (ULONG32)Random();
+		Valid = Encoding < 0x8000 && Kinds[Encoding & ~1] && (!(Encoding & 1) || Width(Encoding) == 1);
+		Value = Random();
+
+		if (Random() % 2)
+		{
+			Error = NvmxRead(&State, Encoding, &Value);
+			Expect(Error == (Valid ? 0 : NVMX_ERROR_UNSUPPORTED_FIELD), "VMREAD error");
+			if (!Valid || Error)
+				continue;
+			Want = Encoding & 1 ? Model[Encoding & ~1] >> 32 : Truncate(Encoding, Model[Encoding]);
+			Expect(Value == Want, "VMREAD value");
+			continue;
+		}
+		Error = NvmxWrite(&State, Encoding, Value);
+		Expected = !Valid ? NVMX_ERROR_UNSUPPORTED_FIELD : ((Encoding >> 10) & 3) == 1 ? NVMX_ERROR_READ_ONLY_FIELD : 0;
+		Expect(Error == Expected, "VMWRITE error");
+		if (Error || !Valid)
+			continue;
+		if (Encoding & 1)
+			Model[Encoding & ~1] = (Model[Encoding & ~1] & 0xFFFFFFFF) | (Value << 32);
+		else
+			Model[Encoding] = Truncate(Encoding, Value);
+	}
+}
+
+/* vmcs02 as it has to look after merging the current vmcs12. */
+static void CheckVmcs02(SIM_VMCS *Vmcs)
+{
+	ULONG32 i, Encoding, Flags;
+	ULONG64 Proc12 = Get(0x4002), Entry12 = Get(0x4012), Exit02 = Vmcs->Values[0x400C];
+	ULONG64 Tsc = 0x1000;
+
+	for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+	{
+		switch (Flags & NVMX_KIND_MASK)
+		{
+		case NVMX_GUEST_STATE:
+		case NVMX_CONTROL:
+			Expect(Vmcs->Values[Encoding] == Get(Encoding), "vmcs02 lacks a guest or control field");
+			break;
+		case NVMX_HOST_STATE:
+			if (Encoding == 0x2C00)
+				Expect(Vmcs->Values[Encoding] == Host.Pat, "vmcs02 host PAT");
+			else if (Encoding == 0x2C02)
+				Expect(Vmcs->Values[Encoding] == Host.Efer, "vmcs02 host EFER");
+			else if (Encoding != 0x2C04)
+				Expect(Vmcs->Values[Encoding] == Vmcs01.Values[Encoding], "vmcs02 host state is not L0's");
+			break;
+		}
+	}
+	Expect(Vmcs->Values[0x2800] == ~0ULL, "vmcs02 link pointer");
+	Expect(Allowed(Vmcs->Values[0x4000], SIM_PIN_CAPS) && Allowed(Vmcs->Values[0x4002], SIM_PROC_CAPS) &&
+		Allowed(Vmcs->Values[0x400C], SIM_EXIT_CAPS) && Allowed(Vmcs->Values[0x4012], SIM_ENTRY_CAPS) &&
+		Allowed(Vmcs->Values[0x401E], SIM_PROC2_CAPS), "vmcs02 controls outside the capabilities");
+	Expect((Vmcs->Values[0x4000] & 0xFFFFFFFF) == (Get(0x4000) | (Vmcs01.Values[0x4000] & 9)), "vmcs02 pin controls");
+	Expect(Vmcs->Values[0x2000] == Host.Bitmaps02PA && Vmcs->Values[0x2002] == Host.Bitmaps02PA + 4096 &&
+		Vmcs->Values[0x2004] == Host.Bitmaps02PA + 8192, "vmcs02 bitmaps are not L0's");
+	Expect(!((Get(0x4004) | Vmcs01.Values[0x4004]) & ~Vmcs->Values[0x4004] & ~0x4000ULL), "vmcs02 exception bitmap");
+	Expect(!(Vmcs->Values[0x401E] & 0x4000), "vmcs02 has VMCS shadowing");
+	Expect((Exit02 & 0x200) && (!(Entry12 & 0x4000) || (Exit02 & 0x80000)) && (!(Entry12 & 0x8000) || (Exit02 & 0x200000)),
+		"vmcs02 exit controls don't return to L0's host");
+	Expect(!(Vmcs->Values[0x4012] & 0x2C00), "vmcs02 entry controls");
+	if (Proc12 & 8)
+		Tsc += Get(0x2010);
+	Expect(Vmcs->Values[0x2010] == Tsc && (Vmcs->Values[0x4002] & 8), "vmcs02 TSC offset");
+}
+
+/* Exit information is the processor's, the rest of vmcs02 comes from the merges. */
+static int SameVmcs02(SIM_VMCS *A, SIM_VMCS *B)
+{
+	ULONG32 i, Encoding, Flags;
+
+	for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+		if ((Flags & NVMX_KIND_MASK) != NVMX_EXIT_INFO && A->Values[Encoding] != B->Values[Encoding])
+			return 0;
+	return 1;
+}
+
+static const struct
+{
+	ULONG32 Encoding;
+	ULONG64 Value;
+	const char *What;
+} BadHost[] = {
+	{ 0x6C16, 0x0000800000000000ULL, "non-canonical host RIP" },
+	{ 0x6C06, 0x8000000000000000ULL, "non-canonical host FS base" },
+	{ 0x6C08, 0x0001000000000000ULL, "non-canonical host GS base" },
+	{ 0x6C0A, 0xFFFF000000000000ULL, "non-canonical host TR base" },
+	{ 0x6C0C, 0x0000800000001000ULL, "non-canonical host GDTR base" },
+	{ 0x6C0E, 0x7FFF800000000000ULL, "non-canonical host IDTR base" },
+	{ 0x6C10, 0x0123456789ABCDEFULL, "non-canonical host SYSENTER_ESP" },
+	{ 0x6C12, 0xFFFE800000000000ULL, "non-canonical host SYSENTER_EIP" },
+	{ 0x6C00, 0x80050013, "host CR0 without NE" },
+	{ 0x6C04, 0x000406F8, "host CR4 without VMXE" },
+	{ 0x6C04, 0x008426F8, "host CR4 with a bit outside CR4_FIXED1" },
+	{ 0x6C02, 0x0000010000000000ULL, "host CR3 beyond MAXPHYADDR" },
+};
+
+static void CheckMerge(unsigned long Cases)
+{
+	unsigned long c, k, Writes;
+
+	InitHost();
+	InitState();
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "a valid vmcs12 is rejected");
+	memset(&Vmcs02, 0, sizeof(Vmcs02));
+	NvmxMerge(&State, &Host, TRUE, SimWrite, &Vmcs02);
+	CheckVmcs02(&Vmcs02);
+
+	for (c = 0; c < Cases; c++)
+	{
+		for (k = Random() % 6; k; k--)
+		{
+			if (Random() % 4)
+				Put(RandomWritableField(), Random());
+			else
+				Put(0x4002, RandomControls(SIM_PROC_CAPS) & ~0x12000000ULL);
+		}
+		Put(0x4012, RandomControls(SIM_ENTRY_CAPS) & ~0xC00ULL);
+		Put(0x400C, RandomControls(SIM_EXIT_CAPS) | 0x200);
+		Put(0x400A, Random() % 5);
+		FixHostState();
+		Put(0x4000, RandomControls(SIM_PIN_CAPS));
+		Put(0x401E, RandomControls(SIM_PROC2_CAPS));
+		if (!Allowed(Get(0x4002), SIM_PROC_CAPS) || (Get(0x4002) & 0x12000000))
+			Put(0x4002, RandomControls(SIM_PROC_CAPS) & ~0x12000000ULL);
+		Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "a valid vmcs12 is rejected");
+
+		Writes = Vmcs02.Writes;
+		NvmxMerge(&State, &Host, FALSE, SimWrite, &Vmcs02);
+		Expect(Vmcs02.Writes - Writes < 40, "dirty-only merge wrote too much");
+		if (c % 64 == 0)
+		{
+			memset(&Fresh, 0, sizeof(Fresh));
+			NvmxMerge(&State, &Host, TRUE, SimWrite, &Fresh);
+			Expect(SameVmcs02(&Vmcs02, &Fresh), "dirty-only merges differ from a full merge");
+			CheckVmcs02(&Vmcs02);
+		}
+	}
+
+	/* Entry checks */
+	Put(0x4000, Get(0x4000) & ~0x16ULL);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_CONTROLS, "pin controls below the allowed 0-settings");
+	Put(0x4000, RandomControls(SIM_PIN_CAPS));
+	Put(0x401E, Get(0x401E) | 0x4000);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "VMCS shadowing in vmcs12 is rejected");
+	Put(0x400A, 5);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_CONTROLS, "CR3 target count 5");
+	Put(0x400A, 4);
+	Put(0x0C02, Get(0x0C02) | 3);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "host CS with RPL 3");
+	Put(0x0C02, Get(0x0C02) & ~7ULL);
+	Put(0x6C00, Get(0x6C00) & ~0x80000000ULL);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "host CR0 without paging");
+	Put(0x6C00, Get(0x6C00) | 0x80000000);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "vmcs12 rejected after the fixes");
+
+	/* Host state that would make L0's own entry of vmcs01 fail at the nested exit */
+	for (k = 0; k < sizeof(BadHost) / sizeof(BadHost[0]); k++)
+	{
+		ULONG64 Old = Get(BadHost[k].Encoding);
+
+		Put(BadHost[k].Encoding, BadHost[k].Value);
+		Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, BadHost[k].What);
+		Put(BadHost[k].Encoding, Old);
+	}
+	Put(0x400C, Get(0x400C) | 0x280000);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "host PAT and EFER loads rejected");
+	Put(0x2C00, 0x0007040600070402ULL);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "host PAT with memory type 2");
+	Put(0x2C00, 0x0007040600070406ULL);
+	Put(0x2C02, 0x801);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "host EFER without LMA for a 64-bit host");
+	Put(0x2C02, 0xD03);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "host EFER with a reserved bit");
+	Put(0x2C02, 0xD01);
+
+	/* A 32-bit guest hypervisor */
+	Expect(NvmxCheckEntry(&State, &Host, FALSE) == NVMX_ERROR_ENTRY_HOST_STATE, "64-bit host outside IA-32e mode");
+	Put(0x400C, Get(0x400C) & ~0x280200ULL);
+	Put(0x4012, Get(0x4012) & ~0x200ULL);
+	Put(0x6C16, Get(0x6C16) & 0xFFFFFFFF);
+	Put(0x6C04, Get(0x6C04) & ~0x20000ULL);
+	Expect(NvmxCheckEntry(&State, &Host, FALSE) == 0, "a 32-bit guest hypervisor is rejected");
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == NVMX_ERROR_ENTRY_HOST_STATE, "32-bit host in IA-32e mode");
+	Put(0x4012, Get(0x4012) | 0x200);
+	Expect(NvmxCheckEntry(&State, &Host, FALSE) == NVMX_ERROR_ENTRY_HOST_STATE, "IA-32e mode guest outside IA-32e mode");
+	Put(0x4012, Get(0x4012) & ~0x200ULL);
+	Put(0x6C16, Get(0x6C16) | 0x100000000ULL);
+	Expect(NvmxCheckEntry(&State, &Host, FALSE) == NVMX_ERROR_ENTRY_HOST_STATE, "host RIP above 4GB for a 32-bit host");
+	Put(0x6C16, Get(0x6C16) & 0xFFFFFFFF);
+	Put(0x6C04, Get(0x6C04) | 0x20000);
+	Expect(NvmxCheckEntry(&State, &Host, FALSE) == NVMX_ERROR_ENTRY_HOST_STATE, "CR4.PCIDE for a 32-bit host");
+	Put(0x6C04, Get(0x6C04) & ~0x20000ULL);
+	Put(0x400C, Get(0x400C) | 0x200);
+	Expect(NvmxCheckEntry(&State, &Host, TRUE) == 0, "vmcs12 rejected after the fixes");
+}
+
+static void CheckExit(unsigned long Cases)
+{
+	ULONG32 i, Encoding, Flags, Kind;
+	ULONG64 Exit12, Old[NVMX_MAX_FIELDS];
+	unsigned long c, Writes;
+	BOOLEAN Failure;
+
+	for (c = 0; c < Cases; c++)
+	{
+		Put(0x4016, Get(0x4016) | 0x80000000);
+		NvmxMerge(&State, &Host, FALSE, SimWrite, &Vmcs02);
+		memcpy(Old, State.Vmcs12.Fields, sizeof(Old));
+
+		/* The nested guest runs and exits: the processor changes guest state and exit information. Fields
+		   it doesn't save are set back below, vmcs02 keeps what it was entered with. */
+		Failure = Random() % 8 == 0;
+		for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+		{
+			Kind = Flags & NVMX_KIND_MASK;
+			if (Kind == NVMX_GUEST_STATE || Kind == NVMX_EXIT_INFO)
+				Vmcs02.Values[Encoding] = Truncate(Encoding, Random());
+		}
+		Vmcs02.Values[0x4402] = (Random() % 60) | (Failure ? 0x80000000 : 0);
+		Vmcs02.Values[0x4016] &= ~0x80000000ULL;
+		NvmxSaveExit(&State, SimRead, &Vmcs02);
+
+		Exit12 = Get(0x400C);
+		for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+		{
+			Kind = Flags & NVMX_KIND_MASK;
+			if (Kind == NVMX_EXIT_INFO)
+				Expect(Get(Encoding) == Vmcs02.Values[Encoding], "exit information not saved");
+			else if (Kind == NVMX_GUEST_STATE && (Failure || (Encoding == 0x2804 && !(Exit12 & 0x40000)) ||
+				(Encoding == 0x2806 && !(Exit12 & 0x100000)) || (Encoding == 0x482E && !(Exit12 & 0x400000)) ||
+				((Encoding == 0x2802 || Encoding == 0x681A) && !(Exit12 & 4)) || Encoding == 0x2808))
+			{
+				Expect(Get(Encoding) == Old[i], "guest field saved after a failed entry or without its exit control");
+				Vmcs02.Values[Encoding] = Old[i];
+			}
+			else if (Kind == NVMX_GUEST_STATE)
+				Expect(Get(Encoding) == Vmcs02.Values[Encoding], "guest state not saved");
+		}
+		Expect(!(Get(0x4016) & 0x80000000), "event injection still valid after the exit");
+
+		/* Entering again without a VMWRITE in between writes nothing */
+		Writes = Vmcs02.Writes;
+		Expect(NvmxMerge(&State, &Host, FALSE, SimWrite, &Vmcs02) == 0 && Vmcs02.Writes == Writes,
+			"re-entry after an exit rewrote vmcs02");
+		memset(&Fresh, 0, sizeof(Fresh));
+		NvmxMerge(&State, &Host, TRUE, SimWrite, &Fresh);
+		Expect(SameVmcs02(&Vmcs02, &Fresh), "vmcs02 after an exit differs from a full merge");
+
+		NvmxLoadHostState(&State, SimRead, SimWrite, &Vmcs01);
+		Expect(Vmcs01.Values[0x681E] == Get(0x6C16) && Vmcs01.Values[0x681C] == Get(0x6C14), "host RIP and RSP");
+		Expect(Vmcs01.Values[0x6800] == Get(0x6C00) && Vmcs01.Values[0x6802] == Get(0x6C02) &&
+			Vmcs01.Values[0x6804] == Get(0x6C04), "host control registers");
+		Expect(Vmcs01.Values[0x0802] == Get(0x0C02) && Vmcs01.Values[0x080E] == Get(0x0C0C) &&
+			Vmcs01.Values[0x080C] == 0, "host selectors");
+		Expect(Vmcs01.Values[0x4816] == ((Exit12 & 0x200) ? 0xA09B : 0xC09B) && Vmcs01.Values[0x4820] == 0x10000 &&
+			Vmcs01.Values[0x4822] == 0x8B, "host access rights");
+		Expect(Vmcs01.Values[0x680E] == Get(0x6C06) && Vmcs01.Values[0x6810] == Get(0x6C08) &&
+			Vmcs01.Values[0x6814] == Get(0x6C0A) && Vmcs01.Values[0x6816] == Get(0x6C0C), "host bases");
+		Expect(Vmcs01.Values[0x6820] == 2 && !(Vmcs01.Values[0x4824] & ~8ULL), "host RFLAGS and interruptibility");
+		Expect(!!(Vmcs01.Values[0x4012] & 0x200) == !!(Exit12 & 0x200), "IA-32e mode of the guest hypervisor");
+	}
+}
+
+static void CheckShadow(unsigned long Cases)
+{
+	static UCHAR Vmread[4096], Vmwrite[4096];
+	ULONG32 Encoding, i, Flags, Count, Changed;
+	ULONG64 Value;
+	unsigned long c, Writes;
+	BOOLEAN Read, Write;
+
+	for (i = 0; i < 2; i++)
+	{
+		Host.Misc = i ? SIM_MISC : 0;
+		Count = NvmxBuildShadowBitmaps(&Host, Vmread, Vmwrite);
+		Expect(Count == (i ? 39 : 29), "number of shadowed fields");
+		for (Encoding = 0; Encoding < 0x8000; Encoding++)
+		{
+			Flags = Kinds[Encoding & ~1];
+			if ((Encoding & 1) && Width(Encoding) != 1)
+				Flags = 0;
+			Read = (Flags & NVMX_SHADOW_RW) || ((Flags & NVMX_SHADOW_RO) && i);
+			Write = (Flags & NVMX_SHADOW_RW) != 0;
+			Expect(((Vmread[Encoding / 8] >> (Encoding % 8) & 1) == 0) == Read, "VMREAD bitmap");
+			Expect(((Vmwrite[Encoding / 8] >> (Encoding % 8) & 1) == 0) == Write, "VMWRITE bitmap");
+		}
+	}
+
+	for (c = 0; c < Cases; c++)
+	{
+		memset(&Shadow, 0, sizeof(Shadow));
+		NvmxSyncToShadow(&State, &Host, SimWrite, &Shadow);
+		for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+			if (Flags & (NVMX_SHADOW_RW | NVMX_SHADOW_RO))
+				Expect(Shadow.Values[Encoding] == State.Vmcs12.Fields[i], "shadow VMCS lacks a field");
+
+		/* The guest hypervisor writes the shadow VMCS directly */
+		Changed = 0;
+		for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+		{
+			if (!(Flags & NVMX_SHADOW_RW) || Random() % 4)
+				continue;
+			Value = Encoding == 0x4002 ? RandomControls(SIM_PROC_CAPS) & ~0x12000000ULL : Truncate(Encoding, Random());
+			if (Value != Shadow.Values[Encoding])
+				Changed++;
+			Shadow.Values[Encoding] = Value;
+		}
+		Expect(NvmxSyncFromShadow(&State, &Host, SimRead, &Shadow) == Changed, "changed shadow fields");
+		for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+			if (Flags & NVMX_SHADOW_RW)
+				Expect(State.Vmcs12.Fields[i] == Shadow.Values[Encoding], "shadow write lost");
+
+		Writes = Vmcs02.Writes;
+		NvmxMerge(&State, &Host, FALSE, SimWrite, &Vmcs02);
+		Expect(Vmcs02.Writes - Writes <= Changed + 13, "merge after a shadow sync");
+		memset(&Fresh, 0, sizeof(Fresh));
+		NvmxMerge(&State, &Host, TRUE, SimWrite, &Fresh);
+		Expect(SameVmcs02(&Vmcs02, &Fresh), "shadow writes did not reach vmcs02");
+	}
+}
+
+/* Whether a VMCS with the fields <V>, indexed by encoding, exits for <Exit>, straight from the SDM. */
+static int SimExits(const ULONG64 *V, NVMX_EXIT *Exit)
+{
+	ULONG64 Proc = V[0x4002], Proc2 = (Proc & 0x80000000) ? V[0x401E] : 0;
+	ULONG32 Vector = Exit->IntrInfo & 0xFF, Cr = Exit->Qualification & 0xF, Access = (Exit->Qualification >> 4) & 3;
+	ULONG32 Port, Msr, Offset, i;
+	PUCHAR Page;
+
+	switch (Exit->Reason)
+	{
+	case 0:
+		if (((Exit->IntrInfo >> 8) & 7) == 2)
+			return (V[0x4000] >> 3) & 1;
+		if (Vector == 14)
+			return ((V[0x4004] >> 14) & 1) == ((Exit->ErrorCode & V[0x4006]) == V[0x4008]);
+		return (V[0x4004] >> Vector) & 1;
+	case 1:
+		return V[0x4000] & 1;
+	case 12:
+		return (Proc >> 7) & 1;
+	case 14:
+		return (Proc >> 9) & 1;
+	case 15:
+		return (Proc >> 11) & 1;
+	case 16:
+	case 51:
+		return (Proc >> 12) & 1;
+	case 28:
+		if (Cr == 3 && Access == 0)
+		{
+			if (!(Proc & 0x8000))
+				return 0;
+			for (i = 0; i < V[0x400A] && i < 4; i++)
+				if (V[0x6008 + i * 2] == Exit->Operand)
+					return 0;
+			return 1;
+		}
+		if (Cr == 3 && Access == 1)
+			return (Proc >> 16) & 1;
+		if (Cr == 8)
+			return (Proc >> (Access ? 20 : 19)) & 1;
+		return 1;
+	case 29:
+		return (Proc >> 23) & 1;
+	case 30:
+		if (!(Proc & 0x02000000))
+			return (Proc >> 24) & 1;
+		for (i = 0; i <= (Exit->Qualification & 7); i++)
+		{
+			Port = ((Exit->Qualification >> 16) & 0xFFFF) + i;
+			if (Port > 0xFFFF)
+				return 1;
+			Page = SimMap(NULL, V[Port < 0x8000 ? 0x2000 : 0x2002]);
+			if (!Page || (Page[(Port & 0x7FFF) / 8] >> (Port % 8) & 1))
+				return 1;
+		}
+		return 0;
+	case 31:
+	case 32:
+		if (!(Proc & 0x10000000))
+			return 1;
+		Msr = (ULONG32)Exit->Operand;
+		Offset = Exit->Reason == 32 ? 2048 : 0;
+		if (Msr >= 0xC0000000 && Msr < 0xC0002000)
+		{
+			Offset += 1024;
+			Msr -= 0xC0000000;
+		}
+		else if (Msr >= 0x2000)
+			return 1;
+		Page = SimMap(NULL, V[0x2004]);
+		return !Page || (Page[Offset + Msr / 8] >> (Msr % 8) & 1);
+	case 36:
+		return (Proc >> 10) & 1;
+	case 39:
+		return (Proc >> 29) & 1;
+	case 40:
+		return ((Proc >> 30) & 1) || ((Proc2 >> 10) & 1);
+	case 46:
+	case 47:
+		return (Proc2 >> 2) & 1;
+	case 54:
+		return (Proc2 >> 6) & 1;
+	case 57:
+		return (Proc2 >> 11) & 1;
+	case 61:
+		return (Proc2 >> 16) & 1;
+	}
+	return 1;
+}
+
+static const ULONG32 SimReasons[] = { 0, 0, 0, 1, 10, 12, 14, 15, 16, 28, 28, 28, 29, 30, 30, 31, 32, 36, 39, 40, 46, 47, 51, 54, 57, 61 };
+
+static void RandomExit(NVMX_EXIT *Exit)
+{
+	static const ULONG32 Crs[] = { 0, 3, 3, 4, 8 };
+	static const ULONG32 Sizes[] = { 0, 1, 3 };
+	ULONG32 Port;
+
+	memset(Exit, 0, sizeof(*Exit));
+	Exit->Reason = Random() % 32 ? SimReasons[Random() % (sizeof(SimReasons) / sizeof(SimReasons[0]))] : 0x80000021;
+	switch (Exit->Reason)
+	{
+	case 0:
+		Exit->IntrInfo = 0x80000000 | (Random() % 3 ? 14 | 0x300 : Random() % 4 ? (Random() % 32) | 0x300 : 0x202);
+		Exit->ErrorCode = Random() & 0x1F;
+		break;
+	case 28:
+		Exit->Qualification = Crs[Random() % 5] | (Random() % 2) << 4 | (Random() % 16) << 8;
+		Exit->Operand = Random() % 2 ? Get(0x6008 + Random() % 4 * 2) : Random() % 4;
+		break;
+	case 30:
+		Port = Random() % 4 ? Random() & 0xFFFF : (Random() % 2 ? 0x8000 : 0x10000) - Random() % 4;
+		Exit->Qualification = Sizes[Random() % 3] | (ULONG64)(Port & 0xFFFF) << 16;
+		break;
+	case 31:
+	case 32:
+		Exit->Operand = Random() % 3 == 0 ? 0xC0000000 + (Random() & 0x1FFF) : Random() % 8 ? Random() & 0x1FFF : (ULONG32)Random();
+		break;
+	}
+}
+
+static void CheckRouting(unsigned long Cases)
+{
+	static SIM_VMCS Vmcs12;
+	NVMX_EXIT Exit;
+	ULONG32 i, k, Encoding, Want;
+	unsigned long c;
+
+	InitHost();
+	InitState();
+	for (c = 0; c < Cases; c++)
+	{
+		/* New bitmaps now and then, sparse enough that accesses both exit and don't */
+		if (c % 64 == 0)
+			for (i = 0; i < (SIM_PAGES - 3) * 4096; i++)
+				((PUCHAR)Pages)[i] = Random() & Random() & Random();
+
+		/* Both levels pick their exiting controls, #PF filters, CR3 targets and bitmaps */
+		for (k = 0; k < 2; k++)
+		{
+			ULONG64 Values[11];
+
+			Values[0] = RandomControls(SIM_PIN_CAPS);
+			Values[1] = RandomControls(SIM_PROC_CAPS);
+			Values[2] = RandomControls(SIM_PROC2_CAPS);
+			/* Pause-loop exiting of L0 is a heuristic vmcs02 does without */
+			if (k)
+				Values[2] &= ~0x400ULL;
+			Values[3] = Random() & 0xFFFFFFFF;
+			Values[4] = Random() % 4 ? Random() & 0x1F : 0;
+			Values[5] = Random() % 4 ? Random() & 0x1F : 0;
+			Values[6] = RandomPage();
+			Values[7] = RandomPage();
+			Values[8] = RandomPage();
+			Values[9] = Random() % 5;
+			Values[10] = Random() % 4;
+			if (k && Random() % 4 == 0)
+			{
+				/* L0 filtering #PF just like the guest hypervisor */
+				Values[3] = (Values[3] & ~0x4000ULL) | (Get(0x4004) & 0x4000);
+				Values[4] = Get(0x4006);
+				Values[5] = Get(0x4008);
+			}
+			for (i = 0; i < 9; i++)
+			{
+				static const ULONG32 Fields[] = { 0x4000, 0x4002, 0x401E, 0x4004, 0x4006, 0x4008, 0x2000, 0x2002, 0x2004 };
+
+				if (k)
+					Vmcs01.Values[Fields[i]] = Values[i];
+				else
+					Put(Fields[i], Values[i]);
+			}
+			if (k)
+				Vmcs01.Values[0x400A] = Values[9];
+			else
+				Put(0x400A, Values[9]);
+			for (i = 0; i < 4; i++)
+				if (k)
+					Vmcs01.Values[0x6008 + i * 2] = Random() % 4;
+				else
+					Put(0x6008 + i * 2, (Values[10] + i) % 4);
+		}
+
+		NvmxCaptureExiting(&State, &Host, SimRead, &Vmcs01);
+		NvmxMergeBitmaps(&State, &Host, SimMap, NULL);
+		NvmxMerge(&State, &Host, FALSE, SimWrite, &Vmcs02);
+		for (i = 0; NvmxFieldInfo(i, &Encoding); i++)
+			Vmcs12.Values[Encoding] = Get(Encoding);
+
+		for (k = 0; k < 16; k++)
+		{
+			RandomExit(&Exit);
+			Want = Exit.Reason & 0x80000000 ? 1 : SimExits(Vmcs12.Values, &Exit);
+			if (!(Exit.Reason & 0x80000000))
+				Expect(SimExits(Vmcs02.Values, &Exit) || (!Want && !SimExits(Vmcs01.Values, &Exit)),
+					"vmcs02 misses an exit one level asks for");
+			Expect(NvmxExitForL1(&State, &Exit, SimMap, NULL) == Want, "exit routed to the wrong level");
+		}
+	}
+}
+
+/*
+ * What the guest hypervisor does with the VMCS in its handler for one exit of its guest, here a CPUID
+ * exit, as a KVM-like hypervisor does it: reads of the exit information and the guest state it
+ * needs, then RIP past the instruction, the event and interrupt window checks on the way back in.
+ */
+static const struct
+{
+	BOOLEAN Write;
+	ULONG32 Encoding;
+} L1Handler[] = {
+	{ FALSE, 0x4402 }, { FALSE, 0x6400 }, { FALSE, 0x4404 }, { FALSE, 0x4408 }, { FALSE, 0x440C },
+	{ FALSE, 0x681E }, { FALSE, 0x681C }, { FALSE, 0x6820 }, { FALSE, 0x4824 }, { FALSE, 0x4816 },
+	{ FALSE, 0x6800 }, { FALSE, 0x6804 }, { FALSE, 0x6802 }, { FALSE, 0x4818 },
+	{ TRUE, 0x681E }, { TRUE, 0x4824 }, { TRUE, 0x4016 }, { TRUE, 0x4002 }, { TRUE, 0x6820 },
+};
+
+static void Bench()
+{
+	static UCHAR Vmread[4096], Vmwrite[4096];
+	ULONG32 i, Exits[2], Full, Dirty;
+	unsigned long Rounds = 200000, r;
+	ULONG64 Value;
+	double Start, Time[3];
+
+	Host.Misc = SIM_MISC;
+	NvmxBuildShadowBitmaps(&Host, Vmread, Vmwrite);
+	for (i = 0; i < 2; i++)
+	{
+		ULONG32 k;
+
+		/* The nested exit, its reflection to the guest hypervisor, and its VMRESUME */
+		Exits[i] = 2;
+		for (k = 0; k < sizeof(L1Handler) / sizeof(L1Handler[0]); k++)
+			if (!i || ((L1Handler[k].Write ? Vmwrite : Vmread)[L1Handler[k].Encoding / 8] >> (L1Handler[k].Encoding % 8) & 1))
+				Exits[i]++;
+	}
+	printf("%-14s %u exits without VMCS shadowing, %u with\n", "nested exit", Exits[0], Exits[1]);
+
+	memset(&Fresh, 0, sizeof(Fresh));
+	Full = NvmxMerge(&State, &Host, TRUE, SimWrite, &Fresh);
+	for (i = 0; i < sizeof(L1Handler) / sizeof(L1Handler[0]); i++)
+		if (L1Handler[i].Write)
+			Put(L1Handler[i].Encoding, Get(L1Handler[i].Encoding) ^ (L1Handler[i].Encoding == 0x4002 ? 0x4 : 1));
+	Dirty = NvmxMerge(&State, &Host, FALSE, SimWrite, &Fresh);
+	printf("%-14s %u VMWRITEs full, %u after the handler above\n", "merge", Full, Dirty);
+
+	Start = Now();
+	for (r = 0; r < Rounds; r++)
+		Sink += NvmxMerge(&State, &Host, TRUE, SimWrite, &Fresh);
+	Time[0] = Now() - Start;
+	Start = Now();
+	for (r = 0; r < Rounds; r++)
+	{
+		for (i = 0; i < sizeof(L1Handler) / sizeof(L1Handler[0]); i++)
+		{
+			if (L1Handler[i].Write)
+				NvmxWrite(&State, L1Handler[i].Encoding, r ^ L1Handler[i].Encoding);
+			else
+			{
+				NvmxRead(&State, L1Handler[i].Encoding, &Value);
+				Sink += Value;
+			}
+		}
+		Sink += NvmxMerge(&State, &Host, FALSE, SimWrite, &Fresh);
+	}
+	Time[1] = Now() - Start;
+	Start = Now();
+	for (r = 0; r < Rounds; r++)
+	{
+		NvmxSaveExit(&State, SimRead, &Fresh);
+		NvmxLoadHostState(&State, SimRead, SimWrite, &Vmcs01);
+		Sink += NvmxSyncToShadow(&State, &Host, SimWrite, &Shadow);
+		Sink += NvmxSyncFromShadow(&State, &Host, SimRead, &Shadow);
+	}
+	Time[2] = Now() - Start;
+	printf("%-14s %7.1f ns/merge\n", "full", Time[0] * 1e9 / Rounds);
+	printf("%-14s %7.1f ns/exit   %zu emulated VMREAD/VMWRITEs and a dirty-only merge\n", "emulated",
+		Time[1] * 1e9 / Rounds, sizeof(L1Handler) / sizeof(L1Handler[0]));
+	printf("%-14s %7.1f ns/exit   save, host state load and both shadow syncs\n", "reflect", Time[2] * 1e9 / Rounds);
+
+	/* Every entry recaptures L0's exiting controls and ORs up to three bitmap pages */
+	Put(0x4002, Get(0x4002) | 0x12000000);
+	Vmcs01.Values[0x4002] |= 0x12000000;
+	for (i = 0; i < 3; i++)
+	{
+		Put(0x2000 + i * 2, SIM_PAGE_BASE + i * 4096);
+		Vmcs01.Values[0x2000 + i * 2] = SIM_PAGE_BASE + (i + 3) * 4096;
+	}
+	Start = Now();
+	for (r = 0; r < Rounds; r++)
+	{
+		Sink += NvmxCaptureExiting(&State, &Host, SimRead, &Vmcs01);
+		Sink += NvmxMergeBitmaps(&State, &Host, SimMap, NULL);
+	}
+	Time[0] = Now() - Start;
+	printf("%-14s %7.1f ns/entry  L0's exiting controls and three merged bitmap pages\n", "bitmaps", Time[0] * 1e9 / Rounds);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long Cases = 200000, r;
+	ULONG32 i, Encoding, Flags, Previous = 0;
+	int a;
+
+	for (a = 1; a + 1 < argc; a += 2)
+	{
+		if (!strcmp(argv[a], "-n"))
+			Cases = strtoul(argv[a + 1], NULL, 0);
+		else if (!strcmp(argv[a], "-s"))
+			Seed = strtoull(argv[a + 1], NULL, 0) | 1;
+	}
+	if (a < argc)
+	{
+		fprintf(stderr, "usage: nestedvmxbench [-n random cases] [-s seed]\n");
+		return 2;
+	}
+
+	for (i = 0; (Flags = NvmxFieldInfo(i, &Encoding)); i++)
+	{
+		Expect(!i || Encoding > Previous, "field table not sorted");
+		Expect(NvmxFieldIndex(Encoding) == i, "field lookup");
+		Kinds[Encoding] = Flags;
+		Previous = Encoding;
+	}
+
+	r = Checked;
+	CheckAccess(Cases);
+	printf("%-14s %9lu checked\n", "access", Checked - r);
+	r = Checked;
+	CheckMerge(Cases / 10);
+	printf("%-14s %9lu checked\n", "merge", Checked - r);
+	r = Checked;
+	CheckExit(Cases / 100);
+	printf("%-14s %9lu checked\n", "exit", Checked - r);
+	r = Checked;
+	CheckShadow(Cases / 100);
+	printf("%-14s %9lu checked\n", "shadow", Checked - r);
+	r = Checked;
+	CheckRouting(Cases / 100);
+	printf("%-14s %9lu checked\n", "routing", Checked - r);
+	if (Failed)
+	{
+		printf("%lu of %lu checks FAILED\n", Failed, Checked);
+		return 1;
+	}
+
+	Bench();
+	return 0;
+}
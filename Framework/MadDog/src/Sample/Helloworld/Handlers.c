@@ -150,16 +150,16 @@ NTSTATUS HvmSetupVMControlBlock (
     VmxFillGuestSelectorData (GdtBase, TR, GetTrSelector ());
 
     // LDTR/TR bases have been set in VmxFillGuestSelectorData()
-    VmxWrite (GUEST_GDTR_BASE, (ULONG) GdtBase);
+    VmxWrite (GUEST_GDTR_BASE, (ULONG_PTR) GdtBase);
     VmxWrite (GUEST_IDTR_BASE, GetIdtBase ());
 
     VmxWrite (GUEST_DR7, 0x400);
-    VmxWrite (GUEST_RSP, (ULONG) GuestEsp);     //setup guest sp
-    VmxWrite (GUEST_RIP, (ULONG) GuestEip);     //setup guest ip:CmSlipIntoMatrix
+    VmxWrite (GUEST_RSP, (ULONG_PTR) GuestEsp);     //setup guest sp
+    VmxWrite (GUEST_RIP, (ULONG_PTR) GuestEip);     //setup guest ip:CmSlipIntoMatrix
     VmxWrite (GUEST_RFLAGS, RegGetRflags ());
     //VmxWrite(GUEST_PENDING_DBG_EXCEPTIONS, 0);//no init
-    VmxWrite (GUEST_SYSENTER_ESP, (ULONG)MsrRead (MSR_IA32_SYSENTER_ESP));
-    VmxWrite (GUEST_SYSENTER_EIP, (ULONG)MsrRead (MSR_IA32_SYSENTER_EIP));
+    VmxWrite (GUEST_SYSENTER_ESP, (ULONG_PTR)MsrRead (MSR_IA32_SYSENTER_ESP));
+    VmxWrite (GUEST_SYSENTER_EIP, (ULONG_PTR)MsrRead (MSR_IA32_SYSENTER_EIP));
 
     /* HOST State Fields. */
     VmxWrite (HOST_CR0, RegGetCr0 ());
@@ -192,8 +192,8 @@ NTSTATUS HvmSetupVMControlBlock (
     VmxWrite(HOST_GDTR_BASE, GetGdtBase());
     VmxWrite(HOST_IDTR_BASE, GetIdtBase());
 
-    VmxWrite (HOST_IA32_SYSENTER_ESP, (ULONG)MsrRead (MSR_IA32_SYSENTER_ESP));
-    VmxWrite (HOST_IA32_SYSENTER_EIP, (ULONG)MsrRead (MSR_IA32_SYSENTER_EIP));
+    VmxWrite (HOST_IA32_SYSENTER_ESP, (ULONG_PTR)MsrRead (MSR_IA32_SYSENTER_ESP));
+    VmxWrite (HOST_IA32_SYSENTER_EIP, (ULONG_PTR)MsrRead (MSR_IA32_SYSENTER_EIP));
 
 	return STATUS_SUCCESS;
 }
@@ -1,16 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <windows.h>
+#include <winioctl.h>
 
 #define START_RECORDING		1000 //Used to tell the hypervisor to start run the target program
 #define PING				1500 //Used to retrieve data while the target program is still running
 #define END_RECORDING		2000 //Used to tell the hypervisor the target program should be killed
 #define TEST_PASSINVALUE	8888 //Only Used in Debug Mode. Hypervisor won't change its current recording state.
+#define BROADCAST			0x42434153 //ECX value asking the hypervisor to apply START/END_RECORDING to all cores
+#define DEVICE_PATH			"\\\\.\\ContextCounter" //Control device of the driver
+#define IOCTL_CC_LOOKUP_CR3	CTL_CODE (FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS) //In: pid, out: its CR3
 
 typedef struct _Parameter
 {
 	//monitor the indicated process, 0 means all processes. 
 	ULONG32 pid;
+	ULONG32 Cr3;//CR3 of <pid>, from the driver, 0 if there is no such process
 } Parameter,*PParameter;
 
 typedef struct _Result
@@ -18,57 +23,121 @@ typedef struct _Result
 	ULONG32 pid;
 } Result, *PResult;
 
-unsigned int numCore;
+/**
+ * Ask the driver for the CR3 of process <pid>. The hypervisor must not walk the process list of the
+ * guest OS from a VM Exit, so the client resolves the pid and passes the CR3 in the hypercall.
+ * Return: the CR3, 0 if there is no such process or the driver is not loaded.
+ */
+ULONG32 LookupProcessCr3 (ULONG32 pid) {
+	HANDLE Device;
+	ULONG32 Cr3 = 0;
+	DWORD Bytes;
+
+	Device = CreateFileA (DEVICE_PATH, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (Device == INVALID_HANDLE_VALUE)
+		return 0;
+	if (!DeviceIoControl (Device, IOCTL_CC_LOOKUP_CR3, &pid, sizeof (pid), &Cr3, sizeof (Cr3), &Bytes, NULL))
+		Cr3 = 0;
+	CloseHandle (Device);
+	return Cr3;
+}
+
+static volatile LONG KickDone;
+
+/**
+ * Make every core take a VM Exit, over and over until <KickDone> is set. A broadcast only reaches a
+ * core at its next VM Exit and the hypervisor keeps no timer running on idle cores, so the client
+ * runs this while its broadcast is pending. CPUID leaf 0 always exits and is otherwise harmless.
+ */
+DWORD WINAPI KickCores (LPVOID Parameter) {
+	SYSTEM_INFO si;
+	DWORD i;
+
+	GetSystemInfo(&si);
+	while (!KickDone) {
+		for (i = 0; i < si.dwNumberOfProcessors && !KickDone; i++) {
+			SetThreadAffinityMask (GetCurrentThread (), (DWORD_PTR)1 << i);
+			__asm {
+				push ebx
+				xor eax, eax
+				cpuid
+				pop ebx
+			}
+		}
+		Sleep (1);
+	}
+	return 0;
+}
 
 /**
  * Pass <pParameter> Argument to Context Counter
- * Return: The virtual address of result struct.
- * The content of the structure <pParameter> points to will be copied to the kernel memory.
+ * Return: The 64-bit result of the hypercall, from EDX:EAX.
+ * The pid and CR3 in <pParameter> are passed in EDX and EBX.
  * <actionType>:either to be START_RECORD or END_RECORD or PING
+ * START_RECORD and END_RECORD are broadcast by the hypervisor to every core, so a single CPUID
+ * from any core is enough; <pCores> and <pCoreMask> receive the cores which handled it. KickCores
+ * runs meanwhile, so that idle cores answer it.
  */
-ULONG32 __stdcall HyperCall (ULONG32 actionType, PParameter pParameter) {
+ULONG64 __stdcall HyperCall (ULONG32 actionType, PParameter pParameter, ULONG32 *pCores, ULONG32 *pCoreMask) {
 	ULONG32 SavedEax;
+	ULONG32 SavedEbx;
+	ULONG32 SavedEcx;
 	ULONG32 SavedEdx;
-	unsigned int cProcessorNumber;
-	HANDLE hProcess = GetCurrentProcess(); 
-	DWORD dwProcessAffinityMask, dwSystemAffinityMask; 
-	GetProcessAffinityMask( hProcess, &dwProcessAffinityMask, &dwSystemAffinityMask ); 
+	ULONG32 Pid = pParameter->pid;
+	ULONG32 Cr3 = pParameter->Cr3;
+	HANDLE Kicker;
 
-	for (cProcessorNumber = 0; cProcessorNumber < numCore; cProcessorNumber++) 
-	{
-		//KeSetSystemAffinityThread ((KAFFINITY) (1 << cProcessorNumber));
-		SetProcessAffinityMask( hProcess, (ULONG)(1<<cProcessorNumber) );
-		__asm { 
-			mov eax, actionType; get <actionType> value
-			mov edx, pParameter; get pParameter value
-			cpuid	
-			mov SavedEax,eax;
-			mov SavedEdx,edx;
-		}
-	}
-	//SetProcessAffinityMask(hProcess, dwProcessAffinityMask);
+	KickDone = 0;
+	Kicker = CreateThread (NULL, 0, KickCores, NULL, 0, NULL);
 	__asm { 
-		mov eax,SavedEax;
-		mov edx,SavedEdx; //Restore the result returned by cpuid instruction	
+		push ebx
+		mov eax, actionType; get <actionType> value
+		mov edx, Pid
+		mov ebx, Cr3
+		mov ecx, BROADCAST
+		cpuid	
+		mov SavedEax,eax;
+		mov SavedEbx,ebx;
+		mov SavedEcx,ecx;
+		mov SavedEdx,edx;
+		pop ebx
+	}
+	InterlockedExchange (&KickDone, 1);
+	if (Kicker) {
+		WaitForSingleObject (Kicker, INFINITE);
+		CloseHandle (Kicker);
 	}
-	return;
+	if (pCores)
+		*pCores = SavedEcx;
+	if (pCoreMask)
+		*pCoreMask = SavedEbx;
+	return ((ULONG64)SavedEdx << 32) | SavedEax;
 }
 int main(int argc, char **argv) {
 	Parameter passin;
 	SYSTEM_INFO si;
-	if (argc != 2) {
-		printf ("ContextCounter <process id>\n");
+	ULONG64 sysenters;
+	ULONG32 cores, coreMask, seconds;
+	if (argc != 2 && argc != 3) {
+		printf ("ContextCounter <process id> [seconds]\n");
 		return 0;
 	}
 	//Retrieve Global Environment Configurations - Get Total Core Number.
 	GetSystemInfo(&si);
-  	numCore = si.dwNumberOfProcessors;
 
 	//Construct Parameter struct
 	passin.pid = strtoul (argv[1], 0, 0);
+	passin.Cr3 = passin.pid ? LookupProcessCr3 (passin.pid) : 0;
+	if (passin.pid && !passin.Cr3)
+		printf ("No process %u, or the driver is not loaded: nothing will be counted\n", passin.pid);
+	seconds = argc == 3 ? strtoul (argv[2], 0, 0) : 10;
 	
 	__try {
-	ULONG32 resultVadr = HyperCall(TEST_PASSINVALUE,&passin); 
+		HyperCall(START_RECORDING, &passin, &cores, &coreMask); 
+		printf ("Recording on %u of %u cores (mask 0x%x)\n", cores, si.dwNumberOfProcessors, coreMask);
+		Sleep (seconds * 1000);
+		sysenters = HyperCall(END_RECORDING, &passin, &cores, &coreMask); 
+		printf ("%I64u sysenters in %u seconds, from %u cores (mask 0x%x)\n", sysenters, seconds, cores, coreMask);
 	} __except (EXCEPTION_EXECUTE_HANDLER) {
 		printf ("CPUDID caused exception");
 		return 0;
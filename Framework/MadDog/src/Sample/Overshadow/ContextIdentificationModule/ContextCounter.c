@@ -1,16 +1,162 @@
 #include "ContextCounter.h"
+#include "ContextTable.h"
+#include "WorkingSet.h"
 
 //extern PHYSICAL_ADDRESS g_PageMapBasePhysicalAddress;
 //extern BOOLEAN g_bDisableComOutput;
 
+static VOID CcAccountExit (
+  PCPU Cpu,
+  ULONG32 ExitReason,
+  ULONG32 GuestCr3,
+  ULONG64 EntryTsc,
+  ULONG64 LeaveTsc
+);
+
+static PDEVICE_OBJECT CcDevice;
+
 static MadDog_Control md_Control = 
 {
 	NULL,
 	NULL,
 	&HvmSetupVMControlBlock,
-	&VmxRegisterTraps
+	&VmxRegisterTraps,
+	&CcAccountExit
 };
 
+/**
+ * effects: Charge the exit to its context, then give the working-set sampler its slice if one is due.
+ */
+static VOID CcAccountExit (
+  PCPU Cpu,
+  ULONG32 ExitReason,
+  ULONG32 GuestCr3,
+  ULONG64 EntryTsc,
+  ULONG64 LeaveTsc
+)
+{
+	CtAccountExit (Cpu, ExitReason, GuestCr3, EntryTsc, LeaveTsc);
+	WsRunSlice (Cpu, LeaveTsc);
+}
+
+/**
+ * effects: Look up the CR3 of process <Pid> for the client. Runs in the client's thread at
+ * PASSIVE_LEVEL, outside VMX root, so the process list of the guest OS can be used.
+ */
+static NTSTATUS NTAPI CcLookupProcessCr3 (
+  ULONG32 Pid,
+  PULONG32 Cr3
+)
+{
+	PEPROCESS Process;
+	NTSTATUS Status;
+
+	Status = PsLookupProcessByProcessId ((HANDLE)Pid, &Process);
+	if (!NT_SUCCESS (Status))
+		return Status;
+	*Cr3 = *(PULONG32)((PUCHAR)Process + KPROCESS_DIRECTORY_TABLE_BASE) & CC_CR3_MASK;
+	ObDereferenceObject (Process);
+	Print(("ContextCounter: Process %d, CR3:%x\n", Pid, *Cr3));
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS CcDispatchCreateClose (
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
+)
+{
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS CcDispatchIoctl (
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
+)
+{
+    PIO_STACK_LOCATION Stack = IoGetCurrentIrpStackLocation (Irp);
+    PULONG32 Buffer = (PULONG32) Irp->AssociatedIrp.SystemBuffer;
+    NTSTATUS Status;
+
+    Irp->IoStatus.Information = 0;
+    switch (Stack->Parameters.DeviceIoControl.IoControlCode)
+    {
+    case IOCTL_CC_LOOKUP_CR3:
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength < sizeof (ULONG32) ||
+            Stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof (ULONG32))
+        {
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        Status = CcLookupProcessCr3 (Buffer[0], &Buffer[0]);
+        if (NT_SUCCESS (Status))
+            Irp->IoStatus.Information = sizeof (ULONG32);
+        break;
+    case IOCTL_CC_WS_TRACK:
+    case IOCTL_CC_WS_UNTRACK:
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength < sizeof (ULONG32))
+        {
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        if (Stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_CC_WS_TRACK)
+            Status = WsTrack (Buffer[0]);
+        else
+            Status = WsUntrack (Buffer[0]);
+        break;
+    default:
+        Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+    return Status;
+}
+
+/**
+ * effects: Create the control device the client sends its guest-side requests to.
+ */
+static NTSTATUS CcCreateDevice (
+    PDRIVER_OBJECT DriverObject
+)
+{
+    UNICODE_STRING Name, Link;
+    NTSTATUS Status;
+
+    RtlInitUnicodeString (&Name, CC_DEVICE_NAME);
+    RtlInitUnicodeString (&Link, CC_DEVICE_LINK);
+    Status = IoCreateDevice (DriverObject, 0, &Name, FILE_DEVICE_UNKNOWN, 0, FALSE, &CcDevice);
+    if (!NT_SUCCESS (Status))
+        return Status;
+    Status = IoCreateSymbolicLink (&Link, &Name);
+    if (!NT_SUCCESS (Status))
+    {
+        IoDeleteDevice (CcDevice);
+        CcDevice = NULL;
+        return Status;
+    }
+
+    DriverObject->MajorFunction[IRP_MJ_CREATE] = CcDispatchCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLOSE] = CcDispatchCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = CcDispatchIoctl;
+    return STATUS_SUCCESS;
+}
+
+static VOID CcDeleteDevice (
+)
+{
+    UNICODE_STRING Link;
+
+    if (!CcDevice)
+        return;
+    RtlInitUnicodeString (&Link, CC_DEVICE_LINK);
+    IoDeleteSymbolicLink (&Link);
+    IoDeleteDevice (CcDevice);
+    CcDevice = NULL;
+}
+
 NTSTATUS DriverUnload (
     PDRIVER_OBJECT DriverObject
 )
@@ -28,6 +174,9 @@ NTSTATUS DriverUnload (
         return Status;
     }
 
+    CcDeleteDevice();
+    CtFinalize();
+    WsFinalize();
     Print(("NEWBLUEPILL: Unloading finished\n"));
 
 	PrintInfoDispose();
@@ -65,10 +214,18 @@ NTSTATUS DriverEntry (
     }
 	Print(("HELLOWORLD: Successful in execute HvmInit()"));
 
+    if (!NT_SUCCESS (Status = CcCreateDevice(DriverObject))) 
+    {
+        Print(("HELLOWORLD: CcCreateDevice() failed with status 0x%08hX\n", Status));
+		PrintInfoDispose();
+		return Status;
+    }
+
 
     if (!NT_SUCCESS (Status = MadDog_InstallHypervisor(&md_Control))) //<------------------1 Finish
     {
         Print(("HELLOWORLD: InstallHypervisor() failed with status 0x%08hX\n", Status));
+        CcDeleteDevice();
 		PrintInfoDispose();
 		return Status;
     }
@@ -0,0 +1,273 @@
+#include "ContextTable.h"
+
+static PCT_CORE CtCores[CoreCount];
+
+//Scratch for CtExportContexts(), the last entry collects what does not fit. Guarded by CtLock,
+//the hypercall may run on several cores at once.
+static CT_CONTEXT CtMerged[CT_SLOTS + 1];
+static volatile LONG CtLock;
+
+static VOID NTAPI CtAcquire (
+)
+{
+	while (InterlockedCompareExchange (&CtLock, 1, 0) != 0)
+		;
+}
+
+static VOID NTAPI CtRelease (
+)
+{
+	InterlockedExchange (&CtLock, 0);
+}
+
+/**
+ * effects: Check that every page of <Buffer> is present in the current address space.
+ */
+static BOOLEAN NTAPI CtIsBufferPresent (
+  PUCHAR Buffer,
+  ULONG32 Size
+)
+{
+	PUCHAR Page;
+
+	for (Page = (PUCHAR) PAGE_ALIGN (Buffer); Page < Buffer + Size; Page += PAGE_SIZE)
+	{
+		if (!MmIsAddressValid (Page))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * effects: Add the counters of <From> to <To>.
+ */
+static VOID NTAPI CtMergeContext (
+  PCT_CONTEXT To,
+  PCT_CONTEXT From
+)
+{
+	ULONG32 i;
+
+	if (!To->FirstSeen || (From->FirstSeen && From->FirstSeen < To->FirstSeen))
+		To->FirstSeen = From->FirstSeen;
+	if (From->LastSeen > To->LastSeen)
+		To->LastSeen = From->LastSeen;
+	To->Exits += From->Exits;
+	To->GuestTsc += From->GuestTsc;
+	To->HypervisorTsc += From->HypervisorTsc;
+	for (i = 0; i < CT_EXIT_REASONS; i++)
+		To->ExitsByReason[i] += From->ExitsByReason[i];
+}
+
+/**
+ * effects: Find <Cr3> in <Table>, inserting it if absent.
+ * With a <Core>, a context unseen for CT_DEAD_TSC on the probe path is recycled when there is no
+ * free slot before it: its counters go to Core->Retired. Slots are never emptied, so the probe
+ * runs of other CR3s stay intact.
+ * returns: NULL if the table is full.
+ */
+static PCT_CONTEXT NTAPI CtFindContext (
+  PCT_CONTEXT Table,
+  ULONG32 Cr3,
+  PCT_CORE Core,
+  ULONG64 Now
+)
+{
+	PCT_CONTEXT Entry, Victim = NULL;
+	ULONG32 i, Slot;
+
+	Slot = (Cr3 >> 5) % CT_SLOTS;
+	for (i = 0; i < CT_SLOTS; i++)
+	{
+		Entry = &Table[Slot];
+		if (Entry->Cr3 == Cr3)
+			return Entry;
+		if (Entry->Cr3 == 0)
+		{
+			if (!Victim)
+				Victim = Entry;
+			break;
+		}
+		if (Core && !Victim && Entry != Core->Current && Now - Entry->LastSeen > CT_DEAD_TSC)
+			Victim = Entry;
+		Slot = (Slot + 1) % CT_SLOTS;
+	}
+	if (!Victim)
+		return NULL;
+
+	if (Victim->Cr3)
+		CtMergeContext(&Core->Retired, Victim);
+	RtlZeroMemory (Victim, sizeof (CT_CONTEXT));
+	Victim->Cr3 = Cr3;
+	Victim->FirstSeen = Now;
+	Victim->LastSeen = Now;
+	return Victim;
+}
+
+/**
+ * effects: Make <Cr3> the current context of <Core>. Usually just a compare.
+ */
+static PCT_CONTEXT NTAPI CtCurrentContext (
+  PCT_CORE Core,
+  ULONG32 Cr3,
+  ULONG64 Now
+)
+{
+	PCT_CONTEXT Context;
+
+	if (Core->Current && Core->Current->Cr3 == Cr3)
+		return Core->Current;
+	Context = CtFindContext(Core->Contexts, Cr3, Core, Now);
+	Core->Current = Context ? Context : &Core->Retired;
+	return Core->Current;
+}
+
+NTSTATUS NTAPI CtInitializeCore (
+  PCPU Cpu
+)
+{
+	PCT_CORE Core;
+
+	if (Cpu->ProcessorNumber >= CoreCount)
+		return STATUS_INVALID_PARAMETER;
+	if (CtCores[Cpu->ProcessorNumber])
+		return STATUS_SUCCESS;
+
+	Core = ExAllocatePoolWithTag (NonPagedPool, sizeof (CT_CORE), LAB_TAG);
+	if (!Core)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory (Core, sizeof (CT_CORE));
+	CtCores[Cpu->ProcessorNumber] = Core;
+	return STATUS_SUCCESS;
+}
+
+VOID NTAPI CtFinalize (
+)
+{
+	ULONG32 i;
+
+	for (i = 0; i < CoreCount; i++)
+	{
+		if (CtCores[i])
+			ExFreePoolWithTag (CtCores[i], LAB_TAG);
+		CtCores[i] = NULL;
+	}
+}
+
+VOID CtAccountExit (
+  PCPU Cpu,
+  ULONG32 ExitReason,
+  ULONG32 GuestCr3,
+  ULONG64 EntryTsc,
+  ULONG64 LeaveTsc
+)
+{
+	PCT_CORE Core;
+	PCT_CONTEXT Context;
+
+	if (Cpu->ProcessorNumber >= CoreCount || !(Core = CtCores[Cpu->ProcessorNumber]))
+		return;
+
+	ExitReason &= 0xffff;//Basic exit reason
+	if (ExitReason >= CT_EXIT_REASONS)
+		ExitReason = CT_EXIT_REASONS - 1;
+
+	//The guest ran with <GuestCr3> since the previous exit. Time spent in the VM Exit/Entry
+	//transitions themselves is not visible from here and is counted as guest time.
+	Context = CtCurrentContext(Core, GuestCr3 & CC_CR3_MASK, EntryTsc);
+	if (Core->LastLeaveTsc)
+		Context->GuestTsc += EntryTsc - Core->LastLeaveTsc;
+	Context->HypervisorTsc += LeaveTsc - EntryTsc;
+	Context->Exits++;
+	Context->ExitsByReason[ExitReason]++;
+	Context->LastSeen = LeaveTsc;
+
+	//A MOV to CR3 in this exit, the guest resumes in the new address space.
+	if (Core->NextCr3)
+	{
+		CtCurrentContext(Core, Core->NextCr3, LeaveTsc)->LastSeen = LeaveTsc;
+		Core->NextCr3 = 0;
+	}
+	Core->LastLeaveTsc = LeaveTsc;
+}
+
+VOID NTAPI CtSwitchContext (
+  PCPU Cpu,
+  ULONG32 NewCr3
+)
+{
+	PCT_CORE Core;
+
+	if (Cpu->ProcessorNumber >= CoreCount || !(Core = CtCores[Cpu->ProcessorNumber]))
+		return;
+
+	//Applied by CtAccountExit() once this exit has been charged to the old CR3.
+	Core->NextCr3 = NewCr3 & CC_CR3_MASK;
+}
+
+ULONG32 NTAPI CtExportContexts (
+  PCT_CONTEXT Buffer,
+  ULONG32 Capacity
+)
+{
+	PCT_CONTEXT Retired = &CtMerged[CT_SLOTS], Entry;
+	ULONG32 i, j, Count, Size;
+	ULONG HostCr3;
+	BOOLEAN Present;
+
+	CtAcquire ();
+	RtlZeroMemory (CtMerged, sizeof (CtMerged));
+
+	//Other cores keep running, their numbers are a snapshot.
+	for (i = 0; i < CoreCount; i++)
+	{
+		if (!CtCores[i])
+			continue;
+		CtMergeContext(Retired, &CtCores[i]->Retired);
+		for (j = 0; j < CT_SLOTS; j++)
+		{
+			if (!CtCores[i]->Contexts[j].Cr3)
+				continue;
+			Entry = CtFindContext(CtMerged, CtCores[i]->Contexts[j].Cr3, NULL, 0);
+			CtMergeContext(Entry ? Entry : Retired, &CtCores[i]->Contexts[j]);
+		}
+	}
+
+	//Pack the used entries, the evicted ones (Cr3 0) last.
+	Count = 0;
+	for (i = 0; i <= CT_SLOTS; i++)
+	{
+		if (i < CT_SLOTS ? !CtMerged[i].Cr3 : !CtMerged[i].Exits)
+			continue;
+		if (i != Count)
+			CtMerged[Count] = CtMerged[i];
+		Count++;
+	}
+
+	if (!Buffer || !Capacity)
+	{
+		CtRelease ();
+		return Count;
+	}
+	Size = (Count < Capacity ? Count : Capacity) * sizeof (CT_CONTEXT);
+	if ((ULONG)Buffer + Size < (ULONG)Buffer || (ULONG)Buffer + Size > (ULONG)MM_USER_PROBE_ADDRESS)
+	{
+		CtRelease ();
+		HvmPrint(("CtExportContexts(): Bad buffer %x\n", Buffer));
+		return Count;
+	}
+
+	//<Buffer> is a user address of the caller, only mapped in the guest address space. A page
+	//the guest has paged out would fault in VMX root, so nothing is copied then.
+	HostCr3 = RegGetCr3 ();
+	RegSetCr3 ((ULONG)VmxRead (GUEST_CR3));
+	Present = CtIsBufferPresent ((PUCHAR)Buffer, Size);
+	if (Present)
+		RtlCopyMemory (Buffer, CtMerged, Size);
+	RegSetCr3 (HostCr3);
+	CtRelease ();
+
+	if (!Present)
+		HvmPrint(("CtExportContexts(): Buffer %x is not present\n", Buffer));
+	return Count;
+}
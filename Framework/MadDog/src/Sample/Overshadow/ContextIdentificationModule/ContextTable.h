@@ -0,0 +1,86 @@
+#pragma once
+
+#include <ntddk.h>
+#include "HvCore.h"
+#include "Vmxtraps.h"
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define CT_SLOTS				256	//Guest address spaces remembered per core
+#define CT_EXIT_REASONS			64	//Basic exit reasons counted one by one, higher ones share the last counter
+#define CT_DEAD_TSC				((ULONG64)30 * 1000000000)	//A CR3 unseen for this long may be evicted (~10s at 3GHz)
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * Everything known about one guest address space. This is also the record the
+ * CONTEXT_TABLE_EAX hypercall copies out, keep the client in sync.
+ * All times are TSC values or TSC deltas.
+ */
+typedef struct _CT_CONTEXT
+{
+	ULONG32 Cr3;//0 means free, or the contexts evicted from the table
+	ULONG32 Exits;
+	ULONG64 FirstSeen;
+	ULONG64 LastSeen;
+	ULONG64 GuestTsc;//Time the guest ran with this CR3
+	ULONG64 HypervisorTsc;//Time spent in HvmEventCallback() for exits from this CR3
+	ULONG32 ExitsByReason[CT_EXIT_REASONS];
+} CT_CONTEXT,*PCT_CONTEXT;
+
+/**
+ * Per-core open-addressing table keyed by CR3. Only the owning core writes it, so no locking;
+ * the export merges the tables of all cores.
+ */
+typedef struct _CT_CORE
+{
+	PCT_CONTEXT Current;//Context of the CR3 the guest is running with
+	ULONG64 LastLeaveTsc;//When this core last returned to the guest
+	ULONG32 NextCr3;//Set by CtSwitchContext() during a MOV to CR3 exit, 0 otherwise
+	CT_CONTEXT Retired;//Sum of the contexts evicted from, or not fitting into, <Contexts>
+	CT_CONTEXT Contexts[CT_SLOTS];
+} CT_CORE,*PCT_CORE;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Allocate the context table of <Cpu>. Called before the core is subverted.
+ */
+NTSTATUS NTAPI CtInitializeCore (
+  PCPU Cpu
+);
+
+/**
+ * effects: Free the context tables. Only call this after the hypervisor has been removed.
+ */
+VOID NTAPI CtFinalize (
+);
+
+/**
+ * effects: MadDog_Control.AccountExit callback, charges one VM Exit and the guest run before
+ * it to the context of <GuestCr3>.
+ */
+VOID CtAccountExit (
+  PCPU Cpu,
+  ULONG32 ExitReason,
+  ULONG32 GuestCr3,
+  ULONG64 EntryTsc,
+  ULONG64 LeaveTsc
+);
+
+/**
+ * effects: Called on MOV to CR3, makes <NewCr3> the current context of <Cpu>.
+ */
+VOID NTAPI CtSwitchContext (
+  PCPU Cpu,
+  ULONG32 NewCr3
+);
+
+/**
+ * effects: Merge the tables of all cores and copy up to <Capacity> contexts to the guest buffer
+ * <Buffer>, which must be resident. A context with Cr3 0 stands for the evicted ones.
+ * returns: The number of merged contexts, which may exceed <Capacity>.
+ */
+ULONG32 NTAPI CtExportContexts (
+  PCT_CONTEXT Buffer,
+  ULONG32 Capacity
+);
@@ -1,11 +1,20 @@
 #include "vmxtraps.h"
+#include "ContextTable.h"
+#include "WorkingSet.h"
 
 BOOLEAN StartRecording[CoreCount];
 Parameter g_CommandInfo;
-static ULONG lock;//This is used as a spin-lock in CcFakeSysenterTrap()
-static ULONG plock;//Points to the <lock> variable
+static BOOLEAN CcFilterByProcess;//TRUE when g_CommandInfo.pid is not 0
+static ULONG32 CcFilterCr3;//CR3 of g_CommandInfo.pid, 0 if the client could not resolve the pid
 
+//Per-core counters, allocated on the first START_RECORDING of each core and reused afterwards.
+static PCC_CPU_BLOCK CcCpuBlocks[CoreCount];
+
+//Totals over all cores, rebuilt by CcAggregateCounters().
 ULONG64 CcSysenterTimes;//Record Sysenter instruction happen times.
+static ULONG64 CcServiceTimes[CC_SERVICE_BUCKETS];
+static CC_PROCESS_ENTRY CcProcessTimes[CC_PROCESS_SLOTS];
+static ULONG64 CcLostTimes;
 
 //MSR backup
 ULONG32 CcOriginSysenterEIP[CoreCount];
@@ -23,10 +32,57 @@ static NTSTATUS NTAPI CcDestroySysenterTrap(int cProcessorNumber);
 
 /**
  * When start recording, This function is used to initialize the members which is important 
- * in all recording-related scenrios.
+ * in all recording-related scenrios. The parameters come in EDX (pid) and EBX (its CR3).
  */
 static VOID NTAPI GeneralInitialization(PGUEST_REGS GuestRegs);
 
+/**
+ * Returns the entry of <Cr3> in <Table>, inserting it if needed. NULL if the table is full.
+ */
+static PCC_PROCESS_ENTRY NTAPI CcFindProcess(PCC_PROCESS_ENTRY Table, ULONG32 Cr3);
+
+/**
+ * Charges the SYSENTERs counted since the last CR3 switch to the current process of <Counters>.
+ */
+static VOID NTAPI CcChargeProcess(PCC_COUNTERS Counters);
+
+/**
+ * Called on every MOV to CR3 of core <cProcessorNumber>. Closes the time slice of the outgoing
+ * process and decides whether SYSENTERs of the incoming one are counted.
+ */
+static VOID NTAPI CcSwitchProcess(ULONG32 cProcessorNumber, ULONG32 NewCr3);
+
+/**
+ * Sums the counters of all cores into CcSysenterTimes, CcServiceTimes and CcProcessTimes.
+ */
+static VOID NTAPI CcAggregateCounters();
+
+/**
+ * Prints the totals built by CcAggregateCounters().
+ */
+static VOID NTAPI CcReportCounters();
+
+/**
+ * Allocate the counters of <Cpu> before it is subverted, so that starting a recording never
+ * allocates memory from inside a VM Exit.
+ */
+static NTSTATUS NTAPI CcInitializeCore(PCPU Cpu);
+
+/**
+ * Broadcast handlers of START_RECORDING and END_RECORDING, run once on every core.
+ * CcStartOnCore() returns 1 if the core records, CcEndOnCore() the SYSENTERs it counted.
+ */
+static ULONG64 NTAPI CcStartOnCore(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 Argument);
+static ULONG64 NTAPI CcEndOnCore(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 Argument);
+
+/**
+ * Handles a START/END_RECORDING knock with ECX == BROADCAST_ECX. Returns FALSE, so that the guest
+ * executes CPUID again, until every core has answered.
+ * On return EAX:EDX holds the aggregated result, ECX the number of cores and EBX their mask.
+ */
+static BOOLEAN NTAPI CcBroadcast(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 fn);
+static ULONG32 CcBroadcastFn;//Knock whose broadcast is in flight, 0 if none
+
 static BOOLEAN NTAPI VmxDispatchCpuid (
   PCPU Cpu,
   PGUEST_REGS GuestRegs,
@@ -80,19 +136,32 @@ NTSTATUS NTAPI VmxRegisterTraps (
   NTSTATUS Status;
   PNBP_TRAP Trap;
 
-  // used to set dummy handler for all VMX intercepts when we compile without nested support
+  // VMCALL is not one of the VMX instructions PtVmxNestedInitialize() emulates
   ULONG32 i, TableOfVmxExits[] = {
-    EXIT_REASON_VMCALL,
-    EXIT_REASON_VMCLEAR,
-    EXIT_REASON_VMLAUNCH,
-    EXIT_REASON_VMRESUME,
-    EXIT_REASON_VMPTRLD,
-    EXIT_REASON_VMPTRST,
-    EXIT_REASON_VMREAD,
-    EXIT_REASON_VMWRITE,
-    EXIT_REASON_VMXON,
-    EXIT_REASON_VMXOFF
+    EXIT_REASON_VMCALL
   };
+
+  Status = CcInitializeCore (Cpu);
+  if (!NT_SUCCESS (Status)) 
+  {
+    HvmPrint(("VmxRegisterTraps(): Failed to allocate the sysenter counters with status 0x%08hX\n", Status));
+    return Status;
+  }
+
+  Status = CtInitializeCore (Cpu);
+  if (!NT_SUCCESS (Status)) 
+  {
+    HvmPrint(("VmxRegisterTraps(): Failed to allocate the context table with status 0x%08hX\n", Status));
+    return Status;
+  }
+
+  Status = WsInitialize ();
+  if (!NT_SUCCESS (Status)) 
+  {
+    HvmPrint(("VmxRegisterTraps(): Failed to allocate the working-set bitmaps with status 0x%08hX\n", Status));
+    return Status;
+  }
+
     Status = MadDog_InitializeGeneralTrap ( //<----------------4.1 Finish
         Cpu, 
         EXIT_REASON_CPUID, 
@@ -179,7 +248,7 @@ NTSTATUS NTAPI VmxRegisterTraps (
   }
   MadDog_RegisterTrap (Cpu, Trap);
 
-  // set dummy handler for all VMX intercepts if we compile without nested support
+  // set dummy handler for the VMX intercepts left to this sample
   for (i = 0; i < sizeof (TableOfVmxExits) / sizeof (ULONG32); i++) 
   {
       Status = MadDog_InitializeGeneralTrap (
@@ -197,6 +266,14 @@ NTSTATUS NTAPI VmxRegisterTraps (
     MadDog_RegisterTrap (Cpu, Trap);
   }
 
+  // the guest may run a hypervisor of its own
+  Status = PtVmxNestedInitialize (Cpu);
+  if (!NT_SUCCESS (Status)) 
+  {
+    Print(("VmxRegisterTraps(): Failed to initialize nested VMX with status 0x%08hX\n", Status));
+    return Status;
+  }
+
   return STATUS_SUCCESS;
 }
 
@@ -218,6 +295,8 @@ static BOOLEAN NTAPI VmxDispatchCpuid (
 	ULONG inst_len;
 	ULONG32 cProcessorNumber;
 	NTSTATUS status;
+	BOOLEAN Recording;
+	ULONG32 i;
 	if (!Cpu || !GuestRegs)
 	return TRUE;
 	fn = GuestRegs->eax;
@@ -230,7 +309,11 @@ static BOOLEAN NTAPI VmxDispatchCpuid (
 	if (Trap->General.RipDelta == 0)
 	Trap->General.RipDelta = inst_len;
 
-	if (fn == START_RECORDING_EAX) //Start Recording
+	if ((fn == START_RECORDING_EAX || fn == END_RECORDING_EAX) && GuestRegs->ecx == BROADCAST_ECX)
+	{
+		return CcBroadcast(Cpu, GuestRegs, fn);
+	}
+	else if (fn == START_RECORDING_EAX) //Start Recording
 	{
 		cProcessorNumber = KeGetCurrentProcessorNumber();
 		HvmPrint(("Hypervisor: Start Recording\n"));
@@ -247,10 +330,31 @@ static BOOLEAN NTAPI VmxDispatchCpuid (
 			if(status == STATUS_SUCCESS)
 			{
 				StartRecording[cProcessorNumber] = TRUE;
-				CcSysenterTimes = 0;
 			}		
 		}		
 	}
+	else if(fn == CONTEXT_TABLE_EAX) //Export the per-CR3 context table
+	{
+		GuestRegs->eax = CtExportContexts((PCT_CONTEXT)GuestRegs->edx, GuestRegs->ecx);
+		return TRUE;
+	}
+	else if(fn == WS_EXPORT_EAX) //Working-set sampling, processes are added through IOCTL_CC_WS_TRACK
+	{
+		GuestRegs->eax = WsExportEstimates((PWS_ESTIMATE)GuestRegs->edx, GuestRegs->ecx);
+		return TRUE;
+	}
+	else if(fn == WS_TUNE_EAX)
+	{
+		WsTune((ULONG32)GuestRegs->ecx, (ULONG32)GuestRegs->edx, (ULONG64)GuestRegs->ebx << 20);
+		return TRUE;
+	}
+	else if(fn == PING_EAX) //Read the counters without stopping
+	{
+		CcAggregateCounters();
+		GuestRegs->eax = (ULONG32) CcSysenterTimes;
+		GuestRegs->edx = (ULONG32) (CcSysenterTimes>>32);
+		return TRUE;
+	}
 	else if(fn == END_RECORDING_EAX) //End Recording
 	{
 		cProcessorNumber = KeGetCurrentProcessorNumber();
@@ -268,6 +372,14 @@ static BOOLEAN NTAPI VmxDispatchCpuid (
 				StartRecording[cProcessorNumber] = FALSE;
 			}
 		}
+
+		//The client ends the recording core by core. The totals are final once the last core stops.
+		CcAggregateCounters();
+		Recording = FALSE;
+		for (i = 0; i < CoreCount; i++)
+			Recording |= StartRecording[i];
+		if (!Recording)
+			CcReportCounters();
 	
 		GuestRegs->eax = (ULONG32) CcSysenterTimes;
 		GuestRegs->edx = (ULONG32) (CcSysenterTimes>>32);
@@ -468,7 +580,7 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 {
     ULONG32 exit_qualification;
     ULONG32 gp, cr;
-    ULONG value;
+    ULONG_PTR value;
     ULONG inst_len;
 
     if (!Cpu || !GuestRegs)
@@ -553,7 +665,9 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 
         if (cr == 3) 
         {
-            Cpu->Vmx.GuestCR3 = *(((PULONG) GuestRegs) + gp);
+            Cpu->Vmx.GuestCR3 = *(((PULONG_PTR) GuestRegs) + gp);
+            CcSwitchProcess (Cpu->ProcessorNumber, Cpu->Vmx.GuestCR3);
+            CtSwitchContext (Cpu, Cpu->Vmx.GuestCR3);
 
             if (Cpu->Vmx.GuestCR0 & X86_CR0_PG)       //enable paging
             {
@@ -594,7 +708,7 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 #if DEBUG_LEVEL>2
             HvmPrint(("VmxDispatchCrAccess(): TYPE_MOV_FROM_CR cr3:0x%x\n", value));
 #endif
-            *(((PULONG32) GuestRegs) + gp) = (ULONG32) value;
+            *(((PULONG_PTR) GuestRegs) + gp) = (ULONG_PTR) value;
 
         }
         break;
@@ -613,53 +727,85 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
  */
 VOID NTAPI GeneralInitialization(PGUEST_REGS GuestRegs)
 {
-	plock=(ULONG)&lock;
-	
-	//Copy the Parameter Struct from user space to kernel space.
-	g_CommandInfo = *((PParameter)(GuestRegs->edx));
-	HvmPrint(("g_CommandInfo->pid value:%d",g_CommandInfo.pid));
+	//Passed in registers: this runs in VMX root, where neither the caller's memory nor the
+	//process list of the guest OS may be touched. The client resolved the CR3 in the guest.
+	g_CommandInfo.pid = (ULONG32) GuestRegs->edx;
+	g_CommandInfo.Cr3 = (ULONG32) GuestRegs->ebx & CC_CR3_MASK;
+	HvmPrint(("g_CommandInfo->pid value:%d, CR3:%x",g_CommandInfo.pid,g_CommandInfo.Cr3));
+
+	CcFilterByProcess = (g_CommandInfo.pid != 0);
+	CcFilterCr3 = CcFilterByProcess ? g_CommandInfo.Cr3 : 0;
+	if (CcFilterByProcess && !CcFilterCr3)
+		HvmPrint(("ContextCounter: No process %d, nothing will be counted\n",g_CommandInfo.pid));
 }
 
+/**
+ * SYSENTER lands here instead of KiFastCallEntry while recording. ESP is this core's
+ * GUEST_SYSENTER_ESP, i.e. the CC_COUNTERS of the core, so the counters are reached without a
+ * lock, an atomic or a shared cache line. Interrupts are off after SYSENTER and nothing else
+ * writes these counters while the guest runs on this core.
+ * The process filter costs one compare: the hypervisor updates <Match> when the core switches CR3.
+ * EFLAGS still holds the user flags that KiFastCallEntry saves, so it is preserved.
+ */
 void __declspec(naked) CcFakeSysenterTrap()
 {
-	
-	__asm{
-	loop_down:
-		lock	bts dword ptr [plock], 0
-		jb	loop_down; Acquire A Spin Lock
-	}
-
 	__asm{
-		push eax
-		push ebx
+		pushfd
 		push ecx
 		push edx
-	}
-
-	CcSysenterTimes++;
-
-	__asm{
+		lea ecx, [esp + 12]; ecx -> CC_COUNTERS of this core
+
+		cmp dword ptr [ecx]CC_COUNTERS.Match, 0
+		je done
+		add dword ptr [ecx]CC_COUNTERS.SysenterTimes, 1
+		adc dword ptr [ecx + 4]CC_COUNTERS.SysenterTimes, 0
+
+		mov edx, eax; Service number -> histogram bucket
+		test edx, CC_SERVICE_INVALID_MASK
+		jnz other
+		and edx, CC_SERVICES_PER_TABLE - 1
+		test eax, CC_SERVICE_TABLE_BIT
+		jz count
+		or edx, CC_SERVICES_PER_TABLE
+		jmp count
+	other:
+		mov edx, CC_SERVICE_OTHER
+	count:
+		inc dword ptr [ecx + edx * 4]CC_COUNTERS.ServiceHits
+
+	done:
 		pop edx
 		pop ecx
-		pop ebx
-		pop eax
-		lock	btr dword ptr [plock], 0; Release the Spin Lock
-		jmp CcOriginSysenterEIP[0]
+		popfd
+		jmp dword ptr [esp]CC_COUNTERS.OriginSysenterEIP
 	}
 }
 static NTSTATUS NTAPI CcSetupSysenterTrap(int cProcessorNumber)
 {
-	PVOID newSysenterESP;
+	PCC_CPU_BLOCK Block;
+	PCC_COUNTERS Counters;
 	
 	CcOriginSysenterEIP[cProcessorNumber] = VmxRead(GUEST_SYSENTER_EIP);
 	CcOriginSysenterESP[cProcessorNumber] = VmxRead(GUEST_SYSENTER_ESP);
 	HvmPrint(("In CcSetupSysenterTrap(): Core:%d, OriginSysenterEIP:%x\n",cProcessorNumber,CcOriginSysenterEIP[cProcessorNumber]));
 	HvmPrint(("In CcSetupSysenterTrap(): Core:%d, OriginSysenterESP:%x\n",cProcessorNumber,CcOriginSysenterESP[cProcessorNumber]));
-	newSysenterESP = ExAllocatePoolWithTag (NonPagedPool, 4 * PAGE_SIZE, LAB_TAG);
+
+	Block = CcCpuBlocks[cProcessorNumber];
+	if (!Block)
+	{
+		HvmPrint(("In CcSetupSysenterTrap(): Core:%d, No counters\n",cProcessorNumber));
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	Counters = &Block->Counters;
+	RtlZeroMemory (Counters, sizeof (CC_COUNTERS));
+	Counters->OriginSysenterEIP = CcOriginSysenterEIP[cProcessorNumber];
+	Counters->CurrentCr3 = (ULONG32) VmxRead (GUEST_CR3) & CC_CR3_MASK;
+	Counters->Match = !CcFilterByProcess || Counters->CurrentCr3 == CcFilterCr3;
 
 	//Begin to rewrite the entry in MSR
 	VmxWrite (GUEST_SYSENTER_EIP, (ULONG)&CcFakeSysenterTrap);
-	VmxWrite (GUEST_SYSENTER_ESP, newSysenterESP);
+	VmxWrite (GUEST_SYSENTER_ESP, (ULONG)Counters);
 
 	HvmPrint(("In CcSetupSysenterTrap(): Core:%d, NewSysenterEntry:%x\n",cProcessorNumber,VmxRead(GUEST_SYSENTER_EIP)));
 
@@ -680,9 +826,192 @@ static NTSTATUS NTAPI CcDestroySysenterTrap(int cProcessorNumber)
 		//Step 2. Replace the entry with the origin sysenter entry address.
 		VmxWrite (GUEST_SYSENTER_EIP,CcOriginSysenterEIP[cProcessorNumber]);
 		VmxWrite (GUEST_SYSENTER_ESP,CcOriginSysenterESP[cProcessorNumber]);
+		CcChargeProcess(&CcCpuBlocks[cProcessorNumber]->Counters);
 
 		return STATUS_SUCCESS;
 	}
 	HvmPrint(("ContextCounter: In CcDestroySysenterTrap(): Can't Restore origin sysenter entry, it has been substituded by other app.\n"));
 	return STATUS_UNSUCCESSFUL;
 }
+
+static PCC_PROCESS_ENTRY NTAPI CcFindProcess(PCC_PROCESS_ENTRY Table, ULONG32 Cr3)
+{
+	ULONG32 i, Slot;
+
+	Slot = (Cr3 >> 5) % CC_PROCESS_SLOTS;
+	for (i = 0; i < CC_PROCESS_SLOTS; i++)
+	{
+		if (Table[Slot].Cr3 == Cr3)
+			return &Table[Slot];
+		if (Table[Slot].Cr3 == 0)
+		{
+			Table[Slot].Cr3 = Cr3;
+			return &Table[Slot];
+		}
+		Slot = (Slot + 1) % CC_PROCESS_SLOTS;
+	}
+	return NULL;
+}
+
+static VOID NTAPI CcChargeProcess(PCC_COUNTERS Counters)
+{
+	PCC_PROCESS_ENTRY Entry;
+	ULONG64 Delta = Counters->SysenterTimes - Counters->AttributedTimes;
+
+	if (Delta == 0)
+		return;
+	Counters->AttributedTimes = Counters->SysenterTimes;
+	Entry = CcFindProcess(Counters->Processes, Counters->CurrentCr3);
+	if (Entry)
+		Entry->SysenterTimes += Delta;
+	else
+		Counters->LostTimes += Delta;
+}
+
+static VOID NTAPI CcSwitchProcess(ULONG32 cProcessorNumber, ULONG32 NewCr3)
+{
+	PCC_COUNTERS Counters;
+
+	if (cProcessorNumber >= CoreCount || !StartRecording[cProcessorNumber])
+		return;
+	Counters = &CcCpuBlocks[cProcessorNumber]->Counters;
+	CcChargeProcess(Counters);
+	Counters->CurrentCr3 = NewCr3 & CC_CR3_MASK;
+	Counters->Match = !CcFilterByProcess || Counters->CurrentCr3 == CcFilterCr3;
+}
+
+static VOID NTAPI CcAggregateCounters()
+{
+	PCC_COUNTERS Counters;
+	PCC_PROCESS_ENTRY Entry;
+	ULONG32 i, j;
+
+	CcSysenterTimes = 0;
+	CcLostTimes = 0;
+	RtlZeroMemory (CcServiceTimes, sizeof (CcServiceTimes));
+	RtlZeroMemory (CcProcessTimes, sizeof (CcProcessTimes));
+
+	//Other cores may still be counting, their numbers are a snapshot.
+	for (i = 0; i < CoreCount; i++)
+	{
+		if (!CcCpuBlocks[i])
+			continue;
+		Counters = &CcCpuBlocks[i]->Counters;
+		CcSysenterTimes += Counters->SysenterTimes;
+		CcLostTimes += Counters->LostTimes;
+		for (j = 0; j < CC_SERVICE_BUCKETS; j++)
+			CcServiceTimes[j] += Counters->ServiceHits[j];
+		for (j = 0; j < CC_PROCESS_SLOTS; j++)
+		{
+			if (Counters->Processes[j].Cr3 == 0)
+				continue;
+			Entry = CcFindProcess(CcProcessTimes, Counters->Processes[j].Cr3);
+			if (Entry)
+				Entry->SysenterTimes += Counters->Processes[j].SysenterTimes;
+			else
+				CcLostTimes += Counters->Processes[j].SysenterTimes;
+		}
+	}
+}
+
+static VOID NTAPI CcReportCounters()
+{
+	ULONG32 i;
+
+	HvmPrint(("ContextCounter: %llu sysenters\n",CcSysenterTimes));
+	for (i = 0; i < CC_SERVICE_OTHER; i++)
+	{
+		if (CcServiceTimes[i])
+			HvmPrint(("ContextCounter: Service 0x%04x: %llu\n",
+				i < CC_SERVICES_PER_TABLE ? i : (i - CC_SERVICES_PER_TABLE) | CC_SERVICE_TABLE_BIT,
+				CcServiceTimes[i]));
+	}
+	if (CcServiceTimes[CC_SERVICE_OTHER])
+		HvmPrint(("ContextCounter: Service other: %llu\n",CcServiceTimes[CC_SERVICE_OTHER]));
+	for (i = 0; i < CC_PROCESS_SLOTS; i++)
+	{
+		if (CcProcessTimes[i].Cr3)
+			HvmPrint(("ContextCounter: CR3 %08x: %llu\n",CcProcessTimes[i].Cr3,CcProcessTimes[i].SysenterTimes));
+	}
+	if (CcLostTimes)
+		HvmPrint(("ContextCounter: CR3 table full, %llu not attributed\n",CcLostTimes));
+}
+
+static NTSTATUS NTAPI CcInitializeCore(PCPU Cpu)
+{
+	PCC_CPU_BLOCK Block;
+
+	if (Cpu->ProcessorNumber >= CoreCount)
+		return STATUS_INVALID_PARAMETER;
+	if (CcCpuBlocks[Cpu->ProcessorNumber])
+		return STATUS_SUCCESS;
+
+	Block = ExAllocatePoolWithTag (NonPagedPool, sizeof (CC_CPU_BLOCK), LAB_TAG);
+	if (!Block)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory (Block, sizeof (CC_CPU_BLOCK));
+	CcCpuBlocks[Cpu->ProcessorNumber] = Block;
+	return STATUS_SUCCESS;
+}
+
+static ULONG64 NTAPI CcStartOnCore(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 Argument)
+{
+	ULONG32 cProcessorNumber = Cpu->ProcessorNumber;
+
+	if (cProcessorNumber >= CoreCount)
+		return 0;
+	if (StartRecording[cProcessorNumber] == FALSE && CcSetupSysenterTrap(cProcessorNumber) == STATUS_SUCCESS)
+		StartRecording[cProcessorNumber] = TRUE;
+	return StartRecording[cProcessorNumber] ? 1 : 0;
+}
+
+static ULONG64 NTAPI CcEndOnCore(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 Argument)
+{
+	ULONG32 cProcessorNumber = Cpu->ProcessorNumber;
+
+	if (cProcessorNumber >= CoreCount)
+		return 0;
+	if (StartRecording[cProcessorNumber] == TRUE && CcDestroySysenterTrap(cProcessorNumber) == STATUS_SUCCESS)
+		StartRecording[cProcessorNumber] = FALSE;
+	return CcCpuBlocks[cProcessorNumber] ? CcCpuBlocks[cProcessorNumber]->Counters.SysenterTimes : 0;
+}
+
+static BOOLEAN NTAPI CcBroadcast(PCPU Cpu, PGUEST_REGS GuestRegs, ULONG32 fn)
+{
+	MADDOG_BROADCAST_RESULT Result;
+	NTSTATUS Status;
+
+	//Read the parameters once, in the caller's context, before any core starts.
+	if (CcBroadcastFn != fn && fn == START_RECORDING_EAX)
+		GeneralInitialization(GuestRegs);
+
+	Status = MadDog_Broadcast (
+		Cpu, 
+		GuestRegs, 
+		fn == START_RECORDING_EAX ? CcStartOnCore : CcEndOnCore, 
+		0, 
+		CC_BROADCAST_TIMEOUT, 
+		&Result);
+	if (Status == STATUS_PENDING)
+	{
+		CcBroadcastFn = fn;
+		return FALSE;
+	}
+	if (Status == STATUS_DEVICE_BUSY)
+		return FALSE;
+	CcBroadcastFn = 0;
+
+	HvmPrint(("ContextCounter: Broadcast %d done on %d cores (mask %x), status 0x%08hX\n",
+		fn, Result.CpuCount, Result.CpuMask, Status));
+	if (fn == END_RECORDING_EAX)
+	{
+		CcAggregateCounters();
+		CcReportCounters();
+	}
+
+	GuestRegs->eax = (ULONG32) Result.Sum;
+	GuestRegs->edx = (ULONG32) (Result.Sum>>32);
+	GuestRegs->ecx = Result.CpuCount;
+	GuestRegs->ebx = Result.CpuMask;
+	return TRUE;
+}
@@ -4,22 +4,89 @@
 #include "HvCore.h"
 
 //+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
-#define START_RECORDING_EAX		1000 //Used to tell the hypervisor to start run the target program
+#define START_RECORDING_EAX		1000 //Start counting: EDX holds the pid to filter on (0 = all), EBX its CR3 from IOCTL_CC_LOOKUP_CR3
 #define PING_EAX				1500 //Used to retrieve data while the target program is still running
 #define END_RECORDING_EAX		2000 //Used to tell the hypervisor the target program should be killed
+#define CONTEXT_TABLE_EAX		2500 //Copy the per-CR3 context table to the buffer in EDX (ECX entries), returns the count in EAX
+#define WS_EXPORT_EAX			3200 //Copy the working-set estimates to the buffer in EDX (ECX entries), returns the count in EAX
+#define WS_TUNE_EAX				3300 //Scan budget: ECX slice, EDX period, EBX pass interval (in 2^20 ticks), all TSC; 0 keeps
 #define TEST_PASSINVALUE_EAX	8888 //Only Used in Debug Mode. Hypervisor won't change its current recording state.
+#define BROADCAST_ECX			0x42434153 //ECX of a START/END_RECORDING knock that applies to all cores at once
+#define CC_BROADCAST_TIMEOUT	((ULONG64)3 * 1000000000)	//TSC ticks a broadcast waits for the other cores
 //TODO - Set this value on the runtime in the future.
 #define CoreCount				32	//Used to define the amount of the CPU core on the target machine, default is 32
 
+//Per-service histogram. EAX on SYSENTER holds the service number: bits 0-9 index the service
+//table, bit 12 selects the table (0 = ntoskrnl, 1 = win32k). Anything else lands in the last bucket.
+#define CC_SERVICES_PER_TABLE	1024
+#define CC_SERVICE_TABLE_BIT	0x1000
+#define CC_SERVICE_INVALID_MASK	0xFFFFEC00	//~(CC_SERVICE_TABLE_BIT | (CC_SERVICES_PER_TABLE - 1)), spelled out for __asm
+#define CC_SERVICE_OTHER		(2 * CC_SERVICES_PER_TABLE)
+#define CC_SERVICE_BUCKETS		(CC_SERVICE_OTHER + 1)
+
+#define CC_PROCESS_SLOTS		256		//Distinct CR3 values remembered per core
+#define CC_TRAP_STACK_SIZE		PAGE_SIZE	//Stack KiFastCallEntry runs on until it switches to the thread stack
+#define CC_CR3_MASK				0xFFFFFFE0	//Low CR3 bits are cache-control flags, not part of the address
+
+//Offset of DirectoryTableBase in the x86 KPROCESS (NT 5.0 - 6.1).
+#define KPROCESS_DIRECTORY_TABLE_BASE	0x18
+
+//Control device of the driver. Requests that need the guest OS, like looking up a process, are served
+//here in the caller's thread; VM Exit handlers must not call into the guest OS.
+#define CC_DEVICE_NAME			L"\\Device\\ContextCounter"
+#define CC_DEVICE_LINK			L"\\DosDevices\\ContextCounter"
+#define IOCTL_CC_LOOKUP_CR3		CTL_CODE (FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)	//In: pid, out: its CR3
+#define IOCTL_CC_WS_TRACK		CTL_CODE (FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)	//In: pid (0 = the caller), start sampling its working set
+#define IOCTL_CC_WS_UNTRACK		CTL_CODE (FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)	//In: pid (0 = the caller), stop sampling it
+
 //+++++++++++++++++++++Structs+++++++++++++++++++++++++++
 typedef struct _Parameter
 {
 	//monitor the indicated process, 0 means all processes. 
 	ULONG32 pid;
+	ULONG32 Cr3;//CR3 of <pid>, resolved by the client, 0 if there is no such process
 } Parameter,*PParameter;
 
+typedef struct _CC_PROCESS_ENTRY
+{
+	ULONG32 Cr3;//0 means the slot is free
+	ULONG32 Reserved;
+	ULONG64 SysenterTimes;
+} CC_PROCESS_ENTRY,*PCC_PROCESS_ENTRY;
+
+/**
+ * Counters of one core. Only the owning core writes them: CcFakeSysenterTrap() in guest mode and
+ * the VM Exit handlers on that core. END_RECORDING reads the blocks of all cores to build the totals.
+ */
+typedef struct _CC_COUNTERS
+{
+	ULONG32 Match;//Nonzero while the current CR3 passes the pid filter, refreshed on every MOV to CR3
+	ULONG32 OriginSysenterEIP;
+	ULONG64 SysenterTimes;//SYSENTERs that passed the filter on this core
+	ULONG32 ServiceHits[CC_SERVICE_BUCKETS];
+
+	//Per-process attribution, maintained by the hypervisor on CR3 switches only.
+	ULONG32 CurrentCr3;
+	ULONG64 AttributedTimes;//Value of SysenterTimes at the last CR3 switch
+	ULONG64 LostTimes;//Attributed to no process because the table was full
+	CC_PROCESS_ENTRY Processes[CC_PROCESS_SLOTS];
+} CC_COUNTERS,*PCC_COUNTERS;
+
+/**
+ * The trap stack sits right below the counters, and GUEST_SYSENTER_ESP points at <Counters>.
+ * CcFakeSysenterTrap() finds its core's counters from ESP alone.
+ */
+typedef struct _CC_CPU_BLOCK
+{
+	UCHAR Stack[CC_TRAP_STACK_SIZE];
+	CC_COUNTERS Counters;
+} CC_CPU_BLOCK,*PCC_CPU_BLOCK;
+
 //+++++++++++++++++++++Public Functions++++++++++++++++++++++++
 
+//From ntifs.h, for the guest-side requests.
+NTKERNELAPI NTSTATUS PsLookupProcessByProcessId(HANDLE ProcessId, PEPROCESS *Process);
+
 /**
  * effects: Register traps in this function
  * requires: <Cpu> is valid
@@ -0,0 +1,458 @@
+#include "WorkingSet.h"
+
+/*
+ * Page tables are read through the recursive mapping of x86 Windows, so a slice loads the target CR3
+ * for the time it runs. Each target has a cursor into its user address space; a slice advances the
+ * cursor of one target until WsSliceTsc runs out, and the next due slice, on whatever core exits
+ * first, carries on from there. Only one core scans at a time.
+ *
+ * Accessed bits cleared here stay set in the TLBs of cores running the target, so pages those cores
+ * keep hitting may be missed until the entries are evicted: the working set is a lower bound.
+ */
+#define WS_PTE_BASE				0xC0000000
+#define WS_PDE_BASE				0xC0300000
+#define WS_PDE_BASE_PAE			0xC0600000
+
+#define WS_P					0x001
+#define WS_A					0x020
+#define WS_D					0x040
+#define WS_PS					0x080
+
+#define WS_BUDGET_CHECK			64	//Entries scanned between two TSC reads
+
+typedef struct _WS_TARGET
+{
+	PEPROCESS Process;//NULL means the slot is free
+	ULONG32 NextPage;//Cursor, the next user page to scan
+	ULONG32 Resident;//Counters of the pass in progress
+	ULONG32 Accessed;
+	ULONG32 Dirtied;
+	BOOLEAN Primed;//The previous pass cleared the accessed bits and filled <DirtyBitmap>
+	BOOLEAN Scanning;//A pass is in progress
+	ULONG64 PassStartTsc;//Start of the pass in progress, or of the last one
+	ULONG64 IntervalTsc;//Between the starts of the previous pass and the one in progress
+	PULONG DirtyBitmap;//Dirty bits as of the previous pass, WS_USER_PAGES bits
+	WS_ESTIMATE Estimate;
+} WS_TARGET,*PWS_TARGET;
+
+static WS_TARGET WsTargets[WS_TARGETS];
+static volatile LONG WsLock;
+static ULONG32 WsNextTarget;
+static ULONG64 WsLastSliceTsc;
+
+static ULONG32 WsSliceTsc = WS_SLICE_TSC;
+static ULONG32 WsPeriodTsc = WS_PERIOD_TSC;
+static ULONG64 WsPassTsc = WS_PASS_TSC;
+
+//Scratch for WsExportEstimates(), guarded by WsLock
+static WS_ESTIMATE WsExported[WS_TARGETS];
+
+static VOID NTAPI WsAcquire (
+)
+{
+	while (InterlockedCompareExchange (&WsLock, 1, 0) != 0)
+		;
+}
+
+static VOID NTAPI WsRelease (
+)
+{
+	InterlockedExchange (&WsLock, 0);
+}
+
+/**
+ * effects: Take WsLock from the guest side. At DISPATCH_LEVEL the holder is not preempted, and the
+ * code it runs under the lock takes no VM Exit, so VMX root never waits on a descheduled thread.
+ */
+static VOID NTAPI WsAcquireFromGuest (
+  PKIRQL OldIrql
+)
+{
+	KeRaiseIrql (DISPATCH_LEVEL, OldIrql);
+	WsAcquire ();
+}
+
+static VOID NTAPI WsReleaseFromGuest (
+  KIRQL OldIrql
+)
+{
+	WsRelease ();
+	KeLowerIrql (OldIrql);
+}
+
+/**
+ * effects: Check that the <Size> bytes at <Buffer> are mapped in the current address space.
+ */
+static BOOLEAN NTAPI WsIsBufferPresent (
+  PUCHAR Buffer,
+  ULONG32 Size
+)
+{
+	PUCHAR Page;
+
+	for (Page = (PUCHAR) PAGE_ALIGN (Buffer); Page < Buffer + Size; Page += PAGE_SIZE)
+	{
+		if (!MmIsAddressValid (Page))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * effects: Find the target sampling <Process>.
+ * returns: NULL if it isn't sampled.
+ */
+static PWS_TARGET NTAPI WsFindTarget (
+  PEPROCESS Process
+)
+{
+	ULONG32 i;
+
+	for (i = 0; i < WS_TARGETS; i++)
+	{
+		if (WsTargets[i].Process == Process)
+			return &WsTargets[i];
+	}
+	return NULL;
+}
+
+/**
+ * effects: Look up <Pid> and take a reference on it, 0 is the calling process.
+ */
+static PEPROCESS NTAPI WsReferenceProcess (
+  ULONG32 Pid
+)
+{
+	PEPROCESS Process;
+
+	if (!Pid)
+	{
+		Process = PsGetCurrentProcess ();
+		ObReferenceObject (Process);
+		return Process;
+	}
+	if (!NT_SUCCESS (PsLookupProcessByProcessId ((HANDLE)Pid, &Process)))
+		return NULL;
+	return Process;
+}
+
+/**
+ * effects: Publish the counters of the pass that just ended and reset them for the next one.
+ */
+static VOID NTAPI WsEndPass (
+  PWS_TARGET Target
+)
+{
+	PWS_ESTIMATE Estimate = &Target->Estimate;
+
+	Estimate->ResidentPages = Target->Resident;
+	if (Target->Primed)
+	{
+		Estimate->WorkingSetPages = Target->Accessed;
+		Estimate->DirtiedPages = Target->Dirtied;
+		Estimate->IntervalTsc = Target->IntervalTsc;
+		if (!Estimate->Passes)
+		{
+			Estimate->AvgWorkingSetPages = Target->Accessed;
+			Estimate->AvgDirtiedPages = Target->Dirtied;
+		}
+		else
+		{
+			Estimate->AvgWorkingSetPages += ((LONG)Target->Accessed - (LONG)Estimate->AvgWorkingSetPages) / 8;
+			Estimate->AvgDirtiedPages += ((LONG)Target->Dirtied - (LONG)Estimate->AvgDirtiedPages) / 8;
+		}
+		Estimate->Passes++;
+	}
+	Target->Primed = TRUE;
+	Target->Scanning = FALSE;
+	Target->NextPage = 0;
+	Target->Resident = 0;
+	Target->Accessed = 0;
+	Target->Dirtied = 0;
+}
+
+/**
+ * effects: Account one present leaf entry mapping <Pages> pages from <Page> on: clear its accessed
+ * bit and compare its dirty bit with the previous pass.
+ */
+static VOID NTAPI WsSampleEntry (
+  PWS_TARGET Target,
+  volatile LONG *Entry,
+  ULONG32 Page,
+  ULONG32 Pages
+)
+{
+	LONG Flags = *Entry;
+	ULONG Bit = 1 << (Page & 31);
+	PULONG Word = &Target->DirtyBitmap[Page >> 5];
+
+	Target->Resident += Pages;
+	if (Flags & WS_A)
+	{
+		//The CPU may be setting the dirty bit on another core
+		InterlockedAnd (Entry, ~WS_A);
+		Target->Accessed += Pages;
+	}
+	if (Flags & WS_D)
+	{
+		if (Target->Primed && !(*Word & Bit))
+			Target->Dirtied += Pages;
+		*Word |= Bit;
+	}
+	else
+		*Word &= ~Bit;
+}
+
+/**
+ * effects: Scan <Target> from its cursor until its pass ends or <Deadline> passes.
+ * requires: The target's CR3 is loaded.
+ */
+static VOID NTAPI WsScan (
+  PWS_TARGET Target,
+  BOOLEAN Pae,
+  ULONG64 Deadline
+)
+{
+	ULONG32 Stride = Pae ? 8 : 4;
+	ULONG32 PtShift = Pae ? 9 : 10;//Pages per page table, log2
+	ULONG_PTR PdeBase = Pae ? WS_PDE_BASE_PAE : WS_PDE_BASE;
+	ULONG32 Page, Work = 0;
+	LONG Pde, Pte;
+
+	for (Page = Target->NextPage; Page < WS_USER_PAGES; )
+	{
+		if (++Work % WS_BUDGET_CHECK == 0 && RegGetTSC () > Deadline)
+			break;
+
+		Pde = *(volatile LONG *)(PdeBase + (Page >> PtShift) * Stride);
+		if (!(Pde & WS_P))
+		{
+			Page = ((Page >> PtShift) + 1) << PtShift;
+			continue;
+		}
+		if (Pde & WS_PS)
+		{
+			WsSampleEntry (Target, (volatile LONG *)(PdeBase + (Page >> PtShift) * Stride),
+				Page, 1 << PtShift);
+			Page = ((Page >> PtShift) + 1) << PtShift;
+			continue;
+		}
+
+		Pte = *(volatile LONG *)(WS_PTE_BASE + Page * Stride);
+		if (Pte & WS_P)
+			WsSampleEntry (Target, (volatile LONG *)(WS_PTE_BASE + Page * Stride), Page, 1);
+		Page++;
+	}
+	Target->NextPage = Page;
+}
+
+NTSTATUS NTAPI WsInitialize (
+)
+{
+	ULONG32 i;
+
+	for (i = 0; i < WS_TARGETS; i++)
+	{
+		if (WsTargets[i].DirtyBitmap)
+			continue;
+		WsTargets[i].DirtyBitmap = ExAllocatePoolWithTag (NonPagedPool, WS_USER_PAGES / 8, LAB_TAG);
+		if (!WsTargets[i].DirtyBitmap)
+			return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID NTAPI WsFinalize (
+)
+{
+	ULONG32 i;
+
+	for (i = 0; i < WS_TARGETS; i++)
+	{
+		if (WsTargets[i].Process)
+			ObDereferenceObject (WsTargets[i].Process);
+		if (WsTargets[i].DirtyBitmap)
+			ExFreePoolWithTag (WsTargets[i].DirtyBitmap, LAB_TAG);
+		RtlZeroMemory (&WsTargets[i], sizeof (WS_TARGET));
+	}
+}
+
+NTSTATUS NTAPI WsTrack (
+  ULONG32 Pid
+)
+{
+	PEPROCESS Process;
+	PWS_TARGET Target;
+	PULONG DirtyBitmap;
+	KIRQL OldIrql;
+
+	Process = WsReferenceProcess (Pid);
+	if (!Process)
+		return STATUS_INVALID_PARAMETER;
+
+	WsAcquireFromGuest (&OldIrql);
+	if (WsFindTarget (Process))
+	{
+		WsReleaseFromGuest (OldIrql);
+		ObDereferenceObject (Process);
+		return STATUS_SUCCESS;
+	}
+	Target = WsFindTarget (NULL);
+	if (!Target || !Target->DirtyBitmap)
+	{
+		WsReleaseFromGuest (OldIrql);
+		ObDereferenceObject (Process);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	DirtyBitmap = Target->DirtyBitmap;
+	RtlZeroMemory (Target, sizeof (WS_TARGET));
+	RtlZeroMemory (DirtyBitmap, WS_USER_PAGES / 8);
+	Target->DirtyBitmap = DirtyBitmap;
+	Target->Estimate.Cr3 = *(PULONG32)((PUCHAR)Process + KPROCESS_DIRECTORY_TABLE_BASE) & CC_CR3_MASK;
+	Target->Estimate.Pid = (ULONG32)PsGetProcessId (Process);
+	Target->Process = Process;
+	WsReleaseFromGuest (OldIrql);
+
+	Print(("WsTrack(): Sampling process %d, CR3:%x\n", Target->Estimate.Pid, Target->Estimate.Cr3));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS NTAPI WsUntrack (
+  ULONG32 Pid
+)
+{
+	PEPROCESS Process;
+	PWS_TARGET Target;
+	KIRQL OldIrql;
+
+	Process = WsReferenceProcess (Pid);
+	if (!Process)
+		return STATUS_INVALID_PARAMETER;
+
+	WsAcquireFromGuest (&OldIrql);
+	Target = WsFindTarget (Process);
+	if (Target)
+		Target->Process = NULL;
+	WsReleaseFromGuest (OldIrql);
+
+	if (Target)
+		ObDereferenceObject (Process);
+	ObDereferenceObject (Process);
+	return Target ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+VOID NTAPI WsTune (
+  ULONG32 SliceTsc,
+  ULONG32 PeriodTsc,
+  ULONG64 PassTsc
+)
+{
+	if (SliceTsc)
+		WsSliceTsc = SliceTsc;
+	if (PeriodTsc)
+		WsPeriodTsc = PeriodTsc;
+	if (PassTsc)
+		WsPassTsc = PassTsc;
+}
+
+VOID NTAPI WsRunSlice (
+  PCPU Cpu,
+  ULONG64 Now
+)
+{
+	PWS_TARGET Target;
+	ULONG HostCr3;
+	ULONG64 End;
+	ULONG32 i;
+
+	if (Now - WsLastSliceTsc < WsPeriodTsc)
+		return;
+	//The guest runs a paging mode we don't walk
+	if (!(VmxRead (GUEST_CR0) & X86_CR0_PG))
+		return;
+	if (InterlockedCompareExchange (&WsLock, 1, 0) != 0)
+		return;
+	WsLastSliceTsc = Now;
+
+	//Round robin, skip the free slots and the targets waiting for their next pass
+	for (i = 0; i < WS_TARGETS; i++)
+	{
+		Target = &WsTargets[(WsNextTarget + i) % WS_TARGETS];
+		if (!Target->Process)
+			continue;
+		if (Target->Scanning || !Target->Primed || Now - Target->PassStartTsc >= WsPassTsc)
+			break;
+	}
+	if (i == WS_TARGETS)
+	{
+		WsRelease ();
+		return;
+	}
+	WsNextTarget = (WsNextTarget + i) % WS_TARGETS;
+	if (!Target->Scanning)
+	{
+		Target->IntervalTsc = Now - Target->PassStartTsc;
+		Target->PassStartTsc = Now;
+		Target->Scanning = TRUE;
+	}
+
+	HostCr3 = RegGetCr3 ();
+	RegSetCr3 (Target->Estimate.Cr3);
+	WsScan (Target, (BOOLEAN)((VmxRead (GUEST_CR4) & X86_CR4_PAE) != 0), Now + WsSliceTsc);
+	RegSetCr3 (HostCr3);
+
+	End = RegGetTSC ();
+	Target->Estimate.ScanTsc += End - Now;
+	if (Target->NextPage >= WS_USER_PAGES)
+	{
+		WsEndPass (Target);
+		WsNextTarget = (WsNextTarget + 1) % WS_TARGETS;
+	}
+	WsRelease ();
+}
+
+ULONG32 NTAPI WsExportEstimates (
+  PWS_ESTIMATE Buffer,
+  ULONG32 Capacity
+)
+{
+	ULONG32 i, Count, Size;
+	ULONG HostCr3;
+	BOOLEAN Present;
+
+	Count = 0;
+	WsAcquire ();
+	for (i = 0; i < WS_TARGETS; i++)
+	{
+		if (WsTargets[i].Process)
+			WsExported[Count++] = WsTargets[i].Estimate;
+	}
+
+	if (!Buffer || !Capacity)
+	{
+		WsRelease ();
+		return Count;
+	}
+	Size = (Count < Capacity ? Count : Capacity) * sizeof (WS_ESTIMATE);
+	if ((ULONG)Buffer + Size < (ULONG)Buffer || (ULONG)Buffer + Size > (ULONG)MM_USER_PROBE_ADDRESS)
+	{
+		WsRelease ();
+		HvmPrint(("WsExportEstimates(): Bad buffer %x\n", Buffer));
+		return Count;
+	}
+
+	//<Buffer> is a user address of the caller, only mapped in the guest address space. A page
+	//the guest has paged out would fault in VMX root, so nothing is copied then.
+	HostCr3 = RegGetCr3 ();
+	RegSetCr3 ((ULONG)VmxRead (GUEST_CR3));
+	Present = WsIsBufferPresent ((PUCHAR)Buffer, Size);
+	if (Present)
+		RtlCopyMemory (Buffer, WsExported, Size);
+	RegSetCr3 (HostCr3);
+	WsRelease ();
+
+	if (!Present)
+		HvmPrint(("WsExportEstimates(): Buffer %x is not present\n", Buffer));
+	return Count;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <ntddk.h>
+#include "HvCore.h"
+#include "Vmxtraps.h"
+
+//+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
+#define WS_TARGETS				8	//Processes sampled at the same time
+#define WS_USER_PAGES			0x80000	//Pages in the 2GB x86 user address space, the part that is scanned
+
+//Defaults of the scan budget, all in TSC ticks. At most WS_SLICE_TSC of every WS_PERIOD_TSC is spent
+//scanning, on one core at a time: ~0.3% of a core.
+#define WS_SLICE_TSC			30000	//Longest slice (~10us at 3GHz)
+#define WS_PERIOD_TSC			10000000	//Shortest time between two slices (~3ms)
+#define WS_PASS_TSC				((ULONG64)3 * 1000000000)	//Shortest time between two passes over one process (~1s)
+
+//+++++++++++++++++++++Structs+++++++++++++++++++++++++++
+
+/**
+ * Estimates of one sampled process, refreshed at the end of every pass over its page tables. This is
+ * also the record the WS_EXPORT_EAX hypercall copies out, keep the client in sync.
+ * A pass clears the accessed bits it reads, so <WorkingSetPages> are the pages referenced during the
+ * <IntervalTsc> between the starts of the last two passes. Dirty bits belong to the guest OS and are
+ * never cleared: <DirtiedPages> are the pages that turned dirty over the same interval; writes to pages
+ * that are still dirty from before are not seen.
+ */
+typedef struct _WS_ESTIMATE
+{
+	ULONG32 Cr3;
+	ULONG32 Pid;
+	ULONG32 Passes;//Completed passes, the first one only primes the bits and is not counted
+	ULONG32 ResidentPages;//Present user pages
+	ULONG32 WorkingSetPages;
+	ULONG32 DirtiedPages;
+	ULONG32 AvgWorkingSetPages;//Moving averages, 1/8 weight to the newest pass
+	ULONG32 AvgDirtiedPages;
+	ULONG64 IntervalTsc;
+	ULONG64 ScanTsc;//Time spent scanning this process, for the cost of the sampling
+} WS_ESTIMATE,*PWS_ESTIMATE;
+
+//+++++++++++++++++++++Public Functions++++++++++++++++++++++++
+
+/**
+ * effects: Allocate the dirty bitmaps of all targets. Called before the core is subverted, only the
+ * first call allocates.
+ */
+NTSTATUS NTAPI WsInitialize (
+);
+
+/**
+ * effects: Stop sampling and free the bitmaps. Only call this after the hypervisor has been removed.
+ */
+VOID NTAPI WsFinalize (
+);
+
+/**
+ * effects: Start sampling the process <Pid>, or the calling process if <Pid> is 0. The process is held
+ * referenced while it is sampled so its page directory is not freed under the scan. Uses the process
+ * list of the guest OS: call it from the guest side (IOCTL_CC_WS_TRACK) at PASSIVE_LEVEL, never in
+ * VMX root.
+ * returns: STATUS_INSUFFICIENT_RESOURCES if WS_TARGETS processes are sampled already.
+ */
+NTSTATUS NTAPI WsTrack (
+  ULONG32 Pid
+);
+
+/**
+ * effects: Stop sampling the process <Pid>, or the calling process if <Pid> is 0. Same rules as
+ * WsTrack(), from IOCTL_CC_WS_UNTRACK.
+ */
+NTSTATUS NTAPI WsUntrack (
+  ULONG32 Pid
+);
+
+/**
+ * effects: Change the scan budget. A zero argument keeps the current value.
+ */
+VOID NTAPI WsTune (
+  ULONG32 SliceTsc,
+  ULONG32 PeriodTsc,
+  ULONG64 PassTsc
+);
+
+/**
+ * effects: Scan the next slice of the page tables of the sampled processes, if one is due. Called at
+ * the end of every VM Exit with its leave TSC, so idle cores, which do not exit, do not scan.
+ */
+VOID NTAPI WsRunSlice (
+  PCPU Cpu,
+  ULONG64 Now
+);
+
+/**
+ * effects: Copy up to <Capacity> estimates to the guest buffer <Buffer>, nothing if a page of it is
+ * not present.
+ * returns: The number of sampled processes.
+ */
+ULONG32 NTAPI WsExportEstimates (
+  PWS_ESTIMATE Buffer,
+  ULONG32 Capacity
+);
@@ -129,18 +129,9 @@ NTSTATUS NTAPI VmxRegisterTraps (
   NTSTATUS Status;
   PNBP_TRAP Trap;
 
-  // used to set dummy handler for all VMX intercepts when we compile without nested support
+  // VMCALL is not one of the VMX instructions PtVmxNestedInitialize() emulates
   ULONG32 i, TableOfVmxExits[] = {
-    EXIT_REASON_VMCALL,
-    EXIT_REASON_VMCLEAR,
-    EXIT_REASON_VMLAUNCH,
-    EXIT_REASON_VMRESUME,
-    EXIT_REASON_VMPTRLD,
-    EXIT_REASON_VMPTRST,
-    EXIT_REASON_VMREAD,
-    EXIT_REASON_VMWRITE,
-    EXIT_REASON_VMXON,
-    EXIT_REASON_VMXOFF
+    EXIT_REASON_VMCALL
   };
     Status = HvInitializeGeneralTrap ( //<----------------4.1 Finish
         Cpu, 
@@ -250,7 +241,7 @@ NTSTATUS NTAPI VmxRegisterTraps (
   }
   MadDog_RegisterTrap (Cpu, Trap);
 
-  // set dummy handler for all VMX intercepts if we compile without nested support
+  // set dummy handler for the VMX intercepts left to this sample
   for (i = 0; i < sizeof (TableOfVmxExits) / sizeof (ULONG32); i++) 
   {
       Status = HvInitializeGeneralTrap (
@@ -269,6 +260,14 @@ NTSTATUS NTAPI VmxRegisterTraps (
     MadDog_RegisterTrap (Cpu, Trap);
   }
 
+  // the guest may run a hypervisor of its own
+  Status = PtVmxNestedInitialize (Cpu);
+  if (!NT_SUCCESS (Status)) 
+  {
+    Print(("VmxRegisterTraps(): Failed to initialize nested VMX with status 0x%08hX\n", Status));
+    return Status;
+  }
+
   return STATUS_SUCCESS;
 }
 
@@ -610,7 +609,7 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 {
     ULONG32 exit_qualification;
     ULONG32 gp, cr;
-    ULONG value;
+    ULONG_PTR value;
     ULONG inst_len;
 
     if (!Cpu || !GuestRegs)
@@ -695,7 +694,7 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 
         if (cr == 3) 
         {
-            Cpu->Vmx.GuestCR3 = *(((PULONG) GuestRegs) + gp);
+            Cpu->Vmx.GuestCR3 = *(((PULONG_PTR) GuestRegs) + gp);
 
             if (Cpu->Vmx.GuestCR0 & X86_CR0_PG)       //enable paging
             {
@@ -736,7 +735,7 @@ static BOOLEAN NTAPI VmxDispatchCrAccess (
 #if DEBUG_LEVEL>2
             Print(("VmxDispatchCrAccess(): TYPE_MOV_FROM_CR cr3:0x%x\n", value));
 #endif
-            *(((PULONG32) GuestRegs) + gp) = (ULONG32) value;
+            *(((PULONG_PTR) GuestRegs) + gp) = (ULONG_PTR) value;
 
         }
         break;
@@ -780,7 +779,7 @@ BOOLEAN NTAPI PtVmxDispatchCR3Access (
 {
 	ULONG32 exit_qualification;
     ULONG32 gp, cr;
-    ULONG value;
+    ULONG_PTR value;
     ULONG inst_len;
 	NTSTATUS Status;
 
@@ -853,7 +852,7 @@ BOOLEAN NTAPI PtVmxDispatchCR3Access (
 
         //if (cr == 3) 
         {
-            Cpu->Vmx.GuestCR3 = *(((PULONG) GuestRegs) + gp);
+            Cpu->Vmx.GuestCR3 = *(((PULONG_PTR) GuestRegs) + gp);
 
             if (Cpu->Vmx.GuestCR0 & X86_CR0_PG)       //enable paging
             {
@@ -870,7 +869,7 @@ BOOLEAN NTAPI PtVmxDispatchCR3Access (
             value = Cpu->Vmx.GuestCR3;
             //HvmPrint(("VmxDispatchCrAccess(): TYPE_MOV_FROM_CR cr3:0x%x\n", value));
 
-            *(((PULONG32) GuestRegs) + gp) = (ULONG32) value;
+            *(((PULONG_PTR) GuestRegs) + gp) = (ULONG_PTR) value;
 
         }
         break;
@@ -87,6 +87,10 @@ LINK32=link.exe
 
 SOURCE=.\peloader.cpp
 # End Source File
+# Begin Source File
+
+SOURCE=..\Framework\MadDog\src\PELoader\PeImage\PeImage.cpp
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
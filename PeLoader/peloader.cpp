@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <imagehlp.h>
 #include <psapi.h>
+#include "..\Framework\MadDog\src\PELoader\PeImage\PeImage.h"
 #pragma pack(1)
 #pragma comment(lib, "imagehlp.lib")
 #pragma comment(lib, "psapi.lib")
@@ -25,34 +26,24 @@ char PEFile[MAX_PATH] = {0};
 unsigned long OEP = 0;
 char *addr_GetModuleHandleExA = NULL;
 char *addr_GetModuleHandleExW = NULL;
+// Returns a private, writable copy of the file; the headers are patched in place.
 unsigned long LoadPEFile(char *FileName, char **Buffer)
 {
-    FILE *fp = fopen(FileName, "rb");
-    fseek(fp, 0, SEEK_END);
-    unsigned long len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    *Buffer = new char[len + 4];
-    memset(*Buffer, 0x0, len + 4);
-    unsigned long i = 0;
-    while(i < len)
-    {
-        fread(*Buffer + i, 4, 1, fp);
-        i+=4;
-    }
-    fclose(fp);
-    return len;
+    PeFileView view;
+    *Buffer = NULL;
+    if(!view.Map(FileName))
+        return 0;
+    *Buffer = new char[view.Size()];
+    memcpy(*Buffer, view.Base(), view.Size());
+    return (unsigned long)view.Size();
 }
 
 void SaveAs(char *FileName, char *Buffer, unsigned long len)
 {
     FILE *fp = fopen(FileName, "wb");
-    unsigned long i = 0;
-    while(i < len)
-    {
-        fwrite(Buffer + i, 4, 1, fp);
-        fflush(fp);
-        i+=4;
-    }
+    if(!fp)
+        return;
+    fwrite(Buffer, 1, len, fp);
     fclose(fp);
 }
 
@@ -665,14 +656,20 @@ void main(int argc, char **argv)
     printf("path:%s\n", lpBuffer);
     SetCurrentDirectory(lpBuffer);
     unsigned long len = LoadPEFile(PEFile, &Buffer);
-    IMAGE_DOS_HEADER *dos_header = (IMAGE_DOS_HEADER *)Buffer;
-    IMAGE_NT_HEADERS *pINH = (IMAGE_NT_HEADERS *)((DWORD)dos_header + dos_header->e_lfanew);
+    PeImage image;
+    if(!image.Attach(Buffer, len) || image.Is64())
+    {
+        printf("%s: %s\n", PEFile, len ? (image.Error() ? image.Error() : "not a PE32 image") : "can't read file");
+        delete []Buffer;
+        return;
+    }
+    IMAGE_NT_HEADERS *pINH = (IMAGE_NT_HEADERS *)(Buffer + image.NtHeadersOffset());
 //    long PESignOffset = *(long *)(Buffer + 0x3c);
 //    IMAGE_NT_HEADERS *pINH = (IMAGE_NT_HEADERS *)(Buffer + PESignOffset);
     pINH->FileHeader.Characteristics |= IMAGE_FILE_DLL;
     pINH->FileHeader.Characteristics |= IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP;
-    OEP = pINH->OptionalHeader.AddressOfEntryPoint;
-    printf("OldEntryPoint:0x%.8x\n", pINH->OptionalHeader.AddressOfEntryPoint);
+    OEP = image.EntryPoint();
+    printf("OldEntryPoint:0x%.8x\n", OEP);
     pINH->OptionalHeader.AddressOfEntryPoint = 0x0;
     printf("pINH->OptionalHeader.AddressOfEntryPoint:0x%.8x\n", pINH->OptionalHeader.AddressOfEntryPoint);
     printf("len:%d\n", len);
@@ -683,6 +680,7 @@ void main(int argc, char **argv)
     pINH->OptionalHeader.CheckSum = CheckSum;
 */   //strcat(PEFile, ".new.exe");
     //SaveAs(PEFile, Buffer, len);
+    image.Close();
     delete []Buffer;
     Buffer = NULL;
     printf("Load\n");
@@ -1,6 +1,7 @@
 %include	"include/load.inc"
 %include	"include/hdd.inc"
 %include	"include/elf.inc"
+%include	"include/lz4.inc"
 %include	"include/pm.inc"
 
 org		OffsetOfLoader
@@ -35,6 +36,14 @@ LABEL_START:
 	mov		ds, ax
 	mov		ss, ax
 	mov		sp, OffsetOfLoader
+
+	mov 		dword [BootTSC_PhyAddr], BOOT_TSC_MAGIC 	; 启动阶段计时，其余检查点先清零
+%assign n 2
+%rep 8
+	mov 		dword [BootTSC_PhyAddr + n * 4], 0
+%assign n n + 1
+%endrep
+	RecordTSC 	BOOT_TSC_LOADER
 	
 	mov 	ax, 0x0003							; Set BIOS video mode
 	int 		0x10
@@ -80,6 +89,89 @@ GetMemInfo:
 ;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 
 
+; LBA 模式读取硬盘扇区 ----------------------------------------------------
+; ds:si -> DAP。读取失败时复位磁盘后重试，最多 MaxReadRetries 次，
+; 仍然失败则显示错误码和扇区号后停机（不再无限重试）。
+ReadSector_LBA:
+	push 		cx
+	push 		dx
+	mov 		al, [DAP_SecNum] 					; 出错时 BIOS 会改写 DAP 中的扇区数，先保存
+	mov 		[ReadSecNum], al
+	mov 		cx, MaxReadRetries
+.retry:
+	mov 		dl, DrvNum 							; dl = 驱动器号
+	mov 		ah, 0x42 								; ah = 42h
+	int 			0x13									; int 13h
+	jnc 			.ok
+	mov 		[DiskErrCode], ah 					; 保存错误码
+	mov 		al, [ReadSecNum]
+	mov 		[DAP_SecNum], al
+	xor 			ah, ah 									; ah = 0: 复位磁盘
+	mov 		dl, DrvNum
+	int 			0x13
+	loop 		.retry
+	jmp 			DiskError
+.ok:
+	pop 		dx
+	pop 		cx
+	ret
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+
+; 磁盘读取失败：显示 "Disk read error xx at LBA xxxxxxxx" 后停机 ------------
+DiskError:
+	cld
+	mov 		si, szDiskError
+	call 			DispStr_RM
+	movzx 		eax, byte [DiskErrCode]
+	call 			DispHex_RM
+	mov 		si, szAtLBA
+	call 			DispStr_RM
+	mov 		eax, [DAP_SecStart]
+	call 			DispHex_RM
+.halt:
+	cli
+	hlt
+	jmp 			.halt
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+
+; 实模式下显示字符串（ds:si，以 0 结尾）------------------------------------
+DispStr_RM:
+	mov 		ah, 0x0E 								; int 10h, ah = 0Eh: TTY 输出
+	mov 		bx, 0x0007
+.1:
+	lodsb
+	test 		al, al
+	jz 			.2
+	int 			0x10
+	jmp 			.1
+.2:
+	ret
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+
+; 实模式下以十六进制显示 eax ------------------------------------------------
+DispHex_RM:
+	mov 		edx, eax
+	mov 		cx, 8
+	mov 		bx, 0x0007
+.1:
+	rol 			edx, 4
+	mov 		al, dl
+	and 			al, 0x0F
+	add 			al, '0'
+	cmp 		al, '9'
+	jbe 			.2
+	add 			al, 7 										; 'A' - '9' - 1
+.2:
+	mov 		ah, 0x0E
+	int 			0x10
+	loop 		.1
+	ret
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+
 %ifndef __LOAD_KERNEL_IN_PM__
 LoadKernelFile:
 	mov 		si, DAP_struct
@@ -108,16 +200,6 @@ LoadKernelFile:
 
 	ret
 ;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
-
-
-; LBA 模式读取硬盘扇区
-ReadSector_LBA:
-	mov 		dl, DrvNum 					; dl = 驱动器号
-	mov 		ah, 0x42 						; ah = 42h
-	int 			0x13							; int 13h
-	jc 				ReadSector_LBA 			; 如果读取错误 CF 会被置为 1, 这时就不停地读, 直到正确为止
-	ret
-;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 %endif
 
 
@@ -158,8 +240,13 @@ LABEL_PM_START:
 	mov 		eax, [_dwMemSize] 					; 计算kernel ELF 文件存放的起始地址（从内存高端偏移）
 	sub 			eax, (OffsetFromMemoryEnd_MB * 0x100000)
 	mov 		dword [KernelFile_PhyAddr], eax
+	add 			eax, OffsetOfPackedFile 			; 从硬盘读出的映像（可能是压缩的）先放在这里
+	mov 		dword [PackedFile_PhyAddr], eax
 
 	call 			LoadKernelFile_PM 					; Load kernel file from prot-mode.
+	RecordTSC 	BOOT_TSC_READ
+	call 			UnpackKernel 							; 解压 LZ4 映像到 KernelFile_PhyAddr
+	RecordTSC 	BOOT_TSC_UNPACK
 %else
 ;// 在实模式下已经将kernel ELF 文件load 好，此处仅将文件地址写入变量
 	mov 		eax, BaseOfKernelFile_PhyAddr
@@ -171,6 +258,7 @@ LABEL_PM_START:
 	add 			eax, e_entry
 	mov 		eax, [eax]
 	mov 		[KernelEntryPoint], eax
+	RecordTSC 	BOOT_TSC_DONE
 
 	; Switch to kernel.
 	mov 		eax, [KernelEntryPoint]
@@ -222,6 +310,149 @@ MemCpy:
 
 
 
+%ifdef __LOAD_KERNEL_IN_PM__
+; UnpackKernel -------------------------------------------------------------
+; PackedFile_PhyAddr 处是 LZ4 压缩映像时，解压到 KernelFile_PhyAddr；
+; 否则是未压缩的 ELF 文件，直接使用。解压失败则显示错误后停机。
+; --------------------------------------------------------------------------
+UnpackKernel:
+	push		esi
+
+	mov 		esi, [PackedFile_PhyAddr]
+	cmp 		dword [esi + lz4_magic], LZ4_IMAGE_MAGIC
+	je 			.packed
+	mov 		[KernelFile_PhyAddr], esi 				; 未压缩的 ELF 文件
+	pop 		esi
+	ret
+.packed:
+	cmp 		dword [esi + lz4_usize], OffsetOfPackedFile 	; 解压结果不能覆盖压缩数据
+	ja 			.bad
+	push		dword [esi + lz4_usize] 				; 输出缓冲区大小
+	push		dword [esi + lz4_csize] 				; size
+	lea 			eax, [esi + LZ4_IMAGE_HDR_SIZE]
+	push		eax											; src
+	push 		dword [KernelFile_PhyAddr] 			; dst
+	call			LZ4Decompress
+	add			esp, 16
+	cmp 		eax, [esi + lz4_usize]
+	jne 			.bad
+
+	pop 		esi
+	ret
+.bad:
+	push		szBadImage
+	call			DispStr
+	add			esp, 4
+.halt:
+	cli
+	hlt
+	jmp 			.halt
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+
+
+; ------------------------------------------------------------------------
+; LZ4 数据块解压（block 格式，无 frame 头）
+; ------------------------------------------------------------------------
+; int LZ4Decompress(void* es:pDest, void* ds:pSrc, int iSrcSize, int iDestSize);
+; 返回解压后的字节数；数据损坏（越过输入或输出的边界、非法偏移）时返回 -1
+; ------------------------------------------------------------------------
+LZ4Decompress:
+	push		ebp
+	mov			ebp, esp
+	push		esi
+	push		edi
+	push		ebx
+	push		ecx
+	push		edx
+
+	mov			edi, [ebp + 8]			; Destination
+	mov			esi, [ebp + 12]			; Source
+	mov			edx, esi
+	add			edx, [ebp + 16]		; edx = 输入数据末尾
+	cld
+.token:
+	cmp 		esi, edx
+	jae 			.done
+	movzx 		ebx, byte [esi] 			; token: 高 4 位 literal 长度，低 4 位 match 长度 - 4
+	inc 			esi
+	mov 		ecx, ebx
+	shr 			ecx, 4
+	cmp 		ecx, 15
+	jne 			.copy_literals
+.literal_length:
+	movzx 		eax, byte [esi] 			; 长度为 15 时后面跟着若干扩展字节，直到不是 255
+	inc 			esi
+	add 			ecx, eax
+	cmp 		al, 255
+	je 			.literal_length
+.copy_literals:
+	mov 		eax, edx 					; literal 不能超出输入末尾
+	sub 			eax, esi
+	cmp 		ecx, eax
+	ja 			.error
+	mov 		eax, [ebp + 8] 			; 也不能超出输出末尾
+	add 			eax, [ebp + 20]
+	sub 			eax, edi
+	cmp 		ecx, eax
+	ja 			.error
+	rep 			movsb
+	cmp 		esi, edx 					; 最后一个序列只有 literal
+	jae 			.done
+
+	lea 			eax, [esi + 2]
+	cmp 		eax, edx
+	ja 			.error
+	movzx 		eax, word [esi] 			; match 偏移（小端）
+	add 			esi, 2
+	mov 		ecx, edi 					; 偏移必须落在已输出的数据内
+	sub 			ecx, [ebp + 8]
+	test 		eax, eax
+	jz 			.error
+	cmp 		eax, ecx
+	ja 			.error
+	and 			ebx, 0x0F
+	cmp 		ebx, 15
+	jne 			.copy_match
+.match_length:
+	movzx 		ecx, byte [esi]
+	inc 			esi
+	add 			ebx, ecx
+	cmp 		cl, 255
+	je 			.match_length
+.copy_match:
+	lea 			ecx, [ebx + 4]
+	mov 		ebx, [ebp + 8] 			; match 不能超出输出末尾
+	add 			ebx, [ebp + 20]
+	sub 			ebx, edi
+	cmp 		ecx, ebx
+	ja 			.error
+	push		esi
+	mov 		esi, edi
+	sub 			esi, eax
+	rep 			movsb 						; 源和目标可能重叠，必须逐字节向前拷贝
+	pop 		esi
+	jmp 			.token
+.done:
+	mov			eax, edi					; 返回值
+	sub 			eax, [ebp + 8]
+	jmp 			.return
+.error:
+	mov 		eax, -1
+.return:
+	pop			edx
+	pop			ecx
+	pop			ebx
+	pop			edi
+	pop			esi
+	mov			esp, ebp
+	pop			ebp
+	ret
+;^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+%endif
+
+
+
 ; 显示内存信息 --------------------------------------------------------------
 DispMemInfo:
 ;	push		szMemChkTitle					; 显示内存信息标题
@@ -351,6 +582,7 @@ InitKernel:
 ;												Base 	Limit 			Attribute
 GDT_TEMP:			Descriptor 	0, 		0, 				0					; Null
 DESC_CODE16: 	Descriptor 	0, 		0xffffff,			DA_C			; 16-bit code
+DESC_FLAT_RW: 	Descriptor 	0, 		0xfffff,			DA_DRW | DA_LIMIT_4K	; Data, 0 ~ 4G (for unreal mode)
 ; GDT ---------------------------------------------------------------------------------------------------
 
 GdtTemp_Len		equ		$ - GDT_TEMP
@@ -359,6 +591,7 @@ GdtTemp_Ptr:		dw		GdtTemp_Len - 1										; Segment limit
 
 ; GDT Selector ----------------------------------------------------------------------------------
 SelectCode16_temp		equ		DESC_CODE16		- GDT_TEMP
+SelectFlatRW_temp		equ		DESC_FLAT_RW	- GDT_TEMP
 ; GDT Selector ----------------------------------------------------------------------------------
 
 LoadKernelFile_PM:
@@ -383,38 +616,72 @@ REAL_ENTRY:
 	mov 		es, ax
 	mov 		ss, ax
 	mov 		sp, TopOfRealStack
+	call 			EnterUnreal
 
 ;--------------------------------------------
-; Load kernel file (origin ELF file)
+; Load kernel file (LZ4 packed or origin ELF file)
+; 每次 int 13h 读取尽可能多的扇区（最多 SecNumOfReadOnce = 127）到 1MB 以下的
+; 暂存区，然后在 unreal mode 下用 32 位串操作直接拷贝到内存高端的目标位置。
 	mov 		si, DAP_struct 						; DAP 结构体地址
 	mov 		ebx, StartSecOfKernalFile		; Start from logic sector StartSecOfKernalFile
 	mov 		word [DAP_Mem_seg], BaseOfTempLoadAddr 	; 1MB 以下暂存位置 -- 段地址
 	mov 		word [DAP_Mem_off], OffsetOfTempLoadAddr 	; 1MB 以下暂存位置 -- 偏移地址
-	mov 		byte [DAP_SecNum], SecNumOfReadOnce 			; 单次中断读取的扇区数
-	mov 		ecx, SizeOfKernelFile			; [用于循环计数]
-	mov 		edi, [KernelFile_PhyAddr] 		; 内存高端放置ELF文件的起始地址
-	mov 		ax, BaseOfTempLoadAddr 	; 1MB 以下暂存位置 -- 偏移地址
-	mov 		es, ax
+
+	; 先读第一个扇区：压缩映像只需读取头部中记录的大小，未压缩的 ELF 文件读取 SizeOfKernelFile 个扇区
+	mov 		byte [DAP_SecNum], 1
+	mov 		[DAP_SecStart], ebx
+	call 			ReadSector_LBA
+	call 			EnterUnreal
+	mov 		ecx, SizeOfKernelFile			; 扇区总数
+	cmp 		dword [dword TempLoad_PhyAddr + lz4_magic], LZ4_IMAGE_MAGIC
+	jne 			.0
+	mov 		ecx, [dword TempLoad_PhyAddr + lz4_csize]
+	add 			ecx, (LZ4_IMAGE_HDR_SIZE + 511)
+	shr 			ecx, 9
+	cmp 		ecx, SizeOfKernelFile
+	jbe 			.0
+	mov 		ecx, SizeOfKernelFile
+.0:
+	; 第一个扇区已经在暂存区中，直接拷贝过去，不再重读
+	push 		ecx
+	push 		esi
+	mov 		ecx, 128 							; 一个扇区 128 个双字
+	mov 		esi, (BaseOfTempLoadAddr * 0x10 + OffsetOfTempLoadAddr)
+	mov 		edi, [PackedFile_PhyAddr] 		; 内存高端放置映像文件的起始地址
+	cld
+	a32 rep 	movsd
+	pop 		esi
+	pop 		ecx
+	inc 			ebx
+	dec 			ecx 									; 剩余扇区数
+	jz 			.load_done
 .loop_load_kernel:
+	mov 		eax, SecNumOfReadOnce 			; 本次读取的扇区数 = min(剩余扇区数, SecNumOfReadOnce)
+	cmp 		ecx, eax
+	jae 			.1
+	mov 		eax, ecx
+.1:
+	mov 		[DAP_SecNum], al
 	mov 		[DAP_SecStart], ebx			; 起始扇区号
 	call 			ReadSector_LBA
+	call 			EnterUnreal 						; BIOS 可能重新装载了段寄存器
 
 	; 将1MB 以下临时存放的内容拷贝至目标位置（内存高端）
 	push 		ecx
 	push 		esi
-	mov 		ecx, (SecNumOfReadOnce * 128)	; [用于循环计数]
-	mov 		esi, OffsetOfTempLoadAddr
-.loop_MemCopy:
-	mov 		eax, dword [es:esi]				; 4-byte 拷贝
-	add 			esi, 4
-	mov 		dword [fs:edi], eax
-	add 			edi, 4
-	loop 		.loop_MemCopy
+	movzx 		ecx, byte [DAP_SecNum]
+	add 			ebx, ecx 							; 硬盘偏移 DAP_SecNum 个扇区
+	shl 			ecx, 7 								; 每扇区 128 个双字
+	mov 		esi, (BaseOfTempLoadAddr * 0x10 + OffsetOfTempLoadAddr)
+	cld
+	a32 rep 	movsd 								; ds:esi -> es:edi, 4-byte 拷贝
 	pop 		esi
 	pop 		ecx
-		
-	add			ebx, SecNumOfReadOnce			; 硬盘偏移SecNumOfReadOnce 个扇区
-	loop 		.loop_load_kernel
+
+	movzx 		eax, byte [DAP_SecNum]
+	sub 			ecx, eax
+	jnz 			.loop_load_kernel
+.load_done:
 ;--------------------------------------------
 
 	cli 																; Close interrupt
@@ -424,12 +691,20 @@ REAL_ENTRY:
 	jmp 		dword SelectorFlatC:(BaseOfLoader_PhyAddr + BACK_TO_PROT)
 
 
-; LBA 模式读取硬盘扇区
-ReadSector_LBA:
-	mov 		dl, DrvNum 							; dl = 驱动器号
-	mov 		ah, 0x42 								; ah = 42h
-	int 			0x13									; int 13h
-	jc 				ReadSector_LBA 					; 如果读取错误 CF 会被置为 1, 这时就不停地读, 直到正确为止
+; 进入 unreal mode：短暂打开保护模式，将 ds, es 的段界限设为 4GB 后返回实模式。
+; 段寄存器的值（以及段基址）保持不变，之后可用 32 位偏移访问 1MB 以上的内存。
+EnterUnreal:
+	cli
+	push 		ds
+	push 		es
+	TurnOnPM
+	mov 		ax, SelectFlatRW_temp
+	mov 		ds, ax
+	mov 		es, ax
+	TurnOffPM
+	pop 		es
+	pop 		ds
+	sti
 	ret
 
 
@@ -479,7 +754,13 @@ DAP_struct:		; 被int 13h, ah=42h 调用的Disk Address Packet (DAP) 结构体
 _SPValueInProtMode: 	dd 	0
 _KernelFile_PhyAddr: 	dd 	0
 _KernelEntryPoint: 		dd 	0
+_PackedFile_PhyAddr: 	dd 	0
+_szBadImage: 				db 	"Bad LZ4 kernel image!", 0
 _SaveGDTR: 				dd 	0, 0
+ReadSecNum: 				db 	0 			; ReadSector_LBA: 请求读取的扇区数
+DiskErrCode: 				db 	0 			; ReadSector_LBA: 最后一次 int 13h 的错误码
+szDiskError: 				db 	"Disk read error ", 0
+szAtLBA: 					db 	" at LBA ", 0
 
 ;; 保护模式下使用这些符号
 ;szMemChkTitle				equ		BaseOfLoader_PhyAddr + _szMemChkTitle
@@ -498,6 +779,8 @@ MemChkBuf					equ		BaseOfLoader_PhyAddr + _MemChkBuf
 SPValueInProtMode 		equ 		BaseOfLoader_PhyAddr + _SPValueInProtMode
 KernelFile_PhyAddr 		equ 		BaseOfLoader_PhyAddr + _KernelFile_PhyAddr
 KernelEntryPoint 			equ 		BaseOfLoader_PhyAddr + _KernelEntryPoint
+PackedFile_PhyAddr 		equ 		BaseOfLoader_PhyAddr + _PackedFile_PhyAddr
+szBadImage 					equ 		BaseOfLoader_PhyAddr + _szBadImage
 SaveGDTR 					equ 		BaseOfLoader_PhyAddr + _SaveGDTR
 
 ; 保护模式的栈空间 -----------------------------------------------------------------
@@ -27,6 +27,14 @@ static __inline void lcr3(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr4(void) __attribute__((always_inline));
+static __inline void ldr0(uint32_t val) __attribute__((always_inline));
+static __inline void ldr1(uint32_t val) __attribute__((always_inline));
+static __inline void ldr2(uint32_t val) __attribute__((always_inline));
+static __inline void ldr3(uint32_t val) __attribute__((always_inline));
+static __inline void ldr6(uint32_t val) __attribute__((always_inline));
+static __inline uint32_t rdr6(void) __attribute__((always_inline));
+static __inline void ldr7(uint32_t val) __attribute__((always_inline));
+static __inline uint32_t rdr7(void) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
@@ -183,6 +191,12 @@ rcr2(void)
 	return val;
 }
 
+static __inline void
+lcr2(uint32_t val)
+{
+	__asm __volatile("movl %0,%%cr2" : : "r" (val));
+}
+
 static __inline void
 lcr3(uint32_t val)
 {
@@ -211,6 +225,58 @@ rcr4(void)
 	return cr4;
 }
 
+static __inline void
+ldr0(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db0" : : "r" (val));
+}
+
+static __inline void
+ldr1(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db1" : : "r" (val));
+}
+
+static __inline void
+ldr2(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db2" : : "r" (val));
+}
+
+static __inline void
+ldr3(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db3" : : "r" (val));
+}
+
+static __inline void
+ldr6(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db6" : : "r" (val));
+}
+
+static __inline uint32_t
+rdr6(void)
+{
+	uint32_t val;
+	__asm __volatile("movl %%db6,%0" : "=r" (val));
+	return val;
+}
+
+static __inline void
+ldr7(uint32_t val)
+{
+	__asm __volatile("movl %0,%%db7" : : "r" (val));
+}
+
+static __inline uint32_t
+rdr7(void)
+{
+	uint32_t val;
+	__asm __volatile("movl %%db7,%0" : "=r" (val));
+	return val;
+}
+
 static __inline void
 tlbflush(void)
 {
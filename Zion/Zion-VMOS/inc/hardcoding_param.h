@@ -20,6 +20,9 @@
 #define 	MCRNumber_paddr 		(0x8008 + ADDR_OFFSET)
 #define 	MemInfo_paddr 			(0x8010 + ADDR_OFFSET)
 
+/* Boot phase timestamps left by Seraph (see inc/kern/boottime.h) */
+#define 	BootTSC_paddr 			(0x8400 + ADDR_OFFSET)
+
 
 
 #endif
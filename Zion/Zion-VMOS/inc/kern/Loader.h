@@ -3,8 +3,10 @@
 
 #include <inc/types.h>
 
-#define 	NUM_SECTOR_ONCE_READ 	8
+#define 	NUM_SECTOR_ONCE_READ 	1024 		// Sectors per hd_rw() call (512KB)
+#define 	ELF_HDR_SECTORS 			4 			// ELF + program headers must fit here
 
-void LoadFile ( uint64_t NrStartSector, uint32_t MemBase, uint32_t Size );
+int LoadFile ( uint64_t NrStartSector, uint32_t MemBase, uint32_t Size );
+int ELF_Load ( uint64_t NrStartSector, uint32_t MemBase, uint32_t MemLimit, uint32_t *pEntry, uint32_t *pSize );
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef __KERN_BCACHE_H
+#define __KERN_BCACHE_H
+
+#include <inc/types.h>
+#include <inc/kern/hdd.h>
+
+#define 	BCACHE_BLOCK_SECTORS 		8 			// Cache block: 4KB
+#define 	BCACHE_BLOCK_SIZE 			(BCACHE_BLOCK_SECTORS * SECTOR_SIZE)
+#define 	BCACHE_NR_BLOCKS 				256 		// 1MB of cached data
+#define 	BCACHE_HASH_SIZE 				128 		// Must be a power of 2
+#define 	BCACHE_READAHEAD_MAX 		16 			// Blocks, one 64KB transfer
+#define 	BCACHE_SEQ_THRESHOLD 		2 			// Sequential reads before read-ahead starts
+#define 	BCACHE_BYPASS_SECTORS 		DMA_MAX_SECTORS 	// Larger requests go to the driver directly
+
+struct bcache_stats {
+	u32 	read_hits; 			// Blocks read from the cache
+	u32 	read_misses; 			// Blocks read from disk on demand
+	u32 	write_hits; 			// Blocks written into a cached block
+	u32 	write_misses; 		// Blocks written into a newly allocated block
+	u32 	readahead; 			// Blocks prefetched
+	u32 	readahead_hits; 		// Prefetched blocks that were used later
+	u32 	writebacks; 			// Dirty blocks written to disk
+	u32 	evictions; 			// Blocks reused by LRU
+	u32 	bypass; 				// Large requests sent to hd_rw() directly
+};
+
+int bc_read ( u8 *buf, u64 sect_nr, u32 sector_cnt );
+int bc_write ( const u8 *buf, u64 sect_nr, u32 sector_cnt );
+int bc_read_uncached ( u8 *buf, u64 sect_nr, u32 sector_cnt );
+int bc_flush ( void );
+int bc_invalidate ( void );
+void bc_get_stats ( struct bcache_stats *stats );
+void bc_reset_stats ( void );
+
+#endif
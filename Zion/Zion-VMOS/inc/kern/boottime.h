@@ -0,0 +1,32 @@
+#ifndef __KERN_BOOTTIME_H
+#define __KERN_BOOTTIME_H
+
+#include <inc/types.h>
+
+/* Boot phase checkpoints, in boot order. The first four are taken by Seraph. */
+enum {
+	BOOT_PHASE_LOADER = 0, 		// Seraph kernel loader entered
+	BOOT_PHASE_LOADER_READ, 		// Kernel image read from disk
+	BOOT_PHASE_LOADER_UNPACK, 		// LZ4 image unpacked
+	BOOT_PHASE_LOADER_DONE, 		// ELF segments placed, jumping to the kernel
+	BOOT_PHASE_KERN_ENTRY, 		// i386_init() entered
+	BOOT_PHASE_CONS, 				// cons_init()
+	BOOT_PHASE_CTORS, 				// Global constructors
+	BOOT_PHASE_MEM_DETECT, 		// i386_mem_detect() and the pages array
+	BOOT_PHASE_PAGE_INIT, 			// page_init()
+	BOOT_PHASE_PAGING, 			// Kernel page tables built, paging on
+	BOOT_PHASE_IDT, 				// idt_init()
+	BOOT_PHASE_VMX, 				// start_vmx()
+	BOOT_PHASE_MONITOR, 			// Ready to enter the monitor
+	BOOT_PHASE_NR
+};
+
+/* Seraph stores its checkpoints at BootTSC_paddr: this magic, then one 64-bit
+ * TSC per loader phase starting at offset 8. */
+#define 	BOOT_TSC_MAGIC 		0x43535442 		// "BTSC"
+
+void boot_phase_init ( void );
+void boot_phase ( int phase );
+void boot_phase_report ( void );
+
+#endif
@@ -3,23 +3,56 @@
 
 #define DEBUGGER_ENABLED
 #define MAX_DEBUGGER_BPS 64
+#define DBG_BACK_LINES 4 /* commands listed before eip on each stop */
 
 #include <inc/kern/common.h>
 #include <inc/trap.h>
 
+#define DBG_BP_HASH_SIZE 64 /* must be a power of 2 */
+#define DBG_NR_DRS 4 /* DR0-DR3 */
+
+/* breakpoint types, the value is the R/W field of DR7 */
+#define DBG_BP_EXEC 0
+#define DBG_BP_WRITE 1
+#define DBG_BP_ACCESS 3
+
+/* condition operators */
+#define DBG_COND_NONE 0
+#define DBG_COND_EQ 1
+#define DBG_COND_NE 2
+#define DBG_COND_LT 3
+#define DBG_COND_GT 4
+#define DBG_COND_AND 5 /* (reg & value) != 0 */
+
+struct dbg_cond
+{
+	uint8_t op;
+	uint8_t reg; /* index in struct Registers */
+	uint32_t value;
+};
+
 struct dbg_bp
 {
 	uint32_t valid;
 	uint32_t addr;
 	uint8_t origin;
+	uint8_t type;
+	uint8_t len; /* 1, 2 or 4 bytes for watchpoints */
+	int8_t dr; /* debug register in use, -1 for int3 */
+	uint32_t hits;
+	struct dbg_cond cond;
+	struct dbg_bp *next; /* hash chain */
 };
 
 struct dbg_block
 {
 	int step_trap;
 	struct dbg_bp bps[MAX_DEBUGGER_BPS];
+	struct dbg_bp *hash[DBG_BP_HASH_SIZE];
+	struct dbg_bp *drs[DBG_NR_DRS];
 	struct Trapframe *ctx;
-	struct dbg_bp *cur_bp;
+	struct dbg_bp *cur_bp; /* int3 waiting to be re-inserted */
+	struct dbg_bp *hit_bp; /* breakpoint that stopped us */
 };
 
 extern int dbg_init();
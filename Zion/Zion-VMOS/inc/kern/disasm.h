@@ -299,35 +299,46 @@ typedef struct t_asmmodel {            // Model to search for assembler command
   int            jmppos;               // Position of jump offset in command
 } t_asmmodel;
 
-unique int       ideal;                // Force IDEAL decoding mode
-unique int       lowercase;            // Force lowercase display
-unique int       tabarguments;         // Tab between mnemonic and arguments
-unique int       extraspace;           // Extra space between arguments
-unique int       putdefseg;            // Display default segments in listing
-unique int       showmemsize;          // Always show memory size
-unique int       shownear;             // Show NEAR modifiers
-unique int       shortstringcmds;      // Use short form of string commands
-unique int       sizesens;             // How to decode size-sensitive mnemonics
-unique int       symbolic;             // Show symbolic addresses in disasm
-unique int       farcalls;             // Accept far calls, returns & addresses
-unique int       decodevxd;            // Decode VxD calls (Win95/98)
-unique int       privileged;           // Accept privileged commands
-unique int       iocommand;            // Accept I/O commands
-unique int       badshift;             // Accept shift out of range 1..31
-unique int       extraprefix;          // Accept superfluous prefixes
-unique int       lockedbus;            // Accept LOCK prefixes
-unique int       stackalign;           // Accept unaligned stack operations
-unique int       iswindowsnt;          // When checking for dangers, assume NT
+// Decoding options. They belong to the caller and are passed to every call,
+// so that decoders with different options never share state; NULL selects
+// all options zero.
+typedef struct t_disasmopt {
+  int            ideal;                // Force IDEAL decoding mode
+  int            lowercase;            // Force lowercase display
+  int            tabarguments;         // Tab between mnemonic and arguments
+  int            extraspace;           // Extra space between arguments
+  int            putdefseg;            // Display default segments in listing
+  int            showmemsize;          // Always show memory size
+  int            shownear;             // Show NEAR modifiers
+  int            shortstringcmds;      // Use short form of string commands
+  int            sizesens;             // How to decode size-sensitive mnemonics
+  int            symbolic;             // Show symbolic addresses in disasm
+  int            farcalls;             // Accept far calls, returns & addresses
+  int            decodevxd;            // Decode VxD calls (Win95/98)
+  int            privileged;           // Accept privileged commands
+  int            iocommand;            // Accept I/O commands
+  int            badshift;             // Accept shift out of range 1..31
+  int            extraprefix;          // Accept superfluous prefixes
+  int            lockedbus;            // Accept LOCK prefixes
+  int            stackalign;           // Accept unaligned stack operations
+  int            iswindowsnt;          // When checking for dangers, assume NT
+} t_disasmopt;
 
 int    Assemble(char *cmd,ulong ip,t_asmmodel *model,int attempt,
          int constsize,char *errtext);
 int    Checkcondition(int code,ulong flags);
 int    Decodeaddress(ulong addr,char *symb,int nsymb,char *comment);
 ulong  Disasm(char *src,ulong srcsize,ulong srcip,
-         t_disasm *disasm,int disasmmode);
-ulong  Disassembleback(char *block,ulong base,ulong size,ulong ip,int n);
-ulong  Disassembleforward(char *block,ulong base,ulong size,ulong ip,int n);
+         t_disasm *disasm,int disasmmode,const t_disasmopt *opt);
+ulong  Disasmlength(char *src,ulong srcsize,const t_disasmopt *opt);
+void   Disasminit(void);
+ulong  Disassembleback(char *block,ulong base,ulong size,ulong ip,int n,
+         const t_disasmopt *opt);
+ulong  Disassembleforward(char *block,ulong base,ulong size,ulong ip,int n,
+         const t_disasmopt *opt);
+void   Invalidateboundaries(ulong addr,ulong size);
 int    Isfilling(ulong addr,char *data,ulong size,ulong align);
+void   Markboundary(ulong addr);
 int    Print3dnow(char *s,char *f);
 int    Printfloat10(char *s,long double ext);
 int    Printfloat4(char *s,float f);
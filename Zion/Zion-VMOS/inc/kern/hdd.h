@@ -31,6 +31,31 @@
 #define		STATUS_ERR			0x01
 
 
+/* Bus master IDE registers, relative to the channel's bus master base (PCI BAR4). */
+#define 		BM_REG_CMD			0x0 		// Bus Master Command 	[I/O]
+#define 		BM_REG_STATUS		0x2 		// Bus Master Status 	[I/O]
+#define 		BM_REG_PRDT			0x4 		// PRD Table Address 	[I/O]
+
+#define 		BM_CMD_START		0x01 		// Start/Stop Bus Master
+#define 		BM_CMD_READ			0x08 		// Direction: device -> memory
+
+#define 		BM_STATUS_ACTIVE	0x01 		// Bus master IDE active
+#define 		BM_STATUS_ERR		0x02 		// DMA error (write 1 to clear)
+#define 		BM_STATUS_IRQ		0x04 		// Interrupt latch (write 1 to clear)
+
+/* Physical Region Descriptor, one entry of the bus master PRD table. */
+struct hd_prd {
+	u32 	base; 			// Physical base address, must be even
+	u16 	byte_cnt; 		// Byte count, 0 means 64KB
+	u16 	flags; 			// Bit 15: end of table
+};
+
+#define 		PRD_EOT					0x8000
+#define 		NR_PRD_ENTRIES		8
+#define 		DMA_MAX_SECTORS		128 		// 64KB per transfer
+#define 		DMA_BOUNDARY			0x10000 	// A PRD region may not cross 64KB
+
+
 
 /* device numbers of hard disk */
 #define		MINOR_hd1a			0x10
@@ -70,6 +95,12 @@ struct hd_cmd {
 #define 	CMD_IDENTIFY		0xEC
 #define 	CMD_READ			0x20
 #define 	CMD_WRITE			0x30
+#define 	CMD_READ_MULTIPLE_EXT 	0x29
+#define 	CMD_WRITE_MULTIPLE_EXT 	0x39
+#define 	CMD_READ_DMA_EXT 		0x25
+#define 	CMD_WRITE_DMA_EXT 		0x35
+#define 	CMD_SET_MULTIPLE 		0xC6
+#define 	CMD_FLUSH_CACHE_EXT 	0xEA
 
 /* for DEVICE register. */
 #define	MAKE_DEVICE_REG(lba,drv,lba_highest) (	\
@@ -84,9 +115,19 @@ struct hd_cmd {
 #define 	DEV_HD_MASTER 		0
 #define 	DEV_HD_SLAVE	 		1
 
+/* Transfer modes, from the fastest to the always-available one. */
+#define 	HD_MODE_AUTO 			0 		// Pick the best mode the hardware supports
+#define 	HD_MODE_DMA 			1 		// Bus master DMA
+#define 	HD_MODE_PIO_MULTI 	2 		// PIO, READ/WRITE MULTIPLE
+#define 	HD_MODE_PIO 			3 		// PIO, one DRQ block per sector
+
 void init_hd ( void );
 void hd_identify ( int drive );
-void hd_rw ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt );
+int hd_rw ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt );
+int hd_set_mode ( int mode );
+int hd_get_mode ( void );
+int hd_get_requested_mode ( void );
+char const *hd_mode_name ( int mode );
 
 
 #endif /* _HDD_H_ */
@@ -26,5 +26,9 @@ int mon_startvmx (int argc, char **argv, struct Trapframe *tf);
 int mon_LoadKernel (int argc, char **argv, struct Trapframe *tf);
 int mon_GetHDInfo (int argc, char **argv, struct Trapframe *tf);
 int mon_HDRead (int argc, char **argv, struct Trapframe *tf);
+int mon_HDMode (int argc, char **argv, struct Trapframe *tf);
+int mon_HDBench (int argc, char **argv, struct Trapframe *tf);
+int mon_BCache (int argc, char **argv, struct Trapframe *tf);
+int mon_IOLog (int argc, char **argv, struct Trapframe *tf);
 
 #endif	
@@ -227,9 +227,10 @@ ZVMSTATUS ZVMAPI CmInitializeSegmentSelector (
 );
 
 //++++++++++++++++++++asm volatile Functions++++++++++++++++++++++++++++
-ZVMSTATUS ZVMAPI CmSubvert (void *);
+// vmx-asm.S
+extern "C" ZVMSTATUS ZVMAPI CmSubvert (void *);
 
-void CmSlipIntoMatrix();
+extern "C" void CmSlipIntoMatrix();
 
 void CmReloadGdtr(PSEGMENT_DESCRIPTOR gdtbase, uint8_t gdtlimit);
 
@@ -22,7 +22,8 @@ ZVMSTATUS ZVMAPI HvmInit();
  */
 bool ZVMAPI HvmSupport();
 
-void HvmEventCallback(PCPU Cpu, PGUEST_REGS GuestRegs);
+// called from the VM Exit stub in vmx-asm.S
+extern "C" void HvmEventCallback(PCPU Cpu, PGUEST_REGS GuestRegs);
 
 ZVMSTATUS HvmResumeGuest();
 
@@ -30,7 +31,7 @@ ZVMSTATUS HvmResumeGuest();
   * Intialize the CPU struct and start VM by invoking VmxVirtualize()
   * requires: a valid <GuestRsp>
   **/
-ZVMSTATUS ZVMAPI HvmSubvertCpu (void * GuestRsp);
+extern "C" ZVMSTATUS ZVMAPI HvmSubvertCpu (void * GuestRsp);
  
 static ZVMSTATUS HvmSetupIdt (PCPU Cpu);
 
@@ -0,0 +1,92 @@
+#ifndef ZION_IOPORTS_H
+#define ZION_IOPORTS_H
+
+#include <inc/vmx/common.h>
+
+/*
+ * Per-port I/O dispatch table.
+ *
+ * The 64K port space is a two-level table: 256 directory slots (port >> 8),
+ * each pointing to a lazily allocated page of 256 entries (port & 0xff).
+ * Ports without a handler never allocate anything and go straight to the
+ * hardware.
+ */
+
+#define IO_PORT_DIR_SIZE	256
+#define IO_PORT_PAGE_SIZE	256
+
+#define IO_PORT_LOG		0x00000001      // Print every access to this port
+
+/*
+ * Emulate one access. For IN the handler fills *Value, for OUT it consumes it.
+ * Return FALSE to let the access go through to the hardware.
+ */
+typedef bool (
+  ZVMAPI * IO_PORT_HANDLER
+) (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  uint32_t * Value,
+  void *Context
+);
+
+/*
+ * Emulate Count accesses of a string instruction in one call. Buffer is
+ * the host mapping of the guest memory operand, Count * Size bytes and
+ * never crossing a guest page. Returns the number of elements handled,
+ * the rest goes through the single-access path.
+ */
+typedef uint32_t (
+  ZVMAPI * IO_PORT_STRING_HANDLER
+) (
+  PCPU Cpu,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  uint8_t * Buffer,
+  uint32_t Count,
+  void *Context
+);
+
+typedef struct _IO_PORT_ENTRY
+{
+  IO_PORT_HANDLER Handler;
+  IO_PORT_STRING_HANDLER StringHandler;
+  void *Context;
+  uint32_t Flags;
+} IO_PORT_ENTRY,
+ *PIO_PORT_ENTRY;
+
+ZVMSTATUS ZVMAPI IoRegisterPortHandler (
+  uint32_t FirstPort,
+  uint32_t Count,
+  IO_PORT_HANDLER Handler,
+  IO_PORT_STRING_HANDLER StringHandler,
+  void *Context
+);
+
+ZVMSTATUS ZVMAPI IoDeregisterPortHandler (
+  uint32_t FirstPort,
+  uint32_t Count
+);
+
+ZVMSTATUS ZVMAPI IoSetPortLogging (
+  uint32_t FirstPort,
+  uint32_t Count,
+  bool Enable
+);
+
+bool ZVMAPI IoIsPortLogged (
+  uint32_t Port
+);
+
+bool ZVMAPI IoDispatchAccess (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  uint32_t ExitQualification
+);
+
+#endif /* !ZION_IOPORTS_H */
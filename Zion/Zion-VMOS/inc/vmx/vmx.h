@@ -144,6 +144,7 @@ typedef struct _CPU
   void* HostStack;              // note that CPU structure reside in this memory region
  } CPU;
 
+// Frame built by the stubs in vmx/vmx-asm.S at every VM Exit, keep GUEST_REGS_SIZE there in sync.
 typedef struct _GUEST_REGS
 {
   uint32_t eax;                  // 0x00         // NOT VALID FOR SVM
@@ -234,6 +235,8 @@ enum SEGREGS
 
 //+++++++++++++++++++++Definitions+++++++++++++++++++++++++++
 #define	HOST_STACK_SIZE_IN_PAGES	16
+// Offset of the PCPU slot in the host stack; HOST_RSP points at it, VmxVmexitHandler reads it
+#define VMX_HOST_STACK_CPU_SLOT	0x0C00
 
 // this must be synchronized with CmSetBluepillSelectors() (common-asm volatile.asm volatile)
 #define	BP_GDT64_CODE		KGDT64_R0_CODE  // cs
@@ -424,6 +427,14 @@ static ZVMSTATUS ZVMAPI VmxVirtualize (
   PCPU Cpu
 );
 
+// vmx-asm.S
+extern "C" void VmxVmexitHandler ();
+
+extern "C" void ZVMAPI VmxResumeFailed (
+  PCPU Cpu,
+  uint32_t Rflags
+);
+
 
 //ZVMSTATUS start_vmx(void);
 
@@ -1,42 +1,222 @@
-#define __LOADER_DEBUG__
+//#define __LOADER_DEBUG__
 
 #include <inc/kern/Loader.h>
 #include <inc/lib/stdio.h>
 #include <inc/lib/stdlib.h>
 #include <inc/kern/hdd.h>
+#include <inc/kern/bcache.h>
 #include <inc/kern/common.h>
 #include <inc/lib/elf.h>
+#include <inc/arch/x86.h>
 
-void 
+static int ReadFileRange ( uint64_t NrStartSector, uint32_t FileOffset, uint8_t *pDest, uint32_t Size );
+
+/**************************************************
+ * Function: 		Load a raw file.
+ * Description: 	Read Size sectors from disk straight into memory.
+ * @param: 		NrStartSector - First sector of the file.
+ * 					MemBase - Destination address.
+ * 					Size - File size in sectors.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int
 LoadFile ( uint64_t NrStartSector, uint32_t MemBase, uint32_t Size )
 {
-	uint8_t 	hdbuf[SECTOR_SIZE * NUM_SECTOR_ONCE_READ];
-	uint64_t 	sector_idx = NrStartSector;
 	uint8_t 	*pMem = (uint8_t *)MemBase;
-	
-	for ( uint32_t i=0; i<Size; i+=NUM_SECTOR_ONCE_READ ) {
-		hd_rw(HD_READ, hdbuf, NrStartSector, NUM_SECTOR_ONCE_READ);
-		memcpy(pMem, hdbuf, SECTOR_SIZE * NUM_SECTOR_ONCE_READ);
-		sector_idx += NUM_SECTOR_ONCE_READ;
-		pMem += SECTOR_SIZE * NUM_SECTOR_ONCE_READ;
-	}//for()
-	
+
+	while ( Size ) {
+		uint16_t n = (Size > NUM_SECTOR_ONCE_READ) ? NUM_SECTOR_ONCE_READ : Size;
+
+		if ( !bc_read(pMem, NrStartSector, n) ) {
+			return 0;
+		}//if
+		NrStartSector += n;
+		pMem += SECTOR_SIZE * n;
+		Size -= n;
+	}//while
+
 #ifdef __LOADER_DEBUG__
 	output_buf((void *)MemBase, (SECTOR_SIZE * 4));
 #endif
+	return 1;
 }//LoadFile()
 
 
 
-uint32_t *
-ELF_Remap ( uint64_t NrStartSector, const void *__FileBase )
+/**************************************************
+ * Function: 		Read a byte range of a file.
+ * Description: 	Whole sectors are read directly into the destination, only a
+ * 					partial first or last sector goes through a bounce buffer.
+ * @param: 		NrStartSector - First sector of the file.
+ * 					FileOffset - Byte offset in the file.
+ * 					pDest - Destination address.
+ * 					Size - Number of bytes.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+static int
+ReadFileRange ( uint64_t NrStartSector, uint32_t FileOffset, uint8_t *pDest, uint32_t Size )
+{
+	uint8_t 	bounce[SECTOR_SIZE];
+	uint64_t 	sector = NrStartSector + FileOffset / SECTOR_SIZE;
+	uint32_t 	skip = FileOffset % SECTOR_SIZE;
+
+	// Unaligned head.
+	if ( skip && Size ) {
+		uint32_t len = SECTOR_SIZE - skip;
+		if ( len > Size ) {
+			len = Size;
+		}//if
+		if ( !bc_read(bounce, sector, 1) ) {
+			return 0;
+		}//if
+		memmove(pDest, bounce + skip, len);
+		pDest += len;
+		Size -= len;
+		sector++;
+	}//if
+
+	// Whole sectors, large requests bypass the cache and go to the driver.
+	while ( Size >= SECTOR_SIZE ) {
+		uint32_t n = Size / SECTOR_SIZE;
+		if ( n > NUM_SECTOR_ONCE_READ ) {
+			n = NUM_SECTOR_ONCE_READ;
+		}//if
+		if ( !bc_read(pDest, sector, n) ) {
+			return 0;
+		}//if
+		pDest += n * SECTOR_SIZE;
+		Size -= n * SECTOR_SIZE;
+		sector += n;
+	}//while
+
+	// Partial tail.
+	if ( Size ) {
+		if ( !bc_read(bounce, sector, 1) ) {
+			return 0;
+		}//if
+		memmove(pDest, bounce, Size);
+	}//if
+
+	return 1;
+}//ReadFileRange()
+
+
+
+/**************************************************
+ * Function: 		Load an ELF image.
+ * Description: 	Read the ELF and program headers, then stream every PT_LOAD
+ * 					segment from disk to MemBase + (p_pa - lowest p_pa) and
+ * 					zero its BSS. Nothing else of the file is read.
+ * @param: 		NrStartSector - First sector of the ELF file.
+ * 					MemBase - Where the lowest segment is placed.
+ * 					MemLimit - Bytes available from MemBase.
+ * 					pEntry - Returns the relocated entry point, may be NULL. e_entry
+ * 					is a virtual address, it is translated through the PT_LOAD
+ * 					segment whose [p_va, p_va + p_memsz) holds it.
+ * 					pSize - Returns the image size in memory (file + BSS), may be NULL.
+ * @return: 		1 if succeed, 0 if failed, -1 if the file is not ELF.
+ * ************************************************/
+int
+ELF_Load ( uint64_t NrStartSector, uint32_t MemBase, uint32_t MemLimit, uint32_t *pEntry, uint32_t *pSize )
 {
-//	const uint8_t *FileBase = (const uint8_t *)__FIleBase;
-	
-	uint8_t 	buf[SECTOR_SIZE];
-	struct ELF *ELFHeader = (struct ELF *) buf;
-//	struct ProgHeader
-	
-	return 0;
-};
+	uint8_t 				hdrbuf[SECTOR_SIZE * ELF_HDR_SECTORS];
+	struct ELF 			*ELFHeader = (struct ELF *)hdrbuf;
+	struct ProgHeader 	*ph, *eph, *EntrySeg = NULL;
+	uint32_t 			LowestPA = 0xFFFFFFFF, HighestPA = 0;
+	uint32_t 			FileBytes = 0, LoadedBytes;
+	uint64_t 			tsc_start, cycles;
+
+	tsc_start = read_tsc();
+
+	if ( !bc_read(hdrbuf, NrStartSector, 1) ) {
+		return 0;
+	}//if
+	if ( ELFHeader->e_magic != ELF_MAGIC ) {
+		return -1;
+	}//if
+	// Written so that a huge e_phoff cannot wrap the sum around.
+	if ( ELFHeader->e_phentsize != sizeof(struct ProgHeader) || ELFHeader->e_phoff > sizeof(hdrbuf) ||
+		 ELFHeader->e_phnum > (sizeof(hdrbuf) - ELFHeader->e_phoff) / sizeof(struct ProgHeader) ) {
+		cprintf("\tERROR: ELF program headers do not fit in %d sectors!\n", ELF_HDR_SECTORS);
+		return 0;
+	}//if
+	if ( ELFHeader->e_phoff + ELFHeader->e_phnum * sizeof(struct ProgHeader) > SECTOR_SIZE &&
+		 !bc_read(hdrbuf + SECTOR_SIZE, NrStartSector + 1, ELF_HDR_SECTORS - 1) ) {
+		return 0;
+	}//if
+
+	ph = (struct ProgHeader *)(hdrbuf + ELFHeader->e_phoff);
+	eph = ph + ELFHeader->e_phnum;
+
+	// Find the physical span of the image first, so it can be checked against MemLimit.
+	for ( struct ProgHeader *p = ph; p < eph; p++ ) {
+		if ( p->p_type != ELF_PROG_LOAD || p->p_memsz == 0 ) {
+			continue;
+		}//if
+		// The span below only covers p_memsz, a larger p_filesz would be read past it.
+		if ( p->p_filesz > p->p_memsz || p->p_memsz > 0xFFFFFFFF - p->p_pa ) {
+			cprintf("\tERROR: ELF segment at 0x%08x has a bad size!\n", p->p_pa);
+			return 0;
+		}//if
+		if ( p->p_pa < LowestPA ) {
+			LowestPA = p->p_pa;
+		}//if
+		if ( p->p_pa + p->p_memsz > HighestPA ) {
+			HighestPA = p->p_pa + p->p_memsz;
+		}//if
+		if ( ELFHeader->e_entry - p->p_va < p->p_memsz ) {
+			EntrySeg = p;
+		}//if
+	}//for
+	if ( HighestPA <= LowestPA ) {
+		cprintf("\tERROR: ELF file has no loadable segment!\n");
+		return 0;
+	}//if
+	if ( HighestPA - LowestPA > MemLimit ) {
+		cprintf("\tERROR: ELF image needs %u bytes, only %u available!\n", HighestPA - LowestPA, MemLimit);
+		return 0;
+	}//if
+	if ( EntrySeg == NULL ) {
+		cprintf("\tERROR: ELF entry point 0x%08x is in no loadable segment!\n", ELFHeader->e_entry);
+		return 0;
+	}//if
+
+	for ( ; ph < eph; ph++ ) {
+		uint8_t 	*pDest;
+
+		if ( ph->p_type != ELF_PROG_LOAD || ph->p_memsz == 0 ) {
+			continue;
+		}//if
+		pDest = (uint8_t *)(MemBase + (ph->p_pa - LowestPA));
+
+#ifdef __LOADER_DEBUG__
+		cprintf("\tPT_LOAD: offset=0x%08x pa=0x%08x filesz=0x%08x memsz=0x%08x -> 0x%08x\n",
+				ph->p_offset, ph->p_pa, ph->p_filesz, ph->p_memsz, pDest);
+#endif
+
+		if ( !ReadFileRange(NrStartSector, ph->p_offset, pDest, ph->p_filesz) ) {
+			return 0;
+		}//if
+		if ( ph->p_memsz > ph->p_filesz ) {
+			memset(pDest + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+		}//if
+		FileBytes += ph->p_filesz;
+	}//for
+
+	LoadedBytes = HighestPA - LowestPA;
+	if ( pEntry != NULL ) {
+		*pEntry = MemBase + (EntrySeg->p_pa - LowestPA) + (ELFHeader->e_entry - EntrySeg->p_va);
+	}//if
+	if ( pSize != NULL ) {
+		*pSize = LoadedBytes;
+	}//if
+
+	cycles = read_tsc() - tsc_start;
+	cprintf("\tLoaded %u bytes from disk (%u bytes in memory) in %llu cycles", FileBytes, LoadedBytes, cycles);
+	if ( FileBytes ) {
+		cprintf(", %llu cycles/KB", cycles * 1024 / FileBytes);
+	}//if
+	cprintf("\n");
 
+	return 1;
+}//ELF_Load()
@@ -23,6 +23,7 @@
 #include <inc/types.h>
 #include <inc/lib/stdio.h>
 #include <inc/lib/string.h>
+#include <inc/lib/stdlib.h>
 
 #include <inc/kern/disasm.h>
 
@@ -693,7 +694,9 @@ int Decodeaddress(ulong addr,char *symb,int nsymb,char *comment) {
 
   // Environment-specific routine! Do it yourself!
 
-
+  // Callers test comment[0] even when nothing was decoded.
+  if (symb!=NULL && nsymb>0) symb[0]='\0';
+  if (comment!=NULL) comment[0]='\0';
   return 0;
 };
 
@@ -783,41 +786,144 @@ int Print3dnow(char *s,char *f) {
   return n;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////// INSTRUCTION BOUNDARY CACHE //////////////////////////
+
+// Backward disassembly must guess where commands start. To avoid guessing again
+// on each step of the debugger, known command starts are kept as bitmaps (one
+// bit per byte) for a few recently used code pages. A set bit is only a hint:
+// before it is used, command at this address is decoded once more and must end
+// exactly where expected, so stale bits cost one decode but never give wrong
+// answer.
+
+#define NBNDREGION     8               // Number of cached code pages
+#define BNDPAGESIZE    4096            // Bytes covered by one bitmap
+
+typedef struct t_bndregion {           // Known command starts in one page
+  int            used;                 // Slot contains valid page
+  ulong          base;                 // Address of the page
+  ulong          lastused;             // Value of bndclock at last access
+  uchar          bits[BNDPAGESIZE/8];  // Bit set: command starts here
+} t_bndregion;
+
+static t_bndregion bndregion[NBNDREGION];
+static ulong     bndclock;             // Access counter for LRU replacement
+
+// Returns bitmap of the page containing addr. If page is not cached and create
+// is set, least recently used slot is cleared and reassigned, otherwise
+// returns NULL.
+static t_bndregion *Findregion(ulong addr,int create) {
+  int i,j;
+  t_bndregion *pr;
+  addr&=~(ulong)(BNDPAGESIZE-1);
+  for (i=0,j=0; i<NBNDREGION; i++) {
+    pr=bndregion+i;
+    if (pr->used && pr->base==addr) {
+      pr->lastused=++bndclock;
+      return pr; };
+    if (bndregion[j].used && (pr->used==0 || pr->lastused<bndregion[j].lastused))
+      j=i;
+  };
+  if (create==0) return NULL;
+  pr=bndregion+j;
+  memset(pr->bits,0,sizeof(pr->bits));
+  pr->used=1;
+  pr->base=addr;
+  pr->lastused=++bndclock;
+  return pr;
+};
+
+static int Isboundary(ulong addr) {
+  t_bndregion *pr;
+  pr=Findregion(addr,0);
+  if (pr==NULL) return 0;
+  addr-=pr->base;
+  return (pr->bits[addr>>3]>>(addr&7))&1;
+};
+
+// Remembers that some command starts at address addr. Call it for commands
+// that were decoded in forward direction and for destinations of jumps and
+// calls.
+void Markboundary(ulong addr) {
+  t_bndregion *pr;
+  pr=Findregion(addr,1);
+  addr-=pr->base;
+  pr->bits[addr>>3]|=(uchar)(1<<(addr&7));
+};
+
+// Forgets command starts that may become invalid when size bytes of code at
+// addr are modified (patched, or breakpoint is set or removed). Commands that
+// start up to MAXCMDSIZE-1 bytes before addr may overlap modified bytes and
+// are discarded too.
+void Invalidateboundaries(ulong addr,ulong size) {
+  int i;
+  ulong end,lo,hi;
+  t_bndregion *pr;
+  if (size==0) return;
+  end=addr+size-1;                     // Last modified byte
+  if (end<addr) end=0xFFFFFFFF;
+  if (addr>=MAXCMDSIZE-1) addr-=MAXCMDSIZE-1; else addr=0;
+  for (i=0; i<NBNDREGION; i++) {
+    pr=bndregion+i;
+    if (pr->used==0 || pr->base>end || pr->base+(BNDPAGESIZE-1)<addr)
+      continue;
+    lo=(addr>pr->base?addr-pr->base:0);
+    hi=(end-pr->base<BNDPAGESIZE-1?end-pr->base:BNDPAGESIZE-1);
+    for ( ; lo<=hi; lo++)
+      pr->bits[lo>>3]&=(uchar)~(1<<(lo&7));
+  };
+};
+
 // Function attempts to calculate address of assembler instruction which is n
 // lines back in the listing. Maximal stepback is limited to 127. In general,
 // this is rather non-trivial task. Proposed solution may cause problems which
-// however are not critical here.
-ulong Disassembleback(char *block,ulong base,ulong size,ulong ip,int n) {
-  int i;
+// however are not critical here. Known command starts are tried first, so in
+// the usual case (listing around already visited code) no guessing is done.
+ulong Disassembleback(char *block,ulong base,ulong size,ulong ip,int n,
+  const t_disasmopt *opt) {
+  int i,j;
   ulong abuf[131],addr,back,cmdsize;
   char *pdata;
-  t_disasm da;
   if (block==NULL) return 0;           // Error, no code!
   if (n<0) n=0; else if (n>127) n=127; // Try to correct obvious errors
   if (ip>base+size) ip=base+size;
   if (n==0) return ip;                 // Obvious answers
   if (ip<=base+n) return base;
+  // Step back over known commands. Command at each of them must end exactly
+  // at the previous step.
+  for ( ; n>0; n--) {
+    for (j=1; j<=MAXCMDSIZE && (ulong)j<=ip-base; j++) {
+      if (Isboundary(ip-j)==0) continue;
+      addr=ip-j-base;
+      if (Disasmlength(block+addr,size-addr,opt)==(ulong)j) break; };
+    if (j>MAXCMDSIZE || (ulong)j>ip-base) break;
+    ip-=j; };
+  if (n==0) return ip;                 // Answer taken from the cache
+  if (ip<=base+n) return base;
   back=MAXCMDSIZE*(n+3);               // Command length limited to MAXCMDSIZE
   if (ip<base+back) back=ip-base;
   addr=ip-back;
   pdata=block+(addr-base);
   for (i=0; addr<ip; i++) {
     abuf[i%128]=addr;
-    cmdsize=Disasm(pdata,back,addr,&da,DISASM_SIZE);
+    cmdsize=Disasmlength(pdata,back,opt);
     pdata+=cmdsize;
     addr+=cmdsize;
     back-=cmdsize; };
+  if (addr==ip) {                      // Remember commands that lead to ip
+    for (j=(i<n?0:i-n); j<i; j++) Markboundary(abuf[j%128]); };
   if (i<n) return abuf[0];
   else return abuf[(i-n+128)%128];
 };
 
 // Function attempts to calculate address of assembler instruction which is n
-// lines forward in the listing.
-ulong Disassembleforward(char *block,ulong base,ulong size,ulong ip,int n) {
+// lines forward in the listing. Decoded commands are remembered as known
+// command starts.
+ulong Disassembleforward(char *block,ulong base,ulong size,ulong ip,int n,
+  const t_disasmopt *opt) {
   int i;
   ulong cmdsize;
   char *pdata;
-  t_disasm da;
   if (block==NULL) return 0;           // Error, no code!
   if (ip<base) ip=base;                // Try to correct obvious errors
   if (ip>base+size) ip=base+size;
@@ -825,7 +931,8 @@ ulong Disassembleforward(char *block,ulong base,ulong size,ulong ip,int n) {
   pdata=block+(ip-base);
   size-=(ip-base);
   for (i=0; i<n && size>0; i++) {
-    cmdsize=Disasm(pdata,size,ip,&da,DISASM_SIZE);
+    Markboundary(ip);
+    cmdsize=Disasmlength(pdata,size,opt);
     pdata+=cmdsize;
     ip+=cmdsize;
     size-=cmdsize; };
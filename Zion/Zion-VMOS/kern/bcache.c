@@ -0,0 +1,528 @@
+#include <inc/kern/bcache.h>
+#include <inc/kern/hdd.h>
+#include <inc/lib/stdio.h>
+#include <inc/lib/stdlib.h>
+
+/* Flags of a cache block. */
+#define 	BC_VALID 		0x1
+#define 	BC_DIRTY 		0x2
+#define 	BC_RA 			0x4 		// Brought in by read-ahead, not used yet
+
+#define 	BC_NONE 		(-1)
+
+struct bc_block {
+	u64 		blkno; 			// Disk block number (sector / BCACHE_BLOCK_SECTORS)
+	u16 		flags;
+	int16_t 	hnext; 			// Next block in the hash chain
+	int16_t 	lru_prev; 		// Towards the most recently used block
+	int16_t 	lru_next; 		// Towards the least recently used block
+};
+
+static struct bc_block 	bc_blocks[BCACHE_NR_BLOCKS];
+static u8 					bc_data[BCACHE_NR_BLOCKS][BCACHE_BLOCK_SIZE] __attribute__((aligned(BCACHE_BLOCK_SIZE)));
+static u8 					bc_staging[BCACHE_READAHEAD_MAX * BCACHE_BLOCK_SIZE] __attribute__((aligned(BCACHE_BLOCK_SIZE)));
+static int16_t 			bc_hash[BCACHE_HASH_SIZE];
+static int16_t 			bc_lru_head = BC_NONE; 		// Most recently used
+static int16_t 			bc_lru_tail = BC_NONE; 		// Least recently used, next victim
+static int 					bc_ready = 0;
+static struct bcache_stats bc_stats;
+
+// Sequential access detection.
+static u64 					bc_next_sect = 0;
+static u32 					bc_seq_count = 0;
+
+#define 	BC_HASH(blkno) 		((u32)(blkno) & (BCACHE_HASH_SIZE - 1))
+
+static void bc_init ( void );
+static int bc_lookup ( u64 blkno );
+static void bc_hash_insert ( int idx );
+static void bc_hash_remove ( int idx );
+static void bc_lru_touch ( int idx );
+static int bc_get_victim ( void );
+static int bc_fill ( u64 blkno, u32 count, int *pidx );
+static int bc_writeback ( int idx );
+static int bc_sync_range ( u64 sect_nr, u32 sector_cnt, int drop );
+static int bc_rw_direct ( u8 rw, u8 *buf, u64 sect_nr, u32 sector_cnt );
+
+/**************************************************
+ * Function: 		Initialize the block cache.
+ * Description: 	All blocks start invalid and are chained into the LRU list.
+ * @param: 		<none>
+ * @return: 		<none>
+ * ************************************************/
+static void
+bc_init ( void )
+{
+	for ( int i = 0; i < BCACHE_HASH_SIZE; i++ ) {
+		bc_hash[i] = BC_NONE;
+	}//for
+
+	for ( int i = 0; i < BCACHE_NR_BLOCKS; i++ ) {
+		bc_blocks[i].flags = 0;
+		bc_blocks[i].hnext = BC_NONE;
+		bc_blocks[i].lru_prev = i - 1;
+		bc_blocks[i].lru_next = (i == BCACHE_NR_BLOCKS - 1) ? BC_NONE : i + 1;
+	}//for
+	bc_lru_head = 0;
+	bc_lru_tail = BCACHE_NR_BLOCKS - 1;
+
+	bc_ready = 1;
+}//bc_init()
+
+
+
+static int
+bc_lookup ( u64 blkno )
+{
+	int 	idx;
+
+	for ( idx = bc_hash[BC_HASH(blkno)]; idx != BC_NONE; idx = bc_blocks[idx].hnext ) {
+		if ( bc_blocks[idx].blkno == blkno ) {
+			return idx;
+		}//if
+	}//for
+
+	return BC_NONE;
+}//bc_lookup()
+
+
+
+static void
+bc_hash_insert ( int idx )
+{
+	u32 	h = BC_HASH(bc_blocks[idx].blkno);
+
+	bc_blocks[idx].hnext = bc_hash[h];
+	bc_hash[h] = idx;
+}//bc_hash_insert()
+
+
+
+static void
+bc_hash_remove ( int idx )
+{
+	int16_t 	*pp = &bc_hash[BC_HASH(bc_blocks[idx].blkno)];
+
+	while ( *pp != BC_NONE ) {
+		if ( *pp == idx ) {
+			*pp = bc_blocks[idx].hnext;
+			break;
+		}//if
+		pp = &bc_blocks[*pp].hnext;
+	}//while
+	bc_blocks[idx].hnext = BC_NONE;
+}//bc_hash_remove()
+
+
+
+/**************************************************
+ * Function: 		Mark a block most recently used.
+ * ************************************************/
+static void
+bc_lru_touch ( int idx )
+{
+	struct bc_block *b = &bc_blocks[idx];
+
+	if ( bc_lru_head == idx ) {
+		return;
+	}//if
+
+	// Unlink.
+	bc_blocks[b->lru_prev].lru_next = b->lru_next;
+	if ( b->lru_next != BC_NONE ) {
+		bc_blocks[b->lru_next].lru_prev = b->lru_prev;
+	} else {
+		bc_lru_tail = b->lru_prev;
+	}//if...else
+
+	// Insert at the head.
+	b->lru_prev = BC_NONE;
+	b->lru_next = bc_lru_head;
+	bc_blocks[bc_lru_head].lru_prev = idx;
+	bc_lru_head = idx;
+}//bc_lru_touch()
+
+
+
+/**************************************************
+ * Function: 		Get a free block.
+ * Description: 	Reuse the least recently used block, writing it back first
+ * 					if it is dirty. The block is returned most recently used,
+ * 					invalid and out of the hash.
+ * @return: 		Block index, BC_NONE if the write-back failed.
+ * ************************************************/
+static int
+bc_get_victim ( void )
+{
+	int 	idx = bc_lru_tail;
+
+	if ( bc_blocks[idx].flags & BC_VALID ) {
+		if ( (bc_blocks[idx].flags & BC_DIRTY) && !bc_writeback(idx) ) {
+			return BC_NONE;
+		}//if
+		bc_hash_remove(idx);
+		bc_stats.evictions++;
+	}//if
+
+	bc_blocks[idx].flags = 0;
+	bc_lru_touch(idx);
+	return idx;
+}//bc_get_victim()
+
+
+
+/**************************************************
+ * Function: 		Fill blocks from disk.
+ * Description: 	Read "count" consecutive blocks with one driver request.
+ * 					Blocks after the first are marked as read-ahead.
+ * @param: 		blkno - First block.
+ * 					count - Number of blocks, at most BCACHE_READAHEAD_MAX.
+ * 					pidx - Returns the index of the first block.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+static int
+bc_fill ( u64 blkno, u32 count, int *pidx )
+{
+	int 	idx = BC_NONE;
+
+	if ( count == 1 ) {
+		if ( (idx = bc_get_victim()) == BC_NONE ) {
+			return 0;
+		}//if
+		if ( !hd_rw(HD_READ, bc_data[idx], blkno * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS) ) {
+			return 0;
+		}//if
+		bc_blocks[idx].blkno = blkno;
+		bc_blocks[idx].flags = BC_VALID;
+		bc_hash_insert(idx);
+		*pidx = idx;
+		return 1;
+	}//if
+
+	if ( !hd_rw(HD_READ, bc_staging, blkno * BCACHE_BLOCK_SECTORS, count * BCACHE_BLOCK_SECTORS) ) {
+		return 0;
+	}//if
+
+	// Insert the read-ahead blocks first, so the demanded one ends up most recently used.
+	for ( int i = count - 1; i >= 0; i-- ) {
+		if ( (idx = bc_get_victim()) == BC_NONE ) {
+			return 0;
+		}//if
+		memmove(bc_data[idx], bc_staging + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+		bc_blocks[idx].blkno = blkno + i;
+		bc_blocks[idx].flags = i ? (BC_VALID | BC_RA) : BC_VALID;
+		bc_hash_insert(idx);
+	}//for
+	bc_stats.readahead += count - 1;
+
+	*pidx = idx;
+	return 1;
+}//bc_fill()
+
+
+
+static int
+bc_writeback ( int idx )
+{
+	if ( !hd_rw(HD_WRITE, bc_data[idx], bc_blocks[idx].blkno * BCACHE_BLOCK_SECTORS, BCACHE_BLOCK_SECTORS) ) {
+		return 0;
+	}//if
+	bc_blocks[idx].flags &= ~BC_DIRTY;
+	bc_stats.writebacks++;
+	return 1;
+}//bc_writeback()
+
+
+
+/**************************************************
+ * Function: 		Sync a sector range.
+ * Description: 	Write back dirty blocks overlapping the range, optionally
+ * 					dropping them from the cache. Used around requests that
+ * 					bypass the cache.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+static int
+bc_sync_range ( u64 sect_nr, u32 sector_cnt, int drop )
+{
+	u64 	first = sect_nr / BCACHE_BLOCK_SECTORS;
+	u64 	last = (sect_nr + sector_cnt - 1) / BCACHE_BLOCK_SECTORS;
+
+	// Walk whichever is smaller, the range or the cache.
+	if ( last - first < BCACHE_NR_BLOCKS ) {
+		for ( u64 blkno = first; blkno <= last; blkno++ ) {
+			int idx = bc_lookup(blkno);
+			if ( idx == BC_NONE ) {
+				continue;
+			}//if
+			if ( (bc_blocks[idx].flags & BC_DIRTY) && !bc_writeback(idx) ) {
+				return 0;
+			}//if
+			if ( drop ) {
+				bc_hash_remove(idx);
+				bc_blocks[idx].flags = 0;
+			}//if
+		}//for
+	} else {
+		for ( int idx = 0; idx < BCACHE_NR_BLOCKS; idx++ ) {
+			if ( !(bc_blocks[idx].flags & BC_VALID) ||
+				 bc_blocks[idx].blkno < first || bc_blocks[idx].blkno > last ) {
+				continue;
+			}//if
+			if ( (bc_blocks[idx].flags & BC_DIRTY) && !bc_writeback(idx) ) {
+				return 0;
+			}//if
+			if ( drop ) {
+				bc_hash_remove(idx);
+				bc_blocks[idx].flags = 0;
+			}//if
+		}//for
+	}//if...else
+
+	return 1;
+}//bc_sync_range()
+
+
+
+static int
+bc_rw_direct ( u8 rw, u8 *buf, u64 sect_nr, u32 sector_cnt )
+{
+	while ( sector_cnt ) {
+		u16 	n = (sector_cnt > 0x8000) ? 0x8000 : sector_cnt;
+
+		if ( !hd_rw(rw, buf, sect_nr, n) ) {
+			return 0;
+		}//if
+		buf += n * SECTOR_SIZE;
+		sect_nr += n;
+		sector_cnt -= n;
+	}//while
+
+	return 1;
+}//bc_rw_direct()
+
+
+
+/**************************************************
+ * Function: 		Cached read.
+ * Description: 	Serve sectors from the cache, reading missing blocks from
+ * 					disk. Once the caller reads sequentially, misses prefetch
+ * 					up to BCACHE_READAHEAD_MAX blocks in one request. Requests
+ * 					of BCACHE_BYPASS_SECTORS or more go to the driver directly.
+ * @param: 		buf - Destination, sector_cnt * SECTOR_SIZE bytes.
+ * 					sect_nr - First sector.
+ * 					sector_cnt - Number of sectors.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int
+bc_read ( u8 *buf, u64 sect_nr, u32 sector_cnt )
+{
+	if ( !bc_ready ) {
+		bc_init();
+	}//if
+	if ( sector_cnt == 0 ) {
+		return 1;
+	}//if
+
+	if ( sect_nr == bc_next_sect ) {
+		bc_seq_count++;
+	} else {
+		bc_seq_count = 0;
+	}//if...else
+	bc_next_sect = sect_nr + sector_cnt;
+
+	if ( sector_cnt >= BCACHE_BYPASS_SECTORS ) {
+		bc_stats.bypass++;
+		return bc_sync_range(sect_nr, sector_cnt, 0) && bc_rw_direct(HD_READ, buf, sect_nr, sector_cnt);
+	}//if
+
+	while ( sector_cnt ) {
+		u64 	blkno = sect_nr / BCACHE_BLOCK_SECTORS;
+		u32 	offset = sect_nr % BCACHE_BLOCK_SECTORS;
+		u32 	n = BCACHE_BLOCK_SECTORS - offset;
+		int 	idx = bc_lookup(blkno);
+
+		if ( n > sector_cnt ) {
+			n = sector_cnt;
+		}//if
+
+		if ( idx != BC_NONE ) {
+			bc_stats.read_hits++;
+			if ( bc_blocks[idx].flags & BC_RA ) {
+				bc_stats.readahead_hits++;
+				bc_blocks[idx].flags &= ~BC_RA;
+			}//if
+			bc_lru_touch(idx);
+		} else {
+			u32 	count = 1;
+
+			bc_stats.read_misses++;
+			if ( bc_seq_count >= BCACHE_SEQ_THRESHOLD ) {
+				// Prefetch up to the next block that is already cached.
+				while ( count < BCACHE_READAHEAD_MAX && bc_lookup(blkno + count) == BC_NONE ) {
+					count++;
+				}//while
+			}//if
+			// Read-ahead may run past the end of the disk, retry the demanded block alone.
+			if ( !bc_fill(blkno, count, &idx) && (count == 1 || !bc_fill(blkno, 1, &idx)) ) {
+				return 0;
+			}//if
+		}//if...else
+
+		memmove(buf, bc_data[idx] + offset * SECTOR_SIZE, n * SECTOR_SIZE);
+		buf += n * SECTOR_SIZE;
+		sect_nr += n;
+		sector_cnt -= n;
+	}//while
+
+	return 1;
+}//bc_read()
+
+
+
+/**************************************************
+ * Function: 		Cached write.
+ * Description: 	Write-back: data is copied into the cache and marked dirty,
+ * 					it reaches the disk on eviction or bc_flush(). A partial
+ * 					block is read first. Large requests are written through.
+ * @param: 		buf - Source, sector_cnt * SECTOR_SIZE bytes.
+ * 					sect_nr - First sector.
+ * 					sector_cnt - Number of sectors.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int
+bc_write ( const u8 *buf, u64 sect_nr, u32 sector_cnt )
+{
+	if ( !bc_ready ) {
+		bc_init();
+	}//if
+	if ( sector_cnt == 0 ) {
+		return 1;
+	}//if
+
+	if ( sector_cnt >= BCACHE_BYPASS_SECTORS ) {
+		bc_stats.bypass++;
+		return bc_sync_range(sect_nr, sector_cnt, 1) && bc_rw_direct(HD_WRITE, (u8 *)buf, sect_nr, sector_cnt);
+	}//if
+
+	while ( sector_cnt ) {
+		u64 	blkno = sect_nr / BCACHE_BLOCK_SECTORS;
+		u32 	offset = sect_nr % BCACHE_BLOCK_SECTORS;
+		u32 	n = BCACHE_BLOCK_SECTORS - offset;
+		int 	idx = bc_lookup(blkno);
+
+		if ( n > sector_cnt ) {
+			n = sector_cnt;
+		}//if
+
+		if ( idx != BC_NONE ) {
+			bc_stats.write_hits++;
+			bc_lru_touch(idx);
+		} else if ( n == BCACHE_BLOCK_SECTORS ) { 	// Whole block, nothing to read.
+			bc_stats.write_misses++;
+			if ( (idx = bc_get_victim()) == BC_NONE ) {
+				return 0;
+			}//if
+			bc_blocks[idx].blkno = blkno;
+			bc_hash_insert(idx);
+		} else {
+			bc_stats.write_misses++;
+			if ( !bc_fill(blkno, 1, &idx) ) {
+				return 0;
+			}//if
+		}//if...else
+
+		memmove(bc_data[idx] + offset * SECTOR_SIZE, buf, n * SECTOR_SIZE);
+		bc_blocks[idx].flags = BC_VALID | BC_DIRTY;
+		buf += n * SECTOR_SIZE;
+		sect_nr += n;
+		sector_cnt -= n;
+	}//while
+
+	return 1;
+}//bc_write()
+
+
+
+/**************************************************
+ * Function: 		Uncached read.
+ * Description: 	Read straight from disk. Cached blocks in the range are
+ * 					written back if dirty and dropped, so the data returned is
+ * 					what the disk holds and later cached reads see it too.
+ * @param: 		buf - Destination, sector_cnt * SECTOR_SIZE bytes.
+ * 					sect_nr - First sector.
+ * 					sector_cnt - Number of sectors.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int
+bc_read_uncached ( u8 *buf, u64 sect_nr, u32 sector_cnt )
+{
+	if ( !bc_ready ) {
+		bc_init();
+	}//if
+	if ( sector_cnt == 0 ) {
+		return 1;
+	}//if
+
+	bc_stats.bypass++;
+	return bc_sync_range(sect_nr, sector_cnt, 1) && bc_rw_direct(HD_READ, buf, sect_nr, sector_cnt);
+}//bc_read_uncached()
+
+
+
+/**************************************************
+ * Function: 		Flush the cache.
+ * Description: 	Write every dirty block back to disk.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int
+bc_flush ( void )
+{
+	int 	ok = 1;
+
+	if ( !bc_ready ) {
+		return 1;
+	}//if
+
+	for ( int idx = 0; idx < BCACHE_NR_BLOCKS; idx++ ) {
+		if ( (bc_blocks[idx].flags & BC_DIRTY) && !bc_writeback(idx) ) {
+			ok = 0;
+		}//if
+	}//for
+
+	return ok;
+}//bc_flush()
+
+
+
+/**************************************************
+ * Function: 		Invalidate the cache.
+ * Description: 	Flush, then drop every block.
+ * @return: 		1 if succeed, 0 if the flush failed (nothing is dropped).
+ * ************************************************/
+int
+bc_invalidate ( void )
+{
+	if ( !bc_flush() ) {
+		return 0;
+	}//if
+
+	bc_init();
+	bc_seq_count = 0;
+	return 1;
+}//bc_invalidate()
+
+
+
+void
+bc_get_stats ( struct bcache_stats *stats )
+{
+	*stats = bc_stats;
+}//bc_get_stats()
+
+
+
+void
+bc_reset_stats ( void )
+{
+	memset(&bc_stats, 0, sizeof(bc_stats));
+}//bc_reset_stats()
@@ -0,0 +1,76 @@
+#include <inc/kern/boottime.h>
+#include <inc/lib/stdio.h>
+#include <inc/lib/stdlib.h>
+#include <inc/arch/x86.h>
+#include <inc/hardcoding_param.h>
+
+static const char 	*boot_phase_name[BOOT_PHASE_NR] = {
+	"loader", "loader-read", "loader-unpack", "loader-done",
+	"kern-entry", "cons-init", "ctors", "mem-detect", "page-init",
+	"paging", "idt-init", "vmx-init", "monitor",
+};
+static uint64_t 		boot_phase_tsc[BOOT_PHASE_NR]; 	// 0: checkpoint not reached
+
+
+
+/**************************************************
+ * Function: 		Start boot phase timing.
+ * Description: 	Take the kernel entry checkpoint and copy the ones left by
+ * 					Seraph, before mem_init() may hand their page out.
+ * 					Must be the first thing i386_init() does.
+ * ************************************************/
+void
+boot_phase_init ( void )
+{
+	uint32_t 	*p = (uint32_t *)BootTSC_paddr;
+
+	boot_phase_tsc[BOOT_PHASE_KERN_ENTRY] = read_tsc();
+	if ( p[0] == BOOT_TSC_MAGIC ) {
+		memcpy(&boot_phase_tsc[BOOT_PHASE_LOADER], p + 2, (BOOT_PHASE_LOADER_DONE + 1) * sizeof(uint64_t));
+		p[0] = 0; 		// Don't report stale values after a warm restart
+	}//if
+}//boot_phase_init()
+
+
+
+/**************************************************
+ * Function: 		Record a boot phase checkpoint.
+ * @param: 		phase - BOOT_PHASE_*, the phase that just finished.
+ * ************************************************/
+void
+boot_phase ( int phase )
+{
+	if ( phase >= 0 && phase < BOOT_PHASE_NR ) {
+		boot_phase_tsc[phase] = read_tsc();
+	}//if
+}//boot_phase()
+
+
+
+/**************************************************
+ * Function: 		Print the boot phase table.
+ * Description: 	One "boot-phase:" line per reached checkpoint with the cycles
+ * 					spent since the previous one and since the first one, then
+ * 					a "total" line. tools/bootbench.sh parses this from the
+ * 					serial port.
+ * ************************************************/
+void
+boot_phase_report ( void )
+{
+	uint64_t 	first = 0, prev = 0;
+	int 			i;
+
+	cprintf("Boot phases (TSC cycles: phase, cumulative)\n");
+	for ( i = 0; i < BOOT_PHASE_NR; i++ ) {
+		if ( boot_phase_tsc[i] == 0 ) {
+			continue;
+		}//if
+		if ( first == 0 ) {
+			first = prev = boot_phase_tsc[i];
+		}//if
+		cprintf("boot-phase: %-14s %12llu %12llu\n", boot_phase_name[i],
+				boot_phase_tsc[i] - prev, boot_phase_tsc[i] - first);
+		prev = boot_phase_tsc[i];
+	}//for
+	cprintf("boot-phase: %-14s %12llu %12llu\n", "total", prev - first, prev - first);
+}//boot_phase_report()
@@ -389,6 +389,57 @@ kbd_init ( void )
 
 
 
+/***** Serial port output (COM1) *****/
+// Everything written to the console is copied here as well, so a headless
+// emulator can capture it (tools/bootbench.sh relies on this).
+
+#define COM1			0x3F8
+#define COM_TX			0		// Out: Transmit buffer (DLAB=0)
+#define COM_DLL			0		// Out: Divisor Latch Low (DLAB=1)
+#define COM_DLM			1		// Out: Divisor Latch High (DLAB=1)
+#define COM_IER			1		// Out: Interrupt Enable Register
+#define COM_FCR			2		// Out: FIFO Control Register
+#define COM_LCR			3		// Out: Line Control Register
+#define	COM_LCR_DLAB	0x80	//   Divisor latch access bit
+#define	COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
+#define COM_MCR			4		// Out: Modem Control Register
+#define COM_LSR			5		// In:	Line Status Register
+#define COM_LSR_TXRDY	0x20	//   Transmit buffer avail
+
+static bool 	serial_exists;
+
+static void 
+serial_init ( void )
+{
+	outb(COM1 + COM_FCR, 0); 						// Turn off the FIFO
+	outb(COM1 + COM_LCR, COM_LCR_DLAB); 			// 115200 baud
+	outb(COM1 + COM_DLL, 1);
+	outb(COM1 + COM_DLM, 0);
+	outb(COM1 + COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB); 	// 8 data bits, 1 stop bit, parity off
+	outb(COM1 + COM_MCR, 0);
+	outb(COM1 + COM_IER, 0); 						// No interrupts
+
+	// If the status register reads 0xFF, there is no serial port.
+	serial_exists = (inb(COM1 + COM_LSR) != 0xFF);
+}//serial_init()
+
+
+static void 
+serial_putc ( int c )
+{
+	int i;
+
+	if ( !serial_exists ) {
+		return;
+	}//if
+	for ( i = 0; !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800; i++ ) {
+		inb(0x84); 			// ~1.25us delay
+	}//for
+	outb(COM1 + COM_TX, c);
+}//serial_putc()
+
+
+
 /***** General device-independent console code *****/
 // Here we manage the console input buffer,
 // where we stash characters received from the keyboard 
@@ -448,6 +499,10 @@ int cons_getc(void)
 // output a character to the console
 void cons_putc(int c)
 {
+	if ( c == '\n' ) {
+		serial_putc('\r');
+	}//if
+	serial_putc(c);
 	cga_putc(c);
 }//cons_putc()
 
@@ -458,6 +513,7 @@ void cons_init(void)
 {
 	cga_init();
 	kbd_init();
+	serial_init();
 
 //	cons.rpos = 0;
 //	cons.wpos = 0;
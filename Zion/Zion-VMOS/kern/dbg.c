@@ -13,12 +13,23 @@
 #include <inc/lib/string.h>
 #include <inc/lib/stdlib.h>
 #include <inc/kern/disasm.h>
+#include <inc/arch/x86.h>
 
 
 #ifdef DEBUGGER_ENABLED
 extern struct Segdesc gdt[]; // TODO
 
 static struct dbg_block dbg;
+static t_disasmopt _dbg_disasmopt; /* lowercase MASM syntax, set up by dbg_init() */
+
+#define DR6_B0_B3 0x0000000F /* DRn condition detected */
+#define DR7_L0 0x00000001 /* local enable of DR0, DRn uses bit n*2 */
+#define DR7_LE 0x00000100 /* exact data breakpoints */
+#define DR7_GE 0x00000200
+
+static const char *_bp_type_name[] = { "exec", "write", "io", "access" };
+static const char *_reg_name[] = { "edi", "esi", "ebp", "oesp", "ebx", "edx", "ecx", "eax" };
+static const char *_cond_op_name[] = { "", "==", "!=", "<", ">", "&" };
 
 /*~ file scope static functions(private) */
 static uint32_t _get_seg_base(uint32_t segid)
@@ -69,41 +80,149 @@ static void _dump_addr(void *raw, char *fmt)
 
 static void _dbg_print_bp(int n, int print_empty)
 {
-	if (n >= MAX_DEBUGGER_BPS)
+	struct dbg_bp *bp;
+	if (n < 0 || n >= MAX_DEBUGGER_BPS)
 	{
 		debug_warning("try printing breakpoint out of bound!\n");
 	}
 	else if (print_empty || dbg.bps[n].valid)
 	{
-		cprintf("breakpoint #%d(%s):0x%08x\n", n, dbg.bps[n].valid ? "active" : "inactive",dbg.bps[n].addr);
+		bp = &dbg.bps[n];
+		cprintf("breakpoint #%d(%s):0x%08x %s", n, bp->valid ? "active" : "inactive", bp->addr, _bp_type_name[bp->type]);
+		if (bp->type != DBG_BP_EXEC)
+			cprintf("/%d", bp->len);
+		if (bp->dr >= 0)
+			cprintf(" dr%d", bp->dr);
+		else
+			cprintf(" int3");
+		if (bp->cond.op != DBG_COND_NONE)
+			cprintf(" if %s%s%x", _reg_name[bp->cond.reg], _cond_op_name[bp->cond.op], bp->cond.value);
+		cprintf(" hits %u\n", bp->hits);
 	}
 }
 
+static uint32_t _bp_hash(uint32_t addr)
+{
+	return (addr ^ (addr >> 6) ^ (addr >> 12)) & (DBG_BP_HASH_SIZE - 1);
+}
+
+/* type < 0 matches any breakpoint at addr */
+static struct dbg_bp *_find_bp(uint32_t addr, int type)
+{
+	struct dbg_bp *bp;
+	for (bp = dbg.hash[_bp_hash(addr)]; bp != NULL; bp = bp->next)
+	{
+		if (bp->addr == addr && (type < 0 || bp->type == type))
+			break;
+	}
+	return bp;
+}
+
 static int _get_bpidx_by_addr(uint32_t addr)
 {
+	struct dbg_bp *bp = _find_bp(addr, -1);
+	return bp != NULL ? bp - dbg.bps : MAX_DEBUGGER_BPS;
+}
+
+static void _hash_bp(struct dbg_bp *bp)
+{
+	uint32_t h = _bp_hash(bp->addr);
+	bp->next = dbg.hash[h];
+	dbg.hash[h] = bp;
+}
+
+static void _unhash_bp(struct dbg_bp *bp)
+{
+	struct dbg_bp **pp = &dbg.hash[_bp_hash(bp->addr)];
+	while (*pp != bp)
+		pp = &(*pp)->next;
+	*pp = bp->next;
+}
+
+/* program DR0-DR3 and DR7 from dbg.drs */
+static void _load_drs(void)
+{
+	uint32_t addr[DBG_NR_DRS] = {0};
+	uint32_t dr7 = DR7_LE | DR7_GE;
 	int i;
-	for (i = 0; i < MAX_DEBUGGER_BPS; ++i)
+	for (i = 0; i < DBG_NR_DRS; ++i)
 	{
-		if (dbg.bps[i].valid && dbg.bps[i].addr == addr)
-			break;
+		struct dbg_bp *bp = dbg.drs[i];
+		if (bp == NULL)
+			continue;
+		addr[i] = bp->addr;
+		/* R/W in bits 16+4n, LEN (0: 1 byte, 1: 2 bytes, 3: 4 bytes) in bits 18+4n */
+		dr7 |= DR7_L0 << (i * 2);
+		dr7 |= (bp->type | ((bp->len - 1) << 2)) << (16 + i * 4);
 	}
-	return i;
+	ldr0(addr[0]);
+	ldr1(addr[1]);
+	ldr2(addr[2]);
+	ldr3(addr[3]);
+	ldr7(dr7);
+}
+
+static int _dbg_cond_true(struct dbg_bp *bp, struct Trapframe *ctx)
+{
+	uint32_t v;
+	if (bp->cond.op == DBG_COND_NONE)
+		return 1;
+	v = ((uint32_t *)&ctx->tf_regs)[bp->cond.reg];
+	switch (bp->cond.op)
+	{
+	case DBG_COND_EQ:
+		return v == bp->cond.value;
+	case DBG_COND_NE:
+		return v != bp->cond.value;
+	case DBG_COND_LT:
+		return v < bp->cond.value;
+	case DBG_COND_GT:
+		return v > bp->cond.value;
+	case DBG_COND_AND:
+		return (v & bp->cond.value) != 0;
+	}
+	return 1;
+}
+
+/* disassemble one command, its address and jump target become known
+|| instruction boundaries for backward listing */
+static unsigned long _dbg_disasm(char *addr, t_disasm *da)
+{
+	unsigned long len = Disasm(addr, MAXCMDSIZE, (unsigned long)addr, da, DISASM_CODE, &_dbg_disasmopt);
+	if (da->error == DAE_NOERR)
+	{
+		Markboundary((unsigned long)addr);
+		if (da->jmpconst)
+			Markboundary(da->jmpconst);
+	}
+	return len;
 }
 
 static void _dbg_print_ctx(struct Trapframe *ctx)
 {
 	t_disasm da;
-	if (ctx->tf_trapno == 3)
+	unsigned long window = MAXCMDSIZE * (DBG_BACK_LINES + 3);
+	if (dbg.hit_bp != NULL)
 	{
-		cprintf("breakpoint #%d @ %08x\n",_get_bpidx_by_addr(dbg.cur_bp->addr), dbg.cur_bp->addr);
+		cprintf("breakpoint #%d(%s) @ %08x\n", dbg.hit_bp - dbg.bps, _bp_type_name[dbg.hit_bp->type], dbg.hit_bp->addr);
 	}
 	else if (ctx->tf_trapno == 1)
 		;
 	else
 		debug_warning("why send it to debugger??\n");
-	ideal=0; lowercase=1; putdefseg=0;
-	Disasm((char *)ctx->tf_eip, ctx->tf_eip, 0,&da,DISASM_CODE);
-	cprintf("%08x  %-24s  %-24s\n", ctx->tf_eip, da.dump, da.result);
+	if (ctx->tf_eip > window)
+	{ /* a few commands before eip, usually straight from the boundary cache */
+		char *base = (char *)(ctx->tf_eip - window);
+		char *addr = (char *)Disassembleback(base, (unsigned long)base, window, ctx->tf_eip, DBG_BACK_LINES, &_dbg_disasmopt);
+		while (addr < (char *)ctx->tf_eip)
+		{
+			char *t = addr + _dbg_disasm(addr, &da);
+			cprintf("  %08x  %-24s  %-24s\n", addr, da.dump, da.result);
+			addr = t;
+		}
+	}
+	_dbg_disasm((char *)ctx->tf_eip, &da);
+	cprintf("> %08x  %-24s  %-24s\n", ctx->tf_eip, da.dump, da.result);
 }
 
 static char *_eat_white_char(char *p)
@@ -113,23 +232,97 @@ static char *_eat_white_char(char *p)
 	return p;
 }
 
-static int _dbg_add_bp(uint32_t addr)
+/* parse "if <reg><op><hex>", returns NULL on syntax error */
+static char *_parse_cond(char *p, struct dbg_cond *cond)
 {
-	int i;
-	for (i = 0; i < MAX_DEBUGGER_BPS; ++i)
+	int i, n;
+	cond->op = DBG_COND_NONE;
+	p = _eat_white_char(p);
+	if (strncmp(p, "if", 2) != 0)
+		return p;
+	p = _eat_white_char(p + 2);
+	for (i = 0; i < 8; ++i)
 	{
-		if (!dbg.bps[i].valid)
-		{
-			dbg.bps[i].valid = 1;
-			dbg.bps[i].addr = addr;
-			dbg.bps[i].origin = *(uint8_t *)addr;
-			*(uint8_t *)addr = 0xCC; /* set int3 */
+		if (strncmp(p, _reg_name[i], strlen(_reg_name[i])) == 0)
+			break;
+	}
+	if (i == 8)
+		return NULL;
+	cond->reg = i;
+	p = _eat_white_char(p + strlen(_reg_name[i]));
+	for (i = DBG_COND_EQ; i <= DBG_COND_AND; ++i)
+	{
+		n = strlen(_cond_op_name[i]);
+		if (strncmp(p, _cond_op_name[i], n) == 0)
 			break;
-		}
 	}
+	if (i > DBG_COND_AND)
+		return NULL;
+	cond->op = i;
+	cond->value = strtol(_eat_white_char(p + n), &p, 16);
+	return p;
+}
+
+/* debug registers first, int3 only for execution breakpoints when they run out;
+|| returns the slot, MAX_DEBUGGER_BPS if no slot left, -1 if no debug register left */
+static int _dbg_add_bp(uint32_t addr, int type, int len, struct dbg_cond *cond)
+{
+	int i, dr;
+	struct dbg_bp *bp;
+	for (i = 0; i < MAX_DEBUGGER_BPS && dbg.bps[i].valid; ++i)
+		;
+	if (i == MAX_DEBUGGER_BPS)
+		return i;
+	for (dr = 0; dr < DBG_NR_DRS && dbg.drs[dr] != NULL; ++dr)
+		;
+	if (dr == DBG_NR_DRS && type != DBG_BP_EXEC)
+		return -1;
+	bp = &dbg.bps[i];
+	bp->valid = 1;
+	bp->addr = addr;
+	bp->type = type;
+	bp->len = type == DBG_BP_EXEC ? 1 : len;
+	bp->hits = 0;
+	bp->cond = *cond;
+	if (dr < DBG_NR_DRS)
+	{
+		bp->dr = dr;
+		dbg.drs[dr] = bp;
+		_load_drs();
+	}
+	else
+	{
+		bp->dr = -1;
+		bp->origin = *(uint8_t *)addr;
+		*(uint8_t *)addr = 0xCC; /* set int3 */
+		Invalidateboundaries(addr, 1);
+	}
+	_hash_bp(bp);
 	return i;
 }
 
+static void _dbg_del_bp(int n)
+{
+	struct dbg_bp *bp;
+	if (n < 0 || n >= MAX_DEBUGGER_BPS || !dbg.bps[n].valid)
+		return;
+	bp = &dbg.bps[n];
+	if (bp->dr >= 0)
+	{
+		dbg.drs[bp->dr] = NULL;
+		_load_drs();
+	}
+	else
+	{
+		*(uint8_t *)bp->addr = bp->origin;
+		Invalidateboundaries(bp->addr, 1);
+		if (dbg.cur_bp == bp) /* do not re-insert it after the step */
+			dbg.cur_bp = NULL;
+	}
+	_unhash_bp(bp);
+	bp->valid = 0;
+}
+
 static void _print_sregs(struct Trapframe *ctx)
 {
 	// TODO
@@ -169,8 +362,18 @@ int dbg_init()
 	int i;
 	for (i = 0; i < MAX_DEBUGGER_BPS; ++i)
 		dbg.bps[i].valid = 0;
+	for (i = 0; i < DBG_BP_HASH_SIZE; ++i)
+		dbg.hash[i] = NULL;
+	for (i = 0; i < DBG_NR_DRS; ++i)
+		dbg.drs[i] = NULL;
+	_load_drs();
 	dbg.ctx = NULL;
+	dbg.cur_bp = NULL;
+	dbg.hit_bp = NULL;
 	dbg.step_trap = 0;
+	memset(&_dbg_disasmopt, 0, sizeof(_dbg_disasmopt));
+	_dbg_disasmopt.lowercase = 1;
+	Disasminit();
 	return 0;
 }
 
@@ -195,8 +398,7 @@ loop:
 				if ((n = _get_bpidx_by_addr(strtol(p, NULL, 16))) == MAX_DEBUGGER_BPS)
 					cprintf("no breakpoint @ %s\n", p);
 			}
-			*(uint8_t *)dbg.bps[n].addr = dbg.bps[n].origin;
-			dbg.bps[n].valid = 0;
+			_dbg_del_bp(n);
 		}
 		else if (*p == '?') /* query */
 		{
@@ -212,19 +414,50 @@ loop:
 					_dbg_print_bp(i, 0);
 			}
 		}
-		else /* add */
+		else /* add: b <addr>, bw|ba <addr> [len], then optional if <reg><op><hex> */
 		{
-			int n;
-			p = _eat_white_char(p);
-			n = _dbg_add_bp(strtol(p, NULL, 16));
-			if (n >= MAX_DEBUGGER_BPS)
+			int n, type = DBG_BP_EXEC, len = 1;
+			uint32_t addr;
+			struct dbg_cond cond;
+			char *q;
+			if (*p == 'w' || *p == 'a')
+			{
+				type = *p++ == 'w' ? DBG_BP_WRITE : DBG_BP_ACCESS;
+				len = 4;
+			}
+			addr = strtol(_eat_white_char(p), &p, 16);
+			if (type != DBG_BP_EXEC)
+			{
+				p = _eat_white_char(p);
+				n = strtol(p, &q, 10);
+				if (q != p)
+				{
+					len = n;
+					p = q;
+				}
+				if ((len != 1 && len != 2 && len != 4) || (addr & (len - 1)))
+				{
+					cprintf("watchpoint must be 1, 2 or 4 bytes and aligned!\n");
+					break;
+				}
+			}
+			if (_parse_cond(p, &cond) == NULL)
+			{
+				cprintf("bad condition, use: if <reg><==|!=|<|>|&><hex>\n");
+				break;
+			}
+			n = _dbg_add_bp(addr, type, len, &cond);
+			if (n < 0)
+			{
+				cprintf("debug registers run out!\n");
+			}
+			else if (n >= MAX_DEBUGGER_BPS)
 			{
 				cprintf("breakpoint slot run out!\n");
 			}
 			else
 			{
-				*(uint8_t *)dbg.bps[n].addr = 0xCC;
-				cprintf("breakpoint #%d set to %s\n", n, p);
+				_dbg_print_bp(n, 1);
 			}
 		}
 		break;
@@ -280,10 +513,9 @@ loop:
 			int i;
 			char *addr = (char *)strtol(_eat_white_char(p), NULL, 16), *t = addr;
 			t_disasm da;
-			ideal=0; lowercase=1; putdefseg=0;
 			for (i = 0; i < 16; ++i)
 			{
-				t += Disasm(addr, (unsigned long)addr, 0, &da, DISASM_CODE);
+				t += _dbg_disasm(addr, &da);
 				cprintf("%08x  %-24s  %-24s\n", addr, da.dump, da.result);
 				addr = t;
 			}
@@ -313,6 +545,7 @@ loop:
 			char *addr = (char *)strtol(_eat_white_char(p), &p, 16);
 			int len = _parse_data(buffer, p);
 			memcpy(addr, buffer, len);
+			Invalidateboundaries((unsigned long)addr, len);
 		} while(0);
 		break;
 	default:
@@ -325,46 +558,68 @@ out_ret:
 	return 0;
 }
 
+/* conditions are checked here, a breakpoint whose condition fails
+|| resumes at once without entering the console */
 int dbg_break(struct Trapframe *ctx)
 {
+	struct dbg_bp *bp = NULL;
 	if (dbg.ctx != NULL)
 	{
 		debug_warning("nested debugging context not handled!\n");
 		return 1;
 	}
+	dbg.hit_bp = NULL;
 	if (ctx->tf_trapno == 1)
 	{
+		uint32_t dr6 = rdr6();
+		int i;
+		ldr6(0); /* DR6 status bits are never cleared by the cpu */
 		if (dbg.cur_bp != NULL)
 		{ /* breakpoint fix! */
 			*(uint8_t *)dbg.cur_bp->addr = 0xCC;
 			dbg.cur_bp = NULL;
-			ctx->tf_eflags &= ~FL_TF;
 			// TODO unset msrs
 		}
-		if (dbg.step_trap)
+		ctx->tf_eflags &= ~FL_TF;
+		for (i = 0; i < DBG_NR_DRS; ++i)
 		{
-			_dbg_print_ctx(dbg.ctx = ctx);
-			dbg.step_trap = 0;
-			return dbg_console();
+			if ((dr6 & DR6_B0_B3 & (1 << i)) && dbg.drs[i] != NULL)
+			{
+				bp = dbg.drs[i];
+				break;
+			}
+		}
+		if (bp != NULL)
+		{ /* debug register hit, nothing to restore */
+			if (bp->type == DBG_BP_EXEC)
+				ctx->tf_eflags |= FL_RF; /* do not fault on this instruction again */
+			++bp->hits;
+			if (!dbg.step_trap && !_dbg_cond_true(bp, ctx))
+				return 0;
+			dbg.hit_bp = bp;
 		}
-		return 0;
+		else if (!dbg.step_trap)
+			return 0;
+		dbg.step_trap = 0;
+		_dbg_print_ctx(dbg.ctx = ctx);
+		return dbg_console();
 	}
 	if (ctx->tf_trapno == 3)
 	{
-		int n = _get_bpidx_by_addr(ctx->tf_eip - 1);
-		if (n != MAX_DEBUGGER_BPS)
-		{
-			dbg.cur_bp = &dbg.bps[n];
-		}
-		else
+		bp = _find_bp(ctx->tf_eip - 1, DBG_BP_EXEC);
+		if (bp == NULL || bp->dr >= 0)
 		{
 			debug_warning("unknown breakpoint encountered!\n");
 			return 1;
 		}
+		dbg.cur_bp = bp;
 		ctx->tf_eflags |= FL_TF; /* set eeflag.tp for fix*/
 		--ctx->tf_eip;
-		*(uint8_t *)dbg.cur_bp->addr = dbg.cur_bp->origin;
-		
+		*(uint8_t *)bp->addr = bp->origin;
+		++bp->hits;
+		if (!_dbg_cond_true(bp, ctx))
+			return 0; /* put back by the single step */
+		dbg.hit_bp = bp;
 		_dbg_print_ctx(dbg.ctx = ctx);
 		return dbg_console();
 	}
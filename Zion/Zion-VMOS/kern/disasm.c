@@ -43,82 +43,93 @@ static char *strlwr(char *s)
 ////////////////////////////////////////////////////////////////////////////////
 //////////////////////////// DISASSEMBLER FUNCTIONS ////////////////////////////
 
-// Work variables of disassembler
-static ulong     datasize;             // Size of data (1,2,4 bytes)
-static ulong     addrsize;             // Size of address (2 or 4 bytes)
-static int       segprefix;            // Segment override prefix or SEG_UNDEF
-static int       hasrm;                // Command has ModR/M byte
-static int       hassib;               // Command has SIB byte
-static int       dispsize;             // Size of displacement (if any)
-static int       immsize;              // Size of immediate data (if any)
-static int       softerror;            // Noncritical disassembler error
-static int       ndump;                // Current length of command dump
-static int       nresult;              // Current length of disassembly
-static int       addcomment;           // Comment value of operand
+// Work variables of disassembler. They live in the stack frame of Disasm(),
+// and options come from the caller, so several commands may be decoded at the
+// same time. The only shared data is the command index, which is read-only
+// once Disasminit() has built it.
+typedef struct t_dstate {
+  ulong          datasize;             // Size of data (1,2,4 bytes)
+  ulong          addrsize;             // Size of address (2 or 4 bytes)
+  int            segprefix;            // Segment override prefix or SEG_UNDEF
+  int            hasrm;                // Command has ModR/M byte
+  int            hassib;               // Command has SIB byte
+  int            dispsize;             // Size of displacement (if any)
+  int            immsize;              // Size of immediate data (if any)
+  int            softerror;            // Noncritical disassembler error
+  int            ndump;                // Current length of command dump
+  int            nresult;              // Current length of disassembly
+  int            addcomment;           // Comment value of operand
+  // Copy of input parameters of function Disasm()
+  char           *cmd;                 // Pointer to binary data
+  char           *pfixup;              // Pointer to possible fixups or NULL
+  ulong          size;                 // Remaining size of the command buffer
+  t_disasm       *da;                  // Pointer to disassembly results
+  int            mode;                 // Disassembly mode (DISASM_xxx)
+  const t_disasmopt *opt;              // Decoding options of the caller
+} t_dstate;
 
-// Copy of input parameters of function Disasm()
-static char      *cmd;                 // Pointer to binary data
-static char      *pfixup;              // Pointer to possible fixups or NULL
-static ulong     size;                 // Remaining size of the command buffer
-static t_disasm  *da;                  // Pointer to disassembly results
-static int       mode;                 // Disassembly mode (DISASM_xxx)
+static const t_disasmopt defaultopt={0};  // All options zero
 
 // Disassemble name of 1, 2 or 4-byte general-purpose integer register and, if
 // requested and available, dump its contents. Parameter type changes decoding
 // of contents for some operand types.
-static void DecodeRG(int index,int datasize,int type) {
+static void DecodeRG(t_dstate *ds,int index,int regsize,int type) {
+  t_disasm *da=ds->da;
   int sizeindex;
   char name[9];
-  if (mode<DISASM_DATA) return;        // No need to decode
+  if (ds->mode<DISASM_DATA) return;    // No need to decode
   index&=0x07;
-  if (datasize==1)
+  if (regsize==1)
     sizeindex=0;
-  else if (datasize==2)
+  else if (regsize==2)
     sizeindex=1;
-  else if (datasize==4)
+  else if (regsize==4)
     sizeindex=2;
   else {
     da->error=DAE_INTERN; return; };
-  if (mode>=DISASM_FILE) {
+  if (ds->mode>=DISASM_FILE) {
     strcpy(name,regname[sizeindex][index]);
-    if (lowercase) strlwr(name);
+    if (ds->opt->lowercase) strlwr(name);
     if (type<PSEUDOOP)                 // Not a pseudooperand
-      nresult+=snprintf(da->result+nresult,1024,"%s",name);
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s",name);
     ;
   };
 };
 
 // Disassemble name of 80-bit floating-point register and, if available, dump
 // its contents.
-static void DecodeST(int index,int pseudoop) {
+static void DecodeST(t_dstate *ds,int index,int pseudoop) {
+  t_disasm *da=ds->da;
   int i;
   char s[32];
-  if (mode<DISASM_FILE) return;        // No need to decode
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
   index&=0x07;
-  i=snprintf(s,1024,"%s(%i)",(lowercase?"st":"ST"),index);
+  i=snprintf(s,1024,"%s(%i)",(ds->opt->lowercase?"st":"ST"),index);
   if (pseudoop==0) {
-    strcpy(da->result+nresult,s);
-    nresult+=i;
+    strcpy(da->result+ds->nresult,s);
+    ds->nresult+=i;
   };
 };
 
 // Disassemble name of 64-bit MMX register.
-static void DecodeMX(int index) {
+static void DecodeMX(t_dstate *ds,int index) {
+  t_disasm *da=ds->da;
   char *pr;
-  if (mode<DISASM_FILE) return;        // No need to decode
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
   index&=0x07;
-  pr=da->result+nresult;
-  nresult+=snprintf(pr,1024,"%s%i",(lowercase?"mm":"MM"),index);
+  pr=da->result+ds->nresult;
+  ds->nresult+=snprintf(pr,1024,"%s%i",(ds->opt->lowercase?"mm":"MM"),index);
 };
 
 // Disassemble name of 64-bit 3DNow! register and, if available, dump its
 // contents.
-static void DecodeNR(int index) {
+static void DecodeNR(t_dstate *ds,int index) {
+  t_disasm *da=ds->da;
   char *pr;
-  if (mode<DISASM_FILE) return;        // No need to decode
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
   index&=0x07;
-  pr=da->result+nresult;
-  nresult+=snprintf(pr,1024,"%s%i",(lowercase?"mm":"MM"),index);
+  pr=da->result+ds->nresult;
+  ds->nresult+=snprintf(pr,1024,"%s%i",(ds->opt->lowercase?"mm":"MM"),index);
 };
 
 // Service function, adds valid memory adress in MASM or Ideal format to
@@ -127,38 +138,39 @@ static void DecodeNR(int index) {
 // offset - constant part of address, dsize - data size in bytes. If global
 // flag 'symbolic' is set, function also tries to decode offset as name of
 // some label.
-static void Memadr(int defseg,const char *descr,long offset,int dsize) {
+static void Memadr(t_dstate *ds,int defseg,const char *descr,long offset,int dsize) {
+  t_disasm *da=ds->da;
   int i,n,seg;
   char *pr;
   char s[TEXTLEN];
-  if (mode<DISASM_FILE || descr==NULL)
+  if (ds->mode<DISASM_FILE || descr==NULL)
     return;                            // No need or possibility to decode
-  pr=da->result+nresult; n=0;
-  if (segprefix!=SEG_UNDEF) seg=segprefix; else seg=defseg;
-  if (ideal!=0) pr[n++]='[';
+  pr=da->result+ds->nresult; n=0;
+  if (ds->segprefix!=SEG_UNDEF) seg=ds->segprefix; else seg=defseg;
+  if (ds->opt->ideal!=0) pr[n++]='[';
   // In some cases Disassembler may omit size of memory operand. Namely, flag
   // showmemsize must be 0, type bit C_EXPL must be 0 (this bit namely means
   // that explicit operand size is necessary) and type of command must not be
   // C_MMX or C_NOW (because bit C_EXPL has in these cases different meaning).
   // Otherwise, exact size must be supplied.
-  if (showmemsize!=0 || (da->cmdtype & C_TYPEMASK)==C_MMX ||
+  if (ds->opt->showmemsize!=0 || (da->cmdtype & C_TYPEMASK)==C_MMX ||
     (da->cmdtype & C_TYPEMASK)==C_NOW || (da->cmdtype & C_EXPL)!=0
   ) {
     if ((unsigned)dsize<sizeof(sizename)/sizeof(sizename[0]))
-      n+=snprintf(pr+n,1024,"%s %s",sizename[dsize],(ideal==0?"PTR ":""));
+      n+=snprintf(pr+n,1024,"%s %s",sizename[dsize],(ds->opt->ideal==0?"PTR ":""));
     else
-      n+=snprintf(pr+n,1024,"(%i-BYTE) %s",dsize,(ideal==0?"PTR ":""));
+      n+=snprintf(pr+n,1024,"(%i-BYTE) %s",dsize,(ds->opt->ideal==0?"PTR ":""));
     ;
   };
-  if ((putdefseg!=0 || seg!=defseg) && seg!=SEG_UNDEF)
+  if ((ds->opt->putdefseg!=0 || seg!=defseg) && seg!=SEG_UNDEF)
     n+=snprintf(pr+n,1024,"%s:",segname[seg]);
-  if (ideal==0) pr[n++]='[';
+  if (ds->opt->ideal==0) pr[n++]='[';
   n+=snprintf(pr+n,1024,"%s",descr);
-  if (lowercase) strlwr(pr);
+  if (ds->opt->lowercase) strlwr(pr);
   if (offset==0L) {
     if (*descr=='\0') pr[n++]='0'; }
   else {
-    if (symbolic && mode>=DISASM_CODE)
+    if (ds->opt->symbolic && ds->mode>=DISASM_CODE)
       i=Decodeaddress(offset,s,TEXTLEN-n-24,NULL);
     else i=0;
     if (i>0) {                         // Offset decoded in symbolic form
@@ -172,27 +184,28 @@ static void Memadr(int defseg,const char *descr,long offset,int dsize) {
     };
   };
   pr[n++]=']'; pr[n]='\0';
-  nresult+=n;
+  ds->nresult+=n;
 };
 
 // Disassemble memory/register from the ModRM/SIB bytes and, if available, dump
 // address and contents of memory.
-static void DecodeMR(int type) {
+static void DecodeMR(t_dstate *ds,int type) {
+  t_disasm *da=ds->da;
   int j,memonly,inmemory,seg = 0;
   int c,sib;
   ulong dsize,regsize,addr;
   char s[TEXTLEN];
-  if (size<2) {
+  if (ds->size<2) {
     da->error=DAE_CROSS; return; };    // ModR/M byte outside the memory block
-  hasrm=1;
-  dsize=regsize=datasize;              // Default size of addressed reg/memory
+  ds->hasrm=1;
+  dsize=regsize=ds->datasize;          // Default size of addressed reg/memory
   memonly=0;                           // Register in ModM field is allowed
   // Size and kind of addressed memory or register in ModM has no influence on
   // the command size, and exact calculations are omitted if only command size
   // is requested. If register is used, optype will be incorrect and we need
   // to correct it later.
-  c=cmd[1] & 0xC7;                     // Leave only Mod and M fields
-  if (mode>=DISASM_DATA) {
+  c=ds->cmd[1] & 0xC7;                 // Leave only Mod and M fields
+  if (ds->mode>=DISASM_DATA) {
     if ((c & 0xC0)==0xC0)              // Register operand
       inmemory=0;
     else                               // Memory operand
@@ -200,15 +213,15 @@ static void DecodeMR(int type) {
     switch (type) {
       case MRG:                        // Memory/register in ModRM byte
         if (inmemory) {
-          if (datasize==1) da->memtype=DEC_BYTE;
-          else if (datasize==2) da->memtype=DEC_WORD;
+          if (ds->datasize==1) da->memtype=DEC_BYTE;
+          else if (ds->datasize==2) da->memtype=DEC_WORD;
           else da->memtype=DEC_DWORD; };
         break;
       case MRJ:                        // Memory/reg in ModRM as JUMP target
-        if (datasize!=2 && inmemory)
+        if (ds->datasize!=2 && inmemory)
           da->memtype=DEC_DWORD; 
-        if (mode>=DISASM_FILE && shownear!=0)
-          nresult+=snprintf(da->result+nresult,1024,"%s ",(lowercase?"near":"NEAR"));
+        if (ds->mode>=DISASM_FILE && ds->opt->shownear!=0)
+          ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s ",(ds->opt->lowercase?"near":"NEAR"));
         break;
       case MR1:                        // 1-byte memory/register in ModRM byte
         dsize=regsize=1;
@@ -231,23 +244,23 @@ static void DecodeMR(int type) {
       case MMA:                        // Memory address in ModRM byte for LEA
         memonly=1; break;
       case MML:                        // Memory in ModRM byte (for LES)
-        dsize=datasize+2; memonly=1;
-        if (datasize==4 && inmemory)
+        dsize=ds->datasize+2; memonly=1;
+        if (ds->datasize==4 && inmemory)
           da->memtype=DEC_FWORD;
         da->warnings|=DAW_SEGMENT;
         break;
       case MMS:                        // Memory in ModRM byte (as SEG:OFFS)
-        dsize=datasize+2; memonly=1;
-        if (datasize==4 && inmemory)
+        dsize=ds->datasize+2; memonly=1;
+        if (ds->datasize==4 && inmemory)
           da->memtype=DEC_FWORD;
-        if (mode>=DISASM_FILE)
-          nresult+=snprintf(da->result+nresult,1024,"%s ",(lowercase?"far":"FAR"));
+        if (ds->mode>=DISASM_FILE)
+          ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s ",(ds->opt->lowercase?"far":"FAR"));
         break;
       case MM6:                        // Memory in ModRM (6-byte descriptor)
         dsize=6; memonly=1;
         if (inmemory) da->memtype=DEC_FWORD; break;
       case MMB:                        // Two adjacent memory locations (BOUND)
-        dsize=(ideal?datasize:datasize*2); memonly=1; break;
+        dsize=(ds->opt->ideal?ds->datasize:ds->datasize*2); memonly=1; break;
       case MD2:                        // Memory in ModRM byte (16-bit integer)
       case MB2:                        // Memory in ModRM byte (16-bit binary)
         dsize=2; memonly=1;
@@ -286,69 +299,69 @@ static void DecodeMR(int type) {
   // possibility is register in ModM - general-purpose, MMX or 3DNow!
   if ((c & 0xC0)==0xC0) {              // Decode register operand
     if (type==MR8 || type==RR8)
-      DecodeMX(c);                     // MMX register
+      DecodeMX(ds,c);                     // MMX register
     else if (type==MRD || type==RRD)
-      DecodeNR(c);                     // 3DNow! register
+      DecodeNR(ds,c);                     // 3DNow! register
     else  
-      DecodeRG(c,regsize,type);        // General-purpose register
+      DecodeRG(ds,c,regsize,type);        // General-purpose register
     if (memonly!=0)
-      softerror=DAE_MEMORY;            // Register where only memory allowed
+      ds->softerror=DAE_MEMORY;        // Register where only memory allowed
     return; };
   // Next possibility: 16-bit addressing mode, very seldom in 32-bit flat model
   // but still supported by processor. SIB byte is never used here.
-  if (addrsize==2) {
+  if (ds->addrsize==2) {
     if (c==0x06) {                     // Special case of immediate address
-      dispsize=2;
-      if (size<4)
+      ds->dispsize=2;
+      if (ds->size<4)
         da->error=DAE_CROSS;           // Disp16 outside the memory block
-      else if (mode>=DISASM_DATA) {
-        da->adrconst=addr=*(ushort *)(cmd+2);
+      else if (ds->mode>=DISASM_DATA) {
+        da->adrconst=addr=*(ushort *)(ds->cmd+2);
         if (addr==0) da->zeroconst=1;
         seg=SEG_DS;
-        Memadr(seg,"",addr,dsize);
+        Memadr(ds,seg,"",addr,dsize);
       }; }
     else {
       da->indexed=1;
       if ((c & 0xC0)==0x40) {          // 8-bit signed displacement
-        if (size<3) da->error=DAE_CROSS;
-        else addr=(signed char)cmd[2] & 0xFFFF;
-        dispsize=1; }
+        if (ds->size<3) da->error=DAE_CROSS;
+        else addr=(signed char)ds->cmd[2] & 0xFFFF;
+        ds->dispsize=1; }
       else if ((c & 0xC0)==0x80) {     // 16-bit unsigned displacement
-        if (size<4) da->error=DAE_CROSS;
-        else addr=*(ushort *)(cmd+2);
-        dispsize=2; };
-      if (mode>=DISASM_DATA && da->error==DAE_NOERR) {
+        if (ds->size<4) da->error=DAE_CROSS;
+        else addr=*(ushort *)(ds->cmd+2);
+        ds->dispsize=2; };
+      if (ds->mode>=DISASM_DATA && da->error==DAE_NOERR) {
         da->adrconst=addr;
         if (addr==0) da->zeroconst=1;
         seg=addr16[c & 0x07].defseg;
-        Memadr(seg,addr16[c & 0x07].descr,addr,dsize);
+        Memadr(ds,seg,addr16[c & 0x07].descr,addr,dsize);
       };
     };
   }
   // Next possibility: immediate 32-bit address.
   else if (c==0x05) {                  // Special case of immediate address
-    dispsize=4;
-    if (size<6)
+    ds->dispsize=4;
+    if (ds->size<6)
       da->error=DAE_CROSS;             // Disp32 outside the memory block
-    else if (mode>=DISASM_DATA) {
-      da->adrconst=addr=*(ulong *)(cmd+2);
-      if (pfixup==NULL) pfixup=cmd+2;
+    else if (ds->mode>=DISASM_DATA) {
+      da->adrconst=addr=*(ulong *)(ds->cmd+2);
+      if (ds->pfixup==NULL) ds->pfixup=ds->cmd+2;
       da->fixupsize+=4;
       if (addr==0) da->zeroconst=1;
       seg=SEG_DS;
-      Memadr(seg,"",addr,dsize);
+      Memadr(ds,seg,"",addr,dsize);
     }; }
   // Next possibility: 32-bit address with SIB byte.
   else if ((c & 0x07)==0x04) {         // SIB addresation
-    sib=cmd[2]; hassib=1;
+    sib=ds->cmd[2]; ds->hassib=1;
     *s='\0';
     if (c==0x04 && (sib & 0x07)==0x05) {
-      dispsize=4;                      // Immediate address without base
-      if (size<7)
+      ds->dispsize=4;                  // Immediate address without base
+      if (ds->size<7)
         da->error=DAE_CROSS;           // Disp32 outside the memory block
       else {
-        da->adrconst=addr=*(ulong *)(cmd+3);
-        if (pfixup==NULL) pfixup=cmd+3;
+        da->adrconst=addr=*(ulong *)(ds->cmd+3);
+        if (ds->pfixup==NULL) ds->pfixup=ds->cmd+3;
         da->fixupsize+=4;
         if (addr==0) da->zeroconst=1;
         if ((sib & 0x38)!=0x20) {      // Index register present
@@ -358,19 +371,19 @@ static void DecodeMR(int type) {
       }; }
     else {                             // Base and, eventually, displacement
       if ((c & 0xC0)==0x40) {          // 8-bit displacement
-        dispsize=1;
-        if (size<4) da->error=DAE_CROSS;
+        ds->dispsize=1;
+        if (ds->size<4) da->error=DAE_CROSS;
         else {
-          da->adrconst=addr=(signed char)cmd[3];
+          da->adrconst=addr=(signed char)ds->cmd[3];
           if (addr==0) da->zeroconst=1;
         }; }
       else if ((c & 0xC0)==0x80) {     // 32-bit displacement
-        dispsize=4;
-        if (size<7)
+        ds->dispsize=4;
+        if (ds->size<7)
           da->error=DAE_CROSS;         // Disp32 outside the memory block
         else {
-          da->adrconst=addr=*(ulong *)(cmd+3);
-          if (pfixup==NULL) pfixup=cmd+3;
+          da->adrconst=addr=*(ulong *)(ds->cmd+3);
+          if (ds->pfixup==NULL) ds->pfixup=ds->cmd+3;
           da->fixupsize+=4;
           if (addr==0) da->zeroconst=1;
           // Most compilers use address of type [index*4+displacement] to
@@ -380,7 +393,7 @@ static void DecodeMR(int type) {
         }; };
       da->indexed=1;
       j=sib & 0x07;
-      if (mode>=DISASM_FILE) {
+      if (ds->mode>=DISASM_FILE) {
         strcpy(s,regname[2][j]);
         seg=addr32[j].defseg;
       };
@@ -391,7 +404,7 @@ static void DecodeMR(int type) {
       else if ((sib & 0xC0)==0xC0) da->indexed=8;
       else da->indexed=1;
     };
-    if (mode>=DISASM_FILE && da->error==DAE_NOERR) {
+    if (ds->mode>=DISASM_FILE && da->error==DAE_NOERR) {
       if ((sib & 0x38)!=0x20) {        // Scaled index present
         if (*s!='\0') strcat(s,"+");
         strcat(s,addr32[(sib>>3) & 0x07].descr);
@@ -405,100 +418,104 @@ static void DecodeMR(int type) {
           strcat(s,"*8");
         };
       };
-      Memadr(seg,s,addr,dsize);
+      Memadr(ds,seg,s,addr,dsize);
     };
   }
   // Last possibility: 32-bit address without SIB byte.
   else {                               // No SIB
     if ((c & 0xC0)==0x40) {
-      dispsize=1;
-      if (size<3) da->error=DAE_CROSS; // Disp8 outside the memory block
+      ds->dispsize=1;
+      if (ds->size<3) da->error=DAE_CROSS; // Disp8 outside the memory block
       else {
-        da->adrconst=addr=(signed char)cmd[2];
+        da->adrconst=addr=(signed char)ds->cmd[2];
         if (addr==0) da->zeroconst=1;
       }; }
     else if ((c & 0xC0)==0x80) {
-      dispsize=4;
-      if (size<6)
+      ds->dispsize=4;
+      if (ds->size<6)
         da->error=DAE_CROSS;           // Disp32 outside the memory block
       else {
-        da->adrconst=addr=*(ulong *)(cmd+2);
-        if (pfixup==NULL) pfixup=cmd+2;
+        da->adrconst=addr=*(ulong *)(ds->cmd+2);
+        if (ds->pfixup==NULL) ds->pfixup=ds->cmd+2;
         da->fixupsize+=4;
         if (addr==0) da->zeroconst=1;
         if (type==MRJ) da->jmptable=addr;
       };
     };
     da->indexed=1;
-    if (mode>=DISASM_FILE && da->error==DAE_NOERR) {
+    if (ds->mode>=DISASM_FILE && da->error==DAE_NOERR) {
       seg=addr32[c & 0x07].defseg;
-      Memadr(seg,addr32[c & 0x07].descr,addr,dsize);
+      Memadr(ds,seg,addr32[c & 0x07].descr,addr,dsize);
     };
   };
 };
 
 // Disassemble implicit source of string operations and, if available, dump
 // address and contents.
-static void DecodeSO(void) {
-  if (mode<DISASM_FILE) return;        // No need to decode
-  if (datasize==1) da->memtype=DEC_BYTE;
-  else if (datasize==2) da->memtype=DEC_WORD;
-  else if (datasize==4) da->memtype=DEC_DWORD;
+static void DecodeSO(t_dstate *ds) {
+  t_disasm *da=ds->da;
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
+  if (ds->datasize==1) da->memtype=DEC_BYTE;
+  else if (ds->datasize==2) da->memtype=DEC_WORD;
+  else if (ds->datasize==4) da->memtype=DEC_DWORD;
   da->indexed=1;
-  Memadr(SEG_DS,regname[addrsize==2?1:2][REG_ESI],0L,datasize);
+  Memadr(ds,SEG_DS,regname[ds->addrsize==2?1:2][REG_ESI],0L,ds->datasize);
 };
 
 // Disassemble implicit destination of string operations and, if available,
 // dump address and contents. Destination always uses segment ES, and this
 // setting cannot be overridden.
-static void DecodeDE(void) {
+static void DecodeDE(t_dstate *ds) {
+  t_disasm *da=ds->da;
   int seg;
-  if (mode<DISASM_FILE) return;        // No need to decode
-  if (datasize==1) da->memtype=DEC_BYTE;
-  else if (datasize==2) da->memtype=DEC_WORD;
-  else if (datasize==4) da->memtype=DEC_DWORD;
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
+  if (ds->datasize==1) da->memtype=DEC_BYTE;
+  else if (ds->datasize==2) da->memtype=DEC_WORD;
+  else if (ds->datasize==4) da->memtype=DEC_DWORD;
   da->indexed=1;
-  seg=segprefix; segprefix=SEG_ES;     // Fake Memadr by changing segment prefix
-  Memadr(SEG_DS,regname[addrsize==2?1:2][REG_EDI],0L,datasize);
-  segprefix=seg;                       // Restore segment prefix
+  seg=ds->segprefix; ds->segprefix=SEG_ES; // Fake Memadr by changing segment prefix
+  Memadr(ds,SEG_DS,regname[ds->addrsize==2?1:2][REG_EDI],0L,ds->datasize);
+  ds->segprefix=seg;                   // Restore segment prefix
 };
 
 // Decode XLAT operand and, if available, dump address and contents.
-static void DecodeXL(void) {
-  if (mode<DISASM_FILE) return;        // No need to decode
+static void DecodeXL(t_dstate *ds) {
+  t_disasm *da=ds->da;
+  if (ds->mode<DISASM_FILE) return;    // No need to decode
   da->memtype=DEC_BYTE;
   da->indexed=1;
-  Memadr(SEG_DS,(addrsize==2?"BX+AL":"EBX+AL"),0L,1);
+  Memadr(ds,SEG_DS,(ds->addrsize==2?"BX+AL":"EBX+AL"),0L,1);
 };
 
 // Decode immediate operand of size constsize. If sxt is non-zero, byte operand
 // should be sign-extended to sxt bytes. If type of immediate constant assumes
 // this, small negative operands may be displayed as signed negative numbers.
 // Note that in most cases immediate operands are not shown in comment window.
-static void DecodeIM(int constsize,int sxt,int type) {
+static void DecodeIM(t_dstate *ds,int constsize,int sxt,int type) {
+  t_disasm *da=ds->da;
   int i;
   signed long data;
   ulong l;
   char name[TEXTLEN],comment[TEXTLEN];
-  immsize+=constsize;                    // Allows several immediate operands
-  if (mode<DISASM_DATA) return;
-  l=1+hasrm+hassib+dispsize+(immsize-constsize);
+  ds->immsize+=constsize;                // Allows several immediate operands
+  if (ds->mode<DISASM_DATA) return;
+  l=1+ds->hasrm+ds->hassib+ds->dispsize+(ds->immsize-constsize);
   data=0;
-  if (size<l+constsize)
+  if (ds->size<l+constsize)
     da->error=DAE_CROSS;
   else if (constsize==1) {
-    if (sxt==0) data=(uchar)cmd[l];
-    else data=(signed char)cmd[l];
+    if (sxt==0) data=(uchar)ds->cmd[l];
+    else data=(signed char)ds->cmd[l];
     if (type==IMS && ((data & 0xE0)!=0 || data==0)) {
       da->warnings|=DAW_SHIFT;
       da->cmdtype|=C_RARE;
     }; }
   else if (constsize==2) {
-    if (sxt==0) data=*(ushort *)(cmd+l);
-    else data=*(short *)(cmd+l); }
+    if (sxt==0) data=*(ushort *)(ds->cmd+l);
+    else data=*(short *)(ds->cmd+l); }
   else {
-    data=*(long *)(cmd+l);
-    if (pfixup==NULL) pfixup=cmd+l;
+    data=*(long *)(ds->cmd+l);
+    if (ds->pfixup==NULL) ds->pfixup=ds->cmd+l;
     da->fixupsize+=4; };
   if (sxt==2) data&=0x0000FFFF;
   if (data==0 && da->error==0) da->zeroconst=1;
@@ -507,105 +524,109 @@ static void DecodeIM(int constsize,int sxt,int type) {
   // search if the first constant is non-zero (which is usually the case).
   if (da->immconst==0)
     da->immconst=data;
-  if (mode>=DISASM_FILE && da->error==DAE_NOERR) {
-    if (mode>=DISASM_CODE && type!=IMU)
-      i=Decodeaddress(data,name,TEXTLEN-nresult-24,comment);
+  if (ds->mode>=DISASM_FILE && da->error==DAE_NOERR) {
+    if (ds->mode>=DISASM_CODE && type!=IMU)
+      i=Decodeaddress(data,name,TEXTLEN-ds->nresult-24,comment);
     else {
       i=0; comment[0]='\0'; };
-    if (i!=0 && symbolic!=0) {
-      strcpy(da->result+nresult,name); nresult+=i; }
+    if (i!=0 && ds->opt->symbolic!=0) {
+      strcpy(da->result+ds->nresult,name); ds->nresult+=i; }
     else if (type==IMU || type==IMS || type==IM2 || data>=0 || data<NEGLIMIT)
-      nresult+=snprintf(da->result+nresult,1024,"%x",data);
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"%x",data);
     else
-      nresult+=snprintf(da->result+nresult,1024,"-%x",-data);
-    if (addcomment && comment[0]!='\0') strcpy(da->comment,comment);
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"-%x",-data);
+    if (ds->addcomment && comment[0]!='\0') strcpy(da->comment,comment);
   };
 };
 
 // Decode VxD service name (always 4-byte).
-static void DecodeVX(void) {
+static void DecodeVX(t_dstate *ds) {
+  t_disasm *da=ds->da;
   ulong l,data;
-  immsize+=4;                          // Allows several immediate operands
-  if (mode<DISASM_DATA) return;
-  l=1+hasrm+hassib+dispsize+(immsize-4);
-  if (size<l+4) {
+  ds->immsize+=4;                      // Allows several immediate operands
+  if (ds->mode<DISASM_DATA) return;
+  l=1+ds->hasrm+ds->hassib+ds->dispsize+(ds->immsize-4);
+  if (ds->size<l+4) {
     da->error=DAE_CROSS;
     return; };
-  data=*(long *)(cmd+l);
+  data=*(long *)(ds->cmd+l);
   if (data==0 && da->error==0) da->zeroconst=1;
   if (da->immconst==0)
     da->immconst=data;
-  if (mode>=DISASM_FILE && da->error==DAE_NOERR) {
+  if (ds->mode>=DISASM_FILE && da->error==DAE_NOERR) {
     if ((data & 0x00008000)!=0 && memicmp("VxDCall",da->result,7)==0)
-      memcpy(da->result,lowercase?"vxdjump":"VxDJump",7);
-    nresult+=snprintf(da->result+nresult,1024,"%x",data);
+      memcpy(da->result,ds->opt->lowercase?"vxdjump":"VxDJump",7);
+    ds->nresult+=snprintf(da->result+ds->nresult,1024,"%x",data);
   };
 };
 
 // Decode implicit constant 1 (used in shift commands). This operand is so
 // insignificant that it is never shown in comment window.
-static void DecodeC1(void) {
-  if (mode<DISASM_DATA) return;
+static void DecodeC1(t_dstate *ds) {
+  t_disasm *da=ds->da;
+  if (ds->mode<DISASM_DATA) return;
   da->immconst=1;
-  if (mode>=DISASM_FILE) nresult+=snprintf(da->result+nresult,1024,"1");
+  if (ds->mode>=DISASM_FILE) ds->nresult+=snprintf(da->result+ds->nresult,1024,"1");
 };
 
 // Decode immediate absolute data address. This operand is used in 8080-
 // compatible commands which allow to move data from memory to accumulator and
 // back. Note that bytes ModRM and SIB never appear in commands with IA operand.
-static void DecodeIA(void) {
+static void DecodeIA(t_dstate *ds) {
+  t_disasm *da=ds->da;
   ulong addr;
-  if (size<1+addrsize) {
+  if (ds->size<1+ds->addrsize) {
     da->error=DAE_CROSS; return; };
-  dispsize=addrsize;
-  if (mode<DISASM_DATA) return;
-  if (datasize==1) da->memtype=DEC_BYTE;
-  else if (datasize==2) da->memtype=DEC_WORD;
-  else if (datasize==4) da->memtype=DEC_DWORD;
-  if (addrsize==2)
-    addr=*(ushort *)(cmd+1);
+  ds->dispsize=ds->addrsize;
+  if (ds->mode<DISASM_DATA) return;
+  if (ds->datasize==1) da->memtype=DEC_BYTE;
+  else if (ds->datasize==2) da->memtype=DEC_WORD;
+  else if (ds->datasize==4) da->memtype=DEC_DWORD;
+  if (ds->addrsize==2)
+    addr=*(ushort *)(ds->cmd+1);
   else {
-    addr=*(ulong *)(cmd+1);
-    if (pfixup==NULL) pfixup=cmd+1;
+    addr=*(ulong *)(ds->cmd+1);
+    if (ds->pfixup==NULL) ds->pfixup=ds->cmd+1;
     da->fixupsize+=4; };
   da->adrconst=addr;
   if (addr==0) da->zeroconst=1;
-  if (mode>=DISASM_FILE) {
-    Memadr(SEG_DS,"",addr,datasize);
+  if (ds->mode>=DISASM_FILE) {
+    Memadr(ds,SEG_DS,"",addr,ds->datasize);
   };
 };
 
 // Decodes jump relative to nextip of size offsize.
-static void DecodeRJ(ulong offsize,ulong nextip) {
+static void DecodeRJ(t_dstate *ds,ulong offsize,ulong nextip) {
+  t_disasm *da=ds->da;
   int i;
   ulong addr;
   char s[TEXTLEN];
-  if (size<offsize+1) {
+  if (ds->size<offsize+1) {
     da->error=DAE_CROSS; return; };
-  dispsize=offsize;                    // Interpret offset as displacement
-  if (mode<DISASM_DATA) return;
+  ds->dispsize=offsize;                // Interpret offset as displacement
+  if (ds->mode<DISASM_DATA) return;
   if (offsize==1)
-    addr=(signed char)cmd[1]+nextip;
+    addr=(signed char)ds->cmd[1]+nextip;
   else if (offsize==2)
-    addr=*(signed short *)(cmd+1)+nextip;
+    addr=*(signed short *)(ds->cmd+1)+nextip;
   else
-    addr=*(ulong *)(cmd+1)+nextip;
-  if (datasize==2)
+    addr=*(ulong *)(ds->cmd+1)+nextip;
+  if (ds->datasize==2)
     addr&=0xFFFF;
   da->jmpconst=addr;
   if (addr==0) da->zeroconst=1;
-  if (mode>=DISASM_FILE) {
-    if (offsize==1) nresult+=snprintf(da->result+nresult,1024,
-      "%s ",(lowercase==0?"SHORT":"short"));
-    if (mode>=DISASM_CODE)
+  if (ds->mode>=DISASM_FILE) {
+    if (offsize==1) ds->nresult+=snprintf(da->result+ds->nresult,1024,
+      "%s ",(ds->opt->lowercase==0?"SHORT":"short"));
+    if (ds->mode>=DISASM_CODE)
       i=Decodeaddress(addr,s,TEXTLEN,da->comment);
     else
       i=0;
-    if (symbolic==0 || i==0)
-      nresult+=snprintf(da->result+nresult,1024,"%08x",addr);
+    if (ds->opt->symbolic==0 || i==0)
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"%08x",addr);
     else
-      nresult+=snprintf(da->result+nresult,1024,"%.*s",TEXTLEN-nresult-25,s);
-    if (symbolic==0 && i!=0 && da->comment[0]=='\0')
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"%.*s",TEXTLEN-ds->nresult-25,s);
+    if (ds->opt->symbolic==0 && i!=0 && da->comment[0]=='\0')
       strcpy(da->comment,s);
     ;
   };
@@ -615,63 +636,67 @@ static void DecodeRJ(ulong offsize,ulong nextip) {
 // are not used (mostly because selector is specified directly in the command),
 // so I neither decode as symbol nor comment it. To allow search for selector
 // by value, I interprete it as an immediate constant.
-static void DecodeJF(void) {
+static void DecodeJF(t_dstate *ds) {
+  t_disasm *da=ds->da;
   ulong addr,seg;
-  if (size<1+addrsize+2) {
+  if (ds->size<1+ds->addrsize+2) {
     da->error=DAE_CROSS; return; };
-  dispsize=addrsize; immsize=2;        // Non-trivial but allowed interpretation
-  if (mode<DISASM_DATA) return;
-  if (addrsize==2) {
-    addr=*(ushort *)(cmd+1);
-    seg=*(ushort *)(cmd+3); }
+  ds->dispsize=ds->addrsize; ds->immsize=2; // Non-trivial but allowed interpretation
+  if (ds->mode<DISASM_DATA) return;
+  if (ds->addrsize==2) {
+    addr=*(ushort *)(ds->cmd+1);
+    seg=*(ushort *)(ds->cmd+3); }
   else {
-    addr=*(ulong *)(cmd+1);
-    seg=*(ushort *)(cmd+5); };
+    addr=*(ulong *)(ds->cmd+1);
+    seg=*(ushort *)(ds->cmd+5); };
   da->jmpconst=addr;
   da->immconst=seg;
   if (addr==0 || seg==0) da->zeroconst=1;
-  if (mode>=DISASM_FILE) {
-    nresult+=snprintf(da->result+nresult,1024,"%s %04x:%08x",
-    (lowercase==0?"FAR":"far"),seg,addr);
+  if (ds->mode>=DISASM_FILE) {
+    ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s %04x:%08x",
+    (ds->opt->lowercase==0?"FAR":"far"),seg,addr);
   };
 };
 
 // Decode segment register. In flat model, operands of this type are seldom.
-static void DecodeSG(int index) {
+static void DecodeSG(t_dstate *ds,int index) {
+  t_disasm *da=ds->da;
   int i;
-  if (mode<DISASM_DATA) return;
+  if (ds->mode<DISASM_DATA) return;
   index&=0x07;
-  if (index>=6) softerror=DAE_BADSEG;  // Undefined segment register
-  if (mode>=DISASM_FILE) {
-    i=snprintf(da->result+nresult,1024,"%s",segname[index]);
-    if (lowercase) strlwr(da->result+nresult);
-    nresult+=i;
+  if (index>=6) ds->softerror=DAE_BADSEG; // Undefined segment register
+  if (ds->mode>=DISASM_FILE) {
+    i=snprintf(da->result+ds->nresult,1024,"%s",segname[index]);
+    if (ds->opt->lowercase) strlwr(da->result+ds->nresult);
+    ds->nresult+=i;
   };
 };
 
 // Decode control register addressed in R part of ModRM byte. Operands of
 // this type are extremely rare. Contents of control registers are accessible
 // only from privilege level 0, so I cannot dump them here.
-static void DecodeCR(int index) {
-  hasrm=1;
-  if (mode>=DISASM_FILE) {
+static void DecodeCR(t_dstate *ds,int index) {
+  t_disasm *da=ds->da;
+  ds->hasrm=1;
+  if (ds->mode>=DISASM_FILE) {
     index=(index>>3) & 0x07;
-    nresult+=snprintf(da->result+nresult,1024,"%s",crname[index]);
-    if (lowercase) strlwr(da->result+nresult);
+    ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s",crname[index]);
+    if (ds->opt->lowercase) strlwr(da->result+ds->nresult);
   };
 };
 
 // Decode debug register addressed in R part of ModRM byte. Operands of
 // this type are extremely rare. I can dump only those debug registers
 // available in CONTEXT structure.
-static void DecodeDR(int index) {
+static void DecodeDR(t_dstate *ds,int index) {
+  t_disasm *da=ds->da;
   int i;
-  hasrm=1;
-  if (mode>=DISASM_FILE) {
+  ds->hasrm=1;
+  if (ds->mode>=DISASM_FILE) {
     index=(index>>3) & 0x07;
-    i=snprintf(da->result+nresult,1024,"%s",drname[index]);
-    if (lowercase) strlwr(da->result+nresult);
-    nresult+=i;
+    i=snprintf(da->result+ds->nresult,1024,"%s",drname[index]);
+    if (ds->opt->lowercase) strlwr(da->result+ds->nresult);
+    ds->nresult+=i;
   };
 };
 
@@ -679,17 +704,17 @@ static void DecodeDR(int index) {
 // suffix lies outside the memory block. This subroutine assumes that cmd still
 // points to the beginning of 3DNow! command (i.e. to the sequence of two bytes
 // 0F, 0F).
-static int Get3dnowsuffix(void) {
+static int Get3dnowsuffix(t_dstate *ds) {
   int c,sib;
   ulong offset;
-  if (size<3) return -1;               // Suffix outside the memory block
+  if (ds->size<3) return -1;           // Suffix outside the memory block
   offset=3;
-  c=cmd[2] & 0xC7;                     // Leave only Mod and M fields
+  c=ds->cmd[2] & 0xC7;                 // Leave only Mod and M fields
   // Register in ModM - general-purpose, MMX or 3DNow!
   if ((c & 0xC0)==0xC0)
     ;
   // 16-bit addressing mode, SIB byte is never used here.
-  else if (addrsize==2) {
+  else if (ds->addrsize==2) {
     if (c==0x06)                       // Special case of immediate address
       offset+=2;
     else if ((c & 0xC0)==0x40)         // 8-bit signed displacement
@@ -702,8 +727,8 @@ static int Get3dnowsuffix(void) {
     offset+=4;
   // 32-bit address with SIB byte.
   else if ((c & 0x07)==0x04) {         // SIB addresation
-    if (size<4) return -1;             // Suffix outside the memory block
-    sib=cmd[3]; offset++;
+    if (ds->size<4) return -1;         // Suffix outside the memory block
+    sib=ds->cmd[3]; offset++;
     if (c==0x04 && (sib & 0x07)==0x05)
       offset+=4;                       // Immediate address without base
     else if ((c & 0xC0)==0x40)         // 8-bit displacement
@@ -716,8 +741,8 @@ static int Get3dnowsuffix(void) {
     offset+=1;
   else if ((c & 0xC0)==0x80)
     offset+=4;
-  if (offset>=size) return -1;         // Suffix outside the memory block
-  return cmd[offset];
+  if (offset>=ds->size) return -1;     // Suffix outside the memory block
+  return ds->cmd[offset];
 };
 
 // Function checks whether 80x86 flags meet condition set in the command.
@@ -750,8 +775,153 @@ int Checkcondition(int code,ulong flags) {
   else return (cond==0);               // Invert condition
 };
 
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// COMMAND INDEX //////////////////////////////////
+
+// Instead of scanning the whole cmddata[] for each command, Disasm() looks up
+// a short list of candidates. Lists are indexed by the first byte of the code
+// (REPxx prefix is considered to be part of the command) and, if this byte is
+// 0F, F2 or F3, also by the second byte. Long lists are further split by the
+// Reg field of the ModRM byte. Lists keep the order of cmddata[], so the first
+// matching command is the same as found by the linear scan.
+
+#define NCMDPOOL       4096            // Total size of all candidate lists
+#define NCMDEXT        64              // Max number of lists split by ModRM
+#define CMDSPLIT       6               // Split lists longer than this
+
+typedef struct t_cmdlist {             // Candidates in cmdpool[]
+  ushort         first;                // Index of the first candidate
+  ushort         count;                // Number of candidates
+} t_cmdlist;
+
+typedef struct t_cmdkey {
+  t_cmdlist      all;                  // All candidates for this key
+  short          ext;                  // Index in cmdext[] or -1 if not split
+  short          rmbyte;               // Position of ModRM byte in the code
+} t_cmdkey;
+
+static ushort    cmdpool[NCMDPOOL];    // Indexes into cmddata[]
+static int       ncmdpool;
+static t_cmdkey  cmdkey1[256];         // Indexed by the first byte
+static t_cmdkey  cmdkey2[3][256];      // 0F xx, F2 xx and F3 xx
+static t_cmdlist cmdext[NCMDEXT][8];   // Split by Reg field of ModRM
+static int       ncmdext;
+static const t_cmddata *cmdend;        // Terminating entry of cmddata[]
+static int       cmdindex;             // 0: not built, 1: ready, -1: failed
+
+// Adds to the pool all commands whose masked code matches key in the bytes
+// selected by keymask and, if reg>=0, Reg field of byte rmbyte. Returns 0 on
+// success and -1 if the pool is full.
+static int Addcandidates(t_cmdlist *pl,ulong key,ulong keymask,
+  int rmbyte,int reg) {
+  int i;
+  ulong rmmask;
+  const t_cmddata *pd;
+  pl->first=(ushort)ncmdpool; pl->count=0;
+  rmmask=(ulong)0x38<<(rmbyte*8);
+  for (pd=cmddata,i=0; pd->mask!=0; pd++,i++) {
+    if (((key^pd->code) & pd->mask & keymask)!=0) continue;
+    if (reg>=0 && ((((ulong)reg<<3<<(rmbyte*8))^pd->code) & pd->mask & rmmask)!=0)
+      continue;
+    if (ncmdpool>=NCMDPOOL) return -1;
+    cmdpool[ncmdpool++]=(ushort)i;
+    pl->count++; };
+  return 0;
+};
+
+static int Buildkey(t_cmdkey *pk,ulong key,ulong keymask,int rmbyte) {
+  int reg;
+  pk->ext=-1; pk->rmbyte=(short)rmbyte;
+  if (Addcandidates(&pk->all,key,keymask,-1,-1)!=0) return -1;
+  if (pk->all.count<=CMDSPLIT || ncmdext>=NCMDEXT) return 0;
+  pk->ext=(short)ncmdext++;
+  for (reg=0; reg<8; reg++) {
+    if (Addcandidates(&cmdext[pk->ext][reg],key,keymask,rmbyte,reg)!=0)
+      return -1;
+    ;
+  };
+  return 0;
+};
+
+// Builds command index. Must be called once before commands are decoded on
+// more than one CPU; until then, and if index does not fit into static tables,
+// Disasm() falls back to linear search.
+void Disasminit(void) {
+  int i;
+  if (cmdindex!=0) return;
+  for (cmdend=cmddata; cmdend->mask!=0; cmdend++) ;
+  ncmdpool=0; ncmdext=0;
+  for (i=0; i<256; i++) {
+    if (Buildkey(&cmdkey1[i],i,0xFF,1)!=0 ||
+      Buildkey(&cmdkey2[0][i],0x0F|(i<<8),0xFFFF,2)!=0 ||
+      Buildkey(&cmdkey2[1][i],0xF2|(i<<8),0xFFFF,2)!=0 ||
+      Buildkey(&cmdkey2[2][i],0xF3|(i<<8),0xFFFF,2)!=0
+    ) {
+      cprintf("Disasminit(): command index does not fit, using linear search\n");
+      cmdindex=-1;
+      return;
+    };
+  };
+  cmdindex=1;
+};
+
+// Returns list of candidates for the code (first 3 bytes of command, with
+// REPxx prefix, if any, shifted in as the first byte).
+static const t_cmdlist *Getcandidates(ulong code) {
+  const t_cmdkey *pk;
+  switch (code & 0xFF) {
+    case 0x0F: pk=&cmdkey2[0][(code>>8) & 0xFF]; break;
+    case 0xF2: pk=&cmdkey2[1][(code>>8) & 0xFF]; break;
+    case 0xF3: pk=&cmdkey2[2][(code>>8) & 0xFF]; break;
+    default: pk=&cmdkey1[code & 0xFF]; break; };
+  if (pk->ext<0) return &pk->all;
+  return &cmdext[pk->ext][(code>>(pk->rmbyte*8+3)) & 0x07];
+};
+
+// Finds command in the command table. If shortstr is set, string commands
+// with explicit operands are skipped. For 3DNow! commands, suffix selects the
+// final command. Returns pointer to the command or to the terminating entry
+// of cmddata[] if command is not found. Sets *is3dnow if the command was
+// recognized as 3DNow!, and *error to DAE_CROSS if its suffix is outside the
+// memory block.
+static const t_cmddata *Findcommand(t_dstate *ds,ulong code,int shortstr,
+  int *is3dnow,int *error) {
+  int i,j,n;
+  const ushort *pc;
+  const t_cmddata *pd;
+  const t_cmdlist *pl;
+  if (cmdindex>0) {
+    pl=Getcandidates(code);
+    pc=cmdpool+pl->first; n=pl->count; }
+  else {
+    pc=NULL; n=(int)(cmdend-cmddata); };
+  pd=cmdend;
+  for (i=0; i<n; i++) {
+    pd=cmddata+(pc!=NULL?pc[i]:i);
+    if (((code^pd->code) & pd->mask)!=0) continue;
+    if (shortstr &&
+      (pd->arg1==MSO || pd->arg1==MDE || pd->arg2==MSO || pd->arg2==MDE))
+      continue;                        // Search short form of string command
+    break;
+  };
+  if (i>=n) return cmdend;
+  if ((pd->type & C_TYPEMASK)!=C_NOW) return pd;
+  // 3DNow! commands require additional search.
+  *is3dnow=1;
+  j=Get3dnowsuffix(ds);
+  if (j<0) {
+    *error=DAE_CROSS;
+    return pd; };
+  for ( ; i<n; i++) {
+    pd=cmddata+(pc!=NULL?pc[i]:i);
+    if (((code^pd->code) & pd->mask)!=0) continue;
+    if (((uchar *)&(pd->code))[2]==j) return pd;
+  };
+  return cmdend;
+};
+
 ulong Disasm(char *src,ulong srcsize,ulong srcip,
-  t_disasm *disasm,int disasmmode) {
+  t_disasm *disasm,int disasmmode,const t_disasmopt *opt) {
   int i,j,isprefix,is3dnow,repeated,operand,mnemosize,arg;
   ulong u,code;
   int lockprefix;                      // Non-zero if lock prefix present
@@ -760,15 +930,17 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
   char name[TEXTLEN];
   char const *pname;
   const t_cmddata *pd,*pdan;
+  t_dstate st,*ds=&st;
+  t_disasm *da=disasm;
   // Prepare disassembler variables and initialize structure disasm.
-  datasize=addrsize=4;                 // 32-bit code and data segments only!
-  segprefix=SEG_UNDEF;
-  hasrm=hassib=0; dispsize=immsize=0;
+  ds->datasize=ds->addrsize=4;         // 32-bit code and data segments only!
+  ds->segprefix=SEG_UNDEF;
+  ds->hasrm=ds->hassib=0; ds->dispsize=ds->immsize=0;
   lockprefix=0; repprefix=0;
-  ndump=0; nresult=0;
-  cmd=src; size=srcsize; pfixup=NULL;
-  softerror=0; is3dnow=0;
-  da=disasm;
+  ds->ndump=0; ds->nresult=0;
+  ds->cmd=src; ds->size=srcsize; ds->pfixup=NULL;
+  ds->softerror=0; is3dnow=0;
+  ds->da=da;
   da->ip=srcip;
   da->comment[0]='\0';
   da->cmdtype=C_BAD; da->nprefix=0;
@@ -779,31 +951,32 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
   da->fixupoffset=0; da->fixupsize=0;
   da->warnings=0;
   da->error=DAE_NOERR;
-  mode=disasmmode;                     // No need to use register contents
+  ds->mode=disasmmode;                 // No need to use register contents
+  ds->opt=(opt!=NULL?opt:&defaultopt);
   // Correct 80x86 command may theoretically contain up to 4 prefixes belonging
   // to different prefix groups. This limits maximal possible size of the
   // command to MAXCMDSIZE=16 bytes. In order to maintain this limit, if
   // Disasm() detects second prefix from the same group, it flushes first
   // prefix in the sequence as a pseudocommand.
   u=0; repeated=0;
-  while (size>0) {
+  while (ds->size>0) {
     isprefix=1;                        // Assume that there is some prefix
-    switch (*cmd) {
-      case 0x26: if (segprefix==SEG_UNDEF) segprefix=SEG_ES;
+    switch (*ds->cmd) {
+      case 0x26: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_ES;
         else repeated=1; break;
-      case 0x2E: if (segprefix==SEG_UNDEF) segprefix=SEG_CS;
+      case 0x2E: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_CS;
         else repeated=1; break;
-      case 0x36: if (segprefix==SEG_UNDEF) segprefix=SEG_SS;
+      case 0x36: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_SS;
         else repeated=1; break;
-      case 0x3E: if (segprefix==SEG_UNDEF) segprefix=SEG_DS;
+      case 0x3E: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_DS;
         else repeated=1; break;
-      case 0x64: if (segprefix==SEG_UNDEF) segprefix=SEG_FS;
+      case 0x64: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_FS;
         else repeated=1; break;
-      case 0x65: if (segprefix==SEG_UNDEF) segprefix=SEG_GS;
+      case 0x65: if (ds->segprefix==SEG_UNDEF) ds->segprefix=SEG_GS;
         else repeated=1; break;
-      case 0x66: if (datasize==4) datasize=2;
+      case 0x66: if (ds->datasize==4) ds->datasize=2;
         else repeated=1; break;
-      case 0x67: if (addrsize==4) addrsize=2;
+      case 0x67: if (ds->addrsize==4) ds->addrsize=2;
         else repeated=1; break;
       case 0xF0: if (lockprefix==0) lockprefix=0xF0;
         else repeated=1; break;
@@ -814,16 +987,16 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       default: isprefix=0; break; };
     if (isprefix==0 || repeated!=0)
       break;                           // No more prefixes or duplicated prefix
-    if (mode>=DISASM_FILE)
-      ndump+=snprintf(da->dump+ndump,1024,"%02x:",*cmd);
+    if (ds->mode>=DISASM_FILE)
+      ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x:",*ds->cmd);
     da->nprefix++;
-    cmd++; srcip++; size--; u++; };
+    ds->cmd++; srcip++; ds->size--; u++; };
   // We do have repeated prefix. Flush first prefix from the sequence.
   if (repeated) {
-    if (mode>=DISASM_FILE) {
+    if (ds->mode>=DISASM_FILE) {
       da->dump[3]='\0';                // Leave only first dumped prefix
       da->nprefix=1;
-      switch (cmd[-(long)u]) {
+      switch (ds->cmd[-(long)u]) {
         case 0x26: pname=(char const *)(segname[SEG_ES]); break;
         case 0x2E: pname=(char const *)(segname[SEG_CS]); break;
         case 0x36: pname=(char const *)(segname[SEG_SS]); break;
@@ -836,9 +1009,9 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
         case 0xF2: pname="REPNE"; break;
         case 0xF3: pname="REPE"; break;
         default: pname="?"; break; };
-      nresult+=snprintf(da->result+nresult,1024,"PREFIX %s:",pname);
-      if (lowercase) strlwr(da->result);
-      if (extraprefix==0) strcpy(da->comment,"Superfluous prefix"); };
+      ds->nresult+=snprintf(da->result+ds->nresult,1024,"PREFIX %s:",pname);
+      if (ds->opt->lowercase) strlwr(da->result);
+      if (ds->opt->extraprefix==0) strcpy(da->comment,"Superfluous prefix"); };
     da->warnings|=DAW_PREFIX;
     if (lockprefix) da->warnings|=DAW_LOCK;
     da->cmdtype=C_RARE;
@@ -847,48 +1020,29 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
   // If lock prefix available, display it and forget, because it has no
   // influence on decoding of rest of the command.
   if (lockprefix!=0) {
-    if (mode>=DISASM_FILE) nresult+=snprintf(da->result+nresult,1024,"LOCK ");
+    if (ds->mode>=DISASM_FILE) ds->nresult+=snprintf(da->result+ds->nresult,1024,"LOCK ");
     da->warnings|=DAW_LOCK; };
   // Fetch (if available) first 3 bytes of the command, add repeat prefix and
   // find command in the command table.
   code=0;
-  if (size>0) *(((char *)&code)+0)=cmd[0];
-  if (size>1) *(((char *)&code)+1)=cmd[1];
-  if (size>2) *(((char *)&code)+2)=cmd[2];
+  if (ds->size>0) *(((char *)&code)+0)=ds->cmd[0];
+  if (ds->size>1) *(((char *)&code)+1)=ds->cmd[1];
+  if (ds->size>2) *(((char *)&code)+2)=ds->cmd[2];
   if (repprefix!=0)                    // RER/REPE/REPNE is considered to be
     code=(code<<8) | repprefix;        // part of command.
-  if (decodevxd && (code & 0xFFFF)==0x20CD)
+  if (ds->opt->decodevxd && (code & 0xFFFF)==0x20CD)
     pd=&vxdcmd;                        // Decode VxD call (Win95/98)
-  else {
-    for (pd=cmddata; pd->mask!=0; pd++) {
-      if (((code^pd->code) & pd->mask)!=0) continue;
-      if (mode>=DISASM_FILE && shortstringcmds &&
-        (pd->arg1==MSO || pd->arg1==MDE || pd->arg2==MSO || pd->arg2==MDE))
-        continue;                      // Search short form of string command
-      break;
-    };
-  };
-  if ((pd->type & C_TYPEMASK)==C_NOW) {
-    // 3DNow! commands require additional search.
-    is3dnow=1;
-    j=Get3dnowsuffix();
-    if (j<0)
-      da->error=DAE_CROSS;
-    else {
-      for ( ; pd->mask!=0; pd++) {
-        if (((code^pd->code) & pd->mask)!=0) continue;
-        if (((uchar *)&(pd->code))[2]==j) break;
-      };
-    };
-  };
+  else
+    pd=Findcommand(ds,code,ds->mode>=DISASM_FILE && ds->opt->shortstringcmds,
+      &is3dnow,&da->error);
   if (pd->mask==0) {                   // Command not found
     da->cmdtype=C_BAD;
-    if (size<2) da->error=DAE_CROSS;
+    if (ds->size<2) da->error=DAE_CROSS;
     else da->error=DAE_BADCMD; }
   else {                               // Command recognized, decode it
     da->cmdtype=pd->type;
-    cxsize=datasize;                   // Default size of ECX used as counter
-    if (segprefix==SEG_FS || segprefix==SEG_GS || lockprefix!=0)
+    cxsize=ds->datasize;               // Default size of ECX used as counter
+    if (ds->segprefix==SEG_FS || ds->segprefix==SEG_GS || lockprefix!=0)
       da->cmdtype|=C_RARE;             // These prefixes are rare
     if (pd->bits==PR)
       da->warnings|=DAW_PRIV;          // Privileged command (ring 0)
@@ -898,40 +1052,40 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
     // (44) and DEC ESP (4C) usually don't appear in real code. Also check for
     // ADD ESP,imm and SUB ESP,imm (81,C4,imm32; 83,C4,imm8; 81,EC,imm32;
     // 83,EC,imm8).
-    if (cmd[0]==0x44 || cmd[0]==0x4C ||
-      (size>=3 && (cmd[0]==0x81 || cmd[0]==0x83) &&
-      (cmd[1]==0xC4 || cmd[1]==0xEC) && (cmd[2] & 0x03)!=0)
+    if (ds->cmd[0]==0x44 || ds->cmd[0]==0x4C ||
+      (ds->size>=3 && (ds->cmd[0]==0x81 || ds->cmd[0]==0x83) &&
+      (ds->cmd[1]==0xC4 || ds->cmd[1]==0xEC) && (ds->cmd[2] & 0x03)!=0)
     ) {
       da->warnings|=DAW_STACK;
       da->cmdtype|=C_RARE; };
     // Warn also on MOV SEG,... (8E...). Win32 works in flat mode.
-    if (cmd[0]==0x8E)
+    if (ds->cmd[0]==0x8E)
       da->warnings|=DAW_SEGMENT;
     // If opcode is 2-byte, adjust command.
     if (pd->len==2) {
-      if (size==0) da->error=DAE_CROSS;
+      if (ds->size==0) da->error=DAE_CROSS;
       else {
-        if (mode>=DISASM_FILE)
-          ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd) & 0xFF);
-        cmd++; srcip++; size--;
+        if (ds->mode>=DISASM_FILE)
+          ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd) & 0xFF);
+        ds->cmd++; srcip++; ds->size--;
       }; };
-    if (size==0) da->error=DAE_CROSS;
+    if (ds->size==0) da->error=DAE_CROSS;
     // Some commands either feature non-standard data size or have bit which
     // allowes to select data size.
-    if ((pd->bits & WW)!=0 && (*cmd & WW)==0)
-      datasize=1;                      // Bit W in command set to 0
-    else if ((pd->bits & W3)!=0 && (*cmd & W3)==0)
-      datasize=1;                      // Another position of bit W
+    if ((pd->bits & WW)!=0 && (*ds->cmd & WW)==0)
+      ds->datasize=1;                  // Bit W in command set to 0
+    else if ((pd->bits & W3)!=0 && (*ds->cmd & W3)==0)
+      ds->datasize=1;                  // Another position of bit W
     else if ((pd->bits & FF)!=0)
-      datasize=2;                      // Forced word (2-byte) size
+      ds->datasize=2;                  // Forced word (2-byte) size
     // Some commands either have mnemonics which depend on data size (8/16 bits
     // or 32 bits, like CWD/CDQ), or have several different mnemonics (like
     // JNZ/JNE). First case is marked by either '&' (mnemonic depends on
     // operand size) or '$' (depends on address size). In the second case,
     // there is no special marker and disassembler selects main mnemonic.
-    if (mode>=DISASM_FILE) {
-      if (pd->name[0]=='&') mnemosize=datasize;
-      else if (pd->name[0]=='$') mnemosize=addrsize;
+    if (ds->mode>=DISASM_FILE) {
+      if (pd->name[0]=='&') mnemosize=ds->datasize;
+      else if (pd->name[0]=='$') mnemosize=ds->addrsize;
       else mnemosize=0;
       if (mnemosize!=0) {
         for (i=0,j=1; pd->name[j]!='\0'; j++) {
@@ -939,8 +1093,8 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
             if (mnemosize==4) i=0;
             else break; }
           else if (pd->name[j]=='*') { // Substitute by 'W', 'D' or none
-            if (mnemosize==4 && sizesens!=2) name[i++]='D';
-            else if (mnemosize!=4 && sizesens!=0) name[i++]='W'; }
+            if (mnemosize==4 && ds->opt->sizesens!=2) name[i++]='D';
+            else if (mnemosize!=4 && ds->opt->sizesens!=0) name[i++]='W'; }
           else name[i++]=pd->name[j];
         };
         name[i]='\0'; }
@@ -952,18 +1106,18 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
           };
         };
       };
-      if (repprefix!=0 && tabarguments) {
+      if (repprefix!=0 && ds->opt->tabarguments) {
         for (i=0; name[i]!='\0' && name[i]!=' '; i++)
-          da->result[nresult++]=name[i];
+          da->result[ds->nresult++]=name[i];
         if (name[i]==' ') {
-          da->result[nresult++]=' '; i++; };
-        while (nresult<8) da->result[nresult++]=' ';
+          da->result[ds->nresult++]=' '; i++; };
+        while (ds->nresult<8) da->result[ds->nresult++]=' ';
         for ( ; name[i]!='\0'; i++)
-          da->result[nresult++]=name[i];
+          da->result[ds->nresult++]=name[i];
         ; }
       else
-        nresult+=snprintf(da->result+nresult,1024,"%s",name);
-      if (lowercase) strlwr(da->result);
+        ds->nresult+=snprintf(da->result+ds->nresult,1024,"%s",name);
+      if (ds->opt->lowercase) strlwr(da->result);
     };
     // Decode operands (explicit - encoded in command, implicit - present in
     // mmemonic or assumed - used or modified by command). Assumed operands
@@ -976,9 +1130,9 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       // next step. Global addcomment takes care of this. Decoding routines,
       // however, may ignore this flag.
       if (operand==0 && pd->arg2!=NNN && pd->arg2<PSEUDOOP)
-        addcomment=0;
+        ds->addcomment=0;
       else
-        addcomment=1;
+        ds->addcomment=1;
       // Get type of next argument.
       if (operand==0) arg=pd->arg1;
       else if (operand==1) arg=pd->arg2;
@@ -986,49 +1140,49 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       if (arg==NNN) break;             // No more operands
       // Arguments with arg>=PSEUDOOP are assumed operands and are not
       // displayed in disassembled result, so they require no delimiter.
-      if ((mode>=DISASM_FILE) && arg<PSEUDOOP) {
+      if ((ds->mode>=DISASM_FILE) && arg<PSEUDOOP) {
         if (operand==0) {
-          da->result[nresult++]=' ';
-          if (tabarguments) {
-            while (nresult<8) da->result[nresult++]=' ';
+          da->result[ds->nresult++]=' ';
+          if (ds->opt->tabarguments) {
+            while (ds->nresult<8) da->result[ds->nresult++]=' ';
           }; }
         else {
-          da->result[nresult++]=',';
-          if (extraspace) da->result[nresult++]=' ';
+          da->result[ds->nresult++]=',';
+          if (ds->opt->extraspace) da->result[ds->nresult++]=' ';
         };
       };
       // Decode, analyse and comment next operand of the command.
       switch (arg) {
         case REG:                      // Integer register in Reg field
-          if (size<2) da->error=DAE_CROSS;
-          else DecodeRG(cmd[1]>>3,datasize,REG);
-          hasrm=1; break;
+          if (ds->size<2) da->error=DAE_CROSS;
+          else DecodeRG(ds,ds->cmd[1]>>3,ds->datasize,REG);
+          ds->hasrm=1; break;
         case RCM:                      // Integer register in command byte
-          DecodeRG(cmd[0],datasize,RCM); break;
+          DecodeRG(ds,ds->cmd[0],ds->datasize,RCM); break;
         case RG4:                      // Integer 4-byte register in Reg field
-          if (size<2) da->error=DAE_CROSS;
-          else DecodeRG(cmd[1]>>3,4,RG4);
-          hasrm=1; break;
+          if (ds->size<2) da->error=DAE_CROSS;
+          else DecodeRG(ds,ds->cmd[1]>>3,4,RG4);
+          ds->hasrm=1; break;
         case RAC:                      // Accumulator (AL/AX/EAX, implicit)
-          DecodeRG(REG_EAX,datasize,RAC); break;
+          DecodeRG(ds,REG_EAX,ds->datasize,RAC); break;
         case RAX:                      // AX (2-byte, implicit)
-          DecodeRG(REG_EAX,2,RAX); break;
+          DecodeRG(ds,REG_EAX,2,RAX); break;
         case RDX:                      // DX (16-bit implicit port address)
-          DecodeRG(REG_EDX,2,RDX); break;
+          DecodeRG(ds,REG_EDX,2,RDX); break;
         case RCL:                      // Implicit CL register (for shifts)
-          DecodeRG(REG_ECX,1,RCL); break;
+          DecodeRG(ds,REG_ECX,1,RCL); break;
         case RS0:                      // Top of FPU stack (ST(0))
-          DecodeST(0,0); break;
+          DecodeST(ds,0,0); break;
         case RST:                      // FPU register (ST(i)) in command byte
-          DecodeST(cmd[0],0); break;
+          DecodeST(ds,ds->cmd[0],0); break;
         case RMX:                      // MMX register MMx
-          if (size<2) da->error=DAE_CROSS;
-          else DecodeMX(cmd[1]>>3);
-          hasrm=1; break;
+          if (ds->size<2) da->error=DAE_CROSS;
+          else DecodeMX(ds,ds->cmd[1]>>3);
+          ds->hasrm=1; break;
         case R3D:                      // 3DNow! register MMx
-          if (size<2) da->error=DAE_CROSS;
-          else DecodeNR(cmd[1]>>3);
-          hasrm=1; break;
+          if (ds->size<2) da->error=DAE_CROSS;
+          else DecodeNR(ds,ds->cmd[1]>>3);
+          ds->hasrm=1; break;
         case MRG:                      // Memory/register in ModRM byte
         case MRJ:                      // Memory/reg in ModRM as JUMP target
         case MR1:                      // 1-byte memory/register in ModRM byte
@@ -1051,148 +1205,148 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
         case MFE:                      // Memory in ModRM byte (FPU environment)
         case MFS:                      // Memory in ModRM byte (FPU state)
         case MFX:                      // Memory in ModRM byte (ext. FPU state)
-          DecodeMR(arg); break;
+          DecodeMR(ds,arg); break;
         case MMS:                      // Memory in ModRM byte (as SEG:OFFS)
-          DecodeMR(arg);
+          DecodeMR(ds,arg);
           da->warnings|=DAW_FARADDR; break;
         case RR4:                      // 4-byte memory/register (register only)
         case RR8:                      // 8-byte MMX register only in ModRM
         case RRD:                      // 8-byte memory/3DNow! (register only)
-          if ((cmd[1] & 0xC0)!=0xC0) softerror=DAE_REGISTER;
-          DecodeMR(arg); break;
+          if ((ds->cmd[1] & 0xC0)!=0xC0) ds->softerror=DAE_REGISTER;
+          DecodeMR(ds,arg); break;
         case MSO:                      // Source in string op's ([ESI])
-          DecodeSO(); break;
+          DecodeSO(ds); break;
         case MDE:                      // Destination in string op's ([EDI])
-          DecodeDE(); break;
+          DecodeDE(ds); break;
         case MXL:                      // XLAT operand ([EBX+AL])
-          DecodeXL(); break;
+          DecodeXL(ds); break;
         case IMM:                      // Immediate data (8 or 16/32)
         case IMU:                      // Immediate unsigned data (8 or 16/32)
-          if ((pd->bits & SS)!=0 && (*cmd & 0x02)!=0)
-            DecodeIM(1,datasize,arg);
+          if ((pd->bits & SS)!=0 && (*ds->cmd & 0x02)!=0)
+            DecodeIM(ds,1,ds->datasize,arg);
           else
-            DecodeIM(datasize,0,arg);
+            DecodeIM(ds,ds->datasize,0,arg);
           break;
         case VXD:                      // VxD service (32-bit only)
-          DecodeVX(); break;
+          DecodeVX(ds); break;
         case IMX:                      // Immediate sign-extendable byte
-          DecodeIM(1,datasize,arg); break;
+          DecodeIM(ds,1,ds->datasize,arg); break;
         case C01:                      // Implicit constant 1 (for shifts)
-          DecodeC1(); break;
+          DecodeC1(ds); break;
         case IMS:                      // Immediate byte (for shifts)
         case IM1:                      // Immediate byte
-          DecodeIM(1,0,arg); break;
+          DecodeIM(ds,1,0,arg); break;
         case IM2:                      // Immediate word (ENTER/RET)
-          DecodeIM(2,0,arg);
+          DecodeIM(ds,2,0,arg);
           if ((da->immconst & 0x03)!=0) da->warnings|=DAW_STACK;
           break;
         case IMA:                      // Immediate absolute near data address
-          DecodeIA(); break;
+          DecodeIA(ds); break;
         case JOB:                      // Immediate byte offset (for jumps)
-          DecodeRJ(1,srcip+2); break;
+          DecodeRJ(ds,1,srcip+2); break;
         case JOW:                      // Immediate full offset (for jumps)
-          DecodeRJ(datasize,srcip+datasize+1); break;
+          DecodeRJ(ds,ds->datasize,srcip+ds->datasize+1); break;
         case JMF:                      // Immediate absolute far jump/call addr
-          DecodeJF();
+          DecodeJF(ds);
           da->warnings|=DAW_FARADDR; break;
         case SGM:                      // Segment register in ModRM byte
-          if (size<2) da->error=DAE_CROSS;
-          DecodeSG(cmd[1]>>3); hasrm=1; break;
+          if (ds->size<2) da->error=DAE_CROSS;
+          DecodeSG(ds,ds->cmd[1]>>3); ds->hasrm=1; break;
         case SCM:                      // Segment register in command byte
-          DecodeSG(cmd[0]>>3);
+          DecodeSG(ds,ds->cmd[0]>>3);
           if ((da->cmdtype & C_TYPEMASK)==C_POP) da->warnings|=DAW_SEGMENT;
           break;
         case CRX:                      // Control register CRx
-          if ((cmd[1] & 0xC0)!=0xC0) da->error=DAE_REGISTER;
-          DecodeCR(cmd[1]); break;
+          if ((ds->cmd[1] & 0xC0)!=0xC0) da->error=DAE_REGISTER;
+          DecodeCR(ds,ds->cmd[1]); break;
         case DRX:                      // Debug register DRx
-          if ((cmd[1] & 0xC0)!=0xC0) da->error=DAE_REGISTER;
-          DecodeDR(cmd[1]); break;
+          if ((ds->cmd[1] & 0xC0)!=0xC0) da->error=DAE_REGISTER;
+          DecodeDR(ds,ds->cmd[1]); break;
         case PRN:                      // Near return address (pseudooperand)
           break;
         case PRF:                      // Far return address (pseudooperand)
           da->warnings|=DAW_FARADDR; break;
         case PAC:                      // Accumulator (AL/AX/EAX, pseudooperand)
-          DecodeRG(REG_EAX,datasize,PAC); break;
+          DecodeRG(ds,REG_EAX,ds->datasize,PAC); break;
         case PAH:                      // AH (in LAHF/SAHF, pseudooperand)
         case PFL:                      // Lower byte of flags (pseudooperand)
           break;
         case PS0:                      // Top of FPU stack (pseudooperand)
-          DecodeST(0,1); break;
+          DecodeST(ds,0,1); break;
         case PS1:                      // ST(1) (pseudooperand)
-          DecodeST(1,1); break;
+          DecodeST(ds,1,1); break;
         case PCX:                      // CX/ECX (pseudooperand)
-          DecodeRG(REG_ECX,cxsize,PCX); break;
+          DecodeRG(ds,REG_ECX,cxsize,PCX); break;
         case PDI:                      // EDI (pseudooperand in MMX extentions)
-          DecodeRG(REG_EDI,4,PDI); break;
+          DecodeRG(ds,REG_EDI,4,PDI); break;
         default:
           da->error=DAE_INTERN;        // Unknown argument type
         break;
       };
     };
     // Check whether command may possibly contain fixups.
-    if (pfixup!=NULL && da->fixupsize>0)
-      da->fixupoffset=pfixup-src;
+    if (ds->pfixup!=NULL && da->fixupsize>0)
+      da->fixupoffset=ds->pfixup-src;
     // Segment prefix and address size prefix are superfluous for command which
     // does not access memory. If this the case, mark command as rare to help
     // in analysis.
     if (da->memtype==DEC_UNKNOWN &&
-      (segprefix!=SEG_UNDEF || (addrsize!=4 && pd->name[0]!='$'))
+      (ds->segprefix!=SEG_UNDEF || (ds->addrsize!=4 && pd->name[0]!='$'))
     ) {
       da->warnings|=DAW_PREFIX;
       da->cmdtype|=C_RARE; };
     // 16-bit addressing is rare in 32-bit programs. If this is the case,
     // mark command as rare to help in analysis.
-    if (addrsize!=4) da->cmdtype|=C_RARE;
+    if (ds->addrsize!=4) da->cmdtype|=C_RARE;
   };
   // Suffix of 3DNow! command is accounted best by assuming it immediate byte
   // constant.
   if (is3dnow) {
-    if (immsize!=0) da->error=DAE_BADCMD;
-    else immsize=1; };
+    if (ds->immsize!=0) da->error=DAE_BADCMD;
+    else ds->immsize=1; };
   // Right or wrong, command decoded. Now dump it.
   if (da->error!=0) {                  // Hard error in command detected
-    if (mode>=DISASM_FILE)
-      nresult=snprintf(da->result,1024,"???");
+    if (ds->mode>=DISASM_FILE)
+      ds->nresult=snprintf(da->result,1024,"???");
     if (da->error==DAE_BADCMD &&
-      (*cmd==0x0F || *cmd==0xFF) && size>0
+      (*ds->cmd==0x0F || *ds->cmd==0xFF) && ds->size>0
     ) {
-      if (mode>=DISASM_FILE) ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd) & 0xFF);
-      cmd++; size--; };
-    if (size>0) {
-      if (mode>=DISASM_FILE) ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd) & 0xFF);
-      cmd++; size--;
+      if (ds->mode>=DISASM_FILE) ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd) & 0xFF);
+      ds->cmd++; ds->size--; };
+    if (ds->size>0) {
+      if (ds->mode>=DISASM_FILE) ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd) & 0xFF);
+      ds->cmd++; ds->size--;
     }; }
   else {                               // No hard error, dump command
-    if (mode>=DISASM_FILE) {
-      ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd++) & 0xFF);
-      if (hasrm) ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd++) & 0xFF);
-      if (hassib) ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd++) & 0xFF);
-      if (dispsize!=0) {
-        da->dump[ndump++]=' ';
-        for (i=0; i<dispsize; i++) {
-          ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd++) & 0xFF);
+    if (ds->mode>=DISASM_FILE) {
+      ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd++) & 0xFF);
+      if (ds->hasrm) ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd++) & 0xFF);
+      if (ds->hassib) ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd++) & 0xFF);
+      if (ds->dispsize!=0) {
+        da->dump[ds->ndump++]=' ';
+        for (i=0; i<ds->dispsize; i++) {
+          ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd++) & 0xFF);
         };
       };
-      if (immsize!=0) {
-        da->dump[ndump++]=' ';
-        for (i=0; i<immsize; i++) {
-          ndump+=snprintf(da->dump+ndump,1024,"%02x",(*cmd++) & 0xFF);
+      if (ds->immsize!=0) {
+        da->dump[ds->ndump++]=' ';
+        for (i=0; i<ds->immsize; i++) {
+          ds->ndump+=snprintf(da->dump+ds->ndump,1024,"%02x",(*ds->cmd++) & 0xFF);
         };
       };
     }
     else
-      cmd+=1+hasrm+hassib+dispsize+immsize;
-    size-=1+hasrm+hassib+dispsize+immsize;
+      ds->cmd+=1+ds->hasrm+ds->hassib+ds->dispsize+ds->immsize;
+    ds->size-=1+ds->hasrm+ds->hassib+ds->dispsize+ds->immsize;
   };
   // Check that command is not a dangerous one.
-  if (mode>=DISASM_DATA) {
+  if (ds->mode>=DISASM_DATA) {
     for (pdan=dangerous; pdan->mask!=0; pdan++) {
       if (((code^pdan->code) & pdan->mask)!=0)
         continue;
       if (pdan->type==C_DANGERLOCK && lockprefix==0)
         break;                         // Command harmless without LOCK prefix
-      if (iswindowsnt && pdan->type==C_DANGER95)
+      if (ds->opt->iswindowsnt && pdan->type==C_DANGER95)
         break;                         // Command harmless under Windows NT
       // Dangerous command!
       if (pdan->type==C_DANGER95) da->warnings|=DAW_DANGER95;
@@ -1200,9 +1354,9 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       break;
     };
   };
-  if (da->error==0 && softerror!=0)
-    da->error=softerror;               // Error, but still display command
-  if (mode>=DISASM_FILE) {
+  if (da->error==0 && ds->softerror!=0)
+    da->error=ds->softerror;           // Error, but still display command
+  if (ds->mode>=DISASM_FILE) {
     if (da->error!=DAE_NOERR) switch (da->error) {
       case DAE_CROSS:
         strcpy(da->comment,"Command crosses end of memory block"); break;
@@ -1219,11 +1373,11 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       default:
         strcpy(da->comment,"Unknown error");
       break; }
-    else if ((da->warnings & DAW_PRIV)!=0 && privileged==0)
+    else if ((da->warnings & DAW_PRIV)!=0 && ds->opt->privileged==0)
       strcpy(da->comment,"Privileged command");
-    else if ((da->warnings & DAW_IO)!=0 && iocommand==0)
+    else if ((da->warnings & DAW_IO)!=0 && ds->opt->iocommand==0)
       strcpy(da->comment,"I/O command");
-    else if ((da->warnings & DAW_FARADDR)!=0 && farcalls==0) {
+    else if ((da->warnings & DAW_FARADDR)!=0 && ds->opt->farcalls==0) {
       if ((da->cmdtype & C_TYPEMASK)==C_JMP)
         strcpy(da->comment,"Far jump");
       else if ((da->cmdtype & C_TYPEMASK)==C_CAL)
@@ -1231,18 +1385,168 @@ ulong Disasm(char *src,ulong srcsize,ulong srcip,
       else if ((da->cmdtype & C_TYPEMASK)==C_RET)
         strcpy(da->comment,"Far return");
       ; }
-    else if ((da->warnings & DAW_SEGMENT)!=0 && farcalls==0)
+    else if ((da->warnings & DAW_SEGMENT)!=0 && ds->opt->farcalls==0)
       strcpy(da->comment,"Modification of segment register");
-    else if ((da->warnings & DAW_SHIFT)!=0 && badshift==0)
+    else if ((da->warnings & DAW_SHIFT)!=0 && ds->opt->badshift==0)
       strcpy(da->comment,"Shift constant out of range 1..31");
-    else if ((da->warnings & DAW_PREFIX)!=0 && extraprefix==0)
+    else if ((da->warnings & DAW_PREFIX)!=0 && ds->opt->extraprefix==0)
       strcpy(da->comment,"Superfluous prefix");
-    else if ((da->warnings & DAW_LOCK)!=0 && lockedbus==0)
+    else if ((da->warnings & DAW_LOCK)!=0 && ds->opt->lockedbus==0)
       strcpy(da->comment,"LOCK prefix");
-    else if ((da->warnings & DAW_STACK)!=0 && stackalign==0)
+    else if ((da->warnings & DAW_STACK)!=0 && ds->opt->stackalign==0)
       strcpy(da->comment,"Unaligned stack operation");
     ;
   };
-  return (srcsize-size);               // Returns number of recognized bytes
+  return (srcsize-ds->size);           // Returns number of recognized bytes
 };
 
+
+// Determines size of ModRM, SIB and displacement exactly like DecodeMR() does
+// in mode DISASM_SIZE. Returns DAE_NOERR or DAE_CROSS.
+static int Modrmlength(t_dstate *ds) {
+  int c,sib;
+  if (ds->size<2) return DAE_CROSS;    // ModR/M byte outside the memory block
+  ds->hasrm=1;
+  c=ds->cmd[1] & 0xC7;
+  if ((c & 0xC0)==0xC0)                // Register operand
+    return DAE_NOERR;
+  if (ds->addrsize==2) {               // 16-bit address, no SIB
+    if (c==0x06 || (c & 0xC0)==0x80) ds->dispsize=2;
+    else if ((c & 0xC0)==0x40) ds->dispsize=1;
+    if (ds->size<2+(ulong)ds->dispsize) return DAE_CROSS;
+    return DAE_NOERR; };
+  if (c==0x05)                         // Immediate 32-bit address
+    ds->dispsize=4;
+  else if ((c & 0x07)==0x04) {         // SIB addresation
+    sib=ds->cmd[2]; ds->hassib=1;
+    if (c==0x04 && (sib & 0x07)==0x05) ds->dispsize=4;
+    else if ((c & 0xC0)==0x40) ds->dispsize=1;
+    else if ((c & 0xC0)==0x80) ds->dispsize=4; }
+  else if ((c & 0xC0)==0x40)
+    ds->dispsize=1;
+  else if ((c & 0xC0)==0x80)
+    ds->dispsize=4;
+  if (ds->dispsize!=0 && ds->size<2+(ulong)ds->hassib+ds->dispsize)
+    return DAE_CROSS;                  // Displacement outside the memory block
+  return DAE_NOERR;
+};
+
+// Fast version of Disasm() that determines only the length of the command.
+// It recognizes the same commands and returns the same size as Disasm() in
+// mode DISASM_SIZE, but neither fills t_disasm nor formats any text, so it
+// is suitable for stepping and scanning through code.
+ulong Disasmlength(char *src,ulong srcsize,const t_disasmopt *opt) {
+  int i,arg,isprefix,repeated,is3dnow,error;
+  int segprefix,lockprefix,repprefix;
+  ulong u,code,need;
+  const t_cmddata *pd;
+  t_dstate st,*ds=&st;
+  ds->datasize=ds->addrsize=4;
+  ds->hasrm=ds->hassib=ds->dispsize=ds->immsize=0;
+  ds->cmd=src; ds->size=srcsize;
+  ds->opt=(opt!=NULL?opt:&defaultopt);
+  segprefix=SEG_UNDEF; lockprefix=repprefix=0;
+  is3dnow=0; error=DAE_NOERR;
+  // Skip prefixes. Repeated prefix is flushed as a separate 1-byte command.
+  u=0; repeated=0;
+  while (ds->size>0) {
+    isprefix=1;
+    switch (*ds->cmd) {
+      case 0x26: case 0x2E: case 0x36: case 0x3E: case 0x64: case 0x65:
+        if (segprefix==SEG_UNDEF) segprefix=*ds->cmd; else repeated=1; break;
+      case 0x66: if (ds->datasize==4) ds->datasize=2; else repeated=1; break;
+      case 0x67: if (ds->addrsize==4) ds->addrsize=2; else repeated=1; break;
+      case 0xF0: if (lockprefix==0) lockprefix=0xF0; else repeated=1; break;
+      case 0xF2: case 0xF3:
+        if (repprefix==0) repprefix=*ds->cmd & 0xFF; else repeated=1; break;
+      default: isprefix=0; break; };
+    if (isprefix==0 || repeated!=0)
+      break;
+    ds->cmd++; ds->size--; u++; };
+  if (repeated) return 1;
+  code=0;
+  if (ds->size>0) *(((char *)&code)+0)=ds->cmd[0];
+  if (ds->size>1) *(((char *)&code)+1)=ds->cmd[1];
+  if (ds->size>2) *(((char *)&code)+2)=ds->cmd[2];
+  if (repprefix!=0)
+    code=(code<<8) | repprefix;
+  if (ds->opt->decodevxd && (code & 0xFFFF)==0x20CD)
+    pd=&vxdcmd;
+  else
+    pd=Findcommand(ds,code,0,&is3dnow,&error);
+  if (pd->mask==0) {                   // Command not found
+    if (ds->size<2) error=DAE_CROSS;
+    else error=DAE_BADCMD; }
+  else {
+    if (pd->len==2) {
+      if (ds->size==0) error=DAE_CROSS;
+      else {
+        ds->cmd++; ds->size--;
+      }; };
+    if (ds->size==0) error=DAE_CROSS;
+    if ((pd->bits & WW)!=0 && (*ds->cmd & WW)==0)
+      ds->datasize=1;
+    else if ((pd->bits & W3)!=0 && (*ds->cmd & W3)==0)
+      ds->datasize=1;
+    else if ((pd->bits & FF)!=0)
+      ds->datasize=2;
+    // Only operands that occupy bytes in the command are of interest here.
+    for (i=0; i<3 && error==DAE_NOERR; i++) {
+      arg=(i==0?pd->arg1:(i==1?pd->arg2:pd->arg3));
+      if (arg==NNN) break;
+      switch (arg) {
+        case REG: case RG4: case RMX: case R3D: case SGM:
+          if (ds->size<2) error=DAE_CROSS;
+          ds->hasrm=1; break;
+        case CRX: case DRX:
+          if ((ds->cmd[1] & 0xC0)!=0xC0) error=DAE_REGISTER;
+          ds->hasrm=1; break;
+        case MRG: case MRJ: case MR1: case MR2: case MR4: case MR8: case MRD:
+        case MMA: case MML: case MM6: case MMB: case MD2: case MB2: case MD4:
+        case MD8: case MDA: case MF4: case MF8: case MFA: case MFE: case MFS:
+        case MFX: case MMS: case RR4: case RR8: case RRD:
+          error=Modrmlength(ds);
+          break;
+        case IMM: case IMU:
+          if ((pd->bits & SS)!=0 && (*ds->cmd & 0x02)!=0) ds->immsize+=1;
+          else ds->immsize+=ds->datasize;
+          break;
+        case VXD:
+          ds->immsize+=4; break;
+        case IMX: case IMS: case IM1:
+          ds->immsize+=1; break;
+        case IM2:
+          ds->immsize+=2; break;
+        case IMA:
+          if (ds->size<1+ds->addrsize) error=DAE_CROSS;
+          else ds->dispsize=ds->addrsize;
+          break;
+        case JOB: case JOW:
+          need=(arg==JOB?1:ds->datasize);
+          if (ds->size<need+1) error=DAE_CROSS;
+          else ds->dispsize=need;
+          break;
+        case JMF:
+          if (ds->size<1+ds->addrsize+2) error=DAE_CROSS;
+          else {
+            ds->dispsize=ds->addrsize; ds->immsize=2; };
+          break;
+        default:                       // Implicit operand, no bytes
+          break;
+      };
+    };
+  };
+  if (is3dnow) {
+    if (ds->immsize!=0) error=DAE_BADCMD;
+    else ds->immsize=1; };
+  if (error!=DAE_NOERR) {
+    if (error==DAE_BADCMD && (*ds->cmd==0x0F || *ds->cmd==0xFF) &&
+      ds->size>0) {
+      ds->cmd++; ds->size--; };
+    if (ds->size>0) {
+      ds->cmd++; ds->size--;
+    }; }
+  else
+    ds->size-=1+ds->hasrm+ds->hassib+ds->dispsize+ds->immsize;
+  return (srcsize-ds->size);
+};
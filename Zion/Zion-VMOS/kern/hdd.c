@@ -1,19 +1,42 @@
 //#define 	__HDD_DEBUG__
 
 #include <inc/kern/hdd.h>
+#include <inc/kern/pmap.h>
 #include <inc/lib/stdio.h>
 #include <inc/memlayout.h>
 #include <inc/arch/port_op.h>
 #include <inc/arch/x86.h>
 #include <inc/hardcoding_param.h>
 
+/* PCI configuration space access (mechanism #1). */
+#define 	PCI_CONFIG_ADDR 		0xCF8
+#define 	PCI_CONFIG_DATA 		0xCFC
+#define 	PCI_MAX_BUS 			8
+#define 	PCI_CLASS_IDE 			0x0101 		// Mass storage, IDE interface
+#define 	PCI_CMD_BUS_MASTER 	0x0004
+
 static void print_identify_info(u16* hdinfo);
+static int hd_read_identify(int drive, u16 *hdinfo);
+static void hd_probe(void);
+static u16 hd_find_bm_base(void);
+static void hd_make_cmd(struct hd_cmd *cmd, u64 sect_nr, u16 sector_cnt, u8 command);
+static int hd_pio_xfer(u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt, u16 block);
+static int hd_dma_xfer(u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt);
 static void hd_cmd_out(struct hd_cmd* cmd);
 static int waitfor(int mask, int val, uint timeout);
 #ifdef __HDD_DEBUG__
 static void TEST_output_hdbuf ( u16 *hdbuf, u32 size16_t );
 #endif
 
+static int 		hd_probed = 0;
+static int 		hd_mode = HD_MODE_AUTO; 		// Requested transfer mode
+static u16 		hd_bm_base = 0; 				// Bus master base of our channel, 0 if none
+static u16 		hd_multi_sectors = 0; 		// Sectors per DRQ block for READ MULTIPLE, 0 if unsupported
+static int 		hd_dma_supported = 0; 		// Drive reports DMA in IDENTIFY word 49
+
+// 8 entries * 8 bytes, so 64-byte alignment keeps the table inside one 64KB region.
+static struct hd_prd hd_prdt[NR_PRD_ENTRIES] __attribute__((aligned(64)));
+
 /**************************************************
  * Function: 		Initialize hard disk.
  * Description: 	Check hard drive.
@@ -39,21 +62,50 @@ init_hd ( void )
 void 
 hd_identify ( int drive )
 {
-	u8 hdbuf[HDBUF_SIZE];
+	u16 hdbuf[HDBUF_SIZE/2];
+
+	if ( !hd_read_identify(drive, hdbuf) ) {
+		cprintf("Error: Wait for data request status timeout!\n");
+		return;
+	}//if
+
+	print_identify_info(hdbuf);
+
+	if ( !hd_probed ) {
+		hd_probe();
+	}//if
+	cprintf("\tREAD MULTIPLE: %d sectors per block\n", hd_multi_sectors);
+	cprintf("\tBus master DMA: %s", hd_bm_base ? "Yes" : "No");
+	if ( hd_bm_base ) {
+		cprintf(" (base=0x%04x)", hd_bm_base);
+	}//if
+	cprintf("\n\tTransfer mode: %s\n", hd_mode_name(hd_get_mode()));
+}//hd_identify()
+
+
+
+/**************************************************
+ * Function: 		Read identify data.
+ * Description: 	Issue ATA_IDENTIFY and read the 256-word answer.
+ * @param: 		drive - Driver number.
+ * 					hdinfo - Buffer of HDBUF_SIZE bytes.
+ * @return: 		1 if succeed, 0 if timeout.
+ * ************************************************/
+static int 
+hd_read_identify ( int drive, u16 *hdinfo )
+{
 	struct hd_cmd 	cmd = {0};
 
 	cmd.device  = MAKE_DEVICE_REG(0, drive, 0);
 	cmd.command = CMD_IDENTIFY;
 	hd_cmd_out(&cmd);
 	if ( !waitfor(STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT) ) {
-		cprintf("Error: Wait for data request status timeout!\n");
-		return;
+		return 0;
 	}//if
 	
-	((void (*)(u16, void*, int))port_read)(REG_DATA, hdbuf, HDBUF_SIZE);
-
-	print_identify_info((u16*)hdbuf);
-}//hd_identify()
+	((void (*)(u16, void*, int))port_read)(REG_DATA, hdinfo, HDBUF_SIZE);
+	return 1;
+}//hd_read_identify()
 
 
 
@@ -104,47 +156,368 @@ print_identify_info ( u16 *hdinfo )
 
 
 
-void 
-hd_rw ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt )
+/**************************************************
+ * Function: 		Probe transfer capabilities.
+ * Description: 	Read IDENTIFY once, enable READ MULTIPLE and look up
+ * 					the bus master IDE base of our channel on PCI.
+ * @param: 		<none>
+ * @return: 		<none>
+ * ************************************************/
+static void 
+hd_probe ( void )
 {
-	struct hd_cmd cmd = {0};
-	
-	cmd.features	= 0;
-	cmd.sector_cnt_0_7 = sector_cnt & 0xFF;
-	cmd.sector_cnt_8_15 = (sector_cnt >> 8) & 0xFF;
-	cmd.lba_0_7 = sect_nr & 0xFF;
-	cmd.lba_8_15 = (sect_nr >>  8) & 0xFF;
-	cmd.lba_16_23 = (sect_nr >> 16) & 0xFF;
-	cmd.lba_24_31 = (sect_nr >> 24) & 0xFF;
-	cmd.lba_32_39 = (sect_nr >> 32) & 0xFF;
-	cmd.lba_40_47 = (sect_nr >> 40) & 0xFF;
-	cmd.device	= MAKE_DEVICE_REG(1, DEV_HD_MASTER, (sect_nr >> 24) & 0xF);
-	cmd.command	= (rw == HD_READ) ? CMD_READ : CMD_WRITE;
-	hd_cmd_out(&cmd);
+	u16 	hdinfo[HDBUF_SIZE/2];
+	u16 	multi;
 
-	if ( rw == HD_READ ) { 	// For hard disk read.
-		while ( sector_cnt ) {
-			if ( !waitfor(STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT) ) {
-				cprintf("\tError: Wait for data request status timeout!\n");
-				return;
-			}//if
-			((void (*)(u16, void*, int))port_read)(REG_DATA, hdbuf, SECTOR_SIZE);
-			hdbuf += SECTOR_SIZE;
-			sector_cnt--;
-		}//while
-	} else {	// For hard disk write.
-		cprintf("\tWarning: Hard disk write has not been implemented.\n");
+	hd_probed = 1;
+	if ( !hd_read_identify(DEV_HD_MASTER, hdinfo) ) {
 		return;
-	}//if...else
+	}//if
+
+	hd_dma_supported = (hdinfo[49] & 0x0100) ? 1 : 0;
+
+	// Word 47 bits 0-7: maximum sectors per DRQ block for READ/WRITE MULTIPLE.
+	multi = hdinfo[47] & 0xFF;
+	if ( multi > 1 ) {
+		struct hd_cmd 	cmd = {0};
+
+		cmd.sector_cnt_0_7 = multi;
+		cmd.device = MAKE_DEVICE_REG(1, DEV_HD_MASTER, 0);
+		cmd.command = CMD_SET_MULTIPLE;
+		hd_cmd_out(&cmd);
+		if ( waitfor(STATUS_BSY, 0, HD_TIMEOUT) && !(inb(REG_STATUS) & STATUS_ERR) ) {
+			hd_multi_sectors = multi;
+		}//if
+	}//if
+
+	if ( hd_dma_supported ) {
+		hd_bm_base = hd_find_bm_base();
+	}//if
+}//hd_probe()
+
+
+
+static u32 
+pci_read_config ( u32 bus, u32 dev, u32 func, u32 reg )
+{
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xFC));
+	return inl(PCI_CONFIG_DATA);
+}//pci_read_config()
+
+
+
+static void 
+pci_write_config ( u32 bus, u32 dev, u32 func, u32 reg, u32 val )
+{
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xFC));
+	outl(PCI_CONFIG_DATA, val);
+}//pci_write_config()
+
+
+
+/**************************************************
+ * Function: 		Find bus master base.
+ * Description: 	Scan PCI for the IDE controller that decodes HD_IOPORT_BASE
+ * 					and return the bus master registers of that channel.
+ * @param: 		<none>
+ * @return: 		Bus master i/o base, 0 if not found.
+ * ************************************************/
+static u16 
+hd_find_bm_base ( void )
+{
+	for ( u32 bus = 0; bus < PCI_MAX_BUS; bus++ ) {
+		for ( u32 dev = 0; dev < 32; dev++ ) {
+			for ( u32 func = 0; func < 8; func++ ) {
+				u32 id = pci_read_config(bus, dev, func, 0x00);
+				if ( (id & 0xFFFF) == 0xFFFF ) {
+					if ( func == 0 )
+						break;
+					continue;
+				}//if
+
+				u32 class_reg = pci_read_config(bus, dev, func, 0x08);
+				u8 	prog_if = (class_reg >> 8) & 0xFF;
+				if ( (class_reg >> 16) != PCI_CLASS_IDE || !(prog_if & 0x80) ) {
+					continue;
+				}//if
+
+				// Native-mode channels decode BAR0/BAR2, compatibility ones the legacy ports.
+				u32 primary = (prog_if & 0x01) ? (pci_read_config(bus, dev, func, 0x10) & ~0x3) : 0x1F0;
+				u32 secondary = (prog_if & 0x04) ? (pci_read_config(bus, dev, func, 0x18) & ~0x3) : 0x170;
+				u32 bm = pci_read_config(bus, dev, func, 0x20) & 0xFFFC;
+				if ( bm == 0 ) {
+					continue;
+				}//if
+
+				if ( primary == HD_IOPORT_BASE || secondary == HD_IOPORT_BASE ) {
+					u32 cmd = pci_read_config(bus, dev, func, 0x04);
+					if ( !(cmd & PCI_CMD_BUS_MASTER) ) {
+						pci_write_config(bus, dev, func, 0x04, cmd | PCI_CMD_BUS_MASTER);
+					}//if
+					return (primary == HD_IOPORT_BASE) ? bm : bm + 8;
+				}//if
+			}//for(func)
+		}//for(dev)
+	}//for(bus)
+
+	return 0;
+}//hd_find_bm_base()
+
+
+
+/**************************************************
+ * Function: 		Set transfer mode.
+ * @param: 		mode - HD_MODE_AUTO, HD_MODE_DMA, HD_MODE_PIO_MULTI or HD_MODE_PIO.
+ * @return: 		1 if the mode is usable on this drive, 0 otherwise.
+ * ************************************************/
+int 
+hd_set_mode ( int mode )
+{
+	if ( !hd_probed ) {
+		hd_probe();
+	}//if
+
+	if ( (mode == HD_MODE_DMA && hd_bm_base == 0) || 
+		 (mode == HD_MODE_PIO_MULTI && hd_multi_sectors == 0) ||
+		 mode < HD_MODE_AUTO || mode > HD_MODE_PIO ) {
+		return 0;
+	}//if
+
+	hd_mode = mode;
+	return 1;
+}//hd_set_mode()
+
+
+
+/**************************************************
+ * Function: 		Get transfer mode.
+ * @return: 		The mode hd_rw() actually uses, never HD_MODE_AUTO.
+ * ************************************************/
+int 
+hd_get_mode ( void )
+{
+	if ( !hd_probed ) {
+		hd_probe();
+	}//if
+
+	if ( hd_mode != HD_MODE_AUTO ) {
+		return hd_mode;
+	}//if
+	if ( hd_bm_base ) {
+		return HD_MODE_DMA;
+	}//if
+	return hd_multi_sectors ? HD_MODE_PIO_MULTI : HD_MODE_PIO;
+}//hd_get_mode()
+
+
+
+/**************************************************
+ * Function: 		Get requested transfer mode.
+ * @return: 		The mode last passed to hd_set_mode(), HD_MODE_AUTO
+ * 					unless one was forced. Save this, not hd_get_mode(),
+ * 					to put the driver back the way it was.
+ * ************************************************/
+int 
+hd_get_requested_mode ( void )
+{
+	return hd_mode;
+}//hd_get_requested_mode()
+
+
+
+char const * 
+hd_mode_name ( int mode )
+{
+	switch ( mode ) {
+		case HD_MODE_AUTO: 		return "auto";
+		case HD_MODE_DMA: 			return "dma";
+		case HD_MODE_PIO_MULTI: 	return "multi";
+		case HD_MODE_PIO: 			return "pio";
+		default: 						return "unknown";
+	}//switch
+}//hd_mode_name()
+
+
+
+/**************************************************
+ * Function: 		Hard disk read/write.
+ * Description: 	Transfer sectors with bus master DMA when available, 
+ * 					otherwise with PIO (READ MULTIPLE if supported). 
+ * 					Requests are split into chunks of at most 64KB.
+ * @param: 		rw - HD_READ or HD_WRITE.
+ * 					hdbuf - Data buffer, sector_cnt * SECTOR_SIZE bytes.
+ * 					sect_nr - LBA of the first sector.
+ * 					sector_cnt - Number of sectors.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+int 
+hd_rw ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt )
+{
+	int 	mode = hd_get_mode();
+	int 	ok;
+
+	while ( sector_cnt ) {
+		u16 	n = (sector_cnt > DMA_MAX_SECTORS) ? DMA_MAX_SECTORS : sector_cnt;
+
+		ok = 0;
+		if ( mode == HD_MODE_DMA ) {
+			ok = hd_dma_xfer(rw, hdbuf, sect_nr, n);
+		}//if
+		if ( !ok && mode != HD_MODE_PIO && hd_multi_sectors ) { 	// DMA failure falls back to PIO.
+			ok = hd_pio_xfer(rw, hdbuf, sect_nr, n, hd_multi_sectors);
+		}//if
+		if ( !ok ) {
+			ok = hd_pio_xfer(rw, hdbuf, sect_nr, n, 1);
+		}//if
+		if ( !ok ) {
+			cprintf("\tError: Hard disk %s failed at sector %lld!\n", 
+					(rw == HD_READ) ? "read" : "write", sect_nr);
+			return 0;
+		}//if
+
+		hdbuf += n * SECTOR_SIZE;
+		sect_nr += n;
+		sector_cnt -= n;
+	}//while
 
 #ifdef __HDD_DEBUG__
 	hdbuf -= SECTOR_SIZE;
 	TEST_output_hdbuf((u16 *)hdbuf, HDBUF_SIZE/2);
 #endif
 
+	return 1;
 }//hdd_rw()
 
 
+
+static void 
+hd_make_cmd ( struct hd_cmd *cmd, u64 sect_nr, u16 sector_cnt, u8 command )
+{
+	cmd->features	= 0;
+	cmd->sector_cnt_0_7 = sector_cnt & 0xFF;
+	cmd->sector_cnt_8_15 = (sector_cnt >> 8) & 0xFF;
+	cmd->lba_0_7 = sect_nr & 0xFF;
+	cmd->lba_8_15 = (sect_nr >>  8) & 0xFF;
+	cmd->lba_16_23 = (sect_nr >> 16) & 0xFF;
+	cmd->lba_24_31 = (sect_nr >> 24) & 0xFF;
+	cmd->lba_32_39 = (sect_nr >> 32) & 0xFF;
+	cmd->lba_40_47 = (sect_nr >> 40) & 0xFF;
+	cmd->device	= MAKE_DEVICE_REG(1, DEV_HD_MASTER, (sect_nr >> 24) & 0xF);
+	cmd->command	= command;
+}//hd_make_cmd()
+
+
+
+/**************************************************
+ * Function: 		PIO transfer.
+ * Description: 	Transfer sectors through the data port, "block" sectors per 
+ * 					DRQ. block==1 uses READ/WRITE SECTORS, otherwise 
+ * 					READ/WRITE MULTIPLE EXT.
+ * @return: 		1 if succeed, 0 if failed.
+ * ************************************************/
+static int 
+hd_pio_xfer ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt, u16 block )
+{
+	struct hd_cmd cmd = {0};
+	u8 		command;
+
+	if ( block > 1 ) {
+		command = (rw == HD_READ) ? CMD_READ_MULTIPLE_EXT : CMD_WRITE_MULTIPLE_EXT;
+	} else {
+		command = (rw == HD_READ) ? CMD_READ : CMD_WRITE;
+	}//if...else
+	hd_make_cmd(&cmd, sect_nr, sector_cnt, command);
+	hd_cmd_out(&cmd);
+
+	while ( sector_cnt ) {
+		u16 	n = (sector_cnt > block) ? block : sector_cnt;
+
+		if ( !waitfor(STATUS_BSY | STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT) ) {
+			return 0;
+		}//if
+		if ( rw == HD_READ ) {
+			((void (*)(u16, void*, int))port_read)(REG_DATA, hdbuf, n * SECTOR_SIZE);
+		} else {
+			((void (*)(u16, void*, int))port_write)(REG_DATA, hdbuf, n * SECTOR_SIZE);
+		}//if...else
+		hdbuf += n * SECTOR_SIZE;
+		sector_cnt -= n;
+	}//while
+
+	// The drive finishes a write after the last block, check it got committed.
+	if ( !waitfor(STATUS_BSY, 0, HD_TIMEOUT) ) {
+		return 0;
+	}//if
+	return (inb(REG_STATUS) & (STATUS_ERR | STATUS_DFSE)) ? 0 : 1;
+}//hd_pio_xfer()
+
+
+
+/**************************************************
+ * Function: 		Bus master DMA transfer.
+ * Description: 	Build the PRD table for the buffer, start READ/WRITE DMA EXT
+ * 					and wait on the bus master interrupt latch. At most
+ * 					DMA_MAX_SECTORS per call.
+ * @return: 		1 if succeed, 0 if failed (caller falls back to PIO).
+ * ************************************************/
+static int 
+hd_dma_xfer ( u8 rw, u8 *hdbuf, u64 sect_nr, u16 sector_cnt )
+{
+	struct hd_cmd cmd = {0};
+	physaddr_t 	pa = PADDR(hdbuf);
+	u32 			bytes = sector_cnt * SECTOR_SIZE;
+	u8 			dir = (rw == HD_READ) ? BM_CMD_READ : 0;
+	u8 			bm_status;
+	int 			i = 0;
+	uint 		t = 0;
+
+	if ( (pa & 1) || sector_cnt > DMA_MAX_SECTORS ) {
+		return 0;
+	}//if
+
+	// Split the buffer at 64KB boundaries, a PRD region may not cross one.
+	while ( bytes ) {
+		u32 	len = DMA_BOUNDARY - (pa & (DMA_BOUNDARY - 1));
+		if ( len > bytes ) {
+			len = bytes;
+		}//if
+		hd_prdt[i].base = pa;
+		hd_prdt[i].byte_cnt = len & 0xFFFF; 		// 0 means 64KB
+		hd_prdt[i].flags = 0;
+		pa += len;
+		bytes -= len;
+		i++;
+	}//while
+	hd_prdt[i-1].flags = PRD_EOT;
+
+	outb(hd_bm_base + BM_REG_CMD, dir);
+	outl(hd_bm_base + BM_REG_PRDT, PADDR(hd_prdt));
+	outb(hd_bm_base + BM_REG_STATUS, inb(hd_bm_base + BM_REG_STATUS) | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	hd_make_cmd(&cmd, sect_nr, sector_cnt, (rw == HD_READ) ? CMD_READ_DMA_EXT : CMD_WRITE_DMA_EXT);
+	hd_cmd_out(&cmd);
+	outb(hd_bm_base + BM_REG_CMD, dir | BM_CMD_START);
+
+	// Completion is signalled by the drive's INTRQ, latched in the bus master status.
+	do {
+		bm_status = inb(hd_bm_base + BM_REG_STATUS);
+	} while ( !(bm_status & (BM_STATUS_IRQ | BM_STATUS_ERR)) && 
+			  (bm_status & BM_STATUS_ACTIVE) && t++ < HD_TIMEOUT );
+
+	outb(hd_bm_base + BM_REG_CMD, dir);
+	// Reading the status register acknowledges the drive interrupt.
+	if ( !waitfor(STATUS_BSY, 0, HD_TIMEOUT) ) {
+		return 0;
+	}//if
+	outb(hd_bm_base + BM_REG_STATUS, bm_status | BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	if ( (bm_status & BM_STATUS_ERR) || (inb(REG_STATUS) & (STATUS_ERR | STATUS_DFSE)) ) {
+		return 0;
+	}//if
+	return (bm_status & BM_STATUS_IRQ) ? 1 : 0;
+}//hd_dma_xfer()
+
+
 /**************************************************
  * Function: 		Hard disk command output.
  * Description: 	Output a command to HD controller.
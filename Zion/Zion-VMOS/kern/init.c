@@ -5,6 +5,7 @@
 #include <inc/kern/console.h>
 #include <inc/kern/pmap.h>
 #include <inc/kern/trap.h>
+#include <inc/kern/boottime.h>
 #include <inc/vmx/vmxapi.h>
 
 //#define 	__ZION_WITH_VMX__
@@ -15,9 +16,14 @@ void i386_init(void)
 	extern char edata[], end[];
 	extern const uint32_t sctors[], ectors[];
 	const uint32_t *ctorva;
+
+	// Start boot phase timing before anything else touches low memory.
+	boot_phase_init();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
+	boot_phase(BOOT_PHASE_CONS);
 
 	// Then call any global constructors.
 	// This relies on linker script magic to define the 'sctors' and
@@ -25,6 +31,7 @@ void i386_init(void)
 	// Call after cons_init() so we can cprintf() if necessary.
 	for (ctorva = ectors; ctorva > sctors; )
 		((void(*)()) *--ctorva)();
+	boot_phase(BOOT_PHASE_CTORS);
 
 	// Print starting message.
 	cprintf("\n\t-----------------------------------------------------------------\n");
@@ -38,14 +45,19 @@ void i386_init(void)
 
 	// Interrupt and gate descriptor initialization.
 	idt_init();
+	boot_phase(BOOT_PHASE_IDT);
 	
 #ifdef __ZION_WITH_VMX__
 	// Initialize VM and Turn on VMM
 	cprintf("VMX initialization: start.\n");
     start_vmx();
     cprintf("VMX initialization: finished.\n");
+	boot_phase(BOOT_PHASE_VMX);
 #endif
 
+	boot_phase(BOOT_PHASE_MONITOR);
+	boot_phase_report();
+
 	// Drop into the kernel monitor.
 	while (1)
 		monitor(NULL);
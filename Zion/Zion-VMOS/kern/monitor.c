@@ -12,8 +12,10 @@
 #include <inc/kern/trap.h>
 #include <inc/arch/cpu.h>
 #include <inc/kern/hdd.h>
+#include <inc/kern/bcache.h>
 #include <inc/kern/dbg.h>
 #include <inc/kern/Loader.h>
+#include <inc/vmx/ioports.h>
 #include <inc/hardcoding_param.h>
 
 #define 	CMDBUF_SIZE	80	// enough for one VGA text line
@@ -42,9 +44,13 @@ static struct Command commands[] = {
 	{ "x", "Check the memory. ", mon_memcheck },
 	{ "meminfo", "Display memory information.", mon_meminfo },
 	{ "startvmx", "Start VMX.", mon_startvmx },
-	{ "loadkern", "Load kernel.", mon_LoadKernel },
+	{ "loadkern", "Load kernel: loadkern [start sector].", mon_LoadKernel },
 	{ "hdinfo", "Get hard disk information.", mon_GetHDInfo },
 	{ "hdread", "Read hard disk sectors.", mon_HDRead },
+	{ "hdmode", "Show or set hard disk transfer mode (auto|dma|multi|pio).", mon_HDMode },
+	{ "hdbench", "Time a read in each transfer mode and check they read the same data.", mon_HDBench },
+	{ "bcache", "Block cache statistics: bcache [flush|drop|reset].", mon_BCache },
+	{ "iolog", "Log guest port accesses: iolog <port> [count] on|off.", mon_IOLog },
 	{ "kdbg", "k debugger", dbg_dummy_console },
 };
 #define NCOMMANDS (int) (sizeof(commands)/sizeof(commands[0]))
@@ -298,12 +304,17 @@ int
 mon_LoadKernel (int argc, char **argv, struct Trapframe *tf)
 {
 	u32 		KernFileBaseAddr = *((uint32_t *)MemSize_paddr) - (OffsetFromMemoryEnd_MB * 0x100000) + ADDR_OFFSET;
-	u32 		KernFileSize;
-	u64 		NrStartSector;
+	u32 		KernFileSize, KernEntry;
+	u64 		NrStartSector = 0;
 	char 		*cmdbuf;
+	int 		result;
 
-	while (1) {
-		cmdbuf = readline("Kernel file size (MB): ");
+	if ( argc == 2 ) {
+		NrStartSector = str2num(argv[1]);
+	}//if
+
+	while ( NrStartSector == 0 ) {
+		cmdbuf = readline("Sector number of kernel file base: ");
 		if ( cmdbuf != NULL ) {
 			// gobble whitespace
 			while (*cmdbuf && strchr(WHITESPACE, *cmdbuf))
@@ -314,18 +325,32 @@ mon_LoadKernel (int argc, char **argv, struct Trapframe *tf)
 			if ( !strcmp(cmdbuf, "q") ) {
 				return 0;
 			}
-			KernFileSize = str2num(cmdbuf);
-			if ( KernFileSize > 0 && KernFileSize<OffsetFromMemoryEnd_MB) {
-				break;
-			} else {
-				cprintf("\tERROR: File size should be between 1 and %d MB!\n", OffsetFromMemoryEnd_MB);
-				continue;
-			}//if...else
+			NrStartSector = str2num(cmdbuf);
+			if ( NrStartSector <= 0 ) {
+				NrStartSector = 0;
+				cprintf("\tERROR: Logic sector number does not exist!\n");
+			}//if
 		}//if
 	}//while
 
+#ifdef __MONITOR_DEBUG__
+	cprintf("\tNrStartSector=%ld, KernFileBaseAddr=0x%08x\n", NrStartSector, KernFileBaseAddr);
+#endif
+
+	// ELF images are sized by their program headers, only PT_LOAD segments are read.
+	result = ELF_Load(NrStartSector, KernFileBaseAddr, OffsetFromMemoryEnd_MB * 0x100000, &KernEntry, &KernFileSize);
+	if ( result > 0 ) {
+		cprintf("\tKernel image: 0x%08x - 0x%08x, entry 0x%08x\n", KernFileBaseAddr, KernFileBaseAddr + KernFileSize, KernEntry);
+		return 0;
+	} else if ( result == 0 ) {
+		cprintf("\tERROR: Load ELF kernel failed!\n");
+		return 0;
+	}//if...else
+
+	// Not an ELF file, fall back to a raw load of a user supplied size.
+	cprintf("\tNot an ELF file, loading raw image.\n");
 	while (1) {
-		cmdbuf = readline("Sector number of kernel file base: ");
+		cmdbuf = readline("Kernel file size (MB): ");
 		if ( cmdbuf != NULL ) {
 			// gobble whitespace
 			while (*cmdbuf && strchr(WHITESPACE, *cmdbuf))
@@ -336,24 +361,20 @@ mon_LoadKernel (int argc, char **argv, struct Trapframe *tf)
 			if ( !strcmp(cmdbuf, "q") ) {
 				return 0;
 			}
-			NrStartSector = str2num(cmdbuf);
-			if ( NrStartSector > 0 ) {
+			KernFileSize = str2num(cmdbuf);
+			if ( KernFileSize > 0 && KernFileSize<OffsetFromMemoryEnd_MB) {
 				break;
 			} else {
-				cprintf("\tERROR: Logic sector number does not exist!\n");
+				cprintf("\tERROR: File size should be between 1 and %d MB!\n", OffsetFromMemoryEnd_MB);
 				continue;
 			}//if...else
 		}//if
 	}//while
 
 	KernFileSize *= 0x800;			// Turn into sector unit.
-
-#ifdef __MONITOR_DEBUG__
-	cprintf("\tKernFileSize=%ld (sectors), NrStartSector=%ld\n", KernFileSize, NrStartSector);
-	cprintf("\tKernFileBaseAddr=0x%08x\n", KernFileBaseAddr);
-#endif
-
-	LoadFile(NrStartSector, KernFileBaseAddr, KernFileSize);
+	if ( !LoadFile(NrStartSector, KernFileBaseAddr, KernFileSize) ) {
+		cprintf("\tERROR: Load kernel file failed!\n");
+	}//if
 
 	return 0;
 }//mon_LoadKernel()
@@ -384,7 +405,10 @@ mon_HDRead (int argc, char **argv, struct Trapframe *tf)
 
 	start_sector = str2num(argv[1]);
 	
-	hd_rw(HD_READ, hdbuf, start_sector, 1);
+	// Show what is on the disk, not a cached copy.
+	if ( !bc_read_uncached(hdbuf, start_sector, 1) ) {
+		return 0;
+	}//if
 	
 	output_buf(hdbuf, SECTOR_SIZE);
 	
@@ -392,6 +416,176 @@ mon_HDRead (int argc, char **argv, struct Trapframe *tf)
 }//mon_GetHDDInfo()
 
 
+
+int 
+mon_HDMode (int argc, char **argv, struct Trapframe *tf)
+{
+	if ( argc == 2 ) {
+		int 	mode;
+
+		for ( mode = HD_MODE_AUTO; mode <= HD_MODE_PIO; mode++ ) {
+			if ( !strcmp(argv[1], hd_mode_name(mode)) )
+				break;
+		}//for
+		if ( mode > HD_MODE_PIO || !hd_set_mode(mode) ) {
+			cprintf("\tERROR: Transfer mode '%s' is not available!\n", argv[1]);
+		}//if
+	}//if
+
+	cprintf("\tTransfer mode: %s\n", hd_mode_name(hd_get_mode()));
+	return 0;
+}//mon_HDMode()
+
+
+
+#define 	HDBENCH_DEFAULT_SECTORS 	2048 		// 1MB
+#define 	HDBENCH_BUF_SECTORS 		DMA_MAX_SECTORS
+
+// Position dependent checksum, so that sectors landing in the wrong place show up too.
+static uint32_t 
+hdbench_sum ( uint32_t sum, const uint8_t *buf, uint32_t len )
+{
+	const uint32_t 	*p = (const uint32_t *)buf;
+
+	for ( uint32_t i = 0; i < len / 4; i++ ) {
+		sum = ((sum << 5) | (sum >> 27)) ^ p[i];
+	}//for
+	return sum;
+}//hdbench_sum()
+
+int 
+mon_HDBench (int argc, char **argv, struct Trapframe *tf)
+{
+	static uint8_t 	benchbuf[HDBENCH_BUF_SECTORS * SECTOR_SIZE] __attribute__((aligned(SECTOR_SIZE)));
+	uint64_t 		start_sector;
+	uint32_t 		nr_sectors = HDBENCH_DEFAULT_SECTORS;
+	uint32_t 		ref_sum = 0;
+	int 				saved_mode = hd_get_requested_mode();
+	int 				ref_mode = HD_MODE_AUTO, failed = 0;
+
+	if ( argc < 2 || argc > 3 ) { 		// Argument arbitration
+		cprintf("\tUsage: hdbench <start sector> [number of sectors]\n");
+		return 0;
+	}//if
+
+	start_sector = str2num(argv[1]);
+	if ( argc == 3 ) {
+		nr_sectors = str2num(argv[2]);
+	}//if
+
+	cprintf("\tReading %u sectors from sector %llu\n", nr_sectors, start_sector);
+	for ( int mode = HD_MODE_DMA; mode <= HD_MODE_PIO; mode++ ) {
+		uint64_t 	tsc_start, cycles = 0;
+		uint32_t 	done, sum = 0;
+
+		if ( !hd_set_mode(mode) ) {
+			cprintf("\t%-6s: not available\n", hd_mode_name(mode));
+			continue;
+		}//if
+
+		// Only the transfers are timed, not the checksum.
+		for ( done = 0; done < nr_sectors; done += HDBENCH_BUF_SECTORS ) {
+			uint32_t 	n = nr_sectors - done;
+			if ( n > HDBENCH_BUF_SECTORS ) {
+				n = HDBENCH_BUF_SECTORS;
+			}//if
+			tsc_start = read_tsc();
+			if ( !hd_rw(HD_READ, benchbuf, start_sector + done, n) ) {
+				break;
+			}//if
+			cycles += read_tsc() - tsc_start;
+			sum = hdbench_sum(sum, benchbuf, n * SECTOR_SIZE);
+		}//for
+		if ( done < nr_sectors ) {
+			cprintf("\t%-6s: read failed at sector %llu\n", hd_mode_name(mode), start_sector + done);
+			failed = 1;
+			continue;
+		}//if
+
+		cprintf("\t%-6s: %llu cycles, %llu cycles/sector, sum %08x\n", hd_mode_name(mode), cycles, 
+				nr_sectors ? cycles / nr_sectors : 0, sum);
+		if ( ref_mode == HD_MODE_AUTO ) {
+			ref_mode = mode;
+			ref_sum = sum;
+		} else if ( sum != ref_sum ) {
+			cprintf("\t%-6s: data differs from %s!\n", hd_mode_name(mode), hd_mode_name(ref_mode));
+			failed = 1;
+		}//if
+	}//for
+
+	hd_set_mode(saved_mode);
+	cprintf("hdbench: %s\n", failed ? "FAILED" : "ok");
+	return 0;
+}//mon_HDBench()
+
+
+
+int 
+mon_BCache (int argc, char **argv, struct Trapframe *tf)
+{
+	struct bcache_stats 	stats;
+	u32 						reads, writes;
+
+	if ( argc == 2 ) {
+		if ( !strcmp(argv[1], "flush") ) {
+			if ( !bc_flush() )
+				cprintf("\tERROR: Block cache flush failed!\n");
+		} else if ( !strcmp(argv[1], "drop") ) {
+			if ( !bc_invalidate() )
+				cprintf("\tERROR: Block cache flush failed, nothing dropped!\n");
+		} else if ( !strcmp(argv[1], "reset") ) {
+			bc_reset_stats();
+		} else {
+			cprintf("\tERROR: Unknown option '%s'!\n", argv[1]);
+			return 0;
+		}//if...else
+	}//if
+
+	bc_get_stats(&stats);
+	reads = stats.read_hits + stats.read_misses;
+	writes = stats.write_hits + stats.write_misses;
+	cprintf("\tRead hits: %u  Misses: %u  Hit rate: %u%%\n", stats.read_hits, stats.read_misses, 
+			reads ? stats.read_hits * 100 / reads : 0);
+	cprintf("\tWrite hits: %u  Misses: %u  Hit rate: %u%%\n", stats.write_hits, stats.write_misses, 
+			writes ? stats.write_hits * 100 / writes : 0);
+	cprintf("\tRead-ahead: %u blocks, %u used\n", stats.readahead, stats.readahead_hits);
+	cprintf("\tWrite-backs: %u  Evictions: %u  Bypassed requests: %u\n", 
+			stats.writebacks, stats.evictions, stats.bypass);
+	return 0;
+}//mon_BCache()
+
+
+
+int
+mon_IOLog (int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t 	port, count = 1;
+	bool 		enable;
+
+	if ( argc != 3 && argc != 4 ) {
+		cprintf("Usage: iolog <port> [count] on|off\n");
+		return 0;
+	}//if
+
+	port = strtol(argv[1], 0, 0);
+	if ( argc == 4 ) {
+		count = strtol(argv[2], 0, 0);
+	}//if
+	if ( !strcmp(argv[argc - 1], "on") ) {
+		enable = TRUE;
+	} else if ( !strcmp(argv[argc - 1], "off") ) {
+		enable = FALSE;
+	} else {
+		cprintf("\tERROR: Unknown option '%s'!\n", argv[argc - 1]);
+		return 0;
+	}//if...else
+
+	if ( !ZVM_SUCCESS(IoSetPortLogging(port, count, enable)) ) {
+		cprintf("\tERROR: Invalid port range 0x%x+%u!\n", port, count);
+	}//if
+	return 0;
+}//mon_IOLog()
+
 static int runcmd(char *buf, struct Trapframe *tf)
 {
 	int argc;
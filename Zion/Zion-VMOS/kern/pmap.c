@@ -6,6 +6,7 @@
 #include <inc/kern/pmap.h>
 //#include <inc/kern/kclock.h>
 #include <inc/hardcoding_param.h>
+#include <inc/kern/boottime.h>
 
 // These variables are set by i386_mem_detect()
 size_t npages;			// Amount of physical memory (in pages)
@@ -97,11 +98,13 @@ mem_init ( void )
 	//
 	pages = (Page *)boot_alloc(npages * sizeof(struct Page));
 	memset(pages, 0, npages * sizeof(struct Page));
+	boot_phase(BOOT_PHASE_MEM_DETECT);
 	
 	// Now that we've allocated the 'pages' array, initialize it
 	// by putting all free physical pages onto a list.  After this point,
 	// all further memory management will go through the page_* functions.
 	page_init();
+	boot_phase(BOOT_PHASE_PAGE_INIT);
 
 	// Allocate the kernel's initial page directory, 'kern_pgdir'.
 	// This starts out empty (all zeros).  Any virtual
@@ -176,6 +179,7 @@ mem_init ( void )
 
 	// Flush the TLB for good measure, to kill the kern_pgdir[0] mapping.
 	lcr3(PADDR(kern_pgdir));
+	boot_phase(BOOT_PHASE_PAGING);
 }//mem_init()
 
 
@@ -144,11 +144,9 @@ void
 trap(struct Trapframe *tf)
 {
 	// Dispatch based on what type of trap occurred
-	cprintf("TEST trapping %d!\n", tf->tf_trapno);
 	switch (tf->tf_trapno) {
 		case T_DEBUG:
 		case T_BRKPT:
-			cprintf("TEST:int3 trapped\n");
 			dbg_break(tf);
 			break;
 		default:
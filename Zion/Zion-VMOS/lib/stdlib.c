@@ -67,11 +67,25 @@ memicmp ( void const *buf1, void const *buf2, unsigned int count )
 void * 
 memset ( void *v, int c, size_t n )
 {
-	char *p = (char *) v;
-	int m = n;
-
-	while (--m >= 0)
-		*p++ = c;
+	uint32_t 	d0, d1;
+
+	if ( n == 0 )
+		return v;
+
+	// Use string stores, dword at a time when the region allows it.
+	if ( (uint32_t)v % 4 == 0 && n % 4 == 0 ) {
+		c &= 0xFF;
+		c = (c << 24) | (c << 16) | (c << 8) | c;
+		__asm __volatile("cld; rep stosl"
+				 : "=&D" (d0), "=&c" (d1)
+				 : "0" (v), "a" (c), "1" (n / 4)
+				 : "cc", "memory");
+	} else {
+		__asm __volatile("cld; rep stosb"
+				 : "=&D" (d0), "=&c" (d1)
+				 : "0" (v), "a" (c), "1" (n)
+				 : "cc", "memory");
+	}//if...else
 	return v;
 }//memset()
 
@@ -82,15 +96,33 @@ memmove ( void *dst, const void *src, size_t n )
 {
 	const char *s = (const char *) src;
 	char *d = (char *) dst;
+	uint32_t 	d0, d1, d2;
 
 	if (s < d && s + n > d) {
 		s += n;
 		d += n;
-		while (n-- > 0)
-			*--d = *--s;
-	} else
-		while (n-- > 0)
-			*d++ = *s++;
+		if ( (uint32_t)s % 4 == 0 && (uint32_t)d % 4 == 0 && n % 4 == 0 )
+			__asm __volatile("std; rep movsl; cld"
+				 : "=&D" (d0), "=&S" (d1), "=&c" (d2)
+				 : "0" (d - 4), "1" (s - 4), "2" (n / 4)
+				 : "cc", "memory");
+		else
+			__asm __volatile("std; rep movsb; cld"
+				 : "=&D" (d0), "=&S" (d1), "=&c" (d2)
+				 : "0" (d - 1), "1" (s - 1), "2" (n)
+				 : "cc", "memory");
+	} else {
+		if ( (uint32_t)s % 4 == 0 && (uint32_t)d % 4 == 0 && n % 4 == 0 )
+			__asm __volatile("cld; rep movsl"
+				 : "=&D" (d0), "=&S" (d1), "=&c" (d2)
+				 : "0" (d), "1" (s), "2" (n / 4)
+				 : "cc", "memory");
+		else
+			__asm __volatile("cld; rep movsb"
+				 : "=&D" (d0), "=&S" (d1), "=&c" (d2)
+				 : "0" (d), "1" (s), "2" (n)
+				 : "cc", "memory");
+	}//if...else
 
 	return dst;
 }//memmove()
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Boot the disk image headless under QEMU several times and print the median
+# of every boot phase the kernel reports on the serial port (see
+# kern/boottime.c).
+#
+# Usage: tools/bootbench.sh [runs] [image]
+#
+# QEMU and QEMU_FLAGS can be set in the environment, e.g.
+# QEMU_FLAGS=-enable-kvm. Each boot is given TIMEOUT seconds (default 30).
+
+RUNS=${1:-10}
+IMAGE=${2:-VirtualDisk.img}
+QEMU=${QEMU:-qemu-system-i386}
+TIMEOUT=${TIMEOUT:-30}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+run=1
+while [ $run -le $RUNS ]; do
+	log="$TMP/run$run"
+	: > "$log"
+	$QEMU -hda "$IMAGE" -snapshot -display none -no-reboot \
+		-serial file:"$log" $QEMU_FLAGS &
+	pid=$!
+
+	# The kernel drops into the monitor after the report, so stop QEMU as
+	# soon as the "total" line shows up.
+	waited=0
+	while ! grep -q '^boot-phase: total' "$log" 2>/dev/null; do
+		if [ $waited -ge $((TIMEOUT * 10)) ] || ! kill -0 $pid 2>/dev/null; then
+			echo "run $run: no boot report within ${TIMEOUT}s" >&2
+			break
+		fi
+		sleep 0.1
+		waited=$((waited + 1))
+	done
+	kill $pid 2>/dev/null
+	wait $pid 2>/dev/null
+
+	grep '^boot-phase:' "$log" | tr -d '\r' >> "$TMP/all"
+	run=$((run + 1))
+done
+
+if [ ! -s "$TMP/all" ]; then
+	echo "no boot-phase data collected" >&2
+	exit 1
+fi
+
+# Phases in the order they first appear, median of the per-phase cycles.
+printf '%-14s %14s %14s  (median of %d runs, TSC cycles)\n' phase cycles cumulative $RUNS
+awk '{ print $2 }' "$TMP/all" | awk '!seen[$0]++' | while read phase; do
+	for col in 3 4; do
+		awk -v p="$phase" -v c=$col '$2 == p { print $c }' "$TMP/all" | sort -n > "$TMP/v$col"
+	done
+	n=$(wc -l < "$TMP/v3")
+	mid=$(( (n + 1) / 2 ))
+	printf '%-14s %14s %14s\n' "$phase" "$(sed -n "${mid}p" "$TMP/v3")" "$(sed -n "${mid}p" "$TMP/v4")"
+done
@@ -0,0 +1,211 @@
+/*
+ * disasmtest - host check of the disassembler command index.
+ *
+ * Runs on the build host (Linux), see "make check". kern/disasm.c is built
+ * into this program as it is, and every command is decoded twice: through
+ * the index Disasminit() builds and through the linear scan of cmddata[] the
+ * index replaced. Both must give the same t_disasm in every mode and with
+ * every option set, and Disasmlength() must return the size Disasm() does in
+ * mode DISASM_SIZE.
+ *
+ * Usage:	disasmtest [commands]	(default 300000 random byte sequences)
+ *
+ * The kernel's own lib/ is written for i386 varargs, so the few library
+ * functions the disassembler needs are forwarded to the host C library below.
+ */
+
+#include "../kern/disasm.c"
+
+extern "C" int vprintf(const char *fmt, __builtin_va_list ap);
+extern "C" int vsnprintf(char *str, unsigned long size, const char *fmt, __builtin_va_list ap);
+
+int cprintf(const char *fmt, ...)
+{
+	__builtin_va_list ap;
+	int n;
+
+	__builtin_va_start(ap, fmt);
+	n = vprintf(fmt, ap);
+	__builtin_va_end(ap);
+	return n;
+}
+
+int snprintf(char *str, int size, const char *fmt, ...)
+{
+	__builtin_va_list ap;
+	int n;
+
+	__builtin_va_start(ap, fmt);
+	n = vsnprintf(str, size, fmt, ap);
+	__builtin_va_end(ap);
+	return n;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+
+	while (n--)
+		*d++ = *s++;
+	return dst;
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+	char *d = (char *)dst;
+
+	while (n--)
+		*d++ = (char)c;
+	return dst;
+}
+
+int memicmp(const void *a, const void *b, size_t n)
+{
+	const uchar *p = (const uchar *)a, *q = (const uchar *)b;
+
+	for (; n; n--, p++, q++) {
+		int x = (*p >= 'A' && *p <= 'Z') ? *p + 'a' - 'A' : *p;
+		int y = (*q >= 'A' && *q <= 'Z') ? *q + 'a' - 'A' : *q;
+		if (x != y)
+			return x - y;
+	}
+	return 0;
+}
+
+int memcmp(const void *a, const void *b, size_t n)
+{
+	const uchar *p = (const uchar *)a, *q = (const uchar *)b;
+
+	for (; n; n--, p++, q++)
+		if (*p != *q)
+			return *p - *q;
+	return 0;
+}
+
+char *strcpy(char *dst, const char *src)
+{
+	char *d = dst;
+
+	while ((*d++ = *src++) != '\0')
+		;
+	return dst;
+}
+
+int strlen(const char *s)
+{
+	int n = 0;
+
+	while (s[n] != '\0')
+		n++;
+	return n;
+}
+
+char *strcat(char *dst, const char *src)
+{
+	strcpy(dst + strlen(dst), src);
+	return dst;
+}
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t xorshift(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* Bytes that lead to more than one table: prefixes, 0F escapes, FPU, groups. */
+static const uchar leaders[] = {
+	0x0F, 0x0F, 0x0F, 0x66, 0xF2, 0xF3, 0xF0, 0x2E, 0x67,
+	0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
+	0x80, 0x81, 0x83, 0xC0, 0xC1, 0xD1, 0xD3, 0xF6, 0xF7, 0xFE, 0xFF, 0xCD,
+};
+
+static void fill(uchar *buf)
+{
+	int i, lead = xorshift() % 4;
+
+	for (i = 0; i < MAXCMDSIZE + 8; i++)
+		buf[i] = (uchar)xorshift();
+	for (i = 0; i < lead; i++)
+		buf[i] = leaders[xorshift() % sizeof(leaders)];
+}
+
+static t_disasmopt options[3];
+
+static void setup_options(void)
+{
+	memset(options, 0, sizeof(options));
+	options[1].lowercase = 1;
+	options[1].tabarguments = 1;
+	options[1].shownear = 1;
+	options[1].showmemsize = 1;
+	options[1].shortstringcmds = 1;
+	options[1].decodevxd = 1;
+	options[2].ideal = 1;
+	options[2].putdefseg = 1;
+	options[2].extraspace = 1;
+	options[2].sizesens = 2;
+	options[2].privileged = 1;
+	options[2].iocommand = 1;
+	options[2].farcalls = 1;
+	options[2].extraprefix = 1;
+}
+
+int main(int argc, char **argv)
+{
+	static const int modes[] = { DISASM_SIZE, DISASM_DATA, DISASM_FILE, DISASM_CODE };
+	long commands = 300000;
+	long n, failures = 0, decoded = 0;
+	uchar buf[MAXCMDSIZE + 8];	/* ulong reads 8 bytes on the host */
+	t_disasm indexed, linear;
+
+	if (argc > 1)
+		for (commands = 0; *argv[1] >= '0' && *argv[1] <= '9'; argv[1]++)
+			commands = commands * 10 + *argv[1] - '0';
+	setup_options();
+	Disasminit();
+	if (cmdindex <= 0) {
+		cprintf("disasmtest: command index was not built\n");
+		return 1;
+	}
+
+	for (n = 0; n < commands; n++) {
+		unsigned m, o;
+
+		fill(buf);
+		for (o = 0; o < sizeof(options) / sizeof(options[0]); o++) {
+			for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+				ulong a, b, len;
+
+				memset(&indexed, 0, sizeof(indexed));
+				memset(&linear, 0, sizeof(linear));
+				cmdindex = 1;
+				a = Disasm((char *)buf, MAXCMDSIZE, 0x401000, &indexed, modes[m], &options[o]);
+				cmdindex = -1;
+				b = Disasm((char *)buf, MAXCMDSIZE, 0x401000, &linear, modes[m], &options[o]);
+				cmdindex = 1;
+				decoded += 2;
+
+				if (a != b || memcmp(&indexed, &linear, sizeof(indexed)) != 0) {
+					if (failures++ < 10)
+						cprintf("index differs from scan: %02x %02x %02x %02x, mode %d, options %u: "
+							"%lu \"%s\" vs %lu \"%s\"\n", buf[0], buf[1], buf[2], buf[3],
+							modes[m], o, a, indexed.result, b, linear.result);
+				}
+				if (modes[m] == DISASM_SIZE &&
+				    (len = Disasmlength((char *)buf, MAXCMDSIZE, &options[o])) != a) {
+					if (failures++ < 10)
+						cprintf("Disasmlength() differs: %02x %02x %02x %02x, options %u: %lu vs %lu\n",
+							buf[0], buf[1], buf[2], buf[3], o, len, a);
+				}
+			}
+		}
+	}
+
+	cprintf("disasmtest: %ld commands, %ld decodes, %ld failures\n", commands, decoded, failures);
+	return failures != 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Boot the disk image headless under QEMU, run the monitor's hdbench command
+# and check that bus master DMA and both PIO modes read the same sectors (see
+# mon_HDBench()). The cycles of every mode are printed as the monitor reports
+# them.
+#
+# Usage: tools/hdbench.sh [sector] [count] [image]
+#
+# QEMU and QEMU_FLAGS can be set in the environment as for bootbench.sh; the
+# default i440FX machine has the PIIX3 bus master the driver looks for. The
+# monitor only reads the keyboard, so the command is typed with the QEMU
+# monitor's sendkey. Bochs can't be scripted that way: there, type hdbench at
+# the Zion:> prompt, with "pci: enabled=1, chipset=i440fx" in bochsrc.
+#
+# Exit status is 0 when DMA was available and every mode read the same data.
+
+SECTOR=${1:-0}
+COUNT=${2:-2048}
+IMAGE=${3:-VirtualDisk.img}
+QEMU=${QEMU:-qemu-system-i386}
+TIMEOUT=${TIMEOUT:-60}
+
+TMP=$(mktemp -d) || exit 1
+trap 'kill $pid 2>/dev/null; rm -rf "$TMP"' EXIT
+
+# Wait until the serial log has a line matching $1.
+wait_for() {
+	waited=0
+	while ! grep -q "$1" "$TMP/log" 2>/dev/null; do
+		if [ $waited -ge $((TIMEOUT * 10)) ] || ! kill -0 $pid 2>/dev/null; then
+			echo "no '$1' on the serial port within ${TIMEOUT}s" >&2
+			exit 1
+		fi
+		sleep 0.1
+		waited=$((waited + 1))
+	done
+}
+
+mkfifo "$TMP/mon.in" "$TMP/mon.out" || exit 1
+: > "$TMP/log"
+$QEMU -hda "$IMAGE" -snapshot -display none -no-reboot \
+	-serial file:"$TMP/log" -monitor pipe:"$TMP/mon" $QEMU_FLAGS &
+pid=$!
+cat "$TMP/mon.out" > /dev/null &
+exec 3> "$TMP/mon.in"
+
+wait_for 'Zion:>'
+echo "hdbench $SECTOR $COUNT" | fold -w1 | while IFS= read -r c; do
+	case "$c" in
+	" ")	echo "sendkey spc" ;;
+	*)	echo "sendkey $c" ;;
+	esac
+done >&3
+echo "sendkey ret" >&3
+
+wait_for '^hdbench: '
+tr -d '\r' < "$TMP/log" | sed -n '/Reading [0-9]* sectors/,/^hdbench: /p'
+
+tr -d '\r' < "$TMP/log" | grep -q 'dma *: .*cycles/sector' || {
+	echo "bus master DMA was not used" >&2
+	exit 1
+}
+tr -d '\r' < "$TMP/log" | grep -q '^hdbench: ok'
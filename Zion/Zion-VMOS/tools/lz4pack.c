@@ -0,0 +1,272 @@
+/*
+ * lz4pack - pack the Zion kernel image for the Seraph loader.
+ *
+ * Runs on the build host (Linux). The output is a 16-byte header followed by
+ * one raw LZ4 block (no frame format):
+ *
+ *	offset 0	magic		'Z' 'L' 'Z' '4'
+ *	offset 4	usize		size of the original image
+ *	offset 8	csize		size of the LZ4 block
+ *	offset 12	reserved	0
+ *
+ * All fields are little-endian. The layout is mirrored by
+ * Seraph/include/lz4.inc, keep both in sync.
+ *
+ * Usage:	lz4pack <in> <out>	pack (the result is verified before writing)
+ *		lz4pack -d <in> <out>	unpack
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define LZ4_IMAGE_MAGIC		0x345A4C5A	/* "ZLZ4" */
+#define LZ4_IMAGE_HDR_SIZE	16
+
+#define MINMATCH		4
+#define LASTLITERALS		5	/* last 5 bytes are always literals */
+#define MFLIMIT			12	/* last match starts 12 bytes before the end */
+#define MAX_DISTANCE		65535
+#define HASH_LOG		16
+
+static uint32_t
+hash4(const uint8_t *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t *
+put_len(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t *
+put_sequence(uint8_t *op, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen)
+{
+	uint8_t *token = op++;
+
+	*token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)		/* last sequence, literals only */
+		return op;
+
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	mlen -= MINMATCH;
+	*token |= (uint8_t)(mlen < 15 ? mlen : 15);
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+	return op;
+}
+
+/* Greedy LZ4 block compressor, dst must hold n + n / 255 + 16 bytes. */
+static size_t
+lz4_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+	static int32_t table[1 << HASH_LOG];
+	size_t ip = 0, anchor = 0;
+	uint8_t *op = dst;
+
+	memset(table, 0xff, sizeof(table));
+	while (ip + MFLIMIT < n) {
+		uint32_t h = hash4(src + ip);
+		int32_t ref = table[h];
+		size_t r, len;
+
+		table[h] = (int32_t)ip;
+		if (ref < 0 || ip - ref > MAX_DISTANCE || memcmp(src + ip, src + ref, MINMATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		r = ref;
+		while (ip > anchor && r > 0 && src[ip - 1] == src[r - 1]) {
+			ip--;
+			r--;
+		}
+		len = MINMATCH;
+		while (ip + len < n - LASTLITERALS && src[ip + len] == src[r + len])
+			len++;
+
+		op = put_sequence(op, src + anchor, ip - anchor, ip - r, len);
+		ip += len;
+		anchor = ip;
+		if (ip + MFLIMIT < n)
+			table[hash4(src + ip - 2)] = (int32_t)(ip - 2);
+	}
+	op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+	return op - dst;
+}
+
+/* Same algorithm as LZ4Decompress in Seraph's loader, plus bounds checks.
+ * Returns the output size, or -1 if the block is malformed. */
+static long
+lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + n;
+	uint8_t *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t len = token >> 4, offset;
+		const uint8_t *ref;
+
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		if (ip >= iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return -1;
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		len += MINMATCH;
+		if (len > (size_t)(oend - op))
+			return -1;
+		for (ref = op - offset; len; len--)	/* may overlap */
+			*op++ = *ref++;
+	}
+	return op - dst;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t *
+read_file(const char *name, size_t *size)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *buf;
+	long n;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0) {
+		perror(name);
+		exit(1);
+	}
+	rewind(f);
+	buf = malloc(n ? n : 1);
+	if (buf == NULL || fread(buf, 1, n, f) != (size_t)n) {
+		perror(name);
+		exit(1);
+	}
+	fclose(f);
+	*size = n;
+	return buf;
+}
+
+static void
+write_file(const char *name, const uint8_t *buf, size_t size)
+{
+	FILE *f = fopen(name, "wb");
+
+	if (f == NULL || fwrite(buf, 1, size, f) != size || fclose(f) != 0) {
+		perror(name);
+		exit(1);
+	}
+}
+
+static int
+pack(const char *in, const char *out)
+{
+	size_t usize, csize;
+	uint8_t *src = read_file(in, &usize), *dst, *check;
+
+	dst = malloc(LZ4_IMAGE_HDR_SIZE + usize + usize / 255 + 16);
+	check = malloc(usize ? usize : 1);
+	if (dst == NULL || check == NULL) {
+		fprintf(stderr, "lz4pack: out of memory\n");
+		return 1;
+	}
+	csize = lz4_compress(src, usize, dst + LZ4_IMAGE_HDR_SIZE);
+	if (lz4_decompress(dst + LZ4_IMAGE_HDR_SIZE, csize, check, usize) != (long)usize ||
+	    memcmp(src, check, usize) != 0) {
+		fprintf(stderr, "lz4pack: %s: verification failed\n", in);
+		return 1;
+	}
+
+	put32(dst, LZ4_IMAGE_MAGIC);
+	put32(dst + 4, usize);
+	put32(dst + 8, csize);
+	put32(dst + 12, 0);
+	write_file(out, dst, LZ4_IMAGE_HDR_SIZE + csize);
+	printf("lz4pack: %s: %zu -> %zu bytes (%zu -> %zu sectors)\n", in, usize,
+	       LZ4_IMAGE_HDR_SIZE + csize, (usize + 511) / 512,
+	       (LZ4_IMAGE_HDR_SIZE + csize + 511) / 512);
+	return 0;
+}
+
+static int
+unpack(const char *in, const char *out)
+{
+	size_t size, usize, csize;
+	uint8_t *src = read_file(in, &size), *dst;
+
+	if (size < LZ4_IMAGE_HDR_SIZE || get32(src) != LZ4_IMAGE_MAGIC) {
+		fprintf(stderr, "lz4pack: %s: not a packed image\n", in);
+		return 1;
+	}
+	usize = get32(src + 4);
+	csize = get32(src + 8);
+	dst = malloc(usize ? usize : 1);
+	if (dst == NULL || csize > size - LZ4_IMAGE_HDR_SIZE ||
+	    lz4_decompress(src + LZ4_IMAGE_HDR_SIZE, csize, dst, usize) != (long)usize) {
+		fprintf(stderr, "lz4pack: %s: corrupt image\n", in);
+		return 1;
+	}
+	write_file(out, dst, usize);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc == 4 && strcmp(argv[1], "-d") == 0)
+		return unpack(argv[2], argv[3]);
+	if (argc == 3)
+		return pack(argv[1], argv[2]);
+	fprintf(stderr, "usage: lz4pack [-d] <in> <out>\n");
+	return 1;
+}
@@ -2,7 +2,6 @@
 #include <inc/vmx/hvm.h>
 
 
-extern ZVMSTATUS HvmSubvertCpu(void * GuestRsp);
 //+++++++++++++++Public Function+++++++++++++++++++++++++++++++++
 /**
  * effects:To see if the indicated bit is set or not.
@@ -101,50 +100,7 @@ ZVMSTATUS ZVMAPI CmInitializeSegmentSelector (
 
 
 //+++++++++++++++++++++++asm volatile Function++++++++++++++++++++++++++++++++
-/**
-//effect: call HvmSubvertCpu to setup VM
-**/
-ZVMSTATUS ZVMAPI CmSubvert (void *
-)
-{
-	uint32_t esp =0 ;
-	
-	//CM_SAVE_ALL_NOSEGREGS
-	asm volatile("pushl %edi");
-	asm volatile("pushl %esi");
-	asm volatile("pushl %ebp");
-	asm volatile("pushl %ebp");
-	asm volatile("pushl %ebx");
-	asm volatile("pushl %edx");
-	asm volatile("pushl %ecx");
-	asm volatile("pushl %eax");
-	
-	//send args for HvmsubvertCpu
-	asm volatile("movl %%esp,%0":"=r"(esp));
-	
-	HvmSubvertCpu((void *)esp);
-	
-	return ZVMSUCCESS;
-}
-
-
-void CmSlipIntoMatrix()
-{
-	asm volatile("popl %ebp");
-		
-	asm volatile("popl %eax");
-	asm volatile("popl %ecx");
-	asm volatile("popl %edx");
-	asm volatile("popl %ebx");
-	asm volatile("popl %ebp");
-	asm volatile("popl %ebp");
-	asm volatile("popl %esi");
-	asm volatile("popl %edi");
-
-    //cprintf("pop done!\n");
-
-	asm volatile("addl $8,%esp");
-}
+// CmSubvert and CmSlipIntoMatrix are in vmx-asm.S
 
 void CmReloadGdtr(PSEGMENT_DESCRIPTOR gdtbase, uint8_t gdtlimit)
 {
@@ -485,7 +441,7 @@ void CmIOOutW(uint32_t port, uint32_t data)
 {
 	asm volatile("movl %0,%%eax"::"r"(data));
 	asm volatile("movl %0,%%edx"::"r"(port));
-	asm volatile("outb %al,%dx");
+	asm volatile("outw %ax,%dx");
 }
 
 //CmIOOutD PROC StdCall _Port,_Data
@@ -499,7 +455,7 @@ void CmIOOutD(uint32_t port, uint32_t data)
 {
 	asm volatile("movl %0,%%eax"::"r"(data));
 	asm volatile("movl %0,%%edx"::"r"(port));
-	asm volatile("outb %al,%dx");
+	asm volatile("outl %eax,%dx");
 } 
  
 //+++++++++++++++++++++++DDK Function+++++++++++++++++++++++++++++++
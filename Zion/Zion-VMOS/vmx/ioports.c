@@ -0,0 +1,497 @@
+#include <inc/arch/x86.h>
+#include <inc/vmx/ioports.h>
+#include <inc/lib/malloc.h>
+#include <inc/lib/stdio.h>
+#include <inc/lib/stdlib.h>
+#include <inc/trap.h>
+
+#define IO_QUAL_SIZE(q)		(((q) & 7) + 1)
+#define IO_QUAL_IN(q)		(((q) >> 3) & 1)
+#define IO_QUAL_STRING(q)	(((q) >> 4) & 1)
+#define IO_QUAL_REP(q)		(((q) >> 5) & 1)
+#define IO_QUAL_IMM(q)		(((q) >> 6) & 1)
+#define IO_QUAL_PORT(q)		(((q) >> 16) & 0xffff)
+
+#define IO_PAE_ADDR(e)		((e) & 0x000ffffffffff000ULL)
+
+// VM-entry interruption information for a hardware exception with an error code
+#define IO_INJECT_VALID		0x80000000
+#define IO_INJECT_HW_EXCEPTION	(3 << 8)
+#define IO_INJECT_ERROR_CODE	0x800
+
+//
+// Second-level pages are allocated on first registration and never freed,
+// so a lookup never has to take a lock.
+//
+static PIO_PORT_ENTRY IoPortDir[IO_PORT_DIR_SIZE];
+
+static PIO_PORT_ENTRY IoLookupPort (
+  uint32_t Port
+)
+{
+  PIO_PORT_ENTRY Page = IoPortDir[(Port >> 8) & 0xff];
+
+  return Page ? &Page[Port & 0xff] : NULL;
+}
+
+static PIO_PORT_ENTRY IoGetPortEntry (
+  uint32_t Port
+)
+{
+  PIO_PORT_ENTRY Page = IoPortDir[(Port >> 8) & 0xff];
+
+  if (!Page) {
+    Page = (PIO_PORT_ENTRY) MmAllocPages (BYTES_TO_PAGES (IO_PORT_PAGE_SIZE * sizeof (IO_PORT_ENTRY)), NULL);
+    if (!Page)
+      return NULL;
+    memset (Page, 0, IO_PORT_PAGE_SIZE * sizeof (IO_PORT_ENTRY));
+    IoPortDir[(Port >> 8) & 0xff] = Page;
+  }
+  return &Page[Port & 0xff];
+}
+
+ZVMSTATUS ZVMAPI IoRegisterPortHandler (
+  uint32_t FirstPort,
+  uint32_t Count,
+  IO_PORT_HANDLER Handler,
+  IO_PORT_STRING_HANDLER StringHandler,
+  void *Context
+)
+{
+  PIO_PORT_ENTRY Entry;
+  uint32_t Port;
+
+  if (!Handler || !Count || FirstPort + Count > 0x10000)
+    return ZVM_INVALID_PARAMETER;
+
+  for (Port = FirstPort; Port < FirstPort + Count; Port++) {
+    if (!(Entry = IoGetPortEntry (Port))) {
+      cprintf ("IoRegisterPortHandler(): Failed to allocate the table page for port 0x%x\n", Port);
+      return ZVM_UNSUCCESSFUL;
+    }
+    Entry->Handler = Handler;
+    Entry->StringHandler = StringHandler;
+    Entry->Context = Context;
+  }
+  return ZVMSUCCESS;
+}
+
+ZVMSTATUS ZVMAPI IoDeregisterPortHandler (
+  uint32_t FirstPort,
+  uint32_t Count
+)
+{
+  PIO_PORT_ENTRY Entry;
+  uint32_t Port;
+
+  if (!Count || FirstPort + Count > 0x10000)
+    return ZVM_INVALID_PARAMETER;
+
+  for (Port = FirstPort; Port < FirstPort + Count; Port++) {
+    if (!(Entry = IoLookupPort (Port)))
+      continue;
+    Entry->Handler = NULL;
+    Entry->StringHandler = NULL;
+    Entry->Context = NULL;
+  }
+  return ZVMSUCCESS;
+}
+
+ZVMSTATUS ZVMAPI IoSetPortLogging (
+  uint32_t FirstPort,
+  uint32_t Count,
+  bool Enable
+)
+{
+  PIO_PORT_ENTRY Entry;
+  uint32_t Port;
+
+  if (!Count || FirstPort + Count > 0x10000)
+    return ZVM_INVALID_PARAMETER;
+
+  for (Port = FirstPort; Port < FirstPort + Count; Port++) {
+    if (!Enable) {
+      if ((Entry = IoLookupPort (Port)))
+        Entry->Flags &= ~IO_PORT_LOG;
+      continue;
+    }
+    if (!(Entry = IoGetPortEntry (Port)))
+      return ZVM_UNSUCCESSFUL;
+    Entry->Flags |= IO_PORT_LOG;
+  }
+  return ZVMSUCCESS;
+}
+
+bool ZVMAPI IoIsPortLogged (
+  uint32_t Port
+)
+{
+  PIO_PORT_ENTRY Entry = IoLookupPort (Port);
+
+  return Entry && (Entry->Flags & IO_PORT_LOG);
+}
+
+static uint32_t IoPortRead (
+  uint32_t Port,
+  uint32_t Size
+)
+{
+  switch (Size) {
+  case 1:
+    return inb (Port);
+  case 2:
+    return inw (Port);
+  default:
+    return inl (Port);
+  }
+}
+
+static void IoPortWrite (
+  uint32_t Port,
+  uint32_t Size,
+  uint32_t Value
+)
+{
+  switch (Size) {
+  case 1:
+    outb (Port, (uint8_t) Value);
+    break;
+  case 2:
+    outw (Port, (uint16_t) Value);
+    break;
+  default:
+    outl (Port, Value);
+    break;
+  }
+}
+
+static uint32_t IoGuestToHostPae (
+  uint32_t Linear,
+  uint8_t ** Host
+)
+{
+  uint64_t Pdpte, Pde, Pte;
+
+  Pdpte = ((uint64_t *) (VmxRead (GUEST_CR3) & ~0x1f))[Linear >> 30];
+  if (!(Pdpte & P_PRESENT) || (IO_PAE_ADDR (Pdpte) >> 32))
+    return 0;
+
+  Pde = ((uint64_t *) (uint32_t) IO_PAE_ADDR (Pdpte))[(Linear >> 21) & 0x1ff];
+  if (!(Pde & P_PRESENT) || (IO_PAE_ADDR (Pde) >> 32))
+    return 0;
+  if (Pde & P_LARGE) {
+    *Host = (uint8_t *) (((uint32_t) IO_PAE_ADDR (Pde) & 0xffe00000) | (Linear & 0x1fffff));
+    return 0x200000 - (Linear & 0x1fffff);
+  }
+
+  Pte = ((uint64_t *) (uint32_t) IO_PAE_ADDR (Pde))[(Linear >> 12) & 0x1ff];
+  if (!(Pte & P_PRESENT) || (IO_PAE_ADDR (Pte) >> 32))
+    return 0;
+  *Host = (uint8_t *) ((uint32_t) IO_PAE_ADDR (Pte) | (Linear & (PGSIZE - 1)));
+  return PGSIZE - (Linear & (PGSIZE - 1));
+}
+
+//
+// Translate a guest linear address to a host pointer. Guest physical memory
+// is identity mapped in the host, so only the guest's own page tables need to
+// be walked, 2-level or PAE. Returns the number of bytes left in that guest
+// page, 0 if the address is not mapped. PAE pages above 4GB count as not
+// mapped, the host cannot reach them.
+//
+static uint32_t IoGuestToHost (
+  uint32_t Linear,
+  uint8_t ** Host
+)
+{
+  uint32_t Pde, Pte;
+
+  if (!(VmxRead (GUEST_CR0) & X86_CR0_PG)) {
+    *Host = (uint8_t *) Linear;
+    return PGSIZE - (Linear & (PGSIZE - 1));
+  }
+  if (VmxRead (GUEST_CR4) & X86_CR4_PAE)
+    return IoGuestToHostPae (Linear, Host);
+
+  Pde = ((uint32_t *) (VmxRead (GUEST_CR3) & ~(PGSIZE - 1)))[Linear >> 22];
+  if (!(Pde & P_PRESENT))
+    return 0;
+  if ((Pde & P_LARGE) && (VmxRead (GUEST_CR4) & X86_CR4_PSE)) {
+    *Host = (uint8_t *) ((Pde & 0xffc00000) | (Linear & 0x3fffff));
+    return 0x400000 - (Linear & 0x3fffff);
+  }
+
+  Pte = ((uint32_t *) (Pde & ~(PGSIZE - 1)))[(Linear >> 12) & 0x3ff];
+  if (!(Pte & P_PRESENT))
+    return 0;
+  *Host = (uint8_t *) ((Pte & ~(PGSIZE - 1)) | (Linear & (PGSIZE - 1)));
+  return PGSIZE - (Linear & (PGSIZE - 1));
+}
+
+//
+// Check that every byte of an element is mapped, before the port is touched.
+// Returns FALSE with the first unmapped address in Fault.
+//
+static bool IoProbeGuestElement (
+  uint32_t Linear,
+  uint32_t Size,
+  uint32_t * Fault
+)
+{
+  uint8_t *Host;
+  uint32_t i;
+
+  for (i = 0; i < Size; i++) {
+    if (!IoGuestToHost (Linear + i, &Host)) {
+      *Fault = Linear + i;
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+//
+// Raise the #PF the guest would have taken at Fault, so that its own handler
+// maps the page and the instruction is restarted. CR2 is not switched by VMX,
+// so the host's CR2 is the one the guest sees.
+//
+static void IoInjectPageFault (
+  uint32_t Fault,
+  bool Write
+)
+{
+  uint32_t ErrorCode = 0;
+
+  if (Write)
+    ErrorCode |= FEC_WR;
+  if ((VmxRead (GUEST_CS_SELECTOR) & 3) == 3)
+    ErrorCode |= FEC_U;
+
+  lcr2 (Fault);
+  VmxWrite (VM_ENTRY_EXCEPTION_ERROR_CODE, ErrorCode);
+  VmxWrite (VM_ENTRY_INTR_INFO_FIELD, IO_INJECT_VALID | IO_INJECT_HW_EXCEPTION | IO_INJECT_ERROR_CODE | T_PGFLT);
+}
+
+//
+// Copy one element between the guest and Value, byte by byte so that an
+// element straddling a page boundary still works.
+//
+static bool IoCopyGuestElement (
+  uint32_t Linear,
+  uint32_t Size,
+  uint32_t * Value,
+  bool ToGuest
+)
+{
+  uint8_t *Host;
+  uint32_t i;
+
+  for (i = 0; i < Size; i++) {
+    if (!IoGuestToHost (Linear + i, &Host))
+      return FALSE;
+    if (ToGuest)
+      *Host = ((uint8_t *) Value)[i];
+    else
+      ((uint8_t *) Value)[i] = *Host;
+  }
+  return TRUE;
+}
+
+static void IoAccessOne (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  PIO_PORT_ENTRY Entry,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  uint32_t * Value
+)
+{
+  if (!Entry || !Entry->Handler || !Entry->Handler (Cpu, GuestRegs, Port, Size, In, Value, Entry->Context)) {
+    if (In)
+      *Value = IoPortRead (Port, Size);
+    else
+      IoPortWrite (Port, Size, *Value);
+  }
+  if (Entry && (Entry->Flags & IO_PORT_LOG))
+    cprintf ("IO 0x%x %s 0x%x (%d)\n", Port, In ? "IN" : "OUT", *Value, Size);
+}
+
+//
+// Transfer up to Count elements of a forward string instruction within one
+// guest page. Returns the number of elements done.
+//
+static uint32_t IoAccessBlock (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  PIO_PORT_ENTRY Entry,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  uint8_t * Buffer,
+  uint32_t Count
+)
+{
+  uint32_t Done = 0, Value = 0;
+
+  if (Entry && Entry->StringHandler)
+    Done = Entry->StringHandler (Cpu, Port, Size, In, Buffer, Count, Entry->Context);
+
+  if (Entry && (Entry->Handler || (Entry->Flags & IO_PORT_LOG))) {
+    for (; Done < Count; Done++) {
+      if (!In)
+        memcpy (&Value, Buffer + Done * Size, Size);
+      IoAccessOne (Cpu, GuestRegs, Entry, Port, Size, In, &Value);
+      if (In)
+        memcpy (Buffer + Done * Size, &Value, Size);
+    }
+    return Done;
+  }
+
+  Buffer += Done * Size;
+  Count -= Done;
+  if (!Count)
+    return Done;
+
+  switch (Size) {
+  case 1:
+    if (In)
+      insb (Port, Buffer, Count);
+    else
+      outsb (Port, Buffer, Count);
+    break;
+  case 2:
+    if (In)
+      insw (Port, Buffer, Count);
+    else
+      outsw (Port, Buffer, Count);
+    break;
+  default:
+    if (In)
+      insl (Port, Buffer, Count);
+    else
+      outsl (Port, Buffer, Count);
+    break;
+  }
+  return Done + Count;
+}
+
+//
+// INS/OUTS, with or without REP. The whole count is transferred in this exit,
+// one guest page at a time. Returns FALSE if a guest page was not mapped, in
+// which case ECX/ESI/EDI reflect the progress and a #PF is injected for the
+// page; the instruction is restarted once the guest's handler has mapped it.
+//
+static bool IoDispatchString (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  PIO_PORT_ENTRY Entry,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  bool Rep
+)
+{
+  uint32_t Count, Done = 0, n, Avail, Value = 0;
+  uint32_t Linear, Fault;
+  int32_t Step;
+  uint8_t *Host;
+  bool Complete = TRUE;
+
+  Count = Rep ? GuestRegs->ecx : 1;
+  Linear = VmxRead (GUEST_LINEAR_ADDRESS);
+  Step = (VmxRead (GUEST_RFLAGS) & X86_EFLAGS_DF) ? -(int32_t) Size : (int32_t) Size;
+
+  while (Done < Count) {
+    n = 0;
+    if (Step > 0 && (Avail = IoGuestToHost (Linear, &Host)) >= Size) {
+      n = Avail / Size;
+      if (n > Count - Done)
+        n = Count - Done;
+      n = IoAccessBlock (Cpu, GuestRegs, Entry, Port, Size, In, Host, n);
+    } else {
+      // Backward or page-straddling element, probed first so that a fault
+      // does not lose an IN already done
+      if (!IoProbeGuestElement (Linear, Size, &Fault)) {
+        Complete = FALSE;
+        break;
+      }
+      if (!In)
+        IoCopyGuestElement (Linear, Size, &Value, FALSE);
+      IoAccessOne (Cpu, GuestRegs, Entry, Port, Size, In, &Value);
+      if (In)
+        IoCopyGuestElement (Linear, Size, &Value, TRUE);
+      n = 1;
+    }
+    if (!n) {
+      Fault = Linear;
+      Complete = FALSE;
+      break;
+    }
+    Linear += n * Step;
+    Done += n;
+  }
+
+  if (In)
+    GuestRegs->edi += Done * Step;
+  else
+    GuestRegs->esi += Done * Step;
+  if (Rep)
+    GuestRegs->ecx -= Done;
+
+  if (!Complete)
+    IoInjectPageFault (Fault, In);
+  return Complete;
+}
+
+// IN only writes AL/AX/EAX, the upper part of EAX is preserved
+static void IoSetEax (
+  PGUEST_REGS GuestRegs,
+  uint32_t Size,
+  uint32_t Value
+)
+{
+  if (Size == 4)
+    GuestRegs->eax = Value;
+  else if (Size == 2)
+    GuestRegs->eax = (GuestRegs->eax & 0xffff0000) | (Value & 0xffff);
+  else
+    GuestRegs->eax = (GuestRegs->eax & 0xffffff00) | (Value & 0xff);
+}
+
+/*
+ * Handle an I/O instruction exit. Returns TRUE if the instruction has been
+ * completed and RIP should move past it.
+ */
+bool ZVMAPI IoDispatchAccess (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  uint32_t ExitQualification
+)
+{
+  PIO_PORT_ENTRY Entry;
+  uint32_t Port, Size, Value;
+  bool In;
+
+  Port = IO_QUAL_IMM (ExitQualification) ? IO_QUAL_PORT (ExitQualification) : (GuestRegs->edx & 0xffff);
+  Size = IO_QUAL_SIZE (ExitQualification);
+  In = IO_QUAL_IN (ExitQualification);
+  Entry = IoLookupPort (Port);
+
+  if (IO_QUAL_STRING (ExitQualification))
+    return IoDispatchString (Cpu, GuestRegs, Entry, Port, Size, In, IO_QUAL_REP (ExitQualification));
+
+  // Unhandled, unlogged port: straight to the hardware
+  if (!Entry || (!Entry->Handler && !(Entry->Flags & IO_PORT_LOG))) {
+    if (In)
+      IoSetEax (GuestRegs, Size, IoPortRead (Port, Size));
+    else
+      IoPortWrite (Port, Size, GuestRegs->eax);
+    return TRUE;
+  }
+
+  Value = GuestRegs->eax;
+  IoAccessOne (Cpu, GuestRegs, Entry, Port, Size, In, &Value);
+  if (In)
+    IoSetEax (GuestRegs, Size, Value);
+  return TRUE;
+}
@@ -17,6 +17,7 @@
 #include <inc/vmx/vmxtraps.h>
 #include <inc/vmx/hvm.h>
 #include <inc/lib/malloc.h>
+#include <inc/assert.h>
 
 extern uint32_t HostCr3,guestcr3;
 
@@ -37,48 +38,20 @@ HVM_DEPENDENT Vmx = {
 uint32_t g_HostStackBaseAddress; 
 
 
-void VmxVmexitHandler()
-{		
-        PCPU Cpu;
-		PGUEST_REGS GuestRegs;
-		
-
-	    //HVM_SAVE_ALL_NOSEGREGS
-		
-
-	    asm volatile("pushl %edi");
-        asm volatile("pushl %esi");
-        asm volatile("pushl %ebp");
-        asm volatile("pushl %ebp");
-        asm volatile("pushl %ebx");
-        asm volatile("pushl %edx");
-        asm volatile("pushl %ecx");
-        asm volatile("pushl %eax");
-		
-		asm volatile("movl 0x2c(%%esp),%0":"=r"(Cpu));
-		asm volatile("movl %%esp,%0":"=r"(GuestRegs));
-		
-		asm volatile("movl 0x28(%%esp),%0":"=r"(GuestRegs->ebp));
-		
-		
-		
-		HvmEventCallback(Cpu,GuestRegs);
-		
-	
-		asm volatile("popl %eax");
-		asm volatile("popl %ecx");
-		asm volatile("popl %edx");
-		asm volatile("popl %ebx");
-		asm volatile("popl %ebp");
-		asm volatile("popl %ebp");
-		asm volatile("popl %esi");
-		asm volatile("popl %edi");
-
-
-
-        //vmx-resume
-		asm volatile(".byte 0x0f, 0x01, 0xC3");
-}		
+/**
+ * effects: Called by VmxVmexitHandler (vmx-asm.S) when VMRESUME fails, with the RFLAGS it
+ * left. The guest state can't be trusted any more, so report the error and stop.
+ */
+void ZVMAPI VmxResumeFailed (
+  PCPU Cpu,
+  uint32_t Rflags
+)
+{
+  if (Rflags & FL_ZF)
+    panic ("VmxResumeFailed(): CPU %d, VM instruction error %d\n", Cpu->ProcessorNumber,
+      VmxRead (VM_INSTRUCTION_ERROR));
+  panic ("VmxResumeFailed(): CPU %d, no current VMCS (RFLAGS 0x%x)\n", Cpu->ProcessorNumber, Rflags);
+}
 
 
 static bool ZVMAPI VmxIsNestedEvent (
@@ -510,7 +483,7 @@ static ZVMSTATUS VmxSetupVMCS (
   VmxWrite (HOST_IA32_SYSENTER_EIP, MsrRead (MSR_IA32_SYSENTER_EIP));
 
 //#ifdef _X86_
-  VmxWrite (HOST_RSP, g_HostStackBaseAddress + 0x0C00); //setup host sp at vmxLaunch(...)
+  VmxWrite (HOST_RSP, g_HostStackBaseAddress + VMX_HOST_STACK_CPU_SLOT); //setup host sp at vmxLaunch(...)
 //#else
   //VmxWrite (HOST_RSP, (uint64_t) Cpu);   //setup host sp at vmxLaunch(...)
 //#endif
@@ -656,7 +629,7 @@ static ZVMSTATUS ZVMAPI VmxVirtualize (
   ///cprintf ("GuestIp is 0x%x\n", VmxRead(GUEST_RIP));
   ///cprintf ("GuestSp is 0x%x\n", VmxRead(GUEST_RSP));
 
-  *((uint32_t *) (g_HostStackBaseAddress + 0x0C00)) = (uint32_t) Cpu;
+  *((uint32_t *) (g_HostStackBaseAddress + VMX_HOST_STACK_CPU_SLOT)) = (uint32_t) Cpu;
   
   ///cprintf("host rsp is 0x%x\n",g_HostStackBaseAddress + 0x0C00);
 
@@ -12,7 +12,9 @@
  *
  */
 
+#include <inc/arch/x86.h>
 #include "inc/vmx/vmxtraps.h"
+#include "inc/vmx/ioports.h"
 #include "inc/vmx/scancode.h"
 //#include "vmx.h"
 
@@ -369,6 +371,26 @@ static bool ZVMAPI VmxDispatchCpuid (
 //}
 
 
+static bool ZVMAPI VmxDispatchKbdData (
+  PCPU Cpu,
+  PGUEST_REGS GuestRegs,
+  uint32_t Port,
+  uint32_t Size,
+  bool In,
+  uint32_t * Value,
+  void *Context
+)
+{
+  if (!In)
+    return FALSE;
+
+  *Value = inb (Port);
+  // Sniffed keys are only printed while "iolog 0x60 on" is active
+  if (IoIsPortLogged (Port) && (*Value & 0xff) < 0x80)
+    cprintf ("sancode is %c\n", scancode[*Value & 0xff]);
+  return TRUE;
+}
+
 static bool ZVMAPI VmxDispatchIoAccess (
   PCPU Cpu,
   PGUEST_REGS GuestRegs,
@@ -376,55 +398,13 @@ static bool ZVMAPI VmxDispatchIoAccess (
   bool WillBeAlsoHandledByGuestHv
 )
 {
-  uint32_t exit_qualification;
-  uint32_t port, size;
-  uint32_t dir, df, vm86;
-  uint64_t inst_len;
-
   if (!Cpu || !GuestRegs)
     return TRUE;
 
-  inst_len = VmxRead (VM_EXIT_INSTRUCTION_LEN);
-  if (Trap->General.RipDelta == 0)
-    Trap->General.RipDelta = inst_len;
-
-  exit_qualification = (uint32_t) VmxRead (EXIT_QUALIFICATION);
-  init_scancode ();
-
-  if (CmIsBitSet (exit_qualification, 6))
-    port = (exit_qualification >> 16) & 0xFFFF;
-  else
-    port = ((uint32_t) (GuestRegs->edx)) & 0xffff;
-
-  size = (exit_qualification & 7) + 1;
-  dir = CmIsBitSet (exit_qualification, 3);     /* direction */
-  if (dir) {                    //in
-
-    GuestRegs->eax = CmIOIn (port);
-    //if (port == 0x64) {
-      //if (GuestRegs->eax & 0x20)
-        //ps2mode = 0x1;          //mouse
-      //else
-        //ps2mode = 0;            //mouse
-    //}ps2mode == 0x0 &&
-    if (port == 0x60 && (GuestRegs->eax & 0xff) < 0x80) {
-      cprintf ("IO 0x%x IN 0x%x \n", port, GuestRegs->eax); //scancode[GuestRegs->eax & 0xff]));
-	  cprintf ("sancode is %c\n",scancode[GuestRegs->eax & 0xff]);
-
-    }
-
-  } else {                      //out
-
-    if (size == 1)
-      CmIOOutB (port, (uint32_t) GuestRegs->eax);
-    if (size == 2)
-      CmIOOutW (port, (uint32_t) GuestRegs->eax);
-    if (size == 4)
-      CmIOOutD (port, (uint32_t) GuestRegs->eax);
-
-  }
+  // IN/OUT come in 1 and 2 byte encodings, so the length is taken on every exit
+  Trap->General.RipDelta = VmxRead (VM_EXIT_INSTRUCTION_LEN);
 
-  return TRUE;
+  return IoDispatchAccess (Cpu, GuestRegs, VmxRead (EXIT_QUALIFICATION));
 }
 //#endif
 
@@ -583,6 +563,12 @@ ZVMSTATUS ZVMAPI VmxRegisterTraps (
   }
   TrRegisterTrap (Cpu,Trap); 
 
+  init_scancode ();
+  if (!ZVM_SUCCESS (Status = IoRegisterPortHandler (0x60, 1, VmxDispatchKbdData, NULL, NULL)))
+  {
+	  cprintf ("VmxRegisterTraps(): Failed to register the keyboard port handler with status 0x%08x\n", Status);
+  }
+
   //if (!ZVM_SUCCESS (Status = TrInitializeGeneralTrap (Cpu, EXIT_REASON_MSR_READ, 0,      // length of the instruction, 0 means length need to be get from vmcs later. 
                                                      //VmxDispatchMsrRead, &Trap))) {
     //cprintf (("VmxRegisterTraps(): Failed to register VmxDispatchMsrRead with status 0x%08hX\n"));
@@ -135,76 +135,72 @@ static NTSTATUS NTAPI MmFindPageByHostVA (
   return STATUS_UNSUCCESSFUL;
 }
 
-static NTSTATUS NTAPI MmUpdatePageTable (
-  PVOID PageTable,
-  UCHAR PageTableLevel,
-  PVOID VirtualAddress,
+// Last table found at each level (1 = PT, 2 = PD, 3 = PDP), tagged with the VA bits above the range
+// the table covers. Consecutive mappings mostly share all their tables, so the walk starts at the
+// lowest level that hits instead of at the PML4. Tables are only freed by MmShutdownManager().
+typedef struct _PAGE_WALK_CACHE
+{
+  ULONG64 Tag;
+  PULONG64 PageTable;           // guest VA of the table, NULL if the entry is empty
+} PAGE_WALK_CACHE,
+ *PPAGE_WALK_CACHE;
+
+static PAGE_WALK_CACHE g_PageWalkCache[4];
+static PULONG64 g_Pml4Page;     // guest VA of the host PML4
+static KSPIN_LOCK g_PageWalkLock;       // serializes the table updates and the walk cache
+
+#define PAGE_WALK_SHIFT(PageTableLevel)	(12 + (PageTableLevel) * 9)
+#define PAGE_TABLE_INDEX(VirtualAddress, PageTableLevel) \
+	(((ULONG64) (VirtualAddress) >> (12 + ((PageTableLevel) - 1) * 9)) & 0x1ff)
+
+static ULONG64 NTAPI MmMakePageTableEntry (
   PHYSICAL_ADDRESS PhysicalAddress,
   BOOLEAN bLargePage
 )
+{
+  ULONG64 Entry;
+
+#ifdef SET_PCD_BIT
+  Entry = PhysicalAddress.QuadPart |    /*P_GLOBAL | */
+    P_WRITABLE | P_PRESENT | P_CACHE_DISABLED;
+#else
+  Entry = PhysicalAddress.QuadPart | /*P_GLOBAL | */ P_WRITABLE | P_PRESENT;
+#endif
+  if (bLargePage)
+    Entry |= P_LARGE;
+  return Entry;
+}
+
+static NTSTATUS NTAPI MmCreateMappingLocked (
+  PHYSICAL_ADDRESS PhysicalAddress,
+  PVOID VirtualAddress,
+  BOOLEAN bLargePage
+);
+
+/*
+ * Returns in *pLowerPageTable the guest VA of the table below PageTable[] for VirtualAddress,
+ * allocating and linking it if needed. *pLowerPageTable is NULL when the entry is a large PDE,
+ * which already maps VirtualAddress.
+ */
+static NTSTATUS NTAPI MmGetLowerPageTable (
+  PULONG64 PageTable,
+  UCHAR PageTableLevel,
+  PVOID VirtualAddress,
+  PULONG64 * pLowerPageTable
+)
 {
   ULONG64 PageTableOffset, GlobalOffset;
-  ULONG64 GlobalOffset1, GlobalOffset2, GlobalOffset3, GlobalOffset4;
   PVOID LowerPageTableHostVA, LowerPageTableGuestVA;
   PALLOCATED_PAGE LowerPageTable;
   PHYSICAL_ADDRESS LowerPageTablePA;
   NTSTATUS Status;
-  PHYSICAL_ADDRESS PagePA, l1, l2, l3;
 
-  PALLOCATED_PAGE Pml4e, Pdpe, Pde, Pte;
-
-  // get the offset in the specified page table level
-  PageTableOffset = (((ULONG64) VirtualAddress & (((ULONG64) 1) << (12 + PageTableLevel * 9))
-                      - 1) >> (12 + ((ULONG64) PageTableLevel - 1) * 9));
-
-  if ((PageTableLevel == 1) || (bLargePage && (PageTableLevel == 2))) {
-    // patch PTE/PDE
-/*
-		GlobalOffset=(((ULONG64)VirtualAddress & (((ULONG64)1)<<(12+4*9))-1)>>12);
-
-		GlobalOffset4=(((ULONG64)VirtualAddress & (((ULONG64)1)<<(12+4*9))-1)>>(12+(3)*9));
-		GlobalOffset3=(((ULONG64)VirtualAddress & (((ULONG64)1)<<(12+4*9))-1)>>(12+(2)*9));
-		GlobalOffset2=(((ULONG64)VirtualAddress & (((ULONG64)1)<<(12+4*9))-1)>>(12+(1)*9));
-		GlobalOffset1=(((ULONG64)VirtualAddress & (((ULONG64)1)<<(12+4*9))-1)>>(12+(0)*9));
-
-		MmFindPageByHostVA(GlobalOffset4*8+g_PageTableBases[3],&Pml4e);
-		MmFindPageByHostVA(GlobalOffset3*8+g_PageTableBases[2],&Pdpe);
-		MmFindPageByHostVA(GlobalOffset2*8+g_PageTableBases[1],&Pde);
-		MmFindPageByHostVA(GlobalOffset1*8+g_PageTableBases[0],&Pte);
-
-		DbgPrint("MmUpdatePageTable(): VA 0x%p: PML4E 0x%p, PDPE 0x%p, PDE 0x%p, PTE 0x%p\n",
-			VirtualAddress,
-			GlobalOffset4*8+g_PageTableBases[3],
-			GlobalOffset3*8+g_PageTableBases[2],
-			GlobalOffset2*8+g_PageTableBases[1],
-			GlobalOffset1*8+g_PageTableBases[0]);
-		DbgPrint("MmUpdatePageTable(): Guest: PML4E 0x%p, PDPE 0x%p, PDE 0x%p, PTE 0x%p\n",
-			(GlobalOffset4*8 & 0xfff) + (PUCHAR)Pml4e->GuestAddress,
-			(GlobalOffset3*8 & 0xfff) + (PUCHAR)Pdpe->GuestAddress,
-			(GlobalOffset2*8 & 0xfff) + (PUCHAR)Pde->GuestAddress,
-			(GlobalOffset1*8 & 0xfff) + (PUCHAR)Pte->GuestAddress);
-
-		DbgPrint("MmUpdatePageTable(): VA 0x%p, HPTE 0x%p, GPTE 0x%p, PA 0x%p\n",
-			VirtualAddress,
-			GlobalOffset*8+g_PageTableBases[0],
-			(PUCHAR)PageTable+8*PageTableOffset,
-			PhysicalAddress.QuadPart);
-*/
-
-#ifdef SET_PCD_BIT
-    ((PULONG64) PageTable)[PageTableOffset] = PhysicalAddress.QuadPart |        /*P_GLOBAL | */
-      P_WRITABLE | P_PRESENT | P_CACHE_DISABLED;
-#else
-    ((PULONG64) PageTable)[PageTableOffset] = PhysicalAddress.QuadPart | /*P_GLOBAL | */ P_WRITABLE | P_PRESENT;
-#endif
-    if (bLargePage)
-      ((PULONG64) PageTable)[PageTableOffset] |= P_LARGE;
-    return STATUS_SUCCESS;
-  }
+  *pLowerPageTable = NULL;
 
+  PageTableOffset = PAGE_TABLE_INDEX (VirtualAddress, PageTableLevel);
   GlobalOffset =
     (((ULONG64) VirtualAddress & (((ULONG64) 1) << (12 + 4 * 9)) - 1) >> (12 + ((ULONG64) PageTableLevel - 2) * 9));
-  LowerPageTablePA.QuadPart = ((PULONG64) PageTable)[PageTableOffset] & 0x000ffffffffff000;
+  LowerPageTablePA.QuadPart = PageTable[PageTableOffset] & 0x000ffffffffff000;
   LowerPageTableHostVA = GlobalOffset * 8 + g_PageTableBases[PageTableLevel - 2];
 
   if (!LowerPageTablePA.QuadPart) {
@@ -224,7 +220,7 @@ static NTSTATUS NTAPI MmUpdatePageTable (
                     LowerPageTableGuestVA, PAT_POOL, 1, AP_PAGETABLE | (1 << (PageTableLevel - 1)));
       if (!NT_SUCCESS (Status)) {
         DbgPrint
-          ("MmUpdatePageTable(): Failed to store page table level %d, MmSavePage() returned status 0x%08X\n",
+          ("MmGetLowerPageTable(): Failed to store page table level %d, MmSavePage() returned status 0x%08X\n",
            PageTableLevel - 1, Status);
         return Status;
       }
@@ -233,17 +229,13 @@ static NTSTATUS NTAPI MmUpdatePageTable (
       LowerPageTableGuestVA = LowerPageTable->GuestAddress;
     }
 
-#ifdef SET_PCD_BIT
-    ((PULONG64) PageTable)[PageTableOffset] = LowerPageTablePA.QuadPart |       /*P_GLOBAL | */
-      P_WRITABLE | P_PRESENT | P_CACHE_DISABLED;
-#else
-    ((PULONG64) PageTable)[PageTableOffset] = LowerPageTablePA.QuadPart | /*P_GLOBAL | */ P_WRITABLE | P_PRESENT;
-#endif
+    PageTable[PageTableOffset] = MmMakePageTableEntry (LowerPageTablePA, FALSE);
 
-    Status = MmCreateMapping (LowerPageTablePA, LowerPageTableHostVA, FALSE);
+    // the host sees its own page tables at their PT_BASE.. addresses
+    Status = MmCreateMappingLocked (LowerPageTablePA, LowerPageTableHostVA, FALSE);
     if (!NT_SUCCESS (Status)) {
       DbgPrint
-        ("MmUpdatePageTable(): MmCreateMapping() failed to map PA 0x%p with status 0x%08X\n",
+        ("MmGetLowerPageTable(): MmCreateMapping() failed to map PA 0x%p with status 0x%08X\n",
          LowerPageTablePA.QuadPart, Status);
       return Status;
     }
@@ -252,15 +244,15 @@ static NTSTATUS NTAPI MmUpdatePageTable (
 
     Status = MmFindPageByPA (LowerPageTablePA, &LowerPageTable);
     if (!NT_SUCCESS (Status)) {
-      LowerPageTablePA.QuadPart = ((PULONG64) PageTable)[PageTableOffset];
+      LowerPageTablePA.QuadPart = PageTable[PageTableOffset];
       if ((PageTableLevel == 2) && (LowerPageTablePA.QuadPart & P_LARGE)) {
 
-        DbgPrint ("MmUpdatePageTable(): Found large PDE, data 0x%p\n", LowerPageTablePA.QuadPart);
+        DbgPrint ("MmGetLowerPageTable(): Found large PDE, data 0x%p\n", LowerPageTablePA.QuadPart);
         return STATUS_SUCCESS;
 
       } else {
         DbgPrint
-          ("MmUpdatePageTable(): Failed to find lower page table (pl%d) guest VA, data 0x%p, status 0x%08X\n",
+          ("MmGetLowerPageTable(): Failed to find lower page table (pl%d) guest VA, data 0x%p, status 0x%08X\n",
            PageTableLevel - 1, LowerPageTablePA.QuadPart, Status);
         return Status;
       }
@@ -269,7 +261,149 @@ static NTSTATUS NTAPI MmUpdatePageTable (
     LowerPageTableGuestVA = LowerPageTable->GuestAddress;
   }
 
-  return MmUpdatePageTable (LowerPageTableGuestVA, PageTableLevel - 1, VirtualAddress, PhysicalAddress, bLargePage);
+  *pLowerPageTable = LowerPageTableGuestVA;
+  return STATUS_SUCCESS;
+}
+
+/*
+ * Returns in *pPageTable the guest VA of the level PageTableLevel table that maps VirtualAddress,
+ * creating the missing tables on the way. NULL means a large PDE already maps it.
+ * Must be called with g_PageWalkLock held.
+ */
+static NTSTATUS NTAPI MmFindPageTable (
+  PVOID VirtualAddress,
+  UCHAR PageTableLevel,
+  PULONG64 * pPageTable
+)
+{
+  PULONG64 PageTable, LowerPageTable;
+  UCHAR Level;
+  NTSTATUS Status;
+
+  *pPageTable = NULL;
+  if (!g_Pml4Page)
+    return STATUS_UNSUCCESSFUL;
+
+  for (Level = PageTableLevel; Level < 4; Level++)
+    if (g_PageWalkCache[Level].PageTable
+        && g_PageWalkCache[Level].Tag == (ULONG64) VirtualAddress >> PAGE_WALK_SHIFT (Level))
+      break;
+  PageTable = Level < 4 ? g_PageWalkCache[Level].PageTable : g_Pml4Page;
+
+  for (; Level > PageTableLevel; Level--) {
+    Status = MmGetLowerPageTable (PageTable, Level, VirtualAddress, &LowerPageTable);
+    if (!NT_SUCCESS (Status) || !LowerPageTable)
+      return Status;
+    PageTable = LowerPageTable;
+
+    g_PageWalkCache[Level - 1].Tag = (ULONG64) VirtualAddress >> PAGE_WALK_SHIFT (Level - 1);
+    g_PageWalkCache[Level - 1].PageTable = PageTable;
+  }
+
+  *pPageTable = PageTable;
+  return STATUS_SUCCESS;
+}
+
+static NTSTATUS NTAPI MmCreateMappingLocked (
+  PHYSICAL_ADDRESS PhysicalAddress,
+  PVOID VirtualAddress,
+  BOOLEAN bLargePage
+)
+{
+  PULONG64 PageTable;
+  UCHAR PageTableLevel = bLargePage ? 2 : 1;
+  NTSTATUS Status;
+
+  PhysicalAddress.QuadPart = PhysicalAddress.QuadPart & 0x000ffffffffff000;
+  VirtualAddress = (PVOID) ((ULONG64) VirtualAddress & 0xfffffffffffff000);
+
+  Status = MmFindPageTable (VirtualAddress, PageTableLevel, &PageTable);
+  if (!NT_SUCCESS (Status) || !PageTable)
+    return Status;
+
+  PageTable[PAGE_TABLE_INDEX (VirtualAddress, PageTableLevel)] = MmMakePageTableEntry (PhysicalAddress, bLargePage);
+
+  // a large PDE replaces the PT it pointed to
+  if (bLargePage && g_PageWalkCache[1].Tag == (ULONG64) VirtualAddress >> PAGE_WALK_SHIFT (1))
+    g_PageWalkCache[1].PageTable = NULL;
+  return STATUS_SUCCESS;
+}
+
+/*
+ * Maps uNumberOfPages 4k pages from FirstPage on, a whole PT at a time. With bContiguous the pages
+ * are backed by the physical range starting at PhysicalAddress, otherwise by whatever
+ * MmGetPhysicalAddress() finds for each of them.
+ */
+static NTSTATUS NTAPI MmMapPages (
+  PVOID FirstPage,
+  ULONG uNumberOfPages,
+  PHYSICAL_ADDRESS PhysicalAddress,
+  BOOLEAN bContiguous
+)
+{
+  PULONG64 PageTable;
+  ULONG i, uPagesInTable;
+  NTSTATUS Status = STATUS_SUCCESS;
+  KIRQL OldIrql;
+
+  FirstPage = (PVOID) ((ULONG64) FirstPage & 0xfffffffffffff000);
+  PhysicalAddress.QuadPart = PhysicalAddress.QuadPart & 0x000ffffffffff000;
+
+  KeAcquireSpinLock (&g_PageWalkLock, &OldIrql);
+
+  while (uNumberOfPages) {
+
+    i = (ULONG) PAGE_TABLE_INDEX (FirstPage, 1);
+    uPagesInTable = min (uNumberOfPages, 0x200 - i);
+
+    Status = MmFindPageTable (FirstPage, 1, &PageTable);
+    if (!NT_SUCCESS (Status))
+      break;
+
+    // PageTable is NULL if a large PDE already covers these pages
+    for (; PageTable && i < 0x200 && uPagesInTable; i++) {
+      if (!bContiguous)
+        PhysicalAddress = MmGetPhysicalAddress (FirstPage);
+      PageTable[i] = MmMakePageTableEntry (PhysicalAddress, FALSE);
+
+      FirstPage = (PVOID) ((PUCHAR) FirstPage + PAGE_SIZE);
+      PhysicalAddress.QuadPart += PAGE_SIZE;
+      uPagesInTable--;
+      uNumberOfPages--;
+    }
+
+    if (!PageTable) {
+      FirstPage = (PVOID) ((PUCHAR) FirstPage + uPagesInTable * PAGE_SIZE);
+      PhysicalAddress.QuadPart += uPagesInTable * PAGE_SIZE;
+      uNumberOfPages -= uPagesInTable;
+    }
+  }
+
+  KeReleaseSpinLock (&g_PageWalkLock, OldIrql);
+  return Status;
+}
+NTSTATUS NTAPI MmCreateMapping (
+  PHYSICAL_ADDRESS PhysicalAddress,
+  PVOID VirtualAddress,
+  BOOLEAN bLargePage
+)
+{
+  NTSTATUS Status;
+  KIRQL OldIrql;
+
+  KeAcquireSpinLock (&g_PageWalkLock, &OldIrql);
+  Status = MmCreateMappingLocked (PhysicalAddress, VirtualAddress, bLargePage);
+  KeReleaseSpinLock (&g_PageWalkLock, OldIrql);
+  return Status;
+}
+
+NTSTATUS NTAPI MmCreateMappingRange (
+  PHYSICAL_ADDRESS PhysicalAddress,
+  PVOID VirtualAddress,
+  ULONG uNumberOfPages
+)
+{
+  return MmMapPages (VirtualAddress, uNumberOfPages, PhysicalAddress, TRUE);
 }
 
 PVOID NTAPI MmAllocatePages (
@@ -295,7 +429,6 @@ PVOID NTAPI MmAllocatePages (
 
   for (i = 0; i < uNumberOfPages; i++) {
 
-    // map to the same addresses in the host pagetables as they are in guest's
     PagePA = MmGetPhysicalAddress (PageVA);
     Status = MmSavePage (PagePA, PageVA, PageVA, !i ? PAT_POOL : PAT_DONT_FREE, uNumberOfPages, 0);
     if (!NT_SUCCESS (Status)) {
@@ -303,16 +436,17 @@ PVOID NTAPI MmAllocatePages (
       return NULL;
     }
 
-    Status = MmCreateMapping (PagePA, PageVA, FALSE);
-    if (!NT_SUCCESS (Status)) {
-      DbgPrint
-        ("MmAllocatePages(): MmCreateMapping() failed to map PA 0x%p with status 0x%08X\n", PagePA.QuadPart, Status);
-      return NULL;
-    }
-
     PageVA = (PUCHAR) PageVA + PAGE_SIZE;
   }
 
+  // map to the same addresses in the host pagetables as they are in guest's
+  PagePA.QuadPart = 0;
+  Status = MmMapPages (FirstPage, uNumberOfPages, PagePA, FALSE);
+  if (!NT_SUCCESS (Status)) {
+    DbgPrint ("MmAllocatePages(): MmMapPages() failed to map VA 0x%p with status 0x%08X\n", FirstPage, Status);
+    return NULL;
+  }
+
   return FirstPage;
 }
 
@@ -345,26 +479,26 @@ PVOID NTAPI MmAllocateContiguousPages (
 
   for (i = 0; i < uNumberOfPages; i++) {
 
-    // map to the same addresses in the host pagetables as they are in guest's
-
     Status = MmSavePage (PagePA, PageVA, PageVA, !i ? PAT_CONTIGUOUS : PAT_DONT_FREE, uNumberOfPages, 0);
     if (!NT_SUCCESS (Status)) {
       DbgPrint ("MmAllocateContiguousPages(): MmSavePage() failed with status 0x%08X\n", Status);
       return NULL;
     }
 
-    Status = MmCreateMapping (PagePA, PageVA, FALSE);
-    if (!NT_SUCCESS (Status)) {
-      DbgPrint
-        ("MmAllocateContiguousPages(): MmCreateMapping() failed to map PA 0x%p with status 0x%08X\n",
-         PagePA.QuadPart, Status);
-      return NULL;
-    }
-
     PageVA = (PUCHAR) PageVA + PAGE_SIZE;
     PagePA.QuadPart += PAGE_SIZE;
   }
 
+  // map to the same addresses in the host pagetables as they are in guest's
+  PagePA = MmGetPhysicalAddress (FirstPage);
+  Status = MmCreateMappingRange (PagePA, FirstPage, uNumberOfPages);
+  if (!NT_SUCCESS (Status)) {
+    DbgPrint
+      ("MmAllocateContiguousPages(): MmCreateMappingRange() failed to map PA 0x%p with status 0x%08X\n",
+       PagePA.QuadPart, Status);
+    return NULL;
+  }
+
   return FirstPage;
 }
 
@@ -398,47 +532,27 @@ PVOID NTAPI MmAllocateContiguousPagesSpecifyCache (
 
   for (i = 0; i < uNumberOfPages; i++) {
 
-    // map to the same addresses in the host pagetables as they are in guest's
-
     Status = MmSavePage (PagePA, PageVA, PageVA, !i ? PAT_CONTIGUOUS : PAT_DONT_FREE, uNumberOfPages, 0);
     if (!NT_SUCCESS (Status)) {
       DbgPrint ("MmAllocateContiguousPages(): MmSavePage() failed with status 0x%08X\n", Status);
       return NULL;
     }
 
-    Status = MmCreateMapping (PagePA, PageVA, FALSE);
-    if (!NT_SUCCESS (Status)) {
-      DbgPrint
-        ("MmAllocateContiguousPages(): MmCreateMapping() failed to map PA 0x%p with status 0x%08X\n",
-         PagePA.QuadPart, Status);
-      return NULL;
-    }
-
     PageVA = (PUCHAR) PageVA + PAGE_SIZE;
     PagePA.QuadPart += PAGE_SIZE;
   }
 
-  return FirstPage;
-}
-
-NTSTATUS NTAPI MmCreateMapping (
-  PHYSICAL_ADDRESS PhysicalAddress,
-  PVOID VirtualAddress,
-  BOOLEAN bLargePage
-)
-{
-  PALLOCATED_PAGE Pml4Page;
-  NTSTATUS Status;
-
-  Status = MmFindPageByPA (g_PageMapBasePhysicalAddress, &Pml4Page);
+  // map to the same addresses in the host pagetables as they are in guest's
+  PagePA = MmGetPhysicalAddress (FirstPage);
+  Status = MmCreateMappingRange (PagePA, FirstPage, uNumberOfPages);
   if (!NT_SUCCESS (Status)) {
-    return STATUS_UNSUCCESSFUL;
+    DbgPrint
+      ("MmAllocateContiguousPages(): MmCreateMappingRange() failed to map PA 0x%p with status 0x%08X\n",
+       PagePA.QuadPart, Status);
+    return NULL;
   }
 
-  PhysicalAddress.QuadPart = PhysicalAddress.QuadPart & 0x000ffffffffff000;
-  VirtualAddress = (PVOID) ((ULONG64) VirtualAddress & 0xfffffffffffff000);
-
-  return MmUpdatePageTable (Pml4Page->GuestAddress, 4, VirtualAddress, PhysicalAddress, bLargePage);
+  return FirstPage;
 }
 
 NTSTATUS NTAPI MmMapGuestPages (
@@ -449,21 +563,13 @@ NTSTATUS NTAPI MmMapGuestPages (
   PHYSICAL_ADDRESS PhysicalAddress;
   NTSTATUS Status;
 
-  FirstPage = (PVOID) ((ULONG64) FirstPage & 0xfffffffffffff000);
-
   // Everything is made present, writable, executable, 4kb and cpl0 only.
   // Mapping is done to the same virtual addresses in the host.
-  while (uNumberOfPages--) {
-
-    // Guest memory may not be contiguous   
-    PhysicalAddress = MmGetPhysicalAddress (FirstPage);
-
-    if (!NT_SUCCESS (Status = MmCreateMapping (PhysicalAddress, FirstPage, FALSE))) {
-      DbgPrint ("MmMapGuestPages(): MmCreateMapping() failed with status 0x%08X\n", Status);
-      return Status;
-    }
-
-    FirstPage = (PVOID) ((PUCHAR) FirstPage + PAGE_SIZE);
+  // Guest memory may not be contiguous, MmMapPages() translates page by page.
+  PhysicalAddress.QuadPart = 0;
+  if (!NT_SUCCESS (Status = MmMapPages (FirstPage, uNumberOfPages, PhysicalAddress, FALSE))) {
+    DbgPrint ("MmMapGuestPages(): MmMapPages() failed with status 0x%08X\n", Status);
+    return Status;
   }
 
   return STATUS_SUCCESS;
@@ -476,7 +582,6 @@ NTSTATUS NTAPI MmWalkGuestPageTable (
 {
   ULONG64 i;
   PVOID VirtualAddress;
-  PUCHAR ShortPageVA;
   PHYSICAL_ADDRESS PhysicalAddress;
   PULONG64 LowerPageTable;
 
@@ -512,10 +617,8 @@ NTSTATUS NTAPI MmWalkGuestPageTable (
            "LARGE" : "");
 
         if (bLevel == 2) {
-          for (ShortPageVA = (PUCHAR) VirtualAddress + 0x0 * PAGE_SIZE;
-               ShortPageVA < (PUCHAR) VirtualAddress + 0x200 * PAGE_SIZE;
-               ShortPageVA += PAGE_SIZE, PhysicalAddress.QuadPart += PAGE_SIZE)
-            MmCreateMapping (PhysicalAddress, ShortPageVA, FALSE);
+          // split the large page into a whole PT
+          MmCreateMappingRange (PhysicalAddress, VirtualAddress, 0x200);
         } else
           MmCreateMapping (PhysicalAddress, VirtualAddress, FALSE);
       }
@@ -612,6 +715,8 @@ NTSTATUS NTAPI MmInitManager (
 
   InitializeListHead (&g_PageTableList);
   KeInitializeSpinLock (&g_PageTableListLock);
+  KeInitializeSpinLock (&g_PageWalkLock);
+  RtlZeroMemory (g_PageWalkCache, sizeof (g_PageWalkCache));
 
   Pml4Page = ExAllocatePoolWithTag (NonPagedPool, PAGE_SIZE, ITL_TAG);
   if (!Pml4Page)
@@ -626,6 +731,7 @@ NTSTATUS NTAPI MmInitManager (
     DbgPrint ("MmInitManager(): MmSavePage() failed to save PML4 page, status 0x%08X\n", Status);
     return Status;
   }
+  g_Pml4Page = Pml4Page;
 
   if (!NT_SUCCESS (Status = MmCreateMapping (g_PageMapBasePhysicalAddress, (PVOID) PML4_BASE, FALSE))) {
     DbgPrint ("MmInitManager(): MmCreateMapping() failed to map PML4 page, status 0x%08X\n", Status);
@@ -642,6 +748,9 @@ NTSTATUS NTAPI MmShutdownManager (
   ULONG i;
   PULONG64 Entry;
 
+  g_Pml4Page = NULL;
+  RtlZeroMemory (g_PageWalkCache, sizeof (g_PageWalkCache));
+
   while (AllocatedPage = (PALLOCATED_PAGE) ExInterlockedRemoveHeadList (&g_PageTableList, &g_PageTableListLock)) {
 
     AllocatedPage = CONTAINING_RECORD (AllocatedPage, ALLOCATED_PAGE, le);
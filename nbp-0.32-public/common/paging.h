@@ -53,6 +53,13 @@ NTSTATUS NTAPI MmCreateMapping (
   BOOLEAN bLargePage
 );
 
+// Maps uNumberOfPages 4k pages of the physical range at PhysicalAddress, a PT at a time
+NTSTATUS NTAPI MmCreateMappingRange (
+  PHYSICAL_ADDRESS PhysicalAddress,
+  PVOID VirtualAddress,
+  ULONG uNumberOfPages
+);
+
 PVOID NTAPI MmAllocateContiguousPages (
   ULONG uNumberOfPages,
   PPHYSICAL_ADDRESS pFirstPagePA